@@ -47,6 +47,17 @@
 #define NPF_DISABLE_LOOPBACK	1	///< Drop the packets sent by the NPF driver
 #define NPF_ENABLE_LOOPBACK		2	///< Capture the packets sent by the NPF driver
 
+// Flags of PacketOpenAdapterEx()
+#define PACKET_OPEN_UNORDERED	1	///< PacketReceivePacket() returns the packets of each CPU in runs, each with a bpf_cpu_hdr
+
+#ifndef NPF_FANOUT_NONE
+// Modes of PacketSetFanout(), the same in win_fanout.h
+#define NPF_FANOUT_NONE			0	///< Leaves the fanout group
+#define NPF_FANOUT_HASH			1	///< The member is chosen by the hash of the flow of the packet, the same in both directions
+#define NPF_FANOUT_LB			2	///< The members get the packets in turn
+#define NPF_FANOUT_CPU			3	///< The member is chosen by the CPU that taps the packet
+#endif
+
 /*!
   \brief Network type structure.
 
@@ -105,6 +116,42 @@ struct bpf_stat
 	///< thus reach the application.
 };
 
+/*!
+  \brief Counters of an instruction of the kernel filter.
+
+  They are updated while the profiling of the filter is enabled with PacketSetProfiling().
+*/
+struct bpf_profile_counter
+{
+	ULONGLONG executed;	///< Number of times the instruction ran.
+	ULONGLONG accepted;	///< Number of packets accepted by the instruction, a return of a value other than 0.
+	ULONGLONG rejected;	///< Number of packets rejected by the instruction: a return of 0, or a load out of the
+	///< packet or a division by zero.
+};
+
+/*!
+  \brief Profile of the kernel filter.
+
+  It is returned by PacketGetFilterProfile(), followed by bp_len bpf_profile_insn structures.
+*/
+struct bpf_profile
+{
+	UINT bp_len;			///< Number of instructions of the installed filter, 0 if there is none or if the profiling
+	///< is disabled.
+	UINT bp_reserved;
+	ULONGLONG bp_packets;	///< Number of packets run through the filter since the profiling was enabled or the filter
+	///< installed.
+};
+
+/*!
+  \brief An instruction of the kernel filter as installed (i.e. optimized), with its counters.
+*/
+struct bpf_profile_insn
+{
+	struct bpf_insn bp_insn;				///< The instruction.
+	struct bpf_profile_counter bp_counter;	///< Its counters.
+};
+
 /*!
   \brief Packet header.
 
@@ -124,6 +171,18 @@ struct bpf_hdr
 	///< of the packet.
 };
 
+/*!
+  \brief Header of the packets received on an adapter opened with PACKET_OPEN_UNORDERED.
+
+  The packets of a CPU come in the order in which they arrived, but those of the different CPUs are not merged:
+  a buffer holds runs of packets of one CPU each. bh_hdrlen covers the index of the CPU.
+*/
+struct bpf_cpu_hdr
+{
+	struct bpf_hdr header;	///< The bpf header, with bh_hdrlen set to the size of this structure.
+	UINT cpu;				///< The CPU that received the packet.
+};
+
 /*!
   \brief Dump packet header.
 
@@ -143,7 +202,181 @@ struct dump_bpf_hdr
 
 #endif
 
+#ifndef BPF_AD_OFF
+/*
+ * Ancillary loads of the kernel filter: an absolute load (BPF_LD|BPF_ABS) at BPF_AD_OFF plus one
+ * of the offsets below reads that metadata of the packet, whole, instead of bytes of the packet.
+ */
+#define BPF_AD_OFF				0xfffff000	///< Start of the ancillary area, like SKF_AD_OFF in Linux
+#define BPF_AD_VLAN_TAG			0			///< The 802.1Q tag control information stripped by the adapter
+#define BPF_AD_VLAN_TAG_PRESENT	4			///< 1 if the packet came with a VLAN tag in its out-of-band data
+#define BPF_AD_DIRECTION		8			///< BPF_DIRECTION_IN or BPF_DIRECTION_OUT
+#define BPF_AD_RSS_HASH			12			///< The RSS hash computed by the adapter, 0 if there is none
+#define BPF_AD_CPU				16			///< The processor that taps the packet
+#define BPF_AD_PHY				20			///< The 802.11 PHY type of a received frame, 0 if unknown
+
+#define BPF_DIRECTION_IN		0			///< A packet received from the network
+#define BPF_DIRECTION_OUT		1			///< A packet sent by this host
+#endif
+
+#ifndef BPF_MATCH
+/*
+ * Multi-pattern search: BPF_MISC|BPF_MATCH sets A to 1 plus the index of the first pattern of the set k
+ * found in the A bytes of the packet at X, or to 0. The sets are installed with PacketAddPatternSet(),
+ * whose image is a struct bpf_match_header followed by the patterns, each a UINT length and its bytes,
+ * padded to a multiple of 4 bytes.
+ */
+#define BPF_MATCH				0x40		///< With BPF_MISC
+#define BPF_MATCH_MAX_SETS		32			///< Number of sets installed at once on the driver
+#define BPF_MATCH_MAX_PATTERNS	4096		///< Maximum number of patterns of a set
+#define BPF_MATCH_MAX_LENGTH	256			///< Maximum length of a pattern, in bytes
+#define BPF_MATCH_NOCASE		1			///< The ASCII letters of the patterns match both cases
+
+/*!
+  \brief Header of the image of a pattern set.
+*/
+struct bpf_match_header
+{
+	UINT count;			///< Number of patterns.
+	UINT flags;			///< BPF_MATCH_NOCASE or 0.
+};
+#endif
+
+#ifndef EBPF_MAGIC
+/*
+ * Extended programs, installed with PacketSetExtendedBpf(): a struct ebpf_program_header, the nmaps
+ * struct ebpf_map_def of the maps of the program, then its len struct ebpf_insn. The instructions
+ * have the encoding of the Linux eBPF ones; the helpers below are the only ones.
+ */
+#define EBPF_MAGIC				0x46504245	///< "EBPF"
+
+#define EBPF_FUNC_MAP_LOOKUP	1			///< Copies the value of the key R2 to R3; R0 is 1 if the key was found
+#define EBPF_FUNC_MAP_UPDATE	2			///< Sets the value of the key R2 to R3; R0 is 0, or -1 if the map is full
+#define EBPF_FUNC_MAP_DELETE	3			///< Removes the key R2 from a hash map; R0 is 0, or -1 if it was not there
+#define EBPF_FUNC_MAP_ADD		4			///< Adds R3 to the first 64 bits of the value of the key R2
+
+#define EBPF_MAP_HASH			1			///< A hash table of up to max_entries keys
+#define EBPF_MAP_ARRAY			2			///< max_entries values, the key being their 32-bit index
+
+/*!
+  \brief An instruction of an extended program.
+*/
+struct ebpf_insn
+{
+	UCHAR code;		///< Class, operation and source, as in the classic instructions.
+	UCHAR regs;		///< The destination register in the low 4 bits, the source one in the high 4 bits.
+	SHORT off;		///< Offset of the memory accesses and of the jumps.
+	INT imm;		///< Immediate operand.
+};
+
+/*!
+  \brief A map of an extended program.
+*/
+struct ebpf_map_def
+{
+	UINT type;			///< EBPF_MAP_HASH or EBPF_MAP_ARRAY.
+	UINT key_size;		///< Size of the keys in bytes, 4 for an array.
+	UINT value_size;	///< Size of the values in bytes.
+	UINT max_entries;	///< Maximum number of keys of a hash map, number of values of an array.
+};
+
+/*!
+  \brief Header of the image of an extended program.
+*/
+struct ebpf_program_header
+{
+	UINT magic;			///< EBPF_MAGIC.
+	UINT nmaps;			///< Number of ebpf_map_def following the header.
+	UINT len;			///< Number of ebpf_insn following the maps.
+	UINT reserved;		///< Must be 0.
+};
+
+/*!
+  \brief The content of a map, returned by PacketGetMap(), followed by records made of a key and of its value.
+*/
+struct ebpf_map_info
+{
+	struct ebpf_map_def def;	///< The map as declared by the program.
+	UINT count;					///< Number of keys in the map.
+	UINT reserved;
+};
+#endif
+
+#ifndef NPF_RING_MAGIC
+/*
+ * The capture ring, mapped in the application by PacketMapRing(): the npf_ring_header, the
+ * npf_ring_index of each CPU, then the nblocks blocks of each CPU. A block is a struct
+ * npf_ring_block followed by its packets, each a struct npf_ring_packet and its bh_caplen bytes.
+ * PacketGetNextBlock() gives the closed blocks in turn, PacketReleaseBlock() gives them back to the driver.
+ */
+#define NPF_RING_MAGIC			0x474e4952	///< "RING"
+
+#define NPF_RING_ALIGNMENT		8			///< Alignment of the packets in a block
+#define NPF_RING_MIN_BLOCK		4096		///< Minimum size of a block, in bytes
+#define NPF_RING_MAX_BLOCK		0x400000	///< Maximum size of a block, in bytes
+#define NPF_RING_MAX_BLOCKS		4096		///< Maximum number of blocks of each CPU
+
+#define NPF_RING_BLOCK_KERNEL	0			///< The block is free, or being filled by the driver
+#define NPF_RING_BLOCK_USER		1			///< The block holds packets for the application
+
+/*!
+  \brief Start of the ring.
+*/
+struct npf_ring_header
+{
+	UINT magic;			///< NPF_RING_MAGIC.
+	UINT ncpu;			///< Number of CPUs, each with its npf_ring_index and its blocks.
+	UINT block_size;	///< Size of a block, in bytes.
+	UINT nblocks;		///< Number of blocks of each CPU.
+	UINT index_offset;	///< Offset of the array of the ncpu npf_ring_index from the start of the ring.
+	UINT blocks_offset;	///< Offset of the blocks from the start of the ring, those of CPU 0 first.
+	UINT next_cpu;		///< Written by the application only: the CPU whose blocks it looks at first.
+	UINT reserved;
+};
+
+/*!
+  \brief The indexes of the blocks of a CPU: the blocks from consumer to producer wait for the application.
+*/
+struct npf_ring_index
+{
+	volatile UINT producer;	///< Written by the driver: number of blocks closed.
+	UINT reserved1[15];
+	volatile UINT consumer;	///< Written by the application: number of blocks taken.
+	UINT reserved2[15];
+};
+
+/*!
+  \brief Header of a block.
+*/
+struct npf_ring_block
+{
+	volatile UINT status;	///< NPF_RING_BLOCK_KERNEL or NPF_RING_BLOCK_USER.
+	UINT cpu;				///< The CPU of the block.
+	UINT seq;				///< Number of the block among the blocks closed on its CPU.
+	UINT packets;			///< Number of packets in the block.
+	UINT length;			///< Bytes used in the block, this header included.
+	UINT first;				///< Offset of the first packet from the start of the block.
+};
+
+/*!
+  \brief Header of a packet in a block, followed by its bh_caplen bytes.
+*/
+struct npf_ring_packet
+{
+	UINT next;				///< Offset of the next packet of the block from this one, 0 for the last one.
+	UINT reserved;
+	ULONGLONG stamp;		///< Performance counter when the packet was stored: the order of the packets of all the CPUs.
+							///< 0 if the adapter was opened unordered.
+	struct bpf_hdr header;	///< The bpf header, as returned by PacketReceivePacket().
+};
+
+#define NPF_RING_FIRST_PACKET(_block)	((struct npf_ring_packet*)((UCHAR*)(_block) + (_block)->first))
+#define NPF_RING_NEXT_PACKET(_packet)	((_packet)->next != 0 ? (struct npf_ring_packet*)((UCHAR*)(_packet) + (_packet)->next) : NULL)
+#define NPF_RING_PACKET_DATA(_packet)	((UCHAR*)((_packet) + 1))
+#endif
+
 struct bpf_stat;
+struct bpf_profile;
 
 #define 	   DOSNAMEPREFIX   TEXT("Packet_")	///< Prefix added to the adapters device names to create the WinPcap devices
 #define 	   MAX_LINK_NAME_LENGTH	64			//< Maximum length of the devices symbolic links
@@ -278,6 +511,16 @@ extern "C"
 	INT PacketSetSnapLen(LPADAPTER AdapterObject, int snaplen);
 	BOOLEAN PacketGetStats(LPADAPTER AdapterObject, struct bpf_stat* s);
 	BOOLEAN PacketGetStatsEx(LPADAPTER AdapterObject, struct bpf_stat* s);
+	BOOLEAN PacketSetProfiling(LPADAPTER AdapterObject, BOOLEAN enable);
+	BOOLEAN PacketGetFilterProfile(LPADAPTER AdapterObject, struct bpf_profile* profile, UINT size);
+	BOOLEAN PacketSetExtendedBpf(LPADAPTER AdapterObject, struct ebpf_program_header* program, UINT size);
+	BOOLEAN PacketGetMap(LPADAPTER AdapterObject, UINT index, struct ebpf_map_info* info, UINT size);
+	BOOLEAN PacketAddPatternSet(LPADAPTER AdapterObject, struct bpf_match_header* set, UINT size, PUINT id);
+	BOOLEAN PacketDeletePatternSet(LPADAPTER AdapterObject, UINT id);
+	BOOLEAN PacketMapRing(LPADAPTER AdapterObject, UINT blockSize, UINT blockCount, struct npf_ring_header** ring);
+	struct npf_ring_block* PacketGetNextBlock(LPADAPTER AdapterObject, struct npf_ring_header* ring);
+	VOID PacketReleaseBlock(LPADAPTER AdapterObject, struct npf_ring_block* block);
+	BOOLEAN PacketSetFanout(LPADAPTER AdapterObject, UINT id, UINT mode);
 	BOOLEAN PacketSetBuff(LPADAPTER AdapterObject, int dim);
 	BOOLEAN PacketGetNetType(LPADAPTER AdapterObject, NetType* type);
 	BOOLEAN PacketIsLoopbackAdapter(PCHAR AdapterName);
@@ -285,6 +528,7 @@ extern "C"
 	int PacketSetMonitorMode(PCHAR AdapterName, int mode);
 	int PacketGetMonitorMode(PCHAR AdapterName);
 	LPADAPTER PacketOpenAdapter(PCHAR AdapterName);
+	LPADAPTER PacketOpenAdapterEx(PCHAR AdapterName, UINT Flags);
 	BOOLEAN PacketSendPacket(LPADAPTER AdapterObject, LPPACKET pPacket, BOOLEAN Sync);
 	INT PacketSendPackets(LPADAPTER AdapterObject, PVOID PacketBuff, ULONG Size, BOOLEAN Sync);
 	LPPACKET PacketAllocatePacket(void);
@@ -815,7 +815,7 @@ static BOOLEAN PacketAddAdapterIPH(PIP_ADAPTER_INFO IphAd)
 	{
 
 		TRACE_PRINT1("Trying to open adapter %hs to see if it's available...", TName);
-		adapter = PacketOpenAdapterNPF(TName);
+		adapter = PacketOpenAdapterNPF(TName, 0);
 
 		if(adapter == NULL)
 		{
@@ -1043,7 +1043,7 @@ static BOOLEAN PacketAddAdapterNPF(PCHAR AdName, UINT flags)
  		TRACE_PRINT("Trying to open the NPF adapter and see if it's available...");
 
 		// Try to Open the adapter
-		adapter = PacketOpenAdapterNPF(AdName);
+		adapter = PacketOpenAdapterNPF(AdName, 0);
 
 		if(adapter != NULL)
 		{
@@ -1864,12 +1864,13 @@ BOOL PacketStartService()
 /*!
   \brief Opens an adapter using the NPF device driver.
   \param AdapterName A string containing the name of the device to open.
+  \param Flags The PACKET_OPEN_* flags, see PacketOpenAdapterEx().
   \return If the function succeeds, the return value is the pointer to a properly initialized ADAPTER object,
    otherwise the return value is NULL.
 
   \note internal function used by PacketOpenAdapter() and AddAdapter()
 */
-LPADAPTER PacketOpenAdapterNPF(PCHAR AdapterNameA)
+LPADAPTER PacketOpenAdapterNPF(PCHAR AdapterNameA, UINT Flags)
 {
 	DWORD error;
     LPADAPTER lpAdapter;
@@ -1930,6 +1931,12 @@ LPADAPTER PacketOpenAdapterNPF(PCHAR AdapterNameA)
 	if (strlen(AdapterNameA) > strlen(DEVICE_PREFIX))
 	{
 		StringCchPrintfA(SymbolicLinkA, MAX_PATH, "\\\\.\\Global\\%s", AdapterNameA + strlen(DEVICE_PREFIX));
+
+		// The driver gets the flags in the name of the file it opens
+		if (Flags & PACKET_OPEN_UNORDERED)
+		{
+			StringCchCatA(SymbolicLinkA, MAX_PATH, NPF_OPEN_UNORDERED_SUFFIX);
+		}
 	}
 	else
 	{
@@ -2164,6 +2171,20 @@ BOOL PacketStopDriver60()
    otherwise the return value is NULL.
 */
 LPADAPTER PacketOpenAdapter(PCHAR AdapterNameWA)
+{
+	return PacketOpenAdapterEx(AdapterNameWA, 0);
+}
+
+/*!
+  \brief Opens an adapter, with flags that change how the driver delivers the packets.
+  \param AdapterName A string containing the name of the device to open.
+  \param Flags 0, or PACKET_OPEN_UNORDERED: PacketReceivePacket() returns the packets in runs of packets of one
+   CPU each, each packet with a bpf_cpu_hdr, instead of all of them in the order in which they arrived. The driver
+   neither stamps the packets nor merges the CPUs, for the applications that sort or partition the packets themselves.
+  \return If the function succeeds, the return value is the pointer to a properly initialized ADAPTER object,
+   otherwise the return value is NULL.
+*/
+LPADAPTER PacketOpenAdapterEx(PCHAR AdapterNameWA, UINT Flags)
 {
     LPADAPTER lpAdapter = NULL;
 	PCHAR AdapterNameA = NULL;
@@ -2299,7 +2320,7 @@ LPADAPTER PacketOpenAdapter(PCHAR AdapterNameWA)
 		// the end of this big function!
 		//
 		TRACE_PRINT("Normal NPF adapter, trying to open it...");
-		lpAdapter = PacketOpenAdapterNPF(AdapterNameA);
+		lpAdapter = PacketOpenAdapterNPF(AdapterNameA, Flags);
 		if (lpAdapter == NULL)
 		{
 			dwLastError = GetLastError();
@@ -3247,6 +3268,400 @@ BOOLEAN PacketGetStatsEx(LPADAPTER AdapterObject,struct bpf_stat *s)
 
 }
 
+/*!
+  \brief Enables or disables the profiling of the kernel filter.
+  \param AdapterObject Pointer to an _ADAPTER structure.
+  \param enable TRUE to enable the profiling and reset its counters, FALSE to disable it.
+  \return If the function succeeds, the return value is nonzero.
+
+  While the profiling is enabled, the driver counts how many times each instruction of the filter runs,
+  and how many packets each return instruction accepts and rejects. The counters are reset every time a
+  new filter is installed with PacketSetBpf(). The filter runs slower while it is profiled.
+*/
+BOOLEAN PacketSetProfiling(LPADAPTER AdapterObject, BOOLEAN enable)
+{
+	BOOLEAN Res;
+	DWORD BytesReturned;
+	ULONG Enable = enable ? 1 : 0;
+
+	TRACE_ENTER();
+
+	if (AdapterObject->Flags == INFO_FLAG_NDIS_ADAPTER)
+	{
+		Res = (BOOLEAN)DeviceIoControl(AdapterObject->hFile,
+			BIOCSPROFILE,
+			&Enable,
+			sizeof(Enable),
+			NULL,
+			0,
+			&BytesReturned,
+			NULL);
+	}
+	else
+	{
+		TRACE_PRINT1("Request to profile the filter on an unknown device type (%u)", AdapterObject->Flags);
+		Res = FALSE;
+	}
+
+	TRACE_EXIT();
+	return Res;
+}
+
+/*!
+  \brief Returns the per-instruction counters of the kernel filter.
+  \param AdapterObject Pointer to an _ADAPTER structure.
+  \param profile Pointer to a user provided buffer that will be filled with a bpf_profile structure,
+   followed by the bpf_profile_insn structures of the instructions of the filter.
+  \param size Size of the buffer, in bytes.
+  \return If the function succeeds, the return value is nonzero.
+
+  The instructions are the ones of the filter as installed by the driver, which may have optimized it.
+  If the buffer is too small for all of them, only the first ones are returned: the caller can compare
+  bp_len with the room it provided and call the function again with a larger buffer.
+*/
+BOOLEAN PacketGetFilterProfile(LPADAPTER AdapterObject, struct bpf_profile* profile, UINT size)
+{
+	BOOLEAN Res;
+	DWORD BytesReturned;
+
+	TRACE_ENTER();
+
+	if (AdapterObject->Flags == INFO_FLAG_NDIS_ADAPTER)
+	{
+		Res = (BOOLEAN)DeviceIoControl(AdapterObject->hFile,
+			BIOCGPROFILE,
+			NULL,
+			0,
+			profile,
+			size,
+			&BytesReturned,
+			NULL);
+	}
+	else
+	{
+		TRACE_PRINT1("Request to obtain the filter profile on an unknown device type (%u)", AdapterObject->Flags);
+		Res = FALSE;
+	}
+
+	TRACE_EXIT();
+	return Res;
+}
+
+/*!
+  \brief Sets an extended program as the kernel filter.
+  \param AdapterObject Pointer to an _ADAPTER structure.
+  \param program Pointer to the image of the program: a struct ebpf_program_header, followed by the definitions
+   of its maps and by its instructions.
+  \param size Size of the image, in bytes.
+  \return If the function succeeds, the return value is nonzero. It fails if the driver cannot prove the program
+   safe, in which case the previous filter stays in place.
+
+  Unlike the classic filters, an extended program can loop and keep state across the packets in its maps,
+  which are created empty when it is installed and can be read with PacketGetMap(). Like PacketSetBpf(), this
+  function empties the buffer of the driver.
+*/
+BOOLEAN PacketSetExtendedBpf(LPADAPTER AdapterObject, struct ebpf_program_header* program, UINT size)
+{
+	BOOLEAN Res;
+	DWORD BytesReturned;
+
+	TRACE_ENTER();
+
+	if (AdapterObject->Flags == INFO_FLAG_NDIS_ADAPTER)
+	{
+		Res = (BOOLEAN)DeviceIoControl(AdapterObject->hFile,
+			BIOCSETF,
+			program,
+			size,
+			NULL,
+			0,
+			&BytesReturned,
+			NULL);
+	}
+	else
+	{
+		TRACE_PRINT1("Request to set an extended program on an unknown device type (%u)", AdapterObject->Flags);
+		Res = FALSE;
+	}
+
+	TRACE_EXIT();
+	return Res;
+}
+
+/*!
+  \brief Returns the content of a map of the extended program set with PacketSetExtendedBpf().
+  \param AdapterObject Pointer to an _ADAPTER structure.
+  \param index Index of the map in the program.
+  \param info Pointer to a user provided buffer that will be filled with a ebpf_map_info structure, followed by
+   the records of the map: each key followed by its value.
+  \param size Size of the buffer, in bytes.
+  \return If the function succeeds, the return value is nonzero. It fails if there is no such map.
+
+  If the buffer is too small for all the records, only some of them are returned: the caller can compare
+  count with the room it provided and call the function again with a larger buffer.
+*/
+BOOLEAN PacketGetMap(LPADAPTER AdapterObject, UINT index, struct ebpf_map_info* info, UINT size)
+{
+	BOOLEAN Res;
+	DWORD BytesReturned;
+	ULONG Index = index;
+
+	TRACE_ENTER();
+
+	if (AdapterObject->Flags == INFO_FLAG_NDIS_ADAPTER)
+	{
+		Res = (BOOLEAN)DeviceIoControl(AdapterObject->hFile,
+			BIOCGMAP,
+			&Index,
+			sizeof(Index),
+			info,
+			size,
+			&BytesReturned,
+			NULL);
+	}
+	else
+	{
+		TRACE_PRINT1("Request to obtain a map on an unknown device type (%u)", AdapterObject->Flags);
+		Res = FALSE;
+	}
+
+	TRACE_EXIT();
+	return Res;
+}
+
+/*!
+  \brief Installs a set of patterns in the driver, for the BPF_MISC|BPF_MATCH instructions of the kernel filter.
+  \param AdapterObject Pointer to an _ADAPTER structure.
+  \param set Pointer to the image of the set: a struct bpf_match_header, followed by the patterns.
+  \param size Size of the image, in bytes.
+  \param id Receives the id of the set, i.e. the k of the instructions that search it.
+  \return If the function succeeds, the return value is nonzero. It fails if the image is not valid, if the
+   set is too large or if BPF_MATCH_MAX_SETS sets are already installed.
+
+  The set must be installed before the filters that use it, and belongs to the adapter object: it is deleted
+  with PacketDeletePatternSet() or when the adapter is closed.
+*/
+BOOLEAN PacketAddPatternSet(LPADAPTER AdapterObject, struct bpf_match_header* set, UINT size, PUINT id)
+{
+	BOOLEAN Res;
+	DWORD BytesReturned;
+	ULONG Id = 0;
+
+	TRACE_ENTER();
+
+	if (AdapterObject->Flags == INFO_FLAG_NDIS_ADAPTER)
+	{
+		Res = (BOOLEAN)DeviceIoControl(AdapterObject->hFile,
+			BIOCSMATCH,
+			set,
+			size,
+			&Id,
+			sizeof(Id),
+			&BytesReturned,
+			NULL);
+		*id = Id;
+	}
+	else
+	{
+		TRACE_PRINT1("Request to install a pattern set on an unknown device type (%u)", AdapterObject->Flags);
+		Res = FALSE;
+	}
+
+	TRACE_EXIT();
+	return Res;
+}
+
+/*!
+  \brief Deletes a set of patterns installed with PacketAddPatternSet().
+  \param AdapterObject Pointer to an _ADAPTER structure.
+  \param id The id of the set.
+  \return If the function succeeds, the return value is nonzero. It fails if the filter still uses the set.
+*/
+BOOLEAN PacketDeletePatternSet(LPADAPTER AdapterObject, UINT id)
+{
+	BOOLEAN Res;
+	DWORD BytesReturned;
+	ULONG Id = id;
+
+	TRACE_ENTER();
+
+	if (AdapterObject->Flags == INFO_FLAG_NDIS_ADAPTER)
+	{
+		Res = (BOOLEAN)DeviceIoControl(AdapterObject->hFile,
+			BIOCDMATCH,
+			&Id,
+			sizeof(Id),
+			NULL,
+			0,
+			&BytesReturned,
+			NULL);
+	}
+	else
+	{
+		TRACE_PRINT1("Request to delete a pattern set on an unknown device type (%u)", AdapterObject->Flags);
+		Res = FALSE;
+	}
+
+	TRACE_EXIT();
+	return Res;
+}
+
+/*!
+  \brief Maps the capture ring of the adapter in the application.
+  \param AdapterObject Pointer to an _ADAPTER structure.
+  \param blockSize Size of a block of the ring, a multiple of NPF_RING_ALIGNMENT between NPF_RING_MIN_BLOCK and NPF_RING_MAX_BLOCK.
+  \param blockCount Number of blocks of each CPU, 0 to unmap the ring.
+  \param ring Receives the address of the ring, NULL once it is unmapped.
+  \return If the function succeeds, the return value is nonzero. It fails if a ring is already mapped.
+
+  While the ring is mapped, the driver stores the packets in it instead of its kernel buffer and PacketReceivePacket()
+  fails: the packets are read in the blocks returned by PacketGetNextBlock(), without any copy.
+*/
+BOOLEAN PacketMapRing(LPADAPTER AdapterObject, UINT blockSize, UINT blockCount, struct npf_ring_header** ring)
+{
+	BOOLEAN Res;
+	DWORD BytesReturned;
+	UINT Request[2];
+	ULONGLONG Address = 0;
+
+	TRACE_ENTER();
+
+	Request[0] = blockSize;
+	Request[1] = blockCount;
+
+	if (AdapterObject->Flags == INFO_FLAG_NDIS_ADAPTER)
+	{
+		Res = (BOOLEAN)DeviceIoControl(AdapterObject->hFile,
+			BIOCSETRING,
+			Request,
+			sizeof(Request),
+			&Address,
+			blockCount != 0 ? sizeof(Address) : 0,
+			&BytesReturned,
+			NULL);
+		*ring = (Res && blockCount != 0) ? (struct npf_ring_header*)(ULONG_PTR)Address : NULL;
+	}
+	else
+	{
+		TRACE_PRINT1("Request to map a capture ring on an unknown device type (%u)", AdapterObject->Flags);
+		Res = FALSE;
+	}
+
+	TRACE_EXIT();
+	return Res;
+}
+
+/*
+ * The callbacks of npf_ring_wait(), on the read event of the adapter
+ */
+static void PacketResetRingEvent(void* context)
+{
+	ResetEvent(((LPADAPTER)context)->ReadEvent);
+}
+
+static void PacketWaitRingEvent(void* context)
+{
+	LPADAPTER AdapterObject = (LPADAPTER)context;
+
+	if((int)AdapterObject->ReadTimeOut != -1)
+		WaitForSingleObject(AdapterObject->ReadEvent, (AdapterObject->ReadTimeOut==0)?INFINITE:AdapterObject->ReadTimeOut);
+}
+
+static int PacketFlushRing(void* context)
+{
+	DWORD BytesReturned;
+
+	return DeviceIoControl(((LPADAPTER)context)->hFile, BIOCFLUSHRING, NULL, 0, NULL, 0, &BytesReturned, NULL);
+}
+
+/*!
+  \brief Returns the next block of packets of the capture ring.
+  \param AdapterObject Pointer to an _ADAPTER structure.
+  \param ring The ring returned by PacketMapRing().
+  \return The block, to be given back with PacketReleaseBlock() once its packets are read, or NULL if there is
+  none before the read timeout.
+
+  When no block is closed before the timeout, the driver closes the blocks that it is filling, so that the
+  packets do not wait for their block to be full.
+*/
+struct npf_ring_block* PacketGetNextBlock(LPADAPTER AdapterObject, struct npf_ring_header* ring)
+{
+	struct npf_ring_block* Block;
+
+	TRACE_ENTER();
+
+	if (AdapterObject->Flags == INFO_FLAG_NDIS_ADAPTER)
+	{
+		// The consumer of npf/win_ring.c, the one tested with the driver side
+		Block = npf_ring_wait(ring, AdapterObject, PacketResetRingEvent, PacketWaitRingEvent, PacketFlushRing);
+	}
+	else
+	{
+		Block = npf_ring_next(ring);
+	}
+
+	TRACE_EXIT();
+	return Block;
+}
+
+/*!
+  \brief Gives a block returned by PacketGetNextBlock() back to the driver.
+  \param AdapterObject Pointer to an _ADAPTER structure.
+  \param block The block, that the application must not read any more.
+
+  The blocks can be given back in any order, the driver fills them in turn.
+*/
+VOID PacketReleaseBlock(LPADAPTER AdapterObject, struct npf_ring_block* block)
+{
+	UNUSED(AdapterObject);
+
+	npf_ring_release(block);
+}
+
+/*!
+  \brief Makes the adapter join a fanout group, or leave it.
+  \param AdapterObject Pointer to an _ADAPTER structure.
+  \param id The fanout group, shared by the adapters opened on the same network interface with the same id.
+  \param mode NPF_FANOUT_HASH, NPF_FANOUT_LB or NPF_FANOUT_CPU, the same for all the members of the group, or
+  NPF_FANOUT_NONE to leave the group.
+  \return If the function succeeds, the return value is nonzero. It fails if the group exists with another mode.
+
+  Each packet of the interface goes to a single member of the group instead of all of them, so that several threads
+  can share the analysis of the traffic, each with its own adapter. The statistics of a member count the packets it
+  gets only.
+*/
+BOOLEAN PacketSetFanout(LPADAPTER AdapterObject, UINT id, UINT mode)
+{
+	BOOLEAN Res;
+	DWORD BytesReturned;
+	UINT Request[2];
+
+	TRACE_ENTER();
+
+	Request[0] = id;
+	Request[1] = mode;
+
+	if (AdapterObject->Flags == INFO_FLAG_NDIS_ADAPTER)
+	{
+		Res = (BOOLEAN)DeviceIoControl(AdapterObject->hFile,
+			BIOCSETFANOUT,
+			Request,
+			sizeof(Request),
+			NULL,
+			0,
+			&BytesReturned,
+			NULL);
+	}
+	else
+	{
+		TRACE_PRINT1("Request to join a fanout group on an unknown device type (%u)", AdapterObject->Flags);
+		Res = FALSE;
+	}
+
+	TRACE_EXIT();
+	return Res;
+}
+
 /*!
   \brief Performs a query/set operation on an internal variable of the network card driver.
   \param AdapterObject Pointer to an _ADAPTER structure.
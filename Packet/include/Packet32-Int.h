@@ -12,6 +12,9 @@
 // opening of firewire adapters 
 #define FIREWIRE_SUBSTR L"1394"
 
+// Appended to the name of the device to open it with PACKET_OPEN_UNORDERED, the same as NPF_OPEN_UNORDERED in the driver
+#define NPF_OPEN_UNORDERED_SUFFIX "\\Unordered"
+
 #ifdef __MINGW32__
 #ifdef __MINGW64__
 #include <ntddndis.h>
@@ -64,12 +67,18 @@ BOOL PacketGetFileVersion(LPTSTR FileName, PCHAR VersionBuff, UINT VersionBuffLe
 PADAPTER_INFO PacketFindAdInfo(PCHAR AdapterName);
 BOOLEAN PacketUpdateAdInfo(PCHAR AdapterName);
 BOOLEAN IsFireWire(TCHAR *AdapterDesc);
-LPADAPTER PacketOpenAdapterNPF(PCHAR AdapterName);
+LPADAPTER PacketOpenAdapterNPF(PCHAR AdapterName, UINT Flags);
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 HMODULE LoadLibrarySafe(LPCTSTR lpFileName);
+
+// The application side of the capture ring, in npf/win_ring.c
+struct npf_ring_block* npf_ring_next(struct npf_ring_header* header);
+void npf_ring_release(struct npf_ring_block* block);
+struct npf_ring_block* npf_ring_wait(struct npf_ring_header* header, void* context,
+	void (*reset)(void* context), void (*wait)(void* context), int (*flush)(void* context));
 #ifdef __cplusplus
 }
 #endif
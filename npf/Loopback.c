@@ -316,6 +316,8 @@ NPF_NetworkClassify(
 {
 	POPEN_INSTANCE GroupOpen;
 	POPEN_INSTANCE		TempOpen;
+	PNPF_GROUP_VERDICTS	Verdicts;
+	LOCK_STATE_EX		LockState;
 	NTSTATUS			status = STATUS_SUCCESS;
 	UINT32				ipHeaderSize = 0;
 	UINT32				bytesRetreated = 0;
@@ -568,19 +570,21 @@ NPF_NetworkClassify(
 	if (g_LoopbackOpenGroupHead) {
 
 		/* Lock the group */
-		NdisAcquireSpinLock(&g_LoopbackOpenGroupHead->GroupLock);
+		NdisAcquireRWLockRead(g_LoopbackOpenGroupHead->GroupLock, &LockState, 0);
 		GroupOpen = g_LoopbackOpenGroupHead->GroupNext;
+		Verdicts = NPF_ClassifyNetBufferLists(g_LoopbackOpenGroupHead, pClonedNetBufferList, &g_TapScratch[My_KeGetCurrentProcessorNumber()].Verdicts);
 		while (GroupOpen != NULL)
 		{
 			TempOpen = GroupOpen;
 			if (TempOpen->AdapterBindingStatus == ADAPTER_BOUND)
 			{
 				//let every group adapter receive the packets
-				NPF_TapExForEachOpen(TempOpen, pClonedNetBufferList);
+				NPF_TapExForEachOpen(TempOpen, pClonedNetBufferList, Verdicts, bInbound ? BPF_DIRECTION_IN : BPF_DIRECTION_OUT);
 			}
 			GroupOpen = TempOpen->GroupNext;
 		}
-		NdisReleaseSpinLock(&g_LoopbackOpenGroupHead->GroupLock);
+		NPF_AdvanceFanouts(g_LoopbackOpenGroupHead, pClonedNetBufferList);
+		NdisReleaseRWLock(g_LoopbackOpenGroupHead->GroupLock, &LockState);
 	}
 
 Exit_Ethernet_Retreated:
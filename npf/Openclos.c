@@ -26,6 +26,7 @@ extern ULONG g_Dot11SupportMode;
 	extern PDEVICE_OBJECT g_LoopbackDevObj;
 #endif
 
+extern NDIS_HANDLE FilterDriverHandle; // NDIS handle for filter driver
 extern NDIS_HANDLE FilterDriverHandle_WiFi; // NDIS handle for WiFi filter driver
 
 static
@@ -165,6 +166,7 @@ NPF_OpenAdapter(
 	PIO_STACK_LOCATION		IrpSp;
 	NDIS_STATUS				Status = STATUS_SUCCESS;
 	ULONG					localNumOpenedInstances;
+	NDIS_STRING				UnorderedName = RTL_CONSTANT_STRING(NPF_OPEN_UNORDERED);
 
 	TRACE_ENTER();
 
@@ -205,6 +207,17 @@ NPF_OpenAdapter(
 	Open = NPF_DuplicateOpenObject(GroupHead, DeviceExtension);
 
 	Open->DeviceExtension = DeviceExtension;
+
+	// The flags in the name of the file, the rest of the name is ignored
+	if (RtlEqualUnicodeString(&IrpSp->FileObject->FileName, &UnorderedName, TRUE))
+	{
+		Open->Unordered = TRUE;
+	}
+
+	// Only this process can map a capture ring in the instance
+	Open->OwnerProcess = PsGetCurrentProcess();
+	ObReferenceObject(Open->OwnerProcess);
+
 #ifdef HAVE_WFP_LOOPBACK_SUPPORT
 	TRACE_MESSAGE3(PACKET_DEBUG_LOUD,
 		"Opening the device %ws, BindingContext=%p, Loopback=%u",
@@ -434,22 +447,25 @@ NPF_ReleaseOpenInstanceResources(
 	//
 	// Free the filter if it's present
 	//
-	if (pOpen->bpfprogram != NULL)
+	NPF_FreeFilter(pOpen->Filter);
+	pOpen->Filter = NULL;
+
+	// No filter searches the pattern sets of the instance any more
+	NPF_FreeMatchSets(pOpen);
+
+	// Free the profile of the filter if it's present
+	if (pOpen->Profile != NULL)
 	{
-		ExFreePool(pOpen->bpfprogram);
-		pOpen->bpfprogram = NULL;
+		ExFreePool(pOpen->Profile);
+		pOpen->Profile = NULL;
 	}
 
-	//
-	// Jitted filters are supported on x86 (32bit) only
-	//
-#ifdef _X86_
-	// Free the jitted filter if it's present
-	if (pOpen->Filter != NULL)
+	// Free the group classifier if it's present
+	if (pOpen->GroupProgram != NULL)
 	{
-		BPF_Destroy_JIT_Filter(pOpen->Filter);
+		bpf_free_group(pOpen->GroupProgram);
+		pOpen->GroupProgram = NULL;
 	}
-#endif //_X86_
 
 	//
 	// Dereference the read event.
@@ -460,17 +476,27 @@ NPF_ReleaseOpenInstanceResources(
 		ObDereferenceObject(pOpen->ReadEvent);
 	}
 
+	// Unmap and free the capture ring, if NPF_Cleanup() has not already
+	NPF_UnmapRing(pOpen);
+
+	if (pOpen->OwnerProcess != NULL)
+	{
+		ObDereferenceObject(pOpen->OwnerProcess);
+		pOpen->OwnerProcess = NULL;
+	}
+
 	//
-	// free the buffer
-	// NOTE: the buffer is fragmented among the various CPUs, but the base pointer of the
-	// allocated chunk of memory is stored in the first slot (pOpen->CpuData[0])
+	// free the pool, then its blocks, each chunk allocated on the NUMA node of its CPU
 	//
-	if (pOpen->Size > 0)
+	npf_pool_free(pOpen->Pool);
+	pOpen->Pool = NULL;
+	for (i = 0; i < g_NCpu; i++)
 	{
-		ExFreePool(pOpen->CpuData[0].Buffer);
-		pOpen->CpuData[0].Buffer = NULL;
-		pOpen->Size = 0;
+		NPF_FreeCpuBuffer(pOpen->CpuData[i].Buffer, pOpen->CpuData[i].BufferPages);
+		pOpen->CpuData[i].Buffer = NULL;
+		pOpen->CpuData[i].BufferPages = NULL;
 	}
+	pOpen->Size = 0;
 
 	//
 	// free the per CPU spinlocks
@@ -483,7 +509,7 @@ NPF_ReleaseOpenInstanceResources(
 	NdisFreeSpinLock(&pOpen->OIDLock);
 	NdisFreeSpinLock(&pOpen->CountersLock);
 	NdisFreeSpinLock(&pOpen->WriteLock);
-	NdisFreeSpinLock(&pOpen->GroupLock);
+	NdisFreeRWLock(pOpen->GroupLock);
 	NdisFreeSpinLock(&pOpen->MachineLock);
 	NdisFreeSpinLock(&pOpen->AdapterHandleLock);
 	NdisFreeSpinLock(&pOpen->OpenInUseLock);
@@ -839,6 +865,9 @@ NPF_Cleanup(
 
 	NPF_RemoveFromGroupOpenArray(Open); //Remove the adapter from the group adapter list
 
+	// Unmap the capture ring in the context of the process that closes the handle
+	NPF_UnmapRing(Open);
+
 	NPF_CloseOpenInstance(Open);
 
 	if (Open->ReadEvent != NULL)
@@ -961,10 +990,11 @@ NPF_AddToGroupOpenArray(
 	)
 {
 	POPEN_INSTANCE GroupRear;
+	LOCK_STATE_EX LockState;
 
 	TRACE_ENTER();
 
-	NdisAcquireSpinLock(&GroupHead->GroupLock);
+	NdisAcquireRWLockWrite(GroupHead->GroupLock, &LockState, 0);
 	GroupRear = GroupHead;
 	while (GroupRear->GroupNext != NULL)
 	{
@@ -973,7 +1003,11 @@ NPF_AddToGroupOpenArray(
 	GroupRear->GroupNext = Open;
 	Open->GroupHead = GroupHead;
 
-	NdisReleaseSpinLock(&GroupHead->GroupLock);
+	NPF_InvalidateGroupClassifier(GroupHead);
+
+	NdisReleaseRWLock(GroupHead->GroupLock, &LockState);
+
+	NPF_UpdateGroupClassifier(GroupHead);
 
 	TRACE_EXIT();
 }
@@ -988,6 +1022,8 @@ NPF_RemoveFromOpenArray(
 	POPEN_INSTANCE CurOpen = NULL;
 	POPEN_INSTANCE PrevOpen = NULL;
 	POPEN_INSTANCE GroupOpen;
+	PNPF_FANOUT Fanout;
+	LOCK_STATE_EX LockState;
 
 	if (!Open)
 	{
@@ -1023,15 +1059,25 @@ NPF_RemoveFromOpenArray(
 	}
 
 	// Remove the links between group head and group members.
-	NdisAcquireSpinLock(&Open->GroupLock);
+	NdisAcquireRWLockWrite(Open->GroupLock, &LockState, NDIS_RWL_AT_DISPATCH_LEVEL);
+	NPF_InvalidateGroupClassifier(Open);
 	GroupOpen = Open->GroupNext;
 	while (GroupOpen)
 	{
 		GroupOpen->GroupHead = NULL;
+		GroupOpen->Fanout = NULL;
 		GroupOpen = GroupOpen->GroupNext;
 	}
 	Open->GroupNext = NULL;
-	NdisReleaseSpinLock(&Open->GroupLock);
+
+	// The fanout groups go with the adapter
+	while (Open->Fanouts != NULL)
+	{
+		Fanout = Open->Fanouts;
+		Open->Fanouts = Fanout->Next;
+		ExFreePool(Fanout);
+	}
+	NdisReleaseRWLock(Open->GroupLock, &LockState);
 
 	NdisReleaseSpinLock(&g_OpenArrayLock);
 
@@ -1047,29 +1093,43 @@ NPF_RemoveFromGroupOpenArray(
 	POPEN_INSTANCE Open
 	)
 {
+	POPEN_INSTANCE GroupHead;
 	POPEN_INSTANCE GroupOpen;
 	POPEN_INSTANCE GroupPrev = NULL;
+	PNPF_FANOUT Fanout;
+	LOCK_STATE_EX LockState;
 
 	TRACE_ENTER();
 
-	if (!Open->GroupHead || Open->GroupHead == Open)
+	GroupHead = Open->GroupHead;
+	if (!GroupHead || GroupHead == Open)
 	{
 		IF_LOUD(DbgPrint("NPF_RemoveFromGroupOpenArray: error, the open doesn't have a group head.\n");)
 		TRACE_EXIT();
 		return;
 	}
 
-	NdisAcquireSpinLock(&Open->GroupHead->GroupLock);
-	GroupPrev = Open->GroupHead;
+	NdisAcquireRWLockWrite(GroupHead->GroupLock, &LockState, 0);
+	GroupPrev = GroupHead;
 	GroupOpen = GroupPrev->GroupNext;
 	while (GroupOpen)
 	{
 		if (GroupOpen == Open)
 		{
+			Fanout = NPF_LeaveFanout(Open);
 			GroupPrev->GroupNext = GroupOpen->GroupNext;
-			NdisReleaseSpinLock(&Open->GroupHead->GroupLock);
+			GroupOpen->GroupIndex = NPF_GROUP_NONE;
+			NPF_InvalidateGroupClassifier(GroupHead);
+			NdisReleaseRWLock(GroupHead->GroupLock, &LockState);
 			GroupOpen->GroupHead = NULL;
 
+			if (Fanout != NULL)
+			{
+				ExFreePool(Fanout);
+			}
+
+			NPF_UpdateGroupClassifier(GroupHead);
+
 			TRACE_EXIT();
 			return;
 
@@ -1077,7 +1137,7 @@ NPF_RemoveFromGroupOpenArray(
 		GroupPrev = GroupOpen;
 		GroupOpen = GroupOpen->GroupNext;
 	}
-	NdisReleaseSpinLock(&Open->GroupHead->GroupLock);
+	NdisReleaseRWLock(GroupHead->GroupLock, &LockState);
 
 	IF_LOUD(DbgPrint("NPF_RemoveFromGroupOpenArray: error, the open isn't in the group open list.\n");)
 
@@ -1086,6 +1146,273 @@ NPF_RemoveFromGroupOpenArray(
 
 //-------------------------------------------------------------------
 
+void
+NPF_InvalidateGroupClassifier(
+	POPEN_INSTANCE GroupHead
+	)
+{
+	POPEN_INSTANCE GroupOpen;
+
+	GroupHead->GroupGeneration++;
+
+	if (GroupHead->GroupProgram != NULL)
+	{
+		bpf_free_group(GroupHead->GroupProgram);
+		GroupHead->GroupProgram = NULL;
+	}
+
+	for (GroupOpen = GroupHead->GroupNext; GroupOpen != NULL; GroupOpen = GroupOpen->GroupNext)
+	{
+		GroupOpen->GroupIndex = NPF_GROUP_NONE;
+	}
+}
+
+//-------------------------------------------------------------------
+
+void
+NPF_UpdateGroupClassifier(
+	POPEN_INSTANCE GroupHead
+	)
+{
+	struct bpf_insn* Programs[BPF_GROUP_MAX];
+	u_int Lengths[BPF_GROUP_MAX];
+	POPEN_INSTANCE Members[BPF_GROUP_MAX];
+	POPEN_INSTANCE GroupOpen;
+	struct bpf_group_program* GroupProgram = NULL;
+	struct bpf_group_program* OldProgram;
+	struct bpf_insn* Copy = NULL;
+	LOCK_STATE_EX LockState;
+	ULONGLONG Covered = 0;
+	ULONG Generation;
+	UINT Count = 0;
+	UINT Total = 0;
+	UINT i;
+
+	TRACE_ENTER();
+
+	ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+	// The group head is not freed while the classifier is compiled
+	if (!NPF_StartUsingBinding(GroupHead))
+	{
+		TRACE_EXIT();
+		return;
+	}
+
+	//
+	// Copy the filters of the instances, that can be replaced and freed as soon as the lock is released: the
+	// classifier is compiled without any lock, then installed only if the group and its filters have not changed
+	//
+	NdisAcquireRWLockRead(GroupHead->GroupLock, &LockState, 0);
+
+	Generation = GroupHead->GroupGeneration;
+
+	// The instances beyond the first BPF_GROUP_MAX filter the packets on their own
+	for (GroupOpen = GroupHead->GroupNext; GroupOpen != NULL && Count < BPF_GROUP_MAX; GroupOpen = GroupOpen->GroupNext)
+	{
+		Members[Count] = GroupOpen;
+		Lengths[Count] = (GroupOpen->Filter != NULL) ? GroupOpen->Filter->BpfProgramLength : 0;
+		Total += Lengths[Count];
+		Count++;
+	}
+
+	if (Count >= 2 && Total != 0)
+	{
+		Copy = ExAllocatePoolWithTag(NonPagedPool, Total * sizeof(struct bpf_insn), 'APWA');
+	}
+
+	if (Copy != NULL)
+	{
+		Total = 0;
+		for (i = 0; i < Count; i++)
+		{
+			Programs[i] = NULL;
+			if (Lengths[i] != 0)
+			{
+				Programs[i] = Copy + Total;
+				RtlCopyMemory(Programs[i], Members[i]->Filter->bpfprogram, Lengths[i] * sizeof(struct bpf_insn));
+				Total += Lengths[i];
+			}
+		}
+	}
+
+	NdisReleaseRWLock(GroupHead->GroupLock, &LockState);
+
+	if (Copy != NULL)
+	{
+		GroupProgram = bpf_group_compile(Programs, Lengths, Count);
+		ExFreePool(Copy);
+	}
+
+	if (GroupProgram != NULL)
+	{
+		Covered = bpf_group_covered(GroupProgram);
+
+		NdisAcquireRWLockWrite(GroupHead->GroupLock, &LockState, 0);
+
+		// Otherwise the group or a filter has changed, and the classifier is rebuilt again by whoever changed it
+		if (GroupHead->GroupGeneration == Generation)
+		{
+			for (i = 0; i < Count; i++)
+			{
+				Members[i]->GroupIndex = NPF_GROUP_NONE;
+				if (Covered & ((ULONGLONG)1 << i))
+				{
+					Members[i]->GroupIndex = i;
+					Members[i]->GroupAccept = bpf_group_accept(GroupProgram, i);
+				}
+			}
+
+			// The previous classifier, if two rebuilds of the same generation raced, is freed below
+			OldProgram = GroupHead->GroupProgram;
+			GroupHead->GroupProgram = GroupProgram;
+			GroupProgram = OldProgram;
+		}
+		else
+		{
+			Covered = 0;
+		}
+
+		NdisReleaseRWLock(GroupHead->GroupLock, &LockState);
+
+		if (GroupProgram != NULL)
+		{
+			bpf_free_group(GroupProgram);
+		}
+	}
+
+	NPF_StopUsingBinding(GroupHead);
+
+	TRACE_MESSAGE2(PACKET_DEBUG_LOUD, "Group classifier: %u instances, covered 0x%I64x", Count, Covered);
+
+	TRACE_EXIT();
+}
+
+//-------------------------------------------------------------------
+
+PNPF_FANOUT
+NPF_LeaveFanout(
+	POPEN_INSTANCE Open
+	)
+{
+	PNPF_FANOUT Fanout = Open->Fanout;
+	PNPF_FANOUT* Link;
+	POPEN_INSTANCE GroupOpen;
+
+	if (Fanout == NULL)
+	{
+		return NULL;
+	}
+
+	// The members after this one move down, so that they stay numbered from 0 to Count - 1
+	for (GroupOpen = Open->GroupHead->GroupNext; GroupOpen != NULL; GroupOpen = GroupOpen->GroupNext)
+	{
+		if (GroupOpen->Fanout == Fanout && GroupOpen->FanoutIndex > Open->FanoutIndex)
+		{
+			GroupOpen->FanoutIndex--;
+		}
+	}
+
+	Open->Fanout = NULL;
+	Open->FanoutIndex = 0;
+	Fanout->Count--;
+
+	if (Fanout->Count != 0)
+	{
+		return NULL;
+	}
+
+	for (Link = &Open->GroupHead->Fanouts; *Link != Fanout; Link = &(*Link)->Next);
+	*Link = Fanout->Next;
+
+	return Fanout;
+}
+
+//-------------------------------------------------------------------
+
+NTSTATUS
+NPF_SetFanout(
+	POPEN_INSTANCE Open,
+	ULONG Id,
+	ULONG Mode
+	)
+{
+	POPEN_INSTANCE GroupHead;
+	PNPF_FANOUT NewFanout = NULL;
+	PNPF_FANOUT OldFanout = NULL;
+	PNPF_FANOUT Fanout;
+	LOCK_STATE_EX LockState;
+	NTSTATUS Status = STATUS_SUCCESS;
+
+	TRACE_ENTER();
+
+	GroupHead = Open->GroupHead;
+	if (GroupHead == NULL || GroupHead == Open)
+	{
+		TRACE_EXIT();
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+
+	// Allocated beforehand, in case the group does not exist yet
+	if (Mode != NPF_FANOUT_NONE)
+	{
+		NewFanout = (PNPF_FANOUT)ExAllocatePoolWithTag(NonPagedPool, sizeof(NPF_FANOUT), '9PWA');
+		if (NewFanout == NULL)
+		{
+			TRACE_EXIT();
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		RtlZeroMemory(NewFanout, sizeof(NPF_FANOUT));
+		NewFanout->Id = Id;
+		NewFanout->Mode = Mode;
+	}
+
+	NdisAcquireRWLockWrite(GroupHead->GroupLock, &LockState, 0);
+
+	for (Fanout = GroupHead->Fanouts; Fanout != NULL && Fanout->Id != Id; Fanout = Fanout->Next);
+
+	if (Mode != NPF_FANOUT_NONE && Fanout != NULL && Fanout->Mode != Mode)
+	{
+		Status = STATUS_INVALID_PARAMETER;
+	}
+	else if (Mode == NPF_FANOUT_NONE || Fanout != Open->Fanout)
+	{
+		// Fanout, if it exists, is not the group left and outlives it
+		OldFanout = NPF_LeaveFanout(Open);
+
+		if (Mode != NPF_FANOUT_NONE)
+		{
+			if (Fanout == NULL)
+			{
+				Fanout = NewFanout;
+				Fanout->Next = GroupHead->Fanouts;
+				GroupHead->Fanouts = Fanout;
+				NewFanout = NULL;
+			}
+
+			Open->Fanout = Fanout;
+			Open->FanoutIndex = Fanout->Count++;
+		}
+	}
+
+	NdisReleaseRWLock(GroupHead->GroupLock, &LockState);
+
+	if (NewFanout != NULL)
+	{
+		ExFreePool(NewFanout);
+	}
+
+	if (OldFanout != NULL)
+	{
+		ExFreePool(OldFanout);
+	}
+
+	TRACE_EXIT();
+	return Status;
+}
+
+//-------------------------------------------------------------------
+
 BOOLEAN
 NPF_EqualAdapterName(
 	PNDIS_STRING s1,
@@ -1268,13 +1595,22 @@ NPF_CreateOpenObject(
 		return NULL;
 	}
 
+	Open->GroupLock = NdisAllocateRWLock(FilterDriverHandle);
+	if (Open->GroupLock == NULL)
+	{
+		TRACE_MESSAGE(PACKET_DEBUG_LOUD, "Failed to allocate the group lock");
+		NdisFreeNetBufferListPool(Open->PacketPool);
+		ExFreePool(Open);
+		TRACE_EXIT();
+		return NULL;
+	}
+
 	NdisInitializeEvent(&Open->WriteEvent);
 	NdisInitializeEvent(&Open->NdisRequestEvent);
 	NdisInitializeEvent(&Open->NdisWriteCompleteEvent);
 	NdisInitializeEvent(&Open->DumpEvent);
 	NdisAllocateSpinLock(&Open->MachineLock);
 	NdisAllocateSpinLock(&Open->WriteLock);
-	NdisAllocateSpinLock(&Open->GroupLock);
 	Open->WriteInProgress = FALSE;
 
 	for (i = 0; i < g_NCpu; i++)
@@ -1295,7 +1631,16 @@ NPF_CreateOpenObject(
 	// Initialize the open instance
 	//
 	//Open->BindContext = NULL;
-	Open->bpfprogram = NULL;	//reset the filter
+	Open->Filter = NULL;	//reset the filter
+	Open->ProfileEnabled = FALSE;
+	Open->Profile = NULL;
+	Open->ProfilePackets = 0;
+	Open->GroupProgram = NULL;
+	Open->GroupGeneration = 0;
+	Open->GroupIndex = NPF_GROUP_NONE;
+	Open->Fanouts = NULL;
+	Open->Fanout = NULL;
+	Open->FanoutIndex = 0;
 	Open->mode = MODE_CAPT;
 	Open->Nbytes.QuadPart = 0;
 	Open->Npackets.QuadPart = 0;
@@ -1310,9 +1655,16 @@ NPF_CreateOpenObject(
 #endif // HAVE_BUGGY_TME_SUPPORT
 	Open->DumpLimitReached = FALSE;
 	Open->MaxFrameSize = 0;
-	Open->WriterSN = 0;
-	Open->ReaderSN = 0;
 	Open->Size = 0;
+	Open->Pool = NULL;
+	ExInitializeFastMutex(&Open->ReadMutex);
+	Open->Unordered = FALSE;
+	Open->ReadCpu = 0;
+	Open->Ring = NULL;
+	Open->RingAddress = NULL;
+	Open->RingProcess = NULL;
+	InitializeListHead(&Open->RingLink);
+	Open->OwnerProcess = NULL;
 	Open->SkipSentPackets = FALSE;
 	Open->ReadEvent = NULL;
 
@@ -14,6 +14,7 @@
 #include "debug.h"
 #include "packet.h"
 #include "win_bpf.h"
+#include "win_ebpf.h"
 #include "ioctls.h"
 
 #ifdef HAVE_BUGGY_TME_SUPPORT
@@ -92,6 +93,27 @@ WCHAR* bindP = NULL;
 
 ULONG g_NCpu;
 
+//
+// The working storage of the taps, one per CPU
+//
+PNPF_TAP_SCRATCH g_TapScratch = NULL;
+
+//
+// The pattern sets installed with BIOCSMATCH in bpf_match_sets: the instance that owns each of them,
+// and the number of filters that search it. A set is not deleted while a filter refers to it
+//
+NDIS_SPIN_LOCK g_MatchLock;
+POPEN_INSTANCE g_MatchOwners[BPF_MATCH_MAX_SETS];
+ULONG g_MatchRefs[BPF_MATCH_MAX_SETS];
+
+//
+// The instances that have a capture ring, so that NPF_ProcessNotify() unmaps the rings of a process
+// that exits. No ring is mapped if the notify routine could not be registered
+//
+FAST_MUTEX g_RingMutex;
+LIST_ENTRY g_RingList;
+BOOLEAN g_RingNotify = FALSE;
+
 //
 // Global variables
 //
@@ -107,8 +129,43 @@ typedef ULONG (*KEGETCURRENTPROCESSORNUMBEREX)(
 	PPROCESSOR_NUMBER ProcNumber
 	);
 
+//KeGetProcessorNumberFromIndex
+typedef NTSTATUS (*KEGETPROCESSORNUMBERFROMINDEX)(
+	ULONG ProcIndex,
+	PPROCESSOR_NUMBER ProcNumber
+	);
+//KeQueryHighestNodeNumber
+typedef USHORT (*KEQUERYHIGHESTNODENUMBER)(
+	);
+//KeQueryNodeActiveAffinity
+typedef VOID (*KEQUERYNODEACTIVEAFFINITY)(
+	USHORT NodeNumber,
+	PGROUP_AFFINITY Affinity,
+	PUSHORT Count
+	);
+//MmAllocateNodePagesForMdlEx
+typedef PMDL (*MMALLOCATENODEPAGESFORMDLEX)(
+	PHYSICAL_ADDRESS LowAddress,
+	PHYSICAL_ADDRESS HighAddress,
+	PHYSICAL_ADDRESS SkipBytes,
+	SIZE_T TotalBytes,
+	MEMORY_CACHING_TYPE CacheType,
+	ULONG IdealNode,
+	ULONG Flags
+	);
+
 NDISGROUPMAXPROCESSORCOUNT g_My_NdisGroupMaxProcessorCount = NULL;
 KEGETCURRENTPROCESSORNUMBEREX g_My_KeGetCurrentProcessorNumberEx = NULL;
+KEGETPROCESSORNUMBERFROMINDEX g_My_KeGetProcessorNumberFromIndex = NULL;
+KEQUERYHIGHESTNODENUMBER g_My_KeQueryHighestNodeNumber = NULL;
+KEQUERYNODEACTIVEAFFINITY g_My_KeQueryNodeActiveAffinity = NULL;
+MMALLOCATENODEPAGESFORMDLEX g_My_MmAllocateNodePagesForMdlEx = NULL;
+
+//
+// The NUMA node of each CPU, where its kernel buffers are allocated if g_NumaBuffers is set
+//
+USHORT g_CpuNodes[NPF_MAX_CPU_NUMBER];
+BOOLEAN g_NumaBuffers = FALSE;
 
 //-------------------------------------------------------------------
 ULONG
@@ -152,6 +209,120 @@ My_KeGetCurrentProcessorNumber(
 	return Cpu;
 }
 
+//-------------------------------------------------------------------
+VOID
+NPF_InitCpuNodes(
+	)
+{
+	PROCESSOR_NUMBER ProcNumber;
+	GROUP_AFFINITY Affinity;
+	USHORT HighestNode;
+	USHORT Node;
+	USHORT Count;
+	ULONG Cpu;
+
+	// for Win7 and later only
+	if (g_My_KeGetProcessorNumberFromIndex == NULL || g_My_KeQueryHighestNodeNumber == NULL ||
+		g_My_KeQueryNodeActiveAffinity == NULL || g_My_MmAllocateNodePagesForMdlEx == NULL)
+	{
+		return;
+	}
+
+	// On a single node, the pool is as close to every CPU as its own pages
+	HighestNode = g_My_KeQueryHighestNodeNumber();
+	if (HighestNode == 0)
+	{
+		return;
+	}
+
+	for (Cpu = 0; Cpu < g_NCpu; Cpu++)
+	{
+		g_CpuNodes[Cpu] = 0;
+
+		if (!NT_SUCCESS(g_My_KeGetProcessorNumberFromIndex(Cpu, &ProcNumber)))
+		{
+			continue;
+		}
+
+		for (Node = 0; Node <= HighestNode; Node++)
+		{
+			g_My_KeQueryNodeActiveAffinity(Node, &Affinity, &Count);
+			if (Affinity.Group == ProcNumber.Group && (Affinity.Mask & ((KAFFINITY)1 << ProcNumber.Number)))
+			{
+				g_CpuNodes[Cpu] = Node;
+				break;
+			}
+		}
+	}
+
+	g_NumaBuffers = TRUE;
+}
+
+//-------------------------------------------------------------------
+PUCHAR
+NPF_AllocateCpuBuffer(
+	IN ULONG Cpu,
+	IN ULONG Size,
+	OUT PMDL* pPages
+	)
+{
+	PHYSICAL_ADDRESS LowAddress;
+	PHYSICAL_ADDRESS HighAddress;
+	PHYSICAL_ADDRESS SkipBytes;
+	PMDL Pages;
+	PUCHAR Buffer;
+
+	*pPages = NULL;
+
+	if (g_NumaBuffers)
+	{
+		LowAddress.QuadPart = 0;
+		HighAddress.QuadPart = -1;
+		SkipBytes.QuadPart = 0;
+
+		Pages = g_My_MmAllocateNodePagesForMdlEx(LowAddress, HighAddress, SkipBytes, Size, MmCached, g_CpuNodes[Cpu], MM_ALLOCATE_FULLY_REQUIRED);
+		if (Pages != NULL)
+		{
+			Buffer = MmMapLockedPagesSpecifyCache(Pages, KernelMode, MmCached, NULL, FALSE, NormalPagePriority | MdlMappingNoExecute);
+			if (Buffer != NULL)
+			{
+				*pPages = Pages;
+				return Buffer;
+			}
+
+			MmFreePagesFromMdl(Pages);
+			ExFreePool(Pages);
+		}
+	}
+
+	// The node is out of memory, or there is a single one
+	return ExAllocatePoolWithTag(NonPagedPool, Size, '6PWA');
+}
+
+//-------------------------------------------------------------------
+VOID
+NPF_FreeCpuBuffer(
+	IN PUCHAR Buffer,
+	IN PMDL Pages
+	)
+{
+	if (Buffer == NULL)
+	{
+		return;
+	}
+
+	if (Pages != NULL)
+	{
+		MmUnmapLockedPages(Buffer, Pages);
+		MmFreePagesFromMdl(Pages);
+		ExFreePool(Pages);
+	}
+	else
+	{
+		ExFreePool(Buffer);
+	}
+}
+
 
 //-------------------------------------------------------------------
 //
@@ -179,6 +350,10 @@ DriverEntry(
 
 	NDIS_STRING strNdisGroupMaxProcessorCount;
 	NDIS_STRING strKeGetCurrentProcessorNumberEx;
+	NDIS_STRING strKeGetProcessorNumberFromIndex;
+	NDIS_STRING strKeQueryHighestNodeNumber;
+	NDIS_STRING strKeQueryNodeActiveAffinity;
+	NDIS_STRING strMmAllocateNodePagesForMdlEx;
 	NDIS_STRING strKeGetProcessorIndexFromNumber;
 
 	UNREFERENCED_PARAMETER(RegistryPath);
@@ -270,12 +445,41 @@ DriverEntry(
 	RtlInitUnicodeString(&strKeGetCurrentProcessorNumberEx, L"KeGetCurrentProcessorNumberEx");
 	g_My_KeGetCurrentProcessorNumberEx = (KEGETCURRENTPROCESSORNUMBEREX) NdisGetRoutineAddress(&strKeGetCurrentProcessorNumberEx);
 
+	RtlInitUnicodeString(&strKeGetProcessorNumberFromIndex, L"KeGetProcessorNumberFromIndex");
+	g_My_KeGetProcessorNumberFromIndex = (KEGETPROCESSORNUMBERFROMINDEX) NdisGetRoutineAddress(&strKeGetProcessorNumberFromIndex);
+
+	RtlInitUnicodeString(&strKeQueryHighestNodeNumber, L"KeQueryHighestNodeNumber");
+	g_My_KeQueryHighestNodeNumber = (KEQUERYHIGHESTNODENUMBER) NdisGetRoutineAddress(&strKeQueryHighestNodeNumber);
+
+	RtlInitUnicodeString(&strKeQueryNodeActiveAffinity, L"KeQueryNodeActiveAffinity");
+	g_My_KeQueryNodeActiveAffinity = (KEQUERYNODEACTIVEAFFINITY) NdisGetRoutineAddress(&strKeQueryNodeActiveAffinity);
+
+	RtlInitUnicodeString(&strMmAllocateNodePagesForMdlEx, L"MmAllocateNodePagesForMdlEx");
+	g_My_MmAllocateNodePagesForMdlEx = (MMALLOCATENODEPAGESFORMDLEX) NdisGetRoutineAddress(&strMmAllocateNodePagesForMdlEx);
+
 	//
 	// Get number of CPUs and save it
 	//
 	g_NCpu = My_NdisGroupMaxProcessorCount();
 	TRACE_MESSAGE3(PACKET_DEBUG_LOUD, "g_NCpu: %d, NPF_MAX_CPU_NUMBER: %d, g_My_NdisGroupMaxProcessorCount: %x\n", g_NCpu, NPF_MAX_CPU_NUMBER, g_My_NdisGroupMaxProcessorCount);
 
+	//
+	// Find the NUMA node of each CPU
+	//
+	NPF_InitCpuNodes();
+	TRACE_MESSAGE1(PACKET_DEBUG_LOUD, "g_NumaBuffers: %d\n", g_NumaBuffers);
+
+	//
+	// Allocate the working storage of the taps, before any of them can run
+	//
+	g_TapScratch = ExAllocatePoolWithTag(NonPagedPool, g_NCpu * sizeof(NPF_TAP_SCRATCH), 'BPWA');
+	if (g_TapScratch == NULL)
+	{
+		TRACE_MESSAGE(PACKET_DEBUG_LOUD, "Failed to allocate the working storage of the taps");
+		TRACE_EXIT();
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
 	//
 	// Register as a service with NDIS
 	//
@@ -384,6 +588,19 @@ DriverEntry(
 #endif
 
 	NdisAllocateSpinLock(&g_OpenArrayLock);
+	NdisAllocateSpinLock(&g_MatchLock);
+
+	ExInitializeFastMutex(&g_RingMutex);
+	InitializeListHead(&g_RingList);
+	Status = PsSetCreateProcessNotifyRoutine(NPF_ProcessNotify, FALSE);
+	if (NT_SUCCESS(Status))
+	{
+		g_RingNotify = TRUE;
+	}
+	else
+	{
+		TRACE_MESSAGE1(PACKET_DEBUG_LOUD, "PsSetCreateProcessNotifyRoutine failed, Status = %x, the capture rings are disabled", Status);
+	}
 
 	TRACE_EXIT();
 	return STATUS_SUCCESS;
@@ -1133,6 +1350,20 @@ Return Value:
 	}
 
 	NdisFreeSpinLock(&g_OpenArrayLock);
+	NdisFreeSpinLock(&g_MatchLock);
+
+	if (g_RingNotify)
+	{
+		PsSetCreateProcessNotifyRoutine(NPF_ProcessNotify, TRUE);
+		g_RingNotify = FALSE;
+	}
+
+	// The filters are detached, no tap runs any more
+	if (g_TapScratch != NULL)
+	{
+		ExFreePool(g_TapScratch);
+		g_TapScratch = NULL;
+	}
 
 	TRACE_EXIT();
 
@@ -1173,143 +1404,641 @@ Return Value:
 
 //-------------------------------------------------------------------
 
-_Use_decl_annotations_
-NTSTATUS
-NPF_IoControl(
-	IN PDEVICE_OBJECT DeviceObject,
-	IN PIRP Irp
+//
+// Discards the profile of the filter of an instance and, if profiling is enabled,
+// allocates zeroed counters for the installed program. Called with the MachineLock held
+//
+static VOID
+NPF_ResetProfile(
+	IN POPEN_INSTANCE Open
 	)
 {
-	POPEN_INSTANCE			Open;
-	PIO_STACK_LOCATION		IrpSp;
-	PLIST_ENTRY				RequestListEntry;
-	PINTERNAL_REQUEST		pRequest;
-	ULONG					FunctionCode;
-	NDIS_STATUS				Status;
-	ULONG					Information = 0;
-	PLIST_ENTRY				PacketListEntry;
-	UINT					i;
-	PUCHAR					tpointer = NULL; //assign NULL to suppress error C4703: potentially uninitialized local pointer variable
-	ULONG					dim, timeout;
-	struct bpf_insn*		NewBpfProgram;
-	PPACKET_OID_DATA		OidData;
-	int*					StatsBuf;
-	ULONG					mode;
-	PWSTR					DumpNameBuff;
-	PUCHAR					TmpBPFProgram;
-	INT						WriteRes;
-	BOOLEAN					SyncWrite = FALSE;
-	struct bpf_insn*		initprogram;
-	ULONG					insns;
-	ULONG					cnt;
-	BOOLEAN					IsExtendedFilter = FALSE;
-	ULONG					StringLength;
-	ULONG					NeededBytes;
-	BOOLEAN					Flag;
-	PUINT					pStats;
-	ULONG					StatsLength;
-	ULONG					combinedPacketFilter;
+	if (Open->Profile != NULL)
+	{
+		ExFreePool(Open->Profile);
+		Open->Profile = NULL;
+	}
 
-	HANDLE					hUserEvent;
-	PKEVENT					pKernelEvent;
-#ifdef _AMD64_
-	VOID* POINTER_32		hUserEvent32Bit;
-#endif //_AMD64_
-	PMDL					mdl;
+	Open->ProfilePackets = 0;
 
-	TRACE_ENTER();
+	if (Open->ProfileEnabled && Open->Filter != NULL && Open->Filter->BpfProgramLength != 0)
+	{
+		Open->Profile = (struct bpf_profile_counter*)ExAllocatePoolWithTag(NonPagedPool, Open->Filter->BpfProgramLength * sizeof(struct bpf_profile_counter), '7PWA');
+		if (Open->Profile != NULL)
+		{
+			RtlZeroMemory(Open->Profile, Open->Filter->BpfProgramLength * sizeof(struct bpf_profile_counter));
+		}
+	}
+}
 
-	IrpSp = IoGetCurrentIrpStackLocation(Irp);
-	FunctionCode = IrpSp->Parameters.DeviceIoControl.IoControlCode;
-	Open = IrpSp->FileObject->FsContext;
+//-------------------------------------------------------------------
 
-	if (NPF_StartUsingOpenInstance(Open) == FALSE)
+VOID
+NPF_FreeFilter(
+	IN PNPF_FILTER Filter
+	)
+{
+	if (Filter == NULL)
 	{
-		//
-		// an IRP_MJ_CLEANUP was received, just fail the request
-		//
-		Irp->IoStatus.Information = 0;
-		Irp->IoStatus.Status = STATUS_CANCELLED;
-		IoCompleteRequest(Irp, IO_NO_INCREMENT);
-		TRACE_EXIT();
-		return STATUS_CANCELLED;
+		return;
 	}
 
-	Irp->IoStatus.Status = STATUS_SUCCESS;
+	if (Filter->bpfprogram != NULL)
+	{
+		ExFreePool(Filter->bpfprogram);
+	}
 
-	TRACE_MESSAGE3(PACKET_DEBUG_LOUD,
-		"Function code is %08lx Input size=%08lx Output size %08lx",
-		FunctionCode,
-		IrpSp->Parameters.DeviceIoControl.InputBufferLength,
-		IrpSp->Parameters.DeviceIoControl.OutputBufferLength);
+	//
+	// Jitted filters are supported on x86 and x86-64 only
+	//
+#ifdef HAVE_BPF_JIT_SUPPORT
+	if (Filter->Jit != NULL)
+	{
+		BPF_Destroy_JIT_Filter(Filter->Jit);
+	}
+#endif // HAVE_BPF_JIT_SUPPORT
 
-	switch (FunctionCode)
+	if (Filter->Shape != NULL)
 	{
-	case BIOCGSTATS:
-		//function to get the capture stats
+		bpf_free_shape(Filter->Shape);
+	}
 
-		TRACE_MESSAGE(PACKET_DEBUG_LOUD, "BIOCGSTATS");
+	if (Filter->DecodedProgram != NULL)
+	{
+		bpf_free_decoded(Filter->DecodedProgram);
+	}
 
-		StatsLength = 4 * sizeof(UINT);
-		if (IrpSp->Parameters.DeviceIoControl.OutputBufferLength < StatsLength)
-		{
-			SET_FAILURE_BUFFER_SMALL();
-			break;
-		}
+	// The verdicts cached for the filter are discarded with it
+	if (Filter->FlowProgram != NULL)
+	{
+		bpf_free_flow(Filter->FlowProgram);
+	}
 
-		if (Irp->UserBuffer == NULL)
-		{
-			SET_FAILURE_UNSUCCESSFUL();
-			break;
-		}
+	// And so are the maps of an extended program
+	if (Filter->ExtendedProgram != NULL)
+	{
+		ebpf_free(Filter->ExtendedProgram);
+	}
 
-		//
-		// temp fix to a GIANT bug from LD. The CTL code has been defined as METHOD_NEITHER, so it
-		// might well be a dangling pointer. We need to probe and lock the address.
-		//
+	if (Filter->MatchSets != 0)
+	{
+		NPF_ReleaseMatchSets(Filter->MatchSets);
+	}
 
-		mdl = NULL;
-		pStats = NULL;
+	ExFreePool(Filter);
+}
 
-		__try
+//-------------------------------------------------------------------
+
+BOOLEAN
+NPF_ReferenceMatchSets(
+	IN POPEN_INSTANCE Open,
+	IN struct bpf_insn* Program,
+	IN UINT Length,
+	OUT PULONG pSets
+	)
+{
+	ULONG Sets = 0;
+	UINT i;
+
+	for (i = 0; i < Length; i++)
+	{
+		if (Program[i].code == (BPF_MISC|BPF_MATCH))
 		{
-			mdl = IoAllocateMdl(Irp->UserBuffer, StatsLength, FALSE, TRUE, NULL);
+			Sets |= 1UL << Program[i].k;
+		}
+	}
 
-			if (mdl == NULL)
-			{
-				SET_FAILURE_UNSUCCESSFUL();
-				break;
-			}
+	*pSets = 0;
+	if (Sets == 0)
+	{
+		return TRUE;
+	}
 
-			MmProbeAndLockPages(mdl, UserMode, IoWriteAccess);
+	NdisAcquireSpinLock(&g_MatchLock);
 
-			pStats = (PUINT)(Irp->UserBuffer);
-		}
-		__except(GetExceptionCode() == STATUS_ACCESS_VIOLATION)
+	for (i = 0; i < BPF_MATCH_MAX_SETS; i++)
+	{
+		if ((Sets & (1UL << i)) && g_MatchOwners[i] != Open)
 		{
-			pStats = NULL;
+			NdisReleaseSpinLock(&g_MatchLock);
+			return FALSE;
 		}
+	}
 
-		if (pStats == NULL)
+	for (i = 0; i < BPF_MATCH_MAX_SETS; i++)
+	{
+		if (Sets & (1UL << i))
 		{
-			if (mdl != NULL)
-			{
-				IoFreeMdl(mdl);
-			}
-
-			SET_FAILURE_UNSUCCESSFUL();
-			break;
+			g_MatchRefs[i]++;
 		}
+	}
 
-		pStats[3] = 0;
-		pStats[0] = 0;
-		pStats[1] = 0;
-		pStats[2] = 0;		// Not yet supported
+	NdisReleaseSpinLock(&g_MatchLock);
 
-		for (i = 0 ; i < g_NCpu ; i++)
-		{
-			pStats[3] += Open->CpuData[i].Accepted;
-			pStats[0] += Open->CpuData[i].Received;
+	*pSets = Sets;
+	return TRUE;
+}
+
+//-------------------------------------------------------------------
+
+VOID
+NPF_ReleaseMatchSets(
+	IN ULONG Sets
+	)
+{
+	UINT i;
+
+	NdisAcquireSpinLock(&g_MatchLock);
+
+	for (i = 0; i < BPF_MATCH_MAX_SETS; i++)
+	{
+		if (Sets & (1UL << i))
+		{
+			g_MatchRefs[i]--;
+		}
+	}
+
+	NdisReleaseSpinLock(&g_MatchLock);
+}
+
+//-------------------------------------------------------------------
+
+VOID
+NPF_FreeMatchSets(
+	IN POPEN_INSTANCE Open
+	)
+{
+	struct bpf_match_set* Sets[BPF_MATCH_MAX_SETS];
+	UINT i;
+
+	NdisAcquireSpinLock(&g_MatchLock);
+
+	for (i = 0; i < BPF_MATCH_MAX_SETS; i++)
+	{
+		Sets[i] = NULL;
+		if (g_MatchOwners[i] == Open)
+		{
+			Sets[i] = bpf_match_sets[i];
+			bpf_match_sets[i] = NULL;
+			g_MatchOwners[i] = NULL;
+		}
+	}
+
+	NdisReleaseSpinLock(&g_MatchLock);
+
+	for (i = 0; i < BPF_MATCH_MAX_SETS; i++)
+	{
+		if (Sets[i] != NULL)
+		{
+			bpf_match_free(Sets[i]);
+		}
+	}
+}
+
+//-------------------------------------------------------------------
+
+/*
+ * Frees a ring, if it is not NULL, then the pages of its shared region, once they are not mapped in the application
+ */
+static VOID
+NPF_FreeRing(
+	IN struct npf_ring* Ring,
+	IN PVOID Memory,
+	IN PMDL Mdl
+	)
+{
+	npf_ring_free(Ring);
+
+	MmUnmapLockedPages(Memory, Mdl);
+	MmFreePagesFromMdl(Mdl);
+	ExFreePool(Mdl);
+}
+
+//-------------------------------------------------------------------
+
+NTSTATUS
+NPF_MapRing(
+	IN POPEN_INSTANCE Open,
+	IN ULONG BlockSize,
+	IN ULONG BlockCount,
+	OUT PVOID* pUserAddress
+	)
+{
+	struct npf_ring* Ring;
+	PMDL Mdl;
+	PVOID Memory;
+	PVOID UserAddress = NULL;
+	PEPROCESS Process;
+	PHYSICAL_ADDRESS LowAddress;
+	PHYSICAL_ADDRESS HighAddress;
+	PHYSICAL_ADDRESS SkipBytes;
+	BOOLEAN Busy;
+	ULONG Size;
+	UINT i;
+
+	// The ring is unmapped when its process exits, and only the owner of the handle maps it
+	if (!g_RingNotify)
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	Process = PsGetCurrentProcess();
+	if (Process != Open->OwnerProcess)
+	{
+		return STATUS_ACCESS_DENIED;
+	}
+
+	Size = npf_ring_memory_size(g_NCpu, BlockSize, BlockCount);
+	if (Size == 0)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (Size > NPF_MAX_RING_SIZE)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	// Pages rather than one large block of the non paged pool: they need not be contiguous
+	LowAddress.QuadPart = 0;
+	HighAddress.QuadPart = -1;
+	SkipBytes.QuadPart = 0;
+
+	Mdl = MmAllocatePagesForMdlEx(LowAddress, HighAddress, SkipBytes, Size, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
+	if (Mdl == NULL)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	Memory = MmMapLockedPagesSpecifyCache(Mdl, KernelMode, MmCached, NULL, FALSE, NormalPagePriority | MdlMappingNoExecute);
+	if (Memory == NULL)
+	{
+		MmFreePagesFromMdl(Mdl);
+		ExFreePool(Mdl);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	Ring = npf_ring_create(g_NCpu, BlockSize, BlockCount, Memory);
+	if (Ring == NULL)
+	{
+		NPF_FreeRing(Ring, Memory, Mdl);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	// Mapping in user space raises an exception on failure
+	__try
+	{
+		UserAddress = MmMapLockedPagesSpecifyCache(Mdl, UserMode, MmCached, NULL, FALSE, NormalPagePriority);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		UserAddress = NULL;
+	}
+
+#ifdef _AMD64_
+	// A 32-bit application cannot reach the ring above 4GB
+	if (UserAddress != NULL && IoIs32bitProcess(NULL) && (ULONG_PTR)UserAddress > MAXULONG)
+	{
+		MmUnmapLockedPages(UserAddress, Mdl);
+		UserAddress = NULL;
+	}
+#endif
+
+	if (UserAddress == NULL)
+	{
+		NPF_FreeRing(Ring, Memory, Mdl);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	// The ring is unmapped in the address space of this process, when it exits at the latest
+	ObReferenceObject(Process);
+
+	ExAcquireFastMutex(&g_RingMutex);
+
+	//
+	// acquire the locks for all the buffers
+	//
+	for (i = 0; i < g_NCpu ; i++)
+	{
+		NdisAcquireSpinLock(&Open->CpuData[i].BufferLock);
+	}
+
+	Busy = (Open->Ring != NULL);
+	if (!Busy)
+	{
+		Open->BufferMdl = Mdl;
+		Open->RingAddress = UserAddress;
+		Open->RingProcess = Process;
+		Open->Ring = Ring;
+	}
+
+	//
+	// release the locks for all the buffers
+	//
+	i = g_NCpu;
+
+	while (i > 0)
+	{
+		i --;
+#pragma warning (disable: 28122)
+		NdisReleaseSpinLock(&Open->CpuData[i].BufferLock);
+	}
+
+	if (!Busy)
+	{
+		InsertTailList(&g_RingList, &Open->RingLink);
+	}
+
+	ExReleaseFastMutex(&g_RingMutex);
+
+	if (Busy)
+	{
+		MmUnmapLockedPages(UserAddress, Mdl);
+		ObDereferenceObject(Process);
+		NPF_FreeRing(Ring, Memory, Mdl);
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+
+	*pUserAddress = UserAddress;
+	return STATUS_SUCCESS;
+}
+
+//-------------------------------------------------------------------
+
+/*
+ * Takes the ring of an instance away from the taps and unmaps it, with g_RingMutex held
+ */
+static VOID
+NPF_DetachRing(
+	IN POPEN_INSTANCE Open
+	)
+{
+	struct npf_ring* Ring;
+	PMDL Mdl;
+	PVOID UserAddress;
+	PEPROCESS Process;
+	KAPC_STATE ApcState;
+	UINT i;
+
+	//
+	// acquire the locks for all the buffers
+	//
+	for (i = 0; i < g_NCpu ; i++)
+	{
+		NdisAcquireSpinLock(&Open->CpuData[i].BufferLock);
+	}
+
+	// No tap stores a packet in the ring once the locks are released
+	Ring = Open->Ring;
+	Mdl = Open->BufferMdl;
+	UserAddress = Open->RingAddress;
+	Process = Open->RingProcess;
+
+	Open->Ring = NULL;
+	Open->BufferMdl = NULL;
+	Open->RingAddress = NULL;
+	Open->RingProcess = NULL;
+
+	//
+	// release the locks for all the buffers
+	//
+	i = g_NCpu;
+
+	while (i > 0)
+	{
+		i --;
+#pragma warning (disable: 28122)
+		NdisReleaseSpinLock(&Open->CpuData[i].BufferLock);
+	}
+
+	if (Ring == NULL)
+	{
+		return;
+	}
+
+	RemoveEntryList(&Open->RingLink);
+
+	// The process has not exited: it would have unmapped the ring with NPF_ProcessNotify()
+	if (PsGetCurrentProcess() == Process)
+	{
+		MmUnmapLockedPages(UserAddress, Mdl);
+	}
+	else
+	{
+		KeStackAttachProcess((PRKPROCESS)Process, &ApcState);
+		MmUnmapLockedPages(UserAddress, Mdl);
+		KeUnstackDetachProcess(&ApcState);
+	}
+
+	ObDereferenceObject(Process);
+	NPF_FreeRing(Ring, npf_ring_memory(Ring), Mdl);
+}
+
+//-------------------------------------------------------------------
+
+VOID
+NPF_UnmapRing(
+	IN POPEN_INSTANCE Open
+	)
+{
+	ExAcquireFastMutex(&g_RingMutex);
+	NPF_DetachRing(Open);
+	ExReleaseFastMutex(&g_RingMutex);
+}
+
+//-------------------------------------------------------------------
+
+VOID
+NPF_ProcessNotify(
+	IN HANDLE ParentId,
+	IN HANDLE ProcessId,
+	IN BOOLEAN Create
+	)
+{
+	PLIST_ENTRY Entry;
+	PLIST_ENTRY Next;
+	POPEN_INSTANCE Open;
+
+	UNREFERENCED_PARAMETER(ParentId);
+
+	if (Create)
+	{
+		return;
+	}
+
+	// Called by the last thread of the process, whose address space is still there
+	ExAcquireFastMutex(&g_RingMutex);
+
+	for (Entry = g_RingList.Flink; Entry != &g_RingList; Entry = Next)
+	{
+		Next = Entry->Flink;
+		Open = CONTAINING_RECORD(Entry, OPEN_INSTANCE, RingLink);
+
+		if (PsGetProcessId(Open->RingProcess) == ProcessId)
+		{
+			NPF_DetachRing(Open);
+		}
+	}
+
+	ExReleaseFastMutex(&g_RingMutex);
+}
+
+//-------------------------------------------------------------------
+
+_Use_decl_annotations_
+NTSTATUS
+NPF_IoControl(
+	IN PDEVICE_OBJECT DeviceObject,
+	IN PIRP Irp
+	)
+{
+	POPEN_INSTANCE			Open;
+	PIO_STACK_LOCATION		IrpSp;
+	PLIST_ENTRY				RequestListEntry;
+	PINTERNAL_REQUEST		pRequest;
+	ULONG					FunctionCode;
+	NDIS_STATUS				Status;
+	ULONG					Information = 0;
+	PLIST_ENTRY				PacketListEntry;
+	UINT					i;
+	PUCHAR					tpointer = NULL; //assign NULL to suppress error C4703: potentially uninitialized local pointer variable
+	PNPF_CPU_BUFFER			CpuBuffers;
+	struct npf_pool*		Pool;
+	struct npf_pool*		OldPool;
+	ULONG					BlockSize, NBlocks, NChunks, Chunk;
+	ULONG					dim, timeout;
+	struct bpf_insn*		NewBpfProgram;
+	PPACKET_OID_DATA		OidData;
+	int*					StatsBuf;
+	ULONG					mode;
+	PWSTR					DumpNameBuff;
+	PUCHAR					TmpBPFProgram;
+	INT						WriteRes;
+	BOOLEAN					SyncWrite = FALSE;
+	struct bpf_insn*		initprogram;
+	ULONG					insns;
+	ULONG					cnt;
+	BOOLEAN					IsExtendedFilter = FALSE;
+	POPEN_INSTANCE			GroupHead;
+	ULONG					StringLength;
+	ULONG					NeededBytes;
+	BOOLEAN					Flag;
+	PUINT					pStats;
+	ULONG					StatsLength;
+	ULONG					combinedPacketFilter;
+	PNPF_FILTER				NewFilter;
+	PNPF_FILTER				OldFilter;
+	LOCK_STATE_EX			GroupLockState;
+	struct bpf_profile*		pProfile;
+	struct bpf_profile_insn*	pProfileInsns;
+	struct ebpf_program_header*	EbpfHeader;
+	ULONG					MapIndex;
+	struct bpf_match_set*	MatchSet;
+	struct npf_ring_request	RingRequest;
+	struct npf_fanout_request	FanoutRequest;
+	PVOID					RingAddress;
+
+	HANDLE					hUserEvent;
+	PKEVENT					pKernelEvent;
+#ifdef _AMD64_
+	VOID* POINTER_32		hUserEvent32Bit;
+#endif //_AMD64_
+	PMDL					mdl;
+
+	TRACE_ENTER();
+
+	IrpSp = IoGetCurrentIrpStackLocation(Irp);
+	FunctionCode = IrpSp->Parameters.DeviceIoControl.IoControlCode;
+	Open = IrpSp->FileObject->FsContext;
+
+	if (NPF_StartUsingOpenInstance(Open) == FALSE)
+	{
+		//
+		// an IRP_MJ_CLEANUP was received, just fail the request
+		//
+		Irp->IoStatus.Information = 0;
+		Irp->IoStatus.Status = STATUS_CANCELLED;
+		IoCompleteRequest(Irp, IO_NO_INCREMENT);
+		TRACE_EXIT();
+		return STATUS_CANCELLED;
+	}
+
+	Irp->IoStatus.Status = STATUS_SUCCESS;
+
+	TRACE_MESSAGE3(PACKET_DEBUG_LOUD,
+		"Function code is %08lx Input size=%08lx Output size %08lx",
+		FunctionCode,
+		IrpSp->Parameters.DeviceIoControl.InputBufferLength,
+		IrpSp->Parameters.DeviceIoControl.OutputBufferLength);
+
+	switch (FunctionCode)
+	{
+	case BIOCGSTATS:
+		//function to get the capture stats
+
+		TRACE_MESSAGE(PACKET_DEBUG_LOUD, "BIOCGSTATS");
+
+		StatsLength = 4 * sizeof(UINT);
+		if (IrpSp->Parameters.DeviceIoControl.OutputBufferLength < StatsLength)
+		{
+			SET_FAILURE_BUFFER_SMALL();
+			break;
+		}
+
+		if (Irp->UserBuffer == NULL)
+		{
+			SET_FAILURE_UNSUCCESSFUL();
+			break;
+		}
+
+		//
+		// temp fix to a GIANT bug from LD. The CTL code has been defined as METHOD_NEITHER, so it
+		// might well be a dangling pointer. We need to probe and lock the address.
+		//
+
+		mdl = NULL;
+		pStats = NULL;
+
+		__try
+		{
+			mdl = IoAllocateMdl(Irp->UserBuffer, StatsLength, FALSE, TRUE, NULL);
+
+			if (mdl == NULL)
+			{
+				SET_FAILURE_UNSUCCESSFUL();
+				break;
+			}
+
+			MmProbeAndLockPages(mdl, UserMode, IoWriteAccess);
+
+			pStats = (PUINT)(Irp->UserBuffer);
+		}
+		__except(GetExceptionCode() == STATUS_ACCESS_VIOLATION)
+		{
+			pStats = NULL;
+		}
+
+		if (pStats == NULL)
+		{
+			if (mdl != NULL)
+			{
+				IoFreeMdl(mdl);
+			}
+
+			SET_FAILURE_UNSUCCESSFUL();
+			break;
+		}
+
+		pStats[3] = 0;
+		pStats[0] = 0;
+		pStats[1] = 0;
+		pStats[2] = 0;		// Not yet supported
+
+		for (i = 0 ; i < g_NCpu ; i++)
+		{
+			pStats[3] += Open->CpuData[i].Accepted;
+			pStats[0] += Open->CpuData[i].Received;
 			pStats[1] += Open->CpuData[i].Dropped;
 			pStats[2] += 0;		// Not yet supported
 		}
@@ -1392,30 +2121,44 @@ NPF_IoControl(
 		}
 
 		//
-		// Lock the machine. After this call we are at DISPATCH level
+		// Build the new filter in all its forms without any lock: meanwhile, the taps keep running the previous one
 		//
-		NdisAcquireSpinLock(&Open->MachineLock);
+		NewFilter = NULL;
 
 		do
 		{
-			// Free the previous buffer if it was present
-			if (Open->bpfprogram != NULL)
-			{
-				TmpBPFProgram = Open->bpfprogram;
-				Open->bpfprogram = NULL;
-				ExFreePool(TmpBPFProgram);
-			}
-
 			//
-			// Jitted filters are supported on x86 (32bit) only
+			// An extended program is verified and loaded with its maps as a whole, it has no other form
 			//
-#ifdef _X86_
-			if (Open->Filter != NULL)
+			EbpfHeader = (struct ebpf_program_header *)NewBpfProgram;
+			if (IrpSp->Parameters.DeviceIoControl.InputBufferLength >= sizeof(struct ebpf_program_header) &&
+				EbpfHeader->magic == EBPF_MAGIC)
 			{
-				BPF_Destroy_JIT_Filter(Open->Filter);
-				Open->Filter = NULL;
+				NewFilter = (PNPF_FILTER)ExAllocatePoolWithTag(NonPagedPool, sizeof(NPF_FILTER), '8PWA');
+				if (NewFilter == NULL)
+				{
+					TRACE_MESSAGE(PACKET_DEBUG_LOUD, "Error - No memory for filter");
+
+					SET_FAILURE_NOMEM();
+					break;
+				}
+
+				RtlZeroMemory(NewFilter, sizeof(NPF_FILTER));
+
+				NewFilter->ExtendedProgram = ebpf_load(EbpfHeader, IrpSp->Parameters.DeviceIoControl.InputBufferLength);
+				if (NewFilter->ExtendedProgram == NULL)
+				{
+					TRACE_MESSAGE(PACKET_DEBUG_LOUD, "Error verifying the extended program");
+
+					SET_FAILURE_INVALID_REQUEST();
+					break;
+				}
+
+				TRACE_MESSAGE1(PACKET_DEBUG_LOUD, "Extended program with %u maps", ebpf_map_count(NewFilter->ExtendedProgram));
+
+				SET_RESULT_SUCCESS(0);
+				break;
 			}
-#endif // _X86_
 
 			insns = (IrpSp->Parameters.DeviceIoControl.InputBufferLength) / sizeof(struct bpf_insn);
 
@@ -1434,7 +2177,11 @@ NPF_IoControl(
 
 				initprogram = &NewBpfProgram[cnt + 1];
 
-				if (bpf_filter_init(initprogram, &(Open->mem_ex), &(Open->tme), &G_Start_Time) != INIT_OK)
+				NdisAcquireSpinLock(&Open->MachineLock);
+				Flag = (bpf_filter_init(initprogram, &(Open->mem_ex), &(Open->tme), &G_Start_Time) == INIT_OK);
+				NdisReleaseSpinLock(&Open->MachineLock);
+
+				if (!Flag)
 				{
 					TRACE_MESSAGE(PACKET_DEBUG_LOUD, "Error initializing NPF machine (bpf_filter_init)");
 
@@ -1472,6 +2219,26 @@ NPF_IoControl(
 					break;
 				}
 
+			NewFilter = (PNPF_FILTER)ExAllocatePoolWithTag(NonPagedPool, sizeof(NPF_FILTER), '8PWA');
+			if (NewFilter == NULL)
+			{
+				TRACE_MESSAGE(PACKET_DEBUG_LOUD, "Error - No memory for filter");
+
+				SET_FAILURE_NOMEM();
+				break;
+			}
+
+			RtlZeroMemory(NewFilter, sizeof(NPF_FILTER));
+
+			// The pattern sets that the program searches must be installed by this instance, and stay until the filter is freed
+			if (!NPF_ReferenceMatchSets(Open, NewBpfProgram, cnt, &NewFilter->MatchSets))
+			{
+				TRACE_MESSAGE(PACKET_DEBUG_LOUD, "Error - The filter searches a pattern set that is not installed");
+
+				SET_FAILURE_INVALID_REQUEST();
+				break;
+			}
+
 			// Allocate the memory to contain the new filter program
 			// We could need the original BPF binary if we are forced to use bpf_filter_with_2_buffers()
 			TmpBPFProgram = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool, cnt * sizeof(struct bpf_insn), '4PWA');
@@ -1484,38 +2251,153 @@ NPF_IoControl(
 				break;
 			}
 
+			NewFilter->bpfprogram = TmpBPFProgram;
+
+			//copy the program in the new buffer
+			RtlCopyMemory(TmpBPFProgram, NewBpfProgram, cnt * sizeof(struct bpf_insn));
+
+			//
+			// Optimize the copy. The optimizer does not know the TME extensions and leaves
+			// those programs alone; if its output does not validate, the original program
+			// is installed instead
+			//
+			if (!IsExtendedFilter)
+			{
+				insns = (ULONG)bpf_optimize((struct bpf_insn *)TmpBPFProgram, (int)cnt);
+
+				TRACE_MESSAGE2(PACKET_DEBUG_LOUD, "Optimized program: %u instructions instead of %u", insns, cnt);
+
+#ifdef HAVE_BUGGY_TME_SUPPORT
+				if (bpf_validate((struct bpf_insn *)TmpBPFProgram, insns, Open->mem_ex.size) == 0)
+#else //HAVE_BUGGY_TME_SUPPORT
+				if (bpf_validate((struct bpf_insn *)TmpBPFProgram, insns) == 0)
+#endif //HAVE_BUGGY_TME_SUPPORT
+				{
+					TRACE_MESSAGE(PACKET_DEBUG_LOUD, "The optimized program does not validate, using the original one");
+
+					RtlCopyMemory(TmpBPFProgram, NewBpfProgram, cnt * sizeof(struct bpf_insn));
+					insns = cnt;
+				}
+			}
+
+			//
+			// The programs of the common expressions have a native matcher: they are recognized as libpcap
+			// generates them, i.e. in the original program. It wins over the jitted filter, which is left
+			// with the packets stored in several buffers
+			//
+			if (!IsExtendedFilter)
+			{
+				NewFilter->Shape = bpf_shape_recognize(NewBpfProgram, (int)cnt);
+				if (NewFilter->Shape != NULL)
+				{
+					TRACE_MESSAGE1(PACKET_DEBUG_LOUD, "The filter has the shape \"%s\"", bpf_shape_name(NewFilter->Shape));
+				}
+			}
+
+			//
+			// At the moment the JIT compiler works on x86 and x86-64 only. If it fails, the filter falls
+			// back to the engines below
+			//
+#ifdef HAVE_BPF_JIT_SUPPORT
+			// Create the new JIT filter function
+			if (!IsExtendedFilter)
+			{
+				if ((NewFilter->Jit = BPF_jitter((struct bpf_insn *)TmpBPFProgram, insns)) == NULL)
+				{
+					TRACE_MESSAGE(PACKET_DEBUG_LOUD, "Error jittering filter, using the interpreter");
+				}
+			}
+#endif //HAVE_BPF_JIT_SUPPORT
+
+			//
+			// Without a shape nor a jitted filter, the program is pre-decoded for the threaded interpreter.
+			// This is best effort: if it fails, bpf_filter() runs the program as it is
+			//
+#ifdef HAVE_BPF_JIT_SUPPORT
+			if (!IsExtendedFilter && NewFilter->Shape == NULL && NewFilter->Jit == NULL)
+#else //HAVE_BPF_JIT_SUPPORT
+			if (!IsExtendedFilter && NewFilter->Shape == NULL)
+#endif //HAVE_BPF_JIT_SUPPORT
+			{
+				NewFilter->DecodedProgram = bpf_decode((struct bpf_insn *)TmpBPFProgram, insns);
+				if (NewFilter->DecodedProgram == NULL)
+				{
+					TRACE_MESSAGE(PACKET_DEBUG_LOUD, "Cannot decode the filter, using the plain interpreter");
+				}
+			}
+
 			//
-			// At the moment the JIT compiler works on x86 (32 bit) only
+			// Find the bytes the filter reads, to cache its verdicts for each flow. This is best effort too
 			//
-#ifdef _X86_
-			// Create the new JIT filter function
 			if (!IsExtendedFilter)
 			{
-				if ((Open->Filter = BPF_jitter(NewBpfProgram, cnt)) == NULL)
+				NewFilter->FlowProgram = bpf_flow_compile((struct bpf_insn *)TmpBPFProgram, insns, g_NCpu);
+				if (NewFilter->FlowProgram == NULL)
 				{
-					TRACE_MESSAGE(PACKET_DEBUG_LOUD, "Error jittering filter");
+					TRACE_MESSAGE(PACKET_DEBUG_LOUD, "The verdicts of the filter cannot be cached");
+				}
+			}
 
-					ExFreePool(TmpBPFProgram);
+			//
+			// And the conditions on fixed bytes that every accepted packet meets, to reject the others with
+			// a vector compare or two before running the filter
+			//
+			if (!IsExtendedFilter)
+			{
+				bpf_prefilter_compile((struct bpf_insn *)TmpBPFProgram, insns, &NewFilter->Prefilter);
 
-					SET_FAILURE_UNSUCCESSFUL();
-					break;
-				}
+				TRACE_MESSAGE1(PACKET_DEBUG_LOUD, "The prefilter of the filter has %u windows", NewFilter->Prefilter.windows);
 			}
-#endif //_X86_
 
-			//copy the program in the new buffer
-			RtlCopyMemory(TmpBPFProgram, NewBpfProgram, cnt * sizeof(struct bpf_insn));
-			Open->bpfprogram = TmpBPFProgram;
+			NewFilter->BpfProgramLength = IsExtendedFilter ? 0 : insns;
 
 			SET_RESULT_SUCCESS(0);
 		}
 		while (FALSE);
 
+		if (Status != STATUS_SUCCESS)
+		{
+			// The previous filter stays in place
+			NPF_FreeFilter(NewFilter);
+			break;
+		}
+
 		//
-		// release the machine lock and then reset the buffer
+		// Publish the new filter. The exclusive lock of the group waits for the taps that may be running the
+		// previous one, and drops the group classifier that merged it
 		//
+		GroupHead = Open->GroupHead;
+		if (GroupHead != NULL)
+		{
+			NdisAcquireRWLockWrite(GroupHead->GroupLock, &GroupLockState, 0);
+		}
+
+		NdisAcquireSpinLock(&Open->MachineLock);
+
+		OldFilter = (PNPF_FILTER)InterlockedExchangePointer((PVOID volatile *)&Open->Filter, NewFilter);
+
+		// The counters of the previous filter are meaningless for the new one
+		NPF_ResetProfile(Open);
+
 		NdisReleaseSpinLock(&Open->MachineLock);
 
+		// The classifier merged the previous filter: the instances filter on their own until it is rebuilt
+		if (GroupHead != NULL)
+		{
+			NPF_InvalidateGroupClassifier(GroupHead);
+			NdisReleaseRWLock(GroupHead->GroupLock, &GroupLockState);
+		}
+
+		//
+		// No tap can use the previous filter any more: free it and then reset the buffer
+		//
+		NPF_FreeFilter(OldFilter);
+
+		if (GroupHead != NULL)
+		{
+			NPF_UpdateGroupClassifier(GroupHead);
+		}
+
 		NPF_ResetBufferContents(Open);
 
 		break;
@@ -1809,59 +2691,93 @@ NPF_IoControl(
 			break;
 		}
 
-		if (dim / g_NCpu < sizeof(struct PacketHeader))
+		// The buffer is a pool of blocks shared by the CPUs
+		BlockSize = npf_pool_block_size(dim);
+		NBlocks = BlockSize != 0 ? dim / BlockSize : 0;
+
+		// The new chunks of blocks, then the old ones once they are swapped
+		CpuBuffers = ExAllocatePoolWithTag(NonPagedPool, g_NCpu * sizeof(NPF_CPU_BUFFER), '6PWA');
+		if (CpuBuffers == NULL)
 		{
-			dim = 0;
+			// no memory
+			SET_FAILURE_NOMEM();
+			break;
 		}
-		else
+
+		RtlZeroMemory(CpuBuffers, g_NCpu * sizeof(NPF_CPU_BUFFER));
+
+		Pool = NULL;
+		Flag = TRUE;
+		if (NBlocks > 0)
 		{
-			tpointer = ExAllocatePoolWithTag(NonPagedPool, dim, '6PWA');
-			if (tpointer == NULL)
+			Pool = npf_pool_create(g_NCpu, BlockSize, NBlocks);
+			Flag = (Pool != NULL);
+		}
+
+		//
+		// allocate the blocks in a chunk for each CPU, on the NUMA node of the CPU, or for some of them
+		// if there are fewer blocks than CPUs
+		//
+		NChunks = min(g_NCpu, NBlocks);
+		for (Chunk = 0; Flag && Chunk < NChunks; Chunk++)
+		{
+			i = Chunk * g_NCpu / NChunks;
+			cnt = NBlocks * (Chunk + 1) / NChunks - NBlocks * Chunk / NChunks;
+
+			CpuBuffers[i].Buffer = NPF_AllocateCpuBuffer(i, cnt * BlockSize, &CpuBuffers[i].Pages);
+			if (CpuBuffers[i].Buffer == NULL)
 			{
-				// no memory
-				SET_FAILURE_NOMEM();
+				Flag = FALSE;
 				break;
 			}
+
+			npf_pool_add(Pool, CpuBuffers[i].Buffer, cnt);
 		}
 
-		//
-		// acquire the locks for all the buffers
-		//
-		for (i = 0; i < g_NCpu ; i++)
+		if (!Flag)
 		{
-			NdisAcquireSpinLock(&Open->CpuData[i].BufferLock);
+			for (i = 0; i < g_NCpu; i++)
+			{
+				NPF_FreeCpuBuffer(CpuBuffers[i].Buffer, CpuBuffers[i].Pages);
+			}
+			ExFreePool(CpuBuffers);
+			npf_pool_free(Pool);
+
+			// no memory
+			SET_FAILURE_NOMEM();
+			break;
 		}
 
 		//
-		// free the old buffer, if any
+		// keep the readers out until the old pool is freed, and acquire the locks for all the buffers
 		//
-		if (Open->CpuData[0].Buffer != NULL)
+		ExAcquireFastMutex(&Open->ReadMutex);
+
+		for (i = 0; i < g_NCpu ; i++)
 		{
-			ExFreePool(Open->CpuData[0].Buffer);
-			Open->CpuData[0].Buffer = NULL;
+			NdisAcquireSpinLock(&Open->CpuData[i].BufferLock);
 		}
 
 		for (i = 0 ; i < g_NCpu ; i++)
 		{
-			if (dim > 0)
-				Open->CpuData[i].Buffer = (PUCHAR)tpointer + (dim / g_NCpu) * i;
-			else
-				Open->CpuData[i].Buffer = NULL;
-			Open->CpuData[i].Free = dim / g_NCpu;
-			Open->CpuData[i].P = 0;
-			Open->CpuData[i].C = 0;
+			tpointer = Open->CpuData[i].Buffer;
+			mdl = Open->CpuData[i].BufferPages;
+			Open->CpuData[i].Buffer = CpuBuffers[i].Buffer;
+			Open->CpuData[i].BufferPages = CpuBuffers[i].Pages;
+			CpuBuffers[i].Buffer = tpointer;
+			CpuBuffers[i].Pages = mdl;
+
 			Open->CpuData[i].Accepted = 0;
 			Open->CpuData[i].Dropped = 0;
 			Open->CpuData[i].Received = 0;
 		}
 
-		Open->ReaderSN = 0;
-		Open->WriterSN = 0;
-
-		Open->Size = dim / g_NCpu;
+		OldPool = Open->Pool;
+		Open->Pool = Pool;
+		Open->Size = NBlocks * BlockSize;
 
 		//
-		// acquire the locks for all the buffers
+		// release the locks for all the buffers
 		//
 		i = g_NCpu;
 
@@ -1872,6 +2788,18 @@ NPF_IoControl(
 			NdisReleaseSpinLock(&Open->CpuData[i].BufferLock);
 		}
 
+		//
+		// free the old pool and its blocks, if any
+		//
+		npf_pool_free(OldPool);
+		for (i = 0; i < g_NCpu; i++)
+		{
+			NPF_FreeCpuBuffer(CpuBuffers[i].Buffer, CpuBuffers[i].Pages);
+		}
+		ExFreePool(CpuBuffers);
+
+		ExReleaseFastMutex(&Open->ReadMutex);
+
 		SET_RESULT_SUCCESS(0);
 		break;
 
@@ -1933,6 +2861,294 @@ NPF_IoControl(
 		SET_RESULT_SUCCESS(0);
 		break;
 
+	case BIOCSPROFILE:
+		//enable (and reset) or disable the profiling of the filter
+
+		TRACE_MESSAGE(PACKET_DEBUG_LOUD, "BIOCSPROFILE");
+
+		if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG))
+		{
+			SET_FAILURE_BUFFER_SMALL();
+			break;
+		}
+
+		// Like the filter, the counters are replaced only while no tap runs it
+		GroupHead = Open->GroupHead;
+		if (GroupHead != NULL)
+		{
+			NdisAcquireRWLockWrite(GroupHead->GroupLock, &GroupLockState, 0);
+		}
+
+		NdisAcquireSpinLock(&Open->MachineLock);
+
+		Open->ProfileEnabled = (*((PULONG)Irp->AssociatedIrp.SystemBuffer) != 0);
+		NPF_ResetProfile(Open);
+		Flag = (Open->ProfileEnabled && Open->Filter != NULL && Open->Filter->BpfProgramLength != 0 && Open->Profile == NULL);
+
+		NdisReleaseSpinLock(&Open->MachineLock);
+
+		if (GroupHead != NULL)
+		{
+			NdisReleaseRWLock(GroupHead->GroupLock, &GroupLockState);
+		}
+
+		if (Flag)
+		{
+			SET_FAILURE_NOMEM();
+			break;
+		}
+
+		SET_RESULT_SUCCESS(0);
+		break;
+
+	case BIOCGPROFILE:
+		//get the per-instruction counters of the filter
+
+		TRACE_MESSAGE(PACKET_DEBUG_LOUD, "BIOCGPROFILE");
+
+		if (IrpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(struct bpf_profile))
+		{
+			SET_FAILURE_BUFFER_SMALL();
+			break;
+		}
+
+		pProfile = (struct bpf_profile*)Irp->AssociatedIrp.SystemBuffer;
+		pProfileInsns = (struct bpf_profile_insn*)(pProfile + 1);
+
+		NdisAcquireSpinLock(&Open->MachineLock);
+
+		pProfile->bp_len = (Open->Profile != NULL) ? Open->Filter->BpfProgramLength : 0;
+		pProfile->bp_reserved = 0;
+		pProfile->bp_packets = Open->ProfilePackets;
+
+		// Copy as many instructions as fit, bp_len tells the caller if the buffer was too small
+		for (i = 0;
+			i < pProfile->bp_len && sizeof(struct bpf_profile) + (i + 1) * sizeof(struct bpf_profile_insn) <= IrpSp->Parameters.DeviceIoControl.OutputBufferLength;
+			i++)
+		{
+			pProfileInsns[i].bp_insn = ((struct bpf_insn*)Open->Filter->bpfprogram)[i];
+			pProfileInsns[i].bp_counter = Open->Profile[i];
+		}
+
+		NdisReleaseSpinLock(&Open->MachineLock);
+
+		SET_RESULT_SUCCESS(sizeof(struct bpf_profile) + i * sizeof(struct bpf_profile_insn));
+		break;
+
+	case BIOCGMAP:
+		//get the content of a map of the extended program
+
+		TRACE_MESSAGE(PACKET_DEBUG_LOUD, "BIOCGMAP");
+
+		if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG) ||
+			IrpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(struct ebpf_map_info))
+		{
+			SET_FAILURE_BUFFER_SMALL();
+			break;
+		}
+
+		// Input and output share the system buffer
+		MapIndex = *(PULONG)Irp->AssociatedIrp.SystemBuffer;
+
+		NdisAcquireSpinLock(&Open->MachineLock);
+
+		dim = 0;
+		if (Open->Filter != NULL && Open->Filter->ExtendedProgram != NULL)
+		{
+			dim = ebpf_map_dump(Open->Filter->ExtendedProgram, MapIndex, (struct ebpf_map_info*)Irp->AssociatedIrp.SystemBuffer,
+				IrpSp->Parameters.DeviceIoControl.OutputBufferLength);
+		}
+
+		NdisReleaseSpinLock(&Open->MachineLock);
+
+		if (dim == 0)
+		{
+			SET_FAILURE_INVALID_REQUEST();
+			break;
+		}
+
+		SET_RESULT_SUCCESS(dim);
+		break;
+
+	case BIOCSMATCH:
+		//install a set of patterns
+
+		TRACE_MESSAGE(PACKET_DEBUG_LOUD, "BIOCSMATCH");
+
+		if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(struct bpf_match_header) ||
+			IrpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ULONG))
+		{
+			SET_FAILURE_BUFFER_SMALL();
+			break;
+		}
+
+		// The automaton is built without any lock
+		MatchSet = bpf_match_compile(Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.DeviceIoControl.InputBufferLength);
+		if (MatchSet == NULL)
+		{
+			TRACE_MESSAGE(PACKET_DEBUG_LOUD, "Error compiling the pattern set");
+
+			SET_FAILURE_INVALID_REQUEST();
+			break;
+		}
+
+		NdisAcquireSpinLock(&g_MatchLock);
+
+		for (MapIndex = 0; MapIndex < BPF_MATCH_MAX_SETS; MapIndex++)
+		{
+			if (g_MatchOwners[MapIndex] == NULL)
+			{
+				g_MatchOwners[MapIndex] = Open;
+				g_MatchRefs[MapIndex] = 0;
+				bpf_match_sets[MapIndex] = MatchSet;
+				break;
+			}
+		}
+
+		NdisReleaseSpinLock(&g_MatchLock);
+
+		if (MapIndex == BPF_MATCH_MAX_SETS)
+		{
+			TRACE_MESSAGE(PACKET_DEBUG_LOUD, "Error - Too many pattern sets");
+
+			bpf_match_free(MatchSet);
+			SET_FAILURE_NOMEM();
+			break;
+		}
+
+		TRACE_MESSAGE1(PACKET_DEBUG_LOUD, "Pattern set %u installed", MapIndex);
+
+		*(PULONG)Irp->AssociatedIrp.SystemBuffer = MapIndex;
+		SET_RESULT_SUCCESS(sizeof(ULONG));
+		break;
+
+	case BIOCDMATCH:
+		//delete a set of patterns
+
+		TRACE_MESSAGE(PACKET_DEBUG_LOUD, "BIOCDMATCH");
+
+		if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG))
+		{
+			SET_FAILURE_BUFFER_SMALL();
+			break;
+		}
+
+		MapIndex = *(PULONG)Irp->AssociatedIrp.SystemBuffer;
+		MatchSet = NULL;
+
+		NdisAcquireSpinLock(&g_MatchLock);
+
+		// A set searched by the filter cannot go away under the taps that run it
+		if (MapIndex < BPF_MATCH_MAX_SETS && g_MatchOwners[MapIndex] == Open && g_MatchRefs[MapIndex] == 0)
+		{
+			MatchSet = bpf_match_sets[MapIndex];
+			bpf_match_sets[MapIndex] = NULL;
+			g_MatchOwners[MapIndex] = NULL;
+		}
+
+		NdisReleaseSpinLock(&g_MatchLock);
+
+		if (MatchSet == NULL)
+		{
+			SET_FAILURE_INVALID_REQUEST();
+			break;
+		}
+
+		bpf_match_free(MatchSet);
+
+		SET_RESULT_SUCCESS(0);
+		break;
+
+	case BIOCSETRING:
+		//map or unmap the capture ring
+
+		TRACE_MESSAGE(PACKET_DEBUG_LOUD, "BIOCSETRING");
+
+		if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(struct npf_ring_request))
+		{
+			SET_FAILURE_BUFFER_SMALL();
+			break;
+		}
+
+		RingRequest = *(struct npf_ring_request*)Irp->AssociatedIrp.SystemBuffer;
+
+		if (RingRequest.nblocks == 0)
+		{
+			NPF_UnmapRing(Open);
+
+			SET_RESULT_SUCCESS(0);
+			break;
+		}
+
+		if (IrpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ULONGLONG))
+		{
+			SET_FAILURE_BUFFER_SMALL();
+			break;
+		}
+
+		Status = NPF_MapRing(Open, RingRequest.block_size, RingRequest.nblocks, &RingAddress);
+		if (Status != STATUS_SUCCESS)
+		{
+			Information = 0;
+			break;
+		}
+
+		// The address of the ring in the application, the same size for 32-bit and 64-bit applications
+		*(ULONGLONG*)Irp->AssociatedIrp.SystemBuffer = (ULONGLONG)(ULONG_PTR)RingAddress;
+
+		SET_RESULT_SUCCESS(sizeof(ULONGLONG));
+		break;
+
+	case BIOCFLUSHRING:
+		//give the packets waiting in the open blocks of the ring to the application
+
+		TRACE_MESSAGE(PACKET_DEBUG_LOUD, "BIOCFLUSHRING");
+
+		Flag = FALSE;
+
+		for (i = 0; i < g_NCpu; i++)
+		{
+			NdisAcquireSpinLock(&Open->CpuData[i].BufferLock);
+			if (Open->Ring != NULL)
+			{
+				npf_ring_close(Open->Ring, i);
+				Flag = TRUE;
+			}
+			NdisReleaseSpinLock(&Open->CpuData[i].BufferLock);
+		}
+
+		if (!Flag)
+		{
+			SET_FAILURE_INVALID_REQUEST();
+			break;
+		}
+
+		SET_RESULT_SUCCESS(0);
+		break;
+
+	case BIOCSETFANOUT:
+		//join or leave a fanout group
+
+		TRACE_MESSAGE(PACKET_DEBUG_LOUD, "BIOCSETFANOUT");
+
+		if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(struct npf_fanout_request))
+		{
+			SET_FAILURE_BUFFER_SMALL();
+			break;
+		}
+
+		FanoutRequest = *(struct npf_fanout_request*)Irp->AssociatedIrp.SystemBuffer;
+
+		if (FanoutRequest.mode > NPF_FANOUT_MAX_MODE)
+		{
+			SET_FAILURE_INVALID_REQUEST();
+			break;
+		}
+
+		Status = NPF_SetFanout(Open, FanoutRequest.id, FanoutRequest.mode);
+		Information = 0;
+		break;
+
 	case BIOCQUERYOID:
 	case BIOCSETOID:
 
@@ -2316,24 +3532,25 @@ NPF_ResetBufferContents(
 	UINT i;
 
 	//
-	// lock all the buffers
+	// keep the readers out, they could be copying from the blocks, and lock all the buffers
 	//
+	ExAcquireFastMutex(&Open->ReadMutex);
+
 	for (i = 0 ; i < g_NCpu ; i++)
 	{
 		NdisAcquireSpinLock(&Open->CpuData[i].BufferLock);
 	}
 
-	Open->ReaderSN = 0;
-	Open->WriterSN = 0;
-
 	//
-	// reset their pointers
+	// put all the blocks back in the pool
 	//
+	if (Open->Pool != NULL)
+	{
+		npf_pool_reset(Open->Pool);
+	}
+
 	for (i = 0 ; i < g_NCpu ; i++)
 	{
-		Open->CpuData[i].C = 0;
-		Open->CpuData[i].P = 0;
-		Open->CpuData[i].Free = Open->Size;
 		Open->CpuData[i].Accepted = 0;
 		Open->CpuData[i].Dropped = 0;
 		Open->CpuData[i].Received = 0;
@@ -2349,4 +3566,6 @@ NPF_ResetBufferContents(
 		i--;
 		NdisReleaseSpinLock(&Open->CpuData[i].BufferLock);
 	}
+
+	ExReleaseFastMutex(&Open->ReadMutex);
 }
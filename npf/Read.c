@@ -30,6 +30,163 @@ extern ULONG	g_DltNullMode;
 
 //-------------------------------------------------------------------
 
+//
+// Copies the packets of an unordered instance in the Length bytes at Buffer, in runs: all the packets
+// of a CPU, then all those of the next one, starting with the CPU at which the previous read stopped,
+// without looking at their stamps. Each packet gets a struct bpf_cpu_hdr. Returns the number of bytes
+// copied.
+//
+static ULONG
+NPF_ReadRuns(
+	IN POPEN_INSTANCE Open,
+	IN struct npf_pool* Pool,
+	IN PUCHAR Buffer,
+	IN ULONG Length
+	)
+{
+	struct PacketHeader*	Header;
+	struct bpf_cpu_hdr*		CpuHeader;
+	ULONG					Copied = 0;
+	ULONG					Cpu, n, plen;
+
+	for (n = 0; n < g_NCpu; n++)
+	{
+		Cpu = (Open->ReadCpu + n) % g_NCpu;
+
+		Header = (struct PacketHeader*)npf_pool_peek(Pool, Cpu);
+		if (Header == NULL && npf_pool_held(Pool, Cpu))
+		{
+			// no packet on this CPU since the previous read: its blocks go back to the CPUs that get the traffic
+			NdisAcquireSpinLock(&Open->CpuData[Cpu].BufferLock);
+			npf_pool_trim(Pool, Cpu);
+			NdisReleaseSpinLock(&Open->CpuData[Cpu].BufferLock);
+		}
+
+		while (Header != NULL)
+		{
+			plen = Header->header.bh_caplen;
+			// the padding after the packet too, so that Copied never passes Length
+			if (sizeof(struct bpf_cpu_hdr) + Packet_WORDALIGN(plen) > Length - Copied)
+			{
+				// the rest of the run is for the next read
+				Open->ReadCpu = Cpu;
+				return Copied;
+			}
+
+			CpuHeader = (struct bpf_cpu_hdr*)(Buffer + Copied);
+			CpuHeader->header = Header->header;
+			CpuHeader->header.bh_hdrlen = sizeof(struct bpf_cpu_hdr);
+			CpuHeader->cpu = Cpu;
+			Copied += sizeof(struct bpf_cpu_hdr);
+
+			RtlCopyMemory(Buffer + Copied, (PUCHAR)(Header + 1), plen);
+			Copied += Packet_WORDALIGN(plen);
+
+			npf_pool_consume(Pool, Cpu, sizeof(struct PacketHeader) + plen);
+			Header = (struct PacketHeader*)npf_pool_peek(Pool, Cpu);
+		}
+	}
+
+	// every CPU was drained: the next read starts with another one
+	Open->ReadCpu = (Open->ReadCpu + 1) % g_NCpu;
+
+	return Copied;
+}
+
+//-------------------------------------------------------------------
+
+//
+// Copies the packets of an instance in the Length bytes at Buffer, merging the CPUs in the order of the
+// stamps of their packets. A packet is stamped and stored under the lock of the buffer of its CPU: once
+// every lock has been taken after ReadStamp, all the packets stamped before it are in the buffers. They
+// are copied, the later ones are left for the next read, so that no packet stored afterwards on another
+// CPU can come before those already copied. Returns the number of bytes copied.
+//
+static ULONG
+NPF_ReadMerged(
+	IN POPEN_INSTANCE Open,
+	IN struct npf_pool* Pool,
+	IN PUCHAR Buffer,
+	IN ULONG Length
+	)
+{
+	struct PacketHeader*	Header;
+	ULONGLONG				ReadStamp;
+	u_int					MergeCount;
+	ULONG					Copied = 0;
+	ULONG					Cpu, plen;
+
+	ReadStamp = (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart;
+	for (Cpu = 0; Cpu < g_NCpu; Cpu++)
+	{
+		NdisAcquireSpinLock(&Open->CpuData[Cpu].BufferLock);
+		NdisReleaseSpinLock(&Open->CpuData[Cpu].BufferLock);
+	}
+
+	//
+	// the CPUs with packets to be copied, the one with the oldest first packet on top
+	//
+	MergeCount = 0;
+	for (Cpu = 0; Cpu < g_NCpu; Cpu++)
+	{
+		Header = (struct PacketHeader*)npf_pool_peek(Pool, Cpu);
+
+		if (Header != NULL)
+		{
+			if (Header->Stamp <= ReadStamp)
+			{
+				npf_merge_push(Open->Merge, &MergeCount, Header->Stamp, Cpu);
+			}
+		}
+		else if (npf_pool_held(Pool, Cpu))
+		{
+			// no packet on this CPU since the previous read: its blocks go back to the CPUs that get the traffic
+			NdisAcquireSpinLock(&Open->CpuData[Cpu].BufferLock);
+			npf_pool_trim(Pool, Cpu);
+			NdisReleaseSpinLock(&Open->CpuData[Cpu].BufferLock);
+		}
+	}
+
+	while (MergeCount > 0)
+	{
+		Cpu = Open->Merge[0].cpu;
+		Header = (struct PacketHeader*)npf_pool_peek(Pool, Cpu);
+
+		plen = Header->header.bh_caplen;
+		if (sizeof(struct bpf_hdr) + Packet_WORDALIGN(plen) > Length - Copied)
+		{
+			//if the packet does not fit into the user buffer, we've ended copying packets
+			break;
+		}
+
+		*((struct bpf_hdr *) (Buffer + Copied)) = Header->header;
+		Copied += sizeof(struct bpf_hdr);
+
+		// a packet is never split between two blocks
+		RtlCopyMemory(Buffer + Copied, (PUCHAR)(Header + 1), plen);
+		Copied += Packet_WORDALIGN(plen);
+
+		npf_pool_consume(Pool, Cpu, sizeof(struct PacketHeader) + plen);
+
+		//
+		// the packets of the CPU stamped up to ReadStamp were all there from the start
+		//
+		Header = (struct PacketHeader*)npf_pool_peek(Pool, Cpu);
+		if (Header != NULL && Header->Stamp <= ReadStamp)
+		{
+			npf_merge_update(Open->Merge, MergeCount, Header->Stamp);
+		}
+		else
+		{
+			npf_merge_pop(Open->Merge, &MergeCount);
+		}
+	}
+
+	return Copied;
+}
+
+//-------------------------------------------------------------------
+
 _Use_decl_annotations_
 NTSTATUS
 NPF_Read(
@@ -53,8 +210,8 @@ NPF_Read(
 	ULONG					bytecopy;
 	UINT					SizeToCopy;
 	UINT					PktLen;
-	ULONG					copied, count, current_cpu, av, plen, increment, ToCopy, available;
-	CpuPrivateData*			LocalData;
+	ULONG					copied, av, available;
+	struct npf_pool*		Pool;
 	ULONG					i;
 	ULONG					Occupation;
 
@@ -92,26 +249,45 @@ NPF_Read(
 	}
 	NPF_StopUsingBinding(Open->GroupHead);
 
-	if (Open->Size == 0)
+	// The packets are read in the capture ring while it is mapped
+	if (Open->Ring != NULL)
 	{
 		NPF_StopUsingOpenInstance(Open);
 		TRACE_EXIT();
 		EXIT_FAILURE(0);
 	}
 
-	if (Open->mode & MODE_DUMP && Open->DumpFileHandle == NULL)
+	//
+	// BIOCSETBUFFERSIZE replaces the pool, and NPF_ResetBufferContents() empties it, under the ReadMutex,
+	// that the readers hold whenever they look at it
+	//
+	ExAcquireFastMutex(&Open->ReadMutex);
+
+	Pool = Open->Pool;
+	Occupation = 0;
+	if (Pool != NULL)
+	{
+		for (i = 0; i < g_NCpu; i++)
+		{
+			Occupation += npf_pool_pending(Pool, i);
+		}
+	}
+
+	ExReleaseFastMutex(&Open->ReadMutex);
+
+	if (Pool == NULL)
 	{
-		// this instance is in dump mode, but the dump file has still not been opened
 		NPF_StopUsingOpenInstance(Open);
 		TRACE_EXIT();
 		EXIT_FAILURE(0);
 	}
 
-	Occupation = 0;
-
-	for (i = 0; i < g_NCpu; i++)
+	if (Open->mode & MODE_DUMP && Open->DumpFileHandle == NULL)
 	{
-		Occupation += (Open->Size - Open->CpuData[i].Free);
+		// this instance is in dump mode, but the dump file has still not been opened
+		NPF_StopUsingOpenInstance(Open);
+		TRACE_EXIT();
+		EXIT_FAILURE(0);
 	}
 
 	//See if the buffer is full enough to be copied
@@ -287,8 +463,13 @@ NPF_Read(
 
 		Occupation = 0;
 
-		for (i = 0; i < g_NCpu; i++)
-			Occupation += (Open->Size - Open->CpuData[i].Free);
+		ExAcquireFastMutex(&Open->ReadMutex);
+		if (Open->Pool != NULL)
+		{
+			for (i = 0; i < g_NCpu; i++)
+				Occupation += npf_pool_pending(Open->Pool, i);
+		}
+		ExReleaseFastMutex(&Open->ReadMutex);
 
 
 		if (Occupation == 0 || Open->mode & MODE_DUMP)
@@ -314,8 +495,6 @@ NPF_Read(
 
 	//------------------------------------------------------------------------------
 	copied = 0;
-	count = 0;
-	current_cpu = 0;
 	available = IrpSp->Parameters.Read.Length;
 
 	if (Irp->MdlAddress == 0x0)
@@ -338,96 +517,31 @@ NPF_Read(
 	if (Open->ReadEvent != NULL)
 		KeClearEvent(Open->ReadEvent);
 
-	while (count < g_NCpu) //round robin on the CPUs, if count = NCpu there are no packets left to be copied
-	{
-		if (available == copied)
-		{
-			NPF_StopUsingOpenInstance(Open);
-			TRACE_EXIT();
-			EXIT_SUCCESS(copied);
-		}
-
-		LocalData = &Open->CpuData[current_cpu];
-
-		if (LocalData->Free < Open->Size)
-		{
-			//there are some packets in the selected (aka LocalData) buffer
-			struct PacketHeader* Header = (struct PacketHeader*)(LocalData->Buffer + LocalData->C);
-
-			if (Header->SN == Open->ReaderSN)
-			{
-				//check if it the next one to be copied
-				plen = Header->header.bh_caplen;
-				if (plen + sizeof(struct bpf_hdr) > available - copied)
-				{
-					//if the packet does not fit into the user buffer, we've ended copying packets
-					NPF_StopUsingOpenInstance(Open);
-					TRACE_EXIT();
-					EXIT_SUCCESS(copied);
-				}
-
-				// FIX_TIMESTAMPS(&Header->header.bh_tstamp);
-
-				*((struct bpf_hdr *) (&packp[copied])) = Header->header;
-
-				copied += sizeof(struct bpf_hdr);
-				LocalData->C += sizeof(struct PacketHeader);
-
-				if (LocalData->C == Open->Size)
-				{
-					LocalData->C = 0;
-				}
-
-				if (Open->Size - LocalData->C < plen)
-				{
-					//the packet is fragmented in the buffer (i.e. it skips the buffer boundary)
-					ToCopy = Open->Size - LocalData->C;
-					RtlCopyMemory(packp + copied, LocalData->Buffer + LocalData->C, ToCopy);
-					RtlCopyMemory(packp + copied + ToCopy, LocalData->Buffer, plen - ToCopy);
-					LocalData->C = plen - ToCopy;
-				}
-				else
-				{
-					//the packet is not fragmented
-					RtlCopyMemory(packp + copied, LocalData->Buffer + LocalData->C, plen);
-					LocalData->C += plen;
-					//if (c==size)  inutile, contemplato nell "header atomico"
-					//c=0;
-				}
-
-				Open->ReaderSN++;
-				copied += Packet_WORDALIGN(plen);
+	//
+	// The pool may have been replaced during the wait: look it up again, and copy from it with the other
+	// readers kept out
+	//
+	ExAcquireFastMutex(&Open->ReadMutex);
 
-				increment = plen + sizeof(struct PacketHeader);
-				if (Open->Size - LocalData->C < sizeof(struct PacketHeader))
-				{
-					//the next packet would be saved at the end of the buffer, but the NewHeader struct would be fragmented
-					//so the producer (--> the consumer) skips to the beginning of the buffer
-					increment += Open->Size - LocalData->C;
-					LocalData->C = 0;
-				}
-				InterlockedExchangeAdd(&Open->CpuData[current_cpu].Free, increment);
-				count = 0;
-			}
-			else
-			{
-				current_cpu = (current_cpu + 1) % g_NCpu;
-				count++;
-			}
-		}
-		else
-		{
-			current_cpu = (current_cpu + 1) % g_NCpu;
-			count++;
-		}
+	Pool = Open->Pool;
+	if (Pool == NULL)
+	{
+		copied = 0;
 	}
+	else if (Open->Unordered)
 	{
-		NPF_StopUsingOpenInstance(Open);
-		TRACE_EXIT();
-		EXIT_SUCCESS(copied);
+		copied = NPF_ReadRuns(Open, Pool, packp, available);
 	}
+	else
+	{
+		copied = NPF_ReadMerged(Open, Pool, packp, available);
+	}
+
+	ExReleaseFastMutex(&Open->ReadMutex);
 
+	NPF_StopUsingOpenInstance(Open);
 	TRACE_EXIT();
+	EXIT_SUCCESS(copied);
 }
 
 //-------------------------------------------------------------------
@@ -444,6 +558,8 @@ NPF_SendEx(
 	POPEN_INSTANCE		Open = (POPEN_INSTANCE) FilterModuleContext;
 	POPEN_INSTANCE GroupOpen;
 	POPEN_INSTANCE		TempOpen;
+	PNPF_GROUP_VERDICTS	Verdicts;
+	LOCK_STATE_EX		LockState;
 	PVOID i = 0;
 	PVOID j = 0;
 
@@ -454,8 +570,8 @@ NPF_SendEx(
 	if (Open->Loopback == FALSE)
 	{
 #endif
-		/* Lock the group */
-		NdisAcquireSpinLock(&Open->GroupLock);
+		/* Lock the group, shared with the taps running on the other CPUs */
+		NdisAcquireRWLockRead(Open->GroupLock, &LockState, 0);
 
 		ASSERT(Open->GroupHead == NULL);
 		if (Open->GroupHead != NULL)
@@ -470,18 +586,22 @@ NPF_SendEx(
 			GroupOpen = Open->GroupNext;
 		}
 
+		// Run the filters of the whole group at once
+		Verdicts = NPF_ClassifyNetBufferLists(Open, NetBufferLists, &g_TapScratch[My_KeGetCurrentProcessorNumber()].Verdicts);
+
 		while (GroupOpen != NULL)
 		{
 			TempOpen = GroupOpen;
 			if (TempOpen->AdapterBindingStatus == ADAPTER_BOUND)
 			{
-				NPF_TapExForEachOpen(TempOpen, NetBufferLists);
+				NPF_TapExForEachOpen(TempOpen, NetBufferLists, Verdicts, BPF_DIRECTION_OUT);
 			}
 
 			GroupOpen = TempOpen->GroupNext;
 		}
+		NPF_AdvanceFanouts(Open, NetBufferLists);
 		/* Release the spin lock no matter what. */
-		NdisReleaseSpinLock(&Open->GroupLock);
+		NdisReleaseRWLock(Open->GroupLock, &LockState);
 #ifdef HAVE_WFP_LOOPBACK_SUPPORT
 	}
 #endif
@@ -507,6 +627,8 @@ NPF_TapEx(
 	POPEN_INSTANCE      Open = (POPEN_INSTANCE) FilterModuleContext;
 	POPEN_INSTANCE		GroupOpen;
 	POPEN_INSTANCE		TempOpen;
+	PNPF_GROUP_VERDICTS	Verdicts;
+	LOCK_STATE_EX		LockState;
 	ULONG				ReturnFlags = 0;
 
 	TRACE_ENTER();
@@ -524,8 +646,8 @@ NPF_TapEx(
 	if (Open->Loopback == FALSE)
 	{
 #endif
-		/* Lock the group */
-		NdisAcquireSpinLock(&Open->GroupLock);
+		/* Lock the group, shared with the taps running on the other CPUs */
+		NdisAcquireRWLockRead(Open->GroupLock, &LockState, 0);
 		ASSERT(Open->GroupHead == NULL);
 		if (Open->GroupHead != NULL)
 		{
@@ -538,18 +660,22 @@ NPF_TapEx(
 			GroupOpen = Open->GroupNext;
 		}
 
+		// Run the filters of the whole group at once
+		Verdicts = NPF_ClassifyNetBufferLists(Open, NetBufferLists, &g_TapScratch[My_KeGetCurrentProcessorNumber()].Verdicts);
+
 		while (GroupOpen != NULL)
 		{
 			TempOpen = GroupOpen;
 				if (TempOpen->AdapterBindingStatus == ADAPTER_BOUND)
 				{
 					//let every group adapter receive the packets
-					NPF_TapExForEachOpen(TempOpen, NetBufferLists);
+					NPF_TapExForEachOpen(TempOpen, NetBufferLists, Verdicts, BPF_DIRECTION_IN);
 				}
 				GroupOpen = TempOpen->GroupNext;
 		}
+		NPF_AdvanceFanouts(Open, NetBufferLists);
 		/* Release the spin lock no matter what. */
-		NdisReleaseSpinLock(&Open->GroupLock);
+		NdisReleaseRWLock(Open->GroupLock, &LockState);
 #ifdef HAVE_WFP_LOOPBACK_SUPPORT
 	}
 #endif
@@ -595,10 +721,525 @@ NPF_AlignProtocolField(
 
 //-------------------------------------------------------------------
 
+//
+// Describes the first TotalLength bytes of the chain of MDLs starting at pMdl, whose
+// first buffer (already mapped, after the offset) is given, for bpf_filter_frags().
+// Returns the number of fragments, 0 if the chain is too long or cannot be mapped.
+//
+static UINT
+NPF_GetFrags(
+	IN PMDL pMdl,
+	IN PUCHAR pFirstBuffer,
+	IN UINT FirstLength,
+	IN ULONG TotalLength,
+	OUT struct bpf_frag* Frags
+	)
+{
+	PMDL pCurMdl = pMdl;
+	PUCHAR pBuffer;
+	UINT Length;
+	UINT Remaining = TotalLength - FirstLength;
+	UINT NFrags = 1;
+
+	Frags[0].data = pFirstBuffer;
+	Frags[0].len = FirstLength;
+
+	while (Remaining > 0)
+	{
+		NdisGetNextMdl(pCurMdl, &pCurMdl);
+		if (pCurMdl == NULL || NFrags == NPF_MAX_FRAGS)
+			return 0;
+
+		NdisQueryMdl(pCurMdl, &pBuffer, &Length, NormalPagePriority);
+		if (pBuffer == NULL)
+			return 0;
+
+		if (Length > Remaining)
+			Length = Remaining;
+
+		Frags[NFrags].data = pBuffer;
+		Frags[NFrags].len = Length;
+		NFrags++;
+		Remaining -= Length;
+	}
+
+	return NFrags;
+}
+
+//-------------------------------------------------------------------
+
+//
+// Stores a packet accepted by the filter in the capture ring of the instance, in the open block of
+// the CPU, copying the first Snaplen bytes of the TotalLength bytes of the chain of MDLs starting at
+// pMdl, after the prefix (the radiotap header of 802.11 packets), with the timestamps of the
+// indication. The caller holds the BufferLock of the CPU, and wakes the application if Closed is set
+// to TRUE, once it has released it. Returns FALSE if the instance has no ring any more.
+//
+static BOOLEAN
+NPF_StoreInRing(
+	IN POPEN_INSTANCE Open,
+	IN ULONG Cpu,
+	IN PMDL pMdl,
+	IN ULONG Offset,
+	IN ULONG TotalLength,
+	IN UINT Snaplen,
+	IN PUCHAR Prefix,
+	IN UINT PrefixSize,
+	IN ULONGLONG Stamp,
+	IN struct timeval* Tstamp,
+	OUT PBOOLEAN Closed
+	)
+{
+	CpuPrivateData* LocalData = &Open->CpuData[Cpu];
+	struct npf_ring_packet* Packet;
+	PMDL pCurMdl;
+	PUCHAR pData;
+	PUCHAR pBuffer;
+	UINT BufferLength;
+	UINT Caplen;
+	UINT Remaining;
+	UINT ToCopy;
+	u_int ClosedBlocks;
+
+	if (Open->Ring == NULL)
+	{
+		return FALSE;
+	}
+
+	if (Snaplen > TotalLength)
+		Snaplen = TotalLength;
+
+	ClosedBlocks = npf_ring_closed(Open->Ring, Cpu);
+	Caplen = PrefixSize + Snaplen;
+	Packet = npf_ring_reserve(Open->Ring, Cpu, &Caplen);
+
+	if (Packet == NULL)
+	{
+		LocalData->Dropped++;
+	}
+	else
+	{
+		LocalData->Accepted++;
+		Packet->stamp = Stamp;
+		Packet->header.bh_tstamp = *Tstamp;
+		Packet->header.bh_datalen = PrefixSize + TotalLength;
+		Packet->header.bh_hdrlen = sizeof(struct bpf_hdr);
+
+		pData = NPF_RING_PACKET_DATA(Packet);
+		Remaining = Caplen;
+
+		ToCopy = min(PrefixSize, Remaining);
+		if (ToCopy > 0)
+		{
+			NdisMoveMappedMemory(pData, Prefix, ToCopy);
+			pData += ToCopy;
+			Remaining -= ToCopy;
+		}
+
+		// The single copy of the packet, from the buffers of NDIS to the application
+		for (pCurMdl = pMdl; pCurMdl != NULL && Remaining > 0; NdisGetNextMdl(pCurMdl, &pCurMdl))
+		{
+			NdisQueryMdl(pCurMdl, &pBuffer, &BufferLength, NormalPagePriority);
+			if (pBuffer == NULL)
+				break;
+
+			// The first MDL, need to handle the offset.
+			if (pCurMdl == pMdl)
+			{
+				BufferLength -= Offset;
+				pBuffer += Offset;
+			}
+
+			ToCopy = min(Remaining, BufferLength);
+			NdisMoveMappedMemory(pData, pBuffer, ToCopy);
+			pData += ToCopy;
+			Remaining -= ToCopy;
+		}
+
+		// What is left of the room reserved when the chain is shorter than expected is padding
+		Packet->header.bh_caplen = Caplen - Remaining;
+	}
+
+	// The application waits for whole blocks
+	if (npf_ring_closed(Open->Ring, Cpu) != ClosedBlocks)
+	{
+		*Closed = TRUE;
+	}
+
+	return TRUE;
+}
+
+//-------------------------------------------------------------------
+
+//
+// Stores the packets of a batch, accepted by the filter of the instance, in its capture ring or in its
+// kernel buffer, under a single acquisition of the BufferLock of the CPU. They share the timestamps
+// taken then, the performance counter only if the instance merges the CPUs. The reader is woken by
+// the caller, once it has stored the whole indication.
+//
+static VOID
+NPF_StoreBatch(
+	IN POPEN_INSTANCE Open,
+	IN ULONG Cpu,
+	IN NPF_TAP_PACKET* Batch,
+	IN ULONG BatchCount,
+	IN PUCHAR Prefix,
+	IN UINT PrefixSize,
+	OUT PBOOLEAN WakeReader,
+	OUT PBOOLEAN WakeDump
+	)
+{
+	CpuPrivateData* LocalData = &Open->CpuData[Cpu];
+	struct PacketHeader* Header;
+	PUCHAR pRecordBuffer;
+	PUCHAR pDataLinkBuffer;
+	PMDL pCurMdl;
+	UINT BufferLength;
+	UINT CopyLength;
+	UINT Remaining;
+	ULONG RecordSize;
+	ULONG Accepted;
+	ULONGLONG Stamp = 0;
+	struct timeval Tstamp;
+	ULONG n, i;
+
+	NdisAcquireSpinLock(&LocalData->BufferLock);
+
+	// NDIS gives the packets of the indication all at once
+	if (!Open->Unordered)
+	{
+		Stamp = (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart;
+	}
+	GET_TIME(&Tstamp, &G_Start_Time);
+
+	for (n = 0; n < BatchCount; n++)
+	{
+		// The ring replaces the kernel buffers while it is mapped
+		if (Open->Ring != NULL && NPF_StoreInRing(Open, Cpu, Batch[n].Mdl, Batch[n].Offset, Batch[n].TotalLength, Batch[n].Snaplen,
+				Prefix, PrefixSize, Stamp, &Tstamp, WakeReader))
+		{
+			continue;
+		}
+
+		if (Open->Size == 0)
+		{
+			LocalData->Dropped++;
+			continue;
+		}
+
+		if (Open->mode & MODE_DUMP && Open->MaxDumpPacks)
+		{
+			Accepted = 0;
+			for (i = 0; i < g_NCpu; i++)
+				Accepted += Open->CpuData[i].Accepted;
+
+			if (Accepted > Open->MaxDumpPacks)
+			{
+				// Reached the max number of packets to save in the dump file. Discard the packet and stop the dump thread.
+				Open->DumpLimitReached = TRUE; // This stops the thread
+											   // Awake the dump thread
+				NdisSetEvent(&Open->DumpEvent);
+
+				// Awake the application
+				if (Open->ReadEvent != NULL)
+					KeSetEvent(Open->ReadEvent, 0, FALSE);
+
+				continue;
+			}
+		}
+
+		if (LocalData->TransferMdl1 != NULL)
+		{
+			//
+			//if TransferMdl is not NULL, there is some TransferData pending (i.e. not having called TransferDataComplete, yet)
+			//in order to avoid buffer corruption, we drop the packet
+			//
+			LocalData->Dropped++;
+			IF_LOUD(DbgPrint("LocalData->Dropped++, LocalData->TransferMdl1 = %d\n", LocalData->TransferMdl1);)
+			continue;
+		}
+
+		//
+		// the packet is stored whole in a block of the pool, taken from those shared by the CPUs
+		// when it does not fit in the last block of this CPU
+		//
+		RecordSize = sizeof(struct PacketHeader) + PrefixSize + Batch[n].Snaplen;
+
+		Header = Open->Pool != NULL ? (struct PacketHeader *)npf_pool_reserve(Open->Pool, Cpu, RecordSize) : NULL;
+		if (Header == NULL)
+		{
+			LocalData->Dropped++;
+			IF_LOUD(DbgPrint("LocalData->Dropped++, fres = %d, no free block\n", Batch[n].Snaplen);)
+			continue;
+		}
+
+		pRecordBuffer = (PUCHAR)(Header + 1);
+		LocalData->Accepted++;
+		Header->Stamp = Stamp;
+		Header->header.bh_tstamp = Tstamp;
+		Header->header.bh_caplen = PrefixSize;
+		Header->header.bh_datalen = PrefixSize + Batch[n].DataLength;
+		Header->header.bh_hdrlen = sizeof(struct bpf_hdr);
+
+		if (PrefixSize != 0)
+		{
+			NdisMoveMappedMemory(pRecordBuffer, Prefix, PrefixSize);
+			pRecordBuffer += PrefixSize;
+		}
+
+		// Add MDLs
+		Remaining = Batch[n].Snaplen;
+		for (pCurMdl = Batch[n].Mdl; pCurMdl != NULL && Remaining > 0; NdisGetNextMdl(pCurMdl, &pCurMdl))
+		{
+			NdisQueryMdl(pCurMdl, &pDataLinkBuffer, &BufferLength, NormalPagePriority);
+			if (pDataLinkBuffer == NULL)
+				break;
+
+			// The first MDL, need to handle the offset.
+			if (pCurMdl == Batch[n].Mdl)
+			{
+				BufferLength -= Batch[n].Offset;
+				pDataLinkBuffer += Batch[n].Offset;
+			}
+
+			CopyLength = min(Remaining, BufferLength);
+			NdisMoveMappedMemory(pRecordBuffer, pDataLinkBuffer, CopyLength);
+			pRecordBuffer += CopyLength;
+			Header->header.bh_caplen += CopyLength;
+			Remaining -= CopyLength;
+		}
+
+		IF_LOUD(DbgPrint("Packet Header: bh_caplen = %d, bh_datalen = %d\n", Header->header.bh_caplen, Header->header.bh_datalen);)
+
+		npf_pool_commit(Open->Pool, Cpu, sizeof(struct PacketHeader) + Header->header.bh_caplen);
+		if (npf_pool_pending(Open->Pool, Cpu) >= Open->MinToCopy)
+		{
+			if (Open->mode & MODE_DUMP)
+				*WakeDump = TRUE;
+			else
+				*WakeReader = TRUE;
+		}
+	}
+
+	NdisReleaseSpinLock(&LocalData->BufferLock);
+}
+
+//-------------------------------------------------------------------
+
+//
+// The size of the link layer header of the packets of an instance, as the filters and the fanout
+// groups see them.
+//
+static UINT
+NPF_DataLinkHeaderSize(
+	IN POPEN_INSTANCE Open
+	)
+{
+	UNREFERENCED_PARAMETER(Open);
+
+#ifdef HAVE_WFP_LOOPBACK_SUPPORT
+	if (Open->Loopback && g_DltNullMode)
+	{
+		return DLT_NULL_HDR_LEN;
+	}
+#endif
+
+	return ETHER_HDR_LEN;
+}
+
+//-------------------------------------------------------------------
+
+//
+// Hashes the flow of a packet for the fanout groups, on what the filters see: the first MDL after
+// the offset, cut at the length of the packet. NPF_ClassifyNetBufferLists() computes the same hash.
+//
+static u_int32
+NPF_HashNetBuffer(
+	IN PNET_BUFFER pNetBuf,
+	IN UINT DataLinkHeaderSize
+	)
+{
+	PUCHAR					pDataLinkBuffer = NULL;
+	UINT					BufferLength = 0;
+
+	if (pNetBuf->CurrentMdl != NULL)
+	{
+		NdisQueryMdl(pNetBuf->CurrentMdl, &pDataLinkBuffer, &BufferLength, NormalPagePriority);
+	}
+
+	if (pDataLinkBuffer == NULL || BufferLength == 0)
+	{
+		return 0;
+	}
+
+	BufferLength -= pNetBuf->CurrentMdlOffset;
+	pDataLinkBuffer += pNetBuf->CurrentMdlOffset;
+	if (BufferLength > pNetBuf->DataLength)
+		BufferLength = pNetBuf->DataLength;
+
+	return npf_fanout_hash(pDataLinkBuffer, BufferLength, DataLinkHeaderSize);
+}
+
+//-------------------------------------------------------------------
+
+//
+// Tells if the NbIndex-th packet of an indication, tapped by Cpu, goes to an instance that is the
+// member of a fanout group. The caller holds the GroupLock of the group head.
+//
+static BOOLEAN
+NPF_FanoutAccepts(
+	IN POPEN_INSTANCE Open,
+	IN PNPF_GROUP_VERDICTS Verdicts,
+	IN PNET_BUFFER pNetBuf,
+	IN ULONG NbIndex,
+	IN ULONG Cpu,
+	IN UINT DataLinkHeaderSize
+	)
+{
+	PNPF_FANOUT				Fanout = Open->Fanout;
+	u_int32					Hash = 0;
+
+	if (Fanout->Mode == NPF_FANOUT_HASH)
+	{
+		if (Verdicts != NULL && NbIndex < NPF_GROUP_BATCH && (Verdicts->Hashed & ((ULONGLONG)1 << NbIndex)))
+		{
+			Hash = Verdicts->Hashes[NbIndex];
+		}
+		else
+		{
+			Hash = NPF_HashNetBuffer(pNetBuf, DataLinkHeaderSize);
+		}
+	}
+
+	// The turns of the CPU go on from where the previous indication left them
+	return npf_fanout_member(Fanout->Mode, Fanout->Count, Hash, Cpu, Fanout->Turn[Cpu] + NbIndex) == Open->FanoutIndex;
+}
+
+//-------------------------------------------------------------------
+
+VOID
+NPF_AdvanceFanouts(
+	IN POPEN_INSTANCE GroupHead,
+	IN PNET_BUFFER_LIST pNetBufferLists
+	)
+{
+	PNET_BUFFER_LIST		pNetBufList;
+	PNET_BUFFER				pNetBuf;
+	PNPF_FANOUT				Fanout;
+	ULONG					Count = 0;
+	ULONG					Cpu;
+
+	for (Fanout = GroupHead->Fanouts; Fanout != NULL && Fanout->Mode != NPF_FANOUT_LB; Fanout = Fanout->Next);
+
+	if (Fanout == NULL)
+	{
+		return;
+	}
+
+	for (pNetBufList = pNetBufferLists; pNetBufList != NULL; pNetBufList = NET_BUFFER_LIST_NEXT_NBL(pNetBufList))
+	{
+		for (pNetBuf = NET_BUFFER_LIST_FIRST_NB(pNetBufList); pNetBuf != NULL; pNetBuf = NET_BUFFER_NEXT_NB(pNetBuf))
+		{
+			Count++;
+		}
+	}
+
+	// Only this CPU writes its turn, and the taps of the members read it on this CPU
+	Cpu = My_KeGetCurrentProcessorNumber();
+	for (; Fanout != NULL; Fanout = Fanout->Next)
+	{
+		if (Fanout->Mode == NPF_FANOUT_LB)
+		{
+			Fanout->Turn[Cpu] += Count;
+		}
+	}
+}
+
+//-------------------------------------------------------------------
+
+PNPF_GROUP_VERDICTS
+NPF_ClassifyNetBufferLists(
+	IN POPEN_INSTANCE GroupHead,
+	IN PNET_BUFFER_LIST pNetBufferLists,
+	OUT PNPF_GROUP_VERDICTS Verdicts
+	)
+{
+	PNET_BUFFER_LIST		pNetBufList;
+	PNET_BUFFER				pNetBuf;
+	PUCHAR					pDataLinkBuffer;
+	UINT					BufferLength;
+	ULONG					NbIndex = 0;
+	PNPF_FANOUT				Fanout;
+	UINT					DataLinkHeaderSize;
+
+	// The members of the fanout groups by hash share the hashes of the packets
+	for (Fanout = GroupHead->Fanouts; Fanout != NULL && Fanout->Mode != NPF_FANOUT_HASH; Fanout = Fanout->Next);
+
+	if (GroupHead->GroupProgram == NULL && Fanout == NULL)
+	{
+		return NULL;
+	}
+
+	DataLinkHeaderSize = NPF_DataLinkHeaderSize(GroupHead);
+	Verdicts->Classified = 0;
+	Verdicts->Hashed = 0;
+
+	for (pNetBufList = pNetBufferLists; pNetBufList != NULL; pNetBufList = NET_BUFFER_LIST_NEXT_NBL(pNetBufList))
+	{
+		for (pNetBuf = NET_BUFFER_LIST_FIRST_NB(pNetBufList); pNetBuf != NULL; pNetBuf = NET_BUFFER_NEXT_NB(pNetBuf))
+		{
+			if (NbIndex == NPF_GROUP_BATCH)
+			{
+				return Verdicts;
+			}
+
+			//
+			// The filters see what NPF_TapExForEachOpen() gives them: the first MDL after the offset, cut at the
+			// length of the packet. The packets that continue in other MDLs are left to each instance
+			//
+			pDataLinkBuffer = NULL;
+			BufferLength = 0;
+			if (pNetBuf->CurrentMdl != NULL)
+			{
+				NdisQueryMdl(pNetBuf->CurrentMdl, &pDataLinkBuffer, &BufferLength, NormalPagePriority);
+			}
+
+			if (pDataLinkBuffer != NULL && BufferLength != 0)
+			{
+				BufferLength -= pNetBuf->CurrentMdlOffset;
+				pDataLinkBuffer += pNetBuf->CurrentMdlOffset;
+				if (BufferLength > pNetBuf->DataLength)
+					BufferLength = pNetBuf->DataLength;
+
+				if (GroupHead->GroupProgram != NULL && (BufferLength == pNetBuf->DataLength || pNetBuf->CurrentMdl->Next == NULL))
+				{
+					Verdicts->Matches[NbIndex] = bpf_group_filter(GroupHead->GroupProgram, pDataLinkBuffer, BufferLength, BufferLength);
+					Verdicts->Classified |= (ULONGLONG)1 << NbIndex;
+				}
+
+				// The hash of NPF_HashNetBuffer()
+				if (Fanout != NULL)
+				{
+					Verdicts->Hashes[NbIndex] = npf_fanout_hash(pDataLinkBuffer, BufferLength, DataLinkHeaderSize);
+					Verdicts->Hashed |= (ULONGLONG)1 << NbIndex;
+				}
+			}
+
+			NbIndex++;
+		}
+	}
+
+	return Verdicts;
+}
+
+//-------------------------------------------------------------------
+
 VOID
 NPF_TapExForEachOpen(
 	IN POPEN_INSTANCE Open,
-	IN PNET_BUFFER_LIST pNetBufferLists
+	IN PNET_BUFFER_LIST pNetBufferLists,
+	IN PNPF_GROUP_VERDICTS Verdicts,
+	IN ULONG Direction
 	)
 {
 	ULONG					SizeToTransfer;
@@ -612,11 +1253,12 @@ NPF_TapExForEachOpen(
 
 	CpuPrivateData*			LocalData;
 	ULONG					Cpu;
-	struct PacketHeader*	Header;
-	ULONG					ToCopy;
-	ULONG					increment;
-	ULONG					i;
-	BOOLEAN					ShouldReleaseBufferLock;
+	NPF_TAP_PACKET*			Batch;
+	ULONG					BatchCount = 0;
+	PUCHAR					Prefix = NULL;
+	UINT					PrefixSize = 0;
+	BOOLEAN					WakeReader = FALSE;
+	BOOLEAN					WakeDump = FALSE;
 
 	PUCHAR					TmpBuffer = NULL;
 	PUCHAR					HeaderBuffer;
@@ -628,6 +1270,7 @@ NPF_TapExForEachOpen(
 	UINT					TotalPacketSize;
 
 	PMDL					pMdl = NULL;
+	PMDL					pCurMdl;
 	UINT					BufferLength;
 	PUCHAR					pDataLinkBuffer = NULL;
 	PNET_BUFFER_LIST		pNetBufList;
@@ -635,6 +1278,15 @@ NPF_TapExForEachOpen(
 	PNET_BUFFER				pNetBuf;
 	PNET_BUFFER				pNextNetBuf;
 	ULONG					Offset;
+	struct bpf_frag			Frags[NPF_MAX_FRAGS];
+	UINT					NFrags;
+	ULONG					NbIndex = 0;
+	BOOLEAN					Classified;
+	BOOLEAN					Prefiltered;
+	struct bpf_flow_cache*	FlowCache;
+	struct bpf_flow_key		FlowKey;
+	PNPF_FILTER				Filter;
+	struct bpf_meta			Meta;
 
 	UINT					DataLinkHeaderSize;
 
@@ -651,16 +1303,18 @@ NPF_TapExForEachOpen(
 // 		return;
 // 	}
 
-#ifdef HAVE_WFP_LOOPBACK_SUPPORT
-	if (Open->Loopback && g_DltNullMode)
-	{
-		DataLinkHeaderSize = DLT_NULL_HDR_LEN;
-	}
-	else
-#endif
-	{
-		DataLinkHeaderSize = ETHER_HDR_LEN;
-	}
+	DataLinkHeaderSize = NPF_DataLinkHeaderSize(Open);
+
+	// The caller holds the lock of the group, at DISPATCH_LEVEL: the whole indication is tapped on this CPU
+	Cpu = My_KeGetCurrentProcessorNumber();
+	LocalData = &Open->CpuData[Cpu];
+	Batch = g_TapScratch[Cpu].Batch;
+
+	//
+	// The filter cannot be replaced while the caller holds the lock of the group: it is the same for all the
+	// packets, and it runs without any lock
+	//
+	Filter = Open->Filter;
 
 	pNetBufList = pNetBufferLists;
 	while (pNetBufList != NULL)
@@ -668,6 +1322,21 @@ NPF_TapExForEachOpen(
 		BOOLEAN withVlanTag = FALSE;
 		UCHAR pVlanTag[2];
 
+		// The metadata of the packets of the list, for the ancillary loads of the filter
+		RtlZeroMemory(&Meta, sizeof(Meta));
+		Meta.direction = Direction;
+		Meta.cpu = Cpu;
+		Meta.rss_hash = NET_BUFFER_LIST_GET_HASH_VALUE(pNetBufList);
+		if (NET_BUFFER_LIST_INFO(pNetBufList, Ieee8021QNetBufferListInfo) != 0)
+		{
+			NDIS_NET_BUFFER_LIST_8021Q_INFO qInfo;
+			qInfo.Value = NET_BUFFER_LIST_INFO(pNetBufList, Ieee8021QNetBufferListInfo);
+			Meta.vlan_tag = ((ULONG)qInfo.TagHeader.UserPriority << 13) |
+				((ULONG)qInfo.TagHeader.CanonicalFormatId << 12) |
+				(ULONG)qInfo.TagHeader.VlanId;
+			Meta.vlan_tag_present = 1;
+		}
+
 		// Handle IEEE802.1Q VLAN tag here, the tag in OOB field will be copied to the packet data, currently only Ethernet supported.
 		// This code refers to Win10Pcap at https://github.com/SoftEtherVPN/Win10Pcap.
 		if (g_VlanSupportMode && (NET_BUFFER_LIST_INFO(pNetBufList, Ieee8021QNetBufferListInfo) != 0))
@@ -701,6 +1370,7 @@ NPF_TapExForEachOpen(
 			cur += sizeof(IEEE80211_RADIOTAP_HEADER) / sizeof(UCHAR);
 
 			pwInfo = NET_BUFFER_LIST_INFO(pNetBufList, MediaSpecificInformation);
+			Meta.phy = pwInfo->uPhyId;
 
 			// [Radiotap] "TSFT" field.
 			// Size: 8 bytes, Alignment: 8 bytes.
@@ -841,6 +1511,10 @@ NPF_TapExForEachOpen(
 			pRadiotapHeader->it_version = 0x0;
 			pRadiotapHeader->it_len = (USHORT) Dot11RadiotapHeaderSize;
 		}
+
+		// The radiotap header is stored before each packet of the list
+		Prefix = Dot11RadiotapHeader;
+		PrefixSize = Dot11RadiotapHeaderSize;
 #endif
 
 		pNextNetBufList = NET_BUFFER_LIST_NEXT_NBL(pNetBufList);
@@ -850,15 +1524,16 @@ NPF_TapExForEachOpen(
 		{
 			pNextNetBuf = NET_BUFFER_NEXT_NB(pNetBuf);
 
-			Cpu = My_KeGetCurrentProcessorNumber();
-			LocalData = &Open->CpuData[Cpu];
+			// Each packet goes to a single member of a fanout group, the others do not see it at all
+			if (Open->Fanout != NULL && !NPF_FanoutAccepts(Open, Verdicts, pNetBuf, NbIndex, Cpu, DataLinkHeaderSize))
+			{
+				goto NPF_TapExForEachOpen_End;
+			}
 
 			LocalData->Received++;
 
 			IF_LOUD(DbgPrint("Received on CPU %d \t%d\n", Cpu, LocalData->Received);)
 
-				NdisAcquireSpinLock(&Open->MachineLock);
-
 			//
 			// Get first MDL and data length in the list
 			//
@@ -885,13 +1560,11 @@ NPF_TapExForEachOpen(
 					//  below.
 					//
 					BufferLength = 0;
-					NdisReleaseSpinLock(&Open->MachineLock);
 					break;
 				}
 
 				if (BufferLength == 0)
 				{
-					NdisReleaseSpinLock(&Open->MachineLock);
 					break;
 				}
 
@@ -902,8 +1575,16 @@ NPF_TapExForEachOpen(
 				if (BufferLength > TotalLength)
 					BufferLength = TotalLength;
 
-				// Handle multiple MDLs situation here, if there's only 20 bytes in the first MDL, then the IP header is in the second MDL.
-				if (BufferLength == DataLinkHeaderSize && pMdl->Next != NULL)
+				// Handle multiple MDLs situation here: the filter reads the packet where it is, e.g. the IP header in
+				// the second MDL if there are only the 14 bytes of the Ethernet header in the first one.
+				NFrags = 0;
+				if (BufferLength < TotalLength && pMdl->Next != NULL)
+				{
+					NFrags = NPF_GetFrags(pMdl, pDataLinkBuffer, BufferLength, TotalLength, Frags);
+				}
+
+				// Too many MDLs: copy the packet in one buffer
+				if (BufferLength < TotalLength && pMdl->Next != NULL && NFrags == 0)
 				{
 					TmpBuffer = ExAllocatePoolWithTag(NonPagedPool, pNetBuf->DataLength, 'NPCA');
 					pDataLinkBuffer = NdisGetDataBuffer(pNetBuf,
@@ -917,7 +1598,6 @@ NPF_TapExForEachOpen(
 							"NPF_TapExForEachOpen: NdisGetDataBuffer() [status: %#x]\n",
 							STATUS_UNSUCCESSFUL);
 
-						NdisReleaseSpinLock(&Open->MachineLock);
 						break;
 					}
 					else
@@ -950,19 +1630,114 @@ NPF_TapExForEachOpen(
 				LookaheadBufferSize = BufferLength - HeaderBufferSize;
 				PacketSize = LookaheadBufferSize;
 
+				// The group classifier may have already run the filter on this packet, unless it is profiled
+				Classified = (Open->Profile == NULL && Verdicts != NULL && Open->GroupIndex != NPF_GROUP_NONE && NbIndex < NPF_GROUP_BATCH &&
+					(Verdicts->Classified & ((ULONGLONG)1 << NbIndex)));
+
+				// Otherwise the packet may fail the necessary conditions of the filter, without running it
+				Prefiltered = (!Classified && NFrags == 0 && Filter != NULL && Open->Profile == NULL &&
+					!bpf_prefilter(&Filter->Prefilter, HeaderBuffer, LookaheadBufferSize + HeaderBufferSize));
+
+				// Or its verdict may be cached for the flow of the packet
+				FlowCache = NULL;
+				if (!Classified && !Prefiltered && NFrags == 0 && Filter != NULL && Filter->FlowProgram != NULL && Open->Profile == NULL)
+				{
+					FlowCache = bpf_flow_get_cache(Filter->FlowProgram, Cpu);
+					bpf_flow_key(Filter->FlowProgram,
+						HeaderBuffer,
+						PacketSize + HeaderBufferSize,
+						LookaheadBufferSize + HeaderBufferSize,
+						&FlowKey);
+				}
+
+				if (Filter == NULL)
+				{
+					// No filter, accept the whole packet
+					fres = (UINT)-1;
+				}
+				else
+				if (Classified)
+				{
+					fres = (Verdicts->Matches[NbIndex] & ((ULONGLONG)1 << Open->GroupIndex)) ? Open->GroupAccept : 0;
+				}
+				else
+				if (Prefiltered)
+				{
+					fres = 0;
+				}
+				else
+				if (FlowCache != NULL && bpf_flow_lookup(Filter->FlowProgram, FlowCache, &FlowKey, &fres))
+				{
+					// Cache hit, there is nothing to store
+					FlowCache = NULL;
+				}
+				else
+				if (Filter->ExtendedProgram != NULL)
+				{
+					// Its maps change with each packet: the verdicts are neither classified by the group nor cached
+					if (NFrags != 0)
+					{
+						fres = ebpf_filter_frags(Filter->ExtendedProgram, Frags, TotalLength, TotalLength, &Meta);
+					}
+					else
+					{
+						fres = ebpf_filter(Filter->ExtendedProgram,
+							HeaderBuffer,
+							PacketSize + HeaderBufferSize,
+							LookaheadBufferSize + HeaderBufferSize,
+							&Meta);
+					}
+				}
+				else
+				if (Open->Profile != NULL && NFrags == 0)
+				{
+					// Profiling counts every instruction, it bypasses the faster engines. The counters are shared by the CPUs
+					NdisAcquireSpinLock(&Open->MachineLock);
+					fres = bpf_filter_profile((struct bpf_insn *)(Filter->bpfprogram),
+						HeaderBuffer,
+						PacketSize + HeaderBufferSize,
+						LookaheadBufferSize + HeaderBufferSize,
+						&Meta,
+						Open->Profile);
+					Open->ProfilePackets++;
+					NdisReleaseSpinLock(&Open->MachineLock);
+				}
+				else
 				//
-				// the jit filter is available on x86 (32 bit) only
+				// the jit filter is available on x86 and x86-64 only
 				//
-#ifdef _X86_
-
-				if (Open->Filter != NULL)
+				if (NFrags != 0)
 				{
-					if (Open->bpfprogram != NULL && Open->Filter->Function != NULL)
+#ifdef HAVE_BPF_JIT_SUPPORT
+					if (Filter->Jit != NULL && Filter->Jit->FragsFunction != NULL)
 					{
-						fres = Open->Filter->Function(
+						fres = Filter->Jit->FragsFunction(Frags, TotalLength, TotalLength, &Meta);
+					}
+					else
+#endif //HAVE_BPF_JIT_SUPPORT
+					{
+						fres = bpf_filter_frags((struct bpf_insn *)(Filter->bpfprogram), Frags, TotalLength, TotalLength, &Meta);
+					}
+				}
+				else
+				if (Filter->Shape != NULL)
+				{
+					fres = bpf_filter_shape(Filter->Shape,
+						HeaderBuffer,
+						PacketSize + HeaderBufferSize,
+						LookaheadBufferSize + HeaderBufferSize);
+				}
+				else
+#ifdef HAVE_BPF_JIT_SUPPORT
+				if (Filter->Jit != NULL)
+				{
+					if (Filter->Jit->Function != NULL)
+					{
+						fres = Filter->Jit->Function(
 							(PVOID)HeaderBuffer,
 							PacketSize + HeaderBufferSize,
-							LookaheadBufferSize + HeaderBufferSize);
+							LookaheadBufferSize + HeaderBufferSize,
+							&Meta);
 					}
 					else
 					{
@@ -970,18 +1745,30 @@ NPF_TapExForEachOpen(
 					}
 				}
 				else
-#endif //_X86_
+#endif //HAVE_BPF_JIT_SUPPORT
+				if (Filter->DecodedProgram != NULL)
 				{
-					fres = bpf_filter((struct bpf_insn *)(Open->bpfprogram),
+					fres = bpf_filter_decoded(Filter->DecodedProgram,
 						HeaderBuffer,
 						PacketSize + HeaderBufferSize,
-						LookaheadBufferSize + HeaderBufferSize);
+						LookaheadBufferSize + HeaderBufferSize,
+						&Meta);
+				}
+				else
+				{
+					fres = bpf_filter_meta((struct bpf_insn *)(Filter->bpfprogram),
+						HeaderBuffer,
+						PacketSize + HeaderBufferSize,
+						LookaheadBufferSize + HeaderBufferSize,
+						&Meta);
 					IF_LOUD(DbgPrint("\n");)
 					IF_LOUD(DbgPrint("HeaderBufferSize = %d, LookaheadBufferSize (PacketSize) = %d, fres = %d\n", HeaderBufferSize, LookaheadBufferSize, fres);)
 				}
 
-
-				NdisReleaseSpinLock(&Open->MachineLock);
+				if (FlowCache != NULL)
+				{
+					bpf_flow_insert(Filter->FlowProgram, FlowCache, &FlowKey, fres);
+				}
 
 				//
 				// The MONITOR_MODE (aka TME extensions) is not supported on
@@ -1023,292 +1810,73 @@ NPF_TapExForEachOpen(
 					}
 				}
 
-				if (Open->Size == 0)
+				// The whole length of the packet, from the MDLs that follow the first one
+				TotalPacketSize = PacketSize + HeaderBufferSize;
+				for (NdisGetNextMdl(pMdl, &pCurMdl); pCurMdl != NULL; NdisGetNextMdl(pCurMdl, &pCurMdl))
 				{
-					LocalData->Dropped++;
-					//return NDIS_STATUS_NOT_ACCEPTED;
-					goto NPF_TapExForEachOpen_End;
-				}
-
-				if (Open->mode & MODE_DUMP && Open->MaxDumpPacks)
-				{
-					ULONG Accepted = 0;
-					for (i = 0; i < g_NCpu; i++)
-						Accepted += Open->CpuData[i].Accepted;
-
-					if (Accepted > Open->MaxDumpPacks)
-					{
-						// Reached the max number of packets to save in the dump file. Discard the packet and stop the dump thread.
-						Open->DumpLimitReached = TRUE; // This stops the thread
-													   // Awake the dump thread
-						NdisSetEvent(&Open->DumpEvent);
-
-						// Awake the application
-						if (Open->ReadEvent != NULL)
-							KeSetEvent(Open->ReadEvent, 0, FALSE);
-
-						//return NDIS_STATUS_NOT_ACCEPTED;
-						goto NPF_TapExForEachOpen_End;
-					}
+					NdisQueryMdl(pCurMdl, &pDataLinkBuffer, &BufferLength, NormalPagePriority);
+					TotalPacketSize += BufferLength;
 				}
 
-				//////////////////////////////COPIA.C//////////////////////////////////////////77
-
-				ShouldReleaseBufferLock = TRUE;
-				//NdisDprAcquireSpinLock(&LocalData->BufferLock);
-				NdisAcquireSpinLock(&LocalData->BufferLock);
-
-				do
-				{
-					// Get the whole packet length.
-					TotalPacketSize = PacketSize + HeaderBufferSize;
-					PMDL pCurMdl = pMdl;
-					PMDL pPreMdl;
-					while (TRUE)
-					{
-						pPreMdl = pCurMdl;
-						NdisGetNextMdl(pPreMdl, &pCurMdl);
-
-						if (pCurMdl)
-						{
-							NdisQueryMdl(
-								pCurMdl,
-								&pDataLinkBuffer,
-								&BufferLength,
-								NormalPagePriority);
-							TotalPacketSize += BufferLength;
-						}
-						else
-						{
-							break;
-						}
-					}
-
-					if (fres > TotalPacketSize)
-						fres = TotalPacketSize;
-
-					if (fres + sizeof(struct PacketHeader)
-#ifdef HAVE_DOT11_SUPPORT
-							+ Dot11RadiotapHeaderSize
-#endif
-							> LocalData->Free)
-					{
-						LocalData->Dropped++;
-						IF_LOUD(DbgPrint("LocalData->Dropped++, fres = %d, LocalData->Free = %d\n", fres, LocalData->Free);)
-						break;
-					}
-
-					if (LocalData->TransferMdl1 != NULL)
-					{
-						//
-						//if TransferMdl is not NULL, there is some TransferData pending (i.e. not having called TransferDataComplete, yet)
-						//in order to avoid buffer corruption, we drop the packet
-						//
-						LocalData->Dropped++;
-						IF_LOUD(DbgPrint("LocalData->Dropped++, LocalData->TransferMdl1 = %d\n", LocalData->TransferMdl1);)
-						break;
-					}
-
-					PUCHAR pHeaderBuffer = HeaderBuffer;
-					UINT iFres = fres;
-
-					// Disable the IEEE802.1Q VLAN feature for now.
-// 					if (withVlanTag)
-// 					{
-// 						// Insert a tag in the case of IEEE802.1Q packet
-// 						pHeaderBuffer = ExAllocatePoolWithTag(NonPagedPool, fres + 4, 'NPCA');
-// 						NdisMoveMappedMemory(pHeaderBuffer, HeaderBuffer, 12);
-// 						pHeaderBuffer[12] = 0x81;
-// 						pHeaderBuffer[13] = 0x00;
-// 						NdisMoveMappedMemory(&pHeaderBuffer[14], pVlanTag, 2);
-// 						NdisMoveMappedMemory(&pHeaderBuffer[16], &HeaderBuffer[12], fres - 12);
-// 						iFres += 4;
-// 					}
-
-					Header = (struct PacketHeader *)(LocalData->Buffer + LocalData->P);
-					LocalData->Accepted++;
-					GET_TIME(&Header->header.bh_tstamp, &G_Start_Time);
-					Header->SN = InterlockedIncrement(&Open->WriterSN) - 1;
-
-					// DbgPrint("MDL %d\n", BufferLength);
+				if (fres > TotalPacketSize)
+					fres = TotalPacketSize;
 
-					Header->header.bh_caplen = 0;
-					Header->header.bh_datalen = TotalPacketSize;
-					Header->header.bh_hdrlen = sizeof(struct bpf_hdr);
-
-					LocalData->P += sizeof(struct PacketHeader);
-					if (LocalData->P == Open->Size)
-						LocalData->P = 0;
-
-					increment = sizeof(struct PacketHeader);
-
-#ifdef HAVE_DOT11_SUPPORT
-					if (Dot11RadiotapHeaderSize)
-					{
-						Header->header.bh_caplen += Dot11RadiotapHeaderSize;
-						Header->header.bh_datalen += Dot11RadiotapHeaderSize;
-
-						if (Open->Size - LocalData->P < Dot11RadiotapHeaderSize)
-						{
-							//the Radiotap header will be fragmented in the buffer (aka, it will skip the buffer boundary)
-							ToCopy = Open->Size - LocalData->P;
-							NdisMoveMappedMemory(LocalData->Buffer + LocalData->P, Dot11RadiotapHeader, ToCopy);
-							NdisMoveMappedMemory(LocalData->Buffer + 0, Dot11RadiotapHeader + ToCopy, Dot11RadiotapHeaderSize - ToCopy);
-							LocalData->P = Dot11RadiotapHeaderSize - ToCopy;
-						}
-						else
-						{
-							NdisMoveMappedMemory(LocalData->Buffer + LocalData->P, Dot11RadiotapHeader, Dot11RadiotapHeaderSize);
-							LocalData->P += Dot11RadiotapHeaderSize;
-						}
-						if (LocalData->P == Open->Size)
-							LocalData->P = 0;
-						increment += Dot11RadiotapHeaderSize;
-					}
-#endif
-
-					//
-					//we can consider the buffer contiguous, either because we use only the data
-					//present in the HeaderBuffer, or because HeaderBuffer and LookaheadBuffer are contiguous
-					// ;-))))))
-					//
-// 					if (Open->Size - LocalData->P < iFres)
-// 					{
-// 						//the packet will be fragmented in the buffer (aka, it will skip the buffer boundary)
-// 						//two copies!!
-// 						ToCopy = Open->Size - LocalData->P;
-// 						NdisMoveMappedMemory(LocalData->Buffer + LocalData->P, pHeaderBuffer, ToCopy);
-// 						NdisMoveMappedMemory(LocalData->Buffer + 0, (PUCHAR)pHeaderBuffer + ToCopy, iFres - ToCopy);
-// 						LocalData->P = iFres - ToCopy;
-// 					}
-// 					else
-// 					{
-// 						//the packet does not need to be fragmented in the buffer (aka, it doesn't skip the buffer boundary)
-// 						// ;-)))))) only ONE copy
-// 						NdisMoveMappedMemory(LocalData->Buffer + LocalData->P, pHeaderBuffer, iFres);
-// 						LocalData->P += iFres;
-// 					}	
-
-					// Disable the IEEE802.1Q VLAN feature for now.
-// 					if (withVlanTag)
-// 					{
-// 						if (pHeaderBuffer)
-// 						{
-// 							ExFreePool(pHeaderBuffer);
-// 							pHeaderBuffer = NULL;
-// 						}
-// 					}
-
-					// Add MDLs
-					pCurMdl = pMdl;
-					pPreMdl;
-					while (iFres > 0 || iFres == -1)
-					{
-						UINT CopyLengthForMDL = 0;
-						if (pCurMdl)
-						{
-							NdisQueryMdl(
-								pCurMdl,
-								&pDataLinkBuffer,
-								&BufferLength,
-								NormalPagePriority);
-
-							// The first MDL, need to handle the offset.
-							if (pCurMdl == pMdl)
-							{
-								IF_LOUD(DbgPrint("The 1st MDL, (Original) MdlSize = %d, Offset = %d\n", BufferLength, Offset);)
-								BufferLength -= Offset;
-								pDataLinkBuffer += Offset;
-							}
-
-							if (iFres != -1)
-								CopyLengthForMDL = min(iFres, BufferLength);
-							else
-								CopyLengthForMDL = BufferLength;
-
-							if (LocalData->P == Open->Size)
-							{
-								LocalData->P = 0;
-							}
-
-							if (Open->Size - LocalData->P < CopyLengthForMDL)
-							{
-								//the MDL data will be fragmented in the buffer (aka, it will skip the buffer boundary)
-								//two copies!!
-								ToCopy = Open->Size - LocalData->P;
-								NdisMoveMappedMemory(LocalData->Buffer + LocalData->P, pDataLinkBuffer, ToCopy);
-								NdisMoveMappedMemory(LocalData->Buffer + 0, pDataLinkBuffer + ToCopy, CopyLengthForMDL - ToCopy);
-								LocalData->P = CopyLengthForMDL - ToCopy;
-
-								IF_LOUD(DbgPrint("iFres = %d, MdlSize = %d, CopyLengthForMDL = %d (two copies)\n", iFres, BufferLength, CopyLengthForMDL);)
-							}
-							else
-							{
-								NdisMoveMappedMemory(LocalData->Buffer + LocalData->P, pDataLinkBuffer, CopyLengthForMDL);
-								LocalData->P += CopyLengthForMDL;
-
-								IF_LOUD(DbgPrint("iFres = %d, MdlSize = %d, CopyLengthForMDL = %d\n", iFres, BufferLength, CopyLengthForMDL);)
-							}
-
-							increment += CopyLengthForMDL;
-							Header->header.bh_caplen += CopyLengthForMDL;
-							if (iFres != -1)
-								iFres -= CopyLengthForMDL;
-						}
-						else
-						{
-							break;
-						}
-
-						pPreMdl = pCurMdl;
-						NdisGetNextMdl(pPreMdl, &pCurMdl);
-					}
-
-					IF_LOUD(DbgPrint("Packet Header: bh_caplen = %d, bh_datalen = %d\n", Header->header.bh_caplen, Header->header.bh_datalen);)
-
-					if (Open->Size - LocalData->P < sizeof(struct PacketHeader))  //we check that the available, AND contiguous, space in the buffer will fit
-					{
-						//the NewHeader structure, at least, otherwise we skip the producer
-						increment += Open->Size - LocalData->P;				   //at the beginning of the buffer (p = 0), and decrement the free bytes appropriately
-						LocalData->P = 0;
-					}
-
-					InterlockedExchangeAdd(&LocalData->Free, (ULONG)(-(LONG)increment));
-					if (Open->Size - LocalData->Free >= Open->MinToCopy)
-					{
-						if (Open->mode & MODE_DUMP)
-							NdisSetEvent(&Open->DumpEvent);
-						else
-						{
-							if (Open->ReadEvent != NULL)
-							{
-								KeSetEvent(Open->ReadEvent, 0, FALSE);
-							}
-						}
-					}
-				} while (FALSE);
-
-				if (ShouldReleaseBufferLock)
-				{
-					//NdisDprReleaseSpinLock(&LocalData->BufferLock);
-					NdisReleaseSpinLock(&LocalData->BufferLock);
-				}
+				// Stored with the rest of the batch, under a single acquisition of the lock of the CPU
+				Batch[BatchCount].Mdl = pMdl;
+				Batch[BatchCount].Offset = Offset;
+				Batch[BatchCount].TotalLength = TotalLength;
+				Batch[BatchCount].DataLength = TotalPacketSize;
+				Batch[BatchCount].Snaplen = fres;
+				BatchCount++;
 
 			} while (FALSE);
 
 NPF_TapExForEachOpen_End:;
+			// The copy reads the packet from its MDLs, the bounce buffer was only for the filter
 			if (TmpBuffer)
 			{
 				ExFreePool(TmpBuffer);
 				TmpBuffer = NULL;
 			}
 
+			if (BatchCount == NPF_GROUP_BATCH)
+			{
+				NPF_StoreBatch(Open, Cpu, Batch, BatchCount, Prefix, PrefixSize, &WakeReader, &WakeDump);
+				BatchCount = 0;
+			}
+
 			pNetBuf = pNextNetBuf;
+			NbIndex++;
 		} // while (pNetBuf != NULL)
 
+#ifdef HAVE_DOT11_SUPPORT
+		// The next list rewrites the radiotap header, or has none: the batch is stored with the header of this one
+		if (BatchCount != 0 && Open->Dot11)
+		{
+			NPF_StoreBatch(Open, Cpu, Batch, BatchCount, Prefix, PrefixSize, &WakeReader, &WakeDump);
+			BatchCount = 0;
+		}
+#endif
+
 		pNetBufList = pNextNetBufList;
 	} // while (pNetBufList != NULL)
 
+	if (BatchCount != 0)
+	{
+		NPF_StoreBatch(Open, Cpu, Batch, BatchCount, Prefix, PrefixSize, &WakeReader, &WakeDump);
+	}
+
+	// The reader is woken once for the whole chain
+	if (WakeDump)
+	{
+		NdisSetEvent(&Open->DumpEvent);
+	}
+
+	if (WakeReader && Open->ReadEvent != NULL)
+	{
+		KeSetEvent(Open->ReadEvent, 0, FALSE);
+	}
+
 	//NPF_StopUsingOpenInstance(Open);
 	//TRACE_EXIT();
 }
@@ -30,6 +30,7 @@ NPF_Write(
 	NDIS_STATUS			Status;
 	ULONG				NumSends;
 	ULONG				numSentPackets;
+	LOCK_STATE_EX		LockState;
 
 	TRACE_ENTER();
 
@@ -222,20 +223,21 @@ NPF_Write(
 			{
 #endif
 				/* Lock the group */
-				NdisAcquireSpinLock(&Open->GroupHead->GroupLock);
+				NdisAcquireRWLockRead(Open->GroupHead->GroupLock, &LockState, 0);
 				GroupOpen = Open->GroupHead->GroupNext;
 				while (GroupOpen != NULL)
 				{
 					TempOpen = GroupOpen;
 					if (TempOpen->AdapterBindingStatus == ADAPTER_BOUND && TempOpen->SkipSentPackets == FALSE)
 					{
-						NPF_TapExForEachOpen(TempOpen, pNetBufferList);
+						NPF_TapExForEachOpen(TempOpen, pNetBufferList, NULL, BPF_DIRECTION_OUT);
 					}
 
 					GroupOpen = TempOpen->GroupNext;
 				}
+				NPF_AdvanceFanouts(Open->GroupHead, pNetBufferList);
 				/* Release the spin lock no matter what. */
-				NdisReleaseSpinLock(&Open->GroupHead->GroupLock);
+				NdisReleaseRWLock(Open->GroupHead->GroupLock, &LockState);
 #ifdef HAVE_WFP_LOOPBACK_SUPPORT
 			}
 #endif
@@ -398,6 +400,7 @@ NPF_BufferedWrite(
 	//	PCHAR				CurPos;
 	//	PCHAR				EndOfUserBuff = UserBuff + UserBuffSize;
 	INT						result;
+	LOCK_STATE_EX			LockState;
 
 	TRACE_ENTER();
 
@@ -594,7 +597,7 @@ NPF_BufferedWrite(
 
 		//receive the packets before sending them
 		/* Lock the group */
-		NdisAcquireSpinLock(&Open->GroupHead->GroupLock);
+		NdisAcquireRWLockRead(Open->GroupHead->GroupLock, &LockState, 0);
 		GroupOpen = Open->GroupHead->GroupNext;
 
 		while (GroupOpen != NULL)
@@ -602,13 +605,14 @@ NPF_BufferedWrite(
 			TempOpen = GroupOpen;
 			if (TempOpen->AdapterBindingStatus == ADAPTER_BOUND && TempOpen->SkipSentPackets == FALSE)
 			{
-				NPF_TapExForEachOpen(TempOpen, pNetBufferList);
+				NPF_TapExForEachOpen(TempOpen, pNetBufferList, NULL, BPF_DIRECTION_OUT);
 			}
 
 			GroupOpen = TempOpen->GroupNext;
 		}
+		NPF_AdvanceFanouts(Open->GroupHead, pNetBufferList);
 		/* Release the spin lock no matter what. */
-		NdisReleaseSpinLock(&Open->GroupHead->GroupLock);
+		NdisReleaseRWLock(Open->GroupHead->GroupLock, &LockState);
 
 		pNetBufferList->SourceHandle = Open->AdapterHandle;
 		NPFSetNBLChildOpen(pNetBufferList, Open); //save the child open object in the packets
@@ -835,6 +839,7 @@ Return Value:
 	PNET_BUFFER         Currbuff;
 	PMDL                pMdl;
 	POPEN_INSTANCE		Open = (POPEN_INSTANCE) FilterModuleContext;
+	LOCK_STATE_EX		LockState;
 
 	TRACE_ENTER();
 
@@ -859,7 +864,7 @@ Return Value:
 			NPF_FreePackets(pNetBufList);
 
 			/* Lock the group */
-			NdisAcquireSpinLock(&Open->GroupLock);
+			NdisAcquireRWLockRead(Open->GroupLock, &LockState, 0);
 			// this if should always be false, as Open is always the GroupHead itself, only GroupHead is known by NDIS and get invoked in NPF_SendCompleteEx() function.
 			ASSERT(Open->GroupHead == NULL);
 			if (Open->GroupHead != NULL)
@@ -884,7 +889,7 @@ Return Value:
 
 			}
 			/* Release the spin lock no matter what. */
-			NdisReleaseSpinLock(&Open->GroupLock);
+			NdisReleaseRWLock(Open->GroupLock, &LockState);
 		}
 		else
 		{
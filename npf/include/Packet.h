@@ -16,7 +16,8 @@
 #ifndef __PACKET_INCLUDE______
 #define __PACKET_INCLUDE______
 
-#ifdef _X86_
+#if defined(_X86_) || defined(_AMD64_)
+#define HAVE_BPF_JIT_SUPPORT	///< The jitter has a backend for the target architecture
 #define NTKERNEL	///< Forces the compilation of the jitter with kernel calls
 #include "jitter.h"
 #endif
@@ -29,6 +30,11 @@
 
 
 #include "win_bpf.h"
+#include "win_ebpf.h"
+#include "win_merge.h"
+#include "win_pool.h"
+#include "win_fanout.h"
+#include "win_ring.h"
 
 #define FILTER_ACQUIRE_LOCK(_pLock, DispatchLevel) NdisAcquireSpinLock(_pLock)
 #define FILTER_RELEASE_LOCK(_pLock, DispatchLevel) NdisReleaseSpinLock(_pLock)
@@ -68,6 +74,9 @@ extern NDIS_HANDLE         FilterDriverObject;
 #define NPF_DISABLE_LOOPBACK				1	///< Tells the driver to drop the packets sent by itself. This is usefult when building applications like bridges.
 #define NPF_ENABLE_LOOPBACK					2	///< Tells the driver to capture the packets sent by itself.
 
+// Flags given when the device is opened, as the name of the file after the name of the device
+#define NPF_OPEN_UNORDERED					L"\\Unordered"	///< The reads return the packets of each CPU in runs, see NPF_ReadRuns().
+
 // Admin only mode definition
 //#define NPF_ADMIN_ONLY_MODE			///< Tells the driver to restrict its access only to Administrators. This is used to support "Admin-only Mode" for Npcap.
 
@@ -85,6 +94,15 @@ extern NDIS_HANDLE         FilterDriverObject;
 // Maximum CPU core number, the original value is sizeof(KAFFINITY) * 8, but Amazon instance can return 128 cores, so we make NPF_MAX_CPU_NUMBER to 256 for safe.
 #define NPF_MAX_CPU_NUMBER					sizeof(KAFFINITY) * 32
 
+// Maximum number of MDLs of a packet that the filter reads in place, longer chains are copied in one buffer
+#define NPF_MAX_FRAGS						8
+
+// Number of packets of an indication classified at once by the group classifier, the others are filtered by each instance
+#define NPF_GROUP_BATCH						64
+
+// GroupIndex of an instance whose filter is not part of the group classifier
+#define NPF_GROUP_NONE						((ULONG)-1)
+
 // The length of the adapter name
 #define ADAPTER_NAME_SIZE					(sizeof("\\Device\\{754FC84C-EFBC-4443-B479-2EFAE01DC7BF}") - 1)
 
@@ -106,6 +124,9 @@ extern NDIS_HANDLE         FilterDriverObject;
 // Maximum pool size allowed in bytes (defence against bad BIOCSETBUFFERSIZE calls)
 #define NPF_MAX_BUFFER_SIZE 0x40000000L
 
+// Maximum size of a capture ring in bytes, all its CPUs together (defence against bad BIOCSETRING calls)
+#define NPF_MAX_RING_SIZE 0x40000000L
+
 /*!
   \brief Header of a libpcap dump file.
 
@@ -217,13 +238,13 @@ typedef struct _DEVICE_EXTENSION
   \brief Kernel buffer of each CPU.
 
   Structure containing the kernel buffer (and other CPU related fields) used to capture packets.
+  Each one starts a cache line, so that the taps of different CPUs never write the same line: the
+  OPEN_INSTANCE holding them is larger than a page, and the pool aligns it on one.
 */
-typedef struct __CPU_Private_Data
+typedef struct DECLSPEC_CACHEALIGN __CPU_Private_Data
 {
-	ULONG			P;				///< Zero-based index of the producer in the buffer. It indicates the first free byte to be written.
-	ULONG			C;				///< Zero-based index of the consumer in the buffer. It indicates the first free byte to be read.
-	ULONG			Free;			///< Number of the free bytes in the buffer
-	PUCHAR			Buffer;			///< Pointer to the kernel buffer used to capture packets.
+	PUCHAR			Buffer;			///< The blocks of the pool of the instance allocated on the NUMA node of this CPU, NULL if none.
+									///< The CPU stores its packets in any block of the pool.
 	ULONG			Accepted;		///< Number of packet that current capture instance acepted, from its opening. A packet
 									///< is accepted if it passes the filter and fits in the buffer. Accepted packets are the
 									///< ones that reach the application.
@@ -236,12 +257,117 @@ typedef struct __CPU_Private_Data
 									///< is dropped if there is no more space to store it in the circular buffer that the
 									///< driver associates to current instance.
 									///< This number is related to the particular CPU this structure is referring to.
-	NDIS_SPIN_LOCK	BufferLock;		///< It protects the buffer associated with this CPU.
+	NDIS_SPIN_LOCK	BufferLock;		///< It protects the queue of blocks of this CPU in the pool.
 	PMDL			TransferMdl1;	///< MDL used to map the portion of the buffer that will contain an incoming packet.
 	PMDL			TransferMdl2;	///< Second MDL used to map the portion of the buffer that will contain an incoming packet.
 	ULONG			NewP;			///< Used by NdisTransferData() (when we call NdisTransferData, p index must be updated only in the TransferDataComplete.
+	PMDL			BufferPages;	///< The pages of Buffer, allocated on the NUMA node of the CPU, NULL if Buffer comes from the pool.
 } CpuPrivateData;
 
+/*!
+  \brief A chunk of blocks returned by NPF_AllocateCpuBuffer(), and its pages.
+*/
+typedef struct _NPF_CPU_BUFFER
+{
+	PUCHAR			Buffer;
+	PMDL			Pages;
+} NPF_CPU_BUFFER, *PNPF_CPU_BUFFER;
+
+
+/*!
+  \brief Verdicts of the group classifier on the first NPF_GROUP_BATCH packets of an indication, computed once
+  by NPF_ClassifyNetBufferLists() for all the instances of the group.
+*/
+typedef struct _NPF_GROUP_VERDICTS
+{
+	ULONGLONG				Classified;		///< Bit n is set if the n-th NET_BUFFER of the indication has been classified.
+	ULONGLONG				Matches[NPF_GROUP_BATCH];	///< For each of them, the bitmap returned by bpf_group_filter().
+	ULONGLONG				Hashed;			///< Bit n is set if the hash of the n-th NET_BUFFER of the indication is in Hashes.
+	u_int32					Hashes[NPF_GROUP_BATCH];	///< For each of them, the npf_fanout_hash() of the packet.
+} NPF_GROUP_VERDICTS, *PNPF_GROUP_VERDICTS;
+
+
+/*!
+  \brief A packet of an indication accepted by the filter of an instance, that the tap stores with the
+  others of its batch.
+*/
+typedef struct _NPF_TAP_PACKET
+{
+	PMDL					Mdl;			///< The MDL where the packet starts.
+	ULONG					Offset;			///< Offset of the packet in Mdl.
+	ULONG					TotalLength;	///< Length of the packet.
+	ULONG					DataLength;		///< Length from Offset to the end of the chain of MDLs, the bh_datalen of the kernel buffer.
+	UINT					Snaplen;		///< The verdict of the filter, at most DataLength.
+} NPF_TAP_PACKET;
+
+
+/*!
+  \brief Working storage of the taps running on a CPU, too large for the stack at DISPATCH_LEVEL.
+
+  The tap holds the GroupLock of the adapter shared, at DISPATCH_LEVEL, from the classification of an
+  indication to the last instance of the group, and does not call NDIS until it releases it: no other tap
+  runs on the same CPU in the meantime, and one of these per CPU, shared by all the adapters, is enough.
+*/
+typedef struct DECLSPEC_CACHEALIGN _NPF_TAP_SCRATCH
+{
+	NPF_GROUP_VERDICTS		Verdicts;		///< The verdicts of the group classifier on the indication being tapped.
+	NPF_TAP_PACKET			Batch[NPF_GROUP_BATCH];	///< The packets accepted by the instance being tapped, not stored yet.
+} NPF_TAP_SCRATCH, *PNPF_TAP_SCRATCH;
+
+
+/*!
+  \brief A fanout group of the instances of an adapter, joined with BIOCSETFANOUT. Each packet goes to one of its
+  members only, see win_fanout.h.
+
+  The fanout groups of an adapter are in the list of the group head, and are changed, like their members, under the
+  exclusive GroupLock of the group head: the taps, that hold it shared, see them consistent.
+*/
+typedef struct _NPF_FANOUT
+{
+	struct _NPF_FANOUT		*Next;			///< The next fanout group of the adapter.
+	ULONG					Id;				///< The identifier chosen by the applications.
+	ULONG					Mode;			///< NPF_FANOUT_HASH, NPF_FANOUT_LB or NPF_FANOUT_CPU.
+	ULONG					Count;			///< Number of members, numbered from 0 by their FanoutIndex.
+	ULONG					Turn[NPF_MAX_CPU_NUMBER];	///< With NPF_FANOUT_LB, the number of packets tapped by each CPU:
+											///< each CPU hands its packets to the members in turn, written by the CPU only.
+} NPF_FANOUT, *PNPF_FANOUT;
+
+
+/*!
+  \brief A filter installed with BIOCSETF, in all the forms in which the tap can run it.
+
+  The filter is built entirely before it is published in the Filter field of its instance and is never changed
+  afterwards, so that the tap runs it on every CPU at once without any lock. It is replaced as a whole under the
+  exclusive GroupLock of the group of the instance, that the taps hold shared: once the new filter is published
+  and the lock is released, no tap can still be running the previous one, which can be freed.
+*/
+typedef struct _NPF_FILTER
+{
+	PUCHAR					bpfprogram;		///< The filtering pseudo-code. It is run by bpf_filter() when no faster form
+											///< of the filter is available, and by bpf_filter_frags() when the packet
+											///< received from the NIC driver is stored in several non-consecutive buffers.
+	UINT					BpfProgramLength;	///< Number of instructions in bpfprogram, 0 if it must not be merged in the
+											///< group classifier (e.g. it uses the TME extensions).
+#ifdef HAVE_BPF_JIT_SUPPORT
+	JIT_BPF_Filter*			Jit;			///< Pointer to the native filtering function created by the jitter, NULL if
+											///< the jitter failed. See BPF_jitter() for details.
+#endif //HAVE_BPF_JIT_SUPPORT
+	struct bpf_shape*		Shape;			///< The native matcher of the filter, if its program has one of the common shapes
+											///< (see bpf_shape_recognize()). It runs the packets stored in a single buffer,
+											///< before the jitted filter; those stored in several buffers go to the latter.
+	struct bpf_decoded_program* DecodedProgram;	///< The filter pre-decoded for bpf_filter_decoded(), used when there is no
+											///< shape nor jitted filter. NULL if the filter could not be decoded, in which
+											///< case bpf_filter() runs bpfprogram.
+	struct bpf_flow_program* FlowProgram;	///< The loads of the filter and the per-CPU caches of its verdicts, see
+											///< bpf_flow_compile(). NULL if the filter cannot be cached.
+	struct bpf_prefilter	Prefilter;		///< The necessary conditions of the filter, checked before it runs on the packets
+											///< stored in a single buffer. Empty for the filters without any.
+	struct ebpf_program*	ExtendedProgram;	///< The extended program, with its maps, if the filter was given in that
+											///< format (see ebpf_load()). All the other forms are then empty.
+	ULONG					MatchSets;		///< The pattern sets searched by the filter, bit i for bpf_match_sets[i]. The
+											///< filter holds a reference on each of them, see NPF_ReferenceMatchSets().
+} NPF_FILTER, *PNPF_FILTER;
+
 
 /*!
   \brief Contains the state of a running instance of the NPF driver.
@@ -269,7 +395,18 @@ typedef struct _OPEN_INSTANCE
 	struct _OPEN_INSTANCE	*Next;
 	struct _OPEN_INSTANCE	*GroupNext;
 	struct _OPEN_INSTANCE	*GroupHead;
-	NDIS_SPIN_LOCK GroupLock;
+	PNDIS_RW_LOCK_EX		GroupLock;		///< Group heads only: held shared by the taps while they walk the group and run the
+											///< filters of its instances, exclusively to change the group or one of these filters.
+	struct bpf_group_program* GroupProgram;	///< Group heads only: the filters of the instances of the group merged by
+											///< NPF_UpdateGroupClassifier(), NULL if fewer than two can be. Protected by GroupLock.
+	ULONG					GroupGeneration;	///< Group heads only: changed by NPF_InvalidateGroupClassifier() with the group
+											///< or the filters of its instances, under the exclusive GroupLock.
+	PNPF_FANOUT				Fanouts;		///< Group heads only: the fanout groups of the adapter. Protected by GroupLock.
+	ULONG					GroupIndex;		///< Index of the filter of this instance in the group classifier, or NPF_GROUP_NONE.
+	UINT					GroupAccept;	///< What the filter of this instance returns for the packets the classifier accepts.
+	PNPF_FANOUT				Fanout;			///< The fanout group of this instance, NULL if it gets all the packets. Protected by
+											///< the GroupLock of the group head.
+	ULONG					FanoutIndex;	///< The number of this instance among the members of Fanout.
 
 	ULONG					MyPacketFilter;
 	ULONG					HigherPacketFilter;
@@ -293,17 +430,16 @@ typedef struct _OPEN_INSTANCE
 	LIST_ENTRY				RequestList;	///< List of pending OID requests.
 	LIST_ENTRY				ResetIrpList;	///< List of pending adapter reset requests.
 	INTERNAL_REQUEST		Requests[MAX_REQUESTS]; ///< Array of structures that wrap every single OID request.
-	PMDL					BufferMdl;		///< Pointer to a Memory descriptor list (MDL) that maps the circular buffer's memory.
+	PMDL					BufferMdl;		///< Pointer to a Memory descriptor list (MDL) that describes the pages of the capture
+											///< ring, mapped in the system and in the application, see NPF_MapRing().
 	PKEVENT					ReadEvent;		///< Pointer to the event on which the read calls on this instance must wait.
-	PUCHAR					bpfprogram;		///< Pointer to the filtering pseudo-code associated with current instance of the driver.
-											///< This code is used only in particular situations (for example when the packet received
-											///< from the NIC driver is stored in two non-consecutive buffers. In normal situations
-											///< the filtering routine created by the JIT compiler and pointed by the next field
-											///< is used. See \ref NPF for details on the filtering process.
-#ifdef _X86_
-	JIT_BPF_Filter*			Filter;			///< Pointer to the native filtering function created by the jitter.
-	///< See BPF_jitter() for details.
-#endif //_X86_
+	PNPF_FILTER				Filter;			///< The filter associated with current instance of the driver, NULL if there is
+											///< none. See \ref NPF for details on the filtering process.
+	BOOLEAN					ProfileEnabled;	///< TRUE if the profiling of the filter is enabled with BIOCSPROFILE.
+	struct bpf_profile_counter* Profile;	///< The counters of the instructions of the filter while the profiling is enabled,
+											///< NULL otherwise or if there is no filter that can be profiled. Replaced under
+											///< the exclusive GroupLock and the MachineLock, updated under the MachineLock.
+	ULONGLONG				ProfilePackets;	///< Number of packets counted in Profile.
 	UINT					MinToCopy;		///< Minimum amount of data in the circular buffer that unlocks a read. Set with the
 											///< BIOCSMINTOCOPY IOCTL.
 	LARGE_INTEGER			TimeOut;		///< Timeout after which a read is released, also if the amount of data in the buffer is
@@ -342,7 +478,9 @@ typedef struct _OPEN_INSTANCE
 	TME_CORE				tme;			///< Data structure containing the virtualization of the TME co-processor
 #endif//HAVE_BUGGY_TME_SUPPORT
 
-	NDIS_SPIN_LOCK			MachineLock;	///< SpinLock that protects the BPF filter and the TME engine, if in use.
+	NDIS_SPIN_LOCK			MachineLock;	///< SpinLock that serializes the installation of the filter, and protects the
+											///< profiling counters and the TME engine, if in use. The filter itself runs
+											///< without it.
 	UINT					MaxFrameSize;	///< Maximum frame size that the underlying MAC acceptes. Used to perform a check on the
 											///< size of the frames sent with NPF_Write() or NPF_BufferedWrite().
 	//
@@ -350,10 +488,23 @@ typedef struct _OPEN_INSTANCE
 	// We use its size to compute the max number of CPUs.
 	//
 	CpuPrivateData			CpuData[NPF_MAX_CPU_NUMBER];	///< Pool of kernel buffer structures, one for each CPU.
-	ULONG					ReaderSN;		///< Sequence number of the next packet to be read from the pool of kernel buffers.
-	ULONG					WriterSN;		///< Sequence number of the next packet to be written in the pool of kernel buffers.
-											///< These two sequence numbers are unique for each capture instance.
-	ULONG					Size;			///< Size of each kernel buffer contained in the CpuData field.
+	struct npf_merge_entry	Merge[NPF_MAX_CPU_NUMBER];		///< The heap of the buffers merged by NPF_Read(), under the ReadMutex.
+	struct npf_pool*		Pool;			///< The kernel buffer: the blocks in which the tap of each CPU stores the packets that
+											///< NPF_Read() copies, NULL if there is none. Replaced under the ReadMutex and all the
+											///< BufferLocks.
+	FAST_MUTEX				ReadMutex;		///< Serializes the copies of NPF_Read() from Pool, and keeps the pool from being
+											///< replaced or emptied under them.
+	ULONG					Size;			///< Size of the kernel buffer, the blocks of Pool, 0 if there is none.
+	BOOLEAN					Unordered;		///< True if the instance was opened with NPF_OPEN_UNORDERED: the packets are not stamped
+											///< and NPF_Read() does not merge the CPUs.
+	ULONG					ReadCpu;		///< The CPU whose packets an unordered NPF_Read() copies first, under the ReadMutex.
+	struct npf_ring*		Ring;			///< The capture ring mapped in the application with BIOCSETRING, NULL if the packets
+											///< are read with NPF_Read(). Replaced under all the BufferLocks, that the tap holds
+											///< to store a packet in it.
+	PVOID					RingAddress;	///< Where the shared region of Ring is mapped in RingProcess.
+	PEPROCESS				RingProcess;	///< The process that mapped Ring, referenced until it is unmapped.
+	LIST_ENTRY				RingLink;		///< Links the instance in g_RingList while it has a ring, under g_RingMutex.
+	PEPROCESS				OwnerProcess;	///< The process that opened the instance, the only one that can map a ring in it.
 	ULONG					AdapterHandleUsageCounter;
 	NDIS_SPIN_LOCK			AdapterHandleLock;
 	ULONG					AdapterBindingStatus;	///< Specifies if NPF is still bound to the adapter used by this instance, it's unbinding or it's not bound.
@@ -380,16 +531,30 @@ enum ADAPTER_BINDING_STATUS
   \brief Structure prepended to each packet in the kernel buffer pool.
 
   Each packet in one of the kernel buffers is prepended by this header. It encapsulates the bpf_header,
-  which will be passed to user level programs, as well as the sequence number of the packet, set by the producer (the tap function),
+  which will be passed to user level programs, as well as the stamp of the packet, set by the producer (the tap function),
   and used by the consumer (the read function) to "reorder" the packets contained in the various kernel buffers.
 */
 struct PacketHeader
 {
-	ULONG			SN;				///< Sequence number of the packet.
+	ULONGLONG		Stamp;			///< Performance counter when the packet was stored, the same clock on all the CPUs.
+									///< 0 on an unordered instance.
 	struct bpf_hdr	header;			///< bpf header, created by the tap, and copied unmodified to user level programs.
 };
 
+/*!
+  \brief Header of the packets returned by NPF_Read() on an unordered instance, the same in Packet32.h.
+
+  Its bh_hdrlen covers the index of the CPU, so that the programs that skip bh_hdrlen bytes to find the
+  data of a packet read it unchanged.
+*/
+struct bpf_cpu_hdr
+{
+	struct bpf_hdr	header;			///< bpf header, with bh_hdrlen set to the size of this structure.
+	ULONG			cpu;			///< The CPU that stored the packet.
+};
+
 extern ULONG g_NCpu;
+extern PNPF_TAP_SCRATCH g_TapScratch; // from packet.c, one per CPU
 extern struct time_conv G_Start_Time; // from openclos.c
 
 #define TRANSMIT_PACKETS 256	///< Maximum number of packets in the transmit packet pool. This value is an upper bound to the number
@@ -818,6 +983,39 @@ My_KeGetCurrentProcessorNumber(
 );
 
 
+/*!
+  \brief Finds the NUMA node of each CPU, on Win7 and later with more than one node.
+*/
+VOID
+NPF_InitCpuNodes(
+);
+
+
+/*!
+  \brief Allocates a chunk of blocks of the kernel buffer, on the NUMA node of a CPU if possible.
+  \param Cpu The system-wide index of the CPU.
+  \param Size The size of the chunk.
+  \param pPages Receives the MDL of the pages of the buffer, or NULL if it comes from the non paged pool.
+  \return The buffer, to be released with NPF_FreeCpuBuffer(), or NULL if there is no memory.
+*/
+PUCHAR
+NPF_AllocateCpuBuffer(
+	IN ULONG Cpu,
+	IN ULONG Size,
+	OUT PMDL* pPages
+);
+
+
+/*!
+  \brief Frees a buffer allocated with NPF_AllocateCpuBuffer(), if it is not NULL.
+*/
+VOID
+NPF_FreeCpuBuffer(
+	IN PUCHAR Buffer,
+	IN PMDL Pages
+);
+
+
 /*!
   \brief The initialization routine of the driver.
   \param DriverObject The driver object of NPF created by the system.
@@ -978,16 +1176,60 @@ DRIVER_DISPATCH NPF_CloseAdapter;
   \brief Callback invoked by NPF_TapEx() when a packet arrives from the network.
   \param Open Pointer to an OPEN_INSTANCE structure to which the packets are destined.
   \param pNetBufferLists A List of NetBufferLists to receive.
+  \param Verdicts The verdicts of the classifier of the group of Open on the packets, or NULL. The filter of Open is
+  run only on the packets that have not been classified, or if it is not part of the classifier. If Open is the
+  member of a fanout group, it takes the hashes of the packets from Verdicts too.
+  \param Direction BPF_DIRECTION_IN for the packets received from the network, BPF_DIRECTION_OUT for the ones sent
+  by this host. The filter reads it, with the VLAN tag, the RSS hash, the CPU and the 802.11 PHY type of the packets,
+  through the ancillary loads.
 
   NPF_TapExForEachOpen() is called by the underlying NIC for every incoming packet. It is the most important and one of
   the most complex functions of NPF: it executes the filter, runs the statistical engine (if the instance is in
   statistical mode), gathers the timestamp, moves the packet in the buffer. NPF_tap() is the only function,
   along with the filtering ones, that is executed for every incoming packet, therefore it is carefully
   optimized.
+
+  The filter runs without any lock on batches of up to NPF_GROUP_BATCH packets of the indication, then the ones it
+  accepts are stored under a single acquisition of the BufferLock of the CPU, and share the timestamp taken then. The
+  reader is woken once, after the whole chain.
 */
 VOID
 NPF_TapExForEachOpen(
 	IN POPEN_INSTANCE Open,
+	IN PNET_BUFFER_LIST pNetBufferLists,
+	IN PNPF_GROUP_VERDICTS Verdicts,
+	IN ULONG Direction
+	);
+
+
+/*!
+  \brief Runs the group classifier of a group head on the packets of an indication.
+  \param GroupHead The group head, whose GroupLock must be held.
+  \param pNetBufferLists The packets.
+  \param Verdicts Receives the verdicts.
+  \return Verdicts, or NULL if the group has neither a classifier nor a fanout group by hash.
+
+  Only the first NPF_GROUP_BATCH packets that are in a single buffer are classified: the filters of the instances
+  run on the others. The hashes of the first NPF_GROUP_BATCH packets are computed once for all the members of the
+  fanout groups by hash.
+*/
+PNPF_GROUP_VERDICTS
+NPF_ClassifyNetBufferLists(
+	IN POPEN_INSTANCE GroupHead,
+	IN PNET_BUFFER_LIST pNetBufferLists,
+	OUT PNPF_GROUP_VERDICTS Verdicts
+	);
+
+
+/*!
+  \brief Moves the turns of the fanout groups of a group head that hand the packets to their members in turn past the
+  packets of an indication.
+  \param GroupHead The group head, whose GroupLock must be held.
+  \param pNetBufferLists The packets, once all the members of the group have tapped them.
+*/
+VOID
+NPF_AdvanceFanouts(
+	IN POPEN_INSTANCE GroupHead,
 	IN PNET_BUFFER_LIST pNetBufferLists
 	);
 
@@ -1014,6 +1256,8 @@ NPF_TapExForEachOpen(
   - #BIOCGEVNAME
   -	#BIOCSENDPACKETSSYNC
   -	#BIOCSENDPACKETSNOSYNC
+  - #BIOCSPROFILE
+  - #BIOCGPROFILE
 */
 _Dispatch_type_(IRP_MJ_DEVICE_CONTROL)
 _IRQL_requires_max_(PASSIVE_LEVEL)
@@ -1218,6 +1462,62 @@ NPF_RemoveFromGroupOpenArray(
 	);
 
 
+/*!
+  \brief Drops the group classifier of a head adapter, whose group or one of whose filters changes.
+  \param GroupHead Pointer to the head adapter context, whose GroupLock must be held exclusively.
+
+  The instances filter the packets on their own until NPF_UpdateGroupClassifier() is called, once the lock is
+  released.
+*/
+void
+NPF_InvalidateGroupClassifier(
+	POPEN_INSTANCE GroupHead
+	);
+
+
+/*!
+  \brief Rebuilds the group classifier of a head adapter from the filters of the instances of its group.
+  \param GroupHead Pointer to the head adapter context, whose GroupLock must not be held.
+
+  Called at PASSIVE_LEVEL whenever an instance joins or leaves the group, or installs a new filter, after
+  NPF_InvalidateGroupClassifier(). The filters are copied under the shared GroupLock and compiled without any
+  lock; the classifier is installed under the exclusive GroupLock only if GroupGeneration has not changed
+  meanwhile. The filters that are part of the classifier run once for all the instances on each packet, see
+  bpf_group_compile().
+*/
+void
+NPF_UpdateGroupClassifier(
+	POPEN_INSTANCE GroupHead
+	);
+
+
+/*!
+  \brief Makes an instance join a fanout group of its adapter, or leave its fanout group.
+  \param Open Pointer to open context structure.
+  \param Id The fanout group, created if it does not exist.
+  \param Mode The mode of the fanout group, NPF_FANOUT_NONE to leave the fanout group of the instance.
+  \return STATUS_SUCCESS, or an error if the instance is not bound to an adapter, if the group exists with another
+  mode or if there is no memory. The instance leaves its previous fanout group only on success.
+*/
+NTSTATUS
+NPF_SetFanout(
+	POPEN_INSTANCE Open,
+	ULONG Id,
+	ULONG Mode
+	);
+
+
+/*!
+  \brief Removes an instance from its fanout group, renumbering the other members.
+  \param Open Pointer to open context structure, whose group head's GroupLock must be held exclusively.
+  \return The fanout group, unlinked from the group head, if it has no member left and must be freed, NULL otherwise.
+*/
+PNPF_FANOUT
+NPF_LeaveFanout(
+	POPEN_INSTANCE Open
+	);
+
+
 /*!
   \brief Compare two NDIS strings.
   \param s1 The first string.
@@ -1384,8 +1684,71 @@ ULONG NPF_GetCurrentFrequency_Wrapper(IN POPEN_INSTANCE pOpen);
 UINT GetBuffOccupation(POPEN_INSTANCE Open);
 
 
+/*!
+  \brief Empties the kernel buffer of an instance and resets its counters, with the readers kept out.
+  \param Open The NPF instance. Must be called at PASSIVE_LEVEL.
+*/
 VOID NPF_ResetBufferContents(POPEN_INSTANCE Open);
 
+/*!
+  \brief Frees a filter and all its forms.
+  \param Filter The filter, that must not be published any more. Can be NULL.
+*/
+VOID NPF_FreeFilter(PNPF_FILTER Filter);
+
+/*!
+  \brief Takes a reference on the pattern sets that a filtering program searches with BPF_MISC|BPF_MATCH.
+  \param Open The instance that installs the program, that must own the sets.
+  \param Program The validated program.
+  \param Length Its length in instructions.
+  \param pSets Receives the bitmap of the sets, to be released with NPF_ReleaseMatchSets().
+  \return FALSE, with no reference taken, if a set is not installed or belongs to another instance.
+*/
+BOOLEAN NPF_ReferenceMatchSets(POPEN_INSTANCE Open, struct bpf_insn* Program, UINT Length, PULONG pSets);
+
+/*!
+  \brief Releases the references taken by NPF_ReferenceMatchSets().
+*/
+VOID NPF_ReleaseMatchSets(ULONG Sets);
+
+/*!
+  \brief Deletes the pattern sets installed by an instance that closes, once its filter is freed.
+*/
+VOID NPF_FreeMatchSets(POPEN_INSTANCE Open);
+
+/*!
+  \brief Creates the capture ring of an instance and maps it in the calling process.
+  \param Open The instance, that must not have a ring yet.
+  \param BlockSize Size of a block of the ring.
+  \param BlockCount Number of blocks of each CPU.
+  \param pUserAddress Receives the address of the shared region in the calling process.
+  \return STATUS_SUCCESS, or the reason of the failure.
+
+  From then on the tap stores the packets accepted by the filter in the ring, and NPF_Read() fails.
+  Only the process that opened the instance can map its ring.
+*/
+NTSTATUS NPF_MapRing(POPEN_INSTANCE Open, ULONG BlockSize, ULONG BlockCount, PVOID* pUserAddress);
+
+/*!
+  \brief Unmaps the capture ring of an instance, if it has one, and frees it.
+
+  Called by NPF_Cleanup(), in the context of the process that closes the instance, or when the process
+  that mapped the ring exits, from NPF_ProcessNotify(), while that process still has its address space.
+  In any other process, the view is unmapped by attaching to RingProcess, that has not exited yet.
+*/
+VOID NPF_UnmapRing(POPEN_INSTANCE Open);
+
+/*!
+  \brief Unmaps the capture rings mapped by a process that exits, registered with PsSetCreateProcessNotifyRoutine().
+  \param ParentId The parent of the process.
+  \param ProcessId The process.
+  \param Create TRUE if the process is created, FALSE if it exits.
+
+  A handle inherited or duplicated by another process can outlive the process that mapped the ring; the
+  instance then falls back to the kernel buffer.
+*/
+VOID NPF_ProcessNotify(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create);
+
 /**
  *  @}
  */
@@ -0,0 +1,58 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Definitions needed to compile the portable parts of the BPF engine
+ * (interpreter, validator) outside of the Windows DDK/SDK, i.e. on the
+ * POSIX hosts used to test and benchmark them. Only included when
+ * NPF_HOST_BUILD is defined; the driver and Packet.dll never see this file.
+ */
+
+#ifndef __BPF_HOST_INCLUDE
+#define __BPF_HOST_INCLUDE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+/*
+ * Windows basic types. LONG and ULONG are 32 bit on every Windows ABI,
+ * so they are mapped on fixed-width types and not on long.
+ */
+typedef uint8_t UCHAR, *PUCHAR;
+typedef char CHAR, *PCHAR;
+typedef uint16_t USHORT, *PUSHORT;
+typedef int32_t INT, *PINT;
+typedef uint32_t UINT, *PUINT;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef void VOID, *PVOID;
+typedef UCHAR BOOLEAN;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+#define RtlMoveMemory(Destination, Source, Length) memmove((Destination), (Source), (Length))
+#define RtlEqualMemory(Destination, Source, Length) (!memcmp((Destination), (Source), (Length)))
+
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+
+#define __cdecl
+
+#endif /*__BPF_HOST_INCLUDE*/
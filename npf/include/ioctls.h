@@ -34,10 +34,14 @@
 
   This IOCTL sets a new packet filter in the driver. Before allocating any memory for the new filter, the 
   bpf_validate() function is called to check the correctness of the filter. If this function returns TRUE, 
-  the filter is copied to the driver's memory, its address is stored in the bpfprogram field of the 
+  the filter is copied to the driver's memory, compiled in a NPF_FILTER structure that replaces the one of the
   OPEN_INSTANCE structure associated with current instance of the driver, and the filter will be applied to 
-  every incoming packet. This command also empties the circular buffer used by current instance 
-  to store packets. This is done to avoid the presence in the buffer of packets that do not match the filter.
+  every incoming packet. If the new filter cannot be installed, the previous one stays in place. This command
+  also empties the circular buffer used by current instance to store packets. This is done to avoid the presence
+  in the buffer of packets that do not match the filter.
+
+  The buffer can also hold an extended program, which starts with a struct ebpf_program_header: it is verified
+  by ebpf_load() instead of bpf_validate() and is run by the interpreter of the extended programs, with its maps.
 */
 #define	 BIOCSETF 9030
 
@@ -138,6 +142,78 @@
 */
 #define  BIOCSETDUMPLIMITS 9034
 
+/*!
+  \brief IOCTL code: enable or disable the profiling of the filter.
+
+  Parameter: ULONG, not 0 to enable the profiling, 0 to disable it. Enabling it resets the counters.
+  While the profiling is enabled, the filter runs in bpf_filter_profile(), that counts for each instruction how
+  many times it runs and how many packets it accepts or rejects. This is slower than the other engines, and
+  the filter is run for every instance even when its group could share it. The packets split across several
+  buffers by the miniport are filtered but not profiled. The counters are reset when a new filter is installed.
+*/
+#define  BIOCSPROFILE 9040
+
+/*!
+  \brief IOCTL code: get the counters of the profiling of the filter.
+
+  Returns a bpf_profile structure, followed by as many of its bp_len bpf_profile_insn structures, i.e. the
+  instructions of the filter as installed with their counters, as fit in the output buffer.
+*/
+#define  BIOCGPROFILE 9044
+
+/*!
+  \brief IOCTL code: get the content of a map of the extended program installed with BIOCSETF.
+
+  The input buffer holds the index of the map, as a ULONG. Returns a struct ebpf_map_info, followed by as many
+  of its records as fit in the output buffer; see ebpf_map_dump().
+*/
+#define  BIOCGMAP 9048
+
+/*!
+  \brief IOCTL code: install a set of patterns for the BPF_MISC|BPF_MATCH instructions of the filters.
+
+  The input buffer holds the image of the set: a struct bpf_match_header followed by the patterns, see
+  bpf_match_compile(). Returns the id of the set, as a ULONG, that is the k of the instructions that search it.
+  A set belongs to the instance that installs it: only the filters of that instance can use it, and it is
+  deleted when the instance is closed.
+*/
+#define  BIOCSMATCH 9052
+
+/*!
+  \brief IOCTL code: delete a set of patterns installed with BIOCSMATCH.
+
+  The input buffer holds the id of the set, as a ULONG. Fails if the installed filter still searches it.
+*/
+#define  BIOCDMATCH 9056
+
+/*!
+  \brief IOCTL code: map the capture ring of the instance in the calling process.
+
+  The input buffer holds a struct npf_ring_request. Returns the address of the shared region in the calling
+  process, as a ULONGLONG; see win_ring.h for its layout. The packets accepted by the filter are then stored
+  in the ring instead of the kernel buffer, and the reads fail. A request with 0 blocks unmaps the ring; it is
+  also unmapped when the instance is closed.
+*/
+#define  BIOCSETRING 9060
+
+/*!
+  \brief IOCTL code: give the open blocks of the capture ring to the application.
+
+  The blocks being filled by the tap are closed if they hold any packet, so that the application gets the
+  packets waiting there when the traffic is too slow to fill them.
+*/
+#define  BIOCFLUSHRING 9064
+
+/*!
+  \brief IOCTL code: join a fanout group of the adapter, or leave it.
+
+  The input buffer holds a struct npf_fanout_request. The instances in the same fanout group share its packets,
+  each packet going to one of them only, chosen as the mode of the group says; see win_fanout.h. Fails if the
+  group exists with another mode. The instance leaves its previous fanout group, and leaves the group when it
+  is closed.
+*/
+#define  BIOCSETFANOUT 9068
+
 /*!
   \brief IOCTL code: Get the status of the kernel dump process.
 
@@ -48,12 +48,36 @@ typedef struct binary_stream
 }binary_stream;
 
 
+struct bpf_meta;
+
 /*! \brief Prototype of a filtering function created by the jitter. 
 
-  The syntax and the meaning of the parameters is analogous to the one of bpf_filter(). Notice that the filter
+  The syntax and the meaning of the parameters is analogous to the one of bpf_filter_meta(). Notice that the filter
   is not among the parameters, because it is hardwired in the function.
 */
-typedef UINT (__cdecl *BPF_filter_function)(PVOID*, ULONG, UINT);
+typedef UINT (__cdecl *BPF_filter_function)(PVOID*, ULONG, UINT, struct bpf_meta*);
+
+struct bpf_frag;
+
+/*! \brief Prototype of a filtering function for the packets split in several buffers, created by the jitter.
+
+  Like bpf_filter_frags(), the packet is given as an array of struct bpf_frag covering at least the
+  buflen bytes.
+*/
+typedef UINT (__cdecl *BPF_frags_function)(struct bpf_frag*, ULONG, UINT, struct bpf_meta*);
+
+struct bpf_packet;
+
+/*! \brief Prototype of a filtering function for a batch of packets, created by the jitter.
+
+  Like bpf_filter_batch(), it writes the result of the program on each of the count packets in the array of verdicts.
+*/
+typedef void (__cdecl *BPF_batch_function)(struct bpf_packet*, UINT, UINT*);
+
+/// Kinds of function built by BPFtoX64() from the same program
+#define JIT_MODE_PACKET		0	///< A BPF_filter_function
+#define JIT_MODE_FRAGS		1	///< A BPF_frags_function
+#define JIT_MODE_BATCH		2	///< A BPF_batch_function
 
 /*! \brief Prototype of the emit functions.
 
@@ -69,11 +93,19 @@ typedef void (*emit_func)(binary_stream* stream, ULONG value, UINT n);
 typedef struct JIT_BPF_Filter
 {
 	BPF_filter_function Function;	///< The x86 filtering binary, in the form of a BPF_filter_function.
-	PINT mem;
+	BPF_frags_function FragsFunction;	///< The same program for the packets in several buffers. NULL if
+									///< the jitter of this architecture does not create it.
+	BPF_batch_function BatchFunction;	///< The same program for a batch of packets. NULL if the jitter of
+									///< this architecture does not create it.
 }
 JIT_BPF_Filter;
 
 
+#if defined(_AMD64_) || defined(__x86_64__)
+
+#include "jitter_amd64.h"
+
+#else // _AMD64_
 
 
 /**************************/
@@ -113,6 +145,12 @@ JIT_BPF_Filter;
   emitm(&stream,  (dr8 & 0x7) << 3 | 4 , 1);\
   emitm(&stream,  (or32 & 0x7) << 3 | (sr32 & 0x7) , 1);
 
+/// mov dr32[off],sr32
+#define MOVmdd(dr32, off, sr32) \
+  emitm(&stream, 0x89, 1); \
+  emitm(&stream,  1 << 6 | (sr32 & 0x7) << 3 | dr32 & 0x7, 1);\
+  emitm(&stream,  off, 1);
+
 /// mov [dr32][or32],sr32
 #define MOVomd(dr32, or32, sr32) \
   emitm(&stream, 0x89, 1); \
@@ -141,6 +179,11 @@ JIT_BPF_Filter;
 #define RET() \
   emitm(&stream, 12 << 4 | 0 << 3 | 3, 1);
 
+/// call r32
+#define CALLr(r32) \
+  emitm(&stream, 0xff, 1);\
+  emitm(&stream, 3 << 6 | 2 << 3 | (r32 & 0x7), 1);
+
 /// add dr32,sr32
 #define ADDrd(dr32, sr32) \
   emitm(&stream, 0x03, 1);\
@@ -168,6 +211,12 @@ JIT_BPF_Filter;
   emitm(&stream, 0x2b, 1);\
   emitm(&stream, 3 << 6 | (dr32 & 0x7) << 3 | (sr32 & 0x7), 1);
 
+/// sub r32,i8
+#define SUBib(r32, i8) \
+  emitm(&stream, 0x83, 1);\
+  emitm(&stream, 29 << 3 | r32, 1);\
+  emitm(&stream, i8, 1);
+
 /// sub eax,i32
 #define SUB_EAXi(i32) \
   emitm(&stream, 0x2d, 1);\
@@ -267,6 +316,11 @@ JIT_BPF_Filter;
   emitm(&stream,  0x1f << 3 | (dr32 & 0x7), 1);\
   emitm(&stream,  i32, 4);}
 
+/// je off8
+#define JEb(off8) \
+   emitm(&stream, 0x74, 1);\
+   emitm(&stream, off8, 1);
+
 /// jne off32
 #define JNEb(off8) \
    emitm(&stream, 0x75, 1);\
@@ -333,6 +387,8 @@ JIT_BPF_Filter;
    emitm(&stream, 0xe9, 1);\
    emitm(&stream, off32, 4);
 
+#endif // _AMD64_
+
 /**
  *  @}
  */
@@ -346,28 +402,48 @@ JIT_BPF_Filter;
  */
 
 /*!
-  \brief BPF jitter, builds an x86 function from a BPF program.
+  \brief BPF jitter, builds an x86 (or x86-64) function from a BPF program.
   \param fp The BPF pseudo-assembly filter that will be translated into x86 code.
   \param nins Number of instructions of the input filter.
   \return The JIT_BPF_Filter structure containing the x86 filtering binary.
 
   BPF_jitter allocates the buffers for the new native filter and then translates the program pointed by fp
-  calling BPFtoX86().
+  calling BPFtoX86() (BPFtoX64() on x86-64).
 */ 
 JIT_BPF_Filter* BPF_jitter(struct bpf_insn* fp, INT nins);
 
+#if defined(_AMD64_) || defined(__x86_64__)
+/*!
+  \brief Translates a set of BPF instructions in a set of x86-64 ones.
+  \param ins Pointer to the BPF instructions that will be translated into x86-64 code.
+  \param nins Number of instructions to translate.
+  \param Mode The kind of function to build, one of the JIT_MODE_* values.
+  \return The x86-64 filtering function: a BPF_filter_function, a BPF_frags_function or a BPF_batch_function.
+
+  A and X live in registers, and so do the most used words of the scratch memory; the others are kept in
+  the stack frame of the function. The generated code has no state outside of its frame, therefore it can
+  run on any number of CPUs at the same time.
+
+  With JIT_MODE_FRAGS, the loads in the first fragment are done inline and the others call bpf_frag_load().
+  The matches (BPF_MISC|BPF_MATCH) call bpf_match(), or bpf_match_frags() with JIT_MODE_FRAGS.
+  With JIT_MODE_BATCH, the program is the body of a loop over the packets, and its returns store the verdict
+  and go on with the next packet.
+*/
+PVOID BPFtoX64(struct bpf_insn* ins, UINT nins, UINT Mode);
+#else // _AMD64_
 /*!
   \brief Translates a set of BPF instructions in a set of x86 ones.
   \param ins Pointer to the BPF instructions that will be translated into x86 code.
   \param nins Number of instructions to translate.
-  \param mem Memory used by the x86 function to emulate the RAM of the BPF pseudo processor.
   \return The x86 filtering function.
 
   This function does the hard work for the JIT compilation. It takes a group of BPF pseudo instructions and 
   through the instruction macros defined in jitter.h it is able to create an function directly executable
-  by NPF.
+  by NPF. The scratch memory of the program is kept in the stack frame of the function, which has no state
+  outside of it and can therefore run on any number of CPUs at the same time.
 */ 
-BPF_filter_function BPFtoX86(struct bpf_insn* ins, UINT nins, INT* mem);
+BPF_filter_function BPFtoX86(struct bpf_insn* ins, UINT nins);
+#endif // _AMD64_
 /*!
   \brief Deletes a filtering function that was previously created by BPF_jitter().
   \param Filter The filter to destroy.
@@ -0,0 +1,375 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/** @addtogroup NPF
+ *  @{
+ */
+
+/** @defgroup NPF_jitter_amd64 NPF Just-in-time compiler definitions for x86-64
+ *  @{
+ */
+
+//
+// Registers
+//
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R8  8
+#define R9  9
+#define R10 10
+#define R11 11
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+//
+// Condition codes, low nibble of the Jcc opcodes
+//
+#define CC_B	0x2
+#define CC_AE	0x3
+#define CC_E	0x4
+#define CC_NE	0x5
+#define CC_BE	0x6
+#define CC_A	0x7
+#define CC_L	0xc
+#define CC_GE	0xd
+#define CC_LE	0xe
+#define CC_G	0xf
+
+#define REX_W	8
+
+
+/*****************************/
+/* X86-64 INSTRUCTION MACROS */
+/*****************************/
+
+//
+// All the 32 bit operations zero the upper half of their destination register,
+// so the BPF registers can be kept in 32 bit registers and then used as 64 bit
+// indexes without explicit extensions.
+//
+
+/// REX prefix, emitted only if one of its bits is needed. r is the register in ModRM.reg,
+/// x the SIB index, b the register in ModRM.rm or the SIB base
+#define REX(w, r, x, b) \
+  if ((w) | ((r) & 8) | ((x) & 8) | ((b) & 8)) { \
+  emitm(&stream, 0x40 | (w) | ((r) & 8) >> 1 | ((x) & 8) >> 2 | ((b) & 8) >> 3, 1);}
+
+/// ModRM for a register to register operation
+#define MODRMr(reg, rm) \
+  emitm(&stream, 3 << 6 | ((reg) & 0x7) << 3 | ((rm) & 0x7), 1);
+
+/// ModRM (+SIB) for [base + disp32]
+#define MODRMo(reg, base, disp32) \
+  emitm(&stream, 2 << 6 | ((reg) & 0x7) << 3 | ((base) & 0x7), 1); \
+  if (((base) & 0x7) == RSP) { \
+  emitm(&stream, 0x24, 1);} \
+  emitm(&stream, disp32, 4);
+
+/// ModRM + SIB for [base + index]. base cannot be RBP or R13
+#define MODRMb(reg, base, index) \
+  emitm(&stream, ((reg) & 0x7) << 3 | 4, 1); \
+  emitm(&stream, ((index) & 0x7) << 3 | ((base) & 0x7), 1);
+
+/// mov dr32,sr32
+#define MOVrd(dr32, sr32) \
+  REX(0, sr32, 0, dr32) \
+  emitm(&stream, 0x89, 1); \
+  MODRMr(sr32, dr32)
+
+/// mov dr64,sr64
+#define MOVrq(dr64, sr64) \
+  REX(REX_W, sr64, 0, dr64) \
+  emitm(&stream, 0x89, 1); \
+  MODRMr(sr64, dr64)
+
+/// mov r32,i32
+#define MOVid(r32, i32) \
+  REX(0, 0, 0, r32) \
+  emitm(&stream, 0xb8 | ((r32) & 0x7), 1); \
+  emitm(&stream, i32, 4);
+
+/// mov r64,i64
+#define MOViq(r64, i64) \
+  REX(REX_W, 0, 0, r64) \
+  emitm(&stream, 0xb8 | ((r64) & 0x7), 1); \
+  emitm(&stream, (ULONG)((ULONGLONG)(i64) & 0xffffffff), 4); \
+  emitm(&stream, (ULONG)((ULONGLONG)(i64) >> 32), 4);
+
+/// mov dr32,[sr64+off32]
+#define MOVodd(dr32, sr64, off32) \
+  REX(0, dr32, 0, sr64) \
+  emitm(&stream, 0x8b, 1); \
+  MODRMo(dr32, sr64, off32)
+
+/// mov [dr64+off32],sr32
+#define MOVomd(dr64, off32, sr32) \
+  REX(0, sr32, 0, dr64) \
+  emitm(&stream, 0x89, 1); \
+  MODRMo(sr32, dr64, off32)
+
+/// mov dr64,[sr64+off32]
+#define MOVodq(dr64, sr64, off32) \
+  REX(REX_W, dr64, 0, sr64) \
+  emitm(&stream, 0x8b, 1); \
+  MODRMo(dr64, sr64, off32)
+
+/// mov [dr64+off32],sr64
+#define MOVomq(dr64, off32, sr64) \
+  REX(REX_W, sr64, 0, dr64) \
+  emitm(&stream, 0x89, 1); \
+  MODRMo(sr64, dr64, off32)
+
+/// mov dr32,[sr64+or64]
+#define MOVobd(dr32, sr64, or64) \
+  REX(0, dr32, or64, sr64) \
+  emitm(&stream, 0x8b, 1); \
+  MODRMb(dr32, sr64, or64)
+
+/// movzx dr32,word ptr [sr64+off32]
+#define MOVZXodw(dr32, sr64, off32) \
+  REX(0, dr32, 0, sr64) \
+  emitm(&stream, 0x0f, 1); \
+  emitm(&stream, 0xb7, 1); \
+  MODRMo(dr32, sr64, off32)
+
+/// movzx dr32,word ptr [sr64+or64]
+#define MOVZXobw(dr32, sr64, or64) \
+  REX(0, dr32, or64, sr64) \
+  emitm(&stream, 0x0f, 1); \
+  emitm(&stream, 0xb7, 1); \
+  MODRMb(dr32, sr64, or64)
+
+/// movzx dr32,byte ptr [sr64+off32]
+#define MOVZXodb(dr32, sr64, off32) \
+  REX(0, dr32, 0, sr64) \
+  emitm(&stream, 0x0f, 1); \
+  emitm(&stream, 0xb6, 1); \
+  MODRMo(dr32, sr64, off32)
+
+/// movzx dr32,byte ptr [sr64+or64]
+#define MOVZXobb(dr32, sr64, or64) \
+  REX(0, dr32, or64, sr64) \
+  emitm(&stream, 0x0f, 1); \
+  emitm(&stream, 0xb6, 1); \
+  MODRMb(dr32, sr64, or64)
+
+/// lea dr32,[sr64+off32]
+#define LEAodd(dr32, sr64, off32) \
+  REX(0, dr32, 0, sr64) \
+  emitm(&stream, 0x8d, 1); \
+  MODRMo(dr32, sr64, off32)
+
+/// lea dr64,[sr64+off32]
+#define LEAodq(dr64, sr64, off32) \
+  REX(REX_W, dr64, 0, sr64) \
+  emitm(&stream, 0x8d, 1); \
+  MODRMo(dr64, sr64, off32)
+
+/// bswap r32
+#define BSWAP(r32) \
+  REX(0, 0, 0, r32) \
+  emitm(&stream, 0x0f, 1); \
+  emitm(&stream, 0xc8 | ((r32) & 0x7), 1);
+
+/// rol r16,8 (swaps the bytes of the low word)
+#define SWAPw(r32) \
+  emitm(&stream, 0x66, 1); \
+  REX(0, 0, 0, r32) \
+  emitm(&stream, 0xc1, 1); \
+  MODRMr(0, r32) \
+  emitm(&stream, 8, 1);
+
+/// push r64
+#define PUSH(r64) \
+  REX(0, 0, 0, r64) \
+  emitm(&stream, 0x50 | ((r64) & 0x7), 1);
+
+/// pop r64
+#define POP(r64) \
+  REX(0, 0, 0, r64) \
+  emitm(&stream, 0x58 | ((r64) & 0x7), 1);
+
+/// ret
+#define RET() \
+  emitm(&stream, 0xc3, 1);
+
+/// Group 1 operation (add, or, and, sub, xor, cmp) of r32 with i32. op is the ModRM.reg extension
+#define ALUid(op, r32, i32) \
+  REX(0, 0, 0, r32) \
+  emitm(&stream, 0x81, 1); \
+  MODRMr(op, r32) \
+  emitm(&stream, i32, 4);
+
+/// Group 1 operation (add, or, and, sub, xor, cmp) of dr32 with sr32. opc is the "r/m32, r32" opcode
+#define ALUrd(opc, dr32, sr32) \
+  REX(0, sr32, 0, dr32) \
+  emitm(&stream, opc, 1); \
+  MODRMr(sr32, dr32)
+
+/// add r32,i32
+#define ADDid(r32, i32)		ALUid(0, r32, i32)
+/// or r32,i32
+#define ORid(r32, i32)		ALUid(1, r32, i32)
+/// and r32,i32
+#define ANDid(r32, i32)		ALUid(4, r32, i32)
+/// sub r32,i32
+#define SUBid(r32, i32)		ALUid(5, r32, i32)
+/// cmp r32,i32
+#define CMPid(r32, i32)		ALUid(7, r32, i32)
+
+/// add dr32,sr32
+#define ADDrd(dr32, sr32)	ALUrd(0x01, dr32, sr32)
+/// or dr32,sr32
+#define ORrd(dr32, sr32)	ALUrd(0x09, dr32, sr32)
+/// and dr32,sr32
+#define ANDrd(dr32, sr32)	ALUrd(0x21, dr32, sr32)
+/// sub dr32,sr32
+#define SUBrd(dr32, sr32)	ALUrd(0x29, dr32, sr32)
+/// xor dr32,sr32
+#define XORrd(dr32, sr32)	ALUrd(0x31, dr32, sr32)
+/// cmp dr32,sr32
+#define CMPrd(dr32, sr32)	ALUrd(0x39, dr32, sr32)
+/// test dr32,sr32
+#define TESTrd(dr32, sr32)	ALUrd(0x85, dr32, sr32)
+
+/// test dr64,sr64
+#define TESTrq(dr64, sr64) \
+  REX(REX_W, sr64, 0, dr64) \
+  emitm(&stream, 0x85, 1); \
+  MODRMr(sr64, dr64)
+
+/// cmp dr64,sr64
+#define CMPrq(dr64, sr64) \
+  REX(REX_W, sr64, 0, dr64) \
+  emitm(&stream, 0x39, 1); \
+  MODRMr(sr64, dr64)
+
+/// cmp dr64,[sr64+off32]
+#define CMPodq(dr64, sr64, off32) \
+  REX(REX_W, dr64, 0, sr64) \
+  emitm(&stream, 0x3b, 1); \
+  MODRMo(dr64, sr64, off32)
+
+/// test r32,i32
+#define TESTid(r32, i32) \
+  REX(0, 0, 0, r32) \
+  emitm(&stream, 0xf7, 1); \
+  MODRMr(0, r32) \
+  emitm(&stream, i32, 4);
+
+/// add r64,i32
+#define ADDiq(r64, i32) \
+  REX(REX_W, 0, 0, r64) \
+  emitm(&stream, 0x81, 1); \
+  MODRMr(0, r64) \
+  emitm(&stream, i32, 4);
+
+/// sub r64,i32
+#define SUBiq(r64, i32) \
+  REX(REX_W, 0, 0, r64) \
+  emitm(&stream, 0x81, 1); \
+  MODRMr(5, r64) \
+  emitm(&stream, i32, 4);
+
+/// imul dr32,sr32
+#define IMULrd(dr32, sr32) \
+  REX(0, dr32, 0, sr32) \
+  emitm(&stream, 0x0f, 1); \
+  emitm(&stream, 0xaf, 1); \
+  MODRMr(dr32, sr32)
+
+/// imul dr32,sr32,i32
+#define IMULid(dr32, sr32, i32) \
+  REX(0, dr32, 0, sr32) \
+  emitm(&stream, 0x69, 1); \
+  MODRMr(dr32, sr32) \
+  emitm(&stream, i32, 4);
+
+/// div r32 (edx:eax / r32)
+#define DIVrd(r32) \
+  REX(0, 0, 0, r32) \
+  emitm(&stream, 0xf7, 1); \
+  MODRMr(6, r32)
+
+/// neg r32
+#define NEGd(r32) \
+  REX(0, 0, 0, r32) \
+  emitm(&stream, 0xf7, 1); \
+  MODRMr(3, r32)
+
+/// shl r32,i8
+#define SHLib(r32, i8) \
+  REX(0, 0, 0, r32) \
+  emitm(&stream, 0xc1, 1); \
+  MODRMr(4, r32) \
+  emitm(&stream, i8, 1);
+
+/// shr r32,i8
+#define SHRib(r32, i8) \
+  REX(0, 0, 0, r32) \
+  emitm(&stream, 0xc1, 1); \
+  MODRMr(5, r32) \
+  emitm(&stream, i8, 1);
+
+/// shl r32,cl
+#define SHL_CLrb(r32) \
+  REX(0, 0, 0, r32) \
+  emitm(&stream, 0xd3, 1); \
+  MODRMr(4, r32)
+
+/// shr r32,cl
+#define SHR_CLrb(r32) \
+  REX(0, 0, 0, r32) \
+  emitm(&stream, 0xd3, 1); \
+  MODRMr(5, r32)
+
+/// jcc off32
+#define JCC(cc, off32) \
+  emitm(&stream, 0x0f, 1); \
+  emitm(&stream, 0x80 | (cc), 1); \
+  emitm(&stream, off32, 4);
+
+/// jmp off32
+#define JMP(off32) \
+  emitm(&stream, 0xe9, 1); \
+  emitm(&stream, off32, 4);
+
+/// jcc off8
+#define JCCb(cc, off8) \
+  emitm(&stream, 0x70 | (cc), 1); \
+  emitm(&stream, off8, 1);
+
+/// jmp off8
+#define JMPb(off8) \
+  emitm(&stream, 0xeb, 1); \
+  emitm(&stream, off8, 1);
+
+/// call off32
+#define CALL(off32) \
+  emitm(&stream, 0xe8, 1); \
+  emitm(&stream, off32, 4);
+
+/// call r64
+#define CALLr(r64) \
+  REX(0, 0, 0, r64) \
+  emitm(&stream, 0xff, 1); \
+  MODRMr(2, r64)
+
+/**
+ *  @}
+ */
+
+/**
+ *  @}
+ */
@@ -15,7 +15,7 @@ u_short valid_instructions[] =
 	BPF_ST | BPF_MEM_EX_IMM | BPF_B, BPF_STX | BPF_MEM_EX_IMM | BPF_B, BPF_ST | BPF_MEM_EX_IMM | BPF_W, BPF_STX | BPF_MEM_EX_IMM | BPF_W, BPF_ST | BPF_MEM_EX_IMM | BPF_H, BPF_STX | BPF_MEM_EX_IMM | BPF_H, BPF_ST | BPF_MEM_EX_IND | BPF_B, BPF_ST | BPF_MEM_EX_IND | BPF_W, BPF_ST | BPF_MEM_EX_IND | BPF_H,
 	#endif // HAVE_BUGGY_TME_SUPPORT
 
-	BPF_JMP | BPF_JA, BPF_JMP | BPF_JGT | BPF_K, BPF_JMP | BPF_JGE | BPF_K, BPF_JMP | BPF_JEQ | BPF_K, BPF_JMP | BPF_JSET | BPF_K, BPF_JMP | BPF_JGT | BPF_X, BPF_JMP | BPF_JGE | BPF_X, BPF_JMP | BPF_JEQ | BPF_X, BPF_JMP | BPF_JSET | BPF_X, BPF_ALU | BPF_ADD | BPF_X, BPF_ALU | BPF_SUB | BPF_X, BPF_ALU | BPF_MUL | BPF_X, BPF_ALU | BPF_DIV | BPF_X, BPF_ALU | BPF_AND | BPF_X, BPF_ALU | BPF_OR | BPF_X, BPF_ALU | BPF_LSH | BPF_X, BPF_ALU | BPF_RSH | BPF_X, BPF_ALU | BPF_ADD | BPF_K, BPF_ALU | BPF_SUB | BPF_K, BPF_ALU | BPF_MUL | BPF_K, BPF_ALU | BPF_DIV | BPF_K, BPF_ALU | BPF_AND | BPF_K, BPF_ALU | BPF_OR | BPF_K, BPF_ALU | BPF_LSH | BPF_K, BPF_ALU | BPF_RSH | BPF_K, BPF_ALU | BPF_NEG, BPF_MISC | BPF_TAX, BPF_MISC | BPF_TXA,
+	BPF_JMP | BPF_JA, BPF_JMP | BPF_JGT | BPF_K, BPF_JMP | BPF_JGE | BPF_K, BPF_JMP | BPF_JEQ | BPF_K, BPF_JMP | BPF_JSET | BPF_K, BPF_JMP | BPF_JGT | BPF_X, BPF_JMP | BPF_JGE | BPF_X, BPF_JMP | BPF_JEQ | BPF_X, BPF_JMP | BPF_JSET | BPF_X, BPF_ALU | BPF_ADD | BPF_X, BPF_ALU | BPF_SUB | BPF_X, BPF_ALU | BPF_MUL | BPF_X, BPF_ALU | BPF_DIV | BPF_X, BPF_ALU | BPF_AND | BPF_X, BPF_ALU | BPF_OR | BPF_X, BPF_ALU | BPF_LSH | BPF_X, BPF_ALU | BPF_RSH | BPF_X, BPF_ALU | BPF_ADD | BPF_K, BPF_ALU | BPF_SUB | BPF_K, BPF_ALU | BPF_MUL | BPF_K, BPF_ALU | BPF_DIV | BPF_K, BPF_ALU | BPF_AND | BPF_K, BPF_ALU | BPF_OR | BPF_K, BPF_ALU | BPF_LSH | BPF_K, BPF_ALU | BPF_RSH | BPF_K, BPF_ALU | BPF_NEG, BPF_MISC | BPF_TAX, BPF_MISC | BPF_TXA, BPF_MISC | BPF_MATCH,
 	#ifdef HAVE_BUGGY_TME_SUPPORT
 	BPF_MISC | BPF_TME | BPF_LOOKUP, BPF_MISC | BPF_TME | BPF_EXECUTE, BPF_MISC | BPF_TME | BPF_SET_ACTIVE, BPF_MISC | BPF_TME | BPF_GET_REGISTER_VALUE, BPF_MISC | BPF_TME | BPF_SET_REGISTER_VALUE
 	#endif //HAVE_BUGGY_TME_SUPPORT
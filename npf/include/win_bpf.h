@@ -52,6 +52,8 @@
 
 #ifdef WIN_NT_DRIVER
 #include <ndis.h>
+#elif defined(NPF_HOST_BUILD)
+#include "bpf_host.h"
 #else
 #include <winsock2.h>
 #endif
@@ -59,7 +61,9 @@
 #ifdef HAVE_BUGGY_TME_SUPPORT
 #include "tme.h"
 #endif
+#ifndef NPF_HOST_BUILD
 #include "time_calls.h"
+#endif
 
 typedef	UCHAR u_char;
 typedef	USHORT u_short;
@@ -112,6 +116,38 @@ struct bpf_stat
 	///< thus reach the application.
 };
 
+/*
+ * Counters of an instruction of the filter, while the profiling is enabled with BIOCSPROFILE.
+ */
+struct bpf_profile_counter
+{
+	ULONGLONG executed;	///< Number of times the instruction ran.
+	ULONGLONG accepted;	///< Number of packets accepted by the instruction, a return of a value other than 0.
+	ULONGLONG rejected;	///< Number of packets rejected by the instruction: a return of 0, or a load out of the
+	///< packet or a division by zero.
+};
+
+/*
+ * Struct returned by BIOCGPROFILE, followed by bp_len struct bpf_profile_insn.
+ */
+struct bpf_profile
+{
+	UINT bp_len;			///< Number of instructions of the installed filter, 0 if there is none or if the profiling
+	///< is disabled.
+	UINT bp_reserved;
+	ULONGLONG bp_packets;	///< Number of packets run through the filter since the profiling was enabled or the filter
+	///< installed.
+};
+
+/*
+ * An instruction of the filter as installed (i.e. optimized), with its counters.
+ */
+struct bpf_profile_insn
+{
+	struct bpf_insn bp_insn;
+	struct bpf_profile_counter bp_counter;
+};
+
 /*
  * Struct return by BIOCVERSION.  This represents the version number of
  * the filter language described by the instruction encodings below.
@@ -317,6 +353,7 @@ struct bpf_hdr
 #define BPF_MISCOP(code) ((code) & 0xf8)
 #define		BPF_TAX		0x00
 #define		BPF_TXA		0x80
+#define		BPF_MATCH	0x40	///< A = the pattern of the set k found in the A bytes at X, see bpf_match()
 
 /* TME instructions */
 #define		BPF_TME					0x08
@@ -352,6 +389,53 @@ struct bpf_hdr
  */
 #define BPF_MEMWORDS 16
 
+/*
+ * Pattern sets, searched in the packets by BPF_MISC|BPF_MATCH. The image of a set, given to
+ * BIOCSMATCH, is a struct bpf_match_header followed by count patterns, each a u_int32 length
+ * and its bytes, padded to a multiple of 4 bytes.
+ */
+#define BPF_MATCH_MAX_SETS		32			///< Number of sets, k of BPF_MISC|BPF_MATCH is below
+#define BPF_MATCH_MAX_PATTERNS	4096		///< Maximum number of patterns of a set
+#define BPF_MATCH_MAX_LENGTH	256			///< Maximum length of a pattern, in bytes
+#define BPF_MATCH_MAX_MEMORY	0x1000000	///< Maximum size of the automaton of a set, in bytes
+
+#define BPF_MATCH_NOCASE		1			///< The ASCII letters of the patterns match both cases
+
+struct bpf_match_header
+{
+	bpf_u_int32 count;		///< Number of patterns.
+	bpf_u_int32 flags;		///< BPF_MATCH_NOCASE or 0.
+};
+
+/*
+ * Ancillary loads. An absolute load of any size (BPF_LD|BPF_ABS) at BPF_AD_OFF plus the
+ * offset of a field of struct bpf_meta reads that field, whole, instead of bytes of the
+ * packet: e.g. "ldh [BPF_AD_OFF + BPF_AD_VLAN_TAG]" gives the VLAN tag that the adapter
+ * has stripped. The BPF_AD_AREA bytes from BPF_AD_OFF are reserved for these fields, and
+ * bpf_validate() rejects the loads there that are not one of them.
+ */
+#define BPF_AD_OFF				0xfffff000	///< -0x1000, like SKF_AD_OFF in Linux
+#define BPF_AD_AREA				0x100
+#define		BPF_AD_VLAN_TAG			0	///< The 802.1Q tag control information: priority, CFI and VLAN identifier
+#define		BPF_AD_VLAN_TAG_PRESENT	4	///< 1 if the packet came with a VLAN tag in its out-of-band data
+#define		BPF_AD_DIRECTION		8	///< BPF_DIRECTION_IN or BPF_DIRECTION_OUT
+#define		BPF_AD_RSS_HASH			12	///< The RSS hash computed by the adapter, 0 if there is none
+#define		BPF_AD_CPU				16	///< The processor that taps the packet
+#define		BPF_AD_PHY				20	///< The 802.11 PHY type (DOT11_PHY_TYPE) of a received frame, 0 if unknown
+#define BPF_AD_MAX				24	///< End of the known fields
+
+#define BPF_DIRECTION_IN		0	///< A packet received from the network
+#define BPF_DIRECTION_OUT		1	///< A packet sent by this host
+
+/// TRUE if the instruction is the ancillary load of a known field
+#define BPF_IS_ANCILLARY(_code, _k) \
+	(BPF_CLASS(_code) == BPF_LD && BPF_MODE(_code) == BPF_ABS && \
+	 (u_int32)(_k) - BPF_AD_OFF < BPF_AD_MAX && ((_k) & 3) == 0)
+
+/// The field of the metadata at _off, i.e. at k - BPF_AD_OFF, 0 if the packet has no metadata
+#define BPF_AD_LOAD(_meta, _off) \
+	((_meta) != NULL ? *(u_int32*)((u_char*)(_meta) + (_off)) : 0)
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -375,6 +459,53 @@ extern "C"
 	int bpf_validate(struct bpf_insn* f, int len);
 #endif //HAVE_BUGGY_TME_SUPPORT
 
+	/*!
+	  \brief Computes where the bounds of the absolute packet loads of a validated program can be checked.
+	  \param f The filter.
+	  \param len Its length, in pseudo instructions.
+	  \param checks Array of len entries. On return, checks[i] is the packet length that must be verified
+	   before instruction i, rejecting the packet if buflen is smaller, or 0 if there is nothing to verify.
+	  \return TRUE on success, FALSE if the memory for the analysis cannot be allocated.
+
+	  When these checks are done, the absolute loads (BPF_ABS and BPF_MSH) whose end does not overflow are
+	  always in bounds and need no check of their own, and the result of the program is the same as in
+	  bpf_filter(). Used by bpf_decode() and by the jitter.
+	*/
+	int bpf_validate_bounds(struct bpf_insn* f, int len, u_int32* checks);
+
+	/*!
+	  \brief Optimizes a validated filtering program in place.
+	  \param f The filter.
+	  \param len Its length, in pseudo instructions.
+	  \return The new length of the program, never larger than len.
+
+	  Folds the constants, threads the jumps whose outcome is known, removes the redundant loads,
+	  the dead and the unreachable instructions, and merges adjacent byte or halfword comparisons
+	  into a single wider one. The result has the same semantics as the original program in
+	  bpf_filter(), including the rejection of the packets that are too short for a load.
+	  Programs using instructions other than the classic ones (the TME extensions and the searches of
+	  BPF_MISC|BPF_MATCH) are left untouched, as are all programs if the memory for the analysis cannot
+	  be allocated.
+
+	  The result is still a valid program, but callers running it in the kernel should pass it to
+	  bpf_validate() again and keep the original program if it fails.
+	*/
+	int bpf_optimize(struct bpf_insn* f, int len);
+
+	/*!
+	  \brief The metadata of a packet, read by the ancillary loads (see BPF_AD_OFF). The offset of each
+	  field is the BPF_AD_ constant of the same name.
+	*/
+	struct bpf_meta
+	{
+		u_int32 vlan_tag;			///< The 802.1Q tag control information, 0 if there is no tag.
+		u_int32 vlan_tag_present;	///< 1 if the packet has a VLAN tag, 0 otherwise.
+		u_int32 direction;			///< BPF_DIRECTION_IN or BPF_DIRECTION_OUT.
+		u_int32 rss_hash;			///< The RSS hash of the packet, 0 if there is none.
+		u_int32 cpu;				///< The processor that taps the packet.
+		u_int32 phy;				///< The 802.11 PHY type of the frame, 0 if unknown.
+	};
+
 	/*!
 	  \brief The filtering pseudo-machine interpreter.
 	  \param pc The filter.
@@ -395,7 +526,459 @@ extern "C"
 	u_int bpf_filter(register struct bpf_insn* pc, register UCHAR* p, u_int wirelen, register u_int buflen, PMEM_TYPE mem_ex, PTME_CORE tme, struct time_conv* time_ref);
 #else //HAVE_BUGGY_TME_SUPPORT
 	u_int bpf_filter(register struct bpf_insn* pc, register UCHAR* p, u_int wirelen, register u_int buflen);
+
+	/*!
+	  \brief bpf_filter() on a packet with metadata.
+	  \param pc The filter.
+	  \param p Pointer to the packet.
+	  \param wirelen Original length of the packet.
+	  \param buflen Current length of the packet.
+	  \param meta The metadata read by the ancillary loads, NULL if there is none: the loads then give 0.
+	  \return The same value as bpf_filter(). bpf_filter() is this function without metadata.
+	*/
+	u_int bpf_filter_meta(struct bpf_insn* pc, u_char* p, u_int wirelen, u_int buflen, struct bpf_meta* meta);
 #endif //HAVE_BUGGY_TME_SUPPORT
+
+	/*!
+	  \brief A packet of a batch, with the arguments that bpf_filter() takes for it.
+	*/
+	struct bpf_packet
+	{
+		u_char* data;		///< The packet.
+		u_int wirelen;		///< Original length of the packet.
+		u_int buflen;		///< Current length of the packet.
+		struct bpf_meta* meta;	///< Its metadata, NULL if there is none.
+	};
+
+#ifndef HAVE_BUGGY_TME_SUPPORT
+	/*!
+	  \brief Runs the filtering pseudo-machine interpreter on a batch of packets.
+	  \param pc The filter.
+	  \param pkts The packets.
+	  \param count Number of packets.
+	  \param verdicts Receives count values, the result of bpf_filter() on each packet.
+	*/
+	void bpf_filter_batch(struct bpf_insn* pc, struct bpf_packet* pkts, u_int count, u_int* verdicts);
+#endif //HAVE_BUGGY_TME_SUPPORT
+
+	/*!
+	  \brief A program pre-decoded for bpf_filter_decoded(). Its layout is private to the interpreter.
+	*/
+	struct bpf_decoded_program;
+
+	/*!
+	  \brief Pre-decodes a validated filtering program for bpf_filter_decoded().
+	  \param f The filter.
+	  \param len Its length, in pseudo instructions.
+	  \return The decoded program, to be released with bpf_free_decoded(), or NULL if the program uses
+	   instructions other than the classic ones (i.e. the TME extensions) or if the memory cannot be allocated.
+	   In this case the program must be run with bpf_filter().
+
+	  The jump targets are resolved and the bounds of the absolute loads computed once here, instead of
+	  at each packet.
+	*/
+	struct bpf_decoded_program* bpf_decode(struct bpf_insn* f, int len);
+
+	/*!
+	  \brief Releases a program returned by bpf_decode().
+	*/
+	void bpf_free_decoded(struct bpf_decoded_program* prog);
+
+	/*!
+	  \brief The filtering pseudo-machine interpreter, on a program pre-decoded by bpf_decode().
+	  \param prog The decoded filter.
+	  \param p Pointer to a memory buffer containing the packet on which the filter will be executed.
+	  \param wirelen Original length of the packet.
+	  \param buflen Current length of the packet.
+	  \param meta The metadata of the packet, NULL if there is none.
+	  \return The same value as bpf_filter_meta() on the original program.
+
+	  Used instead of bpf_filter() when the JIT compiler is not available: the dispatch is threaded
+	  where the compiler supports it, and only the scratch memory words that the program can read
+	  before writing them are cleared.
+	*/
+	u_int bpf_filter_decoded(struct bpf_decoded_program* prog, u_char* p, u_int wirelen, u_int buflen, struct bpf_meta* meta);
+
+	/*!
+	  \brief bpf_filter_decoded() on a batch of packets.
+	  \param prog The decoded filter.
+	  \param pkts The packets.
+	  \param count Number of packets.
+	  \param verdicts Receives count values, the result of bpf_filter() on each packet.
+
+	  The packets are run one after the other in the same activation of the interpreter, without a call
+	  and the setup of the dispatch for each of them.
+	*/
+	void bpf_filter_decoded_batch(struct bpf_decoded_program* prog, struct bpf_packet* pkts, u_int count, u_int* verdicts);
+
+	/*!
+	  \brief A fragment of a packet that is stored in several buffers, e.g. one of the MDLs of a NET_BUFFER.
+	*/
+	struct bpf_frag
+	{
+		u_char* data;	///< The data of the fragment.
+		u_int len;		///< Its length, that can be 0.
+	};
+
+	/*!
+	  \brief The filtering pseudo-machine interpreter, on a packet stored in several buffers.
+	  \param pc The filter.
+	  \param frags The fragments of the packet, in order.
+	  \param wirelen Original length of the packet.
+	  \param buflen Current length of the packet, that must not be larger than the total length of the fragments.
+	  \param meta The metadata of the packet, NULL if there is none.
+	  \return The same value as bpf_filter_meta() on the packet copied in a single buffer.
+
+	  The loads that span several fragments are assembled by bpf_frag_load(), the others read the fragments
+	  directly: nothing is copied. The TME extensions are not supported.
+	*/
+	u_int bpf_filter_frags(struct bpf_insn* pc, struct bpf_frag* frags, u_int wirelen, u_int buflen, struct bpf_meta* meta);
+
+	/*!
+	  \brief Loads size (1, 2 or 4) bytes at offset k of a packet stored in several fragments, in network byte order.
+	  \param frags The fragments of the packet.
+	  \param k Offset of the first byte.
+	  \param size Number of bytes.
+	  \return The bytes, as a big endian number.
+
+	  The load must be in bounds, i.e. end before the end of the last fragment. Called by bpf_filter_frags() and by
+	  the code generated by the jitter for the fragmented packets.
+	*/
+	u_int32 bpf_frag_load(struct bpf_frag* frags, u_int32 k, u_int32 size);
+
+	/*!
+	  \brief The filtering pseudo-machine interpreter, counting what each instruction does.
+	  \param pc The filter.
+	  \param p Pointer to the packet.
+	  \param wirelen Original length of the packet.
+	  \param buflen Current length of the packet.
+	  \param meta The metadata of the packet, NULL if there is none.
+	  \param counters The counters of the instructions of the filter, one for each, updated.
+	  \return The same value as bpf_filter_meta(). The TME extensions are not supported.
+	*/
+	u_int bpf_filter_profile(struct bpf_insn* pc, u_char* p, u_int wirelen, u_int buflen, struct bpf_meta* meta, struct bpf_profile_counter* counters);
+
+	/*!
+	  \brief Maximum number of programs in a group classifier.
+	*/
+#define BPF_GROUP_MAX 64
+
+	/*!
+	  \brief The programs of all the instances open on an adapter, merged into one decision DAG by
+	  bpf_group_compile(). Its layout is private to the classifier.
+	*/
+	struct bpf_group_program;
+
+	/*!
+	  \brief Merges validated filtering programs into a group classifier.
+	  \param progs The programs, NULL for an instance without one.
+	  \param lens Their lengths in instructions.
+	  \param count Number of programs, at most BPF_GROUP_MAX are considered.
+	  \return The classifier, to be released with bpf_free_group(), or NULL if fewer than two of the
+	  programs can be merged or on failure.
+
+	  The tests shared by the programs, e.g. the checks of the ethertype and of the IP protocol, are
+	  evaluated once for all of them. The programs that return a value computed from the packet, more than
+	  one non-zero value, that read the metadata of the packet with ancillary loads, that search it with
+	  BPF_MISC|BPF_MATCH, or that make the DAG too large, are left out: see bpf_group_covered().
+	*/
+	struct bpf_group_program* bpf_group_compile(struct bpf_insn** progs, u_int* lens, u_int count);
+
+	/*!
+	  \brief Releases a classifier created by bpf_group_compile().
+	*/
+	void bpf_free_group(struct bpf_group_program* g);
+
+	/*!
+	  \brief The programs merged in a classifier.
+	  \return A bitmap, bit i is set if programs[i] is part of the classifier.
+	*/
+	ULONGLONG bpf_group_covered(struct bpf_group_program* g);
+
+	/*!
+	  \brief The value returned by a program of the classifier when it accepts a packet.
+	  \param index The index of the program given to bpf_group_compile().
+	*/
+	u_int bpf_group_accept(struct bpf_group_program* g, u_int index);
+
+	/*!
+	  \brief Runs all the programs of a classifier on a packet.
+	  \param g The classifier.
+	  \param p Pointer to the packet.
+	  \param wirelen Original length of the packet.
+	  \param buflen Current length of the packet.
+	  \return A bitmap, bit i is set if the covered program i accepts the packet, i.e. if bpf_filter() would
+	  return bpf_group_accept(g, i) for it; it would return 0 for the covered programs whose bit is clear.
+	*/
+	ULONGLONG bpf_group_filter(struct bpf_group_program* g, u_char* p, u_int wirelen, u_int buflen);
+
+	/*!
+	  \brief Maximum number of packet bytes in the key of a flow.
+	*/
+#define BPF_FLOW_KEY_MAX 48
+
+	/*!
+	  \brief Number of entries of a flow verdict cache.
+	*/
+#define BPF_FLOW_ENTRIES 128
+
+	/*!
+	  \brief The key of a packet for the verdict cache of a filter: everything its result depends on.
+	*/
+	struct bpf_flow_key
+	{
+		u_int32 hash;						///< Hash of the rest of the key.
+		u_int32 inbounds;					///< Bit i is set if the i-th load of the program is in bounds.
+		u_int32 wirelen;					///< The original length of the packet, 0 if the program does not read it.
+		u_char bytes[BPF_FLOW_KEY_MAX];		///< The bytes read by the loads in bounds, 0 for the others.
+	};
+
+	/*!
+	  \brief An entry of a flow verdict cache.
+	*/
+	struct bpf_flow_entry
+	{
+		struct bpf_flow_key key;
+		u_int verdict;		///< What the program returns for the packets with this key.
+		u_int valid;
+	};
+
+	/*!
+	  \brief A direct-mapped flow verdict cache, e.g. for one CPU.
+	*/
+	struct bpf_flow_cache
+	{
+		struct bpf_flow_entry entries[BPF_FLOW_ENTRIES];
+	};
+
+	/*!
+	  \brief The loads of a program, with its verdict caches. Its layout is private to the cache.
+	*/
+	struct bpf_flow_program;
+
+	/*!
+	  \brief Analyzes a validated filtering program for the flow verdict cache.
+	  \param f The filter.
+	  \param len Its length in instructions.
+	  \param ncaches Number of empty caches to allocate along, e.g. one for each CPU.
+	  \return The analysis, to be released with bpf_free_flow(), or NULL if the program cannot be cached or
+	  on failure.
+
+	  The key of a packet is made of the bytes that the program loads, at constant offsets or after the IP
+	  header whose length is loaded with BPF_LDX|BPF_MSH. The programs that load from other computed offsets,
+	  more than BPF_FLOW_KEY_MAX bytes, or the metadata of the packet, cannot be cached.
+	*/
+	struct bpf_flow_program* bpf_flow_compile(struct bpf_insn* f, int len, u_int ncaches);
+
+	/*!
+	  \brief Releases the analysis created by bpf_flow_compile(), and its caches.
+	*/
+	void bpf_free_flow(struct bpf_flow_program* prog);
+
+	/*!
+	  \brief One of the caches allocated by bpf_flow_compile().
+	*/
+	struct bpf_flow_cache* bpf_flow_get_cache(struct bpf_flow_program* prog, u_int index);
+
+	/*!
+	  \brief Computes the key of a packet.
+	  \param prog The analysis of the filter.
+	  \param p Pointer to the packet.
+	  \param wirelen Original length of the packet.
+	  \param buflen Current length of the packet.
+	  \param key Receives the key: bpf_filter() returns the same value for the packets with the same key.
+	*/
+	void bpf_flow_key(struct bpf_flow_program* prog, u_char* p, u_int wirelen, u_int buflen, struct bpf_flow_key* key);
+
+	/*!
+	  \brief Looks up the verdict for a key in a cache.
+	  \return TRUE and the verdict if the key is in the cache, FALSE otherwise.
+	*/
+	int bpf_flow_lookup(struct bpf_flow_program* prog, struct bpf_flow_cache* cache, struct bpf_flow_key* key, u_int* verdict);
+
+	/*!
+	  \brief Stores the verdict for a key in a cache, in place of the entry with the same hash slot.
+	*/
+	void bpf_flow_insert(struct bpf_flow_program* prog, struct bpf_flow_cache* cache, struct bpf_flow_key* key, u_int verdict);
+
+	/*!
+	  \brief A program recognized as one of the common shapes, with its constants. Its layout is private.
+	*/
+	struct bpf_shape;
+
+	/*!
+	  \brief Recognizes a validated filtering program as one of the shapes that have a native matcher.
+	  \param f The filter, as generated by libpcap (i.e. before bpf_optimize()).
+	  \param len Its length in instructions.
+	  \return The shape, to be released with bpf_free_shape(), or NULL if the program has none of the shapes
+	  or on failure.
+
+	  The shapes are the programs of "ip" (any ethertype), "tcp" (any IP protocol), "port N", "tcp port N"
+	  (or udp), "host A" and "net A/M" on Ethernet, with any constants, optionally after the check of an
+	  802.1Q tag of "vlan and ...".
+	*/
+	struct bpf_shape* bpf_shape_recognize(struct bpf_insn* f, int len);
+
+	/*!
+	  \brief Releases a shape returned by bpf_shape_recognize().
+	*/
+	void bpf_free_shape(struct bpf_shape* shape);
+
+	/*!
+	  \brief The name of a shape, e.g. "tcp port", for the traces.
+	*/
+	const char* bpf_shape_name(struct bpf_shape* shape);
+
+	/*!
+	  \brief Runs the native matcher of a shape on a packet.
+	  \param shape The shape.
+	  \param p Pointer to the packet.
+	  \param wirelen Original length of the packet.
+	  \param buflen Current length of the packet.
+	  \return The same value as bpf_filter() on the program of the shape.
+	*/
+	u_int bpf_filter_shape(struct bpf_shape* shape, u_char* p, u_int wirelen, u_int buflen);
+
+	/*!
+	  \brief A condition on the bytes of a packet at a fixed offset: (load & mask) == value.
+	*/
+	struct bpf_condition
+	{
+		u_int32 offset;		///< Offset of the first byte.
+		u_int32 size;		///< Number of bytes, 1, 2 or 4, read in network byte order.
+		u_int32 mask;
+		u_int32 value;
+	};
+
+	/*!
+	  \brief Extracts the necessary conditions of a validated filtering program.
+	  \param f The filter.
+	  \param len Its length in instructions.
+	  \param conds Receives the conditions.
+	  \param max Size of conds.
+	  \return The number of conditions stored in conds, 0 if there is none or on failure.
+
+	  The conditions are the comparisons of the absolute loads, masked or not, with constants (BPF_JEQ,
+	  BPF_JSET) that hold on every path to the returns that can accept a packet: bpf_filter() rejects the
+	  packets that fail one of them, or that are too short for its bytes.
+	*/
+	int bpf_validate_conditions(struct bpf_insn* f, int len, struct bpf_condition* conds, u_int max);
+
+	/*!
+	  \brief Size in bytes of a window of a prefilter.
+	*/
+#define BPF_PREFILTER_WINDOW 16
+
+	/*!
+	  \brief Maximum number of windows of a prefilter.
+	*/
+#define BPF_PREFILTER_WINDOWS 2
+
+	/*!
+	  \brief Maximum number of conditions considered for a prefilter.
+	*/
+#define BPF_PREFILTER_MAX_CONDITIONS 16
+
+	/*!
+	  \brief The bytes of a packet that a prefilter compares at once.
+	*/
+	struct bpf_prefilter_window
+	{
+		u_char mask[BPF_PREFILTER_WINDOW];
+		u_char value[BPF_PREFILTER_WINDOW];
+		u_int32 offset;		///< Offset of the window in the packet.
+	};
+
+	/*!
+	  \brief The necessary conditions of a program, packed in windows by bpf_prefilter_compile().
+	  All zeroes, it accepts every packet.
+	*/
+	struct bpf_prefilter
+	{
+		u_int32 length;		///< The packets shorter than this are rejected.
+		u_int32 windows;	///< Number of windows used.
+		struct bpf_prefilter_window window[BPF_PREFILTER_WINDOWS];
+	};
+
+	/*!
+	  \brief Builds the prefilter of a validated filtering program.
+	  \param f The filter.
+	  \param len Its length in instructions.
+	  \param pre Receives the prefilter.
+	  \return The number of necessary conditions found by bpf_validate_conditions().
+
+	  The conditions are merged in the mask and value of the bytes of at most BPF_PREFILTER_WINDOWS windows
+	  of BPF_PREFILTER_WINDOW bytes; those that do not fit are left to the program. The prefilter always
+	  checks that the packet is long enough for all of them.
+	*/
+	int bpf_prefilter_compile(struct bpf_insn* f, int len, struct bpf_prefilter* pre);
+
+	/*!
+	  \brief Runs a prefilter on a packet.
+	  \param pre The prefilter.
+	  \param p Pointer to the packet.
+	  \param buflen Current length of the packet.
+	  \return FALSE if the program of the prefilter rejects the packet, TRUE if it must be run to know.
+
+	  Each window costs a single vector compare where the SSE2 instructions are available (in the kernel on
+	  x86-64 only), and two 64-bit ones elsewhere.
+	*/
+	int bpf_prefilter(struct bpf_prefilter* pre, u_char* p, u_int buflen);
+
+	/*!
+	  \brief A set of patterns compiled by bpf_match_compile() into an automaton. Its layout is private.
+	*/
+	struct bpf_match_set;
+
+	/*!
+	  \brief The sets that BPF_MISC|BPF_MATCH can search, by id. In the driver they are installed by
+	  BIOCSMATCH, and a set stays here while a filter refers to it.
+	*/
+	extern struct bpf_match_set* bpf_match_sets[BPF_MATCH_MAX_SETS];
+
+	/*!
+	  \brief Compiles a set of patterns.
+	  \param image The image: a struct bpf_match_header, then the patterns.
+	  \param size Size of the image in bytes.
+	  \return The set, to be released with bpf_match_free(), or NULL if the image is not valid, if the
+	  automaton would be larger than BPF_MATCH_MAX_MEMORY or on failure.
+
+	  The patterns are merged in an Aho-Corasick automaton, whose transitions are all computed in advance
+	  so that each byte of the packet costs one lookup. The bytes that start no pattern are skipped without
+	  looking at the automaton while it is in its initial state.
+	*/
+	struct bpf_match_set* bpf_match_compile(void* image, u_int size);
+
+	/*!
+	  \brief Releases a set created by bpf_match_compile().
+	*/
+	void bpf_match_free(struct bpf_match_set* set);
+
+	/*!
+	  \brief Searches the patterns of a set in a buffer.
+	  \return 1 plus the index of the pattern that ends first in the buffer, the lowest of those ending
+	  at the same byte, or 0 if there is none.
+	*/
+	u_int bpf_match_scan(struct bpf_match_set* set, u_char* p, u_int len);
+
+	/*!
+	  \brief What BPF_MISC|BPF_MATCH computes: bpf_match_scan() of a range of the packet.
+	  \param id The set, k of the instruction. A set that is not installed matches nothing.
+	  \param p Pointer to the packet.
+	  \param buflen Current length of the packet.
+	  \param off Start of the range, X.
+	  \param len Length of the range, A, cut at the end of the packet.
+	  \return The new value of A: 1 plus the index of the pattern found, or 0.
+
+	  Called by the interpreters and by the code generated by the jitter.
+	*/
+	u_int __cdecl bpf_match(u_int32 id, u_char* p, u_int buflen, u_int32 off, u_int32 len);
+
+	/*!
+	  \brief bpf_match() on a packet stored in several fragments, see bpf_filter_frags().
+	*/
+	u_int __cdecl bpf_match_frags(u_int32 id, struct bpf_frag* frags, u_int buflen, u_int32 off, u_int32 len);
+
 	/*!
 	  \brief The filtering pseudo-machine interpreter with two buffers. This function is slower than bpf_filter(),
 	  but works correctly also if the MAC header and the data of the packet are in two different buffers.
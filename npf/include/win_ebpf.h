@@ -0,0 +1,217 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * The extended filtering programs: a second format accepted by BIOCSETF, with 64-bit registers,
+ * a stack, loops and key/value maps kept in the kernel and read from user space with BIOCGMAP.
+ *
+ * The instructions have the encoding of the Linux eBPF ones. The programs are verified when they
+ * are installed, by following every path with what is known of each register, so that they
+ * cannot read outside of their stack, leak a kernel address or run forever.
+ */
+
+#ifndef __WIN_EBPF_H
+#define __WIN_EBPF_H
+
+#include "win_bpf.h"
+
+/*
+ * The image of an extended program, given to BIOCSETF: a struct ebpf_program_header, then the
+ * nmaps struct ebpf_map_def of its maps and its len struct ebpf_insn. The magic is not a valid
+ * classic instruction, so that both formats share the IOCTL.
+ */
+#define EBPF_MAGIC				0x46504245	///< "EBPF"
+
+#define EBPF_MAXINSNS			4096	///< Maximum length of a program, in instructions
+#define EBPF_STACK_SIZE			512		///< Bytes of stack below the frame pointer, zeroed for each packet
+#define EBPF_MAX_MAPS			16		///< Maximum number of maps of a program
+#define EBPF_MAX_KEY			64		///< Maximum size of the key of a map, in bytes
+#define EBPF_MAX_VALUE			256		///< Maximum size of the value of a map, in bytes
+#define EBPF_MAX_MAP_MEMORY		0x800000	///< Maximum memory for all the maps of a program, in bytes
+
+/*
+ * The instruction set. The classes, sizes, modes and operations of the classic instructions keep
+ * their codes (BPF_ALU is the 32-bit form of EBPF_ALU64), these are the additions.
+ */
+#define EBPF_ALU64				0x07	///< Class of the 64-bit arithmetic
+#define EBPF_DW					0x18	///< Size of the 64-bit loads and stores
+#define EBPF_MOD				0x90
+#define EBPF_XOR				0xa0
+#define EBPF_MOV				0xb0	///< dst = src
+#define EBPF_ARSH				0xc0	///< Arithmetic right shift
+#define EBPF_JNE				0x50
+#define EBPF_JSGT				0x60
+#define EBPF_JSGE				0x70
+#define EBPF_CALL				0x80	///< Call the helper given by imm, see EBPF_FUNC_MAP_LOOKUP
+#define EBPF_EXIT				0x90	///< Return R0, truncated to 32 bits
+#define EBPF_JLT				0xa0
+#define EBPF_JLE				0xb0
+#define EBPF_JSLT				0xc0
+#define EBPF_JSLE				0xd0
+
+/*
+ * The registers. On entry R1 holds the original length of the packet, R2 its captured length and
+ * R10 the frame pointer, which is read-only. The other registers must be written before they are read.
+ * Calls clobber R1 to R5 and return their result in R0; R6 to R9 are preserved.
+ */
+#define EBPF_REG_0				0
+#define EBPF_REG_1				1
+#define EBPF_REG_2				2
+#define EBPF_REG_3				3
+#define EBPF_REG_4				4
+#define EBPF_REG_5				5
+#define EBPF_REG_6				6
+#define EBPF_REG_7				7
+#define EBPF_REG_8				8
+#define EBPF_REG_9				9
+#define EBPF_REG_10				10
+#define EBPF_NREGS				11
+
+/*
+ * The helpers. R1 is always the index of the map, that must be a constant, and the keys and values
+ * are passed by pointers to the stack.
+ */
+#define EBPF_FUNC_MAP_LOOKUP	1	///< Copies the value of the key R2 to R3; R0 is 1 if the key was found, 0 otherwise
+#define EBPF_FUNC_MAP_UPDATE	2	///< Sets the value of the key R2 to R3; R0 is 0, or -1 if the map is full
+#define EBPF_FUNC_MAP_DELETE	3	///< Removes the key R2 from a hash map; R0 is 0, or -1 if it was not there
+#define EBPF_FUNC_MAP_ADD		4	///< Adds R3 to the first 64 bits of the value of the key R2, created zeroed if needed;
+									///< R0 is 0, or -1 if the map is full
+
+#define EBPF_MAP_HASH			1	///< A hash table of up to max_entries keys
+#define EBPF_MAP_ARRAY			2	///< max_entries values, the key being their 32-bit index
+
+/*!
+  \brief An instruction of an extended program.
+*/
+struct ebpf_insn
+{
+	u_char code;		///< Class, operation and source, as in the classic instructions.
+	u_char regs;		///< The destination register in the low 4 bits, the source one in the high 4 bits.
+	short off;			///< Offset of the memory accesses and of the jumps.
+	bpf_int32 imm;		///< Immediate operand.
+};
+
+#define EBPF_DST(_insn)			((_insn)->regs & 0xf)
+#define EBPF_SRC(_insn)			((_insn)->regs >> 4)
+
+/// Initializer of a struct ebpf_insn, like BPF_STMT and BPF_JUMP for the classic ones
+#define EBPF_INSN(code, dst, src, off, imm) { (u_char)(code), (u_char)((dst) | ((src) << 4)), (short)(off), (bpf_int32)(imm) }
+
+/*!
+  \brief A map of an extended program.
+*/
+struct ebpf_map_def
+{
+	u_int32 type;			///< EBPF_MAP_HASH or EBPF_MAP_ARRAY.
+	u_int32 key_size;		///< Size of the keys in bytes, 4 for an array.
+	u_int32 value_size;		///< Size of the values in bytes.
+	u_int32 max_entries;	///< Maximum number of keys of a hash map, number of values of an array.
+};
+
+/*!
+  \brief Header of the image of an extended program.
+*/
+struct ebpf_program_header
+{
+	u_int32 magic;			///< EBPF_MAGIC.
+	u_int32 nmaps;			///< Number of ebpf_map_def following the header.
+	u_int32 len;			///< Number of ebpf_insn following the maps.
+	u_int32 reserved;		///< Must be 0.
+};
+
+/*!
+  \brief The content of a map, returned by BIOCGMAP: this structure, followed by count records
+  made of a key and of its value.
+*/
+struct ebpf_map_info
+{
+	struct ebpf_map_def def;	///< The map as declared by the program.
+	u_int32 count;				///< Number of keys in the map.
+	u_int32 reserved;
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/*!
+	  \brief A verified extended program with its maps, created by ebpf_load(). Its layout is private.
+	*/
+	struct ebpf_program;
+
+	/*!
+	  \brief Verifies the image of an extended program and creates it, with empty maps.
+	  \param image The image: a struct ebpf_program_header, the definitions of the maps and the instructions.
+	  \param size Size of the image in bytes.
+	  \return The program, to be released with ebpf_free(), or NULL if the image is not valid, if the program
+	  cannot be proven safe or on failure.
+
+	  Every path of the program is followed from the start with what is known of each register: not
+	  initialized, a number, constant or not, or a pointer to the stack. The memory accesses must be in the
+	  stack, the pointers cannot be stored, compared or returned, and the helpers must get valid maps and
+	  buffers. A loop is accepted if the verification ends, e.g. when its counter is a constant, and rejected
+	  if it can come back to an instruction without any change or runs too long.
+	*/
+	struct ebpf_program* ebpf_load(void* image, u_int size);
+
+	/*!
+	  \brief Releases a program created by ebpf_load() and its maps.
+	*/
+	void ebpf_free(struct ebpf_program* prog);
+
+	/*!
+	  \brief Runs an extended program on a packet.
+	  \param prog The program.
+	  \param p Pointer to the packet.
+	  \param wirelen Original length of the packet.
+	  \param buflen Current length of the packet.
+	  \param meta The metadata read by the ancillary loads, NULL if there is none.
+	  \return The low 32 bits of R0 at the exit of the program, or 0 if it loaded bytes out of the packet.
+
+	  Like the classic ones, the packet is read by the BPF_LD|BPF_ABS and BPF_LD|BPF_IND loads, in network
+	  byte order, into R0; the program can be run on any CPU at once, the maps having their own locks.
+	*/
+	u_int ebpf_filter(struct ebpf_program* prog, u_char* p, u_int wirelen, u_int buflen, struct bpf_meta* meta);
+
+	/*!
+	  \brief ebpf_filter() on a packet stored in several buffers, see bpf_filter_frags().
+	*/
+	u_int ebpf_filter_frags(struct ebpf_program* prog, struct bpf_frag* frags, u_int wirelen, u_int buflen, struct bpf_meta* meta);
+
+	/*!
+	  \brief Number of maps of a program.
+	*/
+	u_int ebpf_map_count(struct ebpf_program* prog);
+
+	/*!
+	  \brief Looks up a key in a map of a program.
+	  \param prog The program.
+	  \param index The index of the map.
+	  \param key The key, of the key_size of the map.
+	  \param value Receives the value, of the value_size of the map.
+	  \return TRUE if the key was found, FALSE otherwise.
+	*/
+	int ebpf_map_lookup(struct ebpf_program* prog, u_int index, void* key, void* value);
+
+	/*!
+	  \brief Copies the content of a map of a program, for BIOCGMAP.
+	  \param prog The program.
+	  \param index The index of the map.
+	  \param info Receives the description of the map, followed by as many of its records as fit.
+	  \param size Size of the buffer pointed by info.
+	  \return The number of bytes written, 0 if the map does not exist or if the buffer cannot hold info.
+
+	  The count field of info tells the caller if the buffer was too small for all the records. The keys of
+	  an array are the indexes of its values, all of which are returned.
+	*/
+	u_int ebpf_map_dump(struct ebpf_program* prog, u_int index, struct ebpf_map_info* info, u_int size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__WIN_EBPF_H*/
@@ -0,0 +1,72 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Fanout groups: the instances of an adapter that join the same fanout group with BIOCSETFANOUT
+ * share its packets, each packet going to a single member of the group instead of to all of them,
+ * as with PACKET_FANOUT on Linux. The member is chosen by a hash of the flow of the packet, in
+ * turn, or by the CPU that taps the packet.
+ *
+ * The hash is symmetric: both directions of a flow have the same hash, so that a member gets the
+ * whole conversation.
+ */
+
+#ifndef __WIN_FANOUT_H
+#define __WIN_FANOUT_H
+
+#include "win_bpf.h"
+
+#define NPF_FANOUT_NONE			0	///< Leaves the fanout group
+#define NPF_FANOUT_HASH			1	///< The member is chosen by the hash of the flow of the packet
+#define NPF_FANOUT_LB			2	///< The members get the packets in turn
+#define NPF_FANOUT_CPU			3	///< The member is chosen by the CPU that taps the packet
+
+#define NPF_FANOUT_MAX_MODE		NPF_FANOUT_CPU
+
+/*!
+  \brief The input buffer of BIOCSETFANOUT, the same in Packet32.h.
+*/
+struct npf_fanout_request
+{
+	u_int32 id;		///< The fanout group, among those of the adapter.
+	u_int32 mode;	///< NPF_FANOUT_HASH, NPF_FANOUT_LB or NPF_FANOUT_CPU, all the members of a group have the same one.
+					///< NPF_FANOUT_NONE leaves the group.
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/*!
+	  \brief Symmetric hash of the flow of a packet.
+	  \param p The packet, from its link layer header.
+	  \param len The bytes available at p.
+	  \param link_len The size of the link layer header: 14 for Ethernet, 4 for the null header of the loopback
+	  adapter.
+	  \return The hash of the addresses, of the protocol and, for TCP, UDP and SCTP, of the ports of the packet,
+	  whatever their direction. The packets that are not IP have the hash of their MAC addresses.
+
+	  An IPv4 or IPv6 fragment has the hash of its addresses only, the same for all the fragments of a datagram.
+	*/
+	u_int32 npf_fanout_hash(const u_char* p, u_int len, u_int link_len);
+
+	/*!
+	  \brief The member of a fanout group that gets a packet.
+	  \param mode The mode of the group.
+	  \param count The number of members, not 0.
+	  \param hash The hash of the packet, with NPF_FANOUT_HASH.
+	  \param cpu The CPU that taps the packet, with NPF_FANOUT_CPU.
+	  \param seq The number of the packet among those of its CPU, with NPF_FANOUT_LB.
+	  \return The index of the member, less than count.
+	*/
+	u_int npf_fanout_member(u_int mode, u_int count, u_int32 hash, u_int cpu, u_int seq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__WIN_FANOUT_H*/
@@ -0,0 +1,58 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * The merge of the kernel buffers of the CPUs in NPF_Read(): a min-heap of the stamps of the first
+ * packets of the buffers that hold any, so that each packet copied costs O(log n) for n CPUs with
+ * packets, instead of a look at every CPU. The buffers without packets are not in the heap at all.
+ */
+
+#ifndef __WIN_MERGE_H
+#define __WIN_MERGE_H
+
+#include "win_bpf.h"
+
+/*!
+  \brief A buffer in the heap: the stamp of its first packet and its CPU.
+*/
+struct npf_merge_entry
+{
+	ULONGLONG stamp;		///< Stamp of the first packet of the buffer.
+	u_int32 cpu;			///< The CPU of the buffer.
+	u_int32 reserved;
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/*!
+	  \brief Adds a buffer to the heap.
+	  \param heap The heap, with room for one more entry.
+	  \param count The number of entries in the heap, incremented.
+	  \param stamp The stamp of the first packet of the buffer.
+	  \param cpu The CPU of the buffer.
+
+	  heap[0] is then the buffer whose first packet has the smallest stamp, the smallest CPU among equal stamps.
+	*/
+	void npf_merge_push(struct npf_merge_entry* heap, u_int* count, ULONGLONG stamp, u_int cpu);
+
+	/*!
+	  \brief Sets the stamp of heap[0], once its first packet has been taken, to the stamp of its next one.
+	*/
+	void npf_merge_update(struct npf_merge_entry* heap, u_int count, ULONGLONG stamp);
+
+	/*!
+	  \brief Removes heap[0], when its buffer has no packet left to merge.
+	*/
+	void npf_merge_pop(struct npf_merge_entry* heap, u_int* count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__WIN_MERGE_H*/
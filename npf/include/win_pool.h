@@ -0,0 +1,139 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * The kernel buffer of an instance: a pool of blocks of the same size that the CPUs take as their
+ * packets arrive, instead of a fixed slice of the buffer for each CPU, so that the whole buffer
+ * absorbs the bursts of the few CPUs that get the traffic.
+ *
+ * Each CPU has a queue of blocks: the tap writes its packets in the last one, under the BufferLock
+ * of the CPU, and takes another block when a packet does not fit; NPF_Read() reads them from the
+ * first one and gives each block back once it has read it. The free blocks are in a lock-free list
+ * shared by the CPUs, and in a small cache of each CPU, filled by the reader with the blocks of the
+ * CPU it gives back, so that a busy CPU mostly reuses its own blocks without touching the list.
+ *
+ * There is a single reader at a time, and the tap of each CPU runs under the lock of the CPU: the
+ * tap and the reader share nothing but the fields they publish to each other with release stores.
+ */
+
+#ifndef __WIN_POOL_H
+#define __WIN_POOL_H
+
+#include "win_bpf.h"
+
+#define NPF_POOL_ALIGNMENT		8			///< Alignment of the records in a block
+#define NPF_POOL_BLOCK_SIZE		0x40000		///< Size of the blocks of the larger pools
+#define NPF_POOL_MIN_BLOCKS		8			///< Number of blocks of the smaller pools
+#define NPF_POOL_MIN_BLOCK_SIZE	0x800		///< Smallest size of a block
+#define NPF_POOL_CACHE			2			///< Number of blocks in the cache of a CPU
+
+#define NPF_POOL_ALIGN(x)		(((x) + NPF_POOL_ALIGNMENT - 1) & ~(NPF_POOL_ALIGNMENT - 1))
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/*!
+	  \brief A pool and the queues of the CPUs. Its layout is private.
+	*/
+	struct npf_pool;
+
+	/*!
+	  \brief Size of the blocks of a pool of a given size.
+	  \return NPF_POOL_BLOCK_SIZE, less if it makes fewer than NPF_POOL_MIN_BLOCKS blocks, or 0 if the pool is too
+	  small for blocks of NPF_POOL_MIN_BLOCK_SIZE bytes.
+
+	  A record larger than a block cannot be stored.
+	*/
+	u_int npf_pool_block_size(u_int size);
+
+	/*!
+	  \brief Creates a pool without any block.
+	  \param ncpu Number of CPUs.
+	  \param block_size Size of the blocks, a multiple of NPF_POOL_ALIGNMENT.
+	  \param nblocks Number of blocks, added with npf_pool_add().
+	  \return The pool, to be released with npf_pool_free(), or NULL if there is no memory.
+	*/
+	struct npf_pool* npf_pool_create(u_int ncpu, u_int block_size, u_int nblocks);
+
+	/*!
+	  \brief Releases a pool. The memory of its blocks belongs to the caller.
+	*/
+	void npf_pool_free(struct npf_pool* pool);
+
+	/*!
+	  \brief Adds blocks to a pool, before any CPU uses it.
+	  \param pool The pool.
+	  \param memory The memory of the blocks, count times the size of a block.
+	  \param count The number of blocks, at most those not added yet.
+	*/
+	void npf_pool_add(struct npf_pool* pool, u_char* memory, u_int count);
+
+	/*!
+	  \brief Empties the queues of all the CPUs, and puts all the blocks back in the list.
+	  The caller holds the locks of all the CPUs, and no reader is running.
+	*/
+	void npf_pool_reset(struct npf_pool* pool);
+
+	/*!
+	  \brief Finds room for a record at the end of the queue of a CPU. The tap side of the pool.
+	  \param pool The pool.
+	  \param cpu The CPU, whose lock the caller holds.
+	  \param length The size of the record.
+	  \return Where to write the record, or NULL if there is no free block and the record must be dropped.
+
+	  The last block of the queue gets the record if it fits, otherwise a block from the cache of the CPU or from
+	  the list follows it. The record is not visible to the reader before npf_pool_commit().
+	*/
+	u_char* npf_pool_reserve(struct npf_pool* pool, u_int cpu, u_int length);
+
+	/*!
+	  \brief Makes the record written after npf_pool_reserve() visible to the reader.
+	  \param pool The pool.
+	  \param cpu The CPU, whose lock the caller holds.
+	  \param length The size of the record, at most the one reserved.
+	*/
+	void npf_pool_commit(struct npf_pool* pool, u_int cpu, u_int length);
+
+	/*!
+	  \brief The first record of the queue of a CPU. The reader side of the pool.
+	  \return The record, or NULL if the reader has read all the records committed.
+
+	  The blocks that the reader has read entirely are given back on the way.
+	*/
+	u_char* npf_pool_peek(struct npf_pool* pool, u_int cpu);
+
+	/*!
+	  \brief Removes the record returned by npf_pool_peek() from the queue of its CPU.
+	  \param pool The pool.
+	  \param cpu The CPU.
+	  \param length The size of the record, as committed.
+	*/
+	void npf_pool_consume(struct npf_pool* pool, u_int cpu, u_int length);
+
+	/*!
+	  \brief Bytes committed on a CPU and not consumed yet.
+	*/
+	u_int npf_pool_pending(struct npf_pool* pool, u_int cpu);
+
+	/*!
+	  \brief Tells the reader if a CPU holds any block, in its queue or in its cache.
+	*/
+	int npf_pool_held(struct npf_pool* pool, u_int cpu);
+
+	/*!
+	  \brief Gives the blocks of a CPU that has no record left to read back to the list: its last block and
+	  those of its cache. The reader calls it with the lock of the CPU, for a CPU without new records since its
+	  previous read, so that the CPUs that stop getting packets do not keep any block.
+	*/
+	void npf_pool_trim(struct npf_pool* pool, u_int cpu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__WIN_POOL_H*/
@@ -0,0 +1,205 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * The capture ring: a region of memory shared with the application, mapped with BIOCSETRING, in
+ * which the tap stores the packets for the application to read them where they are, instead of
+ * copying them once in the kernel buffers and once more in NPF_Read(). It is modeled on TPACKET_V3.
+ *
+ * The region starts with a struct npf_ring_header and the producer and consumer indexes of each
+ * CPU, followed by nblocks blocks of block_size bytes for each CPU. A block is a struct
+ * npf_ring_block followed by packets, each a struct npf_ring_packet and its data. The tap fills one
+ * block of its CPU at a time, under the BufferLock of the CPU, and closes it when the next packet
+ * does not fit in it or when the application asks for the packets waiting in the open blocks with
+ * BIOCFLUSHRING. A closed block belongs to the application until it sets its status back to
+ * NPF_RING_BLOCK_KERNEL; the tap drops the packets while the next block of its CPU is not free.
+ *
+ * The driver keeps its own copy of everything it needs and reads nothing back from the region but
+ * the status of the blocks, so that what the application writes there cannot make the tap write
+ * outside of the region.
+ */
+
+#ifndef __WIN_RING_H
+#define __WIN_RING_H
+
+#include "win_bpf.h"
+
+/*
+ * The layout of the shared region, the same in Packet32.h.
+ */
+#define NPF_RING_MAGIC			0x474e4952	///< "RING"
+
+#define NPF_RING_ALIGNMENT		8			///< Alignment of the packets in a block
+#define NPF_RING_MIN_BLOCK		4096		///< Minimum size of a block, in bytes
+#define NPF_RING_MAX_BLOCK		0x400000	///< Maximum size of a block, in bytes
+#define NPF_RING_MAX_BLOCKS		4096		///< Maximum number of blocks of each CPU
+
+#define NPF_RING_BLOCK_KERNEL	0			///< The block is free, or being filled by the tap
+#define NPF_RING_BLOCK_USER		1			///< The block holds packets for the application
+
+#define NPF_RING_ALIGN(x)		(((x) + NPF_RING_ALIGNMENT - 1) & ~(NPF_RING_ALIGNMENT - 1))
+
+/*!
+  \brief Start of the shared region.
+*/
+struct npf_ring_header
+{
+	u_int32 magic;			///< NPF_RING_MAGIC.
+	u_int32 ncpu;			///< Number of CPUs, each with its npf_ring_index and its blocks.
+	u_int32 block_size;		///< Size of a block, in bytes.
+	u_int32 nblocks;		///< Number of blocks of each CPU.
+	u_int32 index_offset;	///< Offset of the array of the ncpu npf_ring_index from the start of the region.
+	u_int32 blocks_offset;	///< Offset of the blocks from the start of the region, those of CPU 0 first.
+	u_int32 next_cpu;		///< Written by the application only: the CPU whose blocks it looks at first.
+	u_int32 reserved;
+};
+
+/*!
+  \brief The indexes of the blocks of a CPU, on their own cache lines.
+
+  Both count the blocks from the mapping of the ring: the block i of the CPU is the block i % nblocks
+  of its array. The blocks from consumer to producer are closed and not yet taken by the application.
+*/
+struct npf_ring_index
+{
+	volatile u_int32 producer;	///< Written by the tap: number of blocks closed.
+	u_int32 reserved1[15];
+	volatile u_int32 consumer;	///< Written by the application: number of blocks taken.
+	u_int32 reserved2[15];
+};
+
+/*!
+  \brief Header of a block.
+*/
+struct npf_ring_block
+{
+	volatile u_int32 status;	///< NPF_RING_BLOCK_KERNEL or NPF_RING_BLOCK_USER.
+	u_int32 cpu;				///< The CPU of the block.
+	u_int32 seq;				///< Number of the block among the blocks closed on its CPU.
+	u_int32 packets;			///< Number of packets in the block.
+	u_int32 length;				///< Bytes used in the block, this header included.
+	u_int32 first;				///< Offset of the first packet from the start of the block.
+};
+
+/*!
+  \brief Header of a packet in a block, followed by its bh_caplen bytes.
+*/
+struct npf_ring_packet
+{
+	u_int32 next;				///< Offset of the next packet of the block from this one, 0 for the last one.
+	u_int32 reserved;
+	ULONGLONG stamp;			///< Performance counter when the packet was stored: the order of the packets of all the CPUs.
+								///< 0 if the instance was opened unordered.
+	struct bpf_hdr header;		///< The bpf header, as returned by NPF_Read().
+};
+
+#define NPF_RING_FIRST_PACKET(_block)	((struct npf_ring_packet*)((u_char*)(_block) + (_block)->first))
+#define NPF_RING_NEXT_PACKET(_packet)	((_packet)->next != 0 ? (struct npf_ring_packet*)((u_char*)(_packet) + (_packet)->next) : NULL)
+#define NPF_RING_PACKET_DATA(_packet)	((u_char*)((_packet) + 1))
+
+/*!
+  \brief Input of BIOCSETRING.
+*/
+struct npf_ring_request
+{
+	u_int32 block_size;		///< Size of a block, a multiple of NPF_RING_ALIGNMENT.
+	u_int32 nblocks;		///< Number of blocks of each CPU, 0 to unmap the ring.
+};
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/*!
+	  \brief The driver side of a ring and its shared region, created by npf_ring_create(). Its layout is private.
+	*/
+	struct npf_ring;
+
+	/*!
+	  \brief Size of the shared region of a ring.
+	  \param ncpu Number of CPUs.
+	  \param block_size Size of a block.
+	  \param nblocks Number of blocks of each CPU.
+	  \return The size in bytes, a multiple of the size of a page, or 0 if the parameters are not valid.
+	*/
+	u_int npf_ring_memory_size(u_int ncpu, u_int block_size, u_int nblocks);
+
+	/*!
+	  \brief Creates a ring, with all its blocks free.
+	  \param memory The shared region, of npf_ring_memory_size() bytes. It belongs to the caller, that allocates it
+	  in whole pages, so that mapping it gives nothing else to the application.
+	  \return The ring, to be released with npf_ring_free(), or NULL if the parameters are not valid or on failure.
+	*/
+	struct npf_ring* npf_ring_create(u_int ncpu, u_int block_size, u_int nblocks, void* memory);
+
+	/*!
+	  \brief Releases a ring, but not its shared region, once it is not mapped any more.
+	*/
+	void npf_ring_free(struct npf_ring* ring);
+
+	/*!
+	  \brief The shared region of a ring, of npf_ring_memory_size() bytes.
+	*/
+	struct npf_ring_header* npf_ring_memory(struct npf_ring* ring);
+
+	/*!
+	  \brief Reserves room for a packet in the open block of a CPU.
+	  \param ring The ring.
+	  \param cpu The CPU, whose BufferLock the caller holds.
+	  \param caplen The number of bytes of the packet to store, reduced to what fits in a block.
+	  \return The header of the packet, that the caller fills with its data before the block is closed, or NULL
+	  if the next block of the CPU still belongs to the application and the packet must be dropped.
+
+	  The open block is closed first if the packet does not fit in it. Only the next field of the packet is set.
+	*/
+	struct npf_ring_packet* npf_ring_reserve(struct npf_ring* ring, u_int cpu, u_int* caplen);
+
+	/*!
+	  \brief Closes the open block of a CPU, if it holds any packet, and gives it to the application.
+	  \param ring The ring.
+	  \param cpu The CPU, whose BufferLock the caller holds.
+	  \return TRUE if a block was closed.
+	*/
+	int npf_ring_close(struct npf_ring* ring, u_int cpu);
+
+	/*!
+	  \brief Number of blocks closed on a CPU, from the kernel copy of its producer index.
+	*/
+	u_int npf_ring_closed(struct npf_ring* ring, u_int cpu);
+
+	/*!
+	  \brief Takes the next closed block, looking at the CPUs in turn. The application side of the ring.
+	  \param header The shared region.
+	  \return The block, to be released with npf_ring_release() once its packets are read, or NULL if no
+	  block is closed.
+	*/
+	struct npf_ring_block* npf_ring_next(struct npf_ring_header* header);
+
+	/*!
+	  \brief Gives a block taken with npf_ring_next() back to the tap.
+	*/
+	void npf_ring_release(struct npf_ring_block* block);
+
+	/*!
+	  \brief Takes the next closed block, waiting for one if there is none. The application side of the ring.
+	  \param header The shared region.
+	  \param context Given to the callbacks.
+	  \param reset Clears the event that the driver sets when it closes a block, a manual-reset one.
+	  \param wait Waits for the event, until the read timeout.
+	  \param flush Asks the driver to close the blocks it is filling, returns 0 on failure.
+	  \return The block, to be released with npf_ring_release(), or NULL if none is closed before the timeout
+	  even once the open blocks are flushed.
+	*/
+	struct npf_ring_block* npf_ring_wait(struct npf_ring_header* header, void* context,
+		void (*reset)(void* context), void (*wait)(void* context), int (*flush)(void* context));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__WIN_RING_H*/
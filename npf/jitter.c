@@ -16,6 +16,35 @@
 #include "packet.h"
 #include "win_bpf.h"
 
+//
+// The scratch memory is in the stack frame of the function, below the registers of the
+// caller, so that the function has no state of its own and can run on any number of CPUs
+// at the same time
+//
+#define JIT_SCRATCH_SIZE		(BPF_MEMWORDS * 4)
+
+/// Offset from EBP of a word of the scratch memory: EBP is followed by the 5 saved registers
+#define JIT_SCRATCH_WORD(_k)	((INT)(_k) * 4 - 5 * 4 - JIT_SCRATCH_SIZE)
+
+/// Frees the scratch memory and restores the registers of the caller
+#define EPILOGUE() \
+	ADDib(ESP, JIT_SCRATCH_SIZE) \
+	POP(EDI) \
+	POP(ESI) \
+	POP(EDX) \
+	POP(ECX) \
+	POP(EBX) \
+	POP(EBP)
+
+/// Returns 0, i.e. rejects the packet
+#define RET_ZERO() \
+	EPILOGUE() \
+	MOVid(EAX, 0) \
+	RET()
+
+/// Size of the code emitted by RET_ZERO(), that the loads in bounds jump over
+#define RET_ZERO_LEN			15
+
 //
 // emit routine to update the jump table
 //
@@ -57,10 +86,11 @@ void emit_code(binary_stream* stream, ULONG value, UINT len)
 //
 // Function that does the real stuff
 //
-BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
+BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins)
 {
 	struct bpf_insn* ins;
-	UINT i, pass;
+	UINT i, k, pass;
+	UINT loaded_words = 0;
 	binary_stream stream;
 
 	//NOTE: do not modify the name of this variable, as it's used by the macros to emit code.
@@ -86,6 +116,13 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 	stream.cur_ip = 0;
 	stream.bpf_pc = 0;
 
+	// Find the words of the scratch memory that the program loads
+	for (i = 0; i < nins; i++)
+	{
+		if (prog[i].code == (BPF_LD|BPF_MEM) || prog[i].code == (BPF_LDX|BPF_MEM))
+			loaded_words |= 1 << (prog[i].k & (BPF_MEMWORDS - 1));
+	}
+
 	// the first pass will emit the lengths of the instructions 
 	// to create the reference table
 	emitm = emit_lenght;
@@ -102,12 +139,36 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 		PUSH(EDX)
 		PUSH(ESI)
 		PUSH(EDI)
+		SUBib(ESP, JIT_SCRATCH_SIZE)
 		MOVodd(EBX, EBP, 8)
 
+		// Like bpf_filter(), start with A, X and the scratch memory at 0. Only the words that are loaded matter
+		MOVid(EAX, 0)
+		MOVid(EDX, 0)
+		for (k = 0; k < BPF_MEMWORDS; k++)
+		{
+			if (loaded_words & (1 << k))
+			{
+				MOVmdd(EBP, JIT_SCRATCH_WORD(k), EAX)
+			}
+		}
+
 		for (i = 0; i < nins; i++)
 		{
 			stream.bpf_pc++;
 
+			// An ancillary load reads the metadata, the fourth argument, or gives 0 if there is none
+			if (BPF_IS_ANCILLARY(ins->code, ins->k))
+			{
+				MOVid(EAX, 0)
+				MOVodd(ECX, EBP, 20)
+				CMPid(ECX, 0)
+				JEb(3)
+				MOVodd(EAX, ECX, ins->k - BPF_AD_OFF)
+				ins++;
+				continue;
+			}
+
 			switch (ins->code)
 			{
 			default:
@@ -115,24 +176,14 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 
 			case BPF_RET|BPF_K:
 				MOVid(EAX, ins->k)
-				POP(EDI)
-				POP(ESI)
-				POP(EDX)
-				POP(ECX)
-				POP(EBX)
-				POP(EBP)
+				EPILOGUE()
 				RET()
 
 				break;
 
 
 			case BPF_RET|BPF_A:
-				POP(EDI)
-				POP(ESI)
-				POP(EDX)
-				POP(ECX)
-				POP(EBX)
-				POP(EBP)
+				EPILOGUE()
 				RET()
 
 				break;
@@ -145,15 +196,8 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 				MOVrd(ESI, ECX)
 				ADDib(ECX, sizeof(INT))
 				CMPodd(ECX, EBP, 0x10)
-				JBEb(12)
-				POP(EDI)
-				POP(ESI)
-				POP(EDX)
-				POP(ECX)
-				POP(EBX)
-				POP(EBP)
-				MOVid(EAX, 0)  //this can be optimized with xor eax,eax
-				RET()
+				JBEb(RET_ZERO_LEN)
+				RET_ZERO()
 				MOVobd(EAX, EBX, ESI)
 				BSWAP(EAX)
 
@@ -166,15 +210,8 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 				MOVrd(ESI, ECX)
 				ADDib(ECX, sizeof(SHORT))
 				CMPodd(ECX, EBP, 0x10)
-				JBEb(12)
-				POP(EDI)
-				POP(ESI)
-				POP(EDX)
-				POP(ECX)
-				POP(EBX)
-				POP(EBP)
-				MOVid(EAX, 0)  
-				RET()
+				JBEb(RET_ZERO_LEN)
+				RET_ZERO()
 				MOVid(EAX, 0)  
 				MOVobw(AX, EBX, ESI)
 				SWAP_AX()
@@ -184,15 +221,8 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 			case BPF_LD|BPF_B|BPF_ABS:
 				MOVid(ECX, ins->k)
 				CMPodd(ECX, EBP, 0x10)
-				JBb(12)
-				POP(EDI)
-				POP(ESI)
-				POP(EDX)
-				POP(ECX)
-				POP(EBX)
-				POP(EBP)
-				MOVid(EAX, 0)  
-				RET()
+				JBb(RET_ZERO_LEN)
+				RET_ZERO()
 				MOVid(EAX, 0)  
 				MOVobb(AL, EBX, ECX)
 
@@ -216,15 +246,8 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 				MOVrd(ESI, ECX)
 				ADDib(ECX, sizeof(INT))
 				CMPodd(ECX, EBP, 0x10)
-				JBEb(12)
-				POP(EDI)
-				POP(ESI)
-				POP(EDX)
-				POP(ECX)
-				POP(EBX)
-				POP(EBP)
-				MOVid(EAX, 0)  
-				RET()
+				JBEb(RET_ZERO_LEN)
+				RET_ZERO()
 				MOVobd(EAX, EBX, ESI)
 				BSWAP(EAX)
 
@@ -238,15 +261,8 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 				MOVrd(ESI, ECX)
 				ADDib(ECX, sizeof(SHORT))
 				CMPodd(ECX, EBP, 0x10)
-				JBEb(12)
-				POP(EDI)
-				POP(ESI)
-				POP(EDX)
-				POP(ECX)
-				POP(EBX)
-				POP(EBP)
-				MOVid(EAX, 0)  
-				RET()
+				JBEb(RET_ZERO_LEN)
+				RET_ZERO()
 				MOVid(EAX, 0)  
 				MOVobw(AX, EBX, ESI)
 				SWAP_AX()
@@ -257,15 +273,8 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 				MOVid(ECX, ins->k)
 				ADDrd(ECX, EDX)
 				CMPodd(ECX, EBP, 0x10)
-				JBb(12)
-				POP(EDI)
-				POP(ESI)
-				POP(EDX)
-				POP(ECX)
-				POP(EBX)
-				POP(EBP)
-				MOVid(EAX, 0)  
-				RET()
+				JBb(RET_ZERO_LEN)
+				RET_ZERO()
 				MOVid(EAX, 0)  
 				MOVobb(AL, EBX, ECX)
 
@@ -274,15 +283,8 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 			case BPF_LDX|BPF_MSH|BPF_B:
 				MOVid(ECX, ins->k)
 				CMPodd(ECX, EBP, 0x10)
-				JBb(12)
-				POP(EDI)
-				POP(ESI)
-				POP(EDX)
-				POP(ECX)
-				POP(EBX)
-				POP(EBP)
-				MOVid(EAX, 0)  
-				RET()
+				JBb(RET_ZERO_LEN)
+				RET_ZERO()
 				MOVid(EDX, 0)
 				MOVobb(DL, EBX, ECX)
 				ANDib(DL, 0xf)
@@ -301,32 +303,23 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 				break;
 
 			case BPF_LD|BPF_MEM:
-				MOVid(ECX, (INT)mem)
-				MOVid(ESI, ins->k * 4)
-				MOVobd(EAX, ECX, ESI)
+				MOVodd(EAX, EBP, JIT_SCRATCH_WORD(ins->k))
 
 				break;
 
 			case BPF_LDX|BPF_MEM:
-				MOVid(ECX, (INT)mem)
-				MOVid(ESI, ins->k * 4)
-				MOVobd(EDX, ECX, ESI)
+				MOVodd(EDX, EBP, JIT_SCRATCH_WORD(ins->k))
 
 				break;
 
 			case BPF_ST:
-				// XXX: this command and the following could be optimized if the previous
-				// instruction was already of this type
-				MOVid(ECX, (INT)mem)
-				MOVid(ESI, ins->k * 4)
-				MOVomd(ECX, ESI, EAX)
+				MOVmdd(EBP, JIT_SCRATCH_WORD(ins->k), EAX)
 
 				break;
 
 			case BPF_STX:
-				MOVid(ECX, (INT)mem)
-				MOVid(ESI, ins->k * 4)
-				MOVomd(ECX, ESI, EDX)
+				MOVmdd(EBP, JIT_SCRATCH_WORD(ins->k), EDX)
+
 				break;
 
 			case BPF_JMP|BPF_JA:
@@ -408,15 +401,8 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 
 			case BPF_ALU|BPF_DIV|BPF_X:
 				CMPid(EDX, 0)
-				JNEb(12)
-				POP(EDI)
-				POP(ESI)
-				POP(EDX)
-				POP(ECX)
-				POP(EBX)
-				POP(EBP)
-				MOVid(EAX, 0)  
-				RET()
+				JNEb(RET_ZERO_LEN)
+				RET_ZERO()
 				MOVrd(ECX, EDX)
 				MOVid(EDX, 0)  
 				DIVrd(ECX)
@@ -506,6 +492,23 @@ BPF_filter_function BPFtoX86(struct bpf_insn* prog, UINT nins, INT* mem)
 			case BPF_MISC|BPF_TXA:
 				MOVrd(EAX, EDX)
 
+				break;
+
+			case BPF_MISC|BPF_MATCH:
+				// A = bpf_match(k, packet, buflen, X, A), a cdecl call that clobbers ecx and edx
+				PUSH(EDX)
+				PUSH(EAX)
+				PUSH(EDX)
+				MOVodd(ECX, EBP, 0x10)
+				PUSH(ECX)
+				PUSH(EBX)
+				MOVid(ECX, ins->k)
+				PUSH(ECX)
+				MOVid(ECX, (ULONG)bpf_match)
+				CALLr(ECX)
+				ADDib(ESP, 20)
+				POP(EDX)
+
 				break;
 			}
 
@@ -571,36 +574,21 @@ JIT_BPF_Filter* BPF_jitter(struct bpf_insn* fp, INT nins)
 		return NULL;
 	}
 
-	// Allocate the filter's memory
-#ifdef NTKERNEL
-#pragma warning (disable: 30030)
-	Filter->mem = (INT *)ExAllocatePoolWithTag(NonPagedPoolExecute, BPF_MEMWORDS * sizeof(INT), '3JWA');
-#else
-	Filter->mem = (INT *)malloc(BPF_MEMWORDS * sizeof(INT));
-#endif
-	if (Filter->mem == NULL)
-	{
-#ifdef NTKERNEL
-		ExFreePool(Filter);
-#else
-		free(Filter);
-#endif
-		return NULL;
-	}
-
 	// Create the binary
-	if ((Filter->Function = BPFtoX86(fp, nins, Filter->mem)) == NULL)
+	if ((Filter->Function = BPFtoX86(fp, nins)) == NULL)
 	{
 #ifdef NTKERNEL
-		ExFreePool(Filter->mem);
 		ExFreePool(Filter);
 #else
-		free(Filter->mem);
 		free(Filter);
 #endif
 		return NULL;
 	}
 
+	// The packets in several buffers are left to bpf_filter_frags(), the batches to a loop on Function
+	Filter->FragsFunction = NULL;
+	Filter->BatchFunction = NULL;
+
 	return Filter;
 }
 
@@ -609,11 +597,9 @@ JIT_BPF_Filter* BPF_jitter(struct bpf_insn* fp, INT nins)
 void BPF_Destroy_JIT_Filter(JIT_BPF_Filter* Filter)
 {
 #ifdef NTKERNEL
-	ExFreePool(Filter->mem);
 	ExFreePool(Filter->Function);
 	ExFreePool(Filter);
 #else
-	free(Filter->mem);
 	free(Filter->Function);
 	free(Filter);
 #endif
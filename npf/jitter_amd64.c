@@ -0,0 +1,1203 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+#ifdef NPF_HOST_BUILD
+#include "win_bpf.h"
+#include "jitter.h"
+#else
+#include "stdafx.h"
+#endif
+
+#if defined(_AMD64_) || defined(__x86_64__)
+
+#ifndef NPF_HOST_BUILD
+#include "ndis.h"
+
+#include "packet.h"
+#include "win_bpf.h"
+#endif
+
+#if !defined(NTKERNEL) && !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+//
+// Calling convention of the generated function, i.e. where the four arguments of a
+// BPF_filter_function are found, and the registers that can hold the scratch memory.
+// The latter are in order of preference: the volatile ones first, as they do not need
+// to be saved by the prologue.
+//
+#ifdef _WIN32
+// Microsoft x64: rcx, rdx, r8, r9. rsi and rdi are callee-saved.
+#define ARG_PACKET		RCX
+#define ARG_WIRELEN		RDX
+#define ARG_BUFLEN		R8
+#define ARG_META		R9
+static const UCHAR ScratchRegisters[] = { RBX, RSI, RDI, RBP, R12, R13, R14, R15 };
+#define VOLATILE_SCRATCH_REGISTERS 0
+#else
+// System V AMD64: rdi, rsi, rdx, rcx. rsi and rdi are volatile.
+#define ARG_PACKET		RDI
+#define ARG_WIRELEN		RSI
+#define ARG_BUFLEN		RDX
+#define ARG_META		RCX
+static const UCHAR ScratchRegisters[] = { RSI, RDI, RBX, RBP, R12, R13, R14, R15 };
+#define VOLATILE_SCRATCH_REGISTERS 2
+#endif
+
+#define SCRATCH_REGISTERS (sizeof(ScratchRegisters) / sizeof(ScratchRegisters[0]))
+
+//
+// Fixed register allocation of the BPF machine. rcx and rdx are temporaries
+// (shift count and dividend's high half respectively).
+//
+#define REG_A			RAX
+#define REG_X			R11
+#define REG_PACKET		R8
+#define REG_WIRELEN		R9
+#define REG_BUFLEN		R10
+
+//
+// Location of a scratch memory word: a register, or an offset in the stack frame
+//
+typedef struct scratch_slot
+{
+	UINT Uses;
+	BOOLEAN Read;		///< The program loads this word, so it must start zeroed.
+	BOOLEAN InRegister;
+	UINT Location;		///< Register number or offset from rsp
+} scratch_slot;
+
+//
+// emit routine to update the jump table
+//
+static void emit_lenght(binary_stream* stream, ULONG value, UINT len)
+{
+	UNREFERENCED_PARAMETER(value);
+
+	(stream->refs)[stream->bpf_pc] += len;
+	stream->cur_ip += len;
+}
+
+//
+// emit routine that only measures a piece of code, to jump over it
+//
+static void emit_measure(binary_stream* stream, ULONG value, UINT len)
+{
+	UNREFERENCED_PARAMETER(value);
+
+	stream->cur_ip += len;
+}
+
+//
+// emit routine to output the actual binary code
+//
+static void emit_code(binary_stream* stream, ULONG value, UINT len)
+{
+	switch (len)
+	{
+	case 1:
+		stream->ibuf[stream->cur_ip] = (UCHAR)value;
+		stream->cur_ip++;
+		break;
+
+	case 2:
+		*((USHORT *)(stream->ibuf + stream->cur_ip)) = (USHORT)value;
+		stream->cur_ip += 2;
+		break;
+
+	case 4:
+		*((ULONG *)(stream->ibuf + stream->cur_ip)) = value;
+		stream->cur_ip += 4;
+		break;
+
+	default:
+		;
+	}
+
+	return;
+}
+
+//
+// Executable memory. In user mode the pages are writable while the code is emitted,
+// and executable (but no longer writable) afterwards.
+//
+#if !defined(NTKERNEL) && !defined(_WIN32)
+// mmap needs the size to unmap, it is kept in front of the code
+#define CODE_HEADER_SIZE 16
+#endif
+
+static PCHAR jit_alloc_code(UINT size)
+{
+#ifdef NTKERNEL
+#pragma warning (disable: 30030)
+	return (PCHAR)ExAllocatePoolWithTag(NonPagedPoolExecute, size, '1JWA');
+#elif defined(_WIN32)
+	return (PCHAR)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	PCHAR p = (PCHAR)mmap(NULL, size + CODE_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == (PCHAR)MAP_FAILED)
+		return NULL;
+
+	*(size_t*)p = size + CODE_HEADER_SIZE;
+	return p + CODE_HEADER_SIZE;
+#endif
+}
+
+static BOOLEAN jit_seal_code(PCHAR code, UINT size)
+{
+#ifdef NTKERNEL
+	UNREFERENCED_PARAMETER(code);
+	UNREFERENCED_PARAMETER(size);
+	return TRUE;
+#elif defined(_WIN32)
+	DWORD OldProtect;
+
+	if (!VirtualProtect(code, size, PAGE_EXECUTE_READ, &OldProtect))
+		return FALSE;
+	FlushInstructionCache(GetCurrentProcess(), code, size);
+	return TRUE;
+#else
+	(void)size;
+	code -= CODE_HEADER_SIZE;
+	return mprotect(code, *(size_t*)code, PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+static void jit_free_code(PCHAR code)
+{
+#ifdef NTKERNEL
+	ExFreePool(code);
+#elif defined(_WIN32)
+	VirtualFree(code, 0, MEM_RELEASE);
+#else
+	code -= CODE_HEADER_SIZE;
+	munmap(code, *(size_t*)code);
+#endif
+}
+
+//
+// Decides where every scratch memory word lives: the most used ones go in the
+// spare registers, the others in the stack frame.
+// Returns the number of registers that the prologue must save.
+//
+static UINT jit_assign_scratch(struct bpf_insn* prog, UINT nins, scratch_slot* slots, UINT* FrameSize)
+{
+	UINT i, j, best;
+	UINT nregs = 0;
+	UINT nstack = 0;
+	BOOLEAN assigned[BPF_MEMWORDS];
+
+	for (i = 0; i < BPF_MEMWORDS; i++)
+	{
+		slots[i].Uses = 0;
+		slots[i].Read = FALSE;
+		slots[i].InRegister = FALSE;
+		slots[i].Location = 0;
+		assigned[i] = FALSE;
+	}
+
+	for (i = 0; i < nins; i++)
+	{
+		switch (prog[i].code)
+		{
+		case BPF_LD|BPF_MEM:
+		case BPF_LDX|BPF_MEM:
+			slots[prog[i].k].Read = TRUE;
+			slots[prog[i].k].Uses++;
+			break;
+
+		case BPF_ST:
+		case BPF_STX:
+			slots[prog[i].k].Uses++;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	for (i = 0; i < BPF_MEMWORDS; i++)
+	{
+		best = BPF_MEMWORDS;
+		for (j = 0; j < BPF_MEMWORDS; j++)
+		{
+			if (!assigned[j] && slots[j].Uses > 0 && (best == BPF_MEMWORDS || slots[j].Uses > slots[best].Uses))
+				best = j;
+		}
+
+		if (best == BPF_MEMWORDS)
+			break;
+
+		assigned[best] = TRUE;
+		if (nregs < SCRATCH_REGISTERS)
+		{
+			slots[best].InRegister = TRUE;
+			slots[best].Location = ScratchRegisters[nregs++];
+		}
+		else
+		{
+			slots[best].Location = 4 * nstack++;
+		}
+	}
+
+	// rsp stays 8-byte aligned: only the stubs of the fragmented loads and the matches call
+	// C code, and they align it themselves
+	*FrameSize = (4 * nstack + 7) & ~7;
+
+	return nregs > VOLATILE_SCRATCH_REGISTERS ? nregs - VOLATILE_SCRATCH_REGISTERS : 0;
+}
+
+//
+// Leaves the function, with the result already in eax
+//
+#define EPILOGUE() \
+	if (FrameTotal != 0) { \
+	ADDiq(RSP, FrameTotal) } \
+	for (j = nsaved; j > 0; j--) { \
+	POP(ScratchRegisters[VOLATILE_SCRATCH_REGISTERS + j - 1]) } \
+	RET()
+
+//
+// Jumps, with the displacement computed before the opcode is emitted
+//
+#define JCC_TO(cc, target, len) \
+	off = (INT)(target) - (stream.cur_ip + (len)); \
+	JCC(cc, off)
+
+#define JMP_TO(target) \
+	off = (INT)(target) - (stream.cur_ip + 5); \
+	JMP(off)
+
+/// Jump to the code that rejects the packet
+#define JCC_REJECT(cc)	JCC_TO(cc, stream.refs[nins], 6)
+#define JMP_REJECT()	JMP_TO(stream.refs[nins])
+
+/// Conditional BPF jump, taken when cc is true. Jumps to the next instruction become fall-throughs
+#define BRANCH(cc) \
+	if (ins->jt == ins->jf) { \
+		if (ins->jt != 0) { \
+		JMP_TO(stream.refs[stream.bpf_pc + ins->jt]) } \
+	} \
+	else if (ins->jf == 0) { \
+		JCC_TO(cc, stream.refs[stream.bpf_pc + ins->jt], 6) \
+	} \
+	else if (ins->jt == 0) { \
+		JCC_TO((cc) ^ 1, stream.refs[stream.bpf_pc + ins->jf], 6) \
+	} \
+	else { \
+		JCC_TO(cc, stream.refs[stream.bpf_pc + ins->jt], 6) \
+		JMP_TO(stream.refs[stream.bpf_pc + ins->jf]) \
+	}
+
+/// Bounds check of a load of size bytes at the constant offset k, unless the checks computed
+/// by bpf_validate_bounds() already cover it
+#define CHECK_ABS(k, size) \
+	if ((k) > 0xffffffff - (size)) { \
+		JMP_REJECT() \
+	} \
+	else if (checks == NULL) { \
+		CMPid(REG_BUFLEN, (k) + (size)) \
+		JCC_REJECT(CC_B) \
+	}
+
+/// Bounds check of a load of size bytes at X + k; leaves X + k in rcx and its end in rdx
+#define CHECK_IND(k, size) \
+	LEAodd(RCX, REG_X, k) \
+	LEAodq(RDX, RCX, size) \
+	CMPrq(RDX, REG_BUFLEN) \
+	JCC_REJECT(CC_A)
+
+//
+// Fragmented packets. The generated function receives an array of struct bpf_frag: the
+// first fragment is kept in REG_PACKET, the array and the length of the first fragment
+// in the stack frame. The loads that do not fit in the first fragment call a stub, one
+// for each load size, that saves the volatile registers, aligns the stack and calls
+// bpf_frag_load().
+//
+#define FRAG_STUBS			3
+
+/// Saved by the stubs and around the calls of bpf_match(): the machine state and, on System V,
+/// the volatile scratch registers
+#ifdef _WIN32
+static const UCHAR StubSavedRegisters[] = { RAX, R8, R9, R10, R11 };
+#else
+static const UCHAR StubSavedRegisters[] = { RAX, R8, R9, R10, R11, RSI, RDI };
+#endif
+
+#define STUB_SAVED_REGISTERS (sizeof(StubSavedRegisters) / sizeof(StubSavedRegisters[0]))
+
+/// Stub of the loads of size bytes
+#define FRAG_STUB(size)		((size) == 4 ? 0 : (size) == 2 ? 1 : 2)
+
+/// Fast path of a load of size bytes at rcx in the first fragment, value in ecx
+#define FRAG_FAST(size) \
+	if ((size) == 4) { \
+		MOVobd(RCX, REG_PACKET, RCX) \
+		BSWAP(RCX) \
+	} \
+	else if ((size) == 2) { \
+		MOVZXobw(RCX, REG_PACKET, RCX) \
+		SWAPw(RCX) \
+	} \
+	else { \
+		MOVZXobb(RCX, REG_PACKET, RCX) \
+	}
+
+/// Load of size bytes at rcx, whose end is in rdx, from the fragments; value in ecx
+#define FRAG_LOAD(size) \
+	saved_ip = stream.cur_ip; \
+	saved_emitm = emitm; \
+	emitm = emit_measure; \
+	FRAG_FAST(size) \
+	fastlen = stream.cur_ip - saved_ip; \
+	stream.cur_ip = saved_ip; \
+	emitm = saved_emitm; \
+	CMPodq(RDX, RSP, Frag0Slot) \
+	JCCb(CC_BE, 7) \
+	off = (INT)stream.refs[nins + 1 + FRAG_STUB(size)] - (stream.cur_ip + 5); \
+	CALL(off) \
+	JMPb(fastlen) \
+	FRAG_FAST(size)
+
+//
+// Batches. The loop over the packets keeps its pointers and counter in the stack frame,
+// and the code of a packet starts at LoopHead. The returns of the program store A
+// in the array of verdicts and continue with the next packet; after the last one,
+// the function leaves.
+//
+#define BATCH_BLOCKS		2
+
+#define BATCH_NEXT			(nins + 1)	///< Index in the reference table of the code that goes to the next packet
+#define BATCH_EXIT			(nins + 2)	///< Index in the reference table of the epilogue
+
+/// Return of the BPF program, with the result in eax
+#define RETURN() \
+	if (Mode == JIT_MODE_BATCH) { \
+		JMP_TO(stream.refs[BATCH_NEXT]) \
+	} \
+	else { \
+		EPILOGUE() \
+	}
+
+//
+// Function that does the real stuff. Mode tells the kind of function to build
+// (JIT_MODE_*), see BPFtoX64() in jitter.h.
+//
+PVOID BPFtoX64(struct bpf_insn* prog, UINT nins, UINT Mode)
+{
+	struct bpf_insn* ins;
+	UINT i, j, pass, nrefs;
+	UINT nsaved, FrameSize, FrameTotal;
+	UINT FragsSlot, Frag0Slot, StubFrame, MatchFrame;
+	UINT PacketsSlot, CountSlot, VerdictsSlot, MetaSlot;
+	INT off, saved_ip, fastlen;
+	INT LoopHead = 0;
+	BOOLEAN Frags = (Mode == JIT_MODE_FRAGS);
+	BOOLEAN UsesMeta = FALSE;
+	scratch_slot slots[BPF_MEMWORDS];
+	binary_stream stream;
+	u_int32* checks;
+	emit_func saved_emitm;
+
+	//NOTE: do not modify the name of this variable, as it's used by the macros to emit code.
+	emit_func emitm;
+
+	nsaved = jit_assign_scratch(prog, nins, slots, &FrameSize);
+
+	// The array of fragments and the length of the first one follow the scratch memory,
+	// and so does the state of the loop of the batches
+	FragsSlot = FrameSize;
+	Frag0Slot = FrameSize + 8;
+	PacketsSlot = FrameSize;
+	CountSlot = FrameSize + 8;
+	VerdictsSlot = FrameSize + 16;
+	FrameTotal = FrameSize;
+	if (Mode == JIT_MODE_FRAGS)
+		FrameTotal += 16;
+	else if (Mode == JIT_MODE_BATCH)
+		FrameTotal += 24;
+
+	// The pointer to the metadata of the packet comes last, if the ancillary loads need it
+	for (i = 0; i < nins; i++)
+	{
+		if (BPF_IS_ANCILLARY(prog[i].code, prog[i].k))
+			UsesMeta = TRUE;
+	}
+	MetaSlot = FrameTotal;
+	if (UsesMeta)
+		FrameTotal += 8;
+
+	// Room for the arguments of bpf_frag_load(), and for the alignment of rsp before the call
+	StubFrame = 32 + (8 * nsaved + FrameTotal + 8 * STUB_SAVED_REGISTERS) % 16;
+
+	// The same for bpf_match(), called from the body of the function: its fifth argument goes on
+	// the stack on Win64, and there is no return address of a stub on top of the frame
+	MatchFrame = 40 + (8 * nsaved + FrameTotal + 8 * STUB_SAVED_REGISTERS + 8) % 16;
+
+	// Allocate the reference table for the jumps: one entry per instruction,
+	// plus the prologue, the reject code and the stubs or the loop of the batch at the
+	// end; then the bounds checks
+	nrefs = nins + 2;
+	if (Mode == JIT_MODE_FRAGS)
+		nrefs += FRAG_STUBS;
+	else if (Mode == JIT_MODE_BATCH)
+		nrefs += BATCH_BLOCKS;
+#ifdef NTKERNEL
+	stream.refs = (UINT *)ExAllocatePoolWithTag(NonPagedPool, (nrefs + nins) * sizeof(UINT), '0JWA');
+#else
+	stream.refs = (UINT *)malloc((nrefs + nins) * sizeof(UINT));
+#endif
+	if (stream.refs == NULL)
+	{
+		return NULL;
+	}
+
+	// Without the analysis, every absolute load checks its own bounds
+	checks = (u_int32 *)(stream.refs + nrefs);
+	if (!bpf_validate_bounds(prog, (int)nins, checks))
+	{
+		checks = NULL;
+	}
+
+	// Reset the reference table
+	for (i = 0; i < nrefs; i++)
+		stream.refs[i] = 0;
+
+	stream.cur_ip = 0;
+	stream.bpf_pc = 0;
+	stream.ibuf = NULL;
+
+	// the first pass will emit the lengths of the instructions
+	// to create the reference table
+	emitm = emit_lenght;
+
+	for (pass = 0; ;)
+	{
+		ins = prog;
+
+		/* create the procedure header */
+		for (j = 0; j < nsaved; j++)
+		{
+			PUSH(ScratchRegisters[VOLATILE_SCRATCH_REGISTERS + j])
+		}
+		if (FrameTotal != 0)
+		{
+			SUBiq(RSP, FrameTotal)
+		}
+
+		// Before the other arguments are moved: on Win64, it arrives in r9, that is going to hold wirelen
+		if (UsesMeta && Mode != JIT_MODE_BATCH)
+		{
+			MOVomq(RSP, MetaSlot, ARG_META)
+		}
+
+		if (Mode == JIT_MODE_BATCH)
+		{
+			// Packets, count and verdicts; leave at once if the batch is empty
+			MOVomq(RSP, PacketsSlot, ARG_PACKET)
+			MOVomd(RSP, CountSlot, ARG_WIRELEN)
+			MOVomq(RSP, VerdictsSlot, ARG_BUFLEN)
+			TESTrd(ARG_WIRELEN, ARG_WIRELEN)
+			JCC_TO(CC_E, stream.refs[BATCH_EXIT], 6)
+
+			LoopHead = stream.cur_ip;
+			MOVodq(RCX, RSP, PacketsSlot)
+			MOVodq(REG_PACKET, RCX, FIELD_OFFSET(struct bpf_packet, data))
+			MOVodd(REG_WIRELEN, RCX, FIELD_OFFSET(struct bpf_packet, wirelen))
+			MOVodd(REG_BUFLEN, RCX, FIELD_OFFSET(struct bpf_packet, buflen))
+			if (UsesMeta)
+			{
+				MOVodq(RDX, RCX, FIELD_OFFSET(struct bpf_packet, meta))
+				MOVomq(RSP, MetaSlot, RDX)
+			}
+		}
+		else
+		{
+			// buflen first: on Win64 it arrives in r8, that is going to hold the packet
+			MOVrd(REG_BUFLEN, ARG_BUFLEN)
+			MOVrd(REG_WIRELEN, ARG_WIRELEN)
+		}
+		if (Frags)
+		{
+			MOVomq(RSP, FragsSlot, ARG_PACKET)
+			MOVodq(REG_PACKET, ARG_PACKET, FIELD_OFFSET(struct bpf_frag, data))
+			MOVodd(RCX, ARG_PACKET, FIELD_OFFSET(struct bpf_frag, len))
+			MOVomq(RSP, Frag0Slot, RCX)
+		}
+		else if (Mode == JIT_MODE_PACKET)
+		{
+			MOVrq(REG_PACKET, ARG_PACKET)
+		}
+		XORrd(REG_A, REG_A)
+		XORrd(REG_X, REG_X)
+
+		// The interpreter zeroes the scratch memory: do the same for the words that are read
+		for (j = 0; j < BPF_MEMWORDS; j++)
+		{
+			if (!slots[j].Read)
+				continue;
+
+			if (slots[j].InRegister)
+			{
+				MOVrd(slots[j].Location, REG_A)
+			}
+			else
+			{
+				MOVomd(RSP, slots[j].Location, REG_A)
+			}
+		}
+
+		for (i = 0; i < nins; i++)
+		{
+			stream.bpf_pc++;
+
+			// The jumps to this instruction land here, so the check is done on all the paths
+			if (checks != NULL && checks[i] != 0)
+			{
+				CMPid(REG_BUFLEN, checks[i])
+				JCC_REJECT(CC_B)
+			}
+
+			// An ancillary load reads the metadata, or gives 0 if there is none
+			if (BPF_IS_ANCILLARY(ins->code, ins->k))
+			{
+				XORrd(REG_A, REG_A)
+				MOVodq(RCX, RSP, MetaSlot)
+				TESTrq(RCX, RCX)
+				JCCb(CC_E, 6)
+				MOVodd(REG_A, RCX, ins->k - BPF_AD_OFF)
+				ins++;
+				continue;
+			}
+
+			switch (ins->code)
+			{
+			default:
+#ifdef NTKERNEL
+				ExFreePool(stream.refs);
+#else
+				free(stream.refs);
+#endif
+				if (stream.ibuf != NULL)
+					jit_free_code(stream.ibuf);
+				return NULL;
+
+			case BPF_RET|BPF_K:
+				MOVid(REG_A, ins->k)
+				RETURN()
+
+				break;
+
+			case BPF_RET|BPF_A:
+				RETURN()
+
+				break;
+
+			case BPF_LD|BPF_W|BPF_ABS:
+				CHECK_ABS(ins->k, 4)
+				if (Frags)
+				{
+					MOVid(RCX, ins->k)
+					MOVid(RDX, ins->k + 4)
+					FRAG_LOAD(4)
+					MOVrd(REG_A, RCX)
+				}
+				else
+				{
+					if (ins->k <= 0x7fffffff)
+					{
+						MOVodd(REG_A, REG_PACKET, ins->k)
+					}
+					else
+					{
+						MOVid(RCX, ins->k)
+						MOVobd(REG_A, REG_PACKET, RCX)
+					}
+					BSWAP(REG_A)
+				}
+
+				break;
+
+			case BPF_LD|BPF_H|BPF_ABS:
+				CHECK_ABS(ins->k, 2)
+				if (Frags)
+				{
+					MOVid(RCX, ins->k)
+					MOVid(RDX, ins->k + 2)
+					FRAG_LOAD(2)
+					MOVrd(REG_A, RCX)
+				}
+				else
+				{
+					if (ins->k <= 0x7fffffff)
+					{
+						MOVZXodw(REG_A, REG_PACKET, ins->k)
+					}
+					else
+					{
+						MOVid(RCX, ins->k)
+						MOVZXobw(REG_A, REG_PACKET, RCX)
+					}
+					SWAPw(REG_A)
+				}
+
+				break;
+
+			case BPF_LD|BPF_B|BPF_ABS:
+				CHECK_ABS(ins->k, 1)
+				if (Frags)
+				{
+					MOVid(RCX, ins->k)
+					MOVid(RDX, ins->k + 1)
+					FRAG_LOAD(1)
+					MOVrd(REG_A, RCX)
+				}
+				else if (ins->k <= 0x7fffffff)
+				{
+					MOVZXodb(REG_A, REG_PACKET, ins->k)
+				}
+				else
+				{
+					MOVid(RCX, ins->k)
+					MOVZXobb(REG_A, REG_PACKET, RCX)
+				}
+
+				break;
+
+			case BPF_LD|BPF_W|BPF_LEN:
+				MOVrd(REG_A, REG_WIRELEN)
+
+				break;
+
+			case BPF_LDX|BPF_W|BPF_LEN:
+				MOVrd(REG_X, REG_WIRELEN)
+
+				break;
+
+			case BPF_LD|BPF_W|BPF_IND:
+				CHECK_IND(ins->k, 4)
+				if (Frags)
+				{
+					FRAG_LOAD(4)
+					MOVrd(REG_A, RCX)
+				}
+				else
+				{
+					MOVobd(REG_A, REG_PACKET, RCX)
+					BSWAP(REG_A)
+				}
+
+				break;
+
+			case BPF_LD|BPF_H|BPF_IND:
+				CHECK_IND(ins->k, 2)
+				if (Frags)
+				{
+					FRAG_LOAD(2)
+					MOVrd(REG_A, RCX)
+				}
+				else
+				{
+					MOVZXobw(REG_A, REG_PACKET, RCX)
+					SWAPw(REG_A)
+				}
+
+				break;
+
+			case BPF_LD|BPF_B|BPF_IND:
+				CHECK_IND(ins->k, 1)
+				if (Frags)
+				{
+					FRAG_LOAD(1)
+					MOVrd(REG_A, RCX)
+				}
+				else
+				{
+					MOVZXobb(REG_A, REG_PACKET, RCX)
+				}
+
+				break;
+
+			case BPF_LDX|BPF_MSH|BPF_B:
+				CHECK_ABS(ins->k, 1)
+				if (Frags)
+				{
+					MOVid(RCX, ins->k)
+					MOVid(RDX, ins->k + 1)
+					FRAG_LOAD(1)
+					MOVrd(REG_X, RCX)
+				}
+				else if (ins->k <= 0x7fffffff)
+				{
+					MOVZXodb(REG_X, REG_PACKET, ins->k)
+				}
+				else
+				{
+					MOVid(RCX, ins->k)
+					MOVZXobb(REG_X, REG_PACKET, RCX)
+				}
+				ANDid(REG_X, 0xf)
+				SHLib(REG_X, 2)
+
+				break;
+
+			case BPF_LD|BPF_IMM:
+				MOVid(REG_A, ins->k)
+
+				break;
+
+			case BPF_LDX|BPF_IMM:
+				MOVid(REG_X, ins->k)
+
+				break;
+
+			case BPF_LD|BPF_MEM:
+				if (slots[ins->k].InRegister)
+				{
+					MOVrd(REG_A, slots[ins->k].Location)
+				}
+				else
+				{
+					MOVodd(REG_A, RSP, slots[ins->k].Location)
+				}
+
+				break;
+
+			case BPF_LDX|BPF_MEM:
+				if (slots[ins->k].InRegister)
+				{
+					MOVrd(REG_X, slots[ins->k].Location)
+				}
+				else
+				{
+					MOVodd(REG_X, RSP, slots[ins->k].Location)
+				}
+
+				break;
+
+			case BPF_ST:
+				if (slots[ins->k].InRegister)
+				{
+					MOVrd(slots[ins->k].Location, REG_A)
+				}
+				else
+				{
+					MOVomd(RSP, slots[ins->k].Location, REG_A)
+				}
+
+				break;
+
+			case BPF_STX:
+				if (slots[ins->k].InRegister)
+				{
+					MOVrd(slots[ins->k].Location, REG_X)
+				}
+				else
+				{
+					MOVomd(RSP, slots[ins->k].Location, REG_X)
+				}
+
+				break;
+
+			case BPF_JMP|BPF_JA:
+				if (ins->k != 0)
+				{
+					JMP_TO(stream.refs[stream.bpf_pc + ins->k])
+				}
+
+				break;
+
+			//
+			// Like in the interpreter, the comparisons with a constant are signed
+			//
+			case BPF_JMP|BPF_JGT|BPF_K:
+				CMPid(REG_A, ins->k)
+				BRANCH(CC_G)
+
+				break;
+
+			case BPF_JMP|BPF_JGE|BPF_K:
+				CMPid(REG_A, ins->k)
+				BRANCH(CC_GE)
+
+				break;
+
+			case BPF_JMP|BPF_JEQ|BPF_K:
+				CMPid(REG_A, ins->k)
+				BRANCH(CC_E)
+
+				break;
+
+			case BPF_JMP|BPF_JSET|BPF_K:
+				TESTid(REG_A, ins->k)
+				BRANCH(CC_NE)
+
+				break;
+
+			case BPF_JMP|BPF_JGT|BPF_X:
+				CMPrd(REG_A, REG_X)
+				BRANCH(CC_A)
+
+				break;
+
+			case BPF_JMP|BPF_JGE|BPF_X:
+				CMPrd(REG_A, REG_X)
+				BRANCH(CC_AE)
+
+				break;
+
+			case BPF_JMP|BPF_JEQ|BPF_X:
+				CMPrd(REG_A, REG_X)
+				BRANCH(CC_E)
+
+				break;
+
+			case BPF_JMP|BPF_JSET|BPF_X:
+				TESTrd(REG_A, REG_X)
+				BRANCH(CC_NE)
+
+				break;
+
+			case BPF_ALU|BPF_ADD|BPF_X:
+				ADDrd(REG_A, REG_X)
+
+				break;
+
+			case BPF_ALU|BPF_SUB|BPF_X:
+				SUBrd(REG_A, REG_X)
+
+				break;
+
+			case BPF_ALU|BPF_MUL|BPF_X:
+				IMULrd(REG_A, REG_X)
+
+				break;
+
+			case BPF_ALU|BPF_DIV|BPF_X:
+				TESTrd(REG_X, REG_X)
+				JCC_REJECT(CC_E)
+				XORrd(RDX, RDX)
+				DIVrd(REG_X)
+
+				break;
+
+			case BPF_ALU|BPF_AND|BPF_X:
+				ANDrd(REG_A, REG_X)
+
+				break;
+
+			case BPF_ALU|BPF_OR|BPF_X:
+				ORrd(REG_A, REG_X)
+
+				break;
+
+			case BPF_ALU|BPF_LSH|BPF_X:
+				MOVrd(RCX, REG_X)
+				SHL_CLrb(REG_A)
+
+				break;
+
+			case BPF_ALU|BPF_RSH|BPF_X:
+				MOVrd(RCX, REG_X)
+				SHR_CLrb(REG_A)
+
+				break;
+
+			case BPF_ALU|BPF_ADD|BPF_K:
+				ADDid(REG_A, ins->k)
+
+				break;
+
+			case BPF_ALU|BPF_SUB|BPF_K:
+				SUBid(REG_A, ins->k)
+
+				break;
+
+			case BPF_ALU|BPF_MUL|BPF_K:
+				IMULid(REG_A, REG_A, ins->k)
+
+				break;
+
+			case BPF_ALU|BPF_DIV|BPF_K:
+				// bpf_validate() has already refused the division by 0
+				if ((ins->k & (ins->k - 1)) == 0)
+				{
+					for (j = 0; (1u << j) != ins->k; j++)
+						;
+					if (j != 0)
+					{
+						SHRib(REG_A, j)
+					}
+				}
+				else
+				{
+					XORrd(RDX, RDX)
+					MOVid(RCX, ins->k)
+					DIVrd(RCX)
+				}
+
+				break;
+
+			case BPF_ALU|BPF_AND|BPF_K:
+				ANDid(REG_A, ins->k)
+
+				break;
+
+			case BPF_ALU|BPF_OR|BPF_K:
+				ORid(REG_A, ins->k)
+
+				break;
+
+			case BPF_ALU|BPF_LSH|BPF_K:
+				SHLib(REG_A, (ins->k) & 255)
+
+				break;
+
+			case BPF_ALU|BPF_RSH|BPF_K:
+				SHRib(REG_A, (ins->k) & 255)
+
+				break;
+
+			case BPF_ALU|BPF_NEG:
+				NEGd(REG_A)
+
+				break;
+
+			case BPF_MISC|BPF_TAX:
+				MOVrd(REG_X, REG_A)
+
+				break;
+
+			case BPF_MISC|BPF_TXA:
+				MOVrd(REG_A, REG_X)
+
+				break;
+
+			case BPF_MISC|BPF_MATCH:
+				// A = bpf_match(k, packet, buflen, X, A), or bpf_match_frags() with the array of fragments
+				for (j = 0; j < STUB_SAVED_REGISTERS; j++)
+				{
+					PUSH(StubSavedRegisters[j])
+				}
+				SUBiq(RSP, MatchFrame)
+
+				off = (INT)(MatchFrame + 8 * STUB_SAVED_REGISTERS + FragsSlot);
+#ifdef _WIN32
+				if (Frags)
+				{
+					MOVodq(RDX, RSP, off)
+				}
+				else
+				{
+					MOVrq(RDX, REG_PACKET)
+				}
+				MOVrd(R8, REG_BUFLEN)
+				MOVrd(R9, REG_X)
+				MOVomd(RSP, 32, REG_A)
+				MOVid(RCX, ins->k)
+#else
+				if (Frags)
+				{
+					MOVodq(RSI, RSP, off)
+				}
+				else
+				{
+					MOVrq(RSI, REG_PACKET)
+				}
+				MOVrd(RDX, REG_BUFLEN)
+				MOVrd(RCX, REG_X)
+				MOVrd(R8, REG_A)
+				MOVid(RDI, ins->k)
+#endif
+				MOViq(RAX, Frags ? (ULONG_PTR)bpf_match_frags : (ULONG_PTR)bpf_match)
+				CALLr(RAX)
+				MOVrd(RCX, RAX)
+
+				ADDiq(RSP, MatchFrame)
+				for (j = STUB_SAVED_REGISTERS; j > 0; j--)
+				{
+					POP(StubSavedRegisters[j - 1])
+				}
+				MOVrd(REG_A, RCX)
+
+				break;
+			}
+
+			ins++;
+		}
+
+		// Shared exit of the failed bounds checks and divisions by zero
+		stream.bpf_pc++;
+		XORrd(REG_A, REG_A)
+		if (Mode == JIT_MODE_BATCH)
+		{
+			// Store the verdict, advance to the next packet and loop, the exit follows
+			stream.bpf_pc++;
+			MOVodq(RCX, RSP, VerdictsSlot)
+			MOVomd(RCX, 0, REG_A)
+			ADDiq(RCX, 4)
+			MOVomq(RSP, VerdictsSlot, RCX)
+			MOVodq(RCX, RSP, PacketsSlot)
+			ADDiq(RCX, sizeof(struct bpf_packet))
+			MOVomq(RSP, PacketsSlot, RCX)
+			MOVodd(RCX, RSP, CountSlot)
+			SUBid(RCX, 1)
+			MOVomd(RSP, CountSlot, RCX)
+			JCC_TO(CC_NE, LoopHead, 6)
+
+			stream.bpf_pc++;
+		}
+		EPILOGUE()
+
+		if (Frags)
+		{
+			// The stubs: k in ecx, the value is returned in ecx
+			for (i = 0; i < FRAG_STUBS; i++)
+			{
+				stream.bpf_pc++;
+
+				for (j = 0; j < STUB_SAVED_REGISTERS; j++)
+				{
+					PUSH(StubSavedRegisters[j])
+				}
+				SUBiq(RSP, StubFrame)
+
+				// Above the stub frame: the saved registers, the return address and the frame of the function
+				off = (INT)(StubFrame + 8 * STUB_SAVED_REGISTERS + 8 + FragsSlot);
+#ifdef _WIN32
+				MOVrd(RDX, RCX)
+				MOVodq(RCX, RSP, off)
+				MOVid(R8, i == 0 ? 4 : i == 1 ? 2 : 1)
+#else
+				MOVrd(RSI, RCX)
+				MOVodq(RDI, RSP, off)
+				MOVid(RDX, i == 0 ? 4 : i == 1 ? 2 : 1)
+#endif
+				MOViq(RAX, (ULONG_PTR)bpf_frag_load)
+				CALLr(RAX)
+				MOVrd(RCX, RAX)
+
+				ADDiq(RSP, StubFrame)
+				for (j = STUB_SAVED_REGISTERS; j > 0; j--)
+				{
+					POP(StubSavedRegisters[j - 1])
+				}
+				RET()
+			}
+		}
+
+		pass++;
+		if (pass == 2)
+			break;
+
+		stream.ibuf = jit_alloc_code(stream.cur_ip);
+		if (stream.ibuf == NULL)
+		{
+#ifdef NTKERNEL
+			ExFreePool(stream.refs);
+#else
+			free(stream.refs);
+#endif
+			return NULL;
+		}
+
+		// modify the reference table to contain the offsets and not the lengths of the instructions
+		for (i = 1; i < nrefs; i++)
+			stream.refs[i] += stream.refs[i - 1];
+
+		// Reset the counters
+		stream.cur_ip = 0;
+		stream.bpf_pc = 0;
+		// the second pass creates the actual code
+		emitm = emit_code;
+	}
+
+	// the reference table is needed only during compilation, now we can free it
+#ifdef NTKERNEL
+	ExFreePool(stream.refs);
+#else
+	free(stream.refs);
+#endif
+
+	if (!jit_seal_code(stream.ibuf, stream.cur_ip))
+	{
+		jit_free_code(stream.ibuf);
+		return NULL;
+	}
+
+	return (PVOID)stream.ibuf;
+}
+
+
+JIT_BPF_Filter* BPF_jitter(struct bpf_insn* fp, INT nins)
+{
+	JIT_BPF_Filter* Filter;
+
+	// Allocate the filter structure
+#ifdef NTKERNEL
+	Filter = (struct JIT_BPF_Filter *)ExAllocatePoolWithTag(NonPagedPool, sizeof(struct JIT_BPF_Filter), '2JWA');
+#else
+	Filter = (struct JIT_BPF_Filter *)malloc(sizeof(struct JIT_BPF_Filter));
+#endif
+	if (Filter == NULL)
+	{
+		return NULL;
+	}
+
+	// Create the binaries
+	if ((Filter->Function = (BPF_filter_function)BPFtoX64(fp, nins, JIT_MODE_PACKET)) == NULL)
+	{
+#ifdef NTKERNEL
+		ExFreePool(Filter);
+#else
+		free(Filter);
+#endif
+		return NULL;
+	}
+
+	if ((Filter->FragsFunction = (BPF_frags_function)BPFtoX64(fp, nins, JIT_MODE_FRAGS)) == NULL)
+	{
+		jit_free_code((PCHAR)Filter->Function);
+#ifdef NTKERNEL
+		ExFreePool(Filter);
+#else
+		free(Filter);
+#endif
+		return NULL;
+	}
+
+	if ((Filter->BatchFunction = (BPF_batch_function)BPFtoX64(fp, nins, JIT_MODE_BATCH)) == NULL)
+	{
+		jit_free_code((PCHAR)Filter->FragsFunction);
+		jit_free_code((PCHAR)Filter->Function);
+#ifdef NTKERNEL
+		ExFreePool(Filter);
+#else
+		free(Filter);
+#endif
+		return NULL;
+	}
+
+	return Filter;
+}
+
+//////////////////////////////////////////////////////////////
+
+void BPF_Destroy_JIT_Filter(JIT_BPF_Filter* Filter)
+{
+	jit_free_code((PCHAR)Filter->Function);
+	jit_free_code((PCHAR)Filter->FragsFunction);
+	jit_free_code((PCHAR)Filter->BatchFunction);
+#ifdef NTKERNEL
+	ExFreePool(Filter);
+#else
+	free(Filter);
+#endif
+}
+
+#endif // _AMD64_
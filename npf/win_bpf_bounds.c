@@ -0,0 +1,163 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Bounds analysis of the filtering programs, run at install time after the validation.
+ *
+ * Instead of checking buflen at every absolute packet load, the decoded interpreter and
+ * the jitter check it at the few places computed here, once for the loads of many
+ * instructions.
+ *
+ * A backward pass computes, for each instruction, the packet length that every path
+ * starting there needs: the farthest absolute load on the path, or no limit at all for
+ * the paths that end with "ret #0", as they reject the packet anyway. If buflen is
+ * smaller, bpf_filter() would return 0 from that instruction whatever the path, so the
+ * check can be done there with the same result. A forward pass then computes the length
+ * already verified on every path reaching an instruction, and places a check, for that
+ * whole length, only at the loads that go farther: typically the first one.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_bpf.h"
+
+#ifdef WIN_NT_DRIVER
+#define BOUNDS_ALLOC(_size)	ExAllocatePoolWithTag(NonPagedPool, (_size), '2BWA')
+#define BOUNDS_FREE(_ptr)	ExFreePool(_ptr)
+#else
+#define BOUNDS_ALLOC(_size)	malloc(_size)
+#define BOUNDS_FREE(_ptr)	free(_ptr)
+#endif
+
+#define BOUNDS_ANY			0xffffffff	///< Any length is fine (or no path is known yet)
+
+/*
+ * End of the packet data read by an absolute load, 0 if the instruction is not one or if
+ * the end overflows: those loads always reject the packet, and keep their own check.
+ * The ancillary loads read no packet data.
+ */
+static u_int32 bounds_end(struct bpf_insn* p)
+{
+	u_int32 size;
+
+	switch (p->code)
+	{
+	case BPF_LD|BPF_W|BPF_ABS:
+		size = 4;
+		break;
+	case BPF_LD|BPF_H|BPF_ABS:
+		size = 2;
+		break;
+	case BPF_LD|BPF_B|BPF_ABS:
+	case BPF_LDX|BPF_MSH|BPF_B:
+		size = 1;
+		break;
+	default:
+		return 0;
+	}
+
+	if (p->k > 0xffffffff - size || BPF_IS_ANCILLARY(p->code, p->k))
+		return 0;
+
+	return p->k + size;
+}
+
+#define BOUNDS_MIN(_a, _b)	((_a) < (_b) ? (_a) : (_b))
+#define BOUNDS_MEET(_t, _v)	known[_t] = BOUNDS_MIN(known[_t], (_v))
+
+int bpf_validate_bounds(struct bpf_insn* f, int len, u_int32* checks)
+{
+	struct bpf_insn* p;
+	u_int32* known;
+	u_int32 need, end;
+	int i;
+
+	if (len < 1)
+		return FALSE;
+
+	known = (u_int32*)BOUNDS_ALLOC(len * sizeof(u_int32));
+	if (known == NULL)
+		return FALSE;
+
+	// Backward: the length needed by all the paths starting at each instruction
+	for (i = len - 1; i >= 0; i--)
+	{
+		p = &f[i];
+
+		switch (BPF_CLASS(p->code))
+		{
+		case BPF_RET:
+			need = (p->code == (BPF_RET|BPF_K) && p->k == 0) ? BOUNDS_ANY : 0;
+			break;
+
+		case BPF_JMP:
+			if (p->code == (BPF_JMP|BPF_JA))
+				need = checks[i + 1 + p->k];
+			else
+				need = BOUNDS_MIN(checks[i + 1 + p->jt], checks[i + 1 + p->jf]);
+			break;
+
+		default:
+			// bpf_validate() guarantees that the last instruction is a return
+			need = checks[i + 1];
+			end = bounds_end(p);
+			if (end > need)
+				need = end;
+			break;
+		}
+
+		checks[i] = need;
+	}
+
+	// Forward: the length already verified on all the paths reaching each instruction
+	for (i = 0; i < len; i++)
+		known[i] = BOUNDS_ANY;
+	known[0] = 0;
+
+	for (i = 0; i < len; i++)
+	{
+		p = &f[i];
+
+		// Unreached instructions have known[i] == BOUNDS_ANY, and no check either
+		end = bounds_end(p);
+		if (end > known[i])
+			known[i] = checks[i];
+		else
+			checks[i] = 0;
+
+		switch (BPF_CLASS(p->code))
+		{
+		case BPF_RET:
+			break;
+
+		case BPF_JMP:
+			if (p->code == (BPF_JMP|BPF_JA))
+			{
+				BOUNDS_MEET(i + 1 + p->k, known[i]);
+			}
+			else
+			{
+				BOUNDS_MEET(i + 1 + p->jt, known[i]);
+				BOUNDS_MEET(i + 1 + p->jf, known[i]);
+			}
+			break;
+
+		default:
+			BOUNDS_MEET(i + 1, known[i]);
+			break;
+		}
+	}
+
+	BOUNDS_FREE(known);
+
+	return TRUE;
+}
@@ -0,0 +1,625 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Pre-decoded interpreter, used where the JIT compiler is not available.
+ *
+ * bpf_decode() turns a validated program, once, into an array of instructions with a
+ * dense opcode and the jump targets resolved into pointers. The bounds of the absolute
+ * packet loads are verified by the few CHECK instructions that bpf_validate_bounds()
+ * asks for, inserted before the instructions they belong to, and not by the loads.
+ * bpf_filter_decoded_batch() runs the result on a vector of packets, and
+ * bpf_filter_decoded() on one, with threaded dispatch (each handler jumps directly to
+ * the next one) when the compiler supports computed gotos, with a switch on the dense
+ * opcode otherwise, and only zeroes the scratch memory words that the program can read
+ * before writing them.
+ *
+ * The results are exactly those of bpf_filter().
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_bpf.h"
+
+#ifdef WIN_NT_DRIVER
+#define DECODE_ALLOC(_size)	ExAllocatePoolWithTag(NonPagedPool, (_size), '1BWA')
+#define DECODE_FREE(_ptr)	ExFreePool(_ptr)
+#else
+#define DECODE_ALLOC(_size)	malloc(_size)
+#define DECODE_FREE(_ptr)	free(_ptr)
+#endif
+
+#if defined(__GNUC__)
+#define BPF_THREADED_DISPATCH	///< Computed gotos are available (GCC and clang)
+#endif
+
+#define EXTRACT_SHORT(p)\
+		((((u_short)(((u_char*)p)[0])) << 8) |\
+		 (((u_short)(((u_char*)p)[1])) << 0))
+
+#define EXTRACT_LONG(p)\
+		((((u_int32)(((u_char*)p)[0])) << 24) |\
+		 (((u_int32)(((u_char*)p)[1])) << 16) |\
+		 (((u_int32)(((u_char*)p)[2])) << 8 ) |\
+		 (((u_int32)(((u_char*)p)[3])) << 0 ))
+
+/*
+ * The decoded opcodes. CHECK verifies that buflen is at least K, REJECT stands for the
+ * instructions that always reject the packet, i.e. the packet loads whose end overflows.
+ * LD_AD is an ancillary load, K is the offset of the field in the metadata.
+ */
+#define BPF_DECODED_OPS(_)												\
+	_(RET_K) _(RET_A)													\
+	_(LD_W_ABS) _(LD_H_ABS) _(LD_B_ABS) _(LD_AD)							\
+	_(LD_W_IND) _(LD_H_IND) _(LD_B_IND)									\
+	_(LD_LEN) _(LDX_LEN) _(LD_IMM) _(LDX_IMM) _(LD_MEM) _(LDX_MEM)		\
+	_(LDX_MSH) _(ST) _(STX)												\
+	_(ADD_K) _(SUB_K) _(MUL_K) _(DIV_K) _(AND_K) _(OR_K) _(LSH_K) _(RSH_K)	\
+	_(ADD_X) _(SUB_X) _(MUL_X) _(DIV_X) _(AND_X) _(OR_X) _(LSH_X) _(RSH_X)	\
+	_(NEG) _(TAX) _(TXA) _(MATCH)										\
+	_(JA) _(JGT_K) _(JGE_K) _(JEQ_K) _(JSET_K)							\
+	_(JGT_X) _(JGE_X) _(JEQ_X) _(JSET_X)								\
+	_(CHECK) _(REJECT)
+
+#define DOP_ENUM(_name) DOP_##_name,
+
+enum bpf_decoded_op
+{
+	BPF_DECODED_OPS(DOP_ENUM)
+	DOP_COUNT
+};
+
+/*!
+  \brief A decoded instruction.
+*/
+struct bpf_decoded_insn
+{
+	u_int32 Op;		///< One of the bpf_decoded_op
+	u_int32 K;		///< k of the original instruction
+	struct bpf_decoded_insn* True;	///< Jumps: destination if the condition is true, or of an unconditional jump
+	struct bpf_decoded_insn* False;	///< Jumps: destination if the condition is false
+};
+
+/*!
+  \brief A decoded program, as returned by bpf_decode().
+*/
+struct bpf_decoded_program
+{
+	u_int32 MemMask;	///< Scratch memory words that can be read before being written, bit n for mem[n]
+	u_int32 Length;		///< Number of instructions
+	struct bpf_decoded_insn Insns[1];
+};
+
+//-------------------------------------------------------------------
+
+static int decode_op(struct bpf_insn* p, struct bpf_decoded_insn* d)
+{
+	u_int size = 0;
+
+	switch (p->code)
+	{
+	case BPF_RET|BPF_K:				d->Op = DOP_RET_K; break;
+	case BPF_RET|BPF_A:				d->Op = DOP_RET_A; break;
+	case BPF_LD|BPF_W|BPF_ABS:		d->Op = DOP_LD_W_ABS; size = 4; break;
+	case BPF_LD|BPF_H|BPF_ABS:		d->Op = DOP_LD_H_ABS; size = 2; break;
+	case BPF_LD|BPF_B|BPF_ABS:		d->Op = DOP_LD_B_ABS; size = 1; break;
+	case BPF_LD|BPF_W|BPF_IND:		d->Op = DOP_LD_W_IND; break;
+	case BPF_LD|BPF_H|BPF_IND:		d->Op = DOP_LD_H_IND; break;
+	case BPF_LD|BPF_B|BPF_IND:		d->Op = DOP_LD_B_IND; break;
+	case BPF_LD|BPF_W|BPF_LEN:		d->Op = DOP_LD_LEN; break;
+	case BPF_LDX|BPF_W|BPF_LEN:		d->Op = DOP_LDX_LEN; break;
+	case BPF_LD|BPF_IMM:			d->Op = DOP_LD_IMM; break;
+	case BPF_LDX|BPF_IMM:			d->Op = DOP_LDX_IMM; break;
+	case BPF_LD|BPF_MEM:			d->Op = DOP_LD_MEM; break;
+	case BPF_LDX|BPF_MEM:			d->Op = DOP_LDX_MEM; break;
+	case BPF_LDX|BPF_MSH|BPF_B:		d->Op = DOP_LDX_MSH; size = 1; break;
+	case BPF_ST:					d->Op = DOP_ST; break;
+	case BPF_STX:					d->Op = DOP_STX; break;
+	case BPF_ALU|BPF_ADD|BPF_K:		d->Op = DOP_ADD_K; break;
+	case BPF_ALU|BPF_SUB|BPF_K:		d->Op = DOP_SUB_K; break;
+	case BPF_ALU|BPF_MUL|BPF_K:		d->Op = DOP_MUL_K; break;
+	case BPF_ALU|BPF_DIV|BPF_K:		d->Op = DOP_DIV_K; break;
+	case BPF_ALU|BPF_AND|BPF_K:		d->Op = DOP_AND_K; break;
+	case BPF_ALU|BPF_OR|BPF_K:		d->Op = DOP_OR_K; break;
+	case BPF_ALU|BPF_LSH|BPF_K:		d->Op = DOP_LSH_K; break;
+	case BPF_ALU|BPF_RSH|BPF_K:		d->Op = DOP_RSH_K; break;
+	case BPF_ALU|BPF_ADD|BPF_X:		d->Op = DOP_ADD_X; break;
+	case BPF_ALU|BPF_SUB|BPF_X:		d->Op = DOP_SUB_X; break;
+	case BPF_ALU|BPF_MUL|BPF_X:		d->Op = DOP_MUL_X; break;
+	case BPF_ALU|BPF_DIV|BPF_X:		d->Op = DOP_DIV_X; break;
+	case BPF_ALU|BPF_AND|BPF_X:		d->Op = DOP_AND_X; break;
+	case BPF_ALU|BPF_OR|BPF_X:		d->Op = DOP_OR_X; break;
+	case BPF_ALU|BPF_LSH|BPF_X:		d->Op = DOP_LSH_X; break;
+	case BPF_ALU|BPF_RSH|BPF_X:		d->Op = DOP_RSH_X; break;
+	case BPF_ALU|BPF_NEG:			d->Op = DOP_NEG; break;
+	case BPF_MISC|BPF_TAX:			d->Op = DOP_TAX; break;
+	case BPF_MISC|BPF_TXA:			d->Op = DOP_TXA; break;
+	case BPF_MISC|BPF_MATCH:		d->Op = DOP_MATCH; break;
+	case BPF_JMP|BPF_JA:			d->Op = DOP_JA; break;
+	case BPF_JMP|BPF_JGT|BPF_K:		d->Op = DOP_JGT_K; break;
+	case BPF_JMP|BPF_JGE|BPF_K:		d->Op = DOP_JGE_K; break;
+	case BPF_JMP|BPF_JEQ|BPF_K:		d->Op = DOP_JEQ_K; break;
+	case BPF_JMP|BPF_JSET|BPF_K:	d->Op = DOP_JSET_K; break;
+	case BPF_JMP|BPF_JGT|BPF_X:		d->Op = DOP_JGT_X; break;
+	case BPF_JMP|BPF_JGE|BPF_X:		d->Op = DOP_JGE_X; break;
+	case BPF_JMP|BPF_JEQ|BPF_X:		d->Op = DOP_JEQ_X; break;
+	case BPF_JMP|BPF_JSET|BPF_X:	d->Op = DOP_JSET_X; break;
+	default:
+		// The TME extensions are left to bpf_filter()
+		return FALSE;
+	}
+
+	d->K = p->k;
+
+	if (BPF_IS_ANCILLARY(p->code, p->k))
+	{
+		d->Op = DOP_LD_AD;
+		d->K = p->k - BPF_AD_OFF;
+		return TRUE;
+	}
+
+	// The others are verified by the CHECK instructions
+	if (size != 0 && p->k > 0xffffffff - size)
+		d->Op = DOP_REJECT;
+
+	return TRUE;
+}
+
+/*
+ * Computes which scratch memory words can be read before being written on some path.
+ * written[i] is scratch space for len entries.
+ */
+static u_int32 decode_mem_mask(struct bpf_insn* f, u_int len, u_int32* written)
+{
+	struct bpf_insn* p;
+	u_int32 out, mask = 0;
+	u_int i;
+
+#define REACHED 0x80000000
+#define MEET(_t, _w) written[_t] = (written[_t] & REACHED) ? (written[_t] & ((_w) | REACHED)) : ((_w) | REACHED)
+
+	RtlZeroMemory(written, len * sizeof(u_int32));
+	written[0] = REACHED;
+
+	for (i = 0; i < len; i++)
+	{
+		p = &f[i];
+
+		if (!(written[i] & REACHED))
+			continue;
+
+		out = written[i] & ~REACHED;
+
+		switch (BPF_CLASS(p->code))
+		{
+		case BPF_RET:
+			continue;
+
+		case BPF_JMP:
+			if (p->code == (BPF_JMP|BPF_JA))
+			{
+				MEET(i + 1 + p->k, out);
+			}
+			else
+			{
+				MEET(i + 1 + p->jt, out);
+				MEET(i + 1 + p->jf, out);
+			}
+			continue;
+
+		case BPF_ST:
+		case BPF_STX:
+			out |= 1 << p->k;
+			break;
+
+		case BPF_LD:
+		case BPF_LDX:
+			if (BPF_MODE(p->code) == BPF_MEM && !(out & (1 << p->k)))
+				mask |= 1 << p->k;
+			break;
+		}
+
+		MEET(i + 1, out);
+	}
+
+#undef MEET
+#undef REACHED
+
+	return mask;
+}
+
+struct bpf_decoded_program* bpf_decode(struct bpf_insn* f, int len)
+{
+	struct bpf_decoded_program* prog;
+	struct bpf_decoded_insn* d;
+	struct bpf_decoded_insn tmp;
+	u_int32* checks;
+	u_int32* pos;
+	u_int i, jt, jf, ninsns;
+
+	if (len < 1 || len > BPF_MAXINSNS)
+		return NULL;
+
+	// bpf_validate() has already checked the jumps, but a wrong target here is fatal
+	for (i = 0; i < (u_int)len; i++)
+	{
+		if (!decode_op(&f[i], &tmp))
+			return NULL;
+
+		if (f[i].code == (BPF_JMP|BPF_JA))
+		{
+			if (f[i].k >= (u_int)len - i - 1)
+				return NULL;
+		}
+		else if (BPF_CLASS(f[i].code) == BPF_JMP)
+		{
+			if (i + 1 + f[i].jt >= (u_int)len || i + 1 + f[i].jf >= (u_int)len)
+				return NULL;
+		}
+	}
+
+	if (BPF_CLASS(f[len - 1].code) != BPF_RET)
+		return NULL;
+
+	checks = (u_int32*)DECODE_ALLOC(2 * len * sizeof(u_int32));
+	if (checks == NULL)
+		return NULL;
+	pos = checks + len;
+
+	if (!bpf_validate_bounds(f, len, checks))
+	{
+		DECODE_FREE(checks);
+		return NULL;
+	}
+
+	// Where each instruction goes, after the CHECK that precedes it if any
+	for (i = 0, ninsns = 0; i < (u_int)len; i++)
+	{
+		pos[i] = ninsns;
+		ninsns += (checks[i] != 0) ? 2 : 1;
+	}
+
+	prog = (struct bpf_decoded_program*)DECODE_ALLOC(sizeof(struct bpf_decoded_program) + (ninsns - 1) * sizeof(struct bpf_decoded_insn));
+	if (prog == NULL)
+	{
+		DECODE_FREE(checks);
+		return NULL;
+	}
+
+	prog->Length = ninsns;
+
+	for (i = 0, d = prog->Insns; i < (u_int)len; i++, d++)
+	{
+		// The jumps land on the CHECK, so that it is done on all the paths
+		if (checks[i] != 0)
+		{
+			d->Op = DOP_CHECK;
+			d->K = checks[i];
+			d++;
+		}
+
+		decode_op(&f[i], d);
+
+		if (BPF_CLASS(f[i].code) != BPF_JMP)
+			continue;
+
+		if (f[i].code == (BPF_JMP|BPF_JA))
+			jt = jf = i + 1 + f[i].k;
+		else
+		{
+			jt = i + 1 + f[i].jt;
+			jf = i + 1 + f[i].jf;
+		}
+
+		d->True = &prog->Insns[pos[jt]];
+		d->False = &prog->Insns[pos[jf]];
+	}
+
+	// The scratch space is not needed anymore
+	prog->MemMask = decode_mem_mask(f, (u_int)len, checks);
+	DECODE_FREE(checks);
+
+	return prog;
+}
+
+void bpf_free_decoded(struct bpf_decoded_program* prog)
+{
+	DECODE_FREE(prog);
+}
+
+//-------------------------------------------------------------------
+
+//
+// The conditional jumps dispatch separately on each side, so that the compiler keeps a
+// predictable branch instead of selecting the destination with a conditional move
+//
+#ifdef BPF_THREADED_DISPATCH
+
+#define DOP_LABEL(_name) &&L_##_name,
+
+#define DISPATCH_BEGIN()	goto *labels[pc->Op];
+#define DISPATCH_END()
+#define HANDLER(_name)		L_##_name:
+#define NEXT()				pc++; goto *labels[pc->Op]
+#define JUMP()				pc = pc->True; goto *labels[pc->Op]
+#define BRANCH(_cond)		if (_cond) { JUMP(); } pc = pc->False; goto *labels[pc->Op]
+
+#else // BPF_THREADED_DISPATCH
+
+#define DISPATCH_BEGIN()	for (;;) { switch (pc->Op) {
+#define DISPATCH_END()		default: RETURN(0); } }
+#define HANDLER(_name)		case DOP_##_name:
+#define NEXT()				pc++; continue
+#define JUMP()				pc = pc->True; continue
+#define BRANCH(_cond)		if (_cond) { JUMP(); } pc = pc->False; continue
+
+#endif // BPF_THREADED_DISPATCH
+
+/// Verdict of the current packet, the batch goes on with the next one
+#define RETURN(_v)			do { verdicts[i] = (_v); goto packet_done; } while (0)
+
+void bpf_filter_decoded_batch(struct bpf_decoded_program* prog, struct bpf_packet* pkts, u_int count, u_int* verdicts)
+{
+#ifdef BPF_THREADED_DISPATCH
+	static const void* const labels[DOP_COUNT] = { BPF_DECODED_OPS(DOP_LABEL) };
+#endif
+	struct bpf_decoded_insn* pc;
+	struct bpf_meta* meta;
+	u_char* p;
+	u_int wirelen, buflen;
+	u_int32 A, X;
+	u_int32 k, mask;
+	u_int32 mem[BPF_MEMWORDS];
+	u_int i;
+
+	if (prog == NULL)
+	{
+		for (i = 0; i < count; i++)
+			verdicts[i] = (u_int)-1;
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		p = pkts[i].data;
+		wirelen = pkts[i].wirelen;
+		buflen = pkts[i].buflen;
+		meta = pkts[i].meta;
+		A = 0;
+		X = 0;
+
+		for (mask = prog->MemMask, k = 0; mask != 0; mask >>= 1, k++)
+		{
+			if (mask & 1)
+				mem[k] = 0;
+		}
+
+		pc = prog->Insns;
+
+		DISPATCH_BEGIN()
+
+		HANDLER(RET_K)
+			RETURN((u_int)pc->K);
+
+		HANDLER(RET_A)
+			RETURN((u_int)A);
+
+		HANDLER(LD_W_ABS)
+			A = EXTRACT_LONG(&p[pc->K]);
+			NEXT();
+
+		HANDLER(LD_H_ABS)
+			A = EXTRACT_SHORT(&p[pc->K]);
+			NEXT();
+
+		HANDLER(LD_B_ABS)
+			A = p[pc->K];
+			NEXT();
+
+		HANDLER(LD_AD)
+			A = BPF_AD_LOAD(meta, pc->K);
+			NEXT();
+
+		HANDLER(LD_W_IND)
+			k = X + pc->K;
+			if (k >= buflen || k + sizeof(int) > buflen)
+				RETURN(0);
+			A = EXTRACT_LONG(&p[k]);
+			NEXT();
+
+		HANDLER(LD_H_IND)
+			k = X + pc->K;
+			if (k >= buflen || k + sizeof(short) > buflen)
+				RETURN(0);
+			A = EXTRACT_SHORT(&p[k]);
+			NEXT();
+
+		HANDLER(LD_B_IND)
+			k = X + pc->K;
+			if (k >= buflen)
+				RETURN(0);
+			A = p[k];
+			NEXT();
+
+		HANDLER(LD_LEN)
+			A = wirelen;
+			NEXT();
+
+		HANDLER(LDX_LEN)
+			X = wirelen;
+			NEXT();
+
+		HANDLER(LD_IMM)
+			A = pc->K;
+			NEXT();
+
+		HANDLER(LDX_IMM)
+			X = pc->K;
+			NEXT();
+
+		HANDLER(LD_MEM)
+			A = mem[pc->K];
+			NEXT();
+
+		HANDLER(LDX_MEM)
+			X = mem[pc->K];
+			NEXT();
+
+		HANDLER(LDX_MSH)
+			X = (p[pc->K] & 0xf) << 2;
+			NEXT();
+
+		HANDLER(ST)
+			mem[pc->K] = A;
+			NEXT();
+
+		HANDLER(STX)
+			mem[pc->K] = X;
+			NEXT();
+
+		HANDLER(ADD_K)
+			A += pc->K;
+			NEXT();
+
+		HANDLER(SUB_K)
+			A -= pc->K;
+			NEXT();
+
+		HANDLER(MUL_K)
+			A *= pc->K;
+			NEXT();
+
+		HANDLER(DIV_K)
+			A /= pc->K;
+			NEXT();
+
+		HANDLER(AND_K)
+			A &= pc->K;
+			NEXT();
+
+		HANDLER(OR_K)
+			A |= pc->K;
+			NEXT();
+
+		HANDLER(LSH_K)
+			A <<= pc->K;
+			NEXT();
+
+		HANDLER(RSH_K)
+			A >>= pc->K;
+			NEXT();
+
+		HANDLER(ADD_X)
+			A += X;
+			NEXT();
+
+		HANDLER(SUB_X)
+			A -= X;
+			NEXT();
+
+		HANDLER(MUL_X)
+			A *= X;
+			NEXT();
+
+		HANDLER(DIV_X)
+			if (X == 0)
+				RETURN(0);
+			A /= X;
+			NEXT();
+
+		HANDLER(AND_X)
+			A &= X;
+			NEXT();
+
+		HANDLER(OR_X)
+			A |= X;
+			NEXT();
+
+		HANDLER(LSH_X)
+			A <<= X;
+			NEXT();
+
+		HANDLER(RSH_X)
+			A >>= X;
+			NEXT();
+
+		HANDLER(NEG)
+			A = (u_int32)-((int)A);
+			NEXT();
+
+		HANDLER(TAX)
+			X = A;
+			NEXT();
+
+		HANDLER(TXA)
+			A = X;
+			NEXT();
+
+		HANDLER(MATCH)
+			A = bpf_match(pc->K, p, buflen, X, A);
+			NEXT();
+
+		HANDLER(JA)
+			JUMP();
+
+		HANDLER(JGT_K)
+			BRANCH((int)A > (int)pc->K);
+
+		HANDLER(JGE_K)
+			BRANCH((int)A >= (int)pc->K);
+
+		HANDLER(JEQ_K)
+			BRANCH(A == pc->K);
+
+		HANDLER(JSET_K)
+			BRANCH(A & pc->K);
+
+		HANDLER(JGT_X)
+			BRANCH(A > X);
+
+		HANDLER(JGE_X)
+			BRANCH(A >= X);
+
+		HANDLER(JEQ_X)
+			BRANCH(A == X);
+
+		HANDLER(JSET_X)
+			BRANCH(A & X);
+
+		HANDLER(CHECK)
+			if (buflen < pc->K)
+				RETURN(0);
+			NEXT();
+
+		HANDLER(REJECT)
+			RETURN(0);
+
+		DISPATCH_END()
+
+packet_done:
+		;
+	}
+}
+
+u_int bpf_filter_decoded(struct bpf_decoded_program* prog, u_char* p, u_int wirelen, u_int buflen, struct bpf_meta* meta)
+{
+	struct bpf_packet pkt;
+	u_int verdict;
+
+	pkt.data = p;
+	pkt.wirelen = wirelen;
+	pkt.buflen = buflen;
+	pkt.meta = meta;
+	bpf_filter_decoded_batch(prog, &pkt, 1, &verdict);
+
+	return verdict;
+}
@@ -4,7 +4,7 @@
  * COPYING.WinPcap within this package.
  */
 
-#if !defined (_WINDLL) && !defined(_WINLIB)
+#if !defined (_WINDLL) && !defined(_WINLIB) && !defined(NPF_HOST_BUILD)
 #include "stdafx.h"
 #endif
 
@@ -14,9 +14,10 @@
 #include <ndis.h>
 #endif
 
+#ifdef _MSC_VER
 #pragma warning(disable : 4131) //old style function declaration
 #pragma warning(disable : 4127) // conditional expr is constant (used for while(1) loops)
-#pragma warning(disable : 4213) //cast on l-value
+#endif
 
 #ifndef UNUSED
 #define UNUSED(_x) (_x)
@@ -48,11 +49,12 @@ PMEM_TYPE mem_ex;
 PTME_CORE tme;
 struct time_conv* time_ref;
 #else  //HAVE_BUGGY_TME_SUPPORT
-u_int bpf_filter(pc, p, wirelen, buflen)
+u_int bpf_filter_meta(pc, p, wirelen, buflen, meta)
 register struct bpf_insn * pc;
 register u_char* p;
 u_int wirelen;
 register u_int buflen;
+struct bpf_meta* meta;
 #endif //HAVE_BUGGY_TME_SUPPORT
 {
 	register u_int32 A, X;
@@ -61,6 +63,7 @@ register u_int buflen;
 #ifdef HAVE_BUGGY_TME_SUPPORT
 	u_int32 j, tmp;
 	u_short tmp2;
+	struct bpf_meta* meta = NULL;
 #endif //HAVE_BUGGY_TME_SUPPORT
 
 	int mem[BPF_MEMWORDS];
@@ -89,10 +92,18 @@ register u_int buflen;
 		case BPF_RET|BPF_A:
 			return (u_int)A;
 
+		//
+		// The ancillary loads are out of any packet: they are looked for only when the bounds check fails
+		//
 		case BPF_LD|BPF_W|BPF_ABS:
 			k = pc->k;
 			if (k >= buflen || k + sizeof(int) > buflen)
 			{
+				if (BPF_IS_ANCILLARY(pc->code, k))
+				{
+					A = BPF_AD_LOAD(meta, k - BPF_AD_OFF);
+					continue;
+				}
 				return 0;
 			}
 			A = EXTRACT_LONG(&p[k]);
@@ -102,6 +113,11 @@ register u_int buflen;
 			k = pc->k;
 			if (k >= buflen || k + sizeof(short) > buflen)
 			{
+				if (BPF_IS_ANCILLARY(pc->code, k))
+				{
+					A = BPF_AD_LOAD(meta, k - BPF_AD_OFF);
+					continue;
+				}
 				return 0;
 			}
 			A = EXTRACT_SHORT(&p[k]);
@@ -111,6 +127,11 @@ register u_int buflen;
 			k = pc->k;
 			if (k >= buflen)
 			{
+				if (BPF_IS_ANCILLARY(pc->code, k))
+				{
+					A = BPF_AD_LOAD(meta, k - BPF_AD_OFF);
+					continue;
+				}
 				return 0;
 			}
 			A = p[k];
@@ -402,7 +423,7 @@ register u_int buflen;
 			continue;
 
 		case BPF_ALU|BPF_NEG:
-			(int)A = -((int)A);
+			A = (u_int32)-((int)A);
 			continue;
 
 		case BPF_MISC|BPF_TAX:
@@ -413,6 +434,10 @@ register u_int buflen;
 			A = X;
 			continue;
 
+		case BPF_MISC|BPF_MATCH:
+			A = bpf_match(pc->k, p, buflen, X, A);
+			continue;
+
 #ifdef HAVE_BUGGY_TME_SUPPORT
 			//
 			// these instructions use the TME extensions,
@@ -457,6 +482,23 @@ register u_int buflen;
 
 //-------------------------------------------------------------------
 
+#ifndef HAVE_BUGGY_TME_SUPPORT
+u_int bpf_filter(struct bpf_insn* pc, u_char* p, u_int wirelen, u_int buflen)
+{
+	return bpf_filter_meta(pc, p, wirelen, buflen, NULL);
+}
+
+void bpf_filter_batch(struct bpf_insn* pc, struct bpf_packet* pkts, u_int count, u_int* verdicts)
+{
+	u_int i;
+
+	for (i = 0; i < count; i++)
+		verdicts[i] = bpf_filter_meta(pc, pkts[i].data, pkts[i].wirelen, pkts[i].buflen, pkts[i].meta);
+}
+#endif //HAVE_BUGGY_TME_SUPPORT
+
+//-------------------------------------------------------------------
+
 #ifdef HAVE_BUGGY_TME_SUPPORT
 u_int bpf_filter_with_2_buffers(pc, p, pd, headersize, wirelen, buflen, mem_ex, tme, time_ref)
 register struct bpf_insn * pc;
@@ -891,7 +933,7 @@ register u_int buflen;
 			continue;
 
 		case BPF_ALU|BPF_NEG:
-			(int)A = -((int)A);
+			A = (u_int32)-((int)A);
 			continue;
 
 		case BPF_MISC|BPF_TAX:
@@ -902,6 +944,18 @@ register u_int buflen;
 			A = X;
 			continue;
 
+		case BPF_MISC|BPF_MATCH:
+			{
+				struct bpf_frag frags[2];
+
+				frags[0].data = p;
+				frags[0].len = headersize;
+				frags[1].data = pd;
+				frags[1].len = buflen > (u_int)headersize ? buflen - headersize : 0;
+				A = bpf_match_frags(pc->k, frags, buflen, X, A);
+			}
+			continue;
+
 #ifdef HAVE_BUGGY_TME_SUPPORT
 			//
 			// these instructions use the TME extensions,
@@ -991,6 +1045,12 @@ int len;
 			case BPF_IMM:
 				break;
 			case BPF_ABS:
+				/*
+				 * The ancillary area is reserved for the known fields.
+				 */
+				if (BPF_CLASS(p->code) == BPF_LD && p->k - BPF_AD_OFF < BPF_AD_AREA && !BPF_IS_ANCILLARY(p->code, p->k))
+					return 0;
+				break;
 			case BPF_IND:
 			case BPF_MSH:
 				break;
@@ -1115,6 +1175,9 @@ int len;
 		case BPF_RET:
 			break;
 		case BPF_MISC:
+			// The set of a match is looked up at run time, its id must only be one of the sets
+			if (p->code == (BPF_MISC|BPF_MATCH) && p->k >= BPF_MATCH_MAX_SETS)
+				return 0;
 			break;
 		default:
 			return 0;
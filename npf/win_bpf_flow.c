@@ -0,0 +1,392 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Cache of the verdicts of a filter, for the packets of the same flow.
+ *
+ * The result of a program depends only on the bytes of the packet that it loads, on
+ * whether these loads are in bounds, and on wirelen if it reads the length. At install
+ * time, a forward pass finds where each load reads: at a constant offset, or for the
+ * indirect loads at an offset from the IP header length given by "ldxb 4*([k]&0xf)". The
+ * key of a packet is made of these bytes, of which loads are in bounds and of wirelen:
+ * two packets with the same key get the same verdict, whatever the rest of their bytes.
+ *
+ * The verdicts are kept in small direct-mapped caches indexed by a hash of the key, one
+ * for each CPU. The keys are compared in full, so a collision is only a miss.
+ *
+ * The programs with an indirect load from an X computed otherwise, that read too many
+ * bytes or the metadata of the packets (the ancillary loads), are not cached.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_bpf.h"
+
+#ifdef WIN_NT_DRIVER
+#define FLOW_ALLOC(_size)	ExAllocatePoolWithTag(NonPagedPool, (_size), '4BWA')
+#define FLOW_FREE(_ptr)		ExFreePool(_ptr)
+#else
+#define FLOW_ALLOC(_size)	malloc(_size)
+#define FLOW_FREE(_ptr)		free(_ptr)
+#endif
+
+#define FLOW_MAX_LOADS		32		///< Distinct loads of a program, one bit each in the key
+
+/// What is known of the value of X (or of a scratch memory word) at an instruction
+#define FLOW_UNREACHED		0		///< No path reaches the instruction yet
+#define FLOW_IMM			1		///< A constant
+#define FLOW_MSH			2		///< The result of "ldxb 4*([k]&0xf)"
+#define FLOW_ANY			3		///< Anything else
+
+struct flow_value
+{
+	u_int32 Kind;
+	u_int32 K;
+};
+
+struct flow_state
+{
+	struct flow_value X;
+	struct flow_value Mem[BPF_MEMWORDS];
+};
+
+/*
+ * A load of the program: Size bytes at K, or at K plus the X given by the byte at Msh
+ */
+struct flow_load
+{
+	u_int32 K;
+	u_int32 Size;
+	u_int32 Msh;
+	u_int32 Indirect;
+};
+
+struct bpf_flow_program
+{
+	u_int NLoads;
+	u_int KeyLength;				///< Bytes of the key taken from the packet
+	u_int UsesWirelen;
+	u_int NCaches;
+	struct flow_load Loads[FLOW_MAX_LOADS];
+	struct bpf_flow_cache Caches[1];
+};
+
+static void flow_meet(struct flow_value* to, struct flow_value* from)
+{
+	if (from->Kind == FLOW_UNREACHED)
+		return;
+
+	if (to->Kind == FLOW_UNREACHED)
+		*to = *from;
+	else if (to->Kind != from->Kind || to->K != from->K)
+		to->Kind = FLOW_ANY;
+}
+
+static void flow_propagate(struct flow_state* states, u_int target, struct flow_state* s)
+{
+	u_int k;
+
+	flow_meet(&states[target].X, &s->X);
+	for (k = 0; k < BPF_MEMWORDS; k++)
+		flow_meet(&states[target].Mem[k], &s->Mem[k]);
+}
+
+/*
+ * Adds a load to the key, once. Returns FALSE if there are too many.
+ */
+static int flow_add_load(struct bpf_flow_program* prog, u_int32 k, u_int32 size, u_int32 msh, u_int32 indirect)
+{
+	struct flow_load* l;
+	u_int i;
+
+	for (i = 0; i < prog->NLoads; i++)
+	{
+		l = &prog->Loads[i];
+		if (l->K == k && l->Size == size && l->Msh == msh && l->Indirect == indirect)
+			return TRUE;
+	}
+
+	if (prog->NLoads == FLOW_MAX_LOADS || prog->KeyLength + size > BPF_FLOW_KEY_MAX)
+		return FALSE;
+
+	l = &prog->Loads[prog->NLoads++];
+	l->K = k;
+	l->Size = size;
+	l->Msh = msh;
+	l->Indirect = indirect;
+	prog->KeyLength += size;
+
+	return TRUE;
+}
+
+/*
+ * Finds the loads of the program, returns FALSE if the offset of one of them is unknown
+ */
+static int flow_analyze(struct bpf_flow_program* prog, struct bpf_insn* f, u_int len, struct flow_state* states)
+{
+	struct bpf_insn* p;
+	struct flow_state s;
+	u_int32 size;
+	u_int i, k;
+
+	RtlZeroMemory(states, len * sizeof(struct flow_state));
+
+	// bpf_filter() starts with X and the scratch memory at 0
+	states[0].X.Kind = FLOW_IMM;
+	for (k = 0; k < BPF_MEMWORDS; k++)
+		states[0].Mem[k].Kind = FLOW_IMM;
+
+	for (i = 0; i < len; i++)
+	{
+		p = &f[i];
+		s = states[i];
+
+		if (s.X.Kind == FLOW_UNREACHED)
+			continue;
+
+		switch (BPF_CLASS(p->code))
+		{
+		case BPF_RET:
+			continue;
+
+		case BPF_JMP:
+			if (p->code == (BPF_JMP|BPF_JA))
+			{
+				flow_propagate(states, i + 1 + p->k, &s);
+			}
+			else
+			{
+				flow_propagate(states, i + 1 + p->jt, &s);
+				flow_propagate(states, i + 1 + p->jf, &s);
+			}
+			continue;
+
+		case BPF_LD:
+			switch (BPF_SIZE(p->code))
+			{
+			case BPF_W:
+				size = 4;
+				break;
+			case BPF_H:
+				size = 2;
+				break;
+			default:
+				size = 1;
+				break;
+			}
+
+			if (BPF_MODE(p->code) == BPF_ABS)
+			{
+				// The metadata is not part of the key
+				if (BPF_IS_ANCILLARY(p->code, p->k))
+					return FALSE;
+				if (!flow_add_load(prog, p->k, size, 0, FALSE))
+					return FALSE;
+			}
+			else if (BPF_MODE(p->code) == BPF_IND)
+			{
+				if (s.X.Kind == FLOW_IMM)
+				{
+					// Like bpf_filter(), the offset wraps around
+					if (!flow_add_load(prog, s.X.K + p->k, size, 0, FALSE))
+						return FALSE;
+				}
+				else if (s.X.Kind == FLOW_MSH)
+				{
+					if (!flow_add_load(prog, p->k, size, s.X.K, TRUE))
+						return FALSE;
+				}
+				else
+				{
+					return FALSE;
+				}
+			}
+			else if (BPF_MODE(p->code) == BPF_LEN)
+			{
+				prog->UsesWirelen = TRUE;
+			}
+			break;
+
+		case BPF_LDX:
+			switch (BPF_MODE(p->code))
+			{
+			case BPF_IMM:
+				s.X.Kind = FLOW_IMM;
+				s.X.K = p->k;
+				break;
+			case BPF_MSH:
+				if (!flow_add_load(prog, p->k, 1, 0, FALSE))
+					return FALSE;
+				s.X.Kind = FLOW_MSH;
+				s.X.K = p->k;
+				break;
+			case BPF_MEM:
+				s.X = s.Mem[p->k];
+				break;
+			default:
+				prog->UsesWirelen = TRUE;
+				s.X.Kind = FLOW_ANY;
+				break;
+			}
+			break;
+
+		case BPF_ST:
+			s.Mem[p->k].Kind = FLOW_ANY;
+			break;
+
+		case BPF_STX:
+			s.Mem[p->k] = s.X;
+			break;
+
+		case BPF_MISC:
+			// A match reads a whole range of the packet, that cannot be part of the key
+			if (BPF_MISCOP(p->code) == BPF_MATCH)
+				return FALSE;
+			if (BPF_MISCOP(p->code) == BPF_TAX)
+				s.X.Kind = FLOW_ANY;
+			break;
+		}
+
+		// bpf_validate() guarantees that the last instruction is a return
+		flow_propagate(states, i + 1, &s);
+	}
+
+	return TRUE;
+}
+
+struct bpf_flow_program* bpf_flow_compile(struct bpf_insn* f, int len, u_int ncaches)
+{
+	struct bpf_flow_program* prog;
+	struct flow_state* states;
+	int cacheable;
+
+	if (len < 1 || len > BPF_MAXINSNS || ncaches < 1)
+		return NULL;
+
+	prog = (struct bpf_flow_program*)FLOW_ALLOC(sizeof(struct bpf_flow_program) + (ncaches - 1) * sizeof(struct bpf_flow_cache));
+	if (prog == NULL)
+		return NULL;
+
+	states = (struct flow_state*)FLOW_ALLOC(len * sizeof(struct flow_state));
+	if (states == NULL)
+	{
+		FLOW_FREE(prog);
+		return NULL;
+	}
+
+	prog->NLoads = 0;
+	prog->KeyLength = 0;
+	prog->UsesWirelen = FALSE;
+	prog->NCaches = ncaches;
+
+	cacheable = flow_analyze(prog, f, (u_int)len, states);
+	FLOW_FREE(states);
+
+	if (!cacheable)
+	{
+		FLOW_FREE(prog);
+		return NULL;
+	}
+
+	RtlZeroMemory(prog->Caches, ncaches * sizeof(struct bpf_flow_cache));
+
+	return prog;
+}
+
+void bpf_free_flow(struct bpf_flow_program* prog)
+{
+	FLOW_FREE(prog);
+}
+
+struct bpf_flow_cache* bpf_flow_get_cache(struct bpf_flow_program* prog, u_int index)
+{
+	return &prog->Caches[index % prog->NCaches];
+}
+
+void bpf_flow_key(struct bpf_flow_program* prog, u_char* p, u_int wirelen, u_int buflen, struct bpf_flow_key* key)
+{
+	struct flow_load* l;
+	u_char* bytes = key->bytes;
+	u_int32 k, hash = 2166136261u;
+	u_int i, j;
+
+	key->inbounds = 0;
+	key->wirelen = prog->UsesWirelen ? wirelen : 0;
+
+	for (i = 0; i < prog->NLoads; i++)
+	{
+		l = &prog->Loads[i];
+		k = l->K;
+
+		// The same checks as bpf_filter()
+		if (l->Indirect)
+		{
+			if (l->Msh >= buflen)
+				k = buflen;
+			else
+				k += (p[l->Msh] & 0xf) << 2;
+		}
+
+		if (k < buflen && buflen - k >= l->Size)
+		{
+			key->inbounds |= 1 << i;
+			for (j = 0; j < l->Size; j++)
+				bytes[j] = p[k + j];
+		}
+		else
+		{
+			for (j = 0; j < l->Size; j++)
+				bytes[j] = 0;
+		}
+
+		bytes += l->Size;
+	}
+
+	// FNV-1a
+	for (i = 0; i < prog->KeyLength; i++)
+		hash = (hash ^ key->bytes[i]) * 16777619u;
+	hash = (hash ^ key->inbounds) * 16777619u;
+	hash = (hash ^ key->wirelen) * 16777619u;
+
+	key->hash = hash;
+}
+
+int bpf_flow_lookup(struct bpf_flow_program* prog, struct bpf_flow_cache* cache, struct bpf_flow_key* key, u_int* verdict)
+{
+	struct bpf_flow_entry* e = &cache->entries[key->hash % BPF_FLOW_ENTRIES];
+	u_int i;
+
+	if (!e->valid || e->key.hash != key->hash || e->key.inbounds != key->inbounds || e->key.wirelen != key->wirelen)
+		return FALSE;
+
+	for (i = 0; i < prog->KeyLength; i++)
+	{
+		if (e->key.bytes[i] != key->bytes[i])
+			return FALSE;
+	}
+
+	*verdict = e->verdict;
+
+	return TRUE;
+}
+
+void bpf_flow_insert(struct bpf_flow_program* prog, struct bpf_flow_cache* cache, struct bpf_flow_key* key, u_int verdict)
+{
+	struct bpf_flow_entry* e = &cache->entries[key->hash % BPF_FLOW_ENTRIES];
+
+	e->key.hash = key->hash;
+	e->key.inbounds = key->inbounds;
+	e->key.wirelen = key->wirelen;
+	RtlCopyMemory(e->key.bytes, key->bytes, prog->KeyLength);
+	e->verdict = verdict;
+	e->valid = TRUE;
+}
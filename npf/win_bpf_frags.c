@@ -0,0 +1,306 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Filtering of the packets that NDIS gives in several buffers (i.e. a chain of MDLs),
+ * without copying them into a contiguous one first.
+ *
+ * The loads that fit in the first fragment, which holds at least the link layer header,
+ * read it directly; the others go through bpf_frag_load(), which is also called by the
+ * code generated by the jitter for the same purpose.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_bpf.h"
+
+#define EXTRACT_SHORT(p)\
+		((((u_short)(((u_char*)p)[0])) << 8) |\
+		 (((u_short)(((u_char*)p)[1])) << 0))
+
+#define EXTRACT_LONG(p)\
+		((((u_int32)(((u_char*)p)[0])) << 24) |\
+		 (((u_int32)(((u_char*)p)[1])) << 16) |\
+		 (((u_int32)(((u_char*)p)[2])) << 8 ) |\
+		 (((u_int32)(((u_char*)p)[3])) << 0 ))
+
+u_int32 bpf_frag_load(struct bpf_frag* frags, u_int32 k, u_int32 size)
+{
+	u_int32 value = 0;
+
+	while (size-- > 0)
+	{
+		// Empty fragments are skipped too
+		while (k >= frags->len)
+		{
+			k -= frags->len;
+			frags++;
+		}
+
+		value = (value << 8) | frags->data[k++];
+	}
+
+	return value;
+}
+
+/// Load of size bytes at k, known to be in bounds
+#define FRAG_LOAD(_k, _size, _extract) \
+	(((_size) <= frags->len && (_k) <= frags->len - (_size)) ? _extract(&frags->data[_k]) : bpf_frag_load(frags, (_k), (_size)))
+
+#define FRAG_BYTE(_p)	(*(_p))
+
+u_int bpf_filter_frags(struct bpf_insn* pc, struct bpf_frag* frags, u_int wirelen, u_int buflen, struct bpf_meta* meta)
+{
+	u_int32 A = 0, X = 0;
+	u_int32 k;
+	u_int32 mem[BPF_MEMWORDS];
+
+	if (pc == NULL)
+		return (u_int)-1;
+
+	RtlZeroMemory(mem, sizeof(mem));
+
+	for (;; pc++)
+	{
+		switch (pc->code)
+		{
+		default:
+			return 0;
+
+		case BPF_RET|BPF_K:
+			return (u_int)pc->k;
+
+		case BPF_RET|BPF_A:
+			return (u_int)A;
+
+		case BPF_LD|BPF_W|BPF_ABS:
+			k = pc->k;
+			if (k >= buflen || buflen - k < 4)
+			{
+				if (BPF_IS_ANCILLARY(pc->code, k))
+				{
+					A = BPF_AD_LOAD(meta, k - BPF_AD_OFF);
+					continue;
+				}
+				return 0;
+			}
+			A = FRAG_LOAD(k, 4, EXTRACT_LONG);
+			continue;
+
+		case BPF_LD|BPF_H|BPF_ABS:
+			k = pc->k;
+			if (k >= buflen || buflen - k < 2)
+			{
+				if (BPF_IS_ANCILLARY(pc->code, k))
+				{
+					A = BPF_AD_LOAD(meta, k - BPF_AD_OFF);
+					continue;
+				}
+				return 0;
+			}
+			A = FRAG_LOAD(k, 2, EXTRACT_SHORT);
+			continue;
+
+		case BPF_LD|BPF_B|BPF_ABS:
+			k = pc->k;
+			if (k >= buflen)
+			{
+				if (BPF_IS_ANCILLARY(pc->code, k))
+				{
+					A = BPF_AD_LOAD(meta, k - BPF_AD_OFF);
+					continue;
+				}
+				return 0;
+			}
+			A = FRAG_LOAD(k, 1, FRAG_BYTE);
+			continue;
+
+		case BPF_LD|BPF_W|BPF_LEN:
+			A = wirelen;
+			continue;
+
+		case BPF_LDX|BPF_W|BPF_LEN:
+			X = wirelen;
+			continue;
+
+		case BPF_LD|BPF_W|BPF_IND:
+			k = X + pc->k;
+			if (k >= buflen || buflen - k < 4)
+				return 0;
+			A = FRAG_LOAD(k, 4, EXTRACT_LONG);
+			continue;
+
+		case BPF_LD|BPF_H|BPF_IND:
+			k = X + pc->k;
+			if (k >= buflen || buflen - k < 2)
+				return 0;
+			A = FRAG_LOAD(k, 2, EXTRACT_SHORT);
+			continue;
+
+		case BPF_LD|BPF_B|BPF_IND:
+			k = X + pc->k;
+			if (k >= buflen)
+				return 0;
+			A = FRAG_LOAD(k, 1, FRAG_BYTE);
+			continue;
+
+		case BPF_LDX|BPF_MSH|BPF_B:
+			k = pc->k;
+			if (k >= buflen)
+				return 0;
+			X = (FRAG_LOAD(k, 1, FRAG_BYTE) & 0xf) << 2;
+			continue;
+
+		case BPF_LD|BPF_IMM:
+			A = pc->k;
+			continue;
+
+		case BPF_LDX|BPF_IMM:
+			X = pc->k;
+			continue;
+
+		case BPF_LD|BPF_MEM:
+			A = mem[pc->k];
+			continue;
+
+		case BPF_LDX|BPF_MEM:
+			X = mem[pc->k];
+			continue;
+
+		case BPF_ST:
+			mem[pc->k] = A;
+			continue;
+
+		case BPF_STX:
+			mem[pc->k] = X;
+			continue;
+
+		case BPF_JMP|BPF_JA:
+			pc += pc->k;
+			continue;
+
+		case BPF_JMP|BPF_JGT|BPF_K:
+			pc += ((int)A > (int)pc->k) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JGE|BPF_K:
+			pc += ((int)A >= (int)pc->k) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JEQ|BPF_K:
+			pc += (A == pc->k) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JSET|BPF_K:
+			pc += (A & pc->k) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JGT|BPF_X:
+			pc += (A > X) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JGE|BPF_X:
+			pc += (A >= X) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JEQ|BPF_X:
+			pc += (A == X) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JSET|BPF_X:
+			pc += (A & X) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_ALU|BPF_ADD|BPF_X:
+			A += X;
+			continue;
+
+		case BPF_ALU|BPF_SUB|BPF_X:
+			A -= X;
+			continue;
+
+		case BPF_ALU|BPF_MUL|BPF_X:
+			A *= X;
+			continue;
+
+		case BPF_ALU|BPF_DIV|BPF_X:
+			if (X == 0)
+				return 0;
+			A /= X;
+			continue;
+
+		case BPF_ALU|BPF_AND|BPF_X:
+			A &= X;
+			continue;
+
+		case BPF_ALU|BPF_OR|BPF_X:
+			A |= X;
+			continue;
+
+		case BPF_ALU|BPF_LSH|BPF_X:
+			A <<= X;
+			continue;
+
+		case BPF_ALU|BPF_RSH|BPF_X:
+			A >>= X;
+			continue;
+
+		case BPF_ALU|BPF_ADD|BPF_K:
+			A += pc->k;
+			continue;
+
+		case BPF_ALU|BPF_SUB|BPF_K:
+			A -= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_MUL|BPF_K:
+			A *= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_DIV|BPF_K:
+			A /= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_AND|BPF_K:
+			A &= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_OR|BPF_K:
+			A |= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_LSH|BPF_K:
+			A <<= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_RSH|BPF_K:
+			A >>= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_NEG:
+			A = (u_int32)-((int)A);
+			continue;
+
+		case BPF_MISC|BPF_TAX:
+			X = A;
+			continue;
+
+		case BPF_MISC|BPF_TXA:
+			A = X;
+			continue;
+
+		case BPF_MISC|BPF_MATCH:
+			A = bpf_match_frags(pc->k, frags, buflen, X, A);
+			continue;
+		}
+	}
+}
@@ -0,0 +1,1021 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Combined classifier of the filters of all the instances open on the same adapter.
+ *
+ * Each program is first turned, by symbolic execution, into a decision DAG whose inner
+ * nodes are tests (a comparison of an expression of the packet with a constant or with
+ * another expression, plus the loads that must not fail) and whose leaves are the
+ * returned constants. Expressions and tests are shared by all the programs: the same
+ * "ldh [12]; jeq #0x800" is the same test in every filter.
+ *
+ * The DAGs are then merged into a single one, by walking them all at the same time: a
+ * node of the result is the position reached in each program, and evaluating its test
+ * moves forward all the programs that are waiting on the same test. A packet crosses
+ * each distinct test at most once, however many filters use it, and comes out with the
+ * bitmap of the programs that accept it.
+ *
+ * The programs that this cannot describe (e.g. returning a value computed from the
+ * packet, or accepting with different lengths), or that make the result too large, are
+ * left out of the classifier and must be run as usual.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_bpf.h"
+
+#ifdef WIN_NT_DRIVER
+#define GROUP_ALLOC(_size)	ExAllocatePoolWithTag(NonPagedPool, (_size), '3BWA')
+#define GROUP_FREE(_ptr)	ExFreePool(_ptr)
+#else
+#define GROUP_ALLOC(_size)	malloc(_size)
+#define GROUP_FREE(_ptr)	free(_ptr)
+#endif
+
+#define EXTRACT_SHORT(p)\
+		((((u_short)(((u_char*)p)[0])) << 8) |\
+		 (((u_short)(((u_char*)p)[1])) << 0))
+
+#define EXTRACT_LONG(p)\
+		((((u_int32)(((u_char*)p)[0])) << 24) |\
+		 (((u_int32)(((u_char*)p)[1])) << 16) |\
+		 (((u_int32)(((u_char*)p)[2])) << 8 ) |\
+		 (((u_int32)(((u_char*)p)[3])) << 0 ))
+
+#define GROUP_MAX_EXPRS		512		///< Distinct expressions of all the programs
+#define GROUP_MAX_TESTS		512		///< Distinct tests of all the programs
+#define GROUP_MAX_FORCED	1024	///< Total length of the lists of loads forced by the tests
+#define GROUP_MAX_PNODES	4096	///< Nodes of the DAGs of all the programs
+#define GROUP_MAX_NODES		4096	///< Nodes of the merged DAG
+#define GROUP_MAX_DEPTH		16		///< Depth of an expression, i.e. of the recursion that evaluates it
+#define GROUP_MAX_PENDING	16		///< Loads between two tests
+#define GROUP_HASH			1024	///< Buckets of the table of the merged nodes
+
+#define GROUP_NONE			0xffff	///< No expression, node, or program
+#define GROUP_LEAF			0xfffe	///< Test of a node that is a leaf of a program's DAG
+#define GROUP_UNSET			0xfffd	///< Test of a node of a program's DAG not built yet
+
+/// Outcomes of a test
+#define GROUP_TRUE			0
+#define GROUP_FALSE			1
+#define GROUP_REJECT		2		///< A load is out of the packet, or a division by zero: the program returns 0
+
+/// Live registers and scratch memory words
+#define LIVE_A				0x1
+#define LIVE_X				0x2
+#define LIVE_MEM(_k)		(0x4 << (_k))
+
+/*
+ * An expression: the value of A or X computed by an instruction from its operands
+ */
+struct group_expr
+{
+	u_short Code;		///< The instruction, BPF_LD|BPF_IMM and BPF_LD|BPF_W|BPF_LEN for the loads of X too
+	u_short Left;		///< The A operand of the ALU instructions
+	u_short Right;		///< The X operand of the ALU instructions and of the indirect loads
+	u_short Depth;
+	u_int32 K;
+};
+
+/*
+ * A test: the loads in the Forced list must not fail, then Left is compared with K or
+ * Right. BPF_JMP|BPF_JA is a test that only checks the forced loads.
+ */
+struct group_test
+{
+	u_short Code;
+	u_short Left;
+	u_short Right;
+	u_short NForced;
+	u_int32 K;
+	u_int32 Forced;		///< Index of the first forced load in the Forced array
+};
+
+/*
+ * A node of the merged DAG: the test, and for each outcome the next node and the
+ * programs that accept the packet along the edge
+ */
+struct group_node
+{
+	u_short Test;
+	u_short Next[3];
+	ULONGLONG Matches[3];
+};
+
+struct bpf_group_program
+{
+	u_int Count;							///< Programs given to bpf_group_compile()
+	ULONGLONG Covered;						///< The programs in the classifier
+	u_int32 Accept[BPF_GROUP_MAX];			///< What the covered programs return for an accepted packet
+	ULONGLONG RootMatches;					///< The programs that accept every packet
+	u_short Root;							///< GROUP_NONE if no test is needed
+	struct group_expr* Exprs;
+	struct group_test* Tests;
+	u_short* Forced;
+	struct group_node* Nodes;
+};
+
+//-------------------------------------------------------------------
+// Construction
+//-------------------------------------------------------------------
+
+/*
+ * A node of the DAG of a program: a test with the next nodes, or a leaf. Until it is
+ * built, it holds the state of the machine at the start of the block.
+ */
+struct group_pnode
+{
+	u_short Test;
+	u_short Next[2];
+	u_short Pc;
+	u_short SamePc;		///< Next node with the same Pc
+	u_short A, X;
+	u_short Mem[BPF_MEMWORDS];
+	u_int32 Value;		///< The returned value, for the leaves
+};
+
+/*
+ * A node of the merged DAG while it is built, with the position of every covered
+ * program: a node of its DAG, or GROUP_NONE once its verdict is known
+ */
+struct group_bnode
+{
+	struct group_node Node;
+	u_short HashNext;
+	u_int32 Hash;
+};
+
+struct group_builder
+{
+	struct group_expr Exprs[GROUP_MAX_EXPRS];
+	u_int NExprs;
+	struct group_test Tests[GROUP_MAX_TESTS];
+	u_int NTests;
+	u_short Forced[GROUP_MAX_FORCED];
+	u_int NForced;
+
+	struct group_pnode PNodes[GROUP_MAX_PNODES];
+	u_int NPNodes;
+	u_short Roots[BPF_GROUP_MAX];
+	u_int32 Accept[BPF_GROUP_MAX];
+
+	struct group_bnode BNodes[GROUP_MAX_NODES];
+	u_int NBNodes;
+	u_short Hash[GROUP_HASH];
+	u_short* Positions;		///< NCovered positions for each merged node
+	u_char Covered[BPF_GROUP_MAX];
+	u_int NCovered;
+};
+
+static u_short group_expr(struct group_builder* b, u_short code, u_int32 k, u_short left, u_short right)
+{
+	struct group_expr* e;
+	u_int i, depth = 0;
+
+	for (i = 0; i < b->NExprs; i++)
+	{
+		e = &b->Exprs[i];
+		if (e->Code == code && e->K == k && e->Left == left && e->Right == right)
+			return (u_short)i;
+	}
+
+	if (left != GROUP_NONE && b->Exprs[left].Depth > depth)
+		depth = b->Exprs[left].Depth;
+	if (right != GROUP_NONE && b->Exprs[right].Depth > depth)
+		depth = b->Exprs[right].Depth;
+
+	if (b->NExprs == GROUP_MAX_EXPRS || depth + 1 > GROUP_MAX_DEPTH)
+		return GROUP_NONE;
+
+	e = &b->Exprs[b->NExprs];
+	e->Code = code;
+	e->K = k;
+	e->Left = left;
+	e->Right = right;
+	e->Depth = (u_short)(depth + 1);
+
+	return (u_short)b->NExprs++;
+}
+
+static u_short group_test(struct group_builder* b, u_short code, u_int32 k, u_short left, u_short right,
+	u_short* pending, u_int npending)
+{
+	struct group_test* t;
+	u_int i, j, nforced = 0;
+	u_short forced[GROUP_MAX_PENDING];
+
+	// The operands are evaluated anyway
+	for (i = 0; i < npending; i++)
+	{
+		if (pending[i] != left && pending[i] != right)
+			forced[nforced++] = pending[i];
+	}
+
+	for (i = 0; i < b->NTests; i++)
+	{
+		t = &b->Tests[i];
+		if (t->Code != code || t->K != k || t->Left != left || t->Right != right || t->NForced != nforced)
+			continue;
+
+		for (j = 0; j < nforced && b->Forced[t->Forced + j] == forced[j]; j++)
+			;
+		if (j == nforced)
+			return (u_short)i;
+	}
+
+	if (b->NTests == GROUP_MAX_TESTS || b->NForced + nforced > GROUP_MAX_FORCED)
+		return GROUP_NONE;
+
+	t = &b->Tests[b->NTests];
+	t->Code = code;
+	t->K = k;
+	t->Left = left;
+	t->Right = right;
+	t->NForced = (u_short)nforced;
+	t->Forced = b->NForced;
+	for (j = 0; j < nforced; j++)
+		b->Forced[b->NForced++] = forced[j];
+
+	return (u_short)b->NTests++;
+}
+
+/*
+ * Registers and scratch memory words read by each instruction before being written.
+ * The programs only jump forward, so one backward pass is enough.
+ */
+static void group_liveness(struct bpf_insn* f, u_int len, u_int32* live)
+{
+	struct bpf_insn* p;
+	u_int32 use, def, out;
+	int i;
+
+	for (i = (int)len - 1; i >= 0; i--)
+	{
+		p = &f[i];
+		use = 0;
+		def = 0;
+
+		switch (BPF_CLASS(p->code))
+		{
+		case BPF_RET:
+			live[i] = (BPF_RVAL(p->code) == BPF_A) ? LIVE_A : 0;
+			continue;
+
+		case BPF_JMP:
+			if (p->code == (BPF_JMP|BPF_JA))
+			{
+				live[i] = live[i + 1 + p->k];
+				continue;
+			}
+			use = LIVE_A | (BPF_SRC(p->code) == BPF_X ? LIVE_X : 0);
+			live[i] = use | live[i + 1 + p->jt] | live[i + 1 + p->jf];
+			continue;
+
+		case BPF_LD:
+			def = LIVE_A;
+			if (BPF_MODE(p->code) == BPF_IND)
+				use = LIVE_X;
+			else if (BPF_MODE(p->code) == BPF_MEM)
+				use = LIVE_MEM(p->k);
+			break;
+
+		case BPF_LDX:
+			def = LIVE_X;
+			if (BPF_MODE(p->code) == BPF_MEM)
+				use = LIVE_MEM(p->k);
+			break;
+
+		case BPF_ST:
+			use = LIVE_A;
+			def = LIVE_MEM(p->k);
+			break;
+
+		case BPF_STX:
+			use = LIVE_X;
+			def = LIVE_MEM(p->k);
+			break;
+
+		case BPF_ALU:
+			use = LIVE_A | (BPF_OP(p->code) != BPF_NEG && BPF_SRC(p->code) == BPF_X ? LIVE_X : 0);
+			def = LIVE_A;
+			break;
+
+		case BPF_MISC:
+			if (BPF_MISCOP(p->code) == BPF_MATCH)
+			{
+				use = LIVE_A | LIVE_X;
+				def = LIVE_A;
+				break;
+			}
+			use = (BPF_MISCOP(p->code) == BPF_TAX) ? LIVE_A : LIVE_X;
+			def = (BPF_MISCOP(p->code) == BPF_TAX) ? LIVE_X : LIVE_A;
+			break;
+		}
+
+		out = live[i + 1];
+		live[i] = use | (out & ~def);
+	}
+}
+
+/*
+ * The node of the program's DAG for the machine state at pc, created if needed. The
+ * dead registers are forgotten, so that the paths that join at pc share the node.
+ */
+static u_short group_pnode_at(struct group_builder* b, u_short* first, u_int32* live, u_int pc,
+	u_short A, u_short X, u_short* mem)
+{
+	struct group_pnode* n;
+	u_short id;
+	u_int k;
+
+	if (!(live[pc] & LIVE_A))
+		A = GROUP_NONE;
+	if (!(live[pc] & LIVE_X))
+		X = GROUP_NONE;
+
+	for (id = first[pc]; id != GROUP_NONE; id = n->SamePc)
+	{
+		n = &b->PNodes[id];
+		if (n->A != A || n->X != X)
+			continue;
+
+		for (k = 0; k < BPF_MEMWORDS; k++)
+		{
+			if ((live[pc] & LIVE_MEM(k)) && n->Mem[k] != mem[k])
+				break;
+		}
+		if (k == BPF_MEMWORDS)
+			return id;
+	}
+
+	if (b->NPNodes == GROUP_MAX_PNODES)
+		return GROUP_NONE;
+
+	id = (u_short)b->NPNodes++;
+	n = &b->PNodes[id];
+	n->Test = GROUP_UNSET;
+	n->Pc = (u_short)pc;
+	n->A = A;
+	n->X = X;
+	for (k = 0; k < BPF_MEMWORDS; k++)
+		n->Mem[k] = (live[pc] & LIVE_MEM(k)) ? mem[k] : GROUP_NONE;
+	n->SamePc = first[pc];
+	first[pc] = id;
+
+	return id;
+}
+
+/// Fails the construction of the program's DAG if _v is GROUP_NONE
+#define GROUP_CHECK(_v)	if ((_v) == GROUP_NONE) return FALSE
+
+/// Adds the expression of a load that can fail to the ones the next test must force
+#define GROUP_PENDING(_e) \
+	if (npending == GROUP_MAX_PENDING) return FALSE; \
+	pending[npending++] = (_e)
+
+/*
+ * Runs symbolically the block that starts at the node id, until a test or a return.
+ * Returns FALSE if the program cannot be part of the classifier.
+ */
+static int group_build_node(struct group_builder* b, struct bpf_insn* f, u_short* first, u_int32* live,
+	u_short id, u_int32* accept)
+{
+	struct group_pnode* n = &b->PNodes[id];
+	struct bpf_insn* p;
+	u_short A = n->A, X = n->X;
+	u_short mem[BPF_MEMWORDS];
+	u_short pending[GROUP_MAX_PENDING];
+	u_short test, t, e;
+	u_int npending = 0;
+	u_int pc = n->Pc;
+	u_int32 value;
+
+	RtlCopyMemory(mem, n->Mem, sizeof(mem));
+
+	for (;;)
+	{
+		p = &f[pc];
+
+		switch (p->code)
+		{
+		case BPF_LD|BPF_W|BPF_ABS:
+		case BPF_LD|BPF_H|BPF_ABS:
+		case BPF_LD|BPF_B|BPF_ABS:
+			// The classifier sees the packets only, not their metadata
+			if (BPF_IS_ANCILLARY(p->code, p->k))
+				return FALSE;
+			A = group_expr(b, p->code, p->k, GROUP_NONE, GROUP_NONE);
+			GROUP_CHECK(A);
+			GROUP_PENDING(A);
+			break;
+
+		case BPF_LD|BPF_W|BPF_IND:
+		case BPF_LD|BPF_H|BPF_IND:
+		case BPF_LD|BPF_B|BPF_IND:
+			A = group_expr(b, p->code, p->k, GROUP_NONE, X);
+			GROUP_CHECK(A);
+			GROUP_PENDING(A);
+			break;
+
+		case BPF_LDX|BPF_MSH|BPF_B:
+			X = group_expr(b, p->code, p->k, GROUP_NONE, GROUP_NONE);
+			GROUP_CHECK(X);
+			GROUP_PENDING(X);
+			break;
+
+		case BPF_LD|BPF_W|BPF_LEN:
+			A = group_expr(b, BPF_LD|BPF_W|BPF_LEN, 0, GROUP_NONE, GROUP_NONE);
+			GROUP_CHECK(A);
+			break;
+
+		case BPF_LDX|BPF_W|BPF_LEN:
+			X = group_expr(b, BPF_LD|BPF_W|BPF_LEN, 0, GROUP_NONE, GROUP_NONE);
+			GROUP_CHECK(X);
+			break;
+
+		case BPF_LD|BPF_IMM:
+			A = group_expr(b, BPF_LD|BPF_IMM, p->k, GROUP_NONE, GROUP_NONE);
+			GROUP_CHECK(A);
+			break;
+
+		case BPF_LDX|BPF_IMM:
+			X = group_expr(b, BPF_LD|BPF_IMM, p->k, GROUP_NONE, GROUP_NONE);
+			GROUP_CHECK(X);
+			break;
+
+		case BPF_LD|BPF_MEM:
+			A = mem[p->k];
+			break;
+
+		case BPF_LDX|BPF_MEM:
+			X = mem[p->k];
+			break;
+
+		case BPF_ST:
+			mem[p->k] = A;
+			break;
+
+		case BPF_STX:
+			mem[p->k] = X;
+			break;
+
+		case BPF_ALU|BPF_ADD|BPF_K:
+		case BPF_ALU|BPF_SUB|BPF_K:
+		case BPF_ALU|BPF_MUL|BPF_K:
+		case BPF_ALU|BPF_DIV|BPF_K:
+		case BPF_ALU|BPF_AND|BPF_K:
+		case BPF_ALU|BPF_OR|BPF_K:
+		case BPF_ALU|BPF_LSH|BPF_K:
+		case BPF_ALU|BPF_RSH|BPF_K:
+		case BPF_ALU|BPF_NEG:
+			A = group_expr(b, p->code, p->code == (BPF_ALU|BPF_NEG) ? 0 : p->k, A, GROUP_NONE);
+			GROUP_CHECK(A);
+			break;
+
+		case BPF_ALU|BPF_ADD|BPF_X:
+		case BPF_ALU|BPF_SUB|BPF_X:
+		case BPF_ALU|BPF_MUL|BPF_X:
+		case BPF_ALU|BPF_AND|BPF_X:
+		case BPF_ALU|BPF_OR|BPF_X:
+		case BPF_ALU|BPF_LSH|BPF_X:
+		case BPF_ALU|BPF_RSH|BPF_X:
+			A = group_expr(b, p->code, 0, A, X);
+			GROUP_CHECK(A);
+			break;
+
+		case BPF_ALU|BPF_DIV|BPF_X:
+			A = group_expr(b, p->code, 0, A, X);
+			GROUP_CHECK(A);
+			GROUP_PENDING(A);
+			break;
+
+		case BPF_MISC|BPF_TAX:
+			X = A;
+			break;
+
+		case BPF_MISC|BPF_TXA:
+			A = X;
+			break;
+
+		case BPF_JMP|BPF_JA:
+			pc += 1 + p->k;
+			continue;
+
+		case BPF_RET|BPF_K:
+		case BPF_RET|BPF_A:
+			if (p->code == (BPF_RET|BPF_K))
+			{
+				value = p->k;
+			}
+			else
+			{
+				// Only a constant A, the verdict is a bit
+				if (b->Exprs[A].Code != (BPF_LD|BPF_IMM))
+					return FALSE;
+				value = b->Exprs[A].K;
+			}
+
+			if (value != 0)
+			{
+				if (*accept != 0 && *accept != value)
+					return FALSE;
+				*accept = value;
+			}
+
+			if (npending == 0)
+			{
+				n->Test = GROUP_LEAF;
+				n->Value = value;
+				return TRUE;
+			}
+
+			// The loads before the return must not fail, the leaf follows
+			test = group_test(b, BPF_JMP|BPF_JA, 0, GROUP_NONE, GROUP_NONE, pending, npending);
+			GROUP_CHECK(test);
+			if (b->NPNodes == GROUP_MAX_PNODES)
+				return FALSE;
+			t = (u_short)b->NPNodes++;
+			b->PNodes[t].Test = GROUP_LEAF;
+			b->PNodes[t].Value = value;
+
+			n->Test = test;
+			n->Next[0] = t;
+			n->Next[1] = t;
+			return TRUE;
+
+		case BPF_JMP|BPF_JGT|BPF_K:
+		case BPF_JMP|BPF_JGE|BPF_K:
+		case BPF_JMP|BPF_JEQ|BPF_K:
+		case BPF_JMP|BPF_JSET|BPF_K:
+		case BPF_JMP|BPF_JGT|BPF_X:
+		case BPF_JMP|BPF_JGE|BPF_X:
+		case BPF_JMP|BPF_JEQ|BPF_X:
+		case BPF_JMP|BPF_JSET|BPF_X:
+			e = (BPF_SRC(p->code) == BPF_X) ? X : GROUP_NONE;
+			test = group_test(b, p->code, BPF_SRC(p->code) == BPF_X ? 0 : p->k, A, e, pending, npending);
+			GROUP_CHECK(test);
+
+			t = group_pnode_at(b, first, live, pc + 1 + p->jt, A, X, mem);
+			GROUP_CHECK(t);
+			n->Next[0] = t;
+			t = group_pnode_at(b, first, live, pc + 1 + p->jf, A, X, mem);
+			GROUP_CHECK(t);
+			n->Next[1] = t;
+			n->Test = test;
+			return TRUE;
+
+		default:
+			return FALSE;
+		}
+
+		pc++;
+	}
+}
+
+/*
+ * Builds the DAG of a program, returns its root or GROUP_NONE
+ */
+static u_short group_build_program(struct group_builder* b, struct bpf_insn* f, u_int len, u_int32* accept)
+{
+	u_short* first;
+	u_int32* live;
+	u_short mem[BPF_MEMWORDS];
+	u_short zero, root = GROUP_NONE;
+	u_int i, start = b->NPNodes;
+
+	if (len < 1 || len > BPF_MAXINSNS)
+		return GROUP_NONE;
+
+	live = (u_int32*)GROUP_ALLOC(len * (sizeof(u_int32) + sizeof(u_short)));
+	if (live == NULL)
+		return GROUP_NONE;
+	first = (u_short*)(live + len);
+
+	group_liveness(f, len, live);
+	for (i = 0; i < len; i++)
+		first[i] = GROUP_NONE;
+
+	// bpf_filter() starts with everything at 0
+	zero = group_expr(b, BPF_LD|BPF_IMM, 0, GROUP_NONE, GROUP_NONE);
+	if (zero != GROUP_NONE)
+	{
+		for (i = 0; i < BPF_MEMWORDS; i++)
+			mem[i] = zero;
+
+		root = group_pnode_at(b, first, live, 0, zero, zero, mem);
+
+		// The nodes are appended in order: build them until there are no new ones
+		for (i = start; root != GROUP_NONE && i < b->NPNodes; i++)
+		{
+			if (b->PNodes[i].Test == GROUP_UNSET && !group_build_node(b, f, first, live, (u_short)i, accept))
+				root = GROUP_NONE;
+		}
+	}
+
+	GROUP_FREE(live);
+
+	return root;
+}
+
+static u_int32 group_hash(u_short* pos, u_int n)
+{
+	u_int32 h = 2166136261u;
+	u_int i;
+
+	for (i = 0; i < n; i++)
+		h = (h ^ pos[i]) * 16777619u;
+
+	return h;
+}
+
+/*
+ * Records the verdicts of the programs that reached a leaf, returns the ones that
+ * accept the packet. Their positions become GROUP_NONE.
+ */
+static ULONGLONG group_resolve(struct group_builder* b, u_short* pos)
+{
+	ULONGLONG matches = 0;
+	u_int i;
+
+	for (i = 0; i < b->NCovered; i++)
+	{
+		if (pos[i] != GROUP_NONE && b->PNodes[pos[i]].Test == GROUP_LEAF)
+		{
+			if (b->PNodes[pos[i]].Value != 0)
+				matches |= (ULONGLONG)1 << b->Covered[i];
+			pos[i] = GROUP_NONE;
+		}
+	}
+
+	return matches;
+}
+
+/*
+ * The merged node for the positions, created if needed; GROUP_NONE when all the
+ * programs have a verdict, or if there are too many nodes (*full is set).
+ */
+static u_short group_node_at(struct group_builder* b, u_short* pos, BOOLEAN* full)
+{
+	struct group_bnode* n;
+	u_short* other;
+	u_int32 h;
+	u_short id;
+	u_int i;
+
+	for (i = 0; i < b->NCovered && pos[i] == GROUP_NONE; i++)
+		;
+	if (i == b->NCovered)
+		return GROUP_NONE;
+
+	h = group_hash(pos, b->NCovered);
+	for (id = b->Hash[h % GROUP_HASH]; id != GROUP_NONE; id = n->HashNext)
+	{
+		n = &b->BNodes[id];
+		if (n->Hash != h)
+			continue;
+
+		other = &b->Positions[id * b->NCovered];
+		for (i = 0; i < b->NCovered && other[i] == pos[i]; i++)
+			;
+		if (i == b->NCovered)
+			return id;
+	}
+
+	if (b->NBNodes == GROUP_MAX_NODES)
+	{
+		*full = TRUE;
+		return GROUP_NONE;
+	}
+
+	id = (u_short)b->NBNodes++;
+	n = &b->BNodes[id];
+	n->Node.Test = GROUP_UNSET;
+	n->Hash = h;
+	n->HashNext = b->Hash[h % GROUP_HASH];
+	b->Hash[h % GROUP_HASH] = id;
+	RtlCopyMemory(&b->Positions[id * b->NCovered], pos, b->NCovered * sizeof(u_short));
+
+	return id;
+}
+
+/*
+ * Merges the DAGs of the covered programs. Returns FALSE if the result is too large.
+ */
+static int group_merge(struct group_builder* b, ULONGLONG* root_matches, u_short* root)
+{
+	struct group_bnode* n;
+	u_short pos[BPF_GROUP_MAX];
+	u_short test;
+	u_int i, j, outcome;
+	BOOLEAN full = FALSE;
+
+	b->NBNodes = 0;
+	for (i = 0; i < GROUP_HASH; i++)
+		b->Hash[i] = GROUP_NONE;
+
+	for (i = 0; i < b->NCovered; i++)
+		pos[i] = b->Roots[b->Covered[i]];
+	*root_matches = group_resolve(b, pos);
+	*root = group_node_at(b, pos, &full);
+
+	// The nodes are appended in order: expand them until there are no new ones
+	for (j = 0; j < b->NBNodes && !full; j++)
+	{
+		n = &b->BNodes[j];
+
+		// The test of the first program still waiting, the others with the same test advance too
+		for (i = 0; b->Positions[j * b->NCovered + i] == GROUP_NONE; i++)
+			;
+		test = b->PNodes[b->Positions[j * b->NCovered + i]].Test;
+
+		for (outcome = GROUP_TRUE; outcome <= GROUP_REJECT; outcome++)
+		{
+			RtlCopyMemory(pos, &b->Positions[j * b->NCovered], b->NCovered * sizeof(u_short));
+			for (i = 0; i < b->NCovered; i++)
+			{
+				if (pos[i] == GROUP_NONE || b->PNodes[pos[i]].Test != test)
+					continue;
+				pos[i] = (outcome == GROUP_REJECT) ? GROUP_NONE : b->PNodes[pos[i]].Next[outcome];
+			}
+
+			n->Node.Matches[outcome] = group_resolve(b, pos);
+			n->Node.Next[outcome] = group_node_at(b, pos, &full);
+		}
+		n->Node.Test = test;
+	}
+
+	return !full;
+}
+
+struct bpf_group_program* bpf_group_compile(struct bpf_insn** progs, u_int* lens, u_int count)
+{
+	struct group_builder* b;
+	struct bpf_group_program* g = NULL;
+	ULONGLONG root_matches = 0;
+	u_short root = GROUP_NONE;
+	u_int i, nexprs, ntests, nforced, npnodes;
+	u_char* mem;
+
+	b = (struct group_builder*)GROUP_ALLOC(sizeof(struct group_builder));
+	if (b == NULL)
+		return NULL;
+
+	b->NExprs = 0;
+	b->NTests = 0;
+	b->NForced = 0;
+	b->NPNodes = 0;
+	b->NCovered = 0;
+
+	// The DAGs of the programs; those that cannot be described are left out
+	for (i = 0; i < count && i < BPF_GROUP_MAX; i++)
+	{
+		nexprs = b->NExprs;
+		ntests = b->NTests;
+		nforced = b->NForced;
+		npnodes = b->NPNodes;
+		b->Accept[i] = 0;
+
+		b->Roots[i] = (progs[i] != NULL) ? group_build_program(b, progs[i], lens[i], &b->Accept[i]) : GROUP_NONE;
+		if (b->Roots[i] == GROUP_NONE)
+		{
+			b->NExprs = nexprs;
+			b->NTests = ntests;
+			b->NForced = nforced;
+			b->NPNodes = npnodes;
+			continue;
+		}
+
+		b->Covered[b->NCovered++] = (u_char)i;
+	}
+
+	b->Positions = NULL;
+	if (b->NCovered >= 2)
+		b->Positions = (u_short*)GROUP_ALLOC(GROUP_MAX_NODES * b->NCovered * sizeof(u_short));
+	if (b->Positions == NULL)
+		b->NCovered = 0;
+
+	// Leave out the last programs until the merged DAG is small enough
+	while (b->NCovered >= 2 && !group_merge(b, &root_matches, &root))
+		b->NCovered--;
+
+	if (b->NCovered >= 2)
+	{
+		g = (struct bpf_group_program*)GROUP_ALLOC(sizeof(struct bpf_group_program) +
+			b->NExprs * sizeof(struct group_expr) +
+			b->NTests * sizeof(struct group_test) +
+			b->NBNodes * sizeof(struct group_node) +
+			b->NForced * sizeof(u_short));
+	}
+
+	if (g != NULL)
+	{
+		RtlZeroMemory(g->Accept, sizeof(g->Accept));
+		g->Count = count;
+		g->Covered = 0;
+		for (i = 0; i < b->NCovered; i++)
+		{
+			g->Covered |= (ULONGLONG)1 << b->Covered[i];
+			g->Accept[b->Covered[i]] = b->Accept[b->Covered[i]];
+		}
+		g->RootMatches = root_matches;
+		g->Root = root;
+
+		// The nodes first, for their alignment
+		mem = (u_char*)(g + 1);
+		g->Nodes = (struct group_node*)mem;
+		for (i = 0; i < b->NBNodes; i++)
+			g->Nodes[i] = b->BNodes[i].Node;
+		mem += b->NBNodes * sizeof(struct group_node);
+
+		g->Exprs = (struct group_expr*)mem;
+		RtlCopyMemory(g->Exprs, b->Exprs, b->NExprs * sizeof(struct group_expr));
+		mem += b->NExprs * sizeof(struct group_expr);
+
+		g->Tests = (struct group_test*)mem;
+		RtlCopyMemory(g->Tests, b->Tests, b->NTests * sizeof(struct group_test));
+		mem += b->NTests * sizeof(struct group_test);
+
+		g->Forced = (u_short*)mem;
+		RtlCopyMemory(g->Forced, b->Forced, b->NForced * sizeof(u_short));
+	}
+
+	if (b->Positions != NULL)
+		GROUP_FREE(b->Positions);
+	GROUP_FREE(b);
+
+	return g;
+}
+
+void bpf_free_group(struct bpf_group_program* g)
+{
+	GROUP_FREE(g);
+}
+
+ULONGLONG bpf_group_covered(struct bpf_group_program* g)
+{
+	return g->Covered;
+}
+
+u_int bpf_group_accept(struct bpf_group_program* g, u_int index)
+{
+	return (index < BPF_GROUP_MAX) ? g->Accept[index] : 0;
+}
+
+//-------------------------------------------------------------------
+// Classification
+//-------------------------------------------------------------------
+
+/*
+ * Evaluates an expression like bpf_filter() would, returns FALSE where it returns 0
+ */
+static int group_eval(struct bpf_group_program* g, u_short id, u_char* p, u_int wirelen, u_int buflen, u_int32* value)
+{
+	struct group_expr* e = &g->Exprs[id];
+	u_int32 a = 0, x = 0, k;
+
+	if (e->Left != GROUP_NONE && !group_eval(g, e->Left, p, wirelen, buflen, &a))
+		return FALSE;
+	if (e->Right != GROUP_NONE && !group_eval(g, e->Right, p, wirelen, buflen, &x))
+		return FALSE;
+
+	switch (e->Code)
+	{
+	case BPF_LD|BPF_W|BPF_ABS:
+	case BPF_LD|BPF_W|BPF_IND:
+		k = (BPF_MODE(e->Code) == BPF_IND) ? x + e->K : e->K;
+		if (k >= buflen || buflen - k < 4)
+			return FALSE;
+		*value = EXTRACT_LONG(&p[k]);
+		return TRUE;
+
+	case BPF_LD|BPF_H|BPF_ABS:
+	case BPF_LD|BPF_H|BPF_IND:
+		k = (BPF_MODE(e->Code) == BPF_IND) ? x + e->K : e->K;
+		if (k >= buflen || buflen - k < 2)
+			return FALSE;
+		*value = EXTRACT_SHORT(&p[k]);
+		return TRUE;
+
+	case BPF_LD|BPF_B|BPF_ABS:
+	case BPF_LD|BPF_B|BPF_IND:
+		k = (BPF_MODE(e->Code) == BPF_IND) ? x + e->K : e->K;
+		if (k >= buflen)
+			return FALSE;
+		*value = p[k];
+		return TRUE;
+
+	case BPF_LDX|BPF_MSH|BPF_B:
+		if (e->K >= buflen)
+			return FALSE;
+		*value = (p[e->K] & 0xf) << 2;
+		return TRUE;
+
+	case BPF_LD|BPF_W|BPF_LEN:
+		*value = wirelen;
+		return TRUE;
+
+	case BPF_LD|BPF_IMM:
+		*value = e->K;
+		return TRUE;
+
+	case BPF_ALU|BPF_ADD|BPF_K:		*value = a + e->K;		return TRUE;
+	case BPF_ALU|BPF_SUB|BPF_K:		*value = a - e->K;		return TRUE;
+	case BPF_ALU|BPF_MUL|BPF_K:		*value = a * e->K;		return TRUE;
+	case BPF_ALU|BPF_DIV|BPF_K:		*value = a / e->K;		return TRUE;
+	case BPF_ALU|BPF_AND|BPF_K:		*value = a & e->K;		return TRUE;
+	case BPF_ALU|BPF_OR|BPF_K:		*value = a | e->K;		return TRUE;
+	case BPF_ALU|BPF_LSH|BPF_K:		*value = a << e->K;		return TRUE;
+	case BPF_ALU|BPF_RSH|BPF_K:		*value = a >> e->K;		return TRUE;
+	case BPF_ALU|BPF_NEG:			*value = (u_int32)-((int)a);	return TRUE;
+	case BPF_ALU|BPF_ADD|BPF_X:		*value = a + x;			return TRUE;
+	case BPF_ALU|BPF_SUB|BPF_X:		*value = a - x;			return TRUE;
+	case BPF_ALU|BPF_MUL|BPF_X:		*value = a * x;			return TRUE;
+	case BPF_ALU|BPF_AND|BPF_X:		*value = a & x;			return TRUE;
+	case BPF_ALU|BPF_OR|BPF_X:		*value = a | x;			return TRUE;
+	case BPF_ALU|BPF_LSH|BPF_X:		*value = a << x;		return TRUE;
+	case BPF_ALU|BPF_RSH|BPF_X:		*value = a >> x;		return TRUE;
+
+	case BPF_ALU|BPF_DIV|BPF_X:
+		if (x == 0)
+			return FALSE;
+		*value = a / x;
+		return TRUE;
+
+	default:
+		return FALSE;
+	}
+}
+
+static u_int group_run_test(struct bpf_group_program* g, struct group_test* t, u_char* p, u_int wirelen, u_int buflen)
+{
+	u_int32 a, x, ignored;
+	u_int i;
+
+	for (i = 0; i < t->NForced; i++)
+	{
+		if (!group_eval(g, g->Forced[t->Forced + i], p, wirelen, buflen, &ignored))
+			return GROUP_REJECT;
+	}
+
+	if (t->Code == (BPF_JMP|BPF_JA))
+		return GROUP_TRUE;
+
+	if (!group_eval(g, t->Left, p, wirelen, buflen, &a))
+		return GROUP_REJECT;
+
+	if (BPF_SRC(t->Code) == BPF_X)
+	{
+		if (!group_eval(g, t->Right, p, wirelen, buflen, &x))
+			return GROUP_REJECT;
+	}
+	else
+	{
+		x = t->K;
+	}
+
+	// Like in bpf_filter(), the comparisons with a constant are signed
+	switch (t->Code)
+	{
+	case BPF_JMP|BPF_JGT|BPF_K:
+		return ((int)a > (int)x) ? GROUP_TRUE : GROUP_FALSE;
+	case BPF_JMP|BPF_JGE|BPF_K:
+		return ((int)a >= (int)x) ? GROUP_TRUE : GROUP_FALSE;
+	case BPF_JMP|BPF_JGT|BPF_X:
+		return (a > x) ? GROUP_TRUE : GROUP_FALSE;
+	case BPF_JMP|BPF_JGE|BPF_X:
+		return (a >= x) ? GROUP_TRUE : GROUP_FALSE;
+	case BPF_JMP|BPF_JEQ|BPF_K:
+	case BPF_JMP|BPF_JEQ|BPF_X:
+		return (a == x) ? GROUP_TRUE : GROUP_FALSE;
+	default:
+		return (a & x) ? GROUP_TRUE : GROUP_FALSE;
+	}
+}
+
+ULONGLONG bpf_group_filter(struct bpf_group_program* g, u_char* p, u_int wirelen, u_int buflen)
+{
+	ULONGLONG matches = g->RootMatches;
+	struct group_node* n;
+	u_short id = g->Root;
+	u_int outcome;
+
+	while (id != GROUP_NONE)
+	{
+		n = &g->Nodes[id];
+		outcome = group_run_test(g, &g->Tests[n->Test], p, wirelen, buflen);
+		matches |= n->Matches[outcome];
+		id = n->Next[outcome];
+	}
+
+	return matches;
+}
@@ -0,0 +1,335 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Multi-pattern search in the payload of the packets, for BPF_MISC|BPF_MATCH.
+ *
+ * A set of patterns is compiled once, when it is installed, into an Aho-Corasick automaton.
+ * The bytes that appear in no pattern share a single class, so that the table of the
+ * transitions has one column for each distinct byte of the patterns, plus one; the missing
+ * transitions of the trie are filled in from the failure links, so that the scan takes exactly
+ * one lookup per byte and never goes back. Each state records the first pattern that ends
+ * there, directly or through its failure links.
+ *
+ * In the initial state the automaton only leaves on the first byte of a pattern: the scan skips
+ * the other bytes with a bitmap of these, which is most of the payload when the patterns are
+ * long and rare.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_bpf.h"
+
+#ifdef WIN_NT_DRIVER
+#define MATCH_ALLOC(_size)	ExAllocatePoolWithTag(NonPagedPool, (_size), '6BWA')
+#define MATCH_FREE(_ptr)	ExFreePool(_ptr)
+#else
+#define MATCH_ALLOC(_size)	malloc(_size)
+#define MATCH_FREE(_ptr)	free(_ptr)
+#endif
+
+/// The byte folded to lower case, for BPF_MATCH_NOCASE
+#define MATCH_FOLD(_c)		((_c) >= 'A' && (_c) <= 'Z' ? (_c) + ('a' - 'A') : (_c))
+
+/// TRUE if the byte starts a pattern
+#define MATCH_STARTS(_set, _c)	((_set)->Start[(_c) >> 3] & (1 << ((_c) & 7)))
+
+struct bpf_match_set
+{
+	u_int NStates;
+	u_int NClasses;
+	u_int32* Next;			///< NStates rows of NClasses transitions
+	u_int32* Match;			///< For each state, 1 plus the index of the first pattern that ends there, or 0
+	u_short Classes[256];	///< The class of each byte, 0 for those that are in no pattern
+	u_char Start[32];		///< Bitmap of the bytes that leave the initial state
+};
+
+struct bpf_match_set* bpf_match_sets[BPF_MATCH_MAX_SETS];
+
+/*
+ * Returns the pattern that follows the one at offset off of the image, or FALSE if it does not fit.
+ */
+static int match_next_pattern(u_char* image, u_int size, u_int* off, u_char** pattern, u_int32* len)
+{
+	u_int32 l;
+
+	if (size - *off < sizeof(u_int32))
+		return FALSE;
+
+	RtlCopyMemory(&l, image + *off, sizeof(u_int32));
+	*off += sizeof(u_int32);
+	if (l == 0 || l > BPF_MATCH_MAX_LENGTH || size - *off < l)
+		return FALSE;
+
+	*pattern = image + *off;
+	*len = l;
+	*off += (l + 3) & ~3;
+	if (*off > size)
+		*off = size;
+
+	return TRUE;
+}
+
+struct bpf_match_set* bpf_match_compile(void* image, u_int size)
+{
+	struct bpf_match_header header;
+	struct bpf_match_set* set;
+	u_char* pattern;
+	u_int32* fail;
+	u_int32* queue;
+	u_int32 len, s, t, m;
+	u_int i, j, off, total, nclasses, nstates, head, tail;
+	ULONGLONG memory;
+	u_int nocase;
+
+	if (image == NULL || size < sizeof(header))
+		return NULL;
+
+	RtlCopyMemory(&header, image, sizeof(header));
+	if (header.count == 0 || header.count > BPF_MATCH_MAX_PATTERNS || (header.flags & ~BPF_MATCH_NOCASE) != 0)
+		return NULL;
+	nocase = header.flags & BPF_MATCH_NOCASE;
+
+	set = (struct bpf_match_set*)MATCH_ALLOC(sizeof(struct bpf_match_set));
+	if (set == NULL)
+		return NULL;
+	RtlZeroMemory(set, sizeof(struct bpf_match_set));
+
+	// A class for each distinct byte of the patterns, and the bound on the number of states
+	nclasses = 1;
+	total = 0;
+	off = sizeof(header);
+	for (i = 0; i < header.count; i++)
+	{
+		if (!match_next_pattern((u_char*)image, size, &off, &pattern, &len))
+		{
+			MATCH_FREE(set);
+			return NULL;
+		}
+
+		total += len;
+		for (j = 0; j < len; j++)
+		{
+			u_char c = nocase ? MATCH_FOLD(pattern[j]) : pattern[j];
+
+			if (set->Classes[c] != 0)
+				continue;
+
+			set->Classes[c] = (u_short)nclasses;
+			if (nocase && c >= 'a' && c <= 'z')
+				set->Classes[c - ('a' - 'A')] = (u_short)nclasses;
+			nclasses++;
+		}
+	}
+
+	nstates = total + 1;
+	memory = (ULONGLONG)nstates * (nclasses + 3) * sizeof(u_int32);
+	if (memory > BPF_MATCH_MAX_MEMORY)
+	{
+		MATCH_FREE(set);
+		return NULL;
+	}
+
+	set->NClasses = nclasses;
+	set->Next = (u_int32*)MATCH_ALLOC(nstates * nclasses * sizeof(u_int32));
+	set->Match = (u_int32*)MATCH_ALLOC(nstates * sizeof(u_int32));
+	fail = (u_int32*)MATCH_ALLOC(nstates * sizeof(u_int32));
+	queue = (u_int32*)MATCH_ALLOC(nstates * sizeof(u_int32));
+	if (set->Next == NULL || set->Match == NULL || fail == NULL || queue == NULL)
+	{
+		if (fail != NULL)
+			MATCH_FREE(fail);
+		if (queue != NULL)
+			MATCH_FREE(queue);
+		bpf_match_free(set);
+		return NULL;
+	}
+	RtlZeroMemory(set->Next, nstates * nclasses * sizeof(u_int32));
+	RtlZeroMemory(set->Match, nstates * sizeof(u_int32));
+
+	// The trie: no edge leads to the initial state, so 0 is a missing edge until the links are filled
+	set->NStates = 1;
+	off = sizeof(header);
+	for (i = 0; i < header.count; i++)
+	{
+		match_next_pattern((u_char*)image, size, &off, &pattern, &len);
+
+		s = 0;
+		for (j = 0; j < len; j++)
+		{
+			u_int32* next = &set->Next[s * nclasses + set->Classes[pattern[j]]];
+
+			if (*next == 0)
+				*next = set->NStates++;
+			s = *next;
+		}
+
+		// A duplicate keeps the index of its first occurrence
+		if (set->Match[s] == 0)
+			set->Match[s] = i + 1;
+	}
+
+	// The failure links in breadth-first order, a state always coming after its link: the missing
+	// edges of a state are those of its link, and so are the patterns that end there
+	head = tail = 0;
+	for (i = 0; i < nclasses; i++)
+	{
+		t = set->Next[i];
+		if (t != 0)
+		{
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+
+	while (head < tail)
+	{
+		s = queue[head++];
+
+		m = set->Match[fail[s]];
+		if (m != 0 && (set->Match[s] == 0 || m < set->Match[s]))
+			set->Match[s] = m;
+
+		for (i = 0; i < nclasses; i++)
+		{
+			t = set->Next[s * nclasses + i];
+			if (t != 0)
+			{
+				fail[t] = set->Next[fail[s] * nclasses + i];
+				queue[tail++] = t;
+			}
+			else
+			{
+				set->Next[s * nclasses + i] = set->Next[fail[s] * nclasses + i];
+			}
+		}
+	}
+
+	MATCH_FREE(fail);
+	MATCH_FREE(queue);
+
+	for (i = 0; i < 256; i++)
+	{
+		if (set->Next[set->Classes[i]] != 0)
+			set->Start[i >> 3] |= (u_char)(1 << (i & 7));
+	}
+
+	return set;
+}
+
+void bpf_match_free(struct bpf_match_set* set)
+{
+	if (set->Next != NULL)
+		MATCH_FREE(set->Next);
+	if (set->Match != NULL)
+		MATCH_FREE(set->Match);
+	MATCH_FREE(set);
+}
+
+/*
+ * Runs the automaton on len bytes from the state *state, that is updated. Returns the Match of the
+ * first state that has one, or 0 at the end of the bytes.
+ */
+static u_int match_run(struct bpf_match_set* set, u_int32* state, u_char* p, u_int len)
+{
+	u_int32* next = set->Next;
+	u_int nclasses = set->NClasses;
+	u_int32 s = *state;
+	u_int i = 0;
+
+	while (i < len)
+	{
+		if (s == 0)
+		{
+			while (i < len && !MATCH_STARTS(set, p[i]))
+				i++;
+			if (i == len)
+				break;
+		}
+
+		s = next[s * nclasses + set->Classes[p[i]]];
+		i++;
+		if (set->Match[s] != 0)
+		{
+			*state = s;
+			return set->Match[s];
+		}
+	}
+
+	*state = s;
+	return 0;
+}
+
+u_int bpf_match_scan(struct bpf_match_set* set, u_char* p, u_int len)
+{
+	u_int32 state = 0;
+
+	return match_run(set, &state, p, len);
+}
+
+u_int __cdecl bpf_match(u_int32 id, u_char* p, u_int buflen, u_int32 off, u_int32 len)
+{
+	struct bpf_match_set* set;
+
+	if (id >= BPF_MATCH_MAX_SETS || off >= buflen)
+		return 0;
+
+	set = bpf_match_sets[id];
+	if (set == NULL)
+		return 0;
+
+	if (len > buflen - off)
+		len = buflen - off;
+
+	return bpf_match_scan(set, p + off, len);
+}
+
+u_int __cdecl bpf_match_frags(u_int32 id, struct bpf_frag* frags, u_int buflen, u_int32 off, u_int32 len)
+{
+	struct bpf_match_set* set;
+	u_int32 state = 0;
+	u_int n, m;
+
+	if (id >= BPF_MATCH_MAX_SETS || off >= buflen)
+		return 0;
+
+	set = bpf_match_sets[id];
+	if (set == NULL)
+		return 0;
+
+	if (len > buflen - off)
+		len = buflen - off;
+
+	// The automaton carries its state across the fragments, as if they were contiguous
+	while (off >= frags->len)
+	{
+		off -= frags->len;
+		frags++;
+	}
+
+	while (len != 0)
+	{
+		n = frags->len - off;
+		if (n > len)
+			n = len;
+
+		m = match_run(set, &state, frags->data + off, n);
+		if (m != 0)
+			return m;
+
+		len -= n;
+		off = 0;
+		frags++;
+	}
+
+	return 0;
+}
@@ -0,0 +1,1415 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Optimizer of the filtering programs, run at install time between the validation
+ * and the jitter.
+ *
+ * Classic BPF only has forward jumps, so the program is a DAG in instruction order:
+ * a single forward pass computes, for each instruction, what is known about A, X and
+ * the scratch memory on all the paths that reach it, and a single backward pass
+ * computes which of them are still needed. Each round of the optimizer uses these two
+ * analyses to rewrite instructions in place (turning the useless ones into "ja 0"),
+ * then drops the unreachable instructions and the "ja 0" and fixes the jump offsets.
+ * Rounds are repeated until nothing changes.
+ *
+ * Every rewrite preserves the exact semantics of bpf_filter(), including the rejection
+ * of the packet when a load goes past buflen: a packet load is only removed or replaced
+ * when the same load (or a farther one) has already been executed on every path.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_bpf.h"
+
+#ifdef WIN_NT_DRIVER
+#define OPT_ALLOC(_size)	ExAllocatePoolWithTag(NonPagedPool, (_size), '0BWA')
+#define OPT_FREE(_ptr)		ExFreePool(_ptr)
+#else
+#define OPT_ALLOC(_size)	malloc(_size)
+#define OPT_FREE(_ptr)		free(_ptr)
+#endif
+
+#define OPT_MAX_ROUNDS		8	///< The optimizer gives up after this number of rounds
+#define OPT_MAX_FACTS		8	///< Comparisons remembered along a path
+#define OPT_MAX_THREADING	32	///< Jumps followed when threading a single branch
+
+#define OPT_LIVE_A			0x1
+#define OPT_LIVE_X			0x2
+#define OPT_LIVE_M(_k)		(0x4 << (_k))
+
+/*!
+  \brief What the optimizer knows about the value of A, X or a scratch memory word.
+
+  The two parts are independent: a value can be known to come from a packet load,
+  to be a constant, both (when a comparison established the content of the packet)
+  or none.
+*/
+struct opt_value
+{
+	u_short Load;	///< Opcode of the packet load that produced the value, 0 if unknown
+	u_short Known;	///< TRUE if the value is Const
+	u_int32 Key;	///< k of the packet load
+	u_int32 Const;	///< The value, if Known
+};
+
+/*!
+  \brief Result of a JEQ on a packet load, that holds on the rest of the path.
+*/
+struct opt_fact
+{
+	u_short Load;	///< Opcode of the packet load
+	u_short Equal;	///< TRUE if the load is equal to Const, FALSE if it is different
+	u_int32 Key;	///< k of the packet load
+	u_int32 Const;
+};
+
+/*!
+  \brief Machine state at the beginning of an instruction, on all the paths that reach it.
+*/
+struct opt_state
+{
+	u_int Reached;						///< FALSE if no path reaches the instruction
+	u_int Valid;						///< buflen is at least Valid, i.e. loads ending before Valid cannot fail
+	struct opt_value A;
+	struct opt_value X;
+	struct opt_value M[BPF_MEMWORDS];
+	u_int FactsCount;
+	struct opt_fact Facts[OPT_MAX_FACTS];
+};
+
+//-------------------------------------------------------------------
+
+static void opt_nop(struct bpf_insn* p)
+{
+	p->code = BPF_JMP|BPF_JA;
+	p->jt = 0;
+	p->jf = 0;
+	p->k = 0;
+}
+
+static void opt_set(struct bpf_insn* p, u_short code, u_int32 k)
+{
+	p->code = code;
+	p->jt = 0;
+	p->jf = 0;
+	p->k = k;
+}
+
+static int opt_is_nop(struct bpf_insn* p)
+{
+	return p->code == (BPF_JMP|BPF_JA) && p->k == 0;
+}
+
+/*
+ * Size of the packet loads, 0 for the other instructions.
+ */
+static u_int opt_load_size(u_short code)
+{
+	switch (code)
+	{
+	case BPF_LD|BPF_W|BPF_ABS:
+	case BPF_LD|BPF_W|BPF_IND:
+		return 4;
+	case BPF_LD|BPF_H|BPF_ABS:
+	case BPF_LD|BPF_H|BPF_IND:
+		return 2;
+	case BPF_LD|BPF_B|BPF_ABS:
+	case BPF_LD|BPF_B|BPF_IND:
+	case BPF_LDX|BPF_MSH|BPF_B:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * The optimizer knows the classic instructions only, and leaves alone the programs
+ * using anything else (e.g. the TME extensions).
+ */
+static int opt_supported(u_short code)
+{
+	switch (code)
+	{
+	case BPF_RET|BPF_K:
+	case BPF_RET|BPF_A:
+	case BPF_LD|BPF_W|BPF_ABS:
+	case BPF_LD|BPF_H|BPF_ABS:
+	case BPF_LD|BPF_B|BPF_ABS:
+	case BPF_LD|BPF_W|BPF_IND:
+	case BPF_LD|BPF_H|BPF_IND:
+	case BPF_LD|BPF_B|BPF_IND:
+	case BPF_LD|BPF_W|BPF_LEN:
+	case BPF_LD|BPF_IMM:
+	case BPF_LD|BPF_MEM:
+	case BPF_LDX|BPF_W|BPF_LEN:
+	case BPF_LDX|BPF_IMM:
+	case BPF_LDX|BPF_MEM:
+	case BPF_LDX|BPF_MSH|BPF_B:
+	case BPF_ST:
+	case BPF_STX:
+	case BPF_ALU|BPF_ADD|BPF_K:
+	case BPF_ALU|BPF_SUB|BPF_K:
+	case BPF_ALU|BPF_MUL|BPF_K:
+	case BPF_ALU|BPF_DIV|BPF_K:
+	case BPF_ALU|BPF_AND|BPF_K:
+	case BPF_ALU|BPF_OR|BPF_K:
+	case BPF_ALU|BPF_LSH|BPF_K:
+	case BPF_ALU|BPF_RSH|BPF_K:
+	case BPF_ALU|BPF_ADD|BPF_X:
+	case BPF_ALU|BPF_SUB|BPF_X:
+	case BPF_ALU|BPF_MUL|BPF_X:
+	case BPF_ALU|BPF_DIV|BPF_X:
+	case BPF_ALU|BPF_AND|BPF_X:
+	case BPF_ALU|BPF_OR|BPF_X:
+	case BPF_ALU|BPF_LSH|BPF_X:
+	case BPF_ALU|BPF_RSH|BPF_X:
+	case BPF_ALU|BPF_NEG:
+	case BPF_MISC|BPF_TAX:
+	case BPF_MISC|BPF_TXA:
+	case BPF_JMP|BPF_JA:
+	case BPF_JMP|BPF_JGT|BPF_K:
+	case BPF_JMP|BPF_JGE|BPF_K:
+	case BPF_JMP|BPF_JEQ|BPF_K:
+	case BPF_JMP|BPF_JSET|BPF_K:
+	case BPF_JMP|BPF_JGT|BPF_X:
+	case BPF_JMP|BPF_JGE|BPF_X:
+	case BPF_JMP|BPF_JEQ|BPF_X:
+	case BPF_JMP|BPF_JSET|BPF_X:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+//-------------------------------------------------------------------
+// Values and facts
+
+static void opt_set_const(struct opt_value* v, u_int32 c)
+{
+	v->Load = 0;
+	v->Key = 0;
+	v->Known = TRUE;
+	v->Const = c;
+}
+
+static void opt_set_unknown(struct opt_value* v)
+{
+	v->Load = 0;
+	v->Key = 0;
+	v->Known = FALSE;
+	v->Const = 0;
+}
+
+/*
+ * Returns TRUE and the value in c if v is known to be a constant, directly or
+ * because of an earlier comparison.
+ */
+static int opt_resolve(struct opt_state* s, struct opt_value* v, u_int32* c)
+{
+	u_int i;
+
+	if (v->Known)
+	{
+		*c = v->Const;
+		return TRUE;
+	}
+
+	if (v->Load != 0)
+	{
+		for (i = 0; i < s->FactsCount; i++)
+		{
+			if (s->Facts[i].Equal && s->Facts[i].Load == v->Load && s->Facts[i].Key == v->Key)
+			{
+				*c = s->Facts[i].Const;
+				return TRUE;
+			}
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * TRUE if v is known to be different from c.
+ */
+static int opt_differs(struct opt_state* s, struct opt_value* v, u_int32 c)
+{
+	u_int32 known;
+	u_int i;
+
+	if (opt_resolve(s, v, &known))
+		return known != c;
+
+	if (v->Load != 0)
+	{
+		for (i = 0; i < s->FactsCount; i++)
+		{
+			if (!s->Facts[i].Equal && s->Facts[i].Load == v->Load && s->Facts[i].Key == v->Key && s->Facts[i].Const == c)
+				return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * TRUE if a and b are known to hold the same value.
+ */
+static int opt_same(struct opt_state* s, struct opt_value* a, struct opt_value* b)
+{
+	u_int32 ca, cb;
+
+	if (a->Load != 0 && a->Load == b->Load && a->Key == b->Key)
+		return TRUE;
+
+	return opt_resolve(s, a, &ca) && opt_resolve(s, b, &cb) && ca == cb;
+}
+
+static void opt_set_load(struct opt_state* s, struct opt_value* v, u_short load, u_int32 key)
+{
+	v->Load = load;
+	v->Key = key;
+	v->Known = FALSE;
+	v->Const = 0;
+	if (opt_resolve(s, v, &v->Const))
+		v->Known = TRUE;
+}
+
+static void opt_add_fact(struct opt_state* s, struct opt_value* v, int equal, u_int32 c)
+{
+	struct opt_fact* fact;
+
+	if (v->Load == 0)
+		return;
+
+	// Forget the oldest comparison when the table is full
+	if (s->FactsCount == OPT_MAX_FACTS)
+	{
+		RtlMoveMemory(&s->Facts[0], &s->Facts[1], (OPT_MAX_FACTS - 1) * sizeof(struct opt_fact));
+		s->FactsCount--;
+	}
+
+	fact = &s->Facts[s->FactsCount++];
+	fact->Load = v->Load;
+	fact->Key = v->Key;
+	fact->Equal = (u_short)equal;
+	fact->Const = c;
+}
+
+/*
+ * TRUE if a packet load of the given size at k is known not to fail, because on all the
+ * paths that lead to it a load has already checked buflen, or the same load has been
+ * executed. The ancillary loads never fail.
+ */
+static int opt_load_safe(struct opt_state* s, u_short load, u_int32 k)
+{
+	u_int size = opt_load_size(load);
+	u_int i;
+
+	if (BPF_IS_ANCILLARY(load, k))
+		return TRUE;
+
+	if (k <= 0xffffffff - size && k + size <= s->Valid)
+		return TRUE;
+
+	if ((s->A.Load == load && s->A.Key == k) || (s->X.Load == load && s->X.Key == k))
+		return TRUE;
+
+	for (i = 0; i < BPF_MEMWORDS; i++)
+	{
+		if (s->M[i].Load == load && s->M[i].Key == k)
+			return TRUE;
+	}
+
+	for (i = 0; i < s->FactsCount; i++)
+	{
+		if (s->Facts[i].Load == load && s->Facts[i].Key == k)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void opt_loaded(struct opt_state* s, u_short load, u_int32 k)
+{
+	u_int size = opt_load_size(load);
+
+	// An ancillary load checks nothing of the packet
+	if (BPF_IS_ANCILLARY(load, k))
+		return;
+
+	if (k <= 0xffffffff - size && k + size > s->Valid)
+		s->Valid = k + size;
+}
+
+//-------------------------------------------------------------------
+// Forward analysis
+
+static void opt_meet_value(struct opt_value* dst, struct opt_value* src)
+{
+	if (dst->Load != src->Load || dst->Key != src->Key)
+	{
+		dst->Load = 0;
+		dst->Key = 0;
+	}
+
+	if (!dst->Known || !src->Known || dst->Const != src->Const)
+	{
+		dst->Known = FALSE;
+		dst->Const = 0;
+	}
+}
+
+/*
+ * Merges the state of a new path reaching an instruction into what is known there.
+ */
+static void opt_meet(struct opt_state* dst, struct opt_state* src)
+{
+	u_int i, j, count;
+
+	if (!dst->Reached)
+	{
+		RtlCopyMemory(dst, src, sizeof(struct opt_state));
+		dst->Reached = TRUE;
+		return;
+	}
+
+	if (src->Valid < dst->Valid)
+		dst->Valid = src->Valid;
+
+	opt_meet_value(&dst->A, &src->A);
+	opt_meet_value(&dst->X, &src->X);
+	for (i = 0; i < BPF_MEMWORDS; i++)
+		opt_meet_value(&dst->M[i], &src->M[i]);
+
+	// Only the comparisons made on both paths still hold
+	count = 0;
+	for (i = 0; i < dst->FactsCount; i++)
+	{
+		for (j = 0; j < src->FactsCount; j++)
+		{
+			if (dst->Facts[i].Load == src->Facts[j].Load && dst->Facts[i].Key == src->Facts[j].Key &&
+				dst->Facts[i].Equal == src->Facts[j].Equal && dst->Facts[i].Const == src->Facts[j].Const)
+			{
+				dst->Facts[count++] = dst->Facts[i];
+				break;
+			}
+		}
+	}
+	dst->FactsCount = count;
+}
+
+/*
+ * Computes the result of an ALU operation, FALSE if it cannot be computed at install time.
+ */
+static int opt_alu(u_short op, u_int32 a, u_int32 b, u_int32* result)
+{
+	switch (op)
+	{
+	case BPF_ADD:
+		*result = a + b;
+		return TRUE;
+	case BPF_SUB:
+		*result = a - b;
+		return TRUE;
+	case BPF_MUL:
+		*result = a * b;
+		return TRUE;
+	case BPF_DIV:
+		if (b == 0)
+			return FALSE;
+		*result = a / b;
+		return TRUE;
+	case BPF_AND:
+		*result = a & b;
+		return TRUE;
+	case BPF_OR:
+		*result = a | b;
+		return TRUE;
+	// Shifting by 32 or more is left to the CPU
+	case BPF_LSH:
+		if (b >= 32)
+			return FALSE;
+		*result = a << b;
+		return TRUE;
+	case BPF_RSH:
+		if (b >= 32)
+			return FALSE;
+		*result = a >> b;
+		return TRUE;
+	case BPF_NEG:
+		*result = (u_int32)-((int)a);
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/*
+ * Outcome of a conditional jump: 1 if taken, 0 if not taken, -1 if it depends on the packet.
+ * Same semantics as bpf_filter(), i.e. the K comparisons are signed.
+ */
+static int opt_eval_jump(struct opt_state* s, struct bpf_insn* p)
+{
+	u_int32 a, x;
+	int has_a = opt_resolve(s, &s->A, &a);
+
+	if (BPF_SRC(p->code) == BPF_X)
+	{
+		if (!opt_resolve(s, &s->X, &x))
+		{
+			if (BPF_OP(p->code) == BPF_JEQ && opt_same(s, &s->A, &s->X))
+				return 1;
+			return -1;
+		}
+	}
+	else
+		x = p->k;
+
+	if (BPF_OP(p->code) == BPF_JEQ && !has_a)
+		return opt_differs(s, &s->A, x) ? 0 : -1;
+
+	if (!has_a)
+		return -1;
+
+	switch (p->code)
+	{
+	case BPF_JMP|BPF_JGT|BPF_K:
+		return (int)a > (int)x;
+	case BPF_JMP|BPF_JGE|BPF_K:
+		return (int)a >= (int)x;
+	case BPF_JMP|BPF_JEQ|BPF_K:
+	case BPF_JMP|BPF_JEQ|BPF_X:
+		return a == x;
+	case BPF_JMP|BPF_JGT|BPF_X:
+		return a > x;
+	case BPF_JMP|BPF_JGE|BPF_X:
+		return a >= x;
+	default:
+		return (a & x) != 0;
+	}
+}
+
+/*
+ * Records in s what a taken (or not taken) conditional jump tells about A.
+ */
+static void opt_branch(struct opt_state* s, struct bpf_insn* p, int taken)
+{
+	u_int32 c;
+
+	if (BPF_OP(p->code) != BPF_JEQ)
+		return;
+
+	if (BPF_SRC(p->code) == BPF_X)
+	{
+		if (!opt_resolve(s, &s->X, &c))
+			return;
+	}
+	else
+		c = p->k;
+
+	opt_add_fact(s, &s->A, taken, c);
+	if (taken)
+	{
+		s->A.Known = TRUE;
+		s->A.Const = c;
+	}
+}
+
+/*
+ * Updates s with the effect of a non-jump instruction.
+ */
+static void opt_transfer(struct opt_state* s, struct bpf_insn* p)
+{
+	u_int32 a, b;
+
+	switch (p->code)
+	{
+	case BPF_LD|BPF_W|BPF_ABS:
+	case BPF_LD|BPF_H|BPF_ABS:
+	case BPF_LD|BPF_B|BPF_ABS:
+		opt_set_load(s, &s->A, p->code, p->k);
+		opt_loaded(s, p->code, p->k);
+		break;
+
+	case BPF_LD|BPF_W|BPF_IND:
+	case BPF_LD|BPF_H|BPF_IND:
+	case BPF_LD|BPF_B|BPF_IND:
+		opt_set_unknown(&s->A);
+		break;
+
+	case BPF_LDX|BPF_MSH|BPF_B:
+		opt_set_load(s, &s->X, p->code, p->k);
+		opt_loaded(s, p->code, p->k);
+		break;
+
+	case BPF_LD|BPF_W|BPF_LEN:
+		opt_set_load(s, &s->A, BPF_LD|BPF_W|BPF_LEN, 0);
+		break;
+
+	case BPF_LDX|BPF_W|BPF_LEN:
+		opt_set_load(s, &s->X, BPF_LD|BPF_W|BPF_LEN, 0);
+		break;
+
+	case BPF_LD|BPF_IMM:
+		opt_set_const(&s->A, p->k);
+		break;
+
+	case BPF_LDX|BPF_IMM:
+		opt_set_const(&s->X, p->k);
+		break;
+
+	case BPF_LD|BPF_MEM:
+		s->A = s->M[p->k];
+		break;
+
+	case BPF_LDX|BPF_MEM:
+		s->X = s->M[p->k];
+		break;
+
+	case BPF_ST:
+		s->M[p->k] = s->A;
+		break;
+
+	case BPF_STX:
+		s->M[p->k] = s->X;
+		break;
+
+	case BPF_MISC|BPF_TAX:
+		s->X = s->A;
+		break;
+
+	case BPF_MISC|BPF_TXA:
+		s->A = s->X;
+		break;
+
+	default:
+		// ALU
+		if (BPF_SRC(p->code) == BPF_X && BPF_OP(p->code) != BPF_NEG)
+		{
+			if (!opt_resolve(s, &s->X, &b))
+			{
+				opt_set_unknown(&s->A);
+				break;
+			}
+		}
+		else
+			b = p->k;
+
+		if (opt_resolve(s, &s->A, &a) && opt_alu(BPF_OP(p->code), a, b, &a))
+			opt_set_const(&s->A, a);
+		else
+			opt_set_unknown(&s->A);
+		break;
+	}
+}
+
+static void opt_analyze(struct bpf_insn* f, u_int len, struct opt_state* states)
+{
+	struct opt_state s, t;
+	struct bpf_insn* p;
+	u_int i;
+	int taken;
+
+	RtlZeroMemory(states, len * sizeof(struct opt_state));
+
+	// bpf_filter() starts with everything zeroed
+	states[0].Reached = TRUE;
+	opt_set_const(&states[0].A, 0);
+	opt_set_const(&states[0].X, 0);
+	for (i = 0; i < BPF_MEMWORDS; i++)
+		opt_set_const(&states[0].M[i], 0);
+
+	for (i = 0; i < len; i++)
+	{
+		if (!states[i].Reached)
+			continue;
+
+		p = &f[i];
+		RtlCopyMemory(&s, &states[i], sizeof(s));
+
+		switch (BPF_CLASS(p->code))
+		{
+		case BPF_RET:
+			break;
+
+		case BPF_JMP:
+			if (p->code == (BPF_JMP|BPF_JA))
+			{
+				opt_meet(&states[i + 1 + p->k], &s);
+				break;
+			}
+
+			taken = opt_eval_jump(&s, p);
+			if (taken != 0)
+			{
+				RtlCopyMemory(&t, &s, sizeof(t));
+				opt_branch(&t, p, TRUE);
+				opt_meet(&states[i + 1 + p->jt], &t);
+			}
+			if (taken != 1)
+			{
+				RtlCopyMemory(&t, &s, sizeof(t));
+				opt_branch(&t, p, FALSE);
+				opt_meet(&states[i + 1 + p->jf], &t);
+			}
+			break;
+
+		default:
+			opt_transfer(&s, p);
+			opt_meet(&states[i + 1], &s);
+			break;
+		}
+	}
+}
+
+//-------------------------------------------------------------------
+// Constant folding and redundant loads
+
+/*
+ * Replaces a packet load, an access to the scratch memory or a load of the packet length
+ * with something cheaper, if the value is already known or already in a register.
+ * v is what the instruction loads, into A or X depending on its class.
+ */
+static int opt_fold_load(struct opt_state* s, struct bpf_insn* p, struct opt_value* v)
+{
+	int to_x = (BPF_CLASS(p->code) == BPF_LDX);
+	struct opt_value* reg = to_x ? &s->X : &s->A;
+	struct opt_value* other = to_x ? &s->A : &s->X;
+	u_int32 c;
+	u_int i;
+
+	if (opt_same(s, reg, v))
+	{
+		opt_nop(p);
+		return TRUE;
+	}
+
+	if (opt_resolve(s, v, &c))
+	{
+		if (p->code == (to_x ? BPF_LDX|BPF_IMM : BPF_LD|BPF_IMM) && p->k == c)
+			return FALSE;
+		opt_set(p, to_x ? BPF_LDX|BPF_IMM : BPF_LD|BPF_IMM, c);
+		return TRUE;
+	}
+
+	if (v->Load == 0)
+		return FALSE;
+
+	if (other->Load == v->Load && other->Key == v->Key)
+	{
+		opt_set(p, to_x ? BPF_MISC|BPF_TAX : BPF_MISC|BPF_TXA, 0);
+		return TRUE;
+	}
+
+	if (BPF_MODE(p->code) == BPF_MEM)
+		return FALSE;
+
+	for (i = 0; i < BPF_MEMWORDS; i++)
+	{
+		if (s->M[i].Load == v->Load && s->M[i].Key == v->Key)
+		{
+			opt_set(p, to_x ? BPF_LDX|BPF_MEM : BPF_LD|BPF_MEM, i);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static int opt_fold_alu(struct opt_state* s, struct bpf_insn* p)
+{
+	u_short op = BPF_OP(p->code);
+	u_int32 a, b, result;
+	u_int n;
+
+	if (op != BPF_NEG && BPF_SRC(p->code) == BPF_X)
+	{
+		if (!opt_resolve(s, &s->X, &b))
+			return FALSE;
+
+		if (op == BPF_DIV && b == 0)
+		{
+			// bpf_filter() rejects the packet
+			opt_set(p, BPF_RET|BPF_K, 0);
+			return TRUE;
+		}
+
+		if ((op == BPF_LSH || op == BPF_RSH) && b >= 32)
+			return FALSE;
+
+		opt_set(p, BPF_ALU|op|BPF_K, b);
+		opt_fold_alu(s, p);
+		return TRUE;
+	}
+
+	b = p->k;
+
+	if (opt_resolve(s, &s->A, &a) && opt_alu(op, a, b, &result))
+	{
+		opt_set(p, BPF_LD|BPF_IMM, result);
+		return TRUE;
+	}
+
+	if (op == BPF_NEG)
+		return FALSE;
+
+	// Identities
+	if (((op == BPF_ADD || op == BPF_SUB || op == BPF_OR || op == BPF_LSH || op == BPF_RSH) && b == 0) ||
+		((op == BPF_MUL || op == BPF_DIV) && b == 1) ||
+		(op == BPF_AND && b == 0xffffffff))
+	{
+		opt_nop(p);
+		return TRUE;
+	}
+
+	if ((op == BPF_AND || op == BPF_MUL) && b == 0)
+	{
+		opt_set(p, BPF_LD|BPF_IMM, 0);
+		return TRUE;
+	}
+
+	// Multiplications and divisions by powers of two
+	if ((op == BPF_MUL || op == BPF_DIV) && (b & (b - 1)) == 0)
+	{
+		for (n = 0; (b >> n) != 1; n++)
+			;
+		opt_set(p, BPF_ALU|(op == BPF_MUL ? BPF_LSH : BPF_RSH)|BPF_K, n);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static int opt_fold_insn(struct opt_state* s, struct bpf_insn* p)
+{
+	struct opt_value v;
+	u_int32 c;
+	int taken;
+
+	switch (p->code)
+	{
+	case BPF_LD|BPF_W|BPF_ABS:
+	case BPF_LD|BPF_H|BPF_ABS:
+	case BPF_LD|BPF_B|BPF_ABS:
+	case BPF_LDX|BPF_MSH|BPF_B:
+		if (!opt_load_safe(s, p->code, p->k))
+			return FALSE;
+		opt_set_load(s, &v, p->code, p->k);
+		return opt_fold_load(s, p, &v);
+
+	case BPF_LD|BPF_W|BPF_IND:
+	case BPF_LD|BPF_H|BPF_IND:
+	case BPF_LD|BPF_B|BPF_IND:
+		// X + k wraps in the same way in bpf_filter(), but an indirect load never reads the metadata
+		if (!opt_resolve(s, &s->X, &c) || c + p->k - BPF_AD_OFF < BPF_AD_AREA)
+			return FALSE;
+		opt_set(p, (u_short)(BPF_LD|BPF_SIZE(p->code)|BPF_ABS), c + p->k);
+		return TRUE;
+
+	case BPF_LD|BPF_W|BPF_LEN:
+	case BPF_LDX|BPF_W|BPF_LEN:
+		opt_set_load(s, &v, BPF_LD|BPF_W|BPF_LEN, 0);
+		return opt_fold_load(s, p, &v);
+
+	case BPF_LD|BPF_IMM:
+	case BPF_LDX|BPF_IMM:
+		opt_set_const(&v, p->k);
+		return opt_fold_load(s, p, &v);
+
+	case BPF_LD|BPF_MEM:
+	case BPF_LDX|BPF_MEM:
+		v = s->M[p->k];
+		return opt_fold_load(s, p, &v);
+
+	case BPF_ST:
+		if (!opt_same(s, &s->M[p->k], &s->A))
+			return FALSE;
+		opt_nop(p);
+		return TRUE;
+
+	case BPF_STX:
+		if (!opt_same(s, &s->M[p->k], &s->X))
+			return FALSE;
+		opt_nop(p);
+		return TRUE;
+
+	case BPF_MISC|BPF_TAX:
+	case BPF_MISC|BPF_TXA:
+		if (!opt_same(s, &s->A, &s->X))
+			return FALSE;
+		opt_nop(p);
+		return TRUE;
+
+	case BPF_RET|BPF_A:
+		if (!opt_resolve(s, &s->A, &c))
+			return FALSE;
+		opt_set(p, BPF_RET|BPF_K, c);
+		return TRUE;
+
+	case BPF_RET|BPF_K:
+		return FALSE;
+
+	case BPF_JMP|BPF_JA:
+		return FALSE;
+
+	default:
+		break;
+	}
+
+	if (BPF_CLASS(p->code) == BPF_ALU)
+		return opt_fold_alu(s, p);
+
+	// Conditional jumps
+	if (p->jt == p->jf)
+	{
+		opt_set(p, BPF_JMP|BPF_JA, p->jt);
+		return TRUE;
+	}
+
+	taken = opt_eval_jump(s, p);
+	if (taken >= 0)
+	{
+		opt_set(p, BPF_JMP|BPF_JA, taken ? p->jt : p->jf);
+		return TRUE;
+	}
+
+	// JGT and JGE compare X unsigned but K signed, only JEQ and JSET can take a constant X
+	if (BPF_SRC(p->code) == BPF_X && (BPF_OP(p->code) == BPF_JEQ || BPF_OP(p->code) == BPF_JSET) &&
+		opt_resolve(s, &s->X, &c))
+	{
+		p->code = (u_short)(BPF_JMP|BPF_OP(p->code)|BPF_K);
+		p->k = c;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static int opt_fold(struct bpf_insn* f, u_int len, struct opt_state* states)
+{
+	int changed = FALSE;
+	u_int i;
+
+	for (i = 0; i < len; i++)
+	{
+		if (states[i].Reached && opt_fold_insn(&states[i], &f[i]))
+			changed = TRUE;
+	}
+
+	return changed;
+}
+
+//-------------------------------------------------------------------
+// Jump threading
+
+/*
+ * Follows the jumps starting at target whose outcome is known from s, and returns
+ * where the execution really continues.
+ */
+static u_int opt_follow(struct bpf_insn* f, u_int len, struct opt_state* s, u_int target)
+{
+	struct bpf_insn* p;
+	u_int steps;
+	int taken;
+
+	for (steps = 0; steps < OPT_MAX_THREADING && target < len; steps++)
+	{
+		p = &f[target];
+
+		if (BPF_CLASS(p->code) != BPF_JMP)
+			break;
+
+		if (p->code == (BPF_JMP|BPF_JA))
+		{
+			target += 1 + p->k;
+			continue;
+		}
+
+		taken = opt_eval_jump(s, p);
+		if (taken < 0)
+			break;
+
+		opt_branch(s, p, taken);
+		target += 1 + (taken ? p->jt : p->jf);
+	}
+
+	return target;
+}
+
+static int opt_thread(struct bpf_insn* f, u_int len, struct opt_state* states)
+{
+	struct opt_state s;
+	struct bpf_insn* p;
+	u_int i, target;
+	int changed = FALSE;
+
+	for (i = 0; i < len; i++)
+	{
+		p = &f[i];
+
+		if (!states[i].Reached || BPF_CLASS(p->code) != BPF_JMP)
+			continue;
+
+		if (p->code == (BPF_JMP|BPF_JA))
+		{
+			RtlCopyMemory(&s, &states[i], sizeof(s));
+			target = opt_follow(f, len, &s, i + 1 + p->k);
+
+			// A jump to a return is the return itself
+			if (BPF_CLASS(f[target].code) == BPF_RET)
+			{
+				*p = f[target];
+				changed = TRUE;
+			}
+			else if (target != i + 1 + p->k)
+			{
+				p->k = target - i - 1;
+				changed = TRUE;
+			}
+			continue;
+		}
+
+		RtlCopyMemory(&s, &states[i], sizeof(s));
+		opt_branch(&s, p, TRUE);
+		target = opt_follow(f, len, &s, i + 1 + p->jt);
+		if (target != i + 1 + p->jt && target - i - 1 <= 255)
+		{
+			p->jt = (u_char)(target - i - 1);
+			changed = TRUE;
+		}
+
+		RtlCopyMemory(&s, &states[i], sizeof(s));
+		opt_branch(&s, p, FALSE);
+		target = opt_follow(f, len, &s, i + 1 + p->jf);
+		if (target != i + 1 + p->jf && target - i - 1 <= 255)
+		{
+			p->jf = (u_char)(target - i - 1);
+			changed = TRUE;
+		}
+	}
+
+	return changed;
+}
+
+//-------------------------------------------------------------------
+// Liveness and dead code
+
+static u_int32 opt_live_out(struct bpf_insn* f, u_int i, u_int32* live)
+{
+	struct bpf_insn* p = &f[i];
+
+	switch (BPF_CLASS(p->code))
+	{
+	case BPF_RET:
+		return 0;
+	case BPF_JMP:
+		if (p->code == (BPF_JMP|BPF_JA))
+			return live[i + 1 + p->k];
+		return live[i + 1 + p->jt] | live[i + 1 + p->jf];
+	default:
+		return live[i + 1];
+	}
+}
+
+/*
+ * Computes in live[i] the registers and scratch memory words that are read before being
+ * written from the start of instruction i.
+ */
+static void opt_liveness(struct bpf_insn* f, u_int len, struct opt_state* states, u_int32* live)
+{
+	struct bpf_insn* p;
+	u_int32 in;
+	u_int i;
+
+	for (i = len; i-- > 0;)
+	{
+		p = &f[i];
+
+		if (!states[i].Reached)
+		{
+			live[i] = 0;
+			continue;
+		}
+
+		in = opt_live_out(f, i, live);
+
+		switch (BPF_CLASS(p->code))
+		{
+		case BPF_RET:
+			if (BPF_RVAL(p->code) == BPF_A)
+				in |= OPT_LIVE_A;
+			break;
+
+		case BPF_LD:
+			in &= ~OPT_LIVE_A;
+			if (BPF_MODE(p->code) == BPF_IND)
+				in |= OPT_LIVE_X;
+			else if (BPF_MODE(p->code) == BPF_MEM)
+				in |= OPT_LIVE_M(p->k);
+			break;
+
+		case BPF_LDX:
+			in &= ~OPT_LIVE_X;
+			if (BPF_MODE(p->code) == BPF_MEM)
+				in |= OPT_LIVE_M(p->k);
+			break;
+
+		case BPF_ST:
+			in &= ~OPT_LIVE_M(p->k);
+			in |= OPT_LIVE_A;
+			break;
+
+		case BPF_STX:
+			in &= ~OPT_LIVE_M(p->k);
+			in |= OPT_LIVE_X;
+			break;
+
+		case BPF_ALU:
+			in |= OPT_LIVE_A;
+			if (BPF_OP(p->code) != BPF_NEG && BPF_SRC(p->code) == BPF_X)
+				in |= OPT_LIVE_X;
+			break;
+
+		case BPF_JMP:
+			if (p->code != (BPF_JMP|BPF_JA))
+			{
+				in |= OPT_LIVE_A;
+				if (BPF_SRC(p->code) == BPF_X)
+					in |= OPT_LIVE_X;
+			}
+			break;
+
+		default:
+			if (BPF_MISCOP(p->code) == BPF_TAX)
+				in = (in & ~OPT_LIVE_X) | OPT_LIVE_A;
+			else
+				in = (in & ~OPT_LIVE_A) | OPT_LIVE_X;
+			break;
+		}
+
+		live[i] = in;
+	}
+}
+
+/*
+ * Removes the instructions that only write registers or scratch memory words that are
+ * never read afterwards, unless they can reject the packet.
+ */
+static int opt_eliminate(struct bpf_insn* f, u_int len, struct opt_state* states, u_int32* live)
+{
+	struct bpf_insn* p;
+	u_int32 out, def;
+	u_int i;
+	int changed = FALSE;
+
+	for (i = 0; i < len; i++)
+	{
+		p = &f[i];
+
+		if (!states[i].Reached)
+			continue;
+
+		switch (BPF_CLASS(p->code))
+		{
+		case BPF_LD:
+			if (BPF_MODE(p->code) == BPF_IND)
+				continue;
+			if (BPF_MODE(p->code) == BPF_ABS && !opt_load_safe(&states[i], p->code, p->k))
+				continue;
+			def = OPT_LIVE_A;
+			break;
+
+		case BPF_LDX:
+			if (BPF_MODE(p->code) == BPF_MSH && !opt_load_safe(&states[i], p->code, p->k))
+				continue;
+			def = OPT_LIVE_X;
+			break;
+
+		case BPF_ST:
+		case BPF_STX:
+			def = OPT_LIVE_M(p->k);
+			break;
+
+		case BPF_ALU:
+			// DIV X by a zero X rejects the packet (the known X have already been folded)
+			if (p->code == (BPF_ALU|BPF_DIV|BPF_X))
+				continue;
+			def = OPT_LIVE_A;
+			break;
+
+		case BPF_MISC:
+			def = (BPF_MISCOP(p->code) == BPF_TAX) ? OPT_LIVE_X : OPT_LIVE_A;
+			break;
+
+		default:
+			continue;
+		}
+
+		out = opt_live_out(f, i, live);
+		if ((out & def) == 0)
+		{
+			opt_nop(p);
+			changed = TRUE;
+		}
+	}
+
+	return changed;
+}
+
+//-------------------------------------------------------------------
+// Load merging
+
+static int opt_is_reject(struct bpf_insn* p)
+{
+	return p->code == (BPF_RET|BPF_K) && p->k == 0;
+}
+
+/*
+ * Merges two adjacent byte (or halfword) loads, each compared for equality with a
+ * constant and rejecting the packet if different, into a single halfword (or word)
+ * load and comparison, e.g. tcpdump's "ldh [12]; jeq #a jt 0 jf drop; ldh [14];
+ * jeq #b jt ok jf drop". The merged load can fail where the first of the original
+ * loads did not, but then the original program rejects the packet as well.
+ */
+static int opt_merge(struct bpf_insn* f, u_int len, struct opt_state* states, u_int32* live, u_char* target)
+{
+	struct bpf_insn *ld1, *jeq1, *ld2, *jeq2;
+	u_int i, size, t, jt, jf;
+	u_int32 limit, k, c;
+	int changed = FALSE;
+
+	// Instructions reached by a jump, other than from the previous instruction
+	RtlZeroMemory(target, len);
+	for (i = 0; i < len; i++)
+	{
+		if (!states[i].Reached || BPF_CLASS(f[i].code) != BPF_JMP)
+			continue;
+		if (f[i].code == (BPF_JMP|BPF_JA))
+			target[i + 1 + f[i].k] |= (f[i].k != 0);
+		else
+		{
+			target[i + 1 + f[i].jt] |= (f[i].jt != 0);
+			target[i + 1 + f[i].jf] |= (f[i].jf != 0);
+		}
+	}
+
+	for (i = 0; i + 3 < len; i++)
+	{
+		ld1 = &f[i];
+		jeq1 = &f[i + 1];
+		ld2 = &f[i + 2];
+		jeq2 = &f[i + 3];
+
+		if (!states[i].Reached || target[i + 1] || target[i + 2] || target[i + 3])
+			continue;
+
+		if (ld1->code == (BPF_LD|BPF_B|BPF_ABS))
+			size = 1;
+		else if (ld1->code == (BPF_LD|BPF_H|BPF_ABS))
+			size = 2;
+		else
+			continue;
+
+		if (ld2->code != ld1->code || jeq1->code != (BPF_JMP|BPF_JEQ|BPF_K) || jeq2->code != (BPF_JMP|BPF_JEQ|BPF_K))
+			continue;
+
+		// The fields of the metadata are not bytes in a row
+		if (ld1->k - BPF_AD_OFF < BPF_AD_AREA || ld2->k - BPF_AD_OFF < BPF_AD_AREA)
+			continue;
+
+		limit = (size == 1) ? 0xff : 0xffff;
+		if (jeq1->jt != 0 || jeq1->k > limit || jeq2->k > limit)
+			continue;
+
+		// Both mismatches must reject, and A must not be used after the second comparison
+		t = i + 4;
+		if (!opt_is_reject(&f[i + 2 + jeq1->jf]) || !opt_is_reject(&f[t + jeq2->jf]) || (live[t + jeq2->jt] & OPT_LIVE_A))
+			continue;
+
+		if (ld2->k == ld1->k + size && ld1->k <= 0xffffffff - 2 * size)
+		{
+			k = ld1->k;
+			c = (jeq1->k << (8 * size)) | jeq2->k;
+		}
+		else if (ld1->k == ld2->k + size && ld2->k <= 0xffffffff - 2 * size)
+		{
+			k = ld2->k;
+			c = (jeq2->k << (8 * size)) | jeq1->k;
+		}
+		else
+			continue;
+
+		jt = t + jeq2->jt - (i + 2);
+		jf = t + jeq2->jf - (i + 2);
+		if (jt > 255 || jf > 255)
+			continue;
+
+		opt_set(ld1, (u_short)(size == 1 ? BPF_LD|BPF_H|BPF_ABS : BPF_LD|BPF_W|BPF_ABS), k);
+		opt_set(jeq1, BPF_JMP|BPF_JEQ|BPF_K, c);
+		jeq1->jt = (u_char)jt;
+		jeq1->jf = (u_char)jf;
+		opt_nop(ld2);
+		opt_nop(jeq2);
+		changed = TRUE;
+	}
+
+	return changed;
+}
+
+//-------------------------------------------------------------------
+// Compaction
+
+/*
+ * Removes the unreachable instructions and the "ja 0", and returns the new length.
+ * newpos has room for len + 1 entries, reached for len.
+ */
+static u_int opt_compact(struct bpf_insn* f, u_int len, u_int* newpos, u_char* reached)
+{
+	struct bpf_insn* p;
+	u_int i, n, t;
+
+	RtlZeroMemory(reached, len);
+	reached[0] = TRUE;
+	for (i = 0; i < len; i++)
+	{
+		p = &f[i];
+		if (!reached[i])
+			continue;
+
+		switch (BPF_CLASS(p->code))
+		{
+		case BPF_RET:
+			break;
+		case BPF_JMP:
+			if (p->code == (BPF_JMP|BPF_JA))
+				reached[i + 1 + p->k] = TRUE;
+			else
+			{
+				reached[i + 1 + p->jt] = TRUE;
+				reached[i + 1 + p->jf] = TRUE;
+			}
+			break;
+		default:
+			reached[i + 1] = TRUE;
+			break;
+		}
+	}
+
+	// newpos[i] is where instruction i (or the first one kept after it) ends up
+	n = 0;
+	for (i = 0; i < len; i++)
+	{
+		u_int keep = reached[i] && !opt_is_nop(&f[i]);
+
+		newpos[i] = n;
+		if (keep)
+			n++;
+		else
+			f[i].code = BPF_SEPARATION;	// marks the dropped instructions until the copy
+	}
+	newpos[len] = n;
+
+	for (i = 0; i < len; i++)
+	{
+		p = &f[i];
+		if (p->code == BPF_SEPARATION || BPF_CLASS(p->code) != BPF_JMP)
+			continue;
+
+		if (p->code == (BPF_JMP|BPF_JA))
+		{
+			t = i + 1 + p->k;
+			p->k = newpos[t] - newpos[i] - 1;
+		}
+		else
+		{
+			t = i + 1 + p->jt;
+			p->jt = (u_char)(newpos[t] - newpos[i] - 1);
+			t = i + 1 + p->jf;
+			p->jf = (u_char)(newpos[t] - newpos[i] - 1);
+		}
+	}
+
+	for (i = 0; i < len; i++)
+	{
+		if (f[i].code != BPF_SEPARATION)
+			f[newpos[i]] = f[i];
+	}
+
+	return n;
+}
+
+//-------------------------------------------------------------------
+
+int bpf_optimize(struct bpf_insn* f, int len)
+{
+	struct opt_state* states;
+	u_int32* live;
+	u_int* newpos;
+	u_char* marks;
+	u_int n, round, i;
+	int changed;
+
+	if (len < 1 || len > BPF_MAXINSNS)
+		return len;
+
+	for (i = 0; i < (u_int)len; i++)
+	{
+		if (!opt_supported(f[i].code))
+			return len;
+	}
+
+	n = (u_int)len;
+
+	states = (struct opt_state*)OPT_ALLOC(n * sizeof(struct opt_state));
+	live = (u_int32*)OPT_ALLOC(n * sizeof(u_int32));
+	newpos = (u_int*)OPT_ALLOC((n + 1) * sizeof(u_int));
+	marks = (u_char*)OPT_ALLOC(n);
+
+	if (states != NULL && live != NULL && newpos != NULL && marks != NULL)
+	{
+		for (round = 0; round < OPT_MAX_ROUNDS; round++)
+		{
+			opt_analyze(f, n, states);
+
+			changed = opt_fold(f, n, states);
+			if (opt_thread(f, n, states))
+				changed = TRUE;
+
+			opt_liveness(f, n, states, live);
+			if (opt_eliminate(f, n, states, live))
+				changed = TRUE;
+			if (opt_merge(f, n, states, live, marks))
+				changed = TRUE;
+
+			i = opt_compact(f, n, newpos, marks);
+			if (i != n)
+				changed = TRUE;
+			n = i;
+
+			if (!changed)
+				break;
+		}
+	}
+
+	if (states != NULL)
+		OPT_FREE(states);
+	if (live != NULL)
+		OPT_FREE(live);
+	if (newpos != NULL)
+		OPT_FREE(newpos);
+	if (marks != NULL)
+		OPT_FREE(marks);
+
+	return (int)n;
+}
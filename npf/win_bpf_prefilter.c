@@ -0,0 +1,339 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Prefilter of the necessary conditions of a program, run at install time after the validation.
+ *
+ * Most filters reject most packets on a few comparisons of bytes at fixed offsets: the ethertype,
+ * the IP protocol, the fragment offset. A forward pass follows the value of A, when it is a byte,
+ * halfword or word of the packet at a constant offset, possibly masked, and collects the comparisons
+ * of these values that hold on every path from the start to an instruction: the outcome of a jump
+ * is a condition on its own edge. The conditions holding at all the returns that can accept the
+ * packet are necessary: a packet that fails one of them, or that is too short to hold their bytes,
+ * is rejected by the program whatever the rest of its code does.
+ *
+ * The necessary conditions are then packed as the mask and value of the bytes of one or two windows
+ * of 16 bytes, which the tap compares with a single vector operation each before running the filter.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_bpf.h"
+
+// The kernel can use the SSE registers without saving them on x86-64 only
+#if defined(_M_X64) || (defined(NPF_HOST_BUILD) && defined(__SSE2__))
+#include <emmintrin.h>
+#define PREFILTER_SSE2
+#endif
+
+#ifdef WIN_NT_DRIVER
+#define PREFILTER_ALLOC(_size)	ExAllocatePoolWithTag(NonPagedPool, (_size), '8BWA')
+#define PREFILTER_FREE(_ptr)	ExFreePool(_ptr)
+#else
+#define PREFILTER_ALLOC(_size)	malloc(_size)
+#define PREFILTER_FREE(_ptr)	free(_ptr)
+#endif
+
+#define PREFILTER_CANDIDATES	64		///< Comparisons followed by the analysis, one bit each
+#define PREFILTER_MAX_OFFSET	0xffff	///< Loads farther than this are not followed
+
+/*
+ * What is known on all the paths reaching an instruction
+ */
+struct prefilter_state
+{
+	u_int reached;
+	u_int load;					///< A is the packet load below, masked; otherwise it is unknown
+	u_int32 offset;
+	u_int32 size;
+	u_int32 mask;
+	ULONGLONG holds;			///< Bit c is set if candidate c holds
+};
+
+static void prefilter_meet(struct prefilter_state* to, struct prefilter_state* from, ULONGLONG cond)
+{
+	if (!to->reached)
+	{
+		*to = *from;
+		to->holds |= cond;
+		return;
+	}
+
+	to->holds &= from->holds | cond;
+	if (to->load && (!from->load || to->offset != from->offset || to->size != from->size || to->mask != from->mask))
+		to->load = FALSE;
+}
+
+/*
+ * A new candidate for the value of A at s, returns its bit or 0 if there are too many
+ */
+static ULONGLONG prefilter_candidate(struct bpf_condition* cands, u_int* count, struct prefilter_state* s, u_int32 mask, u_int32 value)
+{
+	struct bpf_condition* c;
+
+	if (*count == PREFILTER_CANDIDATES)
+		return 0;
+
+	c = &cands[*count];
+	c->offset = s->offset;
+	c->size = s->size;
+	c->mask = mask;
+	c->value = value;
+
+	return (ULONGLONG)1 << (*count)++;
+}
+
+int bpf_validate_conditions(struct bpf_insn* f, int len, struct bpf_condition* conds, u_int max)
+{
+	struct prefilter_state* states;
+	struct prefilter_state* s;
+	struct prefilter_state next;
+	struct bpf_condition* cands;
+	struct bpf_insn* p;
+	ULONGLONG necessary = 0, ct, cf;
+	u_int32 bits;
+	u_int ncands = 0, count = 0, accepting = FALSE;
+	u_int c, j;
+	int i;
+
+	if (len < 1)
+		return 0;
+
+	states = (struct prefilter_state*)PREFILTER_ALLOC(len * sizeof(struct prefilter_state) + PREFILTER_CANDIDATES * sizeof(struct bpf_condition));
+	if (states == NULL)
+		return 0;
+	RtlZeroMemory(states, len * sizeof(struct prefilter_state));
+	cands = (struct bpf_condition*)(states + len);
+
+	states[0].reached = TRUE;
+
+	for (i = 0; i < len; i++)
+	{
+		p = &f[i];
+		s = &states[i];
+
+		if (!s->reached)
+			continue;
+
+		switch (BPF_CLASS(p->code))
+		{
+		case BPF_RET:
+			if (p->code != (BPF_RET|BPF_K) || p->k != 0)
+			{
+				necessary = accepting ? (necessary & s->holds) : s->holds;
+				accepting = TRUE;
+			}
+			continue;
+
+		case BPF_JMP:
+			if (p->code == (BPF_JMP|BPF_JA))
+			{
+				prefilter_meet(&states[i + 1 + p->k], s, 0);
+				continue;
+			}
+
+			ct = cf = 0;
+			if (s->load && BPF_SRC(p->code) == BPF_K)
+			{
+				switch (BPF_OP(p->code))
+				{
+				case BPF_JEQ:
+					ct = prefilter_candidate(cands, &ncands, s, s->mask, p->k);
+					break;
+
+				case BPF_JSET:
+					// A single bit is set on the true edge, all of them are clear on the false one
+					bits = s->mask & p->k;
+					cf = prefilter_candidate(cands, &ncands, s, bits, 0);
+					if (bits != 0 && (bits & (bits - 1)) == 0)
+						ct = prefilter_candidate(cands, &ncands, s, bits, bits);
+					break;
+				}
+			}
+
+			prefilter_meet(&states[i + 1 + p->jt], s, ct);
+			prefilter_meet(&states[i + 1 + p->jf], s, cf);
+			continue;
+
+		case BPF_LD:
+			next = *s;
+			next.load = FALSE;
+			if (BPF_MODE(p->code) == BPF_ABS && p->k <= PREFILTER_MAX_OFFSET && !BPF_IS_ANCILLARY(p->code, p->k))
+			{
+				next.load = TRUE;
+				next.offset = p->k;
+				switch (BPF_SIZE(p->code))
+				{
+				case BPF_W: next.size = 4; next.mask = 0xffffffff; break;
+				case BPF_H: next.size = 2; next.mask = 0xffff; break;
+				default: next.size = 1; next.mask = 0xff; break;
+				}
+			}
+			break;
+
+		case BPF_ALU:
+			next = *s;
+			if (p->code == (BPF_ALU|BPF_AND|BPF_K))
+				next.mask &= p->k;
+			else
+				next.load = FALSE;
+			break;
+
+		case BPF_MISC:
+			next = *s;
+			if (BPF_MISCOP(p->code) != BPF_TAX)
+				next.load = FALSE;
+			break;
+
+		default:
+			// LDX, ST and STX leave A alone
+			next = *s;
+			break;
+		}
+
+		// bpf_validate() guarantees that the last instruction is a return
+		prefilter_meet(&states[i + 1], &next, 0);
+	}
+
+	if (accepting)
+	{
+		for (c = 0; c < ncands && count < max; c++)
+		{
+			if (!(necessary & ((ULONGLONG)1 << c)))
+				continue;
+
+			for (j = 0; j < count; j++)
+			{
+				if (RtlEqualMemory(&conds[j], &cands[c], sizeof(struct bpf_condition)))
+					break;
+			}
+
+			if (j == count)
+				conds[count++] = cands[c];
+		}
+	}
+
+	PREFILTER_FREE(states);
+
+	return (int)count;
+}
+
+int bpf_prefilter_compile(struct bpf_insn* f, int len, struct bpf_prefilter* pre)
+{
+	struct bpf_condition conds[BPF_PREFILTER_MAX_CONDITIONS];
+	struct bpf_condition t;
+	struct bpf_prefilter_window* w;
+	u_int32 first, end, base, shift;
+	int count, i, j, b;
+
+	RtlZeroMemory(pre, sizeof(struct bpf_prefilter));
+
+	count = bpf_validate_conditions(f, len, conds, BPF_PREFILTER_MAX_CONDITIONS);
+
+	// By offset, and the packet must hold the bytes of all of them
+	for (i = 1; i < count; i++)
+	{
+		t = conds[i];
+		for (j = i; j > 0 && conds[j - 1].offset > t.offset; j--)
+			conds[j] = conds[j - 1];
+		conds[j] = t;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (conds[i].offset + conds[i].size > pre->length)
+			pre->length = conds[i].offset + conds[i].size;
+	}
+
+	// The windows take the conditions in order, those that do not fit are only checked by the program
+	i = 0;
+	while (i < count && pre->windows < BPF_PREFILTER_WINDOWS)
+	{
+		first = conds[i].offset;
+		end = first;
+		for (j = i; j < count && conds[j].offset + conds[j].size <= first + BPF_PREFILTER_WINDOW; j++)
+		{
+			if (conds[j].offset + conds[j].size > end)
+				end = conds[j].offset + conds[j].size;
+		}
+
+		// The window ends with the last byte of its conditions, so that it is in the packets that hold them
+		base = (end >= BPF_PREFILTER_WINDOW) ? end - BPF_PREFILTER_WINDOW : 0;
+
+		w = &pre->window[pre->windows++];
+		w->offset = base;
+		for (; i < j; i++)
+		{
+			for (b = 0; b < (int)conds[i].size; b++)
+			{
+				shift = 8 * (conds[i].size - 1 - b);
+				w->mask[conds[i].offset - base + b] |= (u_char)(conds[i].mask >> shift);
+				w->value[conds[i].offset - base + b] |= (u_char)(conds[i].value >> shift);
+			}
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Compares the 16 bytes at p with a window
+ */
+static int prefilter_window(struct bpf_prefilter_window* w, u_char* p)
+{
+#ifdef PREFILTER_SSE2
+	__m128i x;
+
+	x = _mm_and_si128(_mm_loadu_si128((__m128i*)p), _mm_loadu_si128((__m128i*)w->mask));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_loadu_si128((__m128i*)w->value))) == 0xffff;
+#else
+	ULONGLONG x[2], m[2], v[2];
+
+	RtlCopyMemory(x, p, sizeof(x));
+	RtlCopyMemory(m, w->mask, sizeof(m));
+	RtlCopyMemory(v, w->value, sizeof(v));
+
+	return (((x[0] & m[0]) ^ v[0]) | ((x[1] & m[1]) ^ v[1])) == 0;
+#endif
+}
+
+int bpf_prefilter(struct bpf_prefilter* pre, u_char* p, u_int buflen)
+{
+	struct bpf_prefilter_window* w;
+	u_int i, n;
+
+	if (buflen < pre->length)
+		return FALSE;
+
+	for (w = pre->window; w < pre->window + pre->windows; w++)
+	{
+		// The window starts before the end of the conditions, i.e. in the packet
+		n = buflen - w->offset;
+		if (n >= BPF_PREFILTER_WINDOW)
+		{
+			if (!prefilter_window(w, p + w->offset))
+				return FALSE;
+		}
+		else
+		{
+			// A packet shorter than the window: the bytes past its end are in no condition
+			for (i = 0; i < n; i++)
+			{
+				if ((p[w->offset + i] & w->mask[i]) != w->value[i])
+					return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
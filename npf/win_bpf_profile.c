@@ -0,0 +1,299 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Profiling interpreter, run by the tap instead of the other engines while the profiling
+ * of an instance is enabled with BIOCSPROFILE.
+ *
+ * It is bpf_filter() counting, for each instruction, how many times it runs and how many
+ * packets are accepted or rejected there: by a return, or by a load out of the packet or
+ * a division by zero. The counters show the hot paths of a long filter.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_bpf.h"
+
+#define EXTRACT_SHORT(p)\
+		((((u_short)(((u_char*)p)[0])) << 8) |\
+		 (((u_short)(((u_char*)p)[1])) << 0))
+
+#define EXTRACT_LONG(p)\
+		((((u_int32)(((u_char*)p)[0])) << 24) |\
+		 (((u_int32)(((u_char*)p)[1])) << 16) |\
+		 (((u_int32)(((u_char*)p)[2])) << 8 ) |\
+		 (((u_int32)(((u_char*)p)[3])) << 0 ))
+
+/// Ends the program at the current instruction
+#define PROFILE_RETURN(_v) \
+	do \
+	{ \
+		verdict = (u_int)(_v); \
+		if (verdict != 0) \
+			counter->accepted++; \
+		else \
+			counter->rejected++; \
+		return verdict; \
+	} while (0)
+
+u_int bpf_filter_profile(struct bpf_insn* pc, u_char* p, u_int wirelen, u_int buflen, struct bpf_meta* meta, struct bpf_profile_counter* counters)
+{
+	u_int32 A = 0, X = 0;
+	u_int32 k;
+	u_int32 mem[BPF_MEMWORDS];
+	struct bpf_insn* start = pc;
+	struct bpf_profile_counter* counter;
+	u_int verdict;
+
+	if (pc == NULL)
+		return (u_int)-1;
+
+	RtlZeroMemory(mem, sizeof(mem));
+
+	for (;; pc++)
+	{
+		counter = &counters[pc - start];
+		counter->executed++;
+
+		switch (pc->code)
+		{
+		default:
+			PROFILE_RETURN(0);
+
+		case BPF_RET|BPF_K:
+			PROFILE_RETURN(pc->k);
+
+		case BPF_RET|BPF_A:
+			PROFILE_RETURN(A);
+
+		case BPF_LD|BPF_W|BPF_ABS:
+			k = pc->k;
+			if (k >= buflen || buflen - k < 4)
+			{
+				if (BPF_IS_ANCILLARY(pc->code, k))
+				{
+					A = BPF_AD_LOAD(meta, k - BPF_AD_OFF);
+					continue;
+				}
+				PROFILE_RETURN(0);
+			}
+			A = EXTRACT_LONG(&p[k]);
+			continue;
+
+		case BPF_LD|BPF_H|BPF_ABS:
+			k = pc->k;
+			if (k >= buflen || buflen - k < 2)
+			{
+				if (BPF_IS_ANCILLARY(pc->code, k))
+				{
+					A = BPF_AD_LOAD(meta, k - BPF_AD_OFF);
+					continue;
+				}
+				PROFILE_RETURN(0);
+			}
+			A = EXTRACT_SHORT(&p[k]);
+			continue;
+
+		case BPF_LD|BPF_B|BPF_ABS:
+			k = pc->k;
+			if (k >= buflen)
+			{
+				if (BPF_IS_ANCILLARY(pc->code, k))
+				{
+					A = BPF_AD_LOAD(meta, k - BPF_AD_OFF);
+					continue;
+				}
+				PROFILE_RETURN(0);
+			}
+			A = p[k];
+			continue;
+
+		case BPF_LD|BPF_W|BPF_LEN:
+			A = wirelen;
+			continue;
+
+		case BPF_LDX|BPF_W|BPF_LEN:
+			X = wirelen;
+			continue;
+
+		case BPF_LD|BPF_W|BPF_IND:
+			k = X + pc->k;
+			if (k >= buflen || buflen - k < 4)
+				PROFILE_RETURN(0);
+			A = EXTRACT_LONG(&p[k]);
+			continue;
+
+		case BPF_LD|BPF_H|BPF_IND:
+			k = X + pc->k;
+			if (k >= buflen || buflen - k < 2)
+				PROFILE_RETURN(0);
+			A = EXTRACT_SHORT(&p[k]);
+			continue;
+
+		case BPF_LD|BPF_B|BPF_IND:
+			k = X + pc->k;
+			if (k >= buflen)
+				PROFILE_RETURN(0);
+			A = p[k];
+			continue;
+
+		case BPF_LDX|BPF_MSH|BPF_B:
+			k = pc->k;
+			if (k >= buflen)
+				PROFILE_RETURN(0);
+			X = (p[k] & 0xf) << 2;
+			continue;
+
+		case BPF_LD|BPF_IMM:
+			A = pc->k;
+			continue;
+
+		case BPF_LDX|BPF_IMM:
+			X = pc->k;
+			continue;
+
+		case BPF_LD|BPF_MEM:
+			A = mem[pc->k];
+			continue;
+
+		case BPF_LDX|BPF_MEM:
+			X = mem[pc->k];
+			continue;
+
+		case BPF_ST:
+			mem[pc->k] = A;
+			continue;
+
+		case BPF_STX:
+			mem[pc->k] = X;
+			continue;
+
+		case BPF_JMP|BPF_JA:
+			pc += pc->k;
+			continue;
+
+		case BPF_JMP|BPF_JGT|BPF_K:
+			pc += ((int)A > (int)pc->k) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JGE|BPF_K:
+			pc += ((int)A >= (int)pc->k) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JEQ|BPF_K:
+			pc += (A == pc->k) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JSET|BPF_K:
+			pc += (A & pc->k) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JGT|BPF_X:
+			pc += (A > X) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JGE|BPF_X:
+			pc += (A >= X) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JEQ|BPF_X:
+			pc += (A == X) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_JMP|BPF_JSET|BPF_X:
+			pc += (A & X) ? pc->jt : pc->jf;
+			continue;
+
+		case BPF_ALU|BPF_ADD|BPF_X:
+			A += X;
+			continue;
+
+		case BPF_ALU|BPF_SUB|BPF_X:
+			A -= X;
+			continue;
+
+		case BPF_ALU|BPF_MUL|BPF_X:
+			A *= X;
+			continue;
+
+		case BPF_ALU|BPF_DIV|BPF_X:
+			if (X == 0)
+				PROFILE_RETURN(0);
+			A /= X;
+			continue;
+
+		case BPF_ALU|BPF_AND|BPF_X:
+			A &= X;
+			continue;
+
+		case BPF_ALU|BPF_OR|BPF_X:
+			A |= X;
+			continue;
+
+		case BPF_ALU|BPF_LSH|BPF_X:
+			A <<= X;
+			continue;
+
+		case BPF_ALU|BPF_RSH|BPF_X:
+			A >>= X;
+			continue;
+
+		case BPF_ALU|BPF_ADD|BPF_K:
+			A += pc->k;
+			continue;
+
+		case BPF_ALU|BPF_SUB|BPF_K:
+			A -= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_MUL|BPF_K:
+			A *= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_DIV|BPF_K:
+			A /= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_AND|BPF_K:
+			A &= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_OR|BPF_K:
+			A |= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_LSH|BPF_K:
+			A <<= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_RSH|BPF_K:
+			A >>= pc->k;
+			continue;
+
+		case BPF_ALU|BPF_NEG:
+			A = (u_int32)-((int)A);
+			continue;
+
+		case BPF_MISC|BPF_TAX:
+			X = A;
+			continue;
+
+		case BPF_MISC|BPF_TXA:
+			A = X;
+			continue;
+
+		case BPF_MISC|BPF_MATCH:
+			A = bpf_match(pc->k, p, buflen, X, A);
+			continue;
+		}
+	}
+}
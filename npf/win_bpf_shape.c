@@ -0,0 +1,567 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Native matchers for the filters that libpcap generates for the most common expressions.
+ *
+ * Each shape is a template of the program that libpcap emits for an expression on Ethernet,
+ * e.g. "tcp port N", in which some constants are parameters: the port, the accepted length,
+ * the offset of the link-layer header (which also covers other link layers with the same
+ * layout)... bpf_shape_recognize() compares a program with the templates instruction by
+ * instruction, binding the parameters on the way, and the filter is then run by the C function
+ * of the shape, with the constants of the program, instead of by an interpreter. A program that
+ * starts with the check of an 802.1Q tag, as "vlan and <expression>", is recognized as the
+ * shape of the expression with a prefix.
+ *
+ * The function of a shape is the program of its template written in C: the packet is read with
+ * the same loads in the same order, so that it is rejected in exactly the same cases as in
+ * bpf_filter(), whatever the values of the parameters.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_bpf.h"
+
+#ifdef WIN_NT_DRIVER
+#define SHAPE_ALLOC(_size)	ExAllocatePoolWithTag(NonPagedPool, (_size), '7BWA')
+#define SHAPE_FREE(_ptr)	ExFreePool(_ptr)
+#else
+#define SHAPE_ALLOC(_size)	malloc(_size)
+#define SHAPE_FREE(_ptr)	free(_ptr)
+#endif
+
+#define EXTRACT_SHORT(p)\
+		((((u_short)(((u_char*)p)[0])) << 8) |\
+		 (((u_short)(((u_char*)p)[1])) << 0))
+
+#define EXTRACT_LONG(p)\
+		((((u_int32)(((u_char*)p)[0])) << 24) |\
+		 (((u_int32)(((u_char*)p)[1])) << 16) |\
+		 (((u_int32)(((u_char*)p)[2])) << 8 ) |\
+		 (((u_int32)(((u_char*)p)[3])) << 0 ))
+
+/*
+ * The parameters of the templates. The k of an instruction that has one must be the value of
+ * the parameter plus the k of the template.
+ */
+#define SHAPE_K			0	///< No parameter, the k of the template
+#define SHAPE_L			1	///< Length of the link-layer header, 14 on Ethernet
+#define SHAPE_S			2	///< The value returned for the accepted packets, the snapshot length
+#define SHAPE_T			3	///< An ethertype
+#define SHAPE_P			4	///< An IP protocol
+#define SHAPE_N			5	///< A TCP or UDP port
+#define SHAPE_A			6	///< An IPv4 address or network
+#define SHAPE_M			7	///< An IPv4 netmask
+#define SHAPE_NPARAMS	8
+
+/*
+ * Loads of the functions of the shapes, with the checks of bpf_filter(): they return 0 from the
+ * function if the bytes are not in the packet.
+ */
+#define SHAPE_LD_W(_a, _k)												\
+	do {																\
+		u_int32 k_ = (_k);												\
+		if (k_ >= buflen || buflen - k_ < sizeof(u_int32))				\
+			return 0;													\
+		(_a) = EXTRACT_LONG(&p[k_]);									\
+	} while (0)
+
+#define SHAPE_LD_H(_a, _k)												\
+	do {																\
+		u_int32 k_ = (_k);												\
+		if (k_ >= buflen || buflen - k_ < sizeof(u_short))				\
+			return 0;													\
+		(_a) = EXTRACT_SHORT(&p[k_]);									\
+	} while (0)
+
+#define SHAPE_LD_B(_a, _k)												\
+	do {																\
+		u_int32 k_ = (_k);												\
+		if (k_ >= buflen)												\
+			return 0;													\
+		(_a) = p[k_];													\
+	} while (0)
+
+/// BPF_LDX|BPF_MSH|BPF_B
+#define SHAPE_LD_MSH(_x, _k)											\
+	do {																\
+		u_int32 k_ = (_k);												\
+		if (k_ >= buflen)												\
+			return 0;													\
+		(_x) = (p[k_] & 0xf) << 2;										\
+	} while (0)
+
+typedef u_int (*shape_function)(u_int32* v, u_char* p, u_int buflen);
+
+/*!
+  \brief An instruction of a template.
+*/
+struct shape_insn
+{
+	u_short code;
+	u_char jt;
+	u_char jf;
+	u_int32 k;
+	u_int param;	///< SHAPE_K, or the parameter added to k
+};
+
+#define SHAPE_STMT(_code, _param, _k)				{ (u_short)(_code), 0, 0, (u_int32)(_k), (_param) }
+#define SHAPE_JUMP(_code, _param, _k, _jt, _jf)		{ (u_short)(_code), (_jt), (_jf), (u_int32)(_k), (_param) }
+
+#define SHAPE_JEQ(_param, _k, _jt, _jf)				SHAPE_JUMP(BPF_JMP|BPF_JEQ|BPF_K, _param, _k, _jt, _jf)
+#define SHAPE_ACCEPT								SHAPE_STMT(BPF_RET|BPF_K, SHAPE_S, 0)
+#define SHAPE_REJECT								SHAPE_STMT(BPF_RET|BPF_K, SHAPE_K, 0)
+
+struct shape_template
+{
+	const char* Name;
+	const struct shape_insn* Insns;
+	u_int Length;
+	shape_function Function;
+};
+
+struct bpf_shape
+{
+	const struct shape_template* Template;
+	u_int Vlan;						///< The program starts with the check of an 802.1Q tag
+	u_int32 Params[SHAPE_NPARAMS];
+};
+
+//-------------------------------------------------------------------
+
+/*
+ * "ip", "arp", "ip6"...
+ */
+static const struct shape_insn ether_proto_insns[] =
+{
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_ABS, SHAPE_L, -2),
+	SHAPE_JEQ(SHAPE_T, 0, 0, 1),
+	SHAPE_ACCEPT,
+	SHAPE_REJECT,
+};
+
+static u_int ether_proto_function(u_int32* v, u_char* p, u_int buflen)
+{
+	u_int32 t;
+
+	SHAPE_LD_H(t, v[SHAPE_L] - 2);
+
+	return t == v[SHAPE_T] ? v[SHAPE_S] : 0;
+}
+
+/*
+ * "tcp", "udp"... over IPv4 and IPv6, with a fragment header or not
+ */
+static const struct shape_insn ip_proto_insns[] =
+{
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_ABS, SHAPE_L, -2),
+	SHAPE_JEQ(SHAPE_K, 0x86dd, 0, 5),
+	SHAPE_STMT(BPF_LD|BPF_B|BPF_ABS, SHAPE_L, 6),
+	SHAPE_JEQ(SHAPE_P, 0, 6, 0),
+	SHAPE_JEQ(SHAPE_K, 0x2c, 0, 6),
+	SHAPE_STMT(BPF_LD|BPF_B|BPF_ABS, SHAPE_L, 40),
+	SHAPE_JEQ(SHAPE_P, 0, 3, 4),
+	SHAPE_JEQ(SHAPE_K, 0x800, 0, 3),
+	SHAPE_STMT(BPF_LD|BPF_B|BPF_ABS, SHAPE_L, 9),
+	SHAPE_JEQ(SHAPE_P, 0, 0, 1),
+	SHAPE_ACCEPT,
+	SHAPE_REJECT,
+};
+
+static u_int ip_proto_function(u_int32* v, u_char* p, u_int buflen)
+{
+	u_int32 l = v[SHAPE_L];
+	u_int32 t, proto;
+
+	SHAPE_LD_H(t, l - 2);
+	if (t == 0x86dd)
+	{
+		SHAPE_LD_B(proto, l + 6);
+		if (proto == v[SHAPE_P])
+			return v[SHAPE_S];
+		if (proto != 0x2c)
+			return 0;
+
+		SHAPE_LD_B(proto, l + 40);
+	}
+	else if (t == 0x800)
+	{
+		SHAPE_LD_B(proto, l + 9);
+	}
+	else
+	{
+		return 0;
+	}
+
+	return proto == v[SHAPE_P] ? v[SHAPE_S] : 0;
+}
+
+/*
+ * "tcp port N", "udp port N"
+ */
+static const struct shape_insn proto_port_insns[] =
+{
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_ABS, SHAPE_L, -2),
+	SHAPE_JEQ(SHAPE_K, 0x86dd, 0, 6),
+	SHAPE_STMT(BPF_LD|BPF_B|BPF_ABS, SHAPE_L, 6),
+	SHAPE_JEQ(SHAPE_P, 0, 0, 15),
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_ABS, SHAPE_L, 40),
+	SHAPE_JEQ(SHAPE_N, 0, 12, 0),
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_ABS, SHAPE_L, 42),
+	SHAPE_JEQ(SHAPE_N, 0, 10, 11),
+	SHAPE_JEQ(SHAPE_K, 0x800, 0, 10),
+	SHAPE_STMT(BPF_LD|BPF_B|BPF_ABS, SHAPE_L, 9),
+	SHAPE_JEQ(SHAPE_P, 0, 0, 8),
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_ABS, SHAPE_L, 6),
+	SHAPE_JUMP(BPF_JMP|BPF_JSET|BPF_K, SHAPE_K, 0x1fff, 6, 0),
+	SHAPE_STMT(BPF_LDX|BPF_MSH|BPF_B, SHAPE_L, 0),
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_IND, SHAPE_L, 0),
+	SHAPE_JEQ(SHAPE_N, 0, 2, 0),
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_IND, SHAPE_L, 2),
+	SHAPE_JEQ(SHAPE_N, 0, 0, 1),
+	SHAPE_ACCEPT,
+	SHAPE_REJECT,
+};
+
+/*
+ * The ports of the IPv4 packets that are not fragments, after the checks of the protocol
+ */
+static u_int ipv4_ports(u_int32* v, u_char* p, u_int buflen)
+{
+	u_int32 l = v[SHAPE_L];
+	u_int32 frag, x, port;
+
+	SHAPE_LD_H(frag, l + 6);
+	if (frag & 0x1fff)
+		return 0;
+
+	SHAPE_LD_MSH(x, l);
+	SHAPE_LD_H(port, x + l);
+	if (port == v[SHAPE_N])
+		return v[SHAPE_S];
+	SHAPE_LD_H(port, x + l + 2);
+
+	return port == v[SHAPE_N] ? v[SHAPE_S] : 0;
+}
+
+/*
+ * The ports of the IPv6 packets, after the checks of the protocol
+ */
+static u_int ipv6_ports(u_int32* v, u_char* p, u_int buflen)
+{
+	u_int32 l = v[SHAPE_L];
+	u_int32 port;
+
+	SHAPE_LD_H(port, l + 40);
+	if (port == v[SHAPE_N])
+		return v[SHAPE_S];
+	SHAPE_LD_H(port, l + 42);
+
+	return port == v[SHAPE_N] ? v[SHAPE_S] : 0;
+}
+
+static u_int proto_port_function(u_int32* v, u_char* p, u_int buflen)
+{
+	u_int32 l = v[SHAPE_L];
+	u_int32 t, proto;
+
+	SHAPE_LD_H(t, l - 2);
+	if (t == 0x86dd)
+	{
+		SHAPE_LD_B(proto, l + 6);
+		if (proto != v[SHAPE_P])
+			return 0;
+
+		return ipv6_ports(v, p, buflen);
+	}
+
+	if (t != 0x800)
+		return 0;
+
+	SHAPE_LD_B(proto, l + 9);
+	if (proto != v[SHAPE_P])
+		return 0;
+
+	return ipv4_ports(v, p, buflen);
+}
+
+/*
+ * "port N": TCP, UDP or SCTP
+ */
+static const struct shape_insn port_insns[] =
+{
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_ABS, SHAPE_L, -2),
+	SHAPE_JEQ(SHAPE_K, 0x86dd, 0, 8),
+	SHAPE_STMT(BPF_LD|BPF_B|BPF_ABS, SHAPE_L, 6),
+	SHAPE_JEQ(SHAPE_K, 0x84, 2, 0),
+	SHAPE_JEQ(SHAPE_K, 0x6, 1, 0),
+	SHAPE_JEQ(SHAPE_K, 0x11, 0, 17),
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_ABS, SHAPE_L, 40),
+	SHAPE_JEQ(SHAPE_N, 0, 14, 0),
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_ABS, SHAPE_L, 42),
+	SHAPE_JEQ(SHAPE_N, 0, 12, 13),
+	SHAPE_JEQ(SHAPE_K, 0x800, 0, 12),
+	SHAPE_STMT(BPF_LD|BPF_B|BPF_ABS, SHAPE_L, 9),
+	SHAPE_JEQ(SHAPE_K, 0x84, 2, 0),
+	SHAPE_JEQ(SHAPE_K, 0x6, 1, 0),
+	SHAPE_JEQ(SHAPE_K, 0x11, 0, 8),
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_ABS, SHAPE_L, 6),
+	SHAPE_JUMP(BPF_JMP|BPF_JSET|BPF_K, SHAPE_K, 0x1fff, 6, 0),
+	SHAPE_STMT(BPF_LDX|BPF_MSH|BPF_B, SHAPE_L, 0),
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_IND, SHAPE_L, 0),
+	SHAPE_JEQ(SHAPE_N, 0, 2, 0),
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_IND, SHAPE_L, 2),
+	SHAPE_JEQ(SHAPE_N, 0, 0, 1),
+	SHAPE_ACCEPT,
+	SHAPE_REJECT,
+};
+
+#define SHAPE_PORT_PROTO(_proto)	((_proto) == 0x84 || (_proto) == 0x6 || (_proto) == 0x11)
+
+static u_int port_function(u_int32* v, u_char* p, u_int buflen)
+{
+	u_int32 l = v[SHAPE_L];
+	u_int32 t, proto;
+
+	SHAPE_LD_H(t, l - 2);
+	if (t == 0x86dd)
+	{
+		SHAPE_LD_B(proto, l + 6);
+		if (!SHAPE_PORT_PROTO(proto))
+			return 0;
+
+		return ipv6_ports(v, p, buflen);
+	}
+
+	if (t != 0x800)
+		return 0;
+
+	SHAPE_LD_B(proto, l + 9);
+	if (!SHAPE_PORT_PROTO(proto))
+		return 0;
+
+	return ipv4_ports(v, p, buflen);
+}
+
+/*
+ * "host A": the IPv4 source and destination, or the sender and target of ARP and RARP
+ */
+static const struct shape_insn host_insns[] =
+{
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_ABS, SHAPE_L, -2),
+	SHAPE_JEQ(SHAPE_K, 0x800, 0, 4),
+	SHAPE_STMT(BPF_LD|BPF_W|BPF_ABS, SHAPE_L, 12),
+	SHAPE_JEQ(SHAPE_A, 0, 8, 0),
+	SHAPE_STMT(BPF_LD|BPF_W|BPF_ABS, SHAPE_L, 16),
+	SHAPE_JEQ(SHAPE_A, 0, 6, 7),
+	SHAPE_JEQ(SHAPE_K, 0x806, 1, 0),
+	SHAPE_JEQ(SHAPE_K, 0x8035, 0, 5),
+	SHAPE_STMT(BPF_LD|BPF_W|BPF_ABS, SHAPE_L, 14),
+	SHAPE_JEQ(SHAPE_A, 0, 2, 0),
+	SHAPE_STMT(BPF_LD|BPF_W|BPF_ABS, SHAPE_L, 24),
+	SHAPE_JEQ(SHAPE_A, 0, 0, 1),
+	SHAPE_ACCEPT,
+	SHAPE_REJECT,
+};
+
+/*
+ * "net A/M": the same with a mask
+ */
+static const struct shape_insn net_insns[] =
+{
+	SHAPE_STMT(BPF_LD|BPF_H|BPF_ABS, SHAPE_L, -2),
+	SHAPE_JEQ(SHAPE_K, 0x800, 0, 6),
+	SHAPE_STMT(BPF_LD|BPF_W|BPF_ABS, SHAPE_L, 12),
+	SHAPE_STMT(BPF_ALU|BPF_AND|BPF_K, SHAPE_M, 0),
+	SHAPE_JEQ(SHAPE_A, 0, 11, 0),
+	SHAPE_STMT(BPF_LD|BPF_W|BPF_ABS, SHAPE_L, 16),
+	SHAPE_STMT(BPF_ALU|BPF_AND|BPF_K, SHAPE_M, 0),
+	SHAPE_JEQ(SHAPE_A, 0, 8, 9),
+	SHAPE_JEQ(SHAPE_K, 0x806, 1, 0),
+	SHAPE_JEQ(SHAPE_K, 0x8035, 0, 7),
+	SHAPE_STMT(BPF_LD|BPF_W|BPF_ABS, SHAPE_L, 14),
+	SHAPE_STMT(BPF_ALU|BPF_AND|BPF_K, SHAPE_M, 0),
+	SHAPE_JEQ(SHAPE_A, 0, 3, 0),
+	SHAPE_STMT(BPF_LD|BPF_W|BPF_ABS, SHAPE_L, 24),
+	SHAPE_STMT(BPF_ALU|BPF_AND|BPF_K, SHAPE_M, 0),
+	SHAPE_JEQ(SHAPE_A, 0, 0, 1),
+	SHAPE_ACCEPT,
+	SHAPE_REJECT,
+};
+
+static u_int addr_function(u_int32* v, u_char* p, u_int buflen, u_int32 mask)
+{
+	u_int32 l = v[SHAPE_L];
+	u_int32 t, addr;
+	u_int32 src, dst;
+
+	SHAPE_LD_H(t, l - 2);
+	if (t == 0x800)
+	{
+		src = l + 12;
+		dst = l + 16;
+	}
+	else if (t == 0x806 || t == 0x8035)
+	{
+		src = l + 14;
+		dst = l + 24;
+	}
+	else
+	{
+		return 0;
+	}
+
+	SHAPE_LD_W(addr, src);
+	if ((addr & mask) == v[SHAPE_A])
+		return v[SHAPE_S];
+	SHAPE_LD_W(addr, dst);
+
+	return (addr & mask) == v[SHAPE_A] ? v[SHAPE_S] : 0;
+}
+
+static u_int host_function(u_int32* v, u_char* p, u_int buflen)
+{
+	return addr_function(v, p, buflen, 0xffffffff);
+}
+
+static u_int net_function(u_int32* v, u_char* p, u_int buflen)
+{
+	return addr_function(v, p, buflen, v[SHAPE_M]);
+}
+
+#define SHAPE_TEMPLATE(_name, _insns, _function) \
+	{ _name, _insns, sizeof(_insns) / sizeof(struct shape_insn), _function }
+
+static const struct shape_template shape_templates[] =
+{
+	SHAPE_TEMPLATE("ether proto", ether_proto_insns, ether_proto_function),
+	SHAPE_TEMPLATE("ip proto", ip_proto_insns, ip_proto_function),
+	SHAPE_TEMPLATE("proto port", proto_port_insns, proto_port_function),
+	SHAPE_TEMPLATE("port", port_insns, port_function),
+	SHAPE_TEMPLATE("host", host_insns, host_function),
+	SHAPE_TEMPLATE("net", net_insns, net_function),
+};
+
+#define SHAPE_TEMPLATES	(sizeof(shape_templates) / sizeof(shape_templates[0]))
+
+//-------------------------------------------------------------------
+
+/*
+ * Compares a program with a template, and binds the parameters of the template.
+ */
+static int shape_match(const struct shape_template* t, struct bpf_insn* f, u_int len, u_int32* params)
+{
+	u_int bound = 0;
+	u_int32 value;
+	u_int i;
+
+	if (len != t->Length)
+		return FALSE;
+
+	for (i = 0; i < len; i++)
+	{
+		const struct shape_insn* s = &t->Insns[i];
+
+		if (f[i].code != s->code || f[i].jt != s->jt || f[i].jf != s->jf)
+			return FALSE;
+
+		// The function of the shape does not read the metadata
+		if (BPF_IS_ANCILLARY(f[i].code, f[i].k))
+			return FALSE;
+
+		if (s->param == SHAPE_K)
+		{
+			if (f[i].k != s->k)
+				return FALSE;
+			continue;
+		}
+
+		value = f[i].k - s->k;
+		if (bound & (1 << s->param))
+		{
+			if (params[s->param] != value)
+				return FALSE;
+		}
+		else
+		{
+			params[s->param] = value;
+			bound |= 1 << s->param;
+		}
+	}
+
+	return TRUE;
+}
+
+struct bpf_shape* bpf_shape_recognize(struct bpf_insn* f, int len)
+{
+	struct bpf_shape* shape;
+	u_int32 params[SHAPE_NPARAMS];
+	u_int vlan = FALSE;
+	u_int i;
+
+	if (len <= 0)
+		return NULL;
+
+	// "vlan and ...": the tag is checked at the start, and the expression rejects on the last instruction
+	if (len > 3 &&
+		f[0].code == (BPF_LD|BPF_H|BPF_ABS) && f[0].k == 12 &&
+		f[1].code == (BPF_JMP|BPF_JEQ|BPF_K) && f[1].k == 0x8100 && f[1].jt == 0 && (int)f[1].jf == len - 3 &&
+		f[len - 1].code == (BPF_RET|BPF_K) && f[len - 1].k == 0)
+	{
+		vlan = TRUE;
+		f += 2;
+		len -= 2;
+	}
+
+	for (i = 0; i < SHAPE_TEMPLATES; i++)
+	{
+		RtlZeroMemory(params, sizeof(params));
+		if (shape_match(&shape_templates[i], f, (u_int)len, params))
+			break;
+	}
+
+	if (i == SHAPE_TEMPLATES)
+		return NULL;
+
+	shape = (struct bpf_shape*)SHAPE_ALLOC(sizeof(struct bpf_shape));
+	if (shape == NULL)
+		return NULL;
+
+	shape->Template = &shape_templates[i];
+	shape->Vlan = vlan;
+	RtlCopyMemory(shape->Params, params, sizeof(params));
+
+	return shape;
+}
+
+void bpf_free_shape(struct bpf_shape* shape)
+{
+	SHAPE_FREE(shape);
+}
+
+const char* bpf_shape_name(struct bpf_shape* shape)
+{
+	return shape->Template->Name;
+}
+
+u_int bpf_filter_shape(struct bpf_shape* shape, u_char* p, u_int wirelen, u_int buflen)
+{
+	UNREFERENCED_PARAMETER(wirelen);
+
+	if (shape->Vlan)
+	{
+		if (buflen < 14 || EXTRACT_SHORT(&p[12]) != 0x8100)
+			return 0;
+	}
+
+	return shape->Template->Function(shape->Params, p, buflen);
+}
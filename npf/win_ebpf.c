@@ -0,0 +1,1208 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Verifier, interpreter and maps of the extended filtering programs, see win_ebpf.h.
+ *
+ * The verifier follows the paths of the program one after the other, depth first. At the targets
+ * of the jumps it remembers the state of the registers in a checkpoint, linked to the previous
+ * checkpoint of the path: a checkpoint is complete when all the paths that went through it have
+ * ended. A path that reaches the state of a complete checkpoint is safe and ends there; one that
+ * reaches the state of a checkpoint that is not complete, i.e. of one of its own ancestors, would
+ * loop forever and the program is rejected. The loops whose state changes, e.g. with a constant
+ * counter, are followed until they end, within EBPF_VERIFY_MAX_STEPS instructions in total.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_ebpf.h"
+
+#ifdef WIN_NT_DRIVER
+#define EBPF_ALLOC(_size)	ExAllocatePoolWithTag(NonPagedPool, (_size), '5BWA')
+#define EBPF_FREE(_ptr)		ExFreePool(_ptr)
+#define MAP_LOCK_INIT(_map)	NdisAllocateSpinLock(&(_map)->Lock)
+#define MAP_LOCK_FREE(_map)	NdisFreeSpinLock(&(_map)->Lock)
+#define MAP_LOCK(_map)		NdisAcquireSpinLock(&(_map)->Lock)
+#define MAP_UNLOCK(_map)	NdisReleaseSpinLock(&(_map)->Lock)
+#else
+#define EBPF_ALLOC(_size)	malloc(_size)
+#define EBPF_FREE(_ptr)		free(_ptr)
+// The host build runs the programs on a single thread
+#define MAP_LOCK_INIT(_map)
+#define MAP_LOCK_FREE(_map)
+#define MAP_LOCK(_map)
+#define MAP_UNLOCK(_map)
+#endif
+
+#define EXTRACT_SHORT(p)\
+		((((u_short)(((u_char*)p)[0])) << 8) |\
+		 (((u_short)(((u_char*)p)[1])) << 0))
+
+#define EXTRACT_LONG(p)\
+		((((u_int32)(((u_char*)p)[0])) << 24) |\
+		 (((u_int32)(((u_char*)p)[1])) << 16) |\
+		 (((u_int32)(((u_char*)p)[2])) << 8 ) |\
+		 (((u_int32)(((u_char*)p)[3])) << 0 ))
+
+#define EBPF_VERIFY_MAX_STEPS		1000000	///< Instructions followed by the verifier on all the paths
+#define EBPF_VERIFY_MAX_PENDING		512		///< Paths waiting to be followed
+#define EBPF_VERIFY_MAX_CHECKPOINTS	2048	///< States remembered to prune the paths
+#define EBPF_VERIFY_MAX_PER_INSN	64		///< States remembered at the same instruction
+
+/// The states of the entries of a hash map
+#define MAP_EMPTY			0
+#define MAP_USED			1
+#define MAP_DELETED			2
+
+struct ebpf_map
+{
+	struct ebpf_map_def Def;
+	u_int32 KeyStride;		///< Bytes of the key in an entry of a hash map, rounded up to 8; 0 for an array
+	u_int32 EntrySize;		///< Bytes of an entry: the state and the key of a hash map, then the value, rounded up to 8
+	u_int32 NSlots;			///< Entries of the table, a power of 2 for a hash map
+	u_int32 Count;			///< Keys in the map
+	u_char* Data;
+#ifdef WIN_NT_DRIVER
+	NDIS_SPIN_LOCK Lock;
+#endif
+};
+
+struct ebpf_program
+{
+	u_int Len;
+	u_int NMaps;
+	struct ebpf_map Maps[EBPF_MAX_MAPS];
+	struct ebpf_insn Insns[1];
+};
+
+static u_int32 ebpf_size(u_char code)
+{
+	switch (BPF_SIZE(code))
+	{
+	case BPF_W:
+		return 4;
+	case BPF_H:
+		return 2;
+	case BPF_B:
+		return 1;
+	default:
+		return 8;
+	}
+}
+
+/*
+ * The arithmetic instructions, for the interpreter and for the constants of the verifier. As in Linux,
+ * a division by zero gives 0 and a modulo by zero leaves dst unchanged.
+ */
+static ULONGLONG ebpf_alu(u_char code, ULONGLONG dst, ULONGLONG src)
+{
+	u_int32 d, s;
+
+	if (BPF_CLASS(code) == EBPF_ALU64)
+	{
+		switch (BPF_OP(code))
+		{
+		case BPF_ADD:
+			return dst + src;
+		case BPF_SUB:
+			return dst - src;
+		case BPF_MUL:
+			return dst * src;
+		case BPF_DIV:
+			return src != 0 ? dst / src : 0;
+		case BPF_OR:
+			return dst | src;
+		case BPF_AND:
+			return dst & src;
+		case BPF_LSH:
+			return dst << (src & 63);
+		case BPF_RSH:
+			return dst >> (src & 63);
+		case BPF_NEG:
+			return 0 - dst;
+		case EBPF_MOD:
+			return src != 0 ? dst % src : dst;
+		case EBPF_XOR:
+			return dst ^ src;
+		case EBPF_MOV:
+			return src;
+		default:
+			return (ULONGLONG)((LONGLONG)dst >> (src & 63));
+		}
+	}
+
+	// The 32-bit forms clear the high half of dst
+	d = (u_int32)dst;
+	s = (u_int32)src;
+
+	switch (BPF_OP(code))
+	{
+	case BPF_ADD:
+		return (u_int32)(d + s);
+	case BPF_SUB:
+		return (u_int32)(d - s);
+	case BPF_MUL:
+		return (u_int32)(d * s);
+	case BPF_DIV:
+		return s != 0 ? d / s : 0;
+	case BPF_OR:
+		return d | s;
+	case BPF_AND:
+		return d & s;
+	case BPF_LSH:
+		return (u_int32)(d << (s & 31));
+	case BPF_RSH:
+		return d >> (s & 31);
+	case BPF_NEG:
+		return (u_int32)(0 - d);
+	case EBPF_MOD:
+		return s != 0 ? d % s : d;
+	case EBPF_XOR:
+		return d ^ s;
+	case EBPF_MOV:
+		return s;
+	default:
+		return (u_int32)((bpf_int32)d >> (s & 31));
+	}
+}
+
+static int ebpf_cond(u_char code, ULONGLONG dst, ULONGLONG src)
+{
+	switch (BPF_OP(code))
+	{
+	case BPF_JEQ:
+		return dst == src;
+	case BPF_JGT:
+		return dst > src;
+	case BPF_JGE:
+		return dst >= src;
+	case BPF_JSET:
+		return (dst & src) != 0;
+	case EBPF_JNE:
+		return dst != src;
+	case EBPF_JSGT:
+		return (LONGLONG)dst > (LONGLONG)src;
+	case EBPF_JSGE:
+		return (LONGLONG)dst >= (LONGLONG)src;
+	case EBPF_JLT:
+		return dst < src;
+	case EBPF_JLE:
+		return dst <= src;
+	case EBPF_JSLT:
+		return (LONGLONG)dst < (LONGLONG)src;
+	default:
+		return (LONGLONG)dst <= (LONGLONG)src;
+	}
+}
+
+//
+// The maps
+//
+
+/*
+ * Computes the layout of a map, returns its size in bytes
+ */
+static ULONGLONG map_layout(struct ebpf_map_def* def, u_int32* keystride, u_int32* entrysize, u_int32* nslots)
+{
+	u_int32 slots;
+
+	if (def->type == EBPF_MAP_ARRAY)
+	{
+		*keystride = 0;
+		*entrysize = (def->value_size + 7) & ~7;
+		*nslots = def->max_entries;
+	}
+	else
+	{
+		// At most half full, for short probes
+		for (slots = 1; slots < 2 * def->max_entries; slots <<= 1)
+			;
+
+		*keystride = (def->key_size + 7) & ~7;
+		*entrysize = sizeof(ULONGLONG) + *keystride + ((def->value_size + 7) & ~7);
+		*nslots = slots;
+	}
+
+	return (ULONGLONG)*entrysize * *nslots;
+}
+
+static int map_check(struct ebpf_map_def* maps, u_int nmaps)
+{
+	ULONGLONG total = 0;
+	u_int32 keystride, entrysize, nslots;
+	u_int i;
+
+	for (i = 0; i < nmaps; i++)
+	{
+		if ((maps[i].type != EBPF_MAP_HASH && maps[i].type != EBPF_MAP_ARRAY) ||
+			maps[i].key_size < 1 || maps[i].key_size > EBPF_MAX_KEY ||
+			(maps[i].type == EBPF_MAP_ARRAY && maps[i].key_size != sizeof(u_int32)) ||
+			maps[i].value_size < 1 || maps[i].value_size > EBPF_MAX_VALUE ||
+			maps[i].max_entries < 1 || maps[i].max_entries > EBPF_MAX_MAP_MEMORY / 8)
+			return FALSE;
+
+		total += map_layout(&maps[i], &keystride, &entrysize, &nslots);
+	}
+
+	return total <= EBPF_MAX_MAP_MEMORY;
+}
+
+static u_int32 map_hash(u_char* key, u_int32 size)
+{
+	u_int32 hash = 2166136261u;
+	u_int32 i;
+
+	// FNV-1a
+	for (i = 0; i < size; i++)
+		hash = (hash ^ key[i]) * 16777619u;
+
+	return hash;
+}
+
+/*
+ * Finds the value of a key. If it is not there and create is set, adds the key with a zeroed value if
+ * there is room. Returns NULL if there is no value. Called with the lock of the map held.
+ */
+static u_char* map_find(struct ebpf_map* map, u_char* key, int create)
+{
+	u_char* entry;
+	u_char* slot = NULL;
+	u_int32 index, i;
+
+	if (map->Def.type == EBPF_MAP_ARRAY)
+	{
+		RtlCopyMemory(&index, key, sizeof(index));
+		return index < map->NSlots ? map->Data + (ULONG_PTR)index * map->EntrySize : NULL;
+	}
+
+	index = map_hash(key, map->Def.key_size);
+	for (i = 0; i < map->NSlots; i++, index++)
+	{
+		entry = map->Data + (ULONG_PTR)(index & (map->NSlots - 1)) * map->EntrySize;
+
+		if (*(ULONGLONG*)entry == MAP_USED)
+		{
+			if (RtlEqualMemory(entry + sizeof(ULONGLONG), key, map->Def.key_size))
+				return entry + sizeof(ULONGLONG) + map->KeyStride;
+			continue;
+		}
+
+		// The first deleted entry is reused, an empty one ends the probe
+		if (slot == NULL)
+			slot = entry;
+		if (*(ULONGLONG*)entry == MAP_EMPTY)
+			break;
+	}
+
+	if (!create || slot == NULL || map->Count == map->Def.max_entries)
+		return NULL;
+
+	*(ULONGLONG*)slot = MAP_USED;
+	RtlCopyMemory(slot + sizeof(ULONGLONG), key, map->Def.key_size);
+	RtlZeroMemory(slot + sizeof(ULONGLONG) + map->KeyStride, map->EntrySize - sizeof(ULONGLONG) - map->KeyStride);
+	map->Count++;
+
+	return slot + sizeof(ULONGLONG) + map->KeyStride;
+}
+
+static int map_delete(struct ebpf_map* map, u_char* key)
+{
+	u_char* value;
+
+	if (map->Def.type != EBPF_MAP_HASH)
+		return FALSE;
+
+	value = map_find(map, key, FALSE);
+	if (value == NULL)
+		return FALSE;
+
+	*(ULONGLONG*)(value - map->KeyStride - sizeof(ULONGLONG)) = MAP_DELETED;
+	map->Count--;
+
+	return TRUE;
+}
+
+/*
+ * The helpers. The verifier has checked the index of the map and the buffers in the stack
+ */
+static ULONGLONG ebpf_call(struct ebpf_program* prog, bpf_int32 func, ULONGLONG* reg)
+{
+	struct ebpf_map* map = &prog->Maps[reg[EBPF_REG_1]];
+	u_char* key = (u_char*)(ULONG_PTR)reg[EBPF_REG_2];
+	u_char* value;
+	ULONGLONG result = (ULONGLONG)-1;
+
+	MAP_LOCK(map);
+
+	switch (func)
+	{
+	case EBPF_FUNC_MAP_LOOKUP:
+		result = 0;
+		value = map_find(map, key, FALSE);
+		if (value != NULL)
+		{
+			RtlCopyMemory((u_char*)(ULONG_PTR)reg[EBPF_REG_3], value, map->Def.value_size);
+			result = 1;
+		}
+		break;
+
+	case EBPF_FUNC_MAP_UPDATE:
+		value = map_find(map, key, TRUE);
+		if (value != NULL)
+		{
+			RtlCopyMemory(value, (u_char*)(ULONG_PTR)reg[EBPF_REG_3], map->Def.value_size);
+			result = 0;
+		}
+		break;
+
+	case EBPF_FUNC_MAP_DELETE:
+		if (map_delete(map, key))
+			result = 0;
+		break;
+
+	default:
+		value = map_find(map, key, TRUE);
+		if (value != NULL)
+		{
+			*(ULONGLONG*)value += reg[EBPF_REG_3];
+			result = 0;
+		}
+		break;
+	}
+
+	MAP_UNLOCK(map);
+
+	return result;
+}
+
+//
+// The interpreter
+//
+
+static u_int ebpf_run(struct ebpf_program* prog, u_char* p, struct bpf_frag* frags, u_int wirelen, u_int buflen, struct bpf_meta* meta)
+{
+	ULONGLONG reg[EBPF_NREGS];
+	ULONGLONG stack[EBPF_STACK_SIZE / sizeof(ULONGLONG)];
+	struct ebpf_insn* pc = prog->Insns;
+	ULONGLONG src;
+	u_char* addr;
+	u_int32 k, size;
+
+	// Nothing of the kernel stack must leak into the maps
+	RtlZeroMemory(reg, sizeof(reg));
+	RtlZeroMemory(stack, sizeof(stack));
+
+	reg[EBPF_REG_1] = wirelen;
+	reg[EBPF_REG_2] = buflen;
+	reg[EBPF_REG_10] = (ULONGLONG)(ULONG_PTR)((u_char*)stack + sizeof(stack));
+
+	for (;; pc++)
+	{
+		switch (BPF_CLASS(pc->code))
+		{
+		case BPF_ALU:
+		case EBPF_ALU64:
+			src = BPF_SRC(pc->code) == BPF_X ? reg[EBPF_SRC(pc)] : (ULONGLONG)(LONGLONG)pc->imm;
+			reg[EBPF_DST(pc)] = ebpf_alu(pc->code, reg[EBPF_DST(pc)], src);
+			break;
+
+		case BPF_JMP:
+			switch (BPF_OP(pc->code))
+			{
+			case EBPF_EXIT:
+				return (u_int)reg[EBPF_REG_0];
+
+			case EBPF_CALL:
+				reg[EBPF_REG_0] = ebpf_call(prog, pc->imm, reg);
+				break;
+
+			case BPF_JA:
+				pc += pc->off;
+				break;
+
+			default:
+				src = BPF_SRC(pc->code) == BPF_X ? reg[EBPF_SRC(pc)] : (ULONGLONG)(LONGLONG)pc->imm;
+				if (ebpf_cond(pc->code, reg[EBPF_DST(pc)], src))
+					pc += pc->off;
+				break;
+			}
+			break;
+
+		case BPF_LD:
+			if (pc->code == (BPF_LD|EBPF_DW|BPF_IMM))
+			{
+				reg[EBPF_DST(pc)] = (u_int32)pc[0].imm | ((ULONGLONG)(u_int32)pc[1].imm << 32);
+				pc++;
+				break;
+			}
+
+			// The loads from the packet, with the checks of bpf_filter()
+			k = (u_int32)pc->imm;
+			if (BPF_MODE(pc->code) == BPF_IND)
+				k += (u_int32)reg[EBPF_SRC(pc)];
+			size = ebpf_size(pc->code);
+
+			if (k >= buflen || size > buflen - k)
+			{
+				if (BPF_MODE(pc->code) == BPF_ABS && BPF_IS_ANCILLARY(pc->code, k))
+				{
+					reg[EBPF_REG_0] = BPF_AD_LOAD(meta, k - BPF_AD_OFF);
+					break;
+				}
+				return 0;
+			}
+
+			if (frags != NULL)
+				reg[EBPF_REG_0] = bpf_frag_load(frags, k, size);
+			else if (size == 4)
+				reg[EBPF_REG_0] = EXTRACT_LONG(&p[k]);
+			else if (size == 2)
+				reg[EBPF_REG_0] = EXTRACT_SHORT(&p[k]);
+			else
+				reg[EBPF_REG_0] = p[k];
+			break;
+
+		case BPF_LDX:
+			addr = (u_char*)(ULONG_PTR)(reg[EBPF_SRC(pc)] + (LONGLONG)pc->off);
+			switch (BPF_SIZE(pc->code))
+			{
+			case BPF_W:
+				reg[EBPF_DST(pc)] = *(u_int32*)addr;
+				break;
+			case BPF_H:
+				reg[EBPF_DST(pc)] = *(u_short*)addr;
+				break;
+			case BPF_B:
+				reg[EBPF_DST(pc)] = *addr;
+				break;
+			default:
+				reg[EBPF_DST(pc)] = *(ULONGLONG*)addr;
+				break;
+			}
+			break;
+
+		default:
+			addr = (u_char*)(ULONG_PTR)(reg[EBPF_DST(pc)] + (LONGLONG)pc->off);
+			src = BPF_CLASS(pc->code) == BPF_STX ? reg[EBPF_SRC(pc)] : (ULONGLONG)(LONGLONG)pc->imm;
+			switch (BPF_SIZE(pc->code))
+			{
+			case BPF_W:
+				*(u_int32*)addr = (u_int32)src;
+				break;
+			case BPF_H:
+				*(u_short*)addr = (u_short)src;
+				break;
+			case BPF_B:
+				*addr = (u_char)src;
+				break;
+			default:
+				*(ULONGLONG*)addr = src;
+				break;
+			}
+			break;
+		}
+	}
+}
+
+u_int ebpf_filter(struct ebpf_program* prog, u_char* p, u_int wirelen, u_int buflen, struct bpf_meta* meta)
+{
+	return ebpf_run(prog, p, NULL, wirelen, buflen, meta);
+}
+
+u_int ebpf_filter_frags(struct ebpf_program* prog, struct bpf_frag* frags, u_int wirelen, u_int buflen, struct bpf_meta* meta)
+{
+	return ebpf_run(prog, NULL, frags, wirelen, buflen, meta);
+}
+
+//
+// The verifier
+//
+
+/// What is known of a register
+#define VERIFY_UNINIT		0		///< Not written yet
+#define VERIFY_SCALAR		1		///< A number
+#define VERIFY_CONST		2		///< A known number, in Value
+#define VERIFY_STACK		3		///< The frame pointer plus the offset in Value, that is not positive
+
+/// The flags of the instructions
+#define VERIFY_TARGET		1		///< The target of a jump
+#define VERIFY_IMM64		2		///< The second half of a 64-bit immediate load
+
+/// The outcomes of an instruction
+#define VERIFY_NEXT			0
+#define VERIFY_EXIT			1
+#define VERIFY_PRUNED		2
+#define VERIFY_REJECT		3
+
+struct verify_reg
+{
+	u_int32 Type;
+	ULONGLONG Value;
+};
+
+struct verify_state
+{
+	struct verify_reg Regs[EBPF_NREGS];
+};
+
+struct verify_checkpoint
+{
+	struct verify_state State;
+	u_int Pc;
+	int Parent;				///< The previous checkpoint of the path, -1 if none
+	int Next;				///< The next checkpoint at the same instruction, -1 if none
+	u_int Branches;			///< Paths through the checkpoint that have not ended yet
+};
+
+struct verify_path
+{
+	struct verify_state State;
+	u_int Pc;
+	int Checkpoint;			///< The last checkpoint of the path, -1 if none
+};
+
+struct verify_context
+{
+	struct ebpf_insn* Insns;
+	u_int Len;
+	struct ebpf_map_def* Maps;
+	u_int NMaps;
+	struct verify_checkpoint* Checkpoints;
+	u_int NCheckpoints;
+	struct verify_path* Pending;
+	u_int NPending;
+	int* Heads;				///< For each instruction, its first checkpoint, -1 if none
+	u_char* Counts;			///< For each instruction, its number of checkpoints
+	u_char* Flags;			///< For each instruction, VERIFY_TARGET and VERIFY_IMM64
+};
+
+/*
+ * Checks the encoding of the instructions and of their jumps
+ */
+static int verify_structure(struct verify_context* ctx)
+{
+	struct ebpf_insn* p;
+	u_int32 op, dst, src;
+	int target;
+	u_int i;
+
+	for (i = 0; i < ctx->Len; i++)
+	{
+		p = &ctx->Insns[i];
+		op = BPF_OP(p->code);
+		dst = EBPF_DST(p);
+		src = EBPF_SRC(p);
+
+		if (dst >= EBPF_NREGS || src >= EBPF_NREGS)
+			return FALSE;
+
+		switch (BPF_CLASS(p->code))
+		{
+		case BPF_ALU:
+		case EBPF_ALU64:
+			if (op > EBPF_ARSH || dst == EBPF_REG_10 || p->off != 0)
+				return FALSE;
+			if (BPF_SRC(p->code) == BPF_X)
+			{
+				if (op == BPF_NEG)
+					return FALSE;
+				break;
+			}
+			if (src != 0 || ((op == BPF_DIV || op == EBPF_MOD) && p->imm == 0))
+				return FALSE;
+			if ((op == BPF_LSH || op == BPF_RSH || op == EBPF_ARSH) &&
+				(u_int32)p->imm >= (BPF_CLASS(p->code) == EBPF_ALU64 ? 64u : 32u))
+				return FALSE;
+			break;
+
+		case BPF_JMP:
+			if (op == EBPF_CALL || op == EBPF_EXIT)
+			{
+				if (BPF_SRC(p->code) != BPF_K || dst != 0 || src != 0 || p->off != 0 || (op == EBPF_EXIT && p->imm != 0))
+					return FALSE;
+				break;
+			}
+			if (op > EBPF_JSLE || (BPF_SRC(p->code) == BPF_K && src != 0))
+				return FALSE;
+			if (op == BPF_JA && (BPF_SRC(p->code) != BPF_K || dst != 0 || p->imm != 0))
+				return FALSE;
+
+			target = (int)i + 1 + p->off;
+			if (target < 0 || target >= (int)ctx->Len)
+				return FALSE;
+			ctx->Flags[target] |= VERIFY_TARGET;
+			break;
+
+		case BPF_LD:
+			if (p->code == (BPF_LD|EBPF_DW|BPF_IMM))
+			{
+				if (dst == EBPF_REG_10 || src != 0 || p->off != 0 || i + 1 >= ctx->Len ||
+					p[1].code != 0 || p[1].regs != 0 || p[1].off != 0)
+					return FALSE;
+				ctx->Flags[++i] |= VERIFY_IMM64;
+				break;
+			}
+			if ((BPF_MODE(p->code) != BPF_ABS && BPF_MODE(p->code) != BPF_IND) || BPF_SIZE(p->code) == EBPF_DW ||
+				dst != 0 || p->off != 0)
+				return FALSE;
+			if (BPF_MODE(p->code) == BPF_ABS)
+			{
+				// Like bpf_validate(), the ancillary area only has the known fields
+				if (src != 0 || ((u_int32)p->imm - BPF_AD_OFF < BPF_AD_AREA && !BPF_IS_ANCILLARY(p->code, (u_int32)p->imm)))
+					return FALSE;
+			}
+			break;
+
+		case BPF_LDX:
+			if (BPF_MODE(p->code) != BPF_MEM || dst == EBPF_REG_10 || p->imm != 0)
+				return FALSE;
+			break;
+
+		case BPF_ST:
+			if (BPF_MODE(p->code) != BPF_MEM || src != 0)
+				return FALSE;
+			break;
+
+		case BPF_STX:
+			if (BPF_MODE(p->code) != BPF_MEM || p->imm != 0)
+				return FALSE;
+			break;
+
+		default:
+			return FALSE;
+		}
+	}
+
+	// No jump lands in the middle of a 64-bit immediate load
+	for (i = 0; i < ctx->Len; i++)
+	{
+		if (ctx->Flags[i] == (VERIFY_TARGET|VERIFY_IMM64))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static int verify_equal(struct verify_state* a, struct verify_state* b)
+{
+	u_int i;
+
+	for (i = 0; i < EBPF_NREGS; i++)
+	{
+		if (a->Regs[i].Type != b->Regs[i].Type)
+			return FALSE;
+		if ((a->Regs[i].Type == VERIFY_CONST || a->Regs[i].Type == VERIFY_STACK) && a->Regs[i].Value != b->Regs[i].Value)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static int verify_is_number(struct verify_reg* r)
+{
+	return r->Type == VERIFY_SCALAR || r->Type == VERIFY_CONST;
+}
+
+/*
+ * TRUE if the size bytes at off from the register are in the stack
+ */
+static int verify_in_stack(struct verify_reg* r, LONGLONG off, u_int32 size)
+{
+	LONGLONG start;
+
+	if (r->Type != VERIFY_STACK)
+		return FALSE;
+
+	start = (LONGLONG)r->Value + off;
+
+	return start >= -EBPF_STACK_SIZE && start + size <= 0;
+}
+
+static int verify_call(struct verify_context* ctx, bpf_int32 func, struct verify_reg* regs)
+{
+	struct ebpf_map_def* map;
+
+	if (func < EBPF_FUNC_MAP_LOOKUP || func > EBPF_FUNC_MAP_ADD)
+		return FALSE;
+
+	if (regs[EBPF_REG_1].Type != VERIFY_CONST || regs[EBPF_REG_1].Value >= ctx->NMaps)
+		return FALSE;
+	map = &ctx->Maps[regs[EBPF_REG_1].Value];
+
+	if (!verify_in_stack(&regs[EBPF_REG_2], 0, map->key_size))
+		return FALSE;
+
+	switch (func)
+	{
+	case EBPF_FUNC_MAP_LOOKUP:
+	case EBPF_FUNC_MAP_UPDATE:
+		return verify_in_stack(&regs[EBPF_REG_3], 0, map->value_size);
+	case EBPF_FUNC_MAP_DELETE:
+		return TRUE;
+	default:
+		return map->value_size >= sizeof(ULONGLONG) && verify_is_number(&regs[EBPF_REG_3]);
+	}
+}
+
+/*
+ * Ends a path: its checkpoints whose paths have all ended are complete
+ */
+static void verify_done(struct verify_context* ctx, int checkpoint)
+{
+	while (checkpoint >= 0 && --ctx->Checkpoints[checkpoint].Branches == 0)
+		checkpoint = ctx->Checkpoints[checkpoint].Parent;
+}
+
+/*
+ * At the target of a jump: ends the path if it reaches a known state, remembers the state otherwise
+ */
+static int verify_checkpoint(struct verify_context* ctx, struct verify_path* path)
+{
+	struct verify_checkpoint* cp;
+	int i;
+
+	for (i = ctx->Heads[path->Pc]; i >= 0; i = cp->Next)
+	{
+		cp = &ctx->Checkpoints[i];
+		if (verify_equal(&cp->State, &path->State))
+		{
+			// The same state on the same path: a loop that never ends
+			if (cp->Branches != 0)
+				return VERIFY_REJECT;
+
+			verify_done(ctx, path->Checkpoint);
+			return VERIFY_PRUNED;
+		}
+	}
+
+	if (ctx->NCheckpoints < EBPF_VERIFY_MAX_CHECKPOINTS && ctx->Counts[path->Pc] < EBPF_VERIFY_MAX_PER_INSN)
+	{
+		i = (int)ctx->NCheckpoints++;
+		cp = &ctx->Checkpoints[i];
+		cp->State = path->State;
+		cp->Pc = path->Pc;
+		cp->Parent = path->Checkpoint;
+		cp->Next = ctx->Heads[path->Pc];
+		cp->Branches = 1;
+
+		ctx->Heads[path->Pc] = i;
+		ctx->Counts[path->Pc]++;
+		path->Checkpoint = i;
+	}
+
+	return VERIFY_NEXT;
+}
+
+/*
+ * Follows an instruction of a path. The other outcome of a conditional jump is queued
+ */
+static int verify_insn(struct verify_context* ctx, struct verify_path* path)
+{
+	struct ebpf_insn* p = &ctx->Insns[path->Pc];
+	struct verify_reg* regs = path->State.Regs;
+	struct verify_reg* dst = &regs[EBPF_DST(p)];
+	struct verify_reg* src = &regs[EBPF_SRC(p)];
+	struct verify_path* fork;
+	struct verify_reg k;
+	u_int i;
+
+	switch (BPF_CLASS(p->code))
+	{
+	case BPF_ALU:
+	case EBPF_ALU64:
+		if (BPF_SRC(p->code) == BPF_X)
+		{
+			if (src->Type == VERIFY_UNINIT)
+				return VERIFY_REJECT;
+			k = *src;
+		}
+		else
+		{
+			k.Type = VERIFY_CONST;
+			k.Value = (ULONGLONG)(LONGLONG)p->imm;
+		}
+
+		if (BPF_OP(p->code) == EBPF_MOV)
+		{
+			// A pointer is only copied whole
+			if (k.Type == VERIFY_STACK && BPF_CLASS(p->code) == BPF_ALU)
+				return VERIFY_REJECT;
+			if (k.Type == VERIFY_CONST)
+				k.Value = ebpf_alu(p->code, 0, k.Value);
+			*dst = k;
+			break;
+		}
+
+		if (dst->Type == VERIFY_UNINIT)
+			return VERIFY_REJECT;
+
+		if (dst->Type == VERIFY_STACK)
+		{
+			// The pointers move by constants, within the stack
+			if (BPF_CLASS(p->code) != EBPF_ALU64 || (BPF_OP(p->code) != BPF_ADD && BPF_OP(p->code) != BPF_SUB) ||
+				k.Type != VERIFY_CONST)
+				return VERIFY_REJECT;
+
+			dst->Value = ebpf_alu(p->code, dst->Value, k.Value);
+			if ((LONGLONG)dst->Value < -EBPF_STACK_SIZE || (LONGLONG)dst->Value > 0)
+				return VERIFY_REJECT;
+			break;
+		}
+
+		if (k.Type == VERIFY_STACK)
+			return VERIFY_REJECT;
+
+		if (dst->Type == VERIFY_CONST && k.Type == VERIFY_CONST)
+		{
+			dst->Value = ebpf_alu(p->code, dst->Value, k.Value);
+		}
+		else
+		{
+			dst->Type = VERIFY_SCALAR;
+			dst->Value = 0;
+		}
+		break;
+
+	case BPF_JMP:
+		switch (BPF_OP(p->code))
+		{
+		case EBPF_EXIT:
+			// The result cannot be a kernel address
+			return verify_is_number(&regs[EBPF_REG_0]) ? VERIFY_EXIT : VERIFY_REJECT;
+
+		case EBPF_CALL:
+			if (!verify_call(ctx, p->imm, regs))
+				return VERIFY_REJECT;
+
+			regs[EBPF_REG_0].Type = VERIFY_SCALAR;
+			regs[EBPF_REG_0].Value = 0;
+			for (i = EBPF_REG_1; i <= EBPF_REG_5; i++)
+			{
+				regs[i].Type = VERIFY_UNINIT;
+				regs[i].Value = 0;
+			}
+			break;
+
+		case BPF_JA:
+			path->Pc += p->off;
+			break;
+
+		default:
+			if (BPF_SRC(p->code) == BPF_X)
+			{
+				k = *src;
+			}
+			else
+			{
+				k.Type = VERIFY_CONST;
+				k.Value = (ULONGLONG)(LONGLONG)p->imm;
+			}
+
+			// The pointers are not compared, their value would leak
+			if (!verify_is_number(dst) || !verify_is_number(&k))
+				return VERIFY_REJECT;
+
+			if (dst->Type == VERIFY_CONST && k.Type == VERIFY_CONST)
+			{
+				if (ebpf_cond(p->code, dst->Value, k.Value))
+					path->Pc += p->off;
+				break;
+			}
+
+			// Both outcomes are possible: the jump is followed later
+			if (ctx->NPending == EBPF_VERIFY_MAX_PENDING)
+				return VERIFY_REJECT;
+
+			fork = &ctx->Pending[ctx->NPending++];
+			*fork = *path;
+			fork->Pc = path->Pc + 1 + p->off;
+			if (path->Checkpoint >= 0)
+				ctx->Checkpoints[path->Checkpoint].Branches++;
+
+			// An equality with a constant makes the register known on its side
+			if (k.Type == VERIFY_CONST && BPF_OP(p->code) == BPF_JEQ)
+				fork->State.Regs[EBPF_DST(p)] = k;
+			else if (k.Type == VERIFY_CONST && BPF_OP(p->code) == EBPF_JNE)
+				*dst = k;
+			break;
+		}
+		break;
+
+	case BPF_LD:
+		if (p->code == (BPF_LD|EBPF_DW|BPF_IMM))
+		{
+			dst->Type = VERIFY_CONST;
+			dst->Value = (u_int32)p[0].imm | ((ULONGLONG)(u_int32)p[1].imm << 32);
+			path->Pc++;
+			break;
+		}
+
+		if (BPF_MODE(p->code) == BPF_IND && !verify_is_number(src))
+			return VERIFY_REJECT;
+
+		regs[EBPF_REG_0].Type = VERIFY_SCALAR;
+		regs[EBPF_REG_0].Value = 0;
+		break;
+
+	case BPF_LDX:
+		if (!verify_in_stack(src, p->off, ebpf_size(p->code)) || ((LONGLONG)src->Value + p->off) % ebpf_size(p->code) != 0)
+			return VERIFY_REJECT;
+
+		dst->Type = VERIFY_SCALAR;
+		dst->Value = 0;
+		break;
+
+	default:
+		// The pointers are not stored, they could not be checked when loaded back
+		if (BPF_CLASS(p->code) == BPF_STX && !verify_is_number(src))
+			return VERIFY_REJECT;
+
+		if (!verify_in_stack(dst, p->off, ebpf_size(p->code)) || ((LONGLONG)dst->Value + p->off) % ebpf_size(p->code) != 0)
+			return VERIFY_REJECT;
+		break;
+	}
+
+	// The program cannot run past its end
+	if (++path->Pc >= ctx->Len)
+		return VERIFY_REJECT;
+
+	return VERIFY_NEXT;
+}
+
+static int verify_paths(struct verify_context* ctx)
+{
+	struct verify_path path;
+	u_int steps = 0;
+	u_int i;
+	int result;
+
+	// On entry R1 and R2 are the lengths of the packet and R10 the frame pointer
+	RtlZeroMemory(&path, sizeof(path));
+	for (i = 0; i < EBPF_NREGS; i++)
+		path.State.Regs[i].Type = VERIFY_UNINIT;
+	path.State.Regs[EBPF_REG_1].Type = VERIFY_SCALAR;
+	path.State.Regs[EBPF_REG_2].Type = VERIFY_SCALAR;
+	path.State.Regs[EBPF_REG_10].Type = VERIFY_STACK;
+	path.Checkpoint = -1;
+
+	ctx->Pending[ctx->NPending++] = path;
+
+	while (ctx->NPending > 0)
+	{
+		path = ctx->Pending[--ctx->NPending];
+
+		for (;;)
+		{
+			if (++steps > EBPF_VERIFY_MAX_STEPS)
+				return FALSE;
+
+			result = VERIFY_NEXT;
+			if (ctx->Flags[path.Pc] & VERIFY_TARGET)
+				result = verify_checkpoint(ctx, &path);
+
+			if (result == VERIFY_NEXT)
+				result = verify_insn(ctx, &path);
+
+			if (result == VERIFY_REJECT)
+				return FALSE;
+
+			if (result == VERIFY_EXIT)
+				verify_done(ctx, path.Checkpoint);
+
+			if (result != VERIFY_NEXT)
+				break;
+		}
+	}
+
+	return TRUE;
+}
+
+static int ebpf_verify(struct ebpf_insn* insns, u_int len, struct ebpf_map_def* maps, u_int nmaps)
+{
+	struct verify_context ctx;
+	u_char* memory;
+	u_int i;
+	int result;
+
+	memory = (u_char*)EBPF_ALLOC(EBPF_VERIFY_MAX_CHECKPOINTS * sizeof(struct verify_checkpoint) +
+		EBPF_VERIFY_MAX_PENDING * sizeof(struct verify_path) + len * (sizeof(int) + 2));
+	if (memory == NULL)
+		return FALSE;
+
+	ctx.Insns = insns;
+	ctx.Len = len;
+	ctx.Maps = maps;
+	ctx.NMaps = nmaps;
+	ctx.Checkpoints = (struct verify_checkpoint*)memory;
+	ctx.NCheckpoints = 0;
+	ctx.Pending = (struct verify_path*)(ctx.Checkpoints + EBPF_VERIFY_MAX_CHECKPOINTS);
+	ctx.NPending = 0;
+	ctx.Heads = (int*)(ctx.Pending + EBPF_VERIFY_MAX_PENDING);
+	ctx.Counts = (u_char*)(ctx.Heads + len);
+	ctx.Flags = ctx.Counts + len;
+
+	for (i = 0; i < len; i++)
+	{
+		ctx.Heads[i] = -1;
+		ctx.Counts[i] = 0;
+		ctx.Flags[i] = 0;
+	}
+
+	result = verify_structure(&ctx) && verify_paths(&ctx);
+
+	EBPF_FREE(memory);
+
+	return result;
+}
+
+//
+// The programs
+//
+
+struct ebpf_program* ebpf_load(void* image, u_int size)
+{
+	struct ebpf_program_header* header = (struct ebpf_program_header*)image;
+	struct ebpf_program* prog;
+	struct ebpf_map_def* maps;
+	struct ebpf_insn* insns;
+	struct ebpf_map* map;
+	u_int i;
+
+	if (size < sizeof(struct ebpf_program_header) || header->magic != EBPF_MAGIC || header->reserved != 0 ||
+		header->nmaps > EBPF_MAX_MAPS || header->len < 1 || header->len > EBPF_MAXINSNS ||
+		size != sizeof(struct ebpf_program_header) + header->nmaps * sizeof(struct ebpf_map_def) + header->len * sizeof(struct ebpf_insn))
+		return NULL;
+
+	maps = (struct ebpf_map_def*)(header + 1);
+	insns = (struct ebpf_insn*)(maps + header->nmaps);
+
+	if (!map_check(maps, header->nmaps) || !ebpf_verify(insns, header->len, maps, header->nmaps))
+		return NULL;
+
+	prog = (struct ebpf_program*)EBPF_ALLOC(sizeof(struct ebpf_program) + (header->len - 1) * sizeof(struct ebpf_insn));
+	if (prog == NULL)
+		return NULL;
+
+	prog->Len = header->len;
+	prog->NMaps = 0;
+	RtlCopyMemory(prog->Insns, insns, header->len * sizeof(struct ebpf_insn));
+
+	for (i = 0; i < header->nmaps; i++)
+	{
+		map = &prog->Maps[i];
+		map->Def = maps[i];
+		map->Count = 0;
+		map->Data = (u_char*)EBPF_ALLOC((ULONG_PTR)map_layout(&maps[i], &map->KeyStride, &map->EntrySize, &map->NSlots));
+		if (map->Data == NULL)
+		{
+			ebpf_free(prog);
+			return NULL;
+		}
+
+		// The values of an array always exist
+		RtlZeroMemory(map->Data, (ULONG_PTR)map->EntrySize * map->NSlots);
+		if (map->Def.type == EBPF_MAP_ARRAY)
+			map->Count = map->NSlots;
+
+		MAP_LOCK_INIT(map);
+		prog->NMaps++;
+	}
+
+	return prog;
+}
+
+void ebpf_free(struct ebpf_program* prog)
+{
+	u_int i;
+
+	for (i = 0; i < prog->NMaps; i++)
+	{
+		MAP_LOCK_FREE(&prog->Maps[i]);
+		EBPF_FREE(prog->Maps[i].Data);
+	}
+
+	EBPF_FREE(prog);
+}
+
+u_int ebpf_map_count(struct ebpf_program* prog)
+{
+	return prog->NMaps;
+}
+
+int ebpf_map_lookup(struct ebpf_program* prog, u_int index, void* key, void* value)
+{
+	struct ebpf_map* map;
+	u_char* found;
+
+	if (index >= prog->NMaps)
+		return FALSE;
+
+	map = &prog->Maps[index];
+
+	MAP_LOCK(map);
+	found = map_find(map, (u_char*)key, FALSE);
+	if (found != NULL)
+		RtlCopyMemory(value, found, map->Def.value_size);
+	MAP_UNLOCK(map);
+
+	return found != NULL;
+}
+
+u_int ebpf_map_dump(struct ebpf_program* prog, u_int index, struct ebpf_map_info* info, u_int size)
+{
+	struct ebpf_map* map;
+	u_char* out = (u_char*)(info + 1);
+	u_char* entry;
+	u_int written = sizeof(struct ebpf_map_info);
+	u_int record;
+	u_int32 i;
+
+	if (index >= prog->NMaps || size < sizeof(struct ebpf_map_info))
+		return 0;
+
+	map = &prog->Maps[index];
+	record = map->Def.key_size + map->Def.value_size;
+
+	MAP_LOCK(map);
+
+	info->def = map->Def;
+	info->count = map->Count;
+	info->reserved = 0;
+
+	// Copy as many records as fit, count tells the caller if the buffer was too small
+	for (i = 0; i < map->NSlots && size - written >= record; i++)
+	{
+		entry = map->Data + (ULONG_PTR)i * map->EntrySize;
+
+		if (map->Def.type == EBPF_MAP_ARRAY)
+		{
+			RtlCopyMemory(out, &i, sizeof(i));
+			RtlCopyMemory(out + sizeof(i), entry, map->Def.value_size);
+		}
+		else if (*(ULONGLONG*)entry == MAP_USED)
+		{
+			RtlCopyMemory(out, entry + sizeof(ULONGLONG), map->Def.key_size);
+			RtlCopyMemory(out + map->Def.key_size, entry + sizeof(ULONGLONG) + map->KeyStride, map->Def.value_size);
+		}
+		else
+		{
+			continue;
+		}
+
+		out += record;
+		written += record;
+	}
+
+	MAP_UNLOCK(map);
+
+	return written;
+}
@@ -0,0 +1,220 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * The choice of the member of a fanout group, see win_fanout.h.
+ *
+ * The hash is the MurmurHash3 of the addresses, of the protocol and of the ports of the packet. The
+ * two addresses, and the two ports, are hashed in the same order whatever their direction, the
+ * lower one first.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_fanout.h"
+
+#define FANOUT_ETHERNET_LEN		14
+#define FANOUT_ETHERTYPE_IP		0x0800
+#define FANOUT_ETHERTYPE_IPV6	0x86dd
+#define FANOUT_ETHERTYPE_VLAN	0x8100
+#define FANOUT_ETHERTYPE_QINQ	0x88a8
+
+#define FANOUT_IPPROTO_HOPOPTS	0
+#define FANOUT_IPPROTO_TCP		6
+#define FANOUT_IPPROTO_UDP		17
+#define FANOUT_IPPROTO_ROUTING	43
+#define FANOUT_IPPROTO_FRAGMENT	44
+#define FANOUT_IPPROTO_DSTOPTS	60
+#define FANOUT_IPPROTO_SCTP		132
+
+#define FANOUT_SEED				0x4e504346	///< "NPCF"
+
+#define FANOUT_ROTL(_x, _r)		(((_x) << (_r)) | ((_x) >> (32 - (_r))))
+#define FANOUT_GET16(_p)		((u_int)((_p)[0] << 8 | (_p)[1]))
+
+static u_int32 fanout_mix(u_int32 h, u_int32 k)
+{
+	k *= 0xcc9e2d51;
+	k = FANOUT_ROTL(k, 15);
+	k *= 0x1b873593;
+
+	h ^= k;
+	h = FANOUT_ROTL(h, 13);
+	return h * 5 + 0xe6546b64;
+}
+
+static u_int32 fanout_final(u_int32 h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static u_int32 fanout_mix_bytes(u_int32 h, const u_char* p, u_int len)
+{
+	u_int32 k;
+	u_int i;
+
+	for (i = 0; i < len; i += 4)
+	{
+		k = p[i];
+		if (i + 1 < len)
+			k |= (u_int32)p[i + 1] << 8;
+		if (i + 2 < len)
+			k |= (u_int32)p[i + 2] << 16;
+		if (i + 3 < len)
+			k |= (u_int32)p[i + 3] << 24;
+
+		h = fanout_mix(h, k);
+	}
+
+	return h;
+}
+
+/*
+ * Hashes two addresses of len bytes, the lower one first.
+ */
+static u_int32 fanout_mix_pair(u_int32 h, const u_char* a, const u_char* b, u_int len)
+{
+	const u_char* tmp;
+	u_int i;
+
+	for (i = 0; i < len && a[i] == b[i]; i++);
+
+	if (i < len && a[i] > b[i])
+	{
+		tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	h = fanout_mix_bytes(h, a, len);
+	return fanout_mix_bytes(h, b, len);
+}
+
+u_int32 npf_fanout_hash(const u_char* p, u_int len, u_int link_len)
+{
+	u_int off, type, proto, hlen, sport, dport, alen;
+	const u_char* src;
+	const u_char* dst;
+	int fragment = 0;
+	u_int32 h;
+
+	if (link_len == FANOUT_ETHERNET_LEN)
+	{
+		if (len < FANOUT_ETHERNET_LEN)
+			return 0;
+
+		type = FANOUT_GET16(p + 12);
+		off = FANOUT_ETHERNET_LEN;
+
+		while ((type == FANOUT_ETHERTYPE_VLAN || type == FANOUT_ETHERTYPE_QINQ) && off + 4 <= len)
+		{
+			type = FANOUT_GET16(p + off + 2);
+			off += 4;
+		}
+	}
+	else
+	{
+		// The null header of the loopback adapter: the version of IP tells the protocol
+		off = link_len;
+		if (off >= len)
+			return 0;
+
+		switch (p[off] >> 4)
+		{
+		case 4:
+			type = FANOUT_ETHERTYPE_IP;
+			break;
+		case 6:
+			type = FANOUT_ETHERTYPE_IPV6;
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	if (type == FANOUT_ETHERTYPE_IP && off + 20 <= len && (hlen = (p[off] & 0xf) * 4) >= 20)
+	{
+		proto = p[off + 9];
+		src = p + off + 12;
+		dst = p + off + 16;
+		alen = 4;
+
+		// More fragments, or an offset
+		fragment = (FANOUT_GET16(p + off + 6) & 0x3fff) != 0;
+		off += hlen;
+	}
+	else if (type == FANOUT_ETHERTYPE_IPV6 && off + 40 <= len)
+	{
+		proto = p[off + 6];
+		src = p + off + 8;
+		dst = p + off + 24;
+		alen = 16;
+		off += 40;
+
+		while ((proto == FANOUT_IPPROTO_HOPOPTS || proto == FANOUT_IPPROTO_ROUTING || proto == FANOUT_IPPROTO_DSTOPTS) && off + 8 <= len)
+		{
+			proto = p[off];
+			off += (p[off + 1] + 1) * 8;
+		}
+
+		if (proto == FANOUT_IPPROTO_FRAGMENT)
+			fragment = 1;
+	}
+	else if (link_len == FANOUT_ETHERNET_LEN)
+	{
+		// Not IP: the MAC addresses
+		return fanout_final(fanout_mix_pair(FANOUT_SEED, p, p + 6, 6));
+	}
+	else
+	{
+		return 0;
+	}
+
+	sport = 0;
+	dport = 0;
+
+	if (!fragment && (proto == FANOUT_IPPROTO_TCP || proto == FANOUT_IPPROTO_UDP || proto == FANOUT_IPPROTO_SCTP) && off + 4 <= len)
+	{
+		sport = FANOUT_GET16(p + off);
+		dport = FANOUT_GET16(p + off + 2);
+	}
+
+	h = fanout_mix_pair(FANOUT_SEED, src, dst, alen);
+	h = fanout_mix(h, fragment ? 0 : proto);
+	h = fanout_mix(h, sport < dport ? sport << 16 | dport : dport << 16 | sport);
+
+	return fanout_final(h);
+}
+
+u_int npf_fanout_member(u_int mode, u_int count, u_int32 hash, u_int cpu, u_int seq)
+{
+	switch (mode)
+	{
+	case NPF_FANOUT_HASH:
+		// The high bits of the hash, spread over the members without a division
+		return (u_int)(((ULONGLONG)hash * count) >> 32);
+
+	case NPF_FANOUT_LB:
+		return seq % count;
+
+	case NPF_FANOUT_CPU:
+		return cpu % count;
+
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,79 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * The min-heap of the merge of the kernel buffers, see win_merge.h.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_merge.h"
+
+static int merge_before(struct npf_merge_entry* a, struct npf_merge_entry* b)
+{
+	return a->stamp < b->stamp || (a->stamp == b->stamp && a->cpu < b->cpu);
+}
+
+static void merge_sift_down(struct npf_merge_entry* heap, u_int count, u_int i)
+{
+	struct npf_merge_entry entry = heap[i];
+	u_int child;
+
+	while ((child = 2 * i + 1) < count)
+	{
+		if (child + 1 < count && merge_before(&heap[child + 1], &heap[child]))
+			child++;
+
+		if (!merge_before(&heap[child], &entry))
+			break;
+
+		heap[i] = heap[child];
+		i = child;
+	}
+
+	heap[i] = entry;
+}
+
+void npf_merge_push(struct npf_merge_entry* heap, u_int* count, ULONGLONG stamp, u_int cpu)
+{
+	struct npf_merge_entry entry;
+	u_int i = (*count)++;
+
+	entry.stamp = stamp;
+	entry.cpu = cpu;
+	entry.reserved = 0;
+
+	while (i > 0 && merge_before(&entry, &heap[(i - 1) / 2]))
+	{
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+
+	heap[i] = entry;
+}
+
+void npf_merge_update(struct npf_merge_entry* heap, u_int count, ULONGLONG stamp)
+{
+	// The stamps of a buffer only grow: heap[0] can only go down
+	heap[0].stamp = stamp;
+	merge_sift_down(heap, count, 0);
+}
+
+void npf_merge_pop(struct npf_merge_entry* heap, u_int* count)
+{
+	(*count)--;
+	if (*count == 0)
+		return;
+
+	heap[0] = heap[*count];
+	merge_sift_down(heap, *count, 0);
+}
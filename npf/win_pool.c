@@ -0,0 +1,364 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * The pool of blocks of the kernel buffer, see win_pool.h.
+ *
+ * The list of the free blocks is a stack linked through the blocks, whose head holds the index of
+ * the first block and a counter incremented by every change, so that a compare-and-swap never takes
+ * a block that has left the list and come back in between. The cache of a CPU is a ring of block
+ * indexes with a single producer, the reader, and a single consumer, the tap of the CPU.
+ *
+ * The tap publishes the end of the records of a block after writing them, and the block that follows
+ * it once it has written its last record there; the reader looks at the block that follows before at
+ * the end, so that it has seen the last end of a block when it leaves it.
+ */
+
+#if !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#endif
+
+#include "win_pool.h"
+
+#ifdef WIN_NT_DRIVER
+#define POOL_ALLOC(_size)		ExAllocatePoolWithTag(NonPagedPool, (_size), 'ABWA')
+#define POOL_FREE(_ptr)			ExFreePool(_ptr)
+#else
+#define POOL_ALLOC(_size)		malloc(_size)
+#define POOL_FREE(_ptr)			free(_ptr)
+#endif
+
+#if defined(NPF_HOST_BUILD)
+#define POOL_LOAD(_p)			__atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define POOL_STORE(_p, _v)		__atomic_store_n((_p), (_v), __ATOMIC_RELEASE)
+#define POOL_LOAD64(_p)			__atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define POOL_CAS64(_p, _old, _new)	__atomic_compare_exchange_n((_p), &(_old), (_new), FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else
+// Full barriers
+#define POOL_LOAD(_p)			((u_int32)InterlockedCompareExchange((volatile LONG*)(_p), 0, 0))
+#define POOL_STORE(_p, _v)		InterlockedExchange((volatile LONG*)(_p), (LONG)(_v))
+#define POOL_LOAD64(_p)			((ULONGLONG)InterlockedCompareExchange64((volatile LONG64*)(_p), 0, 0))
+#define POOL_CAS64(_p, _old, _new)	(InterlockedCompareExchange64((volatile LONG64*)(_p), (LONG64)(_new), (LONG64)(_old)) == (LONG64)(_old))
+#endif
+
+#define POOL_NONE				0xffffffff
+#define POOL_CACHE_LINE			64
+
+struct pool_block
+{
+	u_char* data;
+	volatile u_int32 end;		///< Written by the tap: end of the records committed in the block
+	volatile u_int32 next;		///< Written by the tap: the block that follows in the queue, POOL_NONE for the last one
+	u_int32 link;				///< The next block in the list of the free blocks
+	u_int32 reserved;
+};
+
+/*
+ * The queue and the cache of a CPU, the fields written by the tap and those written by the reader on
+ * their own cache lines
+ */
+struct pool_cpu
+{
+	u_int32 tail;				///< The last block of the queue, POOL_NONE if the queue is empty
+	u_int32 offset;				///< End of the records reserved in the last block
+	volatile u_int32 first;		///< The first block of the queue when it was empty, POOL_NONE once trimmed
+	volatile u_int32 get;		///< Number of blocks taken from the cache
+	volatile u_int32 produced;	///< Bytes committed
+	u_int32 reserved1[POOL_CACHE_LINE / sizeof(u_int32) - 5];
+
+	u_int32 head;				///< The block of the queue being read, POOL_NONE before the first one
+	u_int32 read;				///< Offset of the next record in the block being read
+	volatile u_int32 put;		///< Number of blocks put in the cache
+	volatile u_int32 consumed;	///< Bytes consumed
+	u_int32 cache[NPF_POOL_CACHE];
+	u_int32 reserved2[POOL_CACHE_LINE / sizeof(u_int32) - 4 - NPF_POOL_CACHE];
+};
+
+struct npf_pool
+{
+	volatile ULONGLONG free;	///< Head of the list: a counter in the high 32 bits, the first block in the low ones
+	u_int32 ncpu;
+	u_int32 block_size;
+	u_int32 nblocks;
+	u_int32 added;				///< Number of blocks added
+	struct pool_block* blocks;
+	struct pool_cpu* cpus;
+	void* memory;				///< The allocation of the cpus, before their alignment
+};
+
+u_int npf_pool_block_size(u_int size)
+{
+	u_int block_size = NPF_POOL_BLOCK_SIZE;
+
+	if (size / NPF_POOL_MIN_BLOCKS < block_size)
+		block_size = (size / NPF_POOL_MIN_BLOCKS) & ~(NPF_POOL_ALIGNMENT - 1);
+
+	if (block_size < NPF_POOL_MIN_BLOCK_SIZE)
+		return 0;
+
+	return block_size;
+}
+
+static void pool_push(struct npf_pool* pool, u_int32 b)
+{
+	ULONGLONG old, new_head;
+
+	do
+	{
+		old = POOL_LOAD64(&pool->free);
+		pool->blocks[b].link = (u_int32)old;
+		new_head = (((old >> 32) + 1) << 32) | b;
+	}
+	while (!POOL_CAS64(&pool->free, old, new_head));
+}
+
+static u_int32 pool_pop(struct npf_pool* pool)
+{
+	ULONGLONG old, new_head;
+	u_int32 b;
+
+	do
+	{
+		old = POOL_LOAD64(&pool->free);
+		b = (u_int32)old;
+		if (b == POOL_NONE)
+			return POOL_NONE;
+
+		// The link may be stale if the block has been taken meanwhile, but then the counter has changed
+		new_head = (((old >> 32) + 1) << 32) | pool->blocks[b].link;
+	}
+	while (!POOL_CAS64(&pool->free, old, new_head));
+
+	return b;
+}
+
+static void pool_reset_cpus(struct npf_pool* pool)
+{
+	u_int i;
+
+	RtlZeroMemory(pool->cpus, pool->ncpu * sizeof(struct pool_cpu));
+	for (i = 0; i < pool->ncpu; i++)
+	{
+		pool->cpus[i].tail = POOL_NONE;
+		pool->cpus[i].first = POOL_NONE;
+		pool->cpus[i].head = POOL_NONE;
+	}
+}
+
+struct npf_pool* npf_pool_create(u_int ncpu, u_int block_size, u_int nblocks)
+{
+	struct npf_pool* pool;
+
+	pool = (struct npf_pool*)POOL_ALLOC(sizeof(struct npf_pool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->blocks = (struct pool_block*)POOL_ALLOC(nblocks * sizeof(struct pool_block));
+	pool->memory = POOL_ALLOC(ncpu * sizeof(struct pool_cpu) + POOL_CACHE_LINE);
+	if (pool->blocks == NULL || pool->memory == NULL)
+	{
+		if (pool->blocks != NULL)
+			POOL_FREE(pool->blocks);
+		if (pool->memory != NULL)
+			POOL_FREE(pool->memory);
+		POOL_FREE(pool);
+		return NULL;
+	}
+
+	RtlZeroMemory(pool->blocks, nblocks * sizeof(struct pool_block));
+	pool->cpus = (struct pool_cpu*)(((ULONG_PTR)pool->memory + POOL_CACHE_LINE - 1) & ~(ULONG_PTR)(POOL_CACHE_LINE - 1));
+	pool->free = POOL_NONE;
+	pool->ncpu = ncpu;
+	pool->block_size = block_size;
+	pool->nblocks = nblocks;
+	pool->added = 0;
+	pool_reset_cpus(pool);
+
+	return pool;
+}
+
+void npf_pool_free(struct npf_pool* pool)
+{
+	if (pool == NULL)
+		return;
+
+	POOL_FREE(pool->memory);
+	POOL_FREE(pool->blocks);
+	POOL_FREE(pool);
+}
+
+void npf_pool_add(struct npf_pool* pool, u_char* memory, u_int count)
+{
+	u_int i;
+
+	for (i = 0; i < count && pool->added < pool->nblocks; i++)
+	{
+		pool->blocks[pool->added].data = memory + i * pool->block_size;
+		pool_push(pool, pool->added);
+		pool->added++;
+	}
+}
+
+void npf_pool_reset(struct npf_pool* pool)
+{
+	u_int32 b;
+
+	pool->free = POOL_NONE;
+	for (b = 0; b < pool->added; b++)
+		pool_push(pool, b);
+
+	pool_reset_cpus(pool);
+}
+
+u_char* npf_pool_reserve(struct npf_pool* pool, u_int cpu, u_int length)
+{
+	struct pool_cpu* c = &pool->cpus[cpu];
+	struct pool_block* block;
+	u_int32 b;
+
+	length = NPF_POOL_ALIGN(length);
+	if (length > pool->block_size)
+		return NULL;
+
+	if (c->tail != POOL_NONE && c->offset + length <= pool->block_size)
+		return pool->blocks[c->tail].data + c->offset;
+
+	// The blocks that the reader has given back to the CPU first
+	if (c->get != POOL_LOAD(&c->put))
+	{
+		b = c->cache[c->get % NPF_POOL_CACHE];
+		POOL_STORE(&c->get, c->get + 1);
+	}
+	else
+	{
+		b = pool_pop(pool);
+		if (b == POOL_NONE)
+			return NULL;
+	}
+
+	block = &pool->blocks[b];
+	block->end = 0;
+	block->next = POOL_NONE;
+
+	if (c->tail == POOL_NONE)
+		POOL_STORE(&c->first, b);
+	else
+		POOL_STORE(&pool->blocks[c->tail].next, b);
+
+	c->tail = b;
+	c->offset = 0;
+
+	return block->data;
+}
+
+void npf_pool_commit(struct npf_pool* pool, u_int cpu, u_int length)
+{
+	struct pool_cpu* c = &pool->cpus[cpu];
+
+	length = NPF_POOL_ALIGN(length);
+	c->offset += length;
+	POOL_STORE(&pool->blocks[c->tail].end, c->offset);
+	POOL_STORE(&c->produced, c->produced + length);
+}
+
+static void pool_give_back(struct npf_pool* pool, struct pool_cpu* c, u_int32 b)
+{
+	if (c->put - POOL_LOAD(&c->get) < NPF_POOL_CACHE)
+	{
+		c->cache[c->put % NPF_POOL_CACHE] = b;
+		POOL_STORE(&c->put, c->put + 1);
+	}
+	else
+	{
+		pool_push(pool, b);
+	}
+}
+
+u_char* npf_pool_peek(struct npf_pool* pool, u_int cpu)
+{
+	struct pool_cpu* c = &pool->cpus[cpu];
+	struct pool_block* block;
+	u_int32 next, end, b;
+
+	if (c->head == POOL_NONE)
+	{
+		b = POOL_LOAD(&c->first);
+		if (b == POOL_NONE)
+			return NULL;
+
+		c->head = b;
+		c->read = 0;
+	}
+
+	while (TRUE)
+	{
+		block = &pool->blocks[c->head];
+		next = POOL_LOAD(&block->next);
+		end = POOL_LOAD(&block->end);
+
+		if (c->read < end)
+			return block->data + c->read;
+
+		if (next == POOL_NONE)
+			return NULL;
+
+		// The tap has moved to the next block: this one is read
+		b = c->head;
+		c->head = next;
+		c->read = 0;
+		pool_give_back(pool, c, b);
+	}
+}
+
+void npf_pool_consume(struct npf_pool* pool, u_int cpu, u_int length)
+{
+	struct pool_cpu* c = &pool->cpus[cpu];
+
+	length = NPF_POOL_ALIGN(length);
+	c->read += length;
+	POOL_STORE(&c->consumed, c->consumed + length);
+}
+
+u_int npf_pool_pending(struct npf_pool* pool, u_int cpu)
+{
+	struct pool_cpu* c = &pool->cpus[cpu];
+
+	return POOL_LOAD(&c->produced) - c->consumed;
+}
+
+int npf_pool_held(struct npf_pool* pool, u_int cpu)
+{
+	struct pool_cpu* c = &pool->cpus[cpu];
+
+	return POOL_LOAD(&c->first) != POOL_NONE || c->put != POOL_LOAD(&c->get);
+}
+
+void npf_pool_trim(struct npf_pool* pool, u_int cpu)
+{
+	struct pool_cpu* c = &pool->cpus[cpu];
+
+	if (npf_pool_peek(pool, cpu) != NULL)
+		return;
+
+	// The tap is locked out: the reader takes its side of the CPU
+	if (c->tail != POOL_NONE)
+	{
+		pool_push(pool, c->tail);
+		c->tail = POOL_NONE;
+		c->head = POOL_NONE;
+		POOL_STORE(&c->first, POOL_NONE);
+	}
+
+	while (c->get != c->put)
+	{
+		pool_push(pool, c->cache[c->get % NPF_POOL_CACHE]);
+		POOL_STORE(&c->get, c->get + 1);
+	}
+}
@@ -0,0 +1,281 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * The capture ring shared with the application, see win_ring.h.
+ *
+ * Each CPU has a single producer, the tap running on it under the BufferLock of the CPU, and the
+ * application is the single consumer of all the CPUs. The status of a block hands it over: the tap
+ * writes the block, then sets its status to NPF_RING_BLOCK_USER and advances the producer index of
+ * the CPU; the application reads the block, then sets its status back to NPF_RING_BLOCK_KERNEL. Both
+ * stores are releases and both loads are acquires, so that each side sees the whole block written
+ * by the other one before it gets it.
+ */
+
+#if !defined (_WINDLL) && !defined(_WINLIB) && !defined(NPF_HOST_BUILD)
+#include "stdafx.h"
+#endif
+
+#ifdef WIN_NT_DRIVER
+#include <ndis.h>
+#else
+#include <stdlib.h>
+#endif
+
+#include "win_ring.h"
+
+#ifdef WIN_NT_DRIVER
+#define RING_ALLOC(_size)		ExAllocatePoolWithTag(NonPagedPool, (_size), '9BWA')
+#define RING_FREE(_ptr)			ExFreePool(_ptr)
+#else
+#define RING_ALLOC(_size)		malloc(_size)
+#define RING_FREE(_ptr)			free(_ptr)
+#endif
+
+#if defined(NPF_HOST_BUILD)
+#define RING_LOAD(_p)			__atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define RING_STORE(_p, _v)		__atomic_store_n((_p), (_v), __ATOMIC_RELEASE)
+#else
+// Full barriers, once per block
+#define RING_LOAD(_p)			((u_int32)InterlockedCompareExchange((volatile LONG*)(_p), 0, 0))
+#define RING_STORE(_p, _v)		InterlockedExchange((volatile LONG*)(_p), (LONG)(_v))
+#endif
+
+#define RING_PAGE_SIZE			4096
+#define RING_CACHE_LINE			64
+
+/*
+ * What the tap knows of the blocks of a CPU, on its own cache line
+ */
+struct ring_cpu
+{
+	u_int32 produced;			///< Number of blocks closed
+	u_int32 offset;				///< End of the packets in the open block, 0 if no block is open
+	u_int32 packets;			///< Number of packets in the open block
+	u_int32 last;				///< Offset of the last of them
+	u_int32 reserved[RING_CACHE_LINE / sizeof(u_int32) - 4];
+};
+
+struct npf_ring
+{
+	struct npf_ring_header* header;
+	struct npf_ring_index* index;
+	u_char* blocks;
+	u_int32 ncpu;
+	u_int32 block_size;
+	u_int32 nblocks;
+	u_int32 size;				///< Size of the shared region
+	struct ring_cpu* cpus;
+};
+
+#define RING_FIRST		NPF_RING_ALIGN(sizeof(struct npf_ring_block))
+
+static u_int ring_index_offset(void)
+{
+	return (sizeof(struct npf_ring_header) + RING_CACHE_LINE - 1) & ~(RING_CACHE_LINE - 1);
+}
+
+static u_int ring_blocks_offset(u_int ncpu)
+{
+	return (ring_index_offset() + ncpu * sizeof(struct npf_ring_index) + RING_PAGE_SIZE - 1) & ~(RING_PAGE_SIZE - 1);
+}
+
+u_int npf_ring_memory_size(u_int ncpu, u_int block_size, u_int nblocks)
+{
+	ULONGLONG size;
+
+	if (ncpu == 0 || ncpu > 0x10000 || nblocks == 0 || nblocks > NPF_RING_MAX_BLOCKS ||
+		block_size < NPF_RING_MIN_BLOCK || block_size > NPF_RING_MAX_BLOCK || block_size % NPF_RING_ALIGNMENT != 0)
+	{
+		return 0;
+	}
+
+	size = ring_blocks_offset(ncpu) + (ULONGLONG)ncpu * nblocks * block_size;
+	size = (size + RING_PAGE_SIZE - 1) & ~(ULONGLONG)(RING_PAGE_SIZE - 1);
+
+	// The offsets in the region are 32-bit
+	if (size > 0x80000000)
+		return 0;
+
+	return (u_int)size;
+}
+
+struct npf_ring* npf_ring_create(u_int ncpu, u_int block_size, u_int nblocks, void* memory)
+{
+	struct npf_ring* ring;
+	u_int size = npf_ring_memory_size(ncpu, block_size, nblocks);
+
+	if (size == 0)
+		return NULL;
+
+	ring = (struct npf_ring*)RING_ALLOC(sizeof(struct npf_ring) + ncpu * sizeof(struct ring_cpu));
+	if (ring == NULL)
+		return NULL;
+
+	ring->header = (struct npf_ring_header*)memory;
+	RtlZeroMemory(ring->header, size);
+	ring->header->magic = NPF_RING_MAGIC;
+	ring->header->ncpu = ncpu;
+	ring->header->block_size = block_size;
+	ring->header->nblocks = nblocks;
+	ring->header->index_offset = ring_index_offset();
+	ring->header->blocks_offset = ring_blocks_offset(ncpu);
+
+	ring->index = (struct npf_ring_index*)((u_char*)ring->header + ring_index_offset());
+	ring->blocks = (u_char*)ring->header + ring_blocks_offset(ncpu);
+	ring->ncpu = ncpu;
+	ring->block_size = block_size;
+	ring->nblocks = nblocks;
+	ring->size = size;
+	ring->cpus = (struct ring_cpu*)(ring + 1);
+	RtlZeroMemory(ring->cpus, ncpu * sizeof(struct ring_cpu));
+
+	return ring;
+}
+
+void npf_ring_free(struct npf_ring* ring)
+{
+	if (ring == NULL)
+		return;
+
+	RING_FREE(ring);
+}
+
+struct npf_ring_header* npf_ring_memory(struct npf_ring* ring)
+{
+	return ring->header;
+}
+
+static struct npf_ring_block* ring_block(struct npf_ring* ring, u_int cpu, u_int32 seq)
+{
+	return (struct npf_ring_block*)(ring->blocks + ((ULONGLONG)cpu * ring->nblocks + seq % ring->nblocks) * ring->block_size);
+}
+
+struct npf_ring_packet* npf_ring_reserve(struct npf_ring* ring, u_int cpu, u_int* caplen)
+{
+	struct ring_cpu* s = &ring->cpus[cpu];
+	struct npf_ring_block* block;
+	struct npf_ring_packet* packet;
+	u_int max = ring->block_size - RING_FIRST - sizeof(struct npf_ring_packet);
+	u_int length;
+
+	if (*caplen > max)
+		*caplen = max;
+
+	length = NPF_RING_ALIGN(sizeof(struct npf_ring_packet) + *caplen);
+
+	if (s->offset != 0 && s->offset + length > ring->block_size)
+		npf_ring_close(ring, cpu);
+
+	block = ring_block(ring, cpu, s->produced);
+
+	if (s->offset == 0)
+	{
+		// The application gives the blocks back in any order, but they are filled in turn
+		if (RING_LOAD(&block->status) != NPF_RING_BLOCK_KERNEL)
+			return NULL;
+
+		s->offset = RING_FIRST;
+		s->packets = 0;
+		s->last = 0;
+	}
+
+	packet = (struct npf_ring_packet*)((u_char*)block + s->offset);
+	packet->next = 0;
+	if (s->packets != 0)
+		((struct npf_ring_packet*)((u_char*)block + s->last))->next = s->offset - s->last;
+
+	s->last = s->offset;
+	s->offset += length;
+	s->packets++;
+
+	return packet;
+}
+
+int npf_ring_close(struct npf_ring* ring, u_int cpu)
+{
+	struct ring_cpu* s = &ring->cpus[cpu];
+	struct npf_ring_block* block;
+
+	if (s->offset == 0)
+		return FALSE;
+
+	block = ring_block(ring, cpu, s->produced);
+	block->cpu = cpu;
+	block->seq = s->produced;
+	block->packets = s->packets;
+	block->length = s->offset;
+	block->first = RING_FIRST;
+	RING_STORE(&block->status, NPF_RING_BLOCK_USER);
+
+	s->produced++;
+	s->offset = 0;
+	s->packets = 0;
+	RING_STORE(&ring->index[cpu].producer, s->produced);
+
+	return TRUE;
+}
+
+u_int npf_ring_closed(struct npf_ring* ring, u_int cpu)
+{
+	return ring->cpus[cpu].produced;
+}
+
+struct npf_ring_block* npf_ring_next(struct npf_ring_header* header)
+{
+	struct npf_ring_index* index = (struct npf_ring_index*)((u_char*)header + header->index_offset);
+	struct npf_ring_index* x;
+	u_int i, cpu;
+	u_int32 consumer;
+
+	for (i = 0; i < header->ncpu; i++)
+	{
+		cpu = (header->next_cpu + i) % header->ncpu;
+		x = &index[cpu];
+		consumer = x->consumer;
+
+		if (consumer != RING_LOAD(&x->producer))
+		{
+			x->consumer = consumer + 1;
+			header->next_cpu = (cpu + 1) % header->ncpu;
+
+			return (struct npf_ring_block*)((u_char*)header + header->blocks_offset +
+				((ULONGLONG)cpu * header->nblocks + consumer % header->nblocks) * header->block_size);
+		}
+	}
+
+	return NULL;
+}
+
+void npf_ring_release(struct npf_ring_block* block)
+{
+	RING_STORE(&block->status, NPF_RING_BLOCK_KERNEL);
+}
+
+struct npf_ring_block* npf_ring_wait(struct npf_ring_header* header, void* context,
+	void (*reset)(void* context), void (*wait)(void* context), int (*flush)(void* context))
+{
+	struct npf_ring_block* block = npf_ring_next(header);
+
+	if (block != NULL)
+		return block;
+
+	// The event stays set once the driver sets it: it is cleared before looking at the ring again, so that a
+	// block closed from then on sets it again
+	reset(context);
+
+	block = npf_ring_next(header);
+	if (block != NULL)
+		return block;
+
+	wait(context);
+
+	block = npf_ring_next(header);
+	if (block == NULL && flush(context))
+		block = npf_ring_next(header);
+
+	return block;
+}
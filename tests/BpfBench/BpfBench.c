@@ -0,0 +1,518 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Replays a packet corpus (pcap files or a synthetic mix) through the reference
+ * filters with every available filtering engine, and reports the cost per packet.
+ *
+ * Usage: BpfBench [-r rounds] [-c count] [-s seed] [-f filter] [file.pcap ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+
+#ifdef HAVE_BPF_JIT_SUPPORT
+#include "jitter.h"
+#endif
+
+/*!
+  \brief A filtering engine under test.
+*/
+struct bench_engine
+{
+	const char* name;
+	/*! Turns a validated program in the engine's own representation, NULL if the engine cannot run it */
+	void* (*prepare)(struct bench_filter* filter);
+	u_int (*run)(void* ctx, struct bench_packet* pkt);
+	void (*release)(void* ctx);
+	/*! If not NULL, the packets are given to this function by batches of BENCH_BATCH instead of one by one to run */
+	void (*run_batch)(void* ctx, struct bpf_packet* pkts, u_int count, u_int* verdicts);
+};
+
+#define BENCH_BATCH	64	///< Packets given at once to the batch engines
+
+//-------------------------------------------------------------------
+
+static void* interp_prepare(struct bench_filter* filter)
+{
+	return filter->insns;
+}
+
+static u_int interp_run(void* ctx, struct bench_packet* pkt)
+{
+	return bpf_filter((struct bpf_insn*)ctx, pkt->data, pkt->wirelen, pkt->caplen);
+}
+
+static void interp_release(void* ctx)
+{
+	(void)ctx;
+}
+
+static void interp_run_batch(void* ctx, struct bpf_packet* pkts, u_int count, u_int* verdicts)
+{
+	bpf_filter_batch((struct bpf_insn*)ctx, pkts, count, verdicts);
+}
+
+/*
+ * The program as installed by BIOCSETF: optimized, or the original one if the optimizer
+ * output does not validate.
+ */
+static struct bpf_insn* optimized_program(struct bench_filter* filter, u_int* len)
+{
+	struct bpf_insn* insns = (struct bpf_insn*)malloc(filter->len * sizeof(struct bpf_insn));
+
+	if (insns == NULL)
+		return NULL;
+
+	memcpy(insns, filter->insns, filter->len * sizeof(struct bpf_insn));
+	*len = (u_int)bpf_optimize(insns, (int)filter->len);
+	if (!bpf_validate(insns, (int)*len))
+	{
+		memcpy(insns, filter->insns, filter->len * sizeof(struct bpf_insn));
+		*len = filter->len;
+	}
+
+	return insns;
+}
+
+static void* opt_prepare(struct bench_filter* filter)
+{
+	u_int len;
+
+	return optimized_program(filter, &len);
+}
+
+static void opt_release(void* ctx)
+{
+	free(ctx);
+}
+
+static void* decoded_prepare(struct bench_filter* filter)
+{
+	return bpf_decode(filter->insns, (int)filter->len);
+}
+
+static u_int decoded_run(void* ctx, struct bench_packet* pkt)
+{
+	return bpf_filter_decoded((struct bpf_decoded_program*)ctx, pkt->data, pkt->wirelen, pkt->caplen, NULL);
+}
+
+static void decoded_release(void* ctx)
+{
+	bpf_free_decoded((struct bpf_decoded_program*)ctx);
+}
+
+static void decoded_run_batch(void* ctx, struct bpf_packet* pkts, u_int count, u_int* verdicts)
+{
+	bpf_filter_decoded_batch((struct bpf_decoded_program*)ctx, pkts, count, verdicts);
+}
+
+static void* optdecoded_prepare(struct bench_filter* filter)
+{
+	struct bpf_decoded_program* prog;
+	struct bpf_insn* insns;
+	u_int len;
+
+	insns = optimized_program(filter, &len);
+	if (insns == NULL)
+		return NULL;
+
+	prog = bpf_decode(insns, (int)len);
+	free(insns);
+	return prog;
+}
+
+/*
+ * The decoded program behind the flow verdict cache, like in the tap
+ */
+struct flow_ctx
+{
+	struct bpf_flow_program* flow;
+	struct bpf_decoded_program* decoded;
+};
+
+static void* flow_prepare(struct bench_filter* filter)
+{
+	struct flow_ctx* ctx = (struct flow_ctx*)malloc(sizeof(struct flow_ctx));
+
+	if (ctx == NULL)
+		return NULL;
+
+	ctx->flow = bpf_flow_compile(filter->insns, (int)filter->len, 1);
+	ctx->decoded = bpf_decode(filter->insns, (int)filter->len);
+	if (ctx->flow == NULL || ctx->decoded == NULL)
+	{
+		if (ctx->flow != NULL)
+			bpf_free_flow(ctx->flow);
+		if (ctx->decoded != NULL)
+			bpf_free_decoded(ctx->decoded);
+		free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+static u_int flow_run(void* ctx, struct bench_packet* pkt)
+{
+	struct flow_ctx* c = (struct flow_ctx*)ctx;
+	struct bpf_flow_cache* cache = bpf_flow_get_cache(c->flow, 0);
+	struct bpf_flow_key key;
+	u_int verdict;
+
+	bpf_flow_key(c->flow, pkt->data, pkt->wirelen, pkt->caplen, &key);
+	if (!bpf_flow_lookup(c->flow, cache, &key, &verdict))
+	{
+		verdict = bpf_filter_decoded(c->decoded, pkt->data, pkt->wirelen, pkt->caplen, NULL);
+		bpf_flow_insert(c->flow, cache, &key, verdict);
+	}
+
+	return verdict;
+}
+
+static void flow_release(void* ctx)
+{
+	struct flow_ctx* c = (struct flow_ctx*)ctx;
+
+	bpf_free_flow(c->flow);
+	bpf_free_decoded(c->decoded);
+	free(c);
+}
+
+/*
+ * The decoded program behind the prefilter of its necessary conditions, like in the tap
+ */
+struct prefilter_ctx
+{
+	struct bpf_prefilter pre;
+	struct bpf_decoded_program* decoded;
+};
+
+static void* prefilter_prepare(struct bench_filter* filter)
+{
+	struct prefilter_ctx* ctx = (struct prefilter_ctx*)malloc(sizeof(struct prefilter_ctx));
+
+	if (ctx == NULL)
+		return NULL;
+
+	bpf_prefilter_compile(filter->insns, (int)filter->len, &ctx->pre);
+	ctx->decoded = bpf_decode(filter->insns, (int)filter->len);
+	if (ctx->decoded == NULL)
+	{
+		free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+static u_int prefilter_run(void* ctx, struct bench_packet* pkt)
+{
+	struct prefilter_ctx* c = (struct prefilter_ctx*)ctx;
+
+	if (!bpf_prefilter(&c->pre, pkt->data, pkt->caplen))
+		return 0;
+
+	return bpf_filter_decoded(c->decoded, pkt->data, pkt->wirelen, pkt->caplen, NULL);
+}
+
+static void prefilter_release(void* ctx)
+{
+	struct prefilter_ctx* c = (struct prefilter_ctx*)ctx;
+
+	bpf_free_decoded(c->decoded);
+	free(c);
+}
+
+static void* shape_prepare(struct bench_filter* filter)
+{
+	return bpf_shape_recognize(filter->insns, (int)filter->len);
+}
+
+static u_int shape_run(void* ctx, struct bench_packet* pkt)
+{
+	return bpf_filter_shape((struct bpf_shape*)ctx, pkt->data, pkt->wirelen, pkt->caplen);
+}
+
+static void shape_release(void* ctx)
+{
+	bpf_free_shape((struct bpf_shape*)ctx);
+}
+
+#ifdef HAVE_BPF_JIT_SUPPORT
+static void* jit_prepare(struct bench_filter* filter)
+{
+	return BPF_jitter(filter->insns, filter->len);
+}
+
+static u_int jit_run(void* ctx, struct bench_packet* pkt)
+{
+	return ((JIT_BPF_Filter*)ctx)->Function((PVOID*)pkt->data, pkt->wirelen, pkt->caplen, NULL);
+}
+
+static void jit_release(void* ctx)
+{
+	BPF_Destroy_JIT_Filter((JIT_BPF_Filter*)ctx);
+}
+
+static void jit_run_batch(void* ctx, struct bpf_packet* pkts, u_int count, u_int* verdicts)
+{
+	((JIT_BPF_Filter*)ctx)->BatchFunction(pkts, count, verdicts);
+}
+
+static void* optjit_prepare(struct bench_filter* filter)
+{
+	JIT_BPF_Filter* Filter;
+	struct bpf_insn* insns;
+	u_int len;
+
+	insns = optimized_program(filter, &len);
+	if (insns == NULL)
+		return NULL;
+
+	Filter = BPF_jitter(insns, len);
+	free(insns);
+	return Filter;
+}
+#endif
+
+static struct bench_engine engines[] =
+{
+	{ "interp", interp_prepare, interp_run, interp_release, NULL },
+	{ "opt", opt_prepare, interp_run, opt_release, NULL },
+	{ "decoded", decoded_prepare, decoded_run, decoded_release, NULL },
+	{ "opt+decoded", optdecoded_prepare, decoded_run, decoded_release, NULL },
+	{ "batch", interp_prepare, interp_run, interp_release, interp_run_batch },
+	{ "dec-batch", decoded_prepare, decoded_run, decoded_release, decoded_run_batch },
+	{ "flow", flow_prepare, flow_run, flow_release, NULL },
+	{ "prefilter", prefilter_prepare, prefilter_run, prefilter_release, NULL },
+	{ "shape", shape_prepare, shape_run, shape_release, NULL },
+#ifdef HAVE_BPF_JIT_SUPPORT
+	{ "jit", jit_prepare, jit_run, jit_release, NULL },
+	{ "opt+jit", optjit_prepare, jit_run, jit_release, NULL },
+	{ "jit-batch", jit_prepare, jit_run, jit_release, jit_run_batch },
+#endif
+};
+
+#define ENGINES_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+//-------------------------------------------------------------------
+
+// Keeps the compiler from dropping the timed calls
+volatile u_int bench_sink;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*
+ * Runs the engine once on the whole corpus, returns the sum of the results and counts
+ * the accepted packets
+ */
+static u_int bench_pass(struct bench_engine* engine, void* ctx, struct bench_corpus* corpus, struct bpf_packet* pkts, u_int* accepted)
+{
+	u_int verdicts[BENCH_BATCH];
+	u_int i, j, count;
+	u_int sum = 0;
+
+	if (engine->run_batch == NULL)
+	{
+		for (i = 0; i < corpus->count; i++)
+		{
+			verdicts[0] = engine->run(ctx, &corpus->packets[i]);
+			sum += verdicts[0];
+			*accepted += verdicts[0] != 0;
+		}
+
+		return sum;
+	}
+
+	for (i = 0; i < corpus->count; i += count)
+	{
+		count = corpus->count - i < BENCH_BATCH ? corpus->count - i : BENCH_BATCH;
+		engine->run_batch(ctx, &pkts[i], count, verdicts);
+		for (j = 0; j < count; j++)
+		{
+			sum += verdicts[j];
+			*accepted += verdicts[j] != 0;
+		}
+	}
+
+	return sum;
+}
+
+static int bench_one(struct bench_filter* filter, struct bench_engine* engine, struct bench_corpus* corpus, u_int rounds)
+{
+	void* ctx;
+	struct bpf_packet* pkts = NULL;
+	u_int r, i;
+	u_int accepted = 0;
+	u_int ignored = 0;
+	u_int sink = 0;
+	double start, elapsed, npackets;
+
+	ctx = engine->prepare(filter);
+	if (ctx == NULL)
+	{
+		printf("%-10s %-11s %12s\n", filter->name, engine->name, "n/a");
+		return 0;
+	}
+
+	if (engine->run_batch != NULL)
+	{
+		pkts = (struct bpf_packet*)malloc(corpus->count * sizeof(struct bpf_packet));
+		if (pkts == NULL)
+		{
+			engine->release(ctx);
+			return -1;
+		}
+
+		for (i = 0; i < corpus->count; i++)
+		{
+			pkts[i].data = corpus->packets[i].data;
+			pkts[i].wirelen = corpus->packets[i].wirelen;
+			pkts[i].buflen = corpus->packets[i].caplen;
+			pkts[i].meta = NULL;
+		}
+	}
+
+	// Warm up caches and branch predictors, and count the accepted packets
+	bench_pass(engine, ctx, corpus, pkts, &accepted);
+
+	start = now_ns();
+	for (r = 0; r < rounds; r++)
+	{
+		sink += bench_pass(engine, ctx, corpus, pkts, &ignored);
+	}
+	elapsed = now_ns() - start;
+	bench_sink = sink;
+
+	engine->release(ctx);
+	free(pkts);
+
+	npackets = (double)rounds * corpus->count;
+	printf("%-10s %-11s %9u/%-9u %10.2f %12.2f\n",
+		filter->name,
+		engine->name,
+		accepted,
+		corpus->count,
+		elapsed / npackets,
+		npackets / (elapsed / 1e9) / 1e6);
+
+	return 0;
+}
+
+static void usage(void)
+{
+	u_int i;
+
+	fprintf(stderr, "Usage: BpfBench [-r rounds] [-c count] [-s seed] [-f filter] [file.pcap ...]\n");
+	fprintf(stderr, "  -r rounds  passes over the corpus for each measure (default 20)\n");
+	fprintf(stderr, "  -c count   packets in the synthetic corpus, used when no file is given (default 100000)\n");
+	fprintf(stderr, "  -s seed    seed of the synthetic corpus\n");
+	fprintf(stderr, "  -f filter  run only this reference filter (can be repeated)\n");
+	fprintf(stderr, "Reference filters:\n");
+	for (i = 0; i < bench_filters_count; i++)
+		fprintf(stderr, "  %-10s %s\n", bench_filters[i].name, bench_filters[i].expression);
+}
+
+int main(int argc, char* argv[])
+{
+	u_int rounds = 20;
+	u_int count = 100000;
+	u_int seed = 1;
+	struct bench_filter* selected[64];
+	u_int nselected = 0;
+	struct bench_corpus corpus;
+	u_int i, e;
+	int a;
+
+	for (a = 1; a < argc && argv[a][0] == '-'; a++)
+	{
+		if (a + 1 >= argc)
+		{
+			usage();
+			return 1;
+		}
+
+		switch (argv[a][1])
+		{
+		case 'r':
+			rounds = (u_int)strtoul(argv[++a], NULL, 0);
+			break;
+		case 'c':
+			count = (u_int)strtoul(argv[++a], NULL, 0);
+			break;
+		case 's':
+			seed = (u_int)strtoul(argv[++a], NULL, 0);
+			break;
+		case 'f':
+			if (nselected == sizeof(selected) / sizeof(selected[0]) ||
+				(selected[nselected] = bench_filter_find(argv[++a])) == NULL)
+			{
+				usage();
+				return 1;
+			}
+			nselected++;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (rounds == 0)
+		rounds = 1;
+
+	if (nselected == 0)
+	{
+		for (i = 0; i < bench_filters_count; i++)
+			selected[nselected++] = &bench_filters[i];
+	}
+
+	do
+	{
+		if (a < argc)
+		{
+			if (bench_corpus_load_pcap(argv[a], &corpus) != 0)
+				return 1;
+			printf("Corpus: %s, %u packets, linktype %u\n", argv[a], corpus.count, corpus.linktype);
+			if (corpus.linktype != DLT_EN10MB)
+				printf("Warning: the reference filters assume Ethernet (linktype %u)\n", DLT_EN10MB);
+		}
+		else
+		{
+			if (bench_corpus_synthesize(&corpus, count, seed) != 0)
+				return 1;
+			printf("Corpus: synthetic, %u packets, seed %u\n", corpus.count, seed);
+		}
+
+		printf("%-10s %-11s %19s %10s %12s\n", "filter", "engine", "accepted", "ns/pkt", "Mpkts/s");
+
+		for (i = 0; i < nselected; i++)
+		{
+			for (e = 0; e < ENGINES_COUNT; e++)
+			{
+				bench_one(selected[i], &engines[e], &corpus, rounds);
+			}
+		}
+
+		bench_corpus_free(&corpus);
+		printf("\n");
+	}
+	while (++a < argc);
+
+	return 0;
+}
@@ -0,0 +1,373 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_random.h"
+
+#define PCAP_MAGIC_USEC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+#define PCAP_SNAPLEN_MAX	262144
+
+#define SYNTH_MAX_FRAME		1518
+
+//-------------------------------------------------------------------
+
+static u_int32 swap32(u_int32 v)
+{
+	return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+//-------------------------------------------------------------------
+
+int bench_corpus_load_pcap(const char* path, struct bench_corpus* corpus)
+{
+	FILE* f;
+	u_int32 fh[6];
+	u_int32 rh[4];
+	long size;
+	int swapped;
+	u_int capacity = 0;
+	u_int used = 0;
+
+	memset(corpus, 0, sizeof(*corpus));
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+	{
+		fprintf(stderr, "%s: cannot open\n", path);
+		return -1;
+	}
+
+	if (fread(fh, sizeof(fh), 1, f) != 1)
+	{
+		fprintf(stderr, "%s: truncated file header\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	if (fh[0] == PCAP_MAGIC_USEC || fh[0] == PCAP_MAGIC_NSEC)
+		swapped = 0;
+	else if (swap32(fh[0]) == PCAP_MAGIC_USEC || swap32(fh[0]) == PCAP_MAGIC_NSEC)
+		swapped = 1;
+	else
+	{
+		fprintf(stderr, "%s: not a libpcap savefile (pcapng is not supported)\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	corpus->linktype = (swapped ? swap32(fh[5]) : fh[5]) & 0xffff;
+
+	//
+	// The arena is sized on the file, which is always larger than the packet data it holds
+	//
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, sizeof(fh), SEEK_SET);
+
+	corpus->arena = (u_char*)malloc(size > 0 ? (size_t)size : 1);
+	if (corpus->arena == NULL)
+	{
+		fclose(f);
+		return -1;
+	}
+
+	while (fread(rh, sizeof(rh), 1, f) == 1)
+	{
+		u_int caplen = swapped ? swap32(rh[2]) : rh[2];
+		u_int wirelen = swapped ? swap32(rh[3]) : rh[3];
+		struct bench_packet* pkt;
+
+		if (caplen > PCAP_SNAPLEN_MAX || used + caplen > (u_int)size)
+		{
+			fprintf(stderr, "%s: corrupted record %u\n", path, corpus->count);
+			break;
+		}
+
+		if (corpus->count == capacity)
+		{
+			struct bench_packet* grown;
+
+			capacity = capacity ? capacity * 2 : 1024;
+			grown = (struct bench_packet*)realloc(corpus->packets, capacity * sizeof(struct bench_packet));
+			if (grown == NULL)
+			{
+				bench_corpus_free(corpus);
+				fclose(f);
+				return -1;
+			}
+			corpus->packets = grown;
+		}
+
+		if (fread(corpus->arena + used, 1, caplen, f) != caplen)
+		{
+			fprintf(stderr, "%s: truncated record %u\n", path, corpus->count);
+			break;
+		}
+
+		pkt = &corpus->packets[corpus->count++];
+		pkt->caplen = caplen;
+		pkt->wirelen = wirelen < caplen ? caplen : wirelen;
+		pkt->data = (u_char*)(size_t)used;
+		used += caplen;
+	}
+
+	fclose(f);
+
+	//
+	// The arena is not going to move anymore: turn the offsets into pointers
+	//
+	for (capacity = 0; capacity < corpus->count; capacity++)
+	{
+		corpus->packets[capacity].data = corpus->arena + (size_t)corpus->packets[capacity].data;
+	}
+
+	return corpus->count > 0 ? 0 : -1;
+}
+
+//-------------------------------------------------------------------
+
+static void put16(u_char* p, u_int v)
+{
+	p[0] = (u_char)(v >> 8);
+	p[1] = (u_char)v;
+}
+
+static void put32(u_char* p, u_int32 v)
+{
+	p[0] = (u_char)(v >> 24);
+	p[1] = (u_char)(v >> 16);
+	p[2] = (u_char)(v >> 8);
+	p[3] = (u_char)v;
+}
+
+static u_int32 synth_ipv4_addr(u_int32* state)
+{
+	switch (bench_rand(state) % 8)
+	{
+	case 0:
+		return 0x0a000001;	// 10.0.0.1, "host" filter
+	case 1:
+	case 2:
+		return 0xc0a80000 | (bench_rand(state) & 0xffff);	// 192.168/16, "net" filter
+	default:
+		return bench_rand(state);
+	}
+}
+
+static u_int synth_port(u_int32* state)
+{
+	switch (bench_rand(state) % 8)
+	{
+	case 0:
+		return 443;
+	case 1:
+		return 53;
+	case 2:
+		return 80;
+	default:
+		return 1024 + bench_rand(state) % 64000;
+	}
+}
+
+/*
+ * Writes a TCP or UDP header at p, returns its length.
+ */
+static u_int synth_l4(u_char* p, u_char proto, u_int32* state)
+{
+	put16(p, synth_port(state));
+	put16(p + 2, synth_port(state));
+
+	if (proto == 6)
+	{
+		put32(p + 4, bench_rand(state));
+		put32(p + 8, bench_rand(state));
+		p[12] = 5 << 4;
+		p[13] = (u_char)((bench_rand(state) % 4 == 0) ? 0x02 : 0x10);	// SYN or ACK
+		put16(p + 14, 65535);
+		put16(p + 16, 0);
+		put16(p + 18, 0);
+		return 20;
+	}
+
+	put16(p + 4, 0);
+	put16(p + 6, 0);
+	return 8;
+}
+
+/*
+ * Writes an IPv4 header (possibly with options and/or fragmented) at p, returns its length.
+ */
+static u_int synth_ipv4(u_char* p, u_char proto, u_int payload, u_int32* state)
+{
+	u_int hlen = (bench_rand(state) % 8 == 0) ? 24 : 20;
+	u_int r = bench_rand(state) % 16;
+
+	p[0] = (u_char)(0x40 | (hlen >> 2));
+	p[1] = 0;
+	put16(p + 2, hlen + payload);
+	put16(p + 4, bench_rand(state) & 0xffff);
+	// Some non-first fragments, which "port" filters must not match
+	put16(p + 6, r == 0 ? 0x00b9 : (r == 1 ? 0x2000 : 0x4000));
+	p[8] = 64;
+	p[9] = proto;
+	put16(p + 10, 0);
+	put32(p + 12, synth_ipv4_addr(state));
+	put32(p + 16, synth_ipv4_addr(state));
+	if (hlen > 20)
+		put32(p + 20, 0x01010100);	// NOP, NOP, NOP, EOL
+	return hlen;
+}
+
+static u_int synth_packet(u_char* p, u_int32* state)
+{
+	u_int r = bench_rand(state) % 100;
+	u_int len = 14;
+	u_int payload = bench_rand(state) % 1200;
+	u_char proto = (bench_rand(state) % 3 == 0) ? 17 : 6;
+	u_int ethertype;
+
+	if (payload > SYNTH_MAX_FRAME - 14 - 4 - 60 - 20)
+		payload = SYNTH_MAX_FRAME - 14 - 4 - 60 - 20;
+
+	// Destination and source MAC
+	put32(p, bench_rand(state));
+	put16(p + 4, bench_rand(state) & 0xffff);
+	put32(p + 6, bench_rand(state));
+	put16(p + 10, bench_rand(state) & 0xffff);
+
+	if (r < 10)
+	{
+		put16(p + 12, 0x8100);
+		put16(p + 14, bench_rand(state) & 0x0fff);
+		len = 18;
+	}
+
+	if (r < 70)
+		ethertype = 0x0800;
+	else if (r < 85)
+		ethertype = 0x86dd;
+	else if (r < 93)
+		ethertype = 0x0806;
+	else
+		ethertype = bench_rand(state) & 0xffff;
+
+	put16(p + len - 2, ethertype);
+
+	switch (ethertype)
+	{
+	case 0x0800:
+	{
+		u_int l4len = (proto == 6) ? 20 : 8;
+		u_int hlen = synth_ipv4(p + len, proto, l4len + payload, state);
+
+		synth_l4(p + len + hlen, proto, state);
+		len += hlen + l4len;
+		break;
+	}
+
+	case 0x86dd:
+	{
+		u_int l4len;
+
+		put32(p + len, 0x60000000);
+		p[len + 6] = proto;
+		p[len + 7] = 64;
+		put32(p + len + 8, 0x20010db8);
+		put32(p + len + 12, bench_rand(state));
+		put32(p + len + 16, bench_rand(state));
+		put32(p + len + 20, bench_rand(state));
+		put32(p + len + 24, 0x20010db8);
+		put32(p + len + 28, bench_rand(state));
+		put32(p + len + 32, bench_rand(state));
+		put32(p + len + 36, bench_rand(state));
+		l4len = synth_l4(p + len + 40, proto, state);
+		put16(p + len + 4, l4len + payload);
+		len += 40 + l4len;
+		break;
+	}
+
+	case 0x0806:
+		put16(p + len, 1);
+		put16(p + len + 2, 0x0800);
+		p[len + 4] = 6;
+		p[len + 5] = 4;
+		put16(p + len + 6, 1 + bench_rand(state) % 2);
+		put32(p + len + 8, bench_rand(state));
+		put16(p + len + 12, bench_rand(state) & 0xffff);
+		put32(p + len + 14, synth_ipv4_addr(state));
+		memset(p + len + 18, 0, 6);
+		put32(p + len + 24, synth_ipv4_addr(state));
+		len += 28;
+		payload = 0;
+		break;
+
+	default:
+		break;
+	}
+
+	while (payload-- > 0)
+	{
+		p[len++] = (u_char)bench_rand(state);
+	}
+
+	if (len < 60)
+	{
+		memset(p + len, 0, 60 - len);
+		len = 60;
+	}
+
+	return len;
+}
+
+int bench_corpus_synthesize(struct bench_corpus* corpus, u_int count, u_int seed)
+{
+	u_int32 state = seed ? seed : 0x2545f491;
+	u_int i;
+
+	memset(corpus, 0, sizeof(*corpus));
+
+	corpus->linktype = DLT_EN10MB;
+	corpus->packets = (struct bench_packet*)malloc((count ? count : 1) * sizeof(struct bench_packet));
+	corpus->arena = (u_char*)malloc((count ? count : 1) * (size_t)SYNTH_MAX_FRAME);
+	if (corpus->packets == NULL || corpus->arena == NULL)
+	{
+		bench_corpus_free(corpus);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		struct bench_packet* pkt = &corpus->packets[i];
+
+		pkt->data = corpus->arena + (size_t)i * SYNTH_MAX_FRAME;
+		pkt->wirelen = synth_packet(pkt->data, &state);
+
+		//
+		// A few packets are cut by a short snaplen, anywhere in the headers
+		//
+		if (bench_rand(&state) % 20 == 0)
+			pkt->caplen = bench_rand(&state) % 80;
+		else
+			pkt->caplen = pkt->wirelen;
+	}
+
+	corpus->count = count;
+	return 0;
+}
+
+//-------------------------------------------------------------------
+
+void bench_corpus_free(struct bench_corpus* corpus)
+{
+	free(corpus->packets);
+	free(corpus->arena);
+	memset(corpus, 0, sizeof(*corpus));
+}
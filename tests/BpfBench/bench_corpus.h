@@ -0,0 +1,68 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+#ifndef __BENCH_CORPUS_INCLUDE
+#define __BENCH_CORPUS_INCLUDE
+
+#include "win_bpf.h"
+
+/*!
+  \brief A packet of a corpus, as it would be handed to the filter by the tap.
+*/
+struct bench_packet
+{
+	u_char* data;		///< First byte of the link-layer header
+	u_int caplen;		///< Bytes available at data (the filter's buflen)
+	u_int wirelen;		///< Original length of the packet (the filter's wirelen)
+};
+
+/*!
+  \brief A set of packets, all with the same link-layer type.
+*/
+struct bench_corpus
+{
+	struct bench_packet* packets;
+	u_int count;
+	u_int linktype;		///< DLT_* of the packets
+	u_char* arena;		///< Storage backing all the packets' data
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/*!
+	  \brief Loads a libpcap savefile (both byte orders, micro and nanosecond flavours).
+	  \param path The file to read.
+	  \param corpus Filled with the packets of the file.
+	  \return 0 on success, -1 if the file cannot be read or is not a pcap file.
+	*/
+	int bench_corpus_load_pcap(const char* path, struct bench_corpus* corpus);
+
+	/*!
+	  \brief Builds a reproducible Ethernet corpus that exercises all the reference filters.
+	  \param corpus Filled with the generated packets.
+	  \param count Number of packets to generate.
+	  \param seed Seed of the pseudo-random generator; the same seed yields the same corpus.
+	  \return 0 on success, -1 if memory cannot be allocated.
+
+	  The mix contains IPv4 TCP/UDP (with and without IP options), IPv6, 802.1Q tagged frames,
+	  ARP, IP fragments and packets whose capture length is shorter than the headers the
+	  filters look at, so that the bounds checks of the engines are exercised too.
+	*/
+	int bench_corpus_synthesize(struct bench_corpus* corpus, u_int count, u_int seed);
+
+	/*!
+	  \brief Releases the memory of a corpus.
+	*/
+	void bench_corpus_free(struct bench_corpus* corpus);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__BENCH_CORPUS_INCLUDE*/
@@ -0,0 +1,497 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+#include <string.h>
+
+#include "bench_filters.h"
+
+#define SNAPLEN 262144
+
+/*
+ * The programs below are the output of "tcpdump -d <expression>" on an Ethernet
+ * interface, with the jump targets turned into the relative offsets of the ISA.
+ */
+
+static struct bpf_insn ip_insns[] =
+{
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 1),
+	BPF_STMT(BPF_RET|BPF_K, SNAPLEN),
+	BPF_STMT(BPF_RET|BPF_K, 0),
+};
+
+static struct bpf_insn tcp_insns[] =
+{
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x86dd, 0, 5),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 6, 0),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x2c, 0, 6),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 54),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 3, 4),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 3),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 0, 1),
+	BPF_STMT(BPF_RET|BPF_K, SNAPLEN),
+	BPF_STMT(BPF_RET|BPF_K, 0),
+};
+
+#define PORT_INSNS(_proto, _port)								\
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),							\
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x86dd, 0, 6),				\
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 20),							\
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, (_proto), 0, 15),			\
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 54),							\
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, (_port), 12, 0),			\
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 56),							\
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, (_port), 10, 11),			\
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 10),				\
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 23),							\
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, (_proto), 0, 8),			\
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 20),							\
+	BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x1fff, 6, 0),				\
+	BPF_STMT(BPF_LDX|BPF_MSH|BPF_B, 14),						\
+	BPF_STMT(BPF_LD|BPF_H|BPF_IND, 14),							\
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, (_port), 2, 0),				\
+	BPF_STMT(BPF_LD|BPF_H|BPF_IND, 16),							\
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, (_port), 0, 1),				\
+	BPF_STMT(BPF_RET|BPF_K, SNAPLEN),							\
+	BPF_STMT(BPF_RET|BPF_K, 0)
+
+static struct bpf_insn tcp_port_insns[] =
+{
+	PORT_INSNS(6, 443),
+};
+
+static struct bpf_insn udp_port_insns[] =
+{
+	PORT_INSNS(17, 53),
+};
+
+static struct bpf_insn port_insns[] =
+{
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x86dd, 0, 8),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x84, 2, 0),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 1, 0),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 17, 0, 17),
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 54),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 80, 14, 0),
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 56),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 80, 12, 13),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 12),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x84, 2, 0),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 1, 0),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 17, 0, 8),
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x1fff, 6, 0),
+	BPF_STMT(BPF_LDX|BPF_MSH|BPF_B, 14),
+	BPF_STMT(BPF_LD|BPF_H|BPF_IND, 14),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 80, 2, 0),
+	BPF_STMT(BPF_LD|BPF_H|BPF_IND, 16),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 80, 0, 1),
+	BPF_STMT(BPF_RET|BPF_K, SNAPLEN),
+	BPF_STMT(BPF_RET|BPF_K, 0),
+};
+
+static struct bpf_insn host_insns[] =
+{
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 4),
+	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 26),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x0a000001, 8, 0),
+	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 30),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x0a000001, 6, 7),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x806, 1, 0),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x8035, 0, 5),
+	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 28),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x0a000001, 2, 0),
+	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 38),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x0a000001, 0, 1),
+	BPF_STMT(BPF_RET|BPF_K, SNAPLEN),
+	BPF_STMT(BPF_RET|BPF_K, 0),
+};
+
+static struct bpf_insn net_insns[] =
+{
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 6),
+	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 26),
+	BPF_STMT(BPF_ALU|BPF_AND|BPF_K, 0xffff0000),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0xc0a80000, 11, 0),
+	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 30),
+	BPF_STMT(BPF_ALU|BPF_AND|BPF_K, 0xffff0000),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0xc0a80000, 8, 9),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x806, 1, 0),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x8035, 0, 7),
+	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 28),
+	BPF_STMT(BPF_ALU|BPF_AND|BPF_K, 0xffff0000),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0xc0a80000, 3, 0),
+	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 38),
+	BPF_STMT(BPF_ALU|BPF_AND|BPF_K, 0xffff0000),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0xc0a80000, 0, 1),
+	BPF_STMT(BPF_RET|BPF_K, SNAPLEN),
+	BPF_STMT(BPF_RET|BPF_K, 0),
+};
+
+static struct bpf_insn vlan_tcp_insns[] =
+{
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x8100, 0, 11),
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 16),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x86dd, 0, 5),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 24),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 6, 0),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x2c, 0, 6),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 58),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 3, 4),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 3),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 27),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 0, 1),
+	BPF_STMT(BPF_RET|BPF_K, SNAPLEN),
+	BPF_STMT(BPF_RET|BPF_K, 0),
+};
+
+static struct bpf_insn syn_insns[] =
+{
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 8),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 0, 6),
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x1fff, 4, 0),
+	BPF_STMT(BPF_LDX|BPF_MSH|BPF_B, 14),
+	BPF_STMT(BPF_LD|BPF_B|BPF_IND, 27),
+	BPF_STMT(BPF_ALU|BPF_AND|BPF_K, 0x2),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 1),
+	BPF_STMT(BPF_RET|BPF_K, 0),
+	BPF_STMT(BPF_RET|BPF_K, SNAPLEN),
+};
+
+static struct bpf_insn ip_payload_insns[] =
+{
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 10),
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 16),
+	BPF_STMT(BPF_ST, 0),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 14),
+	BPF_STMT(BPF_ALU|BPF_AND|BPF_K, 0xf),
+	BPF_STMT(BPF_ALU|BPF_LSH|BPF_K, 2),
+	BPF_STMT(BPF_MISC|BPF_TAX, 0),
+	BPF_STMT(BPF_LD|BPF_MEM, 0),
+	BPF_STMT(BPF_ALU|BPF_SUB|BPF_X, 0),
+	BPF_JUMP(BPF_JMP|BPF_JGT|BPF_K, 500, 0, 1),
+	BPF_STMT(BPF_RET|BPF_K, SNAPLEN),
+	BPF_STMT(BPF_RET|BPF_K, 0),
+};
+
+static struct bpf_insn greater_insns[] =
+{
+	BPF_STMT(BPF_LD|BPF_W|BPF_LEN, 0),
+	BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K, 1000, 0, 1),
+	BPF_STMT(BPF_RET|BPF_K, SNAPLEN),
+	BPF_STMT(BPF_RET|BPF_K, 0),
+};
+
+/*
+ * "ip and tcp and ip[6:2] & 0x1fff = 0 and tcp dst port 443" as "tcpdump -O -d" emits it,
+ * i.e. with the redundant checks of each term left in place by the missing optimizer.
+ */
+static struct bpf_insn concat_insns[] =
+{
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 18),
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x86dd, 0, 2),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 4, 14),
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 12),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 0, 10),
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 8),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 0, 6),
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x1fff, 4, 0),
+	BPF_STMT(BPF_LDX|BPF_MSH|BPF_B, 14),
+	BPF_STMT(BPF_LD|BPF_H|BPF_IND, 16),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 443, 0, 1),
+	BPF_STMT(BPF_RET|BPF_K, SNAPLEN),
+	BPF_STMT(BPF_RET|BPF_K, 0),
+};
+
+static struct bpf_insn accept_insns[] =
+{
+	BPF_STMT(BPF_RET|BPF_K, SNAPLEN),
+};
+
+//-------------------------------------------------------------------
+
+/*
+ * Plain C versions of the same expressions. A load past caplen makes the whole
+ * filter fail, exactly as in the interpreter: the loads are done in the same order
+ * as in the programs, and any out of bounds access turns the verdict into 0.
+ */
+struct ref_ctx
+{
+	const struct bench_packet* pkt;
+	int oob;
+};
+
+static u_int ref_ld8(struct ref_ctx* c, u_int k)
+{
+	if (k >= c->pkt->caplen)
+	{
+		c->oob = 1;
+		return 0;
+	}
+	return c->pkt->data[k];
+}
+
+static u_int ref_ld16(struct ref_ctx* c, u_int k)
+{
+	if (k >= c->pkt->caplen || k + 2 > c->pkt->caplen)
+	{
+		c->oob = 1;
+		return 0;
+	}
+	return ((u_int)c->pkt->data[k] << 8) | c->pkt->data[k + 1];
+}
+
+static u_int32 ref_ld32(struct ref_ctx* c, u_int k)
+{
+	if (k >= c->pkt->caplen || k + 4 > c->pkt->caplen)
+	{
+		c->oob = 1;
+		return 0;
+	}
+	return ((u_int32)c->pkt->data[k] << 24) | ((u_int32)c->pkt->data[k + 1] << 16) |
+		((u_int32)c->pkt->data[k + 2] << 8) | c->pkt->data[k + 3];
+}
+
+#define REF_BEGIN(_pkt) struct ref_ctx c; c.pkt = (_pkt); c.oob = 0
+#define REF_END(_match) return (c.oob || !(_match)) ? 0 : SNAPLEN
+
+static u_int ip_ref(const struct bench_packet* pkt)
+{
+	REF_BEGIN(pkt);
+	int m = ref_ld16(&c, 12) == 0x800;
+	REF_END(m);
+}
+
+static u_int tcp_ref(const struct bench_packet* pkt)
+{
+	u_int t, p;
+	int m = 0;
+	REF_BEGIN(pkt);
+
+	t = ref_ld16(&c, 12);
+	if (t == 0x86dd)
+	{
+		p = ref_ld8(&c, 20);
+		m = p == 6 || (p == 0x2c && ref_ld8(&c, 54) == 6);
+	}
+	else if (t == 0x800)
+	{
+		m = ref_ld8(&c, 23) == 6;
+	}
+	REF_END(m);
+}
+
+static int port_ref(struct ref_ctx* cp, u_int proto, u_int port)
+{
+	struct ref_ctx* c = cp;
+	u_int t = ref_ld16(c, 12);
+	u_int x;
+
+	if (t == 0x86dd)
+	{
+		return ref_ld8(c, 20) == proto && (ref_ld16(c, 54) == port || ref_ld16(c, 56) == port);
+	}
+	if (t != 0x800 || ref_ld8(c, 23) != proto || (ref_ld16(c, 20) & 0x1fff) != 0)
+		return 0;
+	x = (ref_ld8(c, 14) & 0xf) << 2;
+	return ref_ld16(c, x + 14) == port || ref_ld16(c, x + 16) == port;
+}
+
+static u_int tcp_port_ref(const struct bench_packet* pkt)
+{
+	REF_BEGIN(pkt);
+	int m = port_ref(&c, 6, 443);
+	REF_END(m);
+}
+
+static u_int udp_port_ref(const struct bench_packet* pkt)
+{
+	REF_BEGIN(pkt);
+	int m = port_ref(&c, 17, 53);
+	REF_END(m);
+}
+
+/// TCP, UDP or SCTP
+#define ANY_PORT_PROTO(_p)	((_p) == 6 || (_p) == 17 || (_p) == 0x84)
+
+static u_int port_any_ref(const struct bench_packet* pkt)
+{
+	u_int t, x;
+	int m = 0;
+	REF_BEGIN(pkt);
+
+	t = ref_ld16(&c, 12);
+	if (t == 0x86dd)
+	{
+		m = ANY_PORT_PROTO(ref_ld8(&c, 20)) && (ref_ld16(&c, 54) == 80 || ref_ld16(&c, 56) == 80);
+	}
+	else if (t == 0x800 && ANY_PORT_PROTO(ref_ld8(&c, 23)) && (ref_ld16(&c, 20) & 0x1fff) == 0)
+	{
+		x = (ref_ld8(&c, 14) & 0xf) << 2;
+		m = ref_ld16(&c, x + 14) == 80 || ref_ld16(&c, x + 16) == 80;
+	}
+	REF_END(m);
+}
+
+static int addr_ref(struct ref_ctx* c, u_int32 mask, u_int32 addr)
+{
+	u_int t = ref_ld16(c, 12);
+
+	if (t == 0x800)
+		return (ref_ld32(c, 26) & mask) == addr || (ref_ld32(c, 30) & mask) == addr;
+	if (t == 0x806 || t == 0x8035)
+		return (ref_ld32(c, 28) & mask) == addr || (ref_ld32(c, 38) & mask) == addr;
+	return 0;
+}
+
+static u_int host_ref(const struct bench_packet* pkt)
+{
+	REF_BEGIN(pkt);
+	int m = addr_ref(&c, 0xffffffff, 0x0a000001);
+	REF_END(m);
+}
+
+static u_int net_ref(const struct bench_packet* pkt)
+{
+	REF_BEGIN(pkt);
+	int m = addr_ref(&c, 0xffff0000, 0xc0a80000);
+	REF_END(m);
+}
+
+static u_int vlan_tcp_ref(const struct bench_packet* pkt)
+{
+	u_int t, p;
+	int m = 0;
+	REF_BEGIN(pkt);
+
+	if (ref_ld16(&c, 12) == 0x8100)
+	{
+		t = ref_ld16(&c, 16);
+		if (t == 0x86dd)
+		{
+			p = ref_ld8(&c, 24);
+			m = p == 6 || (p == 0x2c && ref_ld8(&c, 58) == 6);
+		}
+		else if (t == 0x800)
+		{
+			m = ref_ld8(&c, 27) == 6;
+		}
+	}
+	REF_END(m);
+}
+
+static u_int syn_ref(const struct bench_packet* pkt)
+{
+	u_int x;
+	int m = 0;
+	REF_BEGIN(pkt);
+
+	if (ref_ld16(&c, 12) == 0x800 && ref_ld8(&c, 23) == 6 && (ref_ld16(&c, 20) & 0x1fff) == 0)
+	{
+		x = (ref_ld8(&c, 14) & 0xf) << 2;
+		m = (ref_ld8(&c, x + 27) & 0x2) != 0;
+	}
+	REF_END(m);
+}
+
+static u_int ip_payload_ref(const struct bench_packet* pkt)
+{
+	u_int32 len;
+	int m = 0;
+	REF_BEGIN(pkt);
+
+	if (ref_ld16(&c, 12) == 0x800)
+	{
+		len = ref_ld16(&c, 16);
+		len -= (ref_ld8(&c, 14) & 0xf) << 2;
+		// The ISA compares K operands as signed
+		m = (int)len > 500;
+	}
+	REF_END(m);
+}
+
+static u_int greater_ref(const struct bench_packet* pkt)
+{
+	return pkt->wirelen >= 1000 ? SNAPLEN : 0;
+}
+
+static u_int concat_ref(const struct bench_packet* pkt)
+{
+	u_int x;
+	int m = 0;
+	REF_BEGIN(pkt);
+
+	if (ref_ld16(&c, 12) == 0x800 && ref_ld8(&c, 23) == 6 && (ref_ld16(&c, 20) & 0x1fff) == 0)
+	{
+		x = (ref_ld8(&c, 14) & 0xf) << 2;
+		m = ref_ld16(&c, x + 16) == 443;
+	}
+	REF_END(m);
+}
+
+static u_int accept_ref(const struct bench_packet* pkt)
+{
+	(void)pkt;
+	return SNAPLEN;
+}
+
+//-------------------------------------------------------------------
+
+#define FILTER(_name, _expr, _insns, _ref) \
+	{ _name, _expr, _insns, sizeof(_insns) / sizeof(struct bpf_insn), _ref }
+
+struct bench_filter bench_filters[] =
+{
+	FILTER("accept", "", accept_insns, accept_ref),
+	FILTER("ip", "ip", ip_insns, ip_ref),
+	FILTER("tcp", "tcp", tcp_insns, tcp_ref),
+	FILTER("host", "host 10.0.0.1", host_insns, host_ref),
+	FILTER("net", "net 192.168.0.0/16", net_insns, net_ref),
+	FILTER("tcpport", "tcp port 443", tcp_port_insns, tcp_port_ref),
+	FILTER("udpport", "udp port 53", udp_port_insns, udp_port_ref),
+	FILTER("port", "port 80", port_insns, port_any_ref),
+	FILTER("vlan", "vlan and tcp", vlan_tcp_insns, vlan_tcp_ref),
+	FILTER("syn", "tcp[tcpflags] & tcp-syn != 0", syn_insns, syn_ref),
+	FILTER("payload", "ip[2:2] - ((ip[0] & 0xf) << 2) > 500", ip_payload_insns, ip_payload_ref),
+	FILTER("greater", "greater 1000", greater_insns, greater_ref),
+	FILTER("concat", "ip and tcp and ip[6:2] & 0x1fff = 0 and tcp dst port 443", concat_insns, concat_ref),
+};
+
+const u_int bench_filters_count = sizeof(bench_filters) / sizeof(bench_filters[0]);
+
+struct bench_filter* bench_filter_find(const char* name)
+{
+	u_int i;
+
+	for (i = 0; i < bench_filters_count; i++)
+	{
+		if (strcmp(bench_filters[i].name, name) == 0)
+			return &bench_filters[i];
+	}
+
+	return NULL;
+}
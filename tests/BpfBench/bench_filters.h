@@ -0,0 +1,42 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+#ifndef __BENCH_FILTERS_INCLUDE
+#define __BENCH_FILTERS_INCLUDE
+
+#include "bench_corpus.h"
+
+/*!
+  \brief A reference filter: the code generated by libpcap for an expression on DLT_EN10MB,
+  together with a plain C implementation of the same expression.
+*/
+struct bench_filter
+{
+	const char* name;			///< Short name, used on the command line
+	const char* expression;		///< The libpcap expression the program was compiled from
+	struct bpf_insn* insns;
+	u_int len;					///< Number of instructions in insns
+	u_int (*reference)(const struct bench_packet* pkt);	///< Expected bpf_filter() result
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	extern struct bench_filter bench_filters[];
+	extern const u_int bench_filters_count;
+
+	/*!
+	  \brief Looks up a reference filter by name, returns NULL if there is none.
+	*/
+	struct bench_filter* bench_filter_find(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__BENCH_FILTERS_INCLUDE*/
@@ -0,0 +1,245 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench_random.h"
+
+u_int32 bench_rand(u_int32* state)
+{
+	u_int32 x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+/*
+ * Constants biased towards the interesting cases: small offsets, values that
+ * match the bytes loaded from the packets, and the extremes.
+ */
+static u_int32 random_k(u_int32* state)
+{
+	switch (bench_rand(state) % 8)
+	{
+	case 0:
+		return 0;
+	case 1:
+		return 0xffffffff;
+	case 2:
+		return 0x80000000 + bench_rand(state) % 16;
+	case 3:
+		return bench_rand(state);
+	case 4:
+		return bench_rand(state) % 256;
+	default:
+		return bench_rand(state) % 40;
+	}
+}
+
+static u_char random_jump(u_int room, u_int32* state)
+{
+	if (room > 255)
+		room = 255;
+	if (bench_rand(state) % 4 == 0)
+		return 0;
+	return (u_char)(bench_rand(state) % (room + 1));
+}
+
+static const u_short alu_ops[] =
+{
+	BPF_ADD, BPF_SUB, BPF_MUL, BPF_DIV, BPF_OR, BPF_AND, BPF_LSH, BPF_RSH
+};
+
+static const u_short jmp_ops[] =
+{
+	BPF_JEQ, BPF_JGT, BPF_JGE, BPF_JSET
+};
+
+static const u_short ld_sizes[] =
+{
+	BPF_W, BPF_H, BPF_B
+};
+
+u_int bench_random_program(struct bpf_insn* insns, u_int maxlen, u_int32* state)
+{
+	u_int len = 2 + bench_rand(state) % (maxlen - 1);
+	u_int i;
+
+	for (i = 0; i < len - 1; i++)
+	{
+		struct bpf_insn* p = &insns[i];
+		u_int room = len - 2 - i;	// farthest forward jump that stays in the program
+
+		p->jt = 0;
+		p->jf = 0;
+		p->k = random_k(state);
+
+		switch (bench_rand(state) % 16)
+		{
+		case 0:
+		case 1:
+			p->code = BPF_LD|BPF_ABS|ld_sizes[bench_rand(state) % 3];
+			if (bench_rand(state) % 8 != 0)
+				p->k %= 64;
+			break;
+		case 2:
+			p->code = BPF_LD|BPF_IND|ld_sizes[bench_rand(state) % 3];
+			p->k %= 32;
+			break;
+		case 3:
+			p->code = BPF_LDX|BPF_MSH|BPF_B;
+			p->k %= 64;
+			break;
+		case 4:
+			p->code = (bench_rand(state) % 2) ? BPF_LD|BPF_IMM : BPF_LDX|BPF_IMM;
+			break;
+		case 5:
+			p->code = (bench_rand(state) % 2) ? BPF_LD|BPF_W|BPF_LEN : BPF_LDX|BPF_W|BPF_LEN;
+			break;
+		case 6:
+			p->code = (bench_rand(state) % 2) ? BPF_LD|BPF_MEM : BPF_LDX|BPF_MEM;
+			p->k %= BPF_MEMWORDS;
+			break;
+		case 7:
+			p->code = (bench_rand(state) % 2) ? BPF_ST : BPF_STX;
+			p->k %= BPF_MEMWORDS;
+			break;
+		case 8:
+		case 9:
+			p->code = BPF_ALU|alu_ops[bench_rand(state) % 8]|((bench_rand(state) % 2) ? BPF_X : BPF_K);
+			if (p->code == (BPF_ALU|BPF_DIV|BPF_K) && p->k == 0)
+				p->k = 1 + bench_rand(state) % 7;
+			break;
+		case 10:
+			p->code = BPF_ALU|BPF_NEG;
+			break;
+		case 11:
+			p->code = (bench_rand(state) % 2) ? BPF_MISC|BPF_TAX : BPF_MISC|BPF_TXA;
+			break;
+		case 12:
+			p->code = BPF_JMP|BPF_JA;
+			p->k = random_jump(room, state);
+			break;
+		case 13:
+			if (bench_rand(state) % 4 == 0)
+			{
+				p->code = (bench_rand(state) % 2) ? BPF_RET|BPF_A : BPF_RET|BPF_K;
+				break;
+			}
+			// fall through
+		default:
+			p->code = BPF_JMP|jmp_ops[bench_rand(state) % 4]|((bench_rand(state) % 2) ? BPF_X : BPF_K);
+			p->jt = random_jump(room, state);
+			p->jf = random_jump(room, state);
+			break;
+		}
+	}
+
+	insns[len - 1].code = (bench_rand(state) % 2) ? BPF_RET|BPF_A : BPF_RET|BPF_K;
+	insns[len - 1].jt = 0;
+	insns[len - 1].jf = 0;
+	insns[len - 1].k = random_k(state);
+
+	return len;
+}
+
+void bench_random_packet(struct bench_packet* pkt, u_int size, u_int32* state)
+{
+	u_int i;
+
+	pkt->wirelen = bench_rand(state) % (size + 1);
+	pkt->caplen = (bench_rand(state) % 4 == 0) ? bench_rand(state) % (pkt->wirelen + 1) : pkt->wirelen;
+
+	for (i = 0; i < pkt->wirelen; i++)
+	{
+		// Few distinct values, so that comparisons with small constants succeed now and then
+		pkt->data[i] = (u_char)((bench_rand(state) % 4 == 0) ? bench_rand(state) : bench_rand(state) % 4);
+	}
+}
+
+void bench_dump_program(const char* title, const struct bpf_insn* insns, u_int len)
+{
+	u_int i;
+
+	if (title != NULL)
+		printf(" %s:\n", title);
+
+	for (i = 0; i < len; i++)
+		printf("  (%03u) code=0x%04x jt=%u jf=%u k=0x%08x\n", i, insns[i].code, insns[i].jt, insns[i].jf, insns[i].k);
+}
+
+void bench_random_programs(const struct bench_random_test* test, int* failures)
+{
+	struct bpf_insn insns[BENCH_RANDOM_MAXLEN];
+	struct bench_packet pkt;
+	u_int size = test->pktsize != 0 ? test->pktsize : BENCH_RANDOM_PKTSIZE;
+	u_int32 state = test->seed;
+	u_int n, i, len;
+	int ok;
+
+	pkt.data = (u_char*)malloc(size);
+	if (pkt.data == NULL)
+	{
+		printf("FAIL: no memory for the random packets\n");
+		(*failures)++;
+		return;
+	}
+
+	for (n = 0; n < test->programs && *failures < BENCH_RANDOM_FAILURES; n++)
+	{
+		if (test->generate != NULL)
+			len = test->generate(test->context, insns, BENCH_RANDOM_MAXLEN, &state);
+		else
+			len = bench_random_program(insns, BENCH_RANDOM_MAXLEN, &state);
+		if (len == 0)
+			continue;
+
+		if (!bpf_validate(insns, (int)len))
+		{
+			printf("FAIL: random program %u does not validate\n", n);
+			bench_dump_program(NULL, insns, len);
+			(*failures)++;
+			continue;
+		}
+
+		switch (test->prepare != NULL ? test->prepare(test->context, insns, len) : BENCH_RANDOM_RUN)
+		{
+		case BENCH_RANDOM_SKIP:
+			continue;
+		case BENCH_RANDOM_FAIL:
+			printf(" random program %u:\n", n);
+			bench_dump_program(NULL, insns, len);
+			(*failures)++;
+			continue;
+		}
+
+		ok = 1;
+		for (i = 0; i < test->packets && ok; i++)
+		{
+			bench_random_packet(&pkt, size, &state);
+			ok = test->check(test->context, insns, len, &pkt, &state);
+		}
+
+		if (ok && test->finish != NULL)
+			ok = test->finish(test->context, insns, len, &state);
+
+		if (!ok)
+		{
+			printf(" random program %u:\n", n);
+			bench_dump_program(NULL, insns, len);
+			(*failures)++;
+		}
+
+		if (test->release != NULL)
+			test->release(test->context);
+	}
+
+	free(pkt.data);
+}
@@ -0,0 +1,101 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+#ifndef __BENCH_RANDOM_INCLUDE
+#define __BENCH_RANDOM_INCLUDE
+
+#include "bench_corpus.h"
+
+#define BENCH_RANDOM_MAXLEN		48		///< Size of the random programs of the tests.
+#define BENCH_RANDOM_PKTSIZE	96		///< Size of the random packets of the tests.
+#define BENCH_RANDOM_FAILURES	10		///< Number of failures after which a test stops generating programs.
+
+#define BENCH_RANDOM_RUN		1		///< The program is ready to run the packets.
+#define BENCH_RANDOM_SKIP		0		///< The program is not checked, and is not a failure.
+#define BENCH_RANDOM_FAIL		(-1)	///< The program failed, the hook printed why.
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/*!
+	  \brief xorshift32 pseudo-random generator: small, fast and identical on every platform,
+	  so that a seed always generates the same data.
+	  \param state The state of the generator, must not be 0.
+	*/
+	u_int32 bench_rand(u_int32* state);
+
+	/*!
+	  \brief Generates a random program that passes bpf_validate().
+	  \param insns Receives the program.
+	  \param maxlen Size of insns, at least 2.
+	  \param state State of the generator.
+	  \return The length of the generated program.
+
+	  The programs mix all the instructions of the classic ISA, load mostly from the first bytes of the
+	  packet (also past its end) and jump forward at random, so that the engines can be checked against
+	  the interpreter on code that no compiler would generate.
+	*/
+	u_int bench_random_program(struct bpf_insn* insns, u_int maxlen, u_int32* state);
+
+	/*!
+	  \brief Fills a packet with random bytes and a random caplen no larger than its wirelen.
+	  \param pkt The packet; pkt->data must point to at least size bytes.
+	  \param size The largest packet that can be generated.
+	  \param state State of the generator.
+	*/
+	void bench_random_packet(struct bench_packet* pkt, u_int size, u_int32* state);
+
+	/*!
+	  \brief Prints a program, one instruction per line.
+	  \param title Printed before the program, if not NULL.
+	  \param insns The program.
+	  \param len Its length.
+	*/
+	void bench_dump_program(const char* title, const struct bpf_insn* insns, u_int len);
+
+	/*!
+	  \brief The hooks of a test on random programs, run by bench_random_programs(). Only check is mandatory.
+	*/
+	struct bench_random_test
+	{
+		u_int		programs;	///< Number of programs to generate.
+		u_int		packets;	///< Number of random packets run by each of them.
+		u_int		pktsize;	///< Size of the random packets, BENCH_RANDOM_PKTSIZE if 0.
+		u_int32		seed;		///< Seed of the generator, not 0.
+		void*		context;	///< Passed to every hook.
+
+		/// Generates a program of at most maxlen instructions, bench_random_program() if NULL. Returns its
+		/// length, 0 to skip it.
+		u_int		(*generate)(void* context, struct bpf_insn* insns, u_int maxlen, u_int32* state);
+		/// Prepares the engines under test on a program that validates: returns BENCH_RANDOM_RUN,
+		/// BENCH_RANDOM_SKIP or BENCH_RANDOM_FAIL.
+		int			(*prepare)(void* context, struct bpf_insn* insns, u_int len);
+		/// Checks the program on a packet, returns 0 after printing a mismatch.
+		int			(*check)(void* context, struct bpf_insn* insns, u_int len, struct bench_packet* pkt, u_int32* state);
+		/// Called once all the packets passed, returns 0 after printing a failure.
+		int			(*finish)(void* context, struct bpf_insn* insns, u_int len, u_int32* state);
+		/// Releases what prepare allocated.
+		void		(*release)(void* context);
+	};
+
+	/*!
+	  \brief Runs a test on random programs.
+	  \param test The test.
+	  \param failures The failures of the test, incremented at each program that fails. No program is
+	  generated once there are BENCH_RANDOM_FAILURES of them.
+
+	  A program that does not validate fails, the others are prepared, then checked on random packets
+	  until one fails. The failing programs are printed.
+	*/
+	void bench_random_programs(const struct bench_random_test* test, int* failures);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__BENCH_RANDOM_INCLUDE*/
@@ -0,0 +1,296 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks the ancillary loads of the metadata of the packets: that every engine (bpf_filter_meta(),
+ * the batch, decoded, fragmented and profiling interpreters and the functions of the jitter) reads
+ * each field with loads of any size, and 0 without metadata, that bpf_validate() reserves the area
+ * of the fields, and that the analyses that cannot see the metadata leave these programs alone.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+#include "bench_random.h"
+
+#ifdef HAVE_BPF_JIT_SUPPORT
+#include "jitter.h"
+#endif
+
+#define MAX_LEN				16
+
+static int failures = 0;
+
+static u_char packet[] =
+{
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb,
+	0x08, 0x00, 0x45, 0x00, 0x00, 0x54, 0x12, 0x34, 0x40, 0x00, 0x40, 0x01,
+};
+
+static struct bpf_meta meta =
+{
+	0xa00f,				// vlan_tag: priority 5, VLAN 15
+	1,					// vlan_tag_present
+	BPF_DIRECTION_OUT,	// direction
+	0x9e3779b9,			// rss_hash
+	3,					// cpu
+	7,					// phy
+};
+
+/*
+ * Runs the program on the packet with every engine, returns FALSE if one of them does not
+ * return expected.
+ */
+static int check(const char* name, struct bpf_insn* insns, u_int len, struct bpf_meta* m, u_int expected)
+{
+	struct bpf_profile_counter counters[MAX_LEN];
+	struct bpf_decoded_program* decoded;
+	struct bpf_frag frags[2];
+	struct bpf_packet pkt;
+	u_int got[9];
+	u_int i, n = 0;
+
+	if (!bpf_validate(insns, (int)len))
+	{
+		printf("FAIL: %s: rejected by bpf_validate\n", name);
+		return FALSE;
+	}
+
+	pkt.data = packet;
+	pkt.wirelen = sizeof(packet);
+	pkt.buflen = sizeof(packet);
+	pkt.meta = m;
+
+	frags[0].data = packet;
+	frags[0].len = 10;
+	frags[1].data = packet + 10;
+	frags[1].len = sizeof(packet) - 10;
+
+	got[n++] = bpf_filter_meta(insns, packet, sizeof(packet), sizeof(packet), m);
+	bpf_filter_batch(insns, &pkt, 1, &got[n++]);
+	got[n++] = bpf_filter_frags(insns, frags, sizeof(packet), sizeof(packet), m);
+	memset(counters, 0, sizeof(counters));
+	got[n++] = bpf_filter_profile(insns, packet, sizeof(packet), sizeof(packet), m, counters);
+
+	decoded = bpf_decode(insns, (int)len);
+	if (decoded == NULL)
+	{
+		printf("FAIL: %s: cannot decode\n", name);
+		return FALSE;
+	}
+	got[n++] = bpf_filter_decoded(decoded, packet, sizeof(packet), sizeof(packet), m);
+	bpf_filter_decoded_batch(decoded, &pkt, 1, &got[n++]);
+	bpf_free_decoded(decoded);
+
+#ifdef HAVE_BPF_JIT_SUPPORT
+	{
+		JIT_BPF_Filter* Filter = BPF_jitter(insns, len);
+
+		if (Filter == NULL)
+		{
+			printf("FAIL: %s: cannot jit\n", name);
+			return FALSE;
+		}
+		got[n++] = Filter->Function((PVOID*)packet, sizeof(packet), sizeof(packet), m);
+		got[n++] = Filter->FragsFunction(frags, sizeof(packet), sizeof(packet), m);
+		Filter->BatchFunction(&pkt, 1, &got[n++]);
+		BPF_Destroy_JIT_Filter(Filter);
+	}
+#endif
+
+	for (i = 0; i < n; i++)
+	{
+		if (got[i] != expected)
+		{
+			printf("FAIL: %s, %s metadata: engine %u returned 0x%x instead of 0x%x\n", name, m != NULL ? "with" : "without", i, got[i], expected);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void test_fields(void)
+{
+	static const u_short sizes[] = { BPF_W, BPF_H, BPF_B };
+	char name[64];
+	u_int off, s;
+
+	for (off = 0; off < BPF_AD_MAX; off += 4)
+	{
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+		{
+			struct bpf_insn insns[] =
+			{
+				BPF_STMT(BPF_LD | sizes[s] | BPF_ABS, BPF_AD_OFF + off),
+				BPF_STMT(BPF_RET | BPF_A, 0),
+			};
+			u_int expected = *(u_int32*)((u_char*)&meta + off);
+
+			sprintf(name, "field %u, size 0x%x", off, sizes[s]);
+			if (!check(name, insns, 2, &meta, expected) || !check(name, insns, 2, NULL, 0))
+				failures++;
+		}
+	}
+}
+
+/*
+ * The ancillary loads must not disturb the other registers, the scratch memory or the
+ * loads from the packet around them.
+ */
+static void test_mixed(void)
+{
+	struct bpf_insn insns[] =
+	{
+		BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 0x100),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+		BPF_STMT(BPF_ST, 1),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, BPF_AD_OFF + BPF_AD_CPU),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, BPF_AD_OFF + BPF_AD_DIRECTION),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, BPF_DIRECTION_OUT, 0, 4),
+		BPF_STMT(BPF_LD | BPF_MEM, 1),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+		BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0xf00),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0x55),
+	};
+	u_int len = sizeof(insns) / sizeof(insns[0]);
+
+	// X = 0x100 + 3, the last load reads packet[0x103 + 0xf00], out of the packet
+	if (!check("mixed, out of the packet", insns, len, &meta, 0))
+		failures++;
+
+	// X = 0 + 3, the last load reads packet[3 + 3]
+	insns[0].k = 0;
+	insns[10].k = 3;
+	if (!check("mixed, in the packet", insns, len, &meta, 0x66))
+		failures++;
+
+	// Without metadata the direction is 0, i.e. BPF_DIRECTION_IN
+	if (!check("mixed, no metadata", insns, len, NULL, 0x55))
+		failures++;
+}
+
+static void test_validate(void)
+{
+	struct bpf_insn insns[] =
+	{
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	static const struct
+	{
+		u_int32 k;
+		int valid;
+	}
+	cases[] =
+	{
+		{ BPF_AD_OFF, TRUE },
+		{ BPF_AD_OFF + BPF_AD_PHY, TRUE },
+		{ BPF_AD_OFF + 2, FALSE },
+		{ BPF_AD_OFF + BPF_AD_MAX, FALSE },
+		{ BPF_AD_OFF + BPF_AD_AREA - 4, FALSE },
+		{ BPF_AD_OFF + BPF_AD_AREA, TRUE },
+		{ BPF_AD_OFF - 4, TRUE },
+	};
+	u_int i;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		insns[0].k = cases[i].k;
+		if (!bpf_validate(insns, 2) != !cases[i].valid)
+		{
+			printf("FAIL: bpf_validate of a load at 0x%x: expected %d\n", cases[i].k, cases[i].valid);
+			failures++;
+		}
+	}
+
+	// Only the absolute loads of A are ancillary
+	insns[0].code = BPF_LD | BPF_W | BPF_IND;
+	insns[0].k = BPF_AD_OFF + 2;
+	if (!bpf_validate(insns, 2))
+	{
+		printf("FAIL: bpf_validate of an indirect load in the ancillary area\n");
+		failures++;
+	}
+}
+
+static void test_analyses(void)
+{
+	struct bpf_insn ancillary[] =
+	{
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0800, 0, 3),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, BPF_AD_OFF + BPF_AD_VLAN_TAG),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xa00f, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct bpf_insn plain[] =
+	{
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0800, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct bpf_insn* progs[3] = { ancillary, plain, plain };
+	u_int lens[3] = { 6, 4, 4 };
+	u_int32 checks[6];
+	struct bpf_flow_program* flow;
+	struct bpf_group_program* g;
+	struct bpf_insn optimized[6];
+	int len;
+
+	flow = bpf_flow_compile(ancillary, 6, 1);
+	if (flow != NULL)
+	{
+		printf("FAIL: bpf_flow_compile accepted a program with ancillary loads\n");
+		bpf_free_flow(flow);
+		failures++;
+	}
+
+	g = bpf_group_compile(progs, lens, 3);
+	if (g == NULL || (bpf_group_covered(g) & 1) != 0 || bpf_group_covered(g) != 6)
+	{
+		printf("FAIL: bpf_group_compile: the program with ancillary loads must be left out\n");
+		failures++;
+	}
+	if (g != NULL)
+		bpf_free_group(g);
+
+	// The packet is 24 bytes long: the ancillary load must not add a check of the length
+	if (!bpf_validate_bounds(ancillary, 6, checks) || checks[2] != 0 || checks[3] != 0)
+	{
+		printf("FAIL: bpf_validate_bounds checks the length before an ancillary load\n");
+		failures++;
+	}
+
+	memcpy(optimized, ancillary, sizeof(ancillary));
+	len = bpf_optimize(optimized, 6);
+	if (!check("optimized", optimized, (u_int)len, &meta, 0xffff) || !check("optimized", optimized, (u_int)len, NULL, 0))
+		failures++;
+}
+
+int main()
+{
+	test_fields();
+	test_mixed();
+	test_validate();
+	test_analyses();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
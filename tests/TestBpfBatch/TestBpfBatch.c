@@ -0,0 +1,253 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks that the batch entry points (bpf_filter_batch(), bpf_filter_decoded_batch() and
+ * the batch function of the jitter) give, for each packet, the result of bpf_filter(), on
+ * the reference filters and on random programs, with batches of any size including 0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+#include "bench_random.h"
+
+#ifdef HAVE_BPF_JIT_SUPPORT
+#include "jitter.h"
+#endif
+
+#define MAX_BATCH			64
+#define RANDOM_PROGRAMS		10000
+
+static int failures = 0;
+
+/*
+ * The engines under test on one program
+ */
+struct batch_engines
+{
+	struct bpf_insn* insns;
+	struct bpf_decoded_program* decoded;
+#ifdef HAVE_BPF_JIT_SUPPORT
+	JIT_BPF_Filter* jit;
+#endif
+};
+
+static int prepare(struct batch_engines* e, struct bpf_insn* insns, u_int len)
+{
+	e->insns = insns;
+	e->decoded = bpf_decode(insns, (int)len);
+	if (e->decoded == NULL)
+	{
+		printf("FAIL: cannot decode the program\n");
+		return FALSE;
+	}
+
+#ifdef HAVE_BPF_JIT_SUPPORT
+	e->jit = BPF_jitter(insns, len);
+	if (e->jit == NULL)
+	{
+		printf("FAIL: cannot jit the program\n");
+		bpf_free_decoded(e->decoded);
+		return FALSE;
+	}
+#endif
+
+	return TRUE;
+}
+
+static void release(struct batch_engines* e)
+{
+	bpf_free_decoded(e->decoded);
+#ifdef HAVE_BPF_JIT_SUPPORT
+	BPF_Destroy_JIT_Filter(e->jit);
+#endif
+}
+
+/*
+ * Runs a batch with every engine, returns FALSE on a mismatch. The verdict after the
+ * last packet must be left alone.
+ */
+static int compare(struct batch_engines* e, struct bpf_packet* pkts, u_int count)
+{
+	u_int expected[MAX_BATCH + 1];
+	u_int got[MAX_BATCH + 1];
+	u_int i, engine;
+
+	for (i = 0; i < count; i++)
+		expected[i] = bpf_filter(e->insns, pkts[i].data, pkts[i].wirelen, pkts[i].buflen);
+	expected[count] = 0xdeadbeef;
+
+	for (engine = 0; engine < 3; engine++)
+	{
+		memset(got, 0xaa, sizeof(got));
+		got[count] = 0xdeadbeef;
+
+		switch (engine)
+		{
+		case 0:
+			bpf_filter_batch(e->insns, pkts, count, got);
+			break;
+		case 1:
+			bpf_filter_decoded_batch(e->decoded, pkts, count, got);
+			break;
+		default:
+#ifdef HAVE_BPF_JIT_SUPPORT
+			e->jit->BatchFunction(pkts, count, got);
+			break;
+#else
+			continue;
+#endif
+		}
+
+		for (i = 0; i <= count; i++)
+		{
+			if (got[i] != expected[i])
+			{
+				printf("FAIL: engine %u, packet %u of %u: expected 0x%x, got 0x%x\n", engine, i, count, expected[i], got[i]);
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+static void test_reference_filters(void)
+{
+	struct bench_corpus corpus;
+	struct bpf_packet pkts[MAX_BATCH];
+	struct batch_engines e;
+	u_int32 state = 0xba7c;
+	u_int f, i, count, n;
+
+	if (bench_corpus_synthesize(&corpus, 20000, 3) != 0)
+	{
+		printf("FAIL: cannot synthesize the corpus\n");
+		failures++;
+		return;
+	}
+
+	for (f = 0; f < bench_filters_count; f++)
+	{
+		struct bench_filter* filter = &bench_filters[f];
+
+		if (!prepare(&e, filter->insns, filter->len))
+		{
+			failures++;
+			continue;
+		}
+
+		for (i = 0; i < corpus.count; i += count)
+		{
+			count = bench_rand(&state) % (MAX_BATCH + 1);
+			if (count > corpus.count - i)
+				count = corpus.count - i;
+
+			for (n = 0; n < count; n++)
+			{
+				pkts[n].data = corpus.packets[i + n].data;
+				pkts[n].wirelen = corpus.packets[i + n].wirelen;
+				pkts[n].buflen = corpus.packets[i + n].caplen;
+				pkts[n].meta = NULL;
+			}
+
+			if (!compare(&e, pkts, count))
+			{
+				printf("  filter %s, packets %u-%u\n", filter->name, i, i + count);
+				failures++;
+				break;
+			}
+		}
+
+		release(&e);
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+/*
+ * The engines under test on a random program, and the batch of random packets they run
+ */
+struct random_batch
+{
+	struct batch_engines e;
+	u_char data[MAX_BATCH][BENCH_RANDOM_PKTSIZE];
+	struct bpf_packet pkts[MAX_BATCH];
+	u_int count;
+};
+
+static int random_prepare(void* context, struct bpf_insn* insns, u_int len)
+{
+	struct random_batch* b = (struct random_batch*)context;
+
+	b->count = 0;
+	return prepare(&b->e, insns, len) ? BENCH_RANDOM_RUN : BENCH_RANDOM_FAIL;
+}
+
+static int random_check(void* context, struct bpf_insn* insns, u_int len, struct bench_packet* pkt, u_int32* state)
+{
+	struct random_batch* b = (struct random_batch*)context;
+	struct bpf_packet* p = &b->pkts[b->count];
+
+	(void)insns;
+	(void)len;
+	(void)state;
+
+	memcpy(b->data[b->count], pkt->data, pkt->caplen);
+	p->data = b->data[b->count];
+	p->wirelen = pkt->wirelen;
+	p->buflen = pkt->caplen;
+	p->meta = NULL;
+	b->count++;
+
+	return TRUE;
+}
+
+/*
+ * Runs the first packets as a batch, of a random size up to MAX_BATCH
+ */
+static int random_finish(void* context, struct bpf_insn* insns, u_int len, u_int32* state)
+{
+	struct random_batch* b = (struct random_batch*)context;
+
+	(void)insns;
+	(void)len;
+
+	return compare(&b->e, b->pkts, bench_rand(state) % (b->count + 1));
+}
+
+static void random_release(void* context)
+{
+	release(&((struct random_batch*)context)->e);
+}
+
+static void test_random_programs(void)
+{
+	static struct random_batch b;
+	struct bench_random_test test = { RANDOM_PROGRAMS, MAX_BATCH, 0, 0x51ab, &b,
+		NULL, random_prepare, random_check, random_finish, random_release };
+
+	bench_random_programs(&test, &failures);
+}
+
+int main()
+{
+	test_reference_filters();
+	test_random_programs();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
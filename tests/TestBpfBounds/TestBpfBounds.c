@@ -0,0 +1,143 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks where bpf_validate_bounds() places the bounds checks. That the results of the
+ * programs do not change is checked by TestBpfDecode and TestBpfJit, which use them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_filters.h"
+
+static int failures = 0;
+
+#define CHECK(_cond, _what) do												\
+	{																		\
+		if (!(_cond))														\
+		{																	\
+			printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, (_what));		\
+			failures++;														\
+		}																	\
+	} while (0)
+
+/*
+ * Runs the analysis, returns the number of checks or -1 on failure.
+ */
+static int bounds(struct bpf_insn* insns, u_int len, u_int32* checks)
+{
+	u_int i;
+	int count = 0;
+
+	if (!bpf_validate(insns, (int)len) || !bpf_validate_bounds(insns, (int)len, checks))
+		return -1;
+
+	for (i = 0; i < len; i++)
+	{
+		if (checks[i] != 0)
+			count++;
+	}
+
+	return count;
+}
+
+static void test_shapes(void)
+{
+	u_int32 checks[BPF_MAXINSNS];
+	struct bpf_insn header[] =
+	{
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+		BPF_STMT(BPF_LDX|BPF_MSH|BPF_B, 14),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 26),
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 23),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	// The farther load is on the rejecting path only: checking it first gives the same result
+	struct bpf_insn reject_path[] =
+	{
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 1, 0),
+		BPF_STMT(BPF_RET|BPF_K, 0),
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 23),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 0, 1),
+		BPF_STMT(BPF_RET|BPF_K, 0xffff),
+		BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+	// The accepting path before the load must not be affected by its check
+	struct bpf_insn accept_path[] =
+	{
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x806, 0, 1),
+		BPF_STMT(BPF_RET|BPF_K, 0xffff),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 30),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	struct bpf_insn overflow[] =
+	{
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 1),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 0xfffffffe),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+
+	CHECK(bounds(header, sizeof(header) / sizeof(header[0]), checks) == 1 && checks[0] == 30, "single check");
+
+	CHECK(bounds(reject_path, sizeof(reject_path) / sizeof(reject_path[0]), checks) == 1 && checks[0] == 24,
+		"check hoisted above a rejecting branch");
+
+	CHECK(bounds(accept_path, sizeof(accept_path) / sizeof(accept_path[0]), checks) == 2 && checks[0] == 14 &&
+		checks[3] == 34, "check kept below an accepting branch");
+
+	CHECK(bounds(overflow, sizeof(overflow) / sizeof(overflow[0]), checks) == 1 && checks[0] == 2,
+		"loads whose end overflows keep their own check");
+}
+
+/*
+ * Every reference filter needs fewer checks than it has absolute loads, and "ip" just one.
+ */
+static void test_reference_filters(void)
+{
+	u_int32 checks[BPF_MAXINSNS];
+	u_int f, i, loads;
+	int count;
+
+	for (f = 0; f < bench_filters_count; f++)
+	{
+		struct bench_filter* filter = &bench_filters[f];
+
+		count = bounds(filter->insns, filter->len, checks);
+		CHECK(count >= 0, filter->name);
+
+		for (i = 0, loads = 0; i < filter->len; i++)
+		{
+			u_short code = filter->insns[i].code;
+
+			if ((BPF_CLASS(code) == BPF_LD || BPF_CLASS(code) == BPF_LDX) &&
+				(BPF_MODE(code) == BPF_ABS || BPF_MODE(code) == BPF_MSH))
+				loads++;
+		}
+
+		printf("  %-10s %2u absolute loads, %2d checks\n", filter->name, loads, count);
+		CHECK(count <= (int)loads, filter->name);
+		if (strcmp(filter->name, "ip") == 0)
+			CHECK(count == 1, filter->name);
+	}
+}
+
+int main()
+{
+	test_shapes();
+	test_reference_filters();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
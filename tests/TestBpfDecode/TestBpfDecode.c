@@ -0,0 +1,184 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks the pre-decoded interpreter against bpf_filter(), on the reference filters,
+ * on random programs and on programs reading the scratch memory before writing it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+#include "bench_random.h"
+
+#define RANDOM_PROGRAMS		20000
+#define RANDOM_PACKETS		64
+
+static int failures = 0;
+
+static void test_reference_filters(void)
+{
+	struct bench_corpus corpus;
+	u_int f, i;
+
+	if (bench_corpus_synthesize(&corpus, 20000, 3) != 0)
+	{
+		printf("FAIL: cannot synthesize the corpus\n");
+		failures++;
+		return;
+	}
+
+	for (f = 0; f < bench_filters_count; f++)
+	{
+		struct bench_filter* filter = &bench_filters[f];
+		struct bpf_decoded_program* prog = bpf_decode(filter->insns, (int)filter->len);
+		u_int mismatches = 0;
+
+		if (prog == NULL)
+		{
+			printf("FAIL: cannot decode %s\n", filter->name);
+			failures++;
+			continue;
+		}
+
+		for (i = 0; i < corpus.count; i++)
+		{
+			struct bench_packet* pkt = &corpus.packets[i];
+
+			if (bpf_filter_decoded(prog, pkt->data, pkt->wirelen, pkt->caplen, NULL) != filter->reference(pkt))
+				mismatches++;
+		}
+
+		if (mismatches != 0)
+		{
+			printf("FAIL: %s: %u mismatches out of %u packets\n", filter->name, mismatches, corpus.count);
+			failures++;
+		}
+
+		bpf_free_decoded(prog);
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+static int random_prepare(void* context, struct bpf_insn* insns, u_int len)
+{
+	struct bpf_decoded_program** prog = (struct bpf_decoded_program**)context;
+
+	*prog = bpf_decode(insns, (int)len);
+	if (*prog == NULL)
+	{
+		printf("FAIL: cannot decode\n");
+		return BENCH_RANDOM_FAIL;
+	}
+
+	return BENCH_RANDOM_RUN;
+}
+
+static int random_check(void* context, struct bpf_insn* insns, u_int len, struct bench_packet* pkt, u_int32* state)
+{
+	struct bpf_decoded_program** prog = (struct bpf_decoded_program**)context;
+	u_int expected, got;
+
+	(void)len;
+	(void)state;
+
+	expected = bpf_filter(insns, pkt->data, pkt->wirelen, pkt->caplen);
+	got = bpf_filter_decoded(*prog, pkt->data, pkt->wirelen, pkt->caplen, NULL);
+	if (expected != got)
+	{
+		printf("FAIL: wirelen %u, caplen %u: interpreter 0x%x, decoded 0x%x\n", pkt->wirelen, pkt->caplen, expected, got);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void random_release(void* context)
+{
+	bpf_free_decoded(*(struct bpf_decoded_program**)context);
+}
+
+static void test_random_programs(void)
+{
+	struct bpf_decoded_program* prog;
+	struct bench_random_test test = { RANDOM_PROGRAMS, RANDOM_PACKETS, 0, 0xdec0de, &prog,
+		NULL, random_prepare, random_check, NULL, random_release };
+
+	bench_random_programs(&test, &failures);
+}
+
+/*
+ * The scratch memory is cleared only where it can be read before being written: the
+ * words read uninitialized on one path only must still be zero.
+ */
+static void test_scratch_memory(void)
+{
+	struct bpf_insn insns[] =
+	{
+		BPF_STMT(BPF_LD|BPF_W|BPF_LEN, 0),
+		BPF_STMT(BPF_ST, 1),
+		BPF_JUMP(BPF_JMP|BPF_JGT|BPF_K, 100, 0, 1),
+		BPF_STMT(BPF_ST, 2),
+		BPF_STMT(BPF_LDX|BPF_MEM, 2),
+		BPF_STMT(BPF_LD|BPF_MEM, 1),
+		BPF_STMT(BPF_ALU|BPF_ADD|BPF_X, 0),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	struct bpf_insn out_of_bounds[] =
+	{
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 0xfffffffe),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	struct bpf_decoded_program* prog;
+	u_char data[4] = { 0 };
+	u_int wirelen;
+
+	prog = bpf_decode(insns, sizeof(insns) / sizeof(insns[0]));
+	if (prog == NULL)
+	{
+		printf("FAIL: cannot decode the scratch memory program\n");
+		failures++;
+		return;
+	}
+
+	for (wirelen = 50; wirelen <= 150; wirelen += 100)
+	{
+		if (bpf_filter_decoded(prog, data, wirelen, sizeof(data), NULL) != bpf_filter(insns, data, wirelen, sizeof(data)))
+		{
+			printf("FAIL: scratch memory, wirelen %u\n", wirelen);
+			failures++;
+		}
+	}
+
+	bpf_free_decoded(prog);
+
+	prog = bpf_decode(out_of_bounds, sizeof(out_of_bounds) / sizeof(out_of_bounds[0]));
+	if (prog == NULL || bpf_filter_decoded(prog, data, 0xffffffff, 0xffffffff, NULL) != 0)
+	{
+		printf("FAIL: a load whose end overflows must reject the packet\n");
+		failures++;
+	}
+	bpf_free_decoded(prog);
+}
+
+int main()
+{
+	test_reference_filters();
+	test_random_programs();
+	test_scratch_memory();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,780 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks the extended programs: that the verifier accepts the safe programs, bounded loops
+ * included, and rejects the unsafe ones, that the maps count what the programs add to them,
+ * that the fragmented packets and the metadata are read like by the classic engines, and that
+ * the random programs that pass the verifier run to their end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_random.h"
+#include "win_ebpf.h"
+
+#define RANDOM_PROGRAMS		20000
+#define RANDOM_PACKETS		16
+#define RANDOM_MAXLEN		40
+#define RANDOM_PKTSIZE		96
+
+#define MOV64_IMM(d, imm)			EBPF_INSN(EBPF_ALU64 | EBPF_MOV | BPF_K, d, 0, 0, imm)
+#define MOV64_REG(d, s)				EBPF_INSN(EBPF_ALU64 | EBPF_MOV | BPF_X, d, s, 0, 0)
+#define ALU64_IMM(op, d, imm)		EBPF_INSN(EBPF_ALU64 | (op) | BPF_K, d, 0, 0, imm)
+#define ALU64_REG(op, d, s)			EBPF_INSN(EBPF_ALU64 | (op) | BPF_X, d, s, 0, 0)
+#define ALU32_IMM(op, d, imm)		EBPF_INSN(BPF_ALU | (op) | BPF_K, d, 0, 0, imm)
+#define JMP_IMM(op, d, imm, off)	EBPF_INSN(BPF_JMP | (op) | BPF_K, d, 0, off, imm)
+#define JMP_REG(op, d, s, off)		EBPF_INSN(BPF_JMP | (op) | BPF_X, d, s, off, 0)
+#define JA(off)						EBPF_INSN(BPF_JMP | BPF_JA, 0, 0, off, 0)
+#define LDX_MEM(size, d, s, off)	EBPF_INSN(BPF_LDX | BPF_MEM | (size), d, s, off, 0)
+#define STX_MEM(size, d, s, off)	EBPF_INSN(BPF_STX | BPF_MEM | (size), d, s, off, 0)
+#define ST_MEM(size, d, off, imm)	EBPF_INSN(BPF_ST | BPF_MEM | (size), d, 0, off, imm)
+#define LD_ABS(size, k)				EBPF_INSN(BPF_LD | BPF_ABS | (size), 0, 0, 0, k)
+#define LD_IND(size, s, k)			EBPF_INSN(BPF_LD | BPF_IND | (size), 0, s, 0, k)
+#define LD_IMM64(d, lo, hi)			EBPF_INSN(BPF_LD | EBPF_DW | BPF_IMM, d, 0, 0, lo), EBPF_INSN(0, 0, 0, 0, hi)
+#define CALL(func)					EBPF_INSN(BPF_JMP | EBPF_CALL, 0, 0, 0, func)
+#define EXIT()						EBPF_INSN(BPF_JMP | EBPF_EXIT, 0, 0, 0, 0)
+
+#define COUNT(a)					(sizeof(a) / sizeof((a)[0]))
+
+static int failures = 0;
+
+static u_char packet[] =
+{
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb,
+	0x08, 0x00, 0x45, 0x00, 0x00, 0x54, 0x12, 0x34, 0x40, 0x00, 0x40, 0x06,
+	0x0a, 0x0b, 0xc0, 0xa8, 0x01, 0x02, 0xc0, 0xa8, 0x01, 0x03, 0x04, 0xd2,
+	0x00, 0x50, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x50, 0x02,
+};
+
+static struct bpf_meta meta =
+{
+	0xa00f,				// vlan_tag
+	1,					// vlan_tag_present
+	BPF_DIRECTION_OUT,	// direction
+	0x9e3779b9,			// rss_hash
+	3,					// cpu
+	7,					// phy
+};
+
+/*
+ * Builds the image of a program and loads it
+ */
+static struct ebpf_program* load(struct ebpf_map_def* maps, u_int nmaps, struct ebpf_insn* insns, u_int len)
+{
+	struct ebpf_program_header* header;
+	struct ebpf_program* prog;
+	u_int size = sizeof(*header) + nmaps * sizeof(*maps) + len * sizeof(*insns);
+
+	header = (struct ebpf_program_header*)malloc(size);
+	if (header == NULL)
+		return NULL;
+
+	header->magic = EBPF_MAGIC;
+	header->nmaps = nmaps;
+	header->len = len;
+	header->reserved = 0;
+	if (nmaps != 0)
+		memcpy(header + 1, maps, nmaps * sizeof(*maps));
+	memcpy((u_char*)(header + 1) + nmaps * sizeof(*maps), insns, len * sizeof(*insns));
+
+	prog = ebpf_load(header, size);
+	free(header);
+
+	return prog;
+}
+
+static void expect(const char* name, struct ebpf_map_def* maps, u_int nmaps, struct ebpf_insn* insns, u_int len, int valid, u_int result)
+{
+	struct ebpf_program* prog = load(maps, nmaps, insns, len);
+	u_int got;
+
+	if ((prog != NULL) != valid)
+	{
+		printf("FAIL: %s: %s by the verifier\n", name, prog != NULL ? "accepted" : "rejected");
+		failures++;
+	}
+
+	if (prog == NULL)
+		return;
+
+	got = ebpf_filter(prog, packet, sizeof(packet), sizeof(packet), &meta);
+	if (got != result)
+	{
+		printf("FAIL: %s: returned 0x%x instead of 0x%x\n", name, got, result);
+		failures++;
+	}
+
+	ebpf_free(prog);
+}
+
+#define EXPECT(name, maps, nmaps, insns, valid, result) expect(name, maps, nmaps, insns, COUNT(insns), valid, result)
+
+static struct ebpf_map_def hash = { EBPF_MAP_HASH, 4, 8, 4 };
+
+static void test_verifier(void)
+{
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(0, 1), EXIT() };
+		EXPECT("return a constant", NULL, 0, p, TRUE, 1);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_REG(0, 1), ALU64_REG(BPF_ADD, 0, 2), EXIT() };
+		EXPECT("return the lengths", NULL, 0, p, TRUE, 2 * sizeof(packet));
+	}
+	{
+		struct ebpf_insn p[] = { LD_IMM64(0, 0x89abcdef, 0x01234567), ALU64_IMM(BPF_RSH, 0, 16), EXIT() };
+		EXPECT("64-bit immediate", NULL, 0, p, TRUE, 0x456789ab);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(0, -1), ALU32_IMM(BPF_ADD, 0, 2), ALU64_IMM(BPF_LSH, 0, 32), EXIT() };
+		EXPECT("32-bit arithmetic clears the high half", NULL, 0, p, TRUE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(0, -16), ALU64_IMM(EBPF_ARSH, 0, 2), EXIT() };
+		EXPECT("arithmetic shift", NULL, 0, p, TRUE, (u_int)-4);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(3, 0), MOV64_IMM(0, 7), ALU64_REG(BPF_DIV, 0, 3), EXIT() };
+		EXPECT("division by a zero register", NULL, 0, p, TRUE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { ST_MEM(EBPF_DW, 10, -8, 0x1234), LDX_MEM(BPF_H, 0, 10, -8), EXIT() };
+		EXPECT("stack", NULL, 0, p, TRUE, 0x1234);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_REG(6, 10), ALU64_IMM(BPF_ADD, 6, -512), LDX_MEM(EBPF_DW, 0, 6, 0), EXIT() };
+		EXPECT("bottom of the stack", NULL, 0, p, TRUE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { LD_ABS(BPF_H, 12), JMP_IMM(BPF_JEQ, 0, 0x0800, 1), MOV64_IMM(0, 0), EXIT() };
+		EXPECT("forward jump", NULL, 0, p, TRUE, 0x0800);
+	}
+	{
+		struct ebpf_insn p[] = { LD_ABS(BPF_W, 1000), MOV64_IMM(0, 1), EXIT() };
+		EXPECT("load out of the packet", NULL, 0, p, TRUE, 0);
+	}
+
+	{
+		struct ebpf_insn p[] = { EXIT() };
+		EXPECT("R0 not written", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_REG(0, 3), EXIT() };
+		EXPECT("uninitialized register", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(10, 0), MOV64_IMM(0, 0), EXIT() };
+		EXPECT("write of the frame pointer", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_REG(0, 10), EXIT() };
+		EXPECT("return of a pointer", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { STX_MEM(EBPF_DW, 10, 10, -8), MOV64_IMM(0, 0), EXIT() };
+		EXPECT("store of a pointer", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_REG(0, 10), JMP_IMM(BPF_JEQ, 0, 0, 0), MOV64_IMM(0, 0), EXIT() };
+		EXPECT("comparison of a pointer", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_REG(6, 10), ALU32_IMM(BPF_ADD, 6, -8), MOV64_IMM(0, 0), EXIT() };
+		EXPECT("32-bit arithmetic on a pointer", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_REG(6, 10), ALU64_REG(BPF_ADD, 6, 1), MOV64_IMM(0, 0), EXIT() };
+		EXPECT("pointer plus a variable", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { LDX_MEM(BPF_W, 0, 10, 0), EXIT() };
+		EXPECT("load above the stack", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { LDX_MEM(BPF_B, 0, 10, -513), EXIT() };
+		EXPECT("load below the stack", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { LDX_MEM(EBPF_DW, 0, 10, -12), EXIT() };
+		EXPECT("misaligned load", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { LDX_MEM(BPF_W, 0, 1, 0), EXIT() };
+		EXPECT("load through a number", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(0, 1), ALU64_IMM(BPF_DIV, 0, 0), EXIT() };
+		EXPECT("division by a zero constant", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(0, 1), ALU32_IMM(BPF_LSH, 0, 32), EXIT() };
+		EXPECT("shift by the width", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(0, 1), JA(1), EXIT() };
+		EXPECT("jump past the end", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(0, 1) };
+		EXPECT("fall past the end", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(0, 1), JA(1), LD_IMM64(0, 1, 2), EXIT() };
+		EXPECT("jump into a 64-bit immediate", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { LD_ABS(BPF_W, BPF_AD_OFF + 2), EXIT() };
+		EXPECT("unknown ancillary field", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { EBPF_INSN(0x06, 0, 0, 0, 0), MOV64_IMM(0, 0), EXIT() };
+		EXPECT("unknown class", NULL, 0, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { ST_MEM(BPF_W, 10, -4, 1), MOV64_IMM(1, 1), MOV64_REG(2, 10), ALU64_IMM(BPF_ADD, 2, -4),
+			MOV64_IMM(3, 1), CALL(EBPF_FUNC_MAP_ADD), EXIT() };
+		EXPECT("call on a missing map", &hash, 1, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(1, 0), MOV64_REG(2, 10), ALU64_IMM(BPF_ADD, 2, -2),
+			MOV64_IMM(3, 1), CALL(EBPF_FUNC_MAP_ADD), EXIT() };
+		EXPECT("key out of the stack", &hash, 1, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { LD_ABS(BPF_B, 0), MOV64_REG(1, 0), MOV64_REG(2, 10), ALU64_IMM(BPF_ADD, 2, -4),
+			MOV64_IMM(3, 1), CALL(EBPF_FUNC_MAP_ADD), EXIT() };
+		EXPECT("variable map", &hash, 1, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(1, 0), MOV64_REG(2, 10), ALU64_IMM(BPF_ADD, 2, -4),
+			MOV64_IMM(3, 1), CALL(EBPF_FUNC_MAP_ADD), MOV64_REG(0, 1), EXIT() };
+		EXPECT("register clobbered by a call", &hash, 1, p, FALSE, 0);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(1, 0), MOV64_REG(2, 10), ALU64_IMM(BPF_ADD, 2, -4),
+			MOV64_REG(3, 10), ALU64_IMM(BPF_ADD, 3, -4), CALL(EBPF_FUNC_MAP_UPDATE), EXIT() };
+		EXPECT("value out of the stack", &hash, 1, p, FALSE, 0);
+	}
+
+	// The images that do not match their header
+	{
+		struct ebpf_program_header header = { EBPF_MAGIC, 0, 1, 0 };
+		u_char image[sizeof(header) + 2 * sizeof(struct ebpf_insn)];
+		struct ebpf_insn p[] = { MOV64_IMM(0, 1), EXIT() };
+		struct ebpf_program* prog;
+
+		memcpy(image, &header, sizeof(header));
+		memcpy(image + sizeof(header), p, sizeof(p));
+		prog = ebpf_load(image, sizeof(image));
+		if (prog != NULL)
+		{
+			printf("FAIL: image longer than its header accepted\n");
+			ebpf_free(prog);
+			failures++;
+		}
+
+		header.len = 2;
+		header.magic = 0;
+		memcpy(image, &header, sizeof(header));
+		prog = ebpf_load(image, sizeof(image));
+		if (prog != NULL)
+		{
+			printf("FAIL: image with a bad magic accepted\n");
+			ebpf_free(prog);
+			failures++;
+		}
+	}
+	{
+		struct ebpf_map_def bad[] =
+		{
+			{ 3, 4, 8, 4 },
+			{ EBPF_MAP_ARRAY, 8, 8, 4 },
+			{ EBPF_MAP_HASH, 0, 8, 4 },
+			{ EBPF_MAP_HASH, 4, EBPF_MAX_VALUE + 1, 4 },
+			{ EBPF_MAP_HASH, 4, 8, 0 },
+			{ EBPF_MAP_ARRAY, 4, 8, EBPF_MAX_MAP_MEMORY },
+		};
+		struct ebpf_insn p[] = { MOV64_IMM(0, 1), EXIT() };
+		u_int i;
+
+		for (i = 0; i < COUNT(bad); i++)
+			expect("bad map", &bad[i], 1, p, COUNT(p), FALSE, 0);
+	}
+}
+
+static void test_loops(void)
+{
+	{
+		// for (i = 0; i < 10; i++) r0 += i;
+		struct ebpf_insn p[] =
+		{
+			MOV64_IMM(0, 0),
+			MOV64_IMM(6, 0),
+			ALU64_REG(BPF_ADD, 0, 6),
+			ALU64_IMM(BPF_ADD, 6, 1),
+			JMP_IMM(EBPF_JLT, 6, 10, -3),
+			EXIT(),
+		};
+		EXPECT("bounded loop", NULL, 0, p, TRUE, 45);
+	}
+	{
+		// More iterations than the checkpoints of an instruction
+		struct ebpf_insn p[] =
+		{
+			MOV64_IMM(0, 0),
+			ALU64_IMM(BPF_ADD, 0, 3),
+			JMP_IMM(EBPF_JNE, 0, 3000, -2),
+			EXIT(),
+		};
+		EXPECT("long bounded loop", NULL, 0, p, TRUE, 3000);
+	}
+	{
+		// The loop on the packet and on a counter: its state changes at each iteration
+		struct ebpf_insn p[] =
+		{
+			MOV64_IMM(6, 0),
+			MOV64_IMM(7, 0),
+			LD_IND(BPF_B, 6, 0),
+			ALU64_REG(BPF_ADD, 7, 0),
+			ALU64_IMM(BPF_ADD, 6, 1),
+			JMP_IMM(EBPF_JLT, 6, 12, -4),
+			MOV64_REG(0, 7),
+			EXIT(),
+		};
+		u_int sum = 0, i;
+
+		for (i = 0; i < 12; i++)
+			sum += packet[i];
+		EXPECT("loop on the packet", NULL, 0, p, TRUE, sum);
+	}
+	{
+		struct ebpf_insn p[] = { MOV64_IMM(0, 0), JA(-1), EXIT() };
+		EXPECT("infinite loop", NULL, 0, p, FALSE, 0);
+	}
+	{
+		// The counter is not known: the verifier cannot tell that the loop ends
+		struct ebpf_insn p[] =
+		{
+			MOV64_REG(6, 1),
+			MOV64_IMM(0, 0),
+			ALU64_IMM(BPF_SUB, 6, 1),
+			JMP_IMM(EBPF_JNE, 6, 0, -2),
+			EXIT(),
+		};
+		EXPECT("loop on a number", NULL, 0, p, FALSE, 0);
+	}
+	{
+		// The counter wraps: the loop ends, after too many steps to follow
+		struct ebpf_insn p[] =
+		{
+			MOV64_IMM(0, 1),
+			ALU32_IMM(BPF_ADD, 0, 1),
+			JMP_IMM(EBPF_JNE, 0, 0, -2),
+			EXIT(),
+		};
+		EXPECT("loop too long", NULL, 0, p, FALSE, 0);
+	}
+	{
+		// Paths that join again are pruned: 2^20 of them must not be followed one by one
+		struct ebpf_insn p[3 * 20 + 2];
+		u_int i;
+
+		for (i = 0; i < 20; i++)
+		{
+			struct ebpf_insn b[] = { LD_ABS(BPF_B, i), JMP_IMM(BPF_JSET, 0, 1, 1), MOV64_IMM(6, 0) };
+			memcpy(&p[3 * i], b, sizeof(b));
+		}
+		{
+			struct ebpf_insn e[] = { MOV64_IMM(0, 5), EXIT() };
+			memcpy(&p[3 * 20], e, sizeof(e));
+		}
+		EXPECT("pruned paths", NULL, 0, p, TRUE, 5);
+	}
+}
+
+static void test_maps(void)
+{
+	struct ebpf_map_def maps[] =
+	{
+		{ EBPF_MAP_HASH, 2, 8, 64 },
+		{ EBPF_MAP_ARRAY, 4, 16, 4 },
+	};
+	// Counts the packets per EtherType, and their bytes per low bits of their first byte
+	struct ebpf_insn p[] =
+	{
+		LD_ABS(BPF_H, 12),
+		STX_MEM(BPF_H, 10, 0, -2),
+		MOV64_IMM(1, 0),
+		MOV64_REG(2, 10),
+		ALU64_IMM(BPF_ADD, 2, -2),
+		MOV64_IMM(3, 1),
+		CALL(EBPF_FUNC_MAP_ADD),
+		LD_ABS(BPF_B, 0),
+		ALU64_IMM(BPF_AND, 0, 3),
+		STX_MEM(BPF_W, 10, 0, -8),
+		MOV64_IMM(1, 1),
+		MOV64_REG(2, 10),
+		ALU64_IMM(BPF_ADD, 2, -8),
+		LD_ABS(BPF_W, BPF_AD_OFF + BPF_AD_CPU),
+		MOV64_REG(3, 0),
+		CALL(EBPF_FUNC_MAP_ADD),
+		MOV64_IMM(0, 0xffff),
+		EXIT(),
+	};
+	struct ebpf_program* prog = load(maps, COUNT(maps), p, COUNT(p));
+	u_short ethertypes[] = { 0x0800, 0x86dd, 0x0806, 0x0800, 0x0800, 0x86dd };
+	ULONGLONG expected[4] = { 0 };
+	u_char buffer[sizeof(struct ebpf_map_info) + 64 * 10];
+	struct ebpf_map_info* info = (struct ebpf_map_info*)buffer;
+	u_char value[16];
+	u_int i, n;
+
+	if (prog == NULL)
+	{
+		printf("FAIL: counting program rejected\n");
+		failures++;
+		return;
+	}
+
+	for (i = 0; i < COUNT(ethertypes); i++)
+	{
+		packet[0] = (u_char)i;
+		packet[12] = (u_char)(ethertypes[i] >> 8);
+		packet[13] = (u_char)ethertypes[i];
+		meta.cpu = i + 1;
+		expected[i & 3] += i + 1;
+
+		if (ebpf_filter(prog, packet, sizeof(packet), sizeof(packet), &meta) != 0xffff)
+		{
+			printf("FAIL: counting program returned a wrong value\n");
+			failures++;
+		}
+	}
+
+	// The hash map: 3 keys, stored by the program in the byte order of the host
+	n = ebpf_map_dump(prog, 0, info, sizeof(buffer));
+	if (n != sizeof(struct ebpf_map_info) + 3 * 10 || info->count != 3 || info->def.type != EBPF_MAP_HASH)
+	{
+		printf("FAIL: dump of the hash map: %u bytes, %u keys\n", n, info->count);
+		failures++;
+	}
+	for (i = 0; i < 3; i++)
+	{
+		u_char* record = buffer + sizeof(struct ebpf_map_info) + i * 10;
+		u_short key;
+		ULONGLONG count;
+
+		memcpy(&key, record, sizeof(key));
+		memcpy(&count, record + 2, sizeof(count));
+		if (count != (key == 0x0800 ? 3u : key == 0x86dd ? 2u : key == 0x0806 ? 1u : 0u))
+		{
+			printf("FAIL: EtherType 0x%04x counted %u times\n", key, (u_int)count);
+			failures++;
+		}
+	}
+
+	{
+		u_short key = 0x86dd;
+
+		if (!ebpf_map_lookup(prog, 0, &key, value) || *(ULONGLONG*)value != 2)
+		{
+			printf("FAIL: lookup in the hash map\n");
+			failures++;
+		}
+		key = 0x86;
+		if (ebpf_map_lookup(prog, 0, &key, value))
+		{
+			printf("FAIL: lookup of a missing key\n");
+			failures++;
+		}
+	}
+
+	// The array map: all its values
+	n = ebpf_map_dump(prog, 1, info, sizeof(buffer));
+	if (n != sizeof(struct ebpf_map_info) + 4 * 20 || info->count != 4)
+	{
+		printf("FAIL: dump of the array map: %u bytes, %u keys\n", n, info->count);
+		failures++;
+	}
+	for (i = 0; i < 4; i++)
+	{
+		u_char* record = buffer + sizeof(struct ebpf_map_info) + i * 20;
+		u_int32 key;
+		ULONGLONG sum;
+
+		memcpy(&key, record, sizeof(key));
+		memcpy(&sum, record + 4, sizeof(sum));
+		if (key != i || sum != expected[i])
+		{
+			printf("FAIL: array value %u is %u instead of %u\n", key, (u_int)sum, (u_int)expected[i]);
+			failures++;
+		}
+	}
+
+	// A short buffer gets the records that fit, and the count of all of them
+	n = ebpf_map_dump(prog, 1, info, sizeof(struct ebpf_map_info) + 30);
+	if (n != sizeof(struct ebpf_map_info) + 20 || info->count != 4 ||
+		ebpf_map_dump(prog, 1, info, sizeof(struct ebpf_map_info) - 1) != 0 ||
+		ebpf_map_dump(prog, 2, info, sizeof(buffer)) != 0 || ebpf_map_count(prog) != 2)
+	{
+		printf("FAIL: dump into a short buffer or of a missing map\n");
+		failures++;
+	}
+
+	ebpf_free(prog);
+	packet[0] = 0;
+	packet[12] = 0x08;
+	packet[13] = 0x00;
+	meta.cpu = 3;
+}
+
+static void test_helpers(void)
+{
+	struct ebpf_map_def map = { EBPF_MAP_HASH, 4, 8, 2 };
+	// Update, lookup, delete twice, then fill the map: returns the results packed in a byte each
+	struct ebpf_insn p[] =
+	{
+		ST_MEM(BPF_W, 10, -4, 7),
+		ST_MEM(EBPF_DW, 10, -16, 42),
+		MOV64_IMM(1, 0), MOV64_REG(2, 10), ALU64_IMM(BPF_ADD, 2, -4), MOV64_REG(3, 10), ALU64_IMM(BPF_ADD, 3, -16),
+		CALL(EBPF_FUNC_MAP_UPDATE),
+		MOV64_REG(6, 0),										// 0
+		MOV64_IMM(1, 0), MOV64_REG(2, 10), ALU64_IMM(BPF_ADD, 2, -4), MOV64_REG(3, 10), ALU64_IMM(BPF_ADD, 3, -24),
+		CALL(EBPF_FUNC_MAP_LOOKUP),
+		LDX_MEM(EBPF_DW, 7, 10, -24),							// 42
+		ALU64_IMM(BPF_LSH, 0, 8),								// 1
+		ALU64_REG(BPF_OR, 6, 0),
+		MOV64_IMM(1, 0), MOV64_REG(2, 10), ALU64_IMM(BPF_ADD, 2, -4),
+		CALL(EBPF_FUNC_MAP_DELETE),								// 0
+		MOV64_IMM(1, 0), MOV64_REG(2, 10), ALU64_IMM(BPF_ADD, 2, -4),
+		CALL(EBPF_FUNC_MAP_DELETE),								// -1
+		ALU64_IMM(BPF_AND, 0, 0xff),
+		ALU64_IMM(BPF_LSH, 0, 16),
+		ALU64_REG(BPF_OR, 6, 0),
+		// Three keys in a map of two
+		MOV64_IMM(8, 0),
+		STX_MEM(BPF_W, 10, 8, -4),
+		MOV64_IMM(1, 0), MOV64_REG(2, 10), ALU64_IMM(BPF_ADD, 2, -4), MOV64_IMM(3, 1),
+		CALL(EBPF_FUNC_MAP_ADD),
+		ALU64_IMM(BPF_ADD, 8, 1),
+		JMP_IMM(EBPF_JLT, 8, 3, -8),
+		ALU64_IMM(BPF_AND, 0, 0xff),							// -1
+		ALU64_IMM(BPF_LSH, 0, 24),
+		ALU64_REG(BPF_OR, 6, 0),
+		ALU64_REG(BPF_ADD, 6, 7),
+		MOV64_REG(0, 6),
+		EXIT(),
+	};
+
+	expect("helpers", &map, 1, p, COUNT(p), TRUE, 0xffff0100 + 42);
+}
+
+/*
+ * The loads from a packet split in buffers, and from the metadata, are those of the classic engines
+ */
+static void test_frags(void)
+{
+	struct ebpf_insn p[] =
+	{
+		LD_ABS(BPF_H, 12),
+		MOV64_REG(6, 0),
+		LD_ABS(BPF_B, 14),
+		ALU64_IMM(BPF_AND, 0, 0xf),
+		ALU64_IMM(BPF_LSH, 0, 2),
+		MOV64_REG(7, 0),
+		LD_IND(BPF_W, 7, 10),
+		ALU64_REG(EBPF_XOR, 0, 6),
+		MOV64_REG(6, 0),
+		LD_IND(BPF_H, 7, 14),
+		ALU64_IMM(BPF_LSH, 0, 7),
+		ALU64_REG(BPF_ADD, 0, 6),
+		MOV64_REG(6, 0),
+		LD_ABS(BPF_W, BPF_AD_OFF + BPF_AD_RSS_HASH),
+		ALU64_REG(BPF_ADD, 0, 6),
+		EXIT(),
+	};
+	struct ebpf_program* prog = load(NULL, 0, p, COUNT(p));
+	u_char data[RANDOM_PKTSIZE];
+	struct bench_packet pkt;
+	struct bpf_frag frags[3];
+	u_int32 state = 0x1234567;
+	u_int i, split, whole, parts;
+
+	if (prog == NULL)
+	{
+		printf("FAIL: program on fragments rejected\n");
+		failures++;
+		return;
+	}
+
+	pkt.data = data;
+	for (i = 0; i < 2000; i++)
+	{
+		bench_random_packet(&pkt, sizeof(data), &state);
+		if (i & 1)
+			data[14] = 0x45;
+
+		split = pkt.caplen != 0 ? bench_rand(&state) % pkt.caplen : 0;
+		frags[0].data = data;
+		frags[0].len = split / 2;
+		frags[1].data = data + split / 2;
+		frags[1].len = split - split / 2;
+		frags[2].data = data + split;
+		frags[2].len = pkt.caplen - split;
+
+		whole = ebpf_filter(prog, data, pkt.wirelen, pkt.caplen, (i & 2) ? &meta : NULL);
+		parts = ebpf_filter_frags(prog, frags, pkt.wirelen, pkt.caplen, (i & 2) ? &meta : NULL);
+		if (whole != parts)
+		{
+			printf("FAIL: packet %u of %u bytes split at %u: 0x%x in one buffer, 0x%x in three\n", i, pkt.caplen, split, whole, parts);
+			failures++;
+			break;
+		}
+	}
+
+	ebpf_free(prog);
+}
+
+/*
+ * A random instruction, mostly valid, on the registers R0 to R9 and on the stack
+ */
+static struct ebpf_insn random_insn(u_int32* state, u_int pc, u_int len)
+{
+	static const u_char alu[] = { BPF_ADD, BPF_SUB, BPF_MUL, BPF_DIV, BPF_OR, BPF_AND, BPF_LSH, BPF_RSH, BPF_NEG, EBPF_MOD, EBPF_XOR, EBPF_MOV, EBPF_ARSH };
+	static const u_char jmp[] = { BPF_JEQ, BPF_JGT, BPF_JGE, BPF_JSET, EBPF_JNE, EBPF_JSGT, EBPF_JSGE, EBPF_JLT, EBPF_JLE, EBPF_JSLT, EBPF_JSLE };
+	static const u_char sizes[] = { BPF_W, BPF_H, BPF_B, EBPF_DW };
+	struct ebpf_insn insn = EBPF_INSN(0, 0, 0, 0, 0);
+	u_int32 r = bench_rand(state);
+	u_int dst = r % 10, src = (r >> 4) % 11;
+	int imm = (int)(bench_rand(state) % 64) - 8;
+
+	switch ((r >> 8) % 10)
+	{
+	case 0:
+	case 1:
+	case 2:
+		insn.code = (u_char)(((r >> 12) & 1 ? EBPF_ALU64 : BPF_ALU) | alu[(r >> 13) % COUNT(alu)] | ((r >> 17) & 1 ? BPF_X : BPF_K));
+		insn.regs = (u_char)(dst | (BPF_SRC(insn.code) == BPF_X ? src << 4 : 0));
+		insn.imm = imm;
+		break;
+	case 3:
+	case 4:
+		// Mostly forward, sometimes backward
+		insn.code = (u_char)(BPF_JMP | jmp[(r >> 12) % COUNT(jmp)] | ((r >> 17) & 1 ? BPF_X : BPF_K));
+		insn.regs = (u_char)(dst | (BPF_SRC(insn.code) == BPF_X ? src << 4 : 0));
+		insn.imm = imm;
+		insn.off = (short)((r >> 18) % 4 == 0 ? -(int)((r >> 20) % (pc + 1)) - 1 : (int)((r >> 20) % (len - pc)));
+		break;
+	case 5:
+		insn.code = (u_char)(BPF_LD | ((r >> 12) & 1 ? BPF_IND : BPF_ABS) | sizes[(r >> 13) % 3]);
+		insn.regs = (u_char)(BPF_MODE(insn.code) == BPF_IND ? src << 4 : 0);
+		insn.imm = (r >> 16) % 16 == 0 ? (bpf_int32)(BPF_AD_OFF + 4 * ((r >> 20) % 6)) : imm + 8;
+		break;
+	case 6:
+		insn.code = (u_char)(BPF_LDX | BPF_MEM | sizes[(r >> 12) % 4]);
+		insn.regs = (u_char)(dst | ((r >> 14) % 4 == 0 ? src : 10) << 4);
+		insn.off = (short)(-(int)(bench_rand(state) % 520));
+		break;
+	case 7:
+		insn.code = (u_char)(((r >> 11) & 1 ? BPF_STX : BPF_ST) | BPF_MEM | sizes[(r >> 12) % 4]);
+		insn.regs = (u_char)(((r >> 14) % 4 == 0 ? dst : 10) | (BPF_CLASS(insn.code) == BPF_STX ? src << 4 : 0));
+		insn.off = (short)(-(int)(bench_rand(state) % 520));
+		insn.imm = imm;
+		break;
+	case 8:
+		insn.code = BPF_JMP | EBPF_CALL;
+		insn.imm = (r >> 12) % 5;
+		break;
+	default:
+		insn.code = BPF_JMP | EBPF_EXIT;
+		break;
+	}
+
+	return insn;
+}
+
+static void test_random(void)
+{
+	struct ebpf_map_def maps[] =
+	{
+		{ EBPF_MAP_HASH, 4, 8, 8 },
+		{ EBPF_MAP_ARRAY, 4, 8, 4 },
+	};
+	struct ebpf_insn insns[RANDOM_MAXLEN];
+	struct ebpf_program* prog;
+	u_char data[RANDOM_PKTSIZE];
+	struct bench_packet pkt;
+	u_int32 state = 0x2545f491;
+	u_int accepted = 0;
+	u_int i, j, len;
+
+	pkt.data = data;
+	for (i = 0; i < RANDOM_PROGRAMS; i++)
+	{
+		len = 8 + bench_rand(&state) % (RANDOM_MAXLEN - 8);
+
+		// Set R0 and the arguments of the calls, so that a part of the programs pass
+		{
+			struct ebpf_insn set[] =
+			{
+				MOV64_IMM(0, 0),
+				MOV64_IMM(1, bench_rand(&state) % 3),
+				MOV64_REG(2, 10),
+				ALU64_IMM(BPF_ADD, 2, -8),
+				MOV64_REG(3, 10),
+				ALU64_IMM(BPF_ADD, 3, -16),
+			};
+			memcpy(insns, set, sizeof(set));
+		}
+		for (j = 6; j < len; j++)
+			insns[j] = random_insn(&state, j, len);
+		{
+			struct ebpf_insn end = EXIT();
+			insns[len - 1] = end;
+		}
+		prog = load(maps, COUNT(maps), insns, len);
+		if (prog == NULL)
+			continue;
+
+		accepted++;
+		for (j = 0; j < RANDOM_PACKETS; j++)
+		{
+			bench_random_packet(&pkt, sizeof(data), &state);
+			ebpf_filter(prog, data, pkt.wirelen, pkt.caplen, (j & 1) ? &meta : NULL);
+		}
+		ebpf_free(prog);
+	}
+
+	// The verifier must not reject everything
+	if (accepted < RANDOM_PROGRAMS / 100)
+	{
+		printf("FAIL: only %u random programs accepted\n", accepted);
+		failures++;
+	}
+}
+
+int main()
+{
+	test_verifier();
+	test_loops();
+	test_maps();
+	test_helpers();
+	test_frags();
+	test_random();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
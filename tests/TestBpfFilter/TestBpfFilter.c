@@ -0,0 +1,160 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks the BPF validator and interpreter, built for the host, against the
+ * C implementations of the reference filters of BpfBench.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+
+static int failures = 0;
+
+#define CHECK(_cond, _what) do												\
+	{																		\
+		if (!(_cond))														\
+		{																	\
+			printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, (_what));		\
+			failures++;														\
+		}																	\
+	} while (0)
+
+static void test_reference_filters(u_int seed)
+{
+	struct bench_corpus corpus;
+	u_int f, i;
+
+	CHECK(bench_corpus_synthesize(&corpus, 20000, seed) == 0, "synthesize corpus");
+
+	for (f = 0; f < bench_filters_count; f++)
+	{
+		struct bench_filter* filter = &bench_filters[f];
+		u_int mismatches = 0;
+
+		CHECK(bpf_validate(filter->insns, filter->len), filter->name);
+
+		for (i = 0; i < corpus.count; i++)
+		{
+			struct bench_packet* pkt = &corpus.packets[i];
+
+			if (bpf_filter(filter->insns, pkt->data, pkt->wirelen, pkt->caplen) != filter->reference(pkt))
+				mismatches++;
+		}
+
+		if (mismatches != 0)
+			printf("  %s: %u mismatches out of %u packets (seed %u)\n", filter->name, mismatches, corpus.count, seed);
+		CHECK(mismatches == 0, filter->name);
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+static void test_validate(void)
+{
+	struct bpf_insn no_ret[] =
+	{
+		BPF_STMT(BPF_LD|BPF_IMM, 1),
+	};
+	struct bpf_insn jump_out[] =
+	{
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 2),
+		BPF_STMT(BPF_RET|BPF_K, 1),
+	};
+	struct bpf_insn ja_wrap[] =
+	{
+		BPF_STMT(BPF_JMP|BPF_JA, 0xffffffff),
+		BPF_STMT(BPF_RET|BPF_K, 1),
+	};
+	struct bpf_insn bad_mem[] =
+	{
+		BPF_STMT(BPF_ST, BPF_MEMWORDS),
+		BPF_STMT(BPF_RET|BPF_K, 1),
+	};
+	struct bpf_insn div_zero[] =
+	{
+		BPF_STMT(BPF_ALU|BPF_DIV|BPF_K, 0),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	struct bpf_insn bad_opcode[] =
+	{
+		BPF_STMT(0xffff, 0),
+		BPF_STMT(BPF_RET|BPF_K, 1),
+	};
+
+	CHECK(!bpf_validate(no_ret, 0), "empty program");
+	CHECK(!bpf_validate(no_ret, 1), "no final return");
+	CHECK(!bpf_validate(jump_out, 3), "jump past the end");
+	CHECK(!bpf_validate(ja_wrap, 2), "backward JA");
+	CHECK(!bpf_validate(bad_mem, 2), "scratch memory index");
+	CHECK(!bpf_validate(div_zero, 2), "constant division by zero");
+	CHECK(!bpf_validate(bad_opcode, 2), "unknown opcode");
+}
+
+static void test_interpreter(void)
+{
+	u_char pkt[64];
+	struct bpf_insn div_x[] =
+	{
+		BPF_STMT(BPF_LD|BPF_IMM, 100),
+		BPF_STMT(BPF_LDX|BPF_IMM, 0),
+		BPF_STMT(BPF_ALU|BPF_DIV|BPF_X, 0),
+		BPF_STMT(BPF_RET|BPF_K, 1),
+	};
+	struct bpf_insn neg[] =
+	{
+		BPF_STMT(BPF_LD|BPF_IMM, 5),
+		BPF_STMT(BPF_ALU|BPF_NEG, 0),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	struct bpf_insn scratch[] =
+	{
+		BPF_STMT(BPF_LD|BPF_IMM, 7),
+		BPF_STMT(BPF_ST, 15),
+		BPF_STMT(BPF_LD|BPF_IMM, 0),
+		BPF_STMT(BPF_LDX|BPF_MEM, 15),
+		BPF_STMT(BPF_LD|BPF_MEM, 3),
+		BPF_STMT(BPF_ALU|BPF_ADD|BPF_X, 0),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	struct bpf_insn edge[] =
+	{
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 60),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+
+	memset(pkt, 0, sizeof(pkt));
+	pkt[60] = 0xde;
+	pkt[63] = 0xef;
+
+	CHECK(bpf_filter(NULL, pkt, sizeof(pkt), sizeof(pkt)) == (u_int)-1, "no filter accepts all");
+	CHECK(bpf_filter(div_x, pkt, sizeof(pkt), sizeof(pkt)) == 0, "division by X == 0 rejects");
+	CHECK(bpf_filter(neg, pkt, sizeof(pkt), sizeof(pkt)) == (u_int)-5, "negation");
+	CHECK(bpf_filter(scratch, pkt, sizeof(pkt), sizeof(pkt)) == 7, "scratch memory is zeroed and kept");
+	CHECK(bpf_filter(edge, pkt, sizeof(pkt), sizeof(pkt)) == 0xde0000ef, "load ending at buflen");
+	CHECK(bpf_filter(edge, pkt, sizeof(pkt), sizeof(pkt) - 1) == 0, "load crossing buflen");
+}
+
+int main()
+{
+	test_validate();
+	test_interpreter();
+	test_reference_filters(1);
+	test_reference_filters(0x5eed);
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
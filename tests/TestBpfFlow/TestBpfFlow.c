@@ -0,0 +1,210 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks that the flow verdict cache gives the result of bpf_filter(): the verdicts found
+ * in the cache for the reference filters on a corpus, and the verdicts of random programs
+ * on packets that differ only where the key says the program does not look.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+#include "bench_random.h"
+
+#define RANDOM_PROGRAMS		20000
+#define RANDOM_PACKETS		64
+
+static int failures = 0;
+
+static int same_key(struct bpf_flow_key* a, struct bpf_flow_key* b)
+{
+	return a->hash == b->hash && a->inbounds == b->inbounds && a->wirelen == b->wirelen &&
+		memcmp(a->bytes, b->bytes, sizeof(a->bytes)) == 0;
+}
+
+static void test_reference_filters(void)
+{
+	struct bench_corpus corpus;
+	struct bpf_flow_program* prog;
+	struct bpf_flow_cache* cache;
+	struct bpf_flow_key key;
+	u_int f, i, expected, got, hits;
+
+	if (bench_corpus_synthesize(&corpus, 20000, 9) != 0)
+	{
+		printf("FAIL: cannot synthesize the corpus\n");
+		failures++;
+		return;
+	}
+
+	for (f = 0; f < bench_filters_count; f++)
+	{
+		struct bench_filter* filter = &bench_filters[f];
+
+		// All the reference filters load from constant offsets or after the IP header
+		prog = bpf_flow_compile(filter->insns, (int)filter->len, 2);
+		if (prog == NULL)
+		{
+			printf("FAIL: filter %s cannot be cached\n", filter->name);
+			failures++;
+			continue;
+		}
+
+		hits = 0;
+		for (i = 0; i < corpus.count; i++)
+		{
+			struct bench_packet* pkt = &corpus.packets[i];
+
+			expected = bpf_filter(filter->insns, pkt->data, pkt->wirelen, pkt->caplen);
+			cache = bpf_flow_get_cache(prog, i);
+			bpf_flow_key(prog, pkt->data, pkt->wirelen, pkt->caplen, &key);
+
+			if (!bpf_flow_lookup(prog, cache, &key, &got))
+			{
+				bpf_flow_insert(prog, cache, &key, expected);
+				continue;
+			}
+
+			hits++;
+			if (got != expected)
+			{
+				printf("FAIL: filter %s, packet %u: expected 0x%x, cached 0x%x\n", filter->name, i, expected, got);
+				failures++;
+				break;
+			}
+		}
+
+		if (hits == 0)
+		{
+			printf("FAIL: filter %s never hits the cache\n", filter->name);
+			failures++;
+		}
+
+		bpf_free_flow(prog);
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+/*
+ * Changes some bytes and the lengths of a packet, the key may stay the same
+ */
+static void mutate(struct bench_packet* from, struct bench_packet* to, u_int32* state)
+{
+	u_int n, i;
+
+	memcpy(to->data, from->data, BENCH_RANDOM_PKTSIZE);
+	to->caplen = from->caplen;
+	to->wirelen = from->wirelen;
+
+	n = 1 + bench_rand(state) % 4;
+	for (i = 0; i < n; i++)
+		to->data[bench_rand(state) % BENCH_RANDOM_PKTSIZE] = (u_char)bench_rand(state);
+
+	switch (bench_rand(state) % 4)
+	{
+	case 0:
+		to->caplen = bench_rand(state) % (BENCH_RANDOM_PKTSIZE + 1);
+		if (to->wirelen < to->caplen)
+			to->wirelen = to->caplen;
+		break;
+	case 1:
+		to->wirelen = to->caplen + bench_rand(state) % 64;
+		break;
+	}
+}
+
+/*
+ * The flow program of a random program, and the packets with the same key seen so far
+ */
+struct random_flow
+{
+	struct bpf_flow_program* prog;
+	u_char data[BENCH_RANDOM_PKTSIZE];
+	u_int compiled;
+	u_int equal;
+};
+
+static int random_prepare(void* context, struct bpf_insn* insns, u_int len)
+{
+	struct random_flow* f = (struct random_flow*)context;
+
+	f->prog = bpf_flow_compile(insns, (int)len, 1);
+	if (f->prog == NULL)
+		return BENCH_RANDOM_SKIP;
+	f->compiled++;
+
+	return BENCH_RANDOM_RUN;
+}
+
+static int random_check(void* context, struct bpf_insn* insns, u_int len, struct bench_packet* pkt, u_int32* state)
+{
+	struct random_flow* f = (struct random_flow*)context;
+	struct bench_packet other;
+	struct bpf_flow_key key, other_key;
+
+	(void)len;
+
+	other.data = f->data;
+	mutate(pkt, &other, state);
+
+	// only the bytes of the loads are set, the key is compared whole
+	memset(&key, 0, sizeof(key));
+	memset(&other_key, 0, sizeof(other_key));
+	bpf_flow_key(f->prog, pkt->data, pkt->wirelen, pkt->caplen, &key);
+	bpf_flow_key(f->prog, other.data, other.wirelen, other.caplen, &other_key);
+	if (!same_key(&key, &other_key))
+		return TRUE;
+	f->equal++;
+
+	if (bpf_filter(insns, pkt->data, pkt->wirelen, pkt->caplen) != bpf_filter(insns, other.data, other.wirelen, other.caplen))
+	{
+		printf("FAIL: same key, different verdicts\n");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void random_release(void* context)
+{
+	bpf_free_flow(((struct random_flow*)context)->prog);
+}
+
+static void test_random_programs(void)
+{
+	struct random_flow f;
+	struct bench_random_test test = { RANDOM_PROGRAMS, RANDOM_PACKETS, 0, 0x7f4a, &f,
+		NULL, random_prepare, random_check, NULL, random_release };
+
+	f.compiled = 0;
+	f.equal = 0;
+	bench_random_programs(&test, &failures);
+
+	if (f.compiled == 0 || f.equal == 0)
+	{
+		printf("FAIL: %u random programs cached, %u packets with the same key\n", f.compiled, f.equal);
+		failures++;
+	}
+}
+
+int main()
+{
+	test_reference_filters();
+	test_random_programs();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,215 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks that the filtering of the packets split in several buffers, by bpf_filter_frags()
+ * and by the function of the jitter, gives the same results as bpf_filter() on the same
+ * packets in one buffer, on the reference filters and on random programs.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+#include "bench_random.h"
+
+#ifdef HAVE_BPF_JIT_SUPPORT
+#include "jitter.h"
+#endif
+
+#define MAX_FRAGS			8
+#define RANDOM_PROGRAMS		20000
+#define RANDOM_PACKETS		64
+
+static int failures = 0;
+
+/*
+ * Splits the caplen bytes of the packet at random points, sometimes with empty fragments
+ * in the middle. Returns the number of fragments.
+ */
+static u_int split_packet(struct bench_packet* pkt, struct bpf_frag* frags, u_int32* state)
+{
+	u_int n = 1 + bench_rand(state) % MAX_FRAGS;
+	u_int i, offset = 0, len;
+
+	for (i = 0; i < n; i++)
+	{
+		if (i == n - 1)
+			len = pkt->caplen - offset;
+		else if (pkt->caplen > offset)
+			len = bench_rand(state) % (pkt->caplen - offset + 1);
+		else
+			len = 0;
+
+		frags[i].data = pkt->data + offset;
+		frags[i].len = len;
+		offset += len;
+	}
+
+	return n;
+}
+
+static void test_frag_load(void)
+{
+	u_char data[] = { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 };
+	struct bpf_frag frags[] =
+	{
+		{ data, 1 },
+		{ data + 1, 0 },
+		{ data + 1, 2 },
+		{ data + 3, 3 },
+	};
+
+	if (bpf_frag_load(frags, 0, 4) != 0x11223344 || bpf_frag_load(frags, 2, 2) != 0x3344 ||
+		bpf_frag_load(frags, 5, 1) != 0x66 || bpf_frag_load(frags, 1, 4) != 0x22334455)
+	{
+		printf("FAIL: bpf_frag_load\n");
+		failures++;
+	}
+}
+
+/*
+ * Runs the program on the packet in one buffer and split, returns FALSE on a mismatch.
+ */
+static int compare(struct bpf_insn* insns, void* Filter, struct bench_packet* pkt, u_int32* state)
+{
+	struct bpf_frag frags[MAX_FRAGS];
+	u_int expected, got;
+
+	split_packet(pkt, frags, state);
+	expected = bpf_filter(insns, pkt->data, pkt->wirelen, pkt->caplen);
+
+	got = bpf_filter_frags(insns, frags, pkt->wirelen, pkt->caplen, NULL);
+	if (got != expected)
+	{
+		printf("FAIL: wirelen %u, caplen %u: bpf_filter 0x%x, bpf_filter_frags 0x%x\n", pkt->wirelen, pkt->caplen, expected, got);
+		return FALSE;
+	}
+
+#ifdef HAVE_BPF_JIT_SUPPORT
+	got = ((JIT_BPF_Filter*)Filter)->FragsFunction(frags, pkt->wirelen, pkt->caplen, NULL);
+	if (got != expected)
+	{
+		printf("FAIL: wirelen %u, caplen %u: bpf_filter 0x%x, jit 0x%x\n", pkt->wirelen, pkt->caplen, expected, got);
+		return FALSE;
+	}
+#else
+	(void)Filter;
+#endif
+
+	return TRUE;
+}
+
+static void* compile(struct bpf_insn* insns, u_int len)
+{
+#ifdef HAVE_BPF_JIT_SUPPORT
+	return BPF_jitter(insns, len);
+#else
+	(void)insns;
+	(void)len;
+	return insns;
+#endif
+}
+
+static void destroy(void* Filter)
+{
+#ifdef HAVE_BPF_JIT_SUPPORT
+	BPF_Destroy_JIT_Filter((JIT_BPF_Filter*)Filter);
+#else
+	(void)Filter;
+#endif
+}
+
+static void test_reference_filters(void)
+{
+	struct bench_corpus corpus;
+	u_int32 state = 0xf4a6;
+	u_int f, i;
+
+	if (bench_corpus_synthesize(&corpus, 20000, 11) != 0)
+	{
+		printf("FAIL: cannot synthesize the corpus\n");
+		failures++;
+		return;
+	}
+
+	for (f = 0; f < bench_filters_count; f++)
+	{
+		struct bench_filter* filter = &bench_filters[f];
+		void* Filter = compile(filter->insns, filter->len);
+
+		if (Filter == NULL)
+		{
+			printf("FAIL: cannot jit %s\n", filter->name);
+			failures++;
+			continue;
+		}
+
+		for (i = 0; i < corpus.count; i++)
+		{
+			if (!compare(filter->insns, Filter, &corpus.packets[i], &state))
+			{
+				printf("  filter %s, packet %u\n", filter->name, i);
+				failures++;
+				break;
+			}
+		}
+
+		destroy(Filter);
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+static int random_prepare(void* context, struct bpf_insn* insns, u_int len)
+{
+	*(void**)context = compile(insns, len);
+	if (*(void**)context == NULL)
+	{
+		printf("FAIL: cannot jit\n");
+		return BENCH_RANDOM_FAIL;
+	}
+
+	return BENCH_RANDOM_RUN;
+}
+
+static int random_check(void* context, struct bpf_insn* insns, u_int len, struct bench_packet* pkt, u_int32* state)
+{
+	(void)len;
+
+	return compare(insns, *(void**)context, pkt, state);
+}
+
+static void random_release(void* context)
+{
+	destroy(*(void**)context);
+}
+
+static void test_random_programs(void)
+{
+	void* Filter;
+	struct bench_random_test test = { RANDOM_PROGRAMS, RANDOM_PACKETS, 0, 0x9e3779b9, &Filter,
+		NULL, random_prepare, random_check, NULL, random_release };
+
+	bench_random_programs(&test, &failures);
+}
+
+int main()
+{
+	test_frag_load();
+	test_reference_filters();
+	test_random_programs();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
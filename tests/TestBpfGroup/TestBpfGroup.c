@@ -0,0 +1,236 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks that the group classifier gives, for each of the programs it covers, the result
+ * of bpf_filter(): on all the reference filters together, on random sets of them (with
+ * duplicates), and on random programs, of which only those that can be merged are checked.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+#include "bench_random.h"
+
+#define RANDOM_SETS			200
+#define RANDOM_GROUPS		2000
+#define RANDOM_GROUP_SIZE	8
+#define RANDOM_PACKETS		64
+
+static int failures = 0;
+
+/*
+ * Runs the classifier on a packet, returns the index of the first program with a wrong
+ * verdict, or count if there is none
+ */
+static u_int compare(struct bpf_group_program* g, struct bpf_insn** progs, u_int count,
+	u_char* data, u_int wirelen, u_int buflen)
+{
+	ULONGLONG covered = bpf_group_covered(g);
+	ULONGLONG matches = bpf_group_filter(g, data, wirelen, buflen);
+	u_int i, expected, got;
+
+	if (matches & ~covered)
+	{
+		printf("FAIL: programs not covered in the matches: 0x%llx of 0x%llx\n", (unsigned long long)matches, (unsigned long long)covered);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (!(covered & ((ULONGLONG)1 << i)))
+			continue;
+
+		expected = bpf_filter(progs[i], data, wirelen, buflen);
+		got = (matches & ((ULONGLONG)1 << i)) ? bpf_group_accept(g, i) : 0;
+		if (got != expected)
+		{
+			printf("FAIL: program %u of %u, wirelen %u, buflen %u: expected 0x%x, got 0x%x\n", i, count, wirelen, buflen, expected, got);
+			return i;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Classifies the corpus with the filters of the given indexes
+ */
+static void check_set(struct bench_corpus* corpus, u_int* set, u_int count, int all_covered)
+{
+	struct bpf_insn* progs[BPF_GROUP_MAX];
+	u_int lens[BPF_GROUP_MAX];
+	struct bpf_group_program* g;
+	u_int i, bad;
+
+	for (i = 0; i < count; i++)
+	{
+		progs[i] = bench_filters[set[i]].insns;
+		lens[i] = bench_filters[set[i]].len;
+	}
+
+	g = bpf_group_compile(progs, lens, count);
+	if (g == NULL)
+	{
+		printf("FAIL: cannot merge %u reference filters\n", count);
+		failures++;
+		return;
+	}
+
+	if (all_covered && bpf_group_covered(g) != (((ULONGLONG)1 << count) - 1))
+	{
+		printf("FAIL: reference filters left out: covered 0x%llx\n", (unsigned long long)bpf_group_covered(g));
+		failures++;
+	}
+
+	for (i = 0; i < corpus->count; i++)
+	{
+		struct bench_packet* pkt = &corpus->packets[i];
+
+		bad = compare(g, progs, count, pkt->data, pkt->wirelen, pkt->caplen);
+		if (bad != count)
+		{
+			printf("  filter %s, packet %u\n", bench_filters[set[bad]].name, i);
+			failures++;
+			break;
+		}
+	}
+
+	bpf_free_group(g);
+}
+
+static void test_reference_filters(void)
+{
+	struct bench_corpus corpus;
+	u_int set[BPF_GROUP_MAX];
+	u_int32 state = 0x6a09;
+	u_int n, i, count;
+
+	if (bench_corpus_synthesize(&corpus, 5000, 5) != 0)
+	{
+		printf("FAIL: cannot synthesize the corpus\n");
+		failures++;
+		return;
+	}
+
+	for (i = 0; i < bench_filters_count; i++)
+		set[i] = i;
+	check_set(&corpus, set, bench_filters_count, TRUE);
+
+	for (n = 0; n < RANDOM_SETS && failures < 10; n++)
+	{
+		count = 2 + bench_rand(&state) % (BPF_GROUP_MAX - 1);
+		for (i = 0; i < count; i++)
+			set[i] = bench_rand(&state) % bench_filters_count;
+
+		// Large sets may not fit, and drop their last programs
+		check_set(&corpus, set, count, count <= 2 * bench_filters_count);
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+/*
+ * A group of random programs, the first of which is the one of bench_random_programs()
+ */
+struct random_group
+{
+	struct bpf_insn insns[RANDOM_GROUP_SIZE][BENCH_RANDOM_MAXLEN];
+	struct bpf_insn* progs[RANDOM_GROUP_SIZE];
+	u_int lens[RANDOM_GROUP_SIZE];
+	struct bpf_group_program* g;
+	u_int merged;
+};
+
+static u_int random_generate(void* context, struct bpf_insn* insns, u_int maxlen, u_int32* state)
+{
+	struct random_group* r = (struct random_group*)context;
+	u_int i;
+
+	for (i = 0; i < RANDOM_GROUP_SIZE; i++)
+	{
+		do
+		{
+			r->lens[i] = bench_random_program(i == 0 ? insns : r->insns[i], maxlen, state);
+		} while (!bpf_validate(i == 0 ? insns : r->insns[i], r->lens[i]));
+		r->progs[i] = i == 0 ? insns : r->insns[i];
+	}
+
+	return r->lens[0];
+}
+
+static int random_prepare(void* context, struct bpf_insn* insns, u_int len)
+{
+	struct random_group* r = (struct random_group*)context;
+
+	(void)insns;
+	(void)len;
+
+	r->g = bpf_group_compile(r->progs, r->lens, RANDOM_GROUP_SIZE);
+	if (r->g == NULL)
+		return BENCH_RANDOM_SKIP;
+	r->merged++;
+
+	return BENCH_RANDOM_RUN;
+}
+
+static int random_check(void* context, struct bpf_insn* insns, u_int len, struct bench_packet* pkt, u_int32* state)
+{
+	struct random_group* r = (struct random_group*)context;
+	u_int bad;
+
+	(void)insns;
+	(void)len;
+	(void)state;
+
+	bad = compare(r->g, r->progs, RANDOM_GROUP_SIZE, pkt->data, pkt->wirelen, pkt->caplen);
+	if (bad != RANDOM_GROUP_SIZE)
+	{
+		bench_dump_program("the wrong program", r->progs[bad], r->lens[bad]);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void random_release(void* context)
+{
+	bpf_free_group(((struct random_group*)context)->g);
+}
+
+static void test_random_programs(void)
+{
+	static struct random_group r;
+	struct bench_random_test test = { RANDOM_GROUPS, RANDOM_PACKETS, 0, 0x3c6e, &r,
+		random_generate, random_prepare, random_check, NULL, random_release };
+
+	r.merged = 0;
+	bench_random_programs(&test, &failures);
+
+	// Some random programs cannot be merged, but most groups have at least two that can
+	if (r.merged == 0)
+	{
+		printf("FAIL: no group of random programs could be merged\n");
+		failures++;
+	}
+}
+
+int main()
+{
+	test_reference_filters();
+	test_random_programs();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
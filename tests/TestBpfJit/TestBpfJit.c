@@ -0,0 +1,148 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks the native code generated by the jitter against the interpreter,
+ * on the reference filters and on random programs.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+#include "bench_random.h"
+
+#ifdef HAVE_BPF_JIT_SUPPORT
+
+#include "jitter.h"
+
+#define RANDOM_PROGRAMS		20000
+#define RANDOM_PACKETS		64
+
+static int failures = 0;
+
+static u_int jit_run(JIT_BPF_Filter* Filter, struct bench_packet* pkt)
+{
+	return Filter->Function((PVOID*)pkt->data, pkt->wirelen, pkt->caplen, NULL);
+}
+
+static void test_reference_filters(void)
+{
+	struct bench_corpus corpus;
+	u_int f, i;
+
+	if (bench_corpus_synthesize(&corpus, 20000, 7) != 0)
+	{
+		printf("FAIL: cannot synthesize the corpus\n");
+		failures++;
+		return;
+	}
+
+	for (f = 0; f < bench_filters_count; f++)
+	{
+		struct bench_filter* filter = &bench_filters[f];
+		JIT_BPF_Filter* Filter = BPF_jitter(filter->insns, filter->len);
+		u_int mismatches = 0;
+
+		if (Filter == NULL)
+		{
+			printf("FAIL: cannot jit %s\n", filter->name);
+			failures++;
+			continue;
+		}
+
+		for (i = 0; i < corpus.count; i++)
+		{
+			struct bench_packet* pkt = &corpus.packets[i];
+
+			if (jit_run(Filter, pkt) != bpf_filter(filter->insns, pkt->data, pkt->wirelen, pkt->caplen))
+				mismatches++;
+		}
+
+		if (mismatches != 0)
+		{
+			printf("FAIL: %s: %u mismatches out of %u packets\n", filter->name, mismatches, corpus.count);
+			failures++;
+		}
+
+		BPF_Destroy_JIT_Filter(Filter);
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+static int random_prepare(void* context, struct bpf_insn* insns, u_int len)
+{
+	JIT_BPF_Filter** Filter = (JIT_BPF_Filter**)context;
+
+	*Filter = BPF_jitter(insns, len);
+	if (*Filter == NULL)
+	{
+		printf("FAIL: cannot jit\n");
+		return BENCH_RANDOM_FAIL;
+	}
+
+	return BENCH_RANDOM_RUN;
+}
+
+static int random_check(void* context, struct bpf_insn* insns, u_int len, struct bench_packet* pkt, u_int32* state)
+{
+	JIT_BPF_Filter** Filter = (JIT_BPF_Filter**)context;
+	u_int expected, got;
+
+	(void)len;
+	(void)state;
+
+	expected = bpf_filter(insns, pkt->data, pkt->wirelen, pkt->caplen);
+	got = jit_run(*Filter, pkt);
+	if (expected != got)
+	{
+		printf("FAIL: wirelen %u, caplen %u: interpreter 0x%x, jit 0x%x\n", pkt->wirelen, pkt->caplen, expected, got);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void random_release(void* context)
+{
+	BPF_Destroy_JIT_Filter(*(JIT_BPF_Filter**)context);
+}
+
+static void test_random_programs(void)
+{
+	JIT_BPF_Filter* Filter;
+	struct bench_random_test test = { RANDOM_PROGRAMS, RANDOM_PACKETS, 0, 0x1234567, &Filter,
+		NULL, random_prepare, random_check, NULL, random_release };
+
+	bench_random_programs(&test, &failures);
+}
+
+int main()
+{
+	test_reference_filters();
+	test_random_programs();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
+
+#else // HAVE_BPF_JIT_SUPPORT
+
+int main()
+{
+	printf("No JIT compiler for this architecture, nothing to check\n");
+	return 0;
+}
+
+#endif // HAVE_BPF_JIT_SUPPORT
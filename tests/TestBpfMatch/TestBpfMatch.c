@@ -0,0 +1,633 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks the multi-pattern search of BPF_MISC|BPF_MATCH: that bpf_match_scan() finds the same
+ * pattern as a naive search, with and without BPF_MATCH_NOCASE, that bpf_match_compile() rejects
+ * the invalid sets, and that every engine (the interpreters, including the fragmented one, and the
+ * functions of the jitter) gives the same result as bpf_filter() on programs that search the payload.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+#include "bench_random.h"
+
+#ifdef HAVE_BPF_JIT_SUPPORT
+#include "jitter.h"
+#endif
+
+#define MAX_PATTERNS		64
+#define MAX_IMAGE			(sizeof(struct bpf_match_header) + MAX_PATTERNS * (4 + BPF_MATCH_MAX_LENGTH))
+#define RANDOM_SETS			500
+#define RANDOM_PROGRAMS		5000
+#define RANDOM_PACKETS		16
+#define RANDOM_PKTSIZE		64
+#define PKTSIZE				256
+#define MAX_FRAGS			6
+
+static int failures = 0;
+
+static u_char image[MAX_IMAGE];
+
+/*
+ * Builds the image of a set in image[], returns its size.
+ */
+static u_int build_set(u_char** patterns, u_int* lens, u_int count, u_int flags)
+{
+	struct bpf_match_header header;
+	u_int i, off;
+	u_int32 len;
+
+	header.count = count;
+	header.flags = flags;
+	memcpy(image, &header, sizeof(header));
+	off = sizeof(header);
+
+	for (i = 0; i < count; i++)
+	{
+		len = lens[i];
+		memcpy(image + off, &len, sizeof(len));
+		off += sizeof(len);
+		memset(image + off, 0, (len + 3) & ~3);
+		memcpy(image + off, patterns[i], len);
+		off += (len + 3) & ~3;
+	}
+
+	return off;
+}
+
+static u_char fold(u_char c)
+{
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/*
+ * The reference: the lowest index of the patterns that end at the first byte where one ends.
+ */
+static u_int naive_scan(u_char** patterns, u_int* lens, u_int count, u_int nocase, u_char* p, u_int len)
+{
+	u_int end, i, j;
+
+	for (end = 1; end <= len; end++)
+	{
+		for (i = 0; i < count; i++)
+		{
+			if (lens[i] > end)
+				continue;
+
+			for (j = 0; j < lens[i]; j++)
+			{
+				u_char a = p[end - lens[i] + j];
+				u_char b = patterns[i][j];
+
+				if (nocase ? fold(a) != fold(b) : a != b)
+					break;
+			}
+
+			if (j == lens[i])
+				return i + 1;
+		}
+	}
+
+	return 0;
+}
+
+static void test_classic(void)
+{
+	static u_char* patterns[] = { (u_char*)"he", (u_char*)"she", (u_char*)"his", (u_char*)"hers" };
+	static u_int lens[] = { 2, 3, 3, 4 };
+	static const struct
+	{
+		const char* text;
+		u_int flags;
+		u_int expected;
+	}
+	cases[] =
+	{
+		{ "ushers", 0, 1 },		// "she" and "he" end at the same byte, "he" comes first in the set
+		{ "ahishers", 0, 3 },
+		{ "xxxxxx", 0, 0 },
+		{ "hxexhe", 0, 1 },
+		{ "USHERS", 0, 0 },
+		{ "USHERS", BPF_MATCH_NOCASE, 1 },
+		{ "HiS", BPF_MATCH_NOCASE, 3 },
+	};
+	struct bpf_match_set* set;
+	u_int i, size, got;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		size = build_set(patterns, lens, 4, cases[i].flags);
+		set = bpf_match_compile(image, size);
+		if (set == NULL)
+		{
+			printf("FAIL: cannot compile the classic set\n");
+			failures++;
+			return;
+		}
+
+		got = bpf_match_scan(set, (u_char*)cases[i].text, (u_int)strlen(cases[i].text));
+		if (got != cases[i].expected ||
+			got != naive_scan(patterns, lens, 4, cases[i].flags, (u_char*)cases[i].text, (u_int)strlen(cases[i].text)))
+		{
+			printf("FAIL: \"%s\": got %u instead of %u\n", cases[i].text, got, cases[i].expected);
+			failures++;
+		}
+
+		bpf_match_free(set);
+	}
+}
+
+/*
+ * Random sets over a small alphabet, so that the patterns overlap and share prefixes and
+ * suffixes, searched in random texts that often contain them.
+ */
+static void test_random_sets(void)
+{
+	static u_char storage[MAX_PATTERNS][32];
+	u_char* patterns[MAX_PATTERNS];
+	u_int lens[MAX_PATTERNS];
+	u_char text[PKTSIZE];
+	struct bpf_match_set* set;
+	u_int32 state = 0x2545f491;
+	u_int s, t, i, j, count, flags, len, alphabet, got, expected;
+
+	for (s = 0; s < RANDOM_SETS; s++)
+	{
+		count = 1 + bench_rand(&state) % MAX_PATTERNS;
+		alphabet = 2 + bench_rand(&state) % 6;
+		flags = (bench_rand(&state) & 1) ? BPF_MATCH_NOCASE : 0;
+
+		for (i = 0; i < count; i++)
+		{
+			lens[i] = 1 + bench_rand(&state) % (s % 4 == 0 ? 3 : 12);
+			for (j = 0; j < lens[i]; j++)
+			{
+				u_int r = bench_rand(&state);
+
+				storage[i][j] = (u_char)((r & 0x100 ? 'A' : 'a') + r % alphabet);
+			}
+			patterns[i] = storage[i];
+		}
+
+		set = bpf_match_compile(image, build_set(patterns, lens, count, flags));
+		if (set == NULL)
+		{
+			printf("FAIL: cannot compile random set %u\n", s);
+			failures++;
+			continue;
+		}
+
+		for (t = 0; t < 20; t++)
+		{
+			len = bench_rand(&state) % PKTSIZE;
+			for (j = 0; j < len; j++)
+			{
+				u_int r = bench_rand(&state);
+
+				// Mostly the alphabet of the patterns, with other bytes in between
+				text[j] = (u_char)(r % 8 == 0 ? r >> 8 : (r & 0x100 ? 'A' : 'a') + (r >> 9) % (alphabet + 1));
+			}
+
+			got = bpf_match_scan(set, text, len);
+			expected = naive_scan(patterns, lens, count, flags, text, len);
+			if (got != expected)
+			{
+				printf("FAIL: random set %u, text %u: got %u instead of %u\n", s, t, got, expected);
+				failures++;
+				break;
+			}
+		}
+
+		bpf_match_free(set);
+	}
+}
+
+static void test_compile(void)
+{
+	static u_char big[BPF_MATCH_MAX_LENGTH + 1];
+	u_char* patterns[2] = { (u_char*)"abc", big };
+	u_int lens[2] = { 3, 0 };
+	struct bpf_match_header header;
+	struct bpf_match_set* set;
+	u_char* many;
+	u_int i, j, size, off;
+	u_int32 len;
+
+	memset(big, 'x', sizeof(big));
+
+	// An empty pattern, one too long, and one that does not fit in the image
+	size = build_set(patterns, lens, 2, 0);
+	if ((set = bpf_match_compile(image, size)) != NULL)
+	{
+		printf("FAIL: bpf_match_compile accepted an empty pattern\n");
+		bpf_match_free(set);
+		failures++;
+	}
+
+	lens[1] = BPF_MATCH_MAX_LENGTH + 1;
+	size = build_set(patterns, lens, 2, 0);
+	if ((set = bpf_match_compile(image, size)) != NULL)
+	{
+		printf("FAIL: bpf_match_compile accepted a pattern of %u bytes\n", lens[1]);
+		bpf_match_free(set);
+		failures++;
+	}
+
+	lens[1] = BPF_MATCH_MAX_LENGTH;
+	size = build_set(patterns, lens, 2, 0);
+	for (i = 0; i < size; i++)
+	{
+		if ((set = bpf_match_compile(image, i)) != NULL)
+		{
+			printf("FAIL: bpf_match_compile accepted an image truncated to %u bytes\n", i);
+			bpf_match_free(set);
+			failures++;
+			break;
+		}
+	}
+	if ((set = bpf_match_compile(image, size)) == NULL)
+	{
+		printf("FAIL: bpf_match_compile rejected a pattern of %u bytes\n", lens[1]);
+		failures++;
+	}
+	else
+	{
+		bpf_match_free(set);
+	}
+
+	// No pattern, unknown flags
+	size = build_set(patterns, lens, 0, 0);
+	if ((set = bpf_match_compile(image, size)) != NULL)
+	{
+		printf("FAIL: bpf_match_compile accepted an empty set\n");
+		bpf_match_free(set);
+		failures++;
+	}
+
+	size = build_set(patterns, lens, 1, 2);
+	if ((set = bpf_match_compile(image, size)) != NULL)
+	{
+		printf("FAIL: bpf_match_compile accepted unknown flags\n");
+		bpf_match_free(set);
+		failures++;
+	}
+
+	// The largest set of distinct patterns, made of every byte, is too large an automaton
+	size = sizeof(header) + BPF_MATCH_MAX_PATTERNS * (4 + BPF_MATCH_MAX_LENGTH);
+	many = (u_char*)malloc(size);
+	if (many == NULL)
+		return;
+
+	header.count = BPF_MATCH_MAX_PATTERNS;
+	header.flags = 0;
+	memcpy(many, &header, sizeof(header));
+	off = sizeof(header);
+	len = BPF_MATCH_MAX_LENGTH;
+	for (i = 0; i < BPF_MATCH_MAX_PATTERNS; i++)
+	{
+		memcpy(many + off, &len, sizeof(len));
+		off += sizeof(len);
+		for (j = 0; j < len; j++)
+			many[off + j] = (u_char)(i + j * 7);
+		off += len;
+	}
+
+	if ((set = bpf_match_compile(many, size)) != NULL)
+	{
+		printf("FAIL: bpf_match_compile accepted an automaton larger than BPF_MATCH_MAX_MEMORY\n");
+		bpf_match_free(set);
+		failures++;
+	}
+
+	free(many);
+}
+
+/*
+ * Runs the program on the packet with every engine, returns FALSE if one of them does not agree
+ * with bpf_filter().
+ */
+static int check(const char* name, struct bpf_insn* insns, u_int len, u_char* packet, u_int wirelen, u_int buflen, u_int32* state)
+{
+	struct bpf_profile_counter counters[BENCH_RANDOM_MAXLEN + 16];
+	struct bpf_decoded_program* decoded;
+	struct bpf_frag frags[MAX_FRAGS];
+	struct bpf_packet pkt;
+	u_int got[9];
+	u_int expected, i, n = 0, nfrags, off;
+
+	expected = bpf_filter(insns, packet, wirelen, buflen);
+
+	pkt.data = packet;
+	pkt.wirelen = wirelen;
+	pkt.buflen = buflen;
+	pkt.meta = NULL;
+
+	// Random fragments, some of them empty
+	nfrags = 1 + bench_rand(state) % MAX_FRAGS;
+	for (i = 0, off = 0; i < nfrags; i++)
+	{
+		frags[i].data = packet + off;
+		frags[i].len = i == nfrags - 1 ? buflen - off : bench_rand(state) % (buflen - off + 1);
+		off += frags[i].len;
+	}
+
+	got[n++] = bpf_filter_frags(insns, frags, wirelen, buflen, NULL);
+	bpf_filter_batch(insns, &pkt, 1, &got[n++]);
+	memset(counters, 0, sizeof(counters));
+	got[n++] = bpf_filter_profile(insns, packet, wirelen, buflen, NULL, counters);
+
+	decoded = bpf_decode(insns, (int)len);
+	if (decoded == NULL)
+	{
+		printf("FAIL: %s: cannot decode\n", name);
+		return FALSE;
+	}
+	got[n++] = bpf_filter_decoded(decoded, packet, wirelen, buflen, NULL);
+	bpf_free_decoded(decoded);
+
+#ifdef HAVE_BPF_JIT_SUPPORT
+	{
+		JIT_BPF_Filter* Filter = BPF_jitter(insns, len);
+
+		if (Filter == NULL)
+		{
+			printf("FAIL: %s: cannot jit\n", name);
+			return FALSE;
+		}
+		got[n++] = Filter->Function((PVOID*)packet, wirelen, buflen, NULL);
+		got[n++] = Filter->FragsFunction(frags, wirelen, buflen, NULL);
+		Filter->BatchFunction(&pkt, 1, &got[n++]);
+		BPF_Destroy_JIT_Filter(Filter);
+	}
+#endif
+
+	for (i = 0; i < n; i++)
+	{
+		if (got[i] != expected)
+		{
+			printf("FAIL: %s: engine %u returned 0x%x instead of 0x%x\n", name, i, got[i], expected);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * The program searches the payload of a TCP packet, after the IP and TCP headers, and keeps
+ * the scratch memory and X across the search.
+ */
+static void test_engines(void)
+{
+	static u_char* patterns[] = { (u_char*)"GET /", (u_char*)"POST /", (u_char*)"User-Agent: evil", (u_char*)"\x90\x90\x90\x90" };
+	static u_int lens[] = { 5, 6, 16, 4 };
+	struct bpf_insn insns[] =
+	{
+		BPF_STMT(BPF_LD | BPF_IMM, 0x11),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_LD | BPF_IMM, 0x220),
+		BPF_STMT(BPF_ST, 1),
+		BPF_STMT(BPF_LD | BPF_IMM, 0x3300),
+		BPF_STMT(BPF_ST, 2),
+		BPF_STMT(BPF_LD | BPF_IMM, 0x44000),
+		BPF_STMT(BPF_ST, 3),
+		BPF_STMT(BPF_LDX | BPF_MSH | BPF_B, 14),
+		BPF_STMT(BPF_LD | BPF_B | BPF_IND, 14 + 12),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 2),
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x3c),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 14),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_IMM, 0xffffffff),
+		BPF_STMT(BPF_MISC | BPF_MATCH, 5),
+		BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 24),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+		BPF_STMT(BPF_LDX | BPF_MEM, 0),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+		BPF_STMT(BPF_LDX | BPF_MEM, 1),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+		BPF_STMT(BPF_LDX | BPF_MEM, 2),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+		BPF_STMT(BPF_LDX | BPF_MEM, 3),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	u_int len = sizeof(insns) / sizeof(insns[0]);
+	u_char packet[PKTSIZE];
+	u_int32 state = 0x1234567;
+	u_int i, j, buflen, at, p;
+	char name[64];
+
+	if (!bpf_validate(insns, (int)len))
+	{
+		printf("FAIL: the search program does not validate\n");
+		failures++;
+		return;
+	}
+
+	bpf_match_sets[5] = bpf_match_compile(image, build_set(patterns, lens, 4, 0));
+	if (bpf_match_sets[5] == NULL)
+	{
+		printf("FAIL: cannot compile the set of the search program\n");
+		failures++;
+		return;
+	}
+
+	for (i = 0; i < 2000; i++)
+	{
+		// IPv4 and TCP headers of random lengths, then a payload that may contain a pattern
+		memset(packet, 0, sizeof(packet));
+		packet[14] = (u_char)(0x45 + bench_rand(&state) % 3);
+		packet[14 + 4 * (packet[14] & 0xf) + 12] = (u_char)((5 + bench_rand(&state) % 4) << 4);
+		for (j = 60; j < sizeof(packet); j++)
+			packet[j] = (u_char)(bench_rand(&state) % 4 == 0 ? 0x90 : 'A' + bench_rand(&state) % 26);
+		if (bench_rand(&state) % 2)
+		{
+			p = bench_rand(&state) % 4;
+			at = 40 + bench_rand(&state) % (sizeof(packet) - 40 - lens[p]);
+			memcpy(packet + at, patterns[p], lens[p]);
+		}
+		buflen = bench_rand(&state) % (sizeof(packet) + 1);
+
+		sprintf(name, "search, packet %u", i);
+		if (!check(name, insns, len, packet, sizeof(packet), buflen, &state))
+		{
+			failures++;
+			break;
+		}
+
+		// The headers and the payload in two buffers
+		at = bench_rand(&state) % (buflen + 1);
+		if (bpf_filter_with_2_buffers(insns, packet, packet + at, (int)at, sizeof(packet), buflen) != bpf_filter(insns, packet, sizeof(packet), buflen))
+		{
+			printf("FAIL: %s: bpf_filter_with_2_buffers with %u bytes in the first buffer\n", name, at);
+			failures++;
+			break;
+		}
+	}
+
+	// A set that is not installed matches nothing
+	bpf_match_free(bpf_match_sets[5]);
+	bpf_match_sets[5] = NULL;
+	if (!check("no set", insns, len, packet, sizeof(packet), sizeof(packet), &state) ||
+		(bpf_filter(insns, packet, sizeof(packet), sizeof(packet)) >> 24) != 0)
+	{
+		printf("FAIL: a program searching a set that is not installed\n");
+		failures++;
+	}
+}
+
+/*
+ * A random program, with some of its instructions that only change A replaced by a search.
+ * The programs without any are skipped.
+ */
+static u_int random_generate(void* context, struct bpf_insn* insns, u_int maxlen, u_int32* state)
+{
+	u_int j, len, matches = 0;
+
+	(void)context;
+
+	len = bench_random_program(insns, maxlen, state);
+	for (j = 0; j < len; j++)
+	{
+		if (insns[j].code == (BPF_ALU | BPF_NEG) || insns[j].code == (BPF_MISC | BPF_TXA) ||
+			(insns[j].code == (BPF_LD | BPF_IMM) && bench_rand(state) % 2))
+		{
+			insns[j].code = BPF_MISC | BPF_MATCH;
+			insns[j].k = bench_rand(state) % 4;
+			matches++;
+		}
+	}
+
+	return matches != 0 ? len : 0;
+}
+
+static int random_check(void* context, struct bpf_insn* insns, u_int len, struct bench_packet* pkt, u_int32* state)
+{
+	(void)context;
+
+	if (pkt->caplen == 0)
+		return TRUE;
+
+	return check("random program", insns, len, pkt->data, pkt->wirelen, pkt->caplen, state);
+}
+
+static void test_random_programs(void)
+{
+	static u_char* patterns[3][3] =
+	{
+		{ (u_char*)"\x00\x01", (u_char*)"\xff", (u_char*)"\x12\x34\x56" },
+		{ (u_char*)"ab", (u_char*)"b", (u_char*)"abc" },
+		{ (u_char*)"\x45", (u_char*)"\x08\x00", (u_char*)"\x00" },
+	};
+	static u_int lens[3][3] = { { 2, 1, 3 }, { 2, 1, 3 }, { 1, 2, 1 } };
+	struct bench_random_test test = { RANDOM_PROGRAMS, RANDOM_PACKETS, RANDOM_PKTSIZE, 0xdeadbeef, NULL,
+		random_generate, NULL, random_check, NULL, NULL };
+	u_int i;
+
+	for (i = 0; i < 3; i++)
+		bpf_match_sets[i] = bpf_match_compile(image, build_set(patterns[i], lens[i], 3, i == 1 ? BPF_MATCH_NOCASE : 0));
+
+	bench_random_programs(&test, &failures);
+
+	for (i = 0; i < 3; i++)
+	{
+		if (bpf_match_sets[i] != NULL)
+			bpf_match_free(bpf_match_sets[i]);
+		bpf_match_sets[i] = NULL;
+	}
+}
+
+static void test_validate_and_analyses(void)
+{
+	struct bpf_insn insns[] =
+	{
+		BPF_STMT(BPF_LDX | BPF_IMM, 54),
+		BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+		BPF_STMT(BPF_MISC | BPF_MATCH, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),
+	};
+	struct bpf_insn plain[] =
+	{
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0800, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct bpf_insn* progs[3] = { insns, plain, plain };
+	u_int lens[3] = { 6, 4, 4 };
+	struct bpf_flow_program* flow;
+	struct bpf_group_program* g;
+
+	if (!bpf_validate(insns, 6))
+	{
+		printf("FAIL: bpf_validate rejected a search of set 0\n");
+		failures++;
+	}
+
+	insns[2].k = BPF_MATCH_MAX_SETS - 1;
+	if (!bpf_validate(insns, 6))
+	{
+		printf("FAIL: bpf_validate rejected a search of the last set\n");
+		failures++;
+	}
+
+	insns[2].k = BPF_MATCH_MAX_SETS;
+	if (bpf_validate(insns, 6))
+	{
+		printf("FAIL: bpf_validate accepted a search of set %u\n", BPF_MATCH_MAX_SETS);
+		failures++;
+	}
+	insns[2].k = 0;
+
+	flow = bpf_flow_compile(insns, 6, 1);
+	if (flow != NULL)
+	{
+		printf("FAIL: bpf_flow_compile accepted a program that searches the packet\n");
+		bpf_free_flow(flow);
+		failures++;
+	}
+
+	g = bpf_group_compile(progs, lens, 3);
+	if (g == NULL || bpf_group_covered(g) != 6)
+	{
+		printf("FAIL: bpf_group_compile: the program that searches the packet must be left out\n");
+		failures++;
+	}
+	if (g != NULL)
+		bpf_free_group(g);
+
+	if (bpf_optimize(insns, 6) != 6)
+	{
+		printf("FAIL: bpf_optimize changed a program that searches the packet\n");
+		failures++;
+	}
+}
+
+int main()
+{
+	test_classic();
+	test_random_sets();
+	test_compile();
+	test_engines();
+	test_random_programs();
+	test_validate_and_analyses();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,294 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks that the programs rewritten by bpf_optimize() are valid and give the same
+ * results as the original ones in the interpreter, on the reference filters, on random
+ * programs and on random chains of comparisons like the ones libpcap emits.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+#include "bench_random.h"
+
+#define RANDOM_PROGRAMS		20000
+#define RANDOM_PACKETS		64
+
+static int failures = 0;
+
+#define CHECK(_cond, _what) do												\
+	{																		\
+		if (!(_cond))														\
+		{																	\
+			printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, (_what));		\
+			failures++;														\
+		}																	\
+	} while (0)
+
+/*
+ * Optimizes a copy of insns into opt, returns its length or 0 if the result is broken.
+ */
+static u_int optimize(struct bpf_insn* insns, u_int len, struct bpf_insn* opt)
+{
+	int optlen;
+
+	memcpy(opt, insns, len * sizeof(struct bpf_insn));
+	optlen = bpf_optimize(opt, (int)len);
+
+	if (optlen < 1 || optlen > (int)len || !bpf_validate(opt, optlen))
+	{
+		printf("FAIL: the optimized program (%d instructions) is not valid\n", optlen);
+		bench_dump_program("original", insns, len);
+		bench_dump_program("optimized", opt, optlen > 0 && optlen <= (int)len ? (u_int)optlen : 0);
+		failures++;
+		return 0;
+	}
+
+	return (u_int)optlen;
+}
+
+/*
+ * The optimized copy of a random program
+ */
+struct random_optimized
+{
+	struct bpf_insn opt[BENCH_RANDOM_MAXLEN];
+	u_int optlen;
+};
+
+static int random_prepare(void* context, struct bpf_insn* insns, u_int len)
+{
+	struct random_optimized* o = (struct random_optimized*)context;
+
+	// a broken result has been counted and printed by optimize()
+	o->optlen = optimize(insns, len, o->opt);
+	return o->optlen != 0 ? BENCH_RANDOM_RUN : BENCH_RANDOM_SKIP;
+}
+
+/*
+ * Runs the original and the optimized programs on a random packet.
+ */
+static int random_check(void* context, struct bpf_insn* insns, u_int len, struct bench_packet* pkt, u_int32* state)
+{
+	struct random_optimized* o = (struct random_optimized*)context;
+	u_int expected, got;
+
+	(void)len;
+	(void)state;
+
+	expected = bpf_filter(insns, pkt->data, pkt->wirelen, pkt->caplen);
+	got = bpf_filter(o->opt, pkt->data, pkt->wirelen, pkt->caplen);
+	if (expected != got)
+	{
+		printf("FAIL: wirelen %u, caplen %u: original 0x%x, optimized 0x%x\n", pkt->wirelen, pkt->caplen, expected, got);
+		bench_dump_program("optimized", o->opt, o->optlen);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void test_reference_filters(u_int seed)
+{
+	struct bpf_insn opt[BPF_MAXINSNS];
+	struct bench_corpus corpus;
+	u_int f, i, optlen, mismatches;
+
+	CHECK(bench_corpus_synthesize(&corpus, 20000, seed) == 0, "synthesize corpus");
+
+	for (f = 0; f < bench_filters_count; f++)
+	{
+		struct bench_filter* filter = &bench_filters[f];
+
+		optlen = optimize(filter->insns, filter->len, opt);
+		if (optlen == 0)
+			continue;
+
+		mismatches = 0;
+		for (i = 0; i < corpus.count; i++)
+		{
+			struct bench_packet* pkt = &corpus.packets[i];
+
+			if (bpf_filter(opt, pkt->data, pkt->wirelen, pkt->caplen) != filter->reference(pkt))
+				mismatches++;
+		}
+
+		if (mismatches != 0)
+		{
+			printf("  %s: %u mismatches out of %u packets (seed %u)\n", filter->name, mismatches, corpus.count, seed);
+			bench_dump_program("optimized", opt, optlen);
+		}
+		CHECK(mismatches == 0, filter->name);
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+static void test_rewrites(void)
+{
+	struct bpf_insn opt[BPF_MAXINSNS];
+	struct bench_filter* concat = bench_filter_find("concat");
+	struct bpf_insn folded[] =
+	{
+		BPF_STMT(BPF_LD|BPF_IMM, 3),
+		BPF_STMT(BPF_ALU|BPF_ADD|BPF_K, 4),
+		BPF_STMT(BPF_MISC|BPF_TAX, 0),
+		BPF_STMT(BPF_ALU|BPF_MUL|BPF_X, 0),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	struct bpf_insn div_zero[] =
+	{
+		BPF_STMT(BPF_LD|BPF_W|BPF_LEN, 0),
+		BPF_STMT(BPF_ALU|BPF_DIV|BPF_X, 0),
+		BPF_STMT(BPF_RET|BPF_K, 1),
+	};
+	struct bpf_insn merge[] =
+	{
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 1),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x22, 0, 3),
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x11, 0, 1),
+		BPF_STMT(BPF_RET|BPF_K, 1),
+		BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+	struct bpf_insn dead_load[] =
+	{
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 10),
+		BPF_STMT(BPF_ST, 2),
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 8),
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 16),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	u_int len;
+
+	len = optimize(folded, sizeof(folded) / sizeof(folded[0]), opt);
+	CHECK(len == 1 && opt[0].code == (BPF_RET|BPF_K) && opt[0].k == 49, "constant folding");
+
+	len = optimize(div_zero, sizeof(div_zero) / sizeof(div_zero[0]), opt);
+	CHECK(len == 1 && opt[0].code == (BPF_RET|BPF_K) && opt[0].k == 0, "division by a zero X");
+
+	len = optimize(merge, sizeof(merge) / sizeof(merge[0]), opt);
+	CHECK(len == 4 && opt[0].code == (BPF_LD|BPF_H|BPF_ABS) && opt[0].k == 0 && opt[1].k == 0x1122, "load merging");
+
+	// The first load must stay, as it can reject the packet, the second one cannot
+	len = optimize(dead_load, sizeof(dead_load) / sizeof(dead_load[0]), opt);
+	CHECK(len == 3 && opt[0].code == (BPF_LD|BPF_W|BPF_ABS) && opt[1].code == (BPF_LD|BPF_B|BPF_ABS), "dead loads");
+
+	CHECK(concat != NULL, "concat filter");
+	if (concat != NULL)
+	{
+		len = optimize(concat->insns, concat->len, opt);
+		if (len > 11)
+			bench_dump_program("concat", opt, len);
+		CHECK(len <= 11, "redundant checks");
+	}
+}
+
+static void test_random_programs(void)
+{
+	struct random_optimized o;
+	struct bench_random_test test = { RANDOM_PROGRAMS, RANDOM_PACKETS, 0, 0x0b7e1a, &o,
+		NULL, random_prepare, random_check, NULL, NULL };
+
+	bench_random_programs(&test, &failures);
+}
+
+/*
+ * Chains of comparisons of the first bytes of the packet with values that are frequent
+ * in the random packets, joined by "and" and "or" like in the code emitted by libpcap:
+ * this is what the threading and the load merging are for.
+ */
+static u_int random_chain(void* context, struct bpf_insn* insns, u_int maxlen, u_int32* state)
+{
+	u_int terms = 2 + bench_rand(state) % ((maxlen - 2) / 2 - 1);
+	u_int len = 2 * terms + 2;
+	u_int accept = len - 2;
+	u_int reject = len - 1;
+	u_int i, pc;
+
+	(void)context;
+
+	for (i = 0; i < terms; i++)
+	{
+		pc = 2 * i;
+
+		switch (bench_rand(state) % 3)
+		{
+		case 0:
+			insns[pc].code = BPF_LD|BPF_B|BPF_ABS;
+			break;
+		case 1:
+			insns[pc].code = BPF_LD|BPF_H|BPF_ABS;
+			break;
+		default:
+			insns[pc].code = BPF_LD|BPF_W|BPF_ABS;
+			break;
+		}
+		insns[pc].jt = insns[pc].jf = 0;
+		insns[pc].k = bench_rand(state) % 12;
+
+		insns[pc + 1].code = BPF_JMP|BPF_JEQ|BPF_K;
+		insns[pc + 1].k = bench_rand(state) % 4;
+		if (insns[pc].code == (BPF_LD|BPF_H|BPF_ABS) && bench_rand(state) % 2)
+			insns[pc + 1].k |= (bench_rand(state) % 4) << 8;
+
+		// "and" rejects on a mismatch, "or" accepts on a match; the last term decides
+		if (i == terms - 1)
+		{
+			insns[pc + 1].jt = (u_char)(accept - pc - 2);
+			insns[pc + 1].jf = (u_char)(reject - pc - 2);
+		}
+		else if (bench_rand(state) % 4 != 0)
+		{
+			insns[pc + 1].jt = 0;
+			insns[pc + 1].jf = (u_char)(reject - pc - 2);
+		}
+		else
+		{
+			insns[pc + 1].jt = (u_char)(accept - pc - 2);
+			insns[pc + 1].jf = 0;
+		}
+	}
+
+	insns[accept].code = BPF_RET|BPF_K;
+	insns[accept].jt = insns[accept].jf = 0;
+	insns[accept].k = (bench_rand(state) % 2) ? 0xffffffff : 64;
+	insns[reject].code = BPF_RET|BPF_K;
+	insns[reject].jt = insns[reject].jf = 0;
+	insns[reject].k = 0;
+
+	return len;
+}
+
+static void test_random_chains(void)
+{
+	struct random_optimized o;
+	struct bench_random_test test = { RANDOM_PROGRAMS, RANDOM_PACKETS, 0, 0xc4a1, &o,
+		random_chain, random_prepare, random_check, NULL, NULL };
+
+	bench_random_programs(&test, &failures);
+}
+
+int main()
+{
+	test_rewrites();
+	test_reference_filters(1);
+	test_reference_filters(0x5eed);
+	test_random_programs();
+	test_random_chains();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,337 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks the prefilter of the necessary conditions: the conditions that bpf_validate_conditions()
+ * extracts from the reference filters, that bpf_prefilter() only rejects packets that bpf_filter()
+ * rejects, on the reference filters and on random programs, that it is exact for the programs made
+ * of a single condition, including on packets shorter than its window, and that it rejects most of
+ * the packets that the selective filters reject.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+#include "bench_random.h"
+
+#define RANDOM_PROGRAMS		20000
+#define RANDOM_PACKETS		64
+#define PKTSIZE				128
+#define SINGLE_CONDITIONS	5000
+
+static int failures = 0;
+
+/*
+ * The necessary conditions expected in the reference filters
+ */
+struct expected_conditions
+{
+	const char* name;
+	u_int count;
+	struct bpf_condition conds[3];
+};
+
+static struct expected_conditions expected[] =
+{
+	{ "accept", 0, { { 0 } } },
+	{ "ip", 1, { { 12, 2, 0xffff, 0x800 } } },
+	{ "tcp", 0, { { 0 } } },
+	{ "host", 0, { { 0 } } },
+	{ "tcpport", 0, { { 0 } } },
+	{ "vlan", 1, { { 12, 2, 0xffff, 0x8100 } } },
+	{ "syn", 3, { { 12, 2, 0xffff, 0x800 }, { 23, 1, 0xff, 6 }, { 20, 2, 0x1fff, 0 } } },
+	{ "greater", 0, { { 0 } } },
+	{ "concat", 3, { { 12, 2, 0xffff, 0x800 }, { 23, 1, 0xff, 6 }, { 20, 2, 0x1fff, 0 } } },
+};
+
+static void test_conditions(void)
+{
+	struct bpf_condition conds[BPF_PREFILTER_MAX_CONDITIONS];
+	u_int e, i;
+	int count;
+
+	for (e = 0; e < sizeof(expected) / sizeof(expected[0]); e++)
+	{
+		struct bench_filter* filter = bench_filter_find(expected[e].name);
+
+		count = bpf_validate_conditions(filter->insns, (int)filter->len, conds, BPF_PREFILTER_MAX_CONDITIONS);
+		if (count != (int)expected[e].count)
+		{
+			printf("FAIL: %s: %d conditions instead of %u\n", filter->name, count, expected[e].count);
+			for (i = 0; i < (u_int)count; i++)
+				printf("  [%u:%u] & 0x%x == 0x%x\n", conds[i].offset, conds[i].size, conds[i].mask, conds[i].value);
+			failures++;
+			continue;
+		}
+
+		for (i = 0; i < expected[e].count; i++)
+		{
+			if (memcmp(&conds[i], &expected[e].conds[i], sizeof(struct bpf_condition)) != 0)
+			{
+				printf("FAIL: %s: condition %u is [%u:%u] & 0x%x == 0x%x\n", filter->name, i,
+					conds[i].offset, conds[i].size, conds[i].mask, conds[i].value);
+				failures++;
+			}
+		}
+	}
+}
+
+/*
+ * The prefilter never rejects what the filter accepts, and catches most of what it rejects when
+ * the filter has necessary conditions
+ */
+static void test_reference_filters(void)
+{
+	struct bench_corpus corpus;
+	struct bpf_prefilter pre;
+	u_int f, i, rejected, prefiltered, wrong;
+
+	if (bench_corpus_synthesize(&corpus, 20000, 9) != 0)
+	{
+		printf("FAIL: cannot synthesize the corpus\n");
+		failures++;
+		return;
+	}
+
+	for (f = 0; f < bench_filters_count; f++)
+	{
+		struct bench_filter* filter = &bench_filters[f];
+		int count = bpf_prefilter_compile(filter->insns, (int)filter->len, &pre);
+
+		rejected = prefiltered = wrong = 0;
+		for (i = 0; i < corpus.count; i++)
+		{
+			struct bench_packet* pkt = &corpus.packets[i];
+			u_int verdict = bpf_filter(filter->insns, pkt->data, pkt->wirelen, pkt->caplen);
+
+			if (verdict == 0)
+				rejected++;
+
+			if (!bpf_prefilter(&pre, pkt->data, pkt->caplen))
+			{
+				prefiltered++;
+				if (verdict != 0)
+					wrong++;
+			}
+		}
+
+		if (wrong != 0)
+		{
+			printf("FAIL: %s: the prefilter rejects %u accepted packets\n", filter->name, wrong);
+			failures++;
+		}
+
+		// The IPv4 TCP packets make most of the corpus: the others fail the conditions
+		if (count != 0 && prefiltered < rejected / 2)
+		{
+			printf("FAIL: %s: the prefilter rejects %u packets out of %u\n", filter->name, prefiltered, rejected);
+			failures++;
+		}
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+/*
+ * The prefilter of a random program, and the number of programs that have one
+ */
+struct random_prefilter
+{
+	struct bpf_prefilter pre;
+	u_int with_conditions;
+};
+
+static int random_prepare(void* context, struct bpf_insn* insns, u_int len)
+{
+	struct random_prefilter* p = (struct random_prefilter*)context;
+
+	if (bpf_prefilter_compile(insns, (int)len, &p->pre) != 0)
+		p->with_conditions++;
+
+	return BENCH_RANDOM_RUN;
+}
+
+static int random_check(void* context, struct bpf_insn* insns, u_int len, struct bench_packet* pkt, u_int32* state)
+{
+	struct random_prefilter* p = (struct random_prefilter*)context;
+
+	(void)len;
+	(void)state;
+
+	if (!bpf_prefilter(&p->pre, pkt->data, pkt->caplen) && bpf_filter(insns, pkt->data, pkt->wirelen, pkt->caplen) != 0)
+	{
+		printf("FAIL: the prefilter rejects an accepted packet of %u bytes\n", pkt->caplen);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void test_random_programs(void)
+{
+	struct random_prefilter p;
+	struct bench_random_test test = { RANDOM_PROGRAMS, RANDOM_PACKETS, PKTSIZE, 0x13572468, &p,
+		NULL, random_prepare, random_check, NULL, NULL };
+
+	p.with_conditions = 0;
+	bench_random_programs(&test, &failures);
+
+	if (p.with_conditions == 0)
+	{
+		printf("FAIL: no random program has necessary conditions\n");
+		failures++;
+	}
+}
+
+/*
+ * A program testing one condition is accepted exactly when its prefilter is
+ */
+static void test_single_conditions(void)
+{
+	struct bpf_insn insns[5];
+	struct bpf_prefilter pre;
+	u_char data[PKTSIZE];
+	u_int32 state = 0x24681357;
+	u_int32 offset, size, mask, value;
+	u_int n, i, b, buflen, len;
+
+	for (n = 0; n < SINGLE_CONDITIONS; n++)
+	{
+		offset = bench_rand(&state) % 40;
+		size = 1 << (bench_rand(&state) % 3);
+		mask = (bench_rand(&state) % 2) ? bench_rand(&state) : 0xffffffff;
+		value = bench_rand(&state) & mask;
+		if (size < 4)
+			value &= (1 << (8 * size)) - 1;
+
+		len = 0;
+		insns[len++] = (struct bpf_insn)BPF_STMT(BPF_LD|BPF_ABS|(size == 4 ? BPF_W : size == 2 ? BPF_H : BPF_B), offset);
+		if (mask != 0xffffffff)
+			insns[len++] = (struct bpf_insn)BPF_STMT(BPF_ALU|BPF_AND|BPF_K, mask);
+		insns[len++] = (struct bpf_insn)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, value, 0, 1);
+		insns[len++] = (struct bpf_insn)BPF_STMT(BPF_RET|BPF_K, 96);
+		insns[len++] = (struct bpf_insn)BPF_STMT(BPF_RET|BPF_K, 0);
+
+		if (bpf_prefilter_compile(insns, (int)len, &pre) != 1)
+		{
+			printf("FAIL: the condition of a single comparison is not found\n");
+			bench_dump_program(NULL, insns, len);
+			failures++;
+			continue;
+		}
+
+		for (i = 0; i < 8; i++)
+		{
+			for (b = 0; b < PKTSIZE; b++)
+				data[b] = (u_char)bench_rand(&state);
+
+			// Half of the packets meet the condition
+			if (i % 2)
+			{
+				for (b = 0; b < size; b++)
+				{
+					u_int shift = 8 * (size - 1 - b);
+					data[offset + b] = (u_char)((data[offset + b] & ~(mask >> shift)) | (value >> shift));
+				}
+			}
+
+			for (buflen = 0; buflen < offset + size + 20; buflen++)
+			{
+				if (bpf_prefilter(&pre, data, buflen) != (bpf_filter(insns, data, buflen, buflen) != 0))
+				{
+					printf("FAIL: the prefilter of a single comparison differs on %u bytes\n", buflen);
+					bench_dump_program(NULL, insns, len);
+					failures++;
+					i = 8;
+					break;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * The conditions too far from each other are in two windows, the others are left to the program
+ */
+static void test_windows(void)
+{
+	// "ip src host 10.0.0.1 and udp and ip[60] == 1"
+	struct bpf_insn insns[] =
+	{
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 7),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 26),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x0a000001, 0, 5),
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 23),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 17, 0, 3),
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 74),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 1, 0, 1),
+		BPF_STMT(BPF_RET|BPF_K, 262144),
+		BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+	static const u_int offsets[] = { 12, 13, 23, 26, 29, 74 };
+	struct bpf_prefilter pre;
+	u_char data[PKTSIZE];
+	u_int i;
+
+	if (bpf_prefilter_compile(insns, sizeof(insns) / sizeof(insns[0]), &pre) != 4 || pre.windows != 2 || pre.length != 75)
+	{
+		printf("FAIL: %u windows for %u bytes, expected 2 for 75\n", pre.windows, pre.length);
+		failures++;
+		return;
+	}
+
+	memset(data, 0, sizeof(data));
+	data[12] = 0x08;
+	data[23] = 17;
+	data[26] = 10;
+	data[29] = 1;
+	data[74] = 1;
+
+	if (!bpf_prefilter(&pre, data, 75) || bpf_filter(insns, data, 75, 75) == 0)
+	{
+		printf("FAIL: the packet that meets the conditions is rejected\n");
+		failures++;
+	}
+
+	if (bpf_prefilter(&pre, data, 74))
+	{
+		printf("FAIL: the packet too short for the last condition is not rejected\n");
+		failures++;
+	}
+
+	// The last condition is left to the program
+	for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++)
+	{
+		data[offsets[i]] ^= 0x10;
+		if (bpf_prefilter(&pre, data, 75) != (offsets[i] == 74))
+		{
+			printf("FAIL: the prefilter is wrong with byte %u changed\n", offsets[i]);
+			failures++;
+		}
+		data[offsets[i]] ^= 0x10;
+	}
+}
+
+int main()
+{
+	test_conditions();
+	test_reference_filters();
+	test_random_programs();
+	test_single_conditions();
+	test_windows();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,206 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks that bpf_filter_profile() returns what bpf_filter() does, and that its counters
+ * add up: every packet starts at the first instruction and ends at exactly one, the
+ * instructions that do not jump pass on what they do not end, and the packets accepted
+ * are the ones the verdicts say.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+#include "bench_random.h"
+
+#define RANDOM_PROGRAMS		10000
+#define RANDOM_PACKETS		64
+
+static int failures = 0;
+
+/*
+ * Checks the counters after packets runs, of which accepted were accepted
+ */
+static int check_counters(struct bpf_insn* insns, u_int len, struct bpf_profile_counter* counters,
+	ULONGLONG packets, ULONGLONG accepted)
+{
+	ULONGLONG ended = 0, total_accepted = 0;
+	struct bpf_insn* p;
+	u_int i;
+
+	if (counters[0].executed != packets)
+	{
+		printf("FAIL: the first instruction ran %llu times for %llu packets\n", (unsigned long long)counters[0].executed, (unsigned long long)packets);
+		return FALSE;
+	}
+
+	for (i = 0; i < len; i++)
+	{
+		p = &insns[i];
+		ended += counters[i].accepted + counters[i].rejected;
+		total_accepted += counters[i].accepted;
+
+		if (counters[i].accepted + counters[i].rejected > counters[i].executed)
+		{
+			printf("FAIL: instruction %u ends more packets than it runs\n", i);
+			return FALSE;
+		}
+
+		// A straight-line instruction runs the next one for all the packets it does not end, but
+		// the next one may be a jump target too
+		if (BPF_CLASS(p->code) != BPF_JMP && BPF_CLASS(p->code) != BPF_RET && i + 1 < len &&
+			counters[i + 1].executed < counters[i].executed - counters[i].accepted - counters[i].rejected)
+		{
+			printf("FAIL: instruction %u loses packets\n", i);
+			return FALSE;
+		}
+	}
+
+	if (ended != packets || total_accepted != accepted)
+	{
+		printf("FAIL: %llu packets ended, %llu accepted, instead of %llu and %llu\n", (unsigned long long)ended,
+			(unsigned long long)total_accepted, (unsigned long long)packets, (unsigned long long)accepted);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void test_reference_filters(void)
+{
+	struct bench_corpus corpus;
+	struct bpf_profile_counter* counters;
+	ULONGLONG accepted;
+	u_int f, i, expected, got;
+
+	if (bench_corpus_synthesize(&corpus, 20000, 13) != 0)
+	{
+		printf("FAIL: cannot synthesize the corpus\n");
+		failures++;
+		return;
+	}
+
+	for (f = 0; f < bench_filters_count; f++)
+	{
+		struct bench_filter* filter = &bench_filters[f];
+
+		counters = (struct bpf_profile_counter*)calloc(filter->len, sizeof(struct bpf_profile_counter));
+		if (counters == NULL)
+		{
+			printf("FAIL: out of memory\n");
+			failures++;
+			break;
+		}
+
+		accepted = 0;
+		for (i = 0; i < corpus.count; i++)
+		{
+			struct bench_packet* pkt = &corpus.packets[i];
+
+			expected = bpf_filter(filter->insns, pkt->data, pkt->wirelen, pkt->caplen);
+			got = bpf_filter_profile(filter->insns, pkt->data, pkt->wirelen, pkt->caplen, NULL, counters);
+			if (got != expected)
+			{
+				printf("FAIL: filter %s, packet %u: expected 0x%x, got 0x%x\n", filter->name, i, expected, got);
+				failures++;
+				break;
+			}
+
+			if (got != 0)
+				accepted++;
+		}
+
+		if (i == corpus.count && !check_counters(filter->insns, filter->len, counters, corpus.count, accepted))
+		{
+			printf("  filter %s\n", filter->name);
+			failures++;
+		}
+
+		free(counters);
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+/*
+ * The counters of a random program, over the random packets
+ */
+struct random_profile
+{
+	struct bpf_profile_counter counters[BENCH_RANDOM_MAXLEN];
+	ULONGLONG accepted;
+};
+
+static int random_prepare(void* context, struct bpf_insn* insns, u_int len)
+{
+	struct random_profile* p = (struct random_profile*)context;
+
+	(void)insns;
+	(void)len;
+
+	memset(p->counters, 0, sizeof(p->counters));
+	p->accepted = 0;
+
+	return BENCH_RANDOM_RUN;
+}
+
+static int random_check(void* context, struct bpf_insn* insns, u_int len, struct bench_packet* pkt, u_int32* state)
+{
+	struct random_profile* p = (struct random_profile*)context;
+	u_int expected, got;
+
+	(void)len;
+	(void)state;
+
+	expected = bpf_filter(insns, pkt->data, pkt->wirelen, pkt->caplen);
+	got = bpf_filter_profile(insns, pkt->data, pkt->wirelen, pkt->caplen, NULL, p->counters);
+	if (got != expected)
+	{
+		printf("FAIL: expected 0x%x, got 0x%x\n", expected, got);
+		return FALSE;
+	}
+
+	if (got != 0)
+		p->accepted++;
+
+	return TRUE;
+}
+
+static int random_finish(void* context, struct bpf_insn* insns, u_int len, u_int32* state)
+{
+	struct random_profile* p = (struct random_profile*)context;
+
+	(void)state;
+
+	return check_counters(insns, len, p->counters, RANDOM_PACKETS, p->accepted);
+}
+
+static void test_random_programs(void)
+{
+	struct random_profile p;
+	struct bench_random_test test = { RANDOM_PROGRAMS, RANDOM_PACKETS, 0, 0x2545, &p,
+		NULL, random_prepare, random_check, random_finish, NULL };
+
+	bench_random_programs(&test, &failures);
+}
+
+int main()
+{
+	test_reference_filters();
+	test_random_programs();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,516 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks the native matchers of the common filter shapes: that bpf_shape_recognize() recognizes
+ * the reference programs of libpcap that have one, also with other constants and after the check
+ * of an 802.1Q tag, that it leaves the others alone, and that bpf_filter_shape() always returns
+ * what bpf_filter() does, including on truncated packets and with offsets that wrap around.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_corpus.h"
+#include "bench_filters.h"
+#include "bench_random.h"
+
+#define MAX_INSNS			64
+#define VARIANTS			300
+#define MUTANTS				3000
+#define PKTSIZE				128
+
+static int failures = 0;
+
+/*
+ * The reference filters that have a shape, and the constants of their expression that are
+ * parameters of the shape
+ */
+struct shaped_filter
+{
+	const char* name;
+	const char* shape;
+	u_int32 constants[2];
+};
+
+static struct shaped_filter shaped_filters[] =
+{
+	{ "ip", "ether proto", { 0x800, 0 } },
+	{ "tcp", "ip proto", { 6, 0 } },
+	{ "host", "host", { 0x0a000001, 0 } },
+	{ "net", "net", { 0xc0a80000, 0xffff0000 } },
+	{ "tcpport", "proto port", { 6, 443 } },
+	{ "udpport", "proto port", { 17, 53 } },
+	{ "port", "port", { 80, 0 } },
+	{ "vlan", "ip proto", { 6, 0 } },
+};
+
+#define SHAPED_FILTERS (sizeof(shaped_filters) / sizeof(shaped_filters[0]))
+
+static struct shaped_filter* find_shaped(const char* name)
+{
+	u_int i;
+
+	for (i = 0; i < SHAPED_FILTERS; i++)
+	{
+		if (strcmp(shaped_filters[i].name, name) == 0)
+			return &shaped_filters[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Runs a shape and bpf_filter() on a packet, also truncated at every length up to the bytes the
+ * filters read. Returns the number of mismatches.
+ */
+static u_int compare_packet(struct bpf_shape* shape, struct bpf_insn* insns, struct bench_packet* pkt)
+{
+	u_int mismatches = 0;
+	u_int buflen;
+
+	if (bpf_filter_shape(shape, pkt->data, pkt->wirelen, pkt->caplen) != bpf_filter(insns, pkt->data, pkt->wirelen, pkt->caplen))
+		mismatches++;
+
+	for (buflen = 0; buflen < pkt->caplen && buflen < 80; buflen += 3)
+	{
+		if (bpf_filter_shape(shape, pkt->data, pkt->wirelen, buflen) != bpf_filter(insns, pkt->data, pkt->wirelen, buflen))
+			mismatches++;
+	}
+
+	return mismatches;
+}
+
+static void test_reference_filters(void)
+{
+	struct bench_corpus corpus;
+	u_int f, i;
+
+	if (bench_corpus_synthesize(&corpus, 20000, 5) != 0)
+	{
+		printf("FAIL: cannot synthesize the corpus\n");
+		failures++;
+		return;
+	}
+
+	for (f = 0; f < bench_filters_count; f++)
+	{
+		struct bench_filter* filter = &bench_filters[f];
+		struct shaped_filter* shaped = find_shaped(filter->name);
+		struct bpf_shape* shape = bpf_shape_recognize(filter->insns, (int)filter->len);
+		u_int mismatches = 0;
+
+		if (shaped == NULL)
+		{
+			if (shape != NULL)
+			{
+				printf("FAIL: %s recognized as \"%s\"\n", filter->name, bpf_shape_name(shape));
+				failures++;
+				bpf_free_shape(shape);
+			}
+			continue;
+		}
+
+		if (shape == NULL)
+		{
+			printf("FAIL: %s not recognized\n", filter->name);
+			failures++;
+			continue;
+		}
+
+		if (strcmp(bpf_shape_name(shape), shaped->shape) != 0)
+		{
+			printf("FAIL: %s recognized as \"%s\" instead of \"%s\"\n", filter->name, bpf_shape_name(shape), shaped->shape);
+			failures++;
+		}
+
+		for (i = 0; i < corpus.count; i++)
+		{
+			struct bench_packet* pkt = &corpus.packets[i];
+
+			if (bpf_filter_shape(shape, pkt->data, pkt->wirelen, pkt->caplen) != filter->reference(pkt))
+				mismatches++;
+		}
+
+		if (mismatches != 0)
+		{
+			printf("FAIL: %s: %u mismatches with the reference out of %u packets\n", filter->name, mismatches, corpus.count);
+			failures++;
+		}
+
+		bpf_free_shape(shape);
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+/*
+ * Builds a variant of a reference program: the loads moved by delta bytes after the optional
+ * 802.1Q check, the constants of the expression and the accepted length replaced.
+ */
+static u_int make_variant(struct bench_filter* filter, struct shaped_filter* shaped, u_int32 delta, u_int32* values, u_int32 snaplen, struct bpf_insn* insns)
+{
+	u_int i, j, start;
+
+	memcpy(insns, filter->insns, filter->len * sizeof(struct bpf_insn));
+
+	start = (insns[1].code == (BPF_JMP|BPF_JEQ|BPF_K) && insns[1].k == 0x8100) ? 2 : 0;
+	for (i = start; i < filter->len; i++)
+	{
+		struct bpf_insn* insn = &insns[i];
+
+		if (BPF_CLASS(insn->code) == BPF_LD || BPF_CLASS(insn->code) == BPF_LDX)
+		{
+			insn->k += delta;
+			continue;
+		}
+
+		if (insn->code == (BPF_RET|BPF_K) && insn->k != 0)
+		{
+			insn->k = snaplen;
+			continue;
+		}
+
+		for (j = 0; j < 2; j++)
+		{
+			if (shaped->constants[j] != 0 && insn->k == shaped->constants[j] &&
+				(insn->code == (BPF_JMP|BPF_JEQ|BPF_K) || insn->code == (BPF_ALU|BPF_AND|BPF_K)))
+			{
+				insn->k = values[j];
+				break;
+			}
+		}
+	}
+
+	return filter->len;
+}
+
+/*
+ * The shapes with other constants and offsets, on the corpus, on its packets mutated and on
+ * random packets
+ */
+static void test_variants(void)
+{
+	struct bench_corpus corpus;
+	struct bpf_insn insns[MAX_INSNS];
+	u_char data[PKTSIZE];
+	struct bench_packet pkt;
+	u_int32 state = 0x5eed1234;
+	u_int32 values[2], delta, snaplen;
+	u_int f, v, i, j, len, mismatches;
+
+	if (bench_corpus_synthesize(&corpus, 2000, 11) != 0)
+	{
+		printf("FAIL: cannot synthesize the corpus\n");
+		failures++;
+		return;
+	}
+
+	for (f = 0; f < bench_filters_count; f++)
+	{
+		struct bench_filter* filter = &bench_filters[f];
+		struct shaped_filter* shaped = find_shaped(filter->name);
+
+		if (shaped == NULL)
+			continue;
+
+		for (v = 0; v < VARIANTS; v++)
+		{
+			struct bpf_shape* shape;
+
+			// Mostly the offsets and values that the corpus has, sometimes anything
+			switch (bench_rand(&state) % 4)
+			{
+			case 0: delta = 0; break;
+			case 1: delta = 4; break;
+			case 2: delta = (u_int32)-(int)(bench_rand(&state) % 16); break;
+			default: delta = bench_rand(&state); break;
+			}
+
+			for (j = 0; j < 2; j++)
+			{
+				values[j] = (bench_rand(&state) % 2) ? shaped->constants[j] : bench_rand(&state) % 0x10000;
+				if (j == 1 && shaped->constants[1] == 0xffff0000 && (bench_rand(&state) % 2))
+					values[1] = bench_rand(&state);
+			}
+
+			snaplen = (bench_rand(&state) % 2) ? 262144 : bench_rand(&state) | 1;
+
+			len = make_variant(filter, shaped, delta, values, snaplen, insns);
+			if (!bpf_validate(insns, (int)len))
+				continue;
+
+			shape = bpf_shape_recognize(insns, (int)len);
+			if (shape == NULL)
+			{
+				// Only the loads moved to the ancillary area are refused
+				for (i = 0; i < len && !BPF_IS_ANCILLARY(insns[i].code, insns[i].k); i++)
+					;
+				if (i == len)
+				{
+					printf("FAIL: %s variant %u not recognized\n", filter->name, v);
+					bench_dump_program(NULL, insns, len);
+					failures++;
+				}
+				continue;
+			}
+
+			mismatches = 0;
+			for (i = 0; i < corpus.count; i += 7)
+			{
+				struct bench_packet* cp = &corpus.packets[i];
+
+				mismatches += compare_packet(shape, insns, cp);
+
+				// The same packet with a few bytes changed
+				if (cp->caplen <= PKTSIZE)
+				{
+					memcpy(data, cp->data, cp->caplen);
+					for (j = 0; j < 3; j++)
+						data[bench_rand(&state) % cp->caplen] = (u_char)bench_rand(&state);
+					pkt.data = data;
+					pkt.caplen = cp->caplen;
+					pkt.wirelen = cp->wirelen;
+					mismatches += compare_packet(shape, insns, &pkt);
+				}
+			}
+
+			for (i = 0; i < 20; i++)
+			{
+				pkt.data = data;
+				bench_random_packet(&pkt, PKTSIZE, &state);
+				mismatches += compare_packet(shape, insns, &pkt);
+			}
+
+			if (mismatches != 0)
+			{
+				printf("FAIL: %s variant %u: %u mismatches\n", filter->name, v, mismatches);
+				bench_dump_program(NULL, insns, len);
+				failures++;
+			}
+
+			bpf_free_shape(shape);
+		}
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+/*
+ * "vlan and <expression>" for each shape
+ */
+static void test_vlan(void)
+{
+	struct bench_corpus corpus;
+	struct bpf_insn insns[MAX_INSNS];
+	u_int f, i, len, mismatches;
+
+	if (bench_corpus_synthesize(&corpus, 5000, 13) != 0)
+	{
+		printf("FAIL: cannot synthesize the corpus\n");
+		failures++;
+		return;
+	}
+
+	for (f = 0; f < SHAPED_FILTERS; f++)
+	{
+		struct bench_filter* filter = bench_filter_find(shaped_filters[f].name);
+		struct bpf_shape* shape;
+
+		if (filter == NULL || filter->insns[1].k == 0x8100)
+			continue;
+
+		insns[0] = (struct bpf_insn)BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12);
+		insns[1] = (struct bpf_insn)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x8100, 0, filter->len - 1);
+		memcpy(&insns[2], filter->insns, filter->len * sizeof(struct bpf_insn));
+		len = filter->len + 2;
+		for (i = 2; i < len; i++)
+		{
+			if (BPF_CLASS(insns[i].code) == BPF_LD || BPF_CLASS(insns[i].code) == BPF_LDX)
+				insns[i].k += 4;
+		}
+
+		shape = bpf_shape_recognize(insns, (int)len);
+		if (shape == NULL || strcmp(bpf_shape_name(shape), shaped_filters[f].shape) != 0)
+		{
+			printf("FAIL: vlan and %s not recognized as \"%s\"\n", filter->expression, shaped_filters[f].shape);
+			failures++;
+			if (shape != NULL)
+				bpf_free_shape(shape);
+			continue;
+		}
+
+		mismatches = 0;
+		for (i = 0; i < corpus.count; i++)
+			mismatches += compare_packet(shape, insns, &corpus.packets[i]);
+
+		if (mismatches != 0)
+		{
+			printf("FAIL: vlan and %s: %u mismatches\n", filter->expression, mismatches);
+			failures++;
+		}
+
+		// The check of the tag must jump to the final rejection
+		insns[1].jf--;
+		if (bpf_validate(insns, (int)len) && (shape = bpf_shape_recognize(insns, (int)len)) != NULL)
+		{
+			printf("FAIL: vlan and %s with a wrong jump recognized\n", filter->expression);
+			failures++;
+			bpf_free_shape(shape);
+		}
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+/*
+ * The reference programs with one field changed: those still recognized must still give the result
+ * of bpf_filter(), and a change of the structure must not be recognized
+ */
+static void test_mutants(void)
+{
+	struct bench_corpus corpus;
+	struct bpf_insn insns[MAX_INSNS];
+	u_int32 state = 0xabcdef01;
+	u_int m, i, n, len, mismatches;
+	u_int recognized = 0, refused = 0;
+
+	if (bench_corpus_synthesize(&corpus, 1000, 17) != 0)
+	{
+		printf("FAIL: cannot synthesize the corpus\n");
+		failures++;
+		return;
+	}
+
+	for (m = 0; m < MUTANTS; m++)
+	{
+		struct bench_filter* filter = bench_filter_find(shaped_filters[m % SHAPED_FILTERS].name);
+		struct bpf_shape* shape;
+		int structural = FALSE;
+
+		len = filter->len;
+		memcpy(insns, filter->insns, len * sizeof(struct bpf_insn));
+		n = bench_rand(&state) % len;
+
+		switch (bench_rand(&state) % 4)
+		{
+		case 0:
+			insns[n].k ^= 1 << (bench_rand(&state) % 32);
+			break;
+		case 1:
+			if (BPF_CLASS(insns[n].code) != BPF_JMP)
+				continue;
+			insns[n].jt++;
+			structural = TRUE;
+			break;
+		case 2:
+			if (BPF_CLASS(insns[n].code) != BPF_JMP || insns[n].jf == 0)
+				continue;
+			insns[n].jf--;
+			structural = TRUE;
+			break;
+		default:
+			insns[n].code ^= BPF_JGT ^ BPF_JEQ;
+			structural = BPF_CLASS(insns[n].code) == BPF_JMP && BPF_OP(insns[n].code) != BPF_JA;
+			if (!structural)
+				continue;
+			break;
+		}
+
+		if (!bpf_validate(insns, (int)len))
+			continue;
+
+		shape = bpf_shape_recognize(insns, (int)len);
+		if (shape == NULL)
+		{
+			refused++;
+			continue;
+		}
+
+		recognized++;
+		if (structural)
+		{
+			printf("FAIL: %s with instruction %u changed recognized as \"%s\"\n", filter->name, n, bpf_shape_name(shape));
+			bench_dump_program(NULL, insns, len);
+			failures++;
+		}
+
+		mismatches = 0;
+		for (i = 0; i < corpus.count; i++)
+			mismatches += compare_packet(shape, insns, &corpus.packets[i]);
+
+		if (mismatches != 0)
+		{
+			printf("FAIL: %s with instruction %u changed: %u mismatches\n", filter->name, n, mismatches);
+			bench_dump_program(NULL, insns, len);
+			failures++;
+		}
+
+		bpf_free_shape(shape);
+	}
+
+	if (recognized == 0 || refused == 0)
+	{
+		printf("FAIL: %u mutants recognized, %u refused\n", recognized, refused);
+		failures++;
+	}
+
+	bench_corpus_free(&corpus);
+}
+
+/*
+ * The loads of the metadata are not packet loads
+ */
+static void test_ancillary(void)
+{
+	struct bpf_insn insns[] =
+	{
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, BPF_AD_OFF + BPF_AD_VLAN_TAG),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x800, 0, 1),
+		BPF_STMT(BPF_RET|BPF_K, 262144),
+		BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+	struct bpf_shape* shape;
+
+	shape = bpf_shape_recognize(insns, 4);
+	if (shape != NULL)
+	{
+		printf("FAIL: a program reading the metadata recognized as \"%s\"\n", bpf_shape_name(shape));
+		failures++;
+		bpf_free_shape(shape);
+	}
+
+	insns[0].k = 12;
+	shape = bpf_shape_recognize(insns, 4);
+	if (shape == NULL)
+	{
+		printf("FAIL: \"ip\" not recognized\n");
+		failures++;
+	}
+	else
+	{
+		bpf_free_shape(shape);
+	}
+}
+
+int main()
+{
+	test_reference_filters();
+	test_variants();
+	test_vlan();
+	test_mutants();
+	test_ancillary();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
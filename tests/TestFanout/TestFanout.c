@@ -0,0 +1,264 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks the fanout groups: that the hash of a flow is the same in both directions, for IPv4 and
+ * IPv6, behind VLAN tags and the null header of the loopback adapter, that all the fragments of a
+ * datagram have the same hash, and that the flows, the turns and the CPUs are spread evenly over
+ * the members of a group.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "win_fanout.h"
+#include "bench_random.h"
+
+#define SPREAD_MEMBERS		8
+#define SPREAD_FLOWS		80000
+
+static int failures = 0;
+
+/*
+ * Builds an Ethernet frame, with vlan tags, carrying a TCP segment over IPv4 or IPv6.
+ */
+static u_int build_packet(u_char* p, int ipv6, u_int vlan, const u_char* src, const u_char* dst, u_int sport, u_int dport)
+{
+	u_int off = 12, alen = ipv6 ? 16 : 4, i;
+
+	memset(p, 0, 128);
+	for (i = 0; i < 6; i++)
+	{
+		p[i] = (u_char)(0x10 + i);
+		p[6 + i] = (u_char)(0x20 + i);
+	}
+
+	for (i = 0; i < vlan; i++)
+	{
+		p[off] = 0x81;
+		p[off + 1] = 0x00;
+		p[off + 3] = (u_char)(i + 1);
+		off += 4;
+	}
+
+	p[off] = ipv6 ? 0x86 : 0x08;
+	p[off + 1] = ipv6 ? 0xdd : 0x00;
+	off += 2;
+
+	if (ipv6)
+	{
+		p[off] = 0x60;
+		p[off + 6] = 6;
+		memcpy(p + off + 8, src, alen);
+		memcpy(p + off + 24, dst, alen);
+		off += 40;
+	}
+	else
+	{
+		p[off] = 0x45;
+		p[off + 9] = 6;
+		memcpy(p + off + 12, src, alen);
+		memcpy(p + off + 16, dst, alen);
+		off += 20;
+	}
+
+	p[off] = (u_char)(sport >> 8);
+	p[off + 1] = (u_char)sport;
+	p[off + 2] = (u_char)(dport >> 8);
+	p[off + 3] = (u_char)dport;
+
+	return off + 20;
+}
+
+static void test_symmetry(void)
+{
+	u_char fwd[128], rev[128];
+	u_char a[16], b[16];
+	u_int len, i, ipv6, vlan;
+	u_int32 hash;
+
+	for (i = 0; i < 16; i++)
+	{
+		a[i] = (u_char)(i * 3 + 1);
+		b[i] = (u_char)(i * 5 + 2);
+	}
+
+	for (ipv6 = 0; ipv6 < 2; ipv6++)
+	{
+		for (vlan = 0; vlan < 3; vlan++)
+		{
+			len = build_packet(fwd, ipv6, vlan, a, b, 1234, 80);
+			build_packet(rev, ipv6, vlan, b, a, 80, 1234);
+
+			if (npf_fanout_hash(fwd, len, 14) != npf_fanout_hash(rev, len, 14))
+			{
+				printf("FAIL: %s with %u tags: the directions of a flow have different hashes\n", ipv6 ? "IPv6" : "IPv4", vlan);
+				failures++;
+			}
+
+			build_packet(rev, ipv6, vlan, a, b, 1235, 80);
+			if (npf_fanout_hash(fwd, len, 14) == npf_fanout_hash(rev, len, 14))
+			{
+				printf("FAIL: %s with %u tags: the port is not hashed\n", ipv6 ? "IPv6" : "IPv4", vlan);
+				failures++;
+			}
+		}
+	}
+
+	// The same IPv4 packets behind the null header of the loopback adapter
+	len = build_packet(fwd, 0, 0, a, b, 1234, 80);
+	hash = npf_fanout_hash(fwd, len, 14);
+	build_packet(rev, 0, 0, b, a, 80, 1234);
+	memset(fwd + 10, 0, 4);
+	memset(rev + 10, 0, 4);
+
+	if (npf_fanout_hash(fwd + 10, len - 10, 4) != hash || npf_fanout_hash(rev + 10, len - 10, 4) != hash)
+	{
+		printf("FAIL: the loopback packets do not have the hash of their flow\n");
+		failures++;
+	}
+
+	// Not IP: the MAC addresses
+	len = build_packet(fwd, 0, 0, a, b, 1234, 80);
+	fwd[12] = 0x08;
+	fwd[13] = 0x06;
+	memcpy(rev, fwd, len);
+	memcpy(rev, fwd + 6, 6);
+	memcpy(rev + 6, fwd, 6);
+
+	if (npf_fanout_hash(fwd, len, 14) != npf_fanout_hash(rev, len, 14))
+	{
+		printf("FAIL: the directions of a non IP flow have different hashes\n");
+		failures++;
+	}
+
+	// Truncated packets
+	if (npf_fanout_hash(fwd, 10, 14) != 0 || npf_fanout_hash(fwd, 0, 4) != 0)
+	{
+		printf("FAIL: a truncated packet has a hash\n");
+		failures++;
+	}
+}
+
+static void test_fragments(void)
+{
+	u_char first[128], next[128];
+	u_char a[16], b[16];
+	u_int len, i;
+
+	for (i = 0; i < 16; i++)
+	{
+		a[i] = (u_char)(i + 1);
+		b[i] = (u_char)(i + 100);
+	}
+
+	// IPv4: the first fragment has the ports, the next one has the payload where they would be
+	len = build_packet(first, 0, 0, a, b, 1234, 80);
+	build_packet(next, 0, 0, a, b, 4321, 8080);
+	first[14 + 6] = 0x20;
+	next[14 + 6] = 0x00;
+	next[14 + 7] = 0xb9;
+
+	if (npf_fanout_hash(first, len, 14) != npf_fanout_hash(next, len, 14))
+	{
+		printf("FAIL: the IPv4 fragments of a datagram have different hashes\n");
+		failures++;
+	}
+
+	// IPv6: a fragment header before the transport header
+	len = build_packet(first, 1, 0, a, b, 1234, 80);
+	build_packet(next, 1, 0, a, b, 4321, 8080);
+	first[14 + 6] = 44;
+	next[14 + 6] = 44;
+	first[14 + 40] = 6;
+	next[14 + 40] = 6;
+
+	if (npf_fanout_hash(first, len, 14) != npf_fanout_hash(next, len, 14))
+	{
+		printf("FAIL: the IPv6 fragments of a datagram have different hashes\n");
+		failures++;
+	}
+}
+
+static void test_spread(void)
+{
+	u_int counts[SPREAD_MEMBERS];
+	u_char p[128];
+	u_char a[4], b[4];
+	u_int len, i, member, min, max;
+	u_int32 state = 24, r;
+
+	// Random flows over the members of a hash group
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < SPREAD_FLOWS; i++)
+	{
+		r = bench_rand(&state);
+		memcpy(a, &r, 4);
+		r = bench_rand(&state);
+		memcpy(b, &r, 4);
+
+		len = build_packet(p, 0, 0, a, b, bench_rand(&state) & 0xffff, 443);
+		member = npf_fanout_member(NPF_FANOUT_HASH, SPREAD_MEMBERS, npf_fanout_hash(p, len, 14), 0, 0);
+		if (member >= SPREAD_MEMBERS)
+		{
+			printf("FAIL: member %u out of %u\n", member, SPREAD_MEMBERS);
+			failures++;
+			return;
+		}
+
+		counts[member]++;
+	}
+
+	min = max = counts[0];
+	for (i = 1; i < SPREAD_MEMBERS; i++)
+	{
+		if (counts[i] < min)
+			min = counts[i];
+		if (counts[i] > max)
+			max = counts[i];
+	}
+
+	// Each member expects 10000 flows, with a deviation of about 100
+	if (min < SPREAD_FLOWS / SPREAD_MEMBERS * 95 / 100 || max > SPREAD_FLOWS / SPREAD_MEMBERS * 105 / 100)
+	{
+		printf("FAIL: the flows are not spread evenly: %u to %u per member\n", min, max);
+		failures++;
+	}
+
+	// The turns and the CPUs
+	for (i = 0; i < 3 * SPREAD_MEMBERS; i++)
+	{
+		if (npf_fanout_member(NPF_FANOUT_LB, SPREAD_MEMBERS, 0, 0, i) != i % SPREAD_MEMBERS ||
+			npf_fanout_member(NPF_FANOUT_CPU, SPREAD_MEMBERS, 0, i, 0) != i % SPREAD_MEMBERS)
+		{
+			printf("FAIL: wrong member for turn or CPU %u\n", i);
+			failures++;
+			return;
+		}
+	}
+
+	if (npf_fanout_member(NPF_FANOUT_HASH, 3, 0xffffffff, 0, 0) != 2 || npf_fanout_member(NPF_FANOUT_HASH, 1, 0x12345678, 0, 0) != 0)
+	{
+		printf("FAIL: a hash out of the range of the members\n");
+		failures++;
+	}
+}
+
+int main()
+{
+	test_symmetry();
+	test_fragments();
+	test_spread();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,189 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks the merge of the kernel buffers: merging the buffers of simulated CPUs as NPF_Read() does,
+ * with only some of them holding packets, equal stamps on several CPUs and a limit on the stamps
+ * merged, gives the packets in the order of their stamps, the smallest CPU first among equal stamps
+ * and the order of its buffer within a CPU, and never looks at the CPUs without packets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "win_merge.h"
+#include "bench_random.h"
+
+#define MERGE_CPUS			64
+#define MERGE_PACKETS		1024
+#define MERGE_ROUNDS		300
+
+static int failures = 0;
+
+struct merge_packet
+{
+	ULONGLONG stamp;
+	u_int cpu;
+	u_int index;				///< Position in the buffer of its CPU
+};
+
+static struct merge_packet buffers[MERGE_CPUS][MERGE_PACKETS];
+static u_int lengths[MERGE_CPUS];
+static struct merge_packet expected[MERGE_CPUS * MERGE_PACKETS];
+
+static int compare_packets(const void* a, const void* b)
+{
+	const struct merge_packet* x = (const struct merge_packet*)a;
+	const struct merge_packet* y = (const struct merge_packet*)b;
+
+	if (x->stamp != y->stamp)
+		return x->stamp < y->stamp ? -1 : 1;
+	if (x->cpu != y->cpu)
+		return x->cpu < y->cpu ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/*
+ * Fills the buffers of some of the CPUs with growing stamps, coarse ones when ties are wanted
+ */
+static void fill_buffers(u_int32* state, u_int active, u_int granularity)
+{
+	u_int cpu, i;
+	ULONGLONG stamp;
+
+	memset(lengths, 0, sizeof(lengths));
+
+	while (active > 0)
+	{
+		cpu = bench_rand(state) % MERGE_CPUS;
+		if (lengths[cpu] != 0)
+			continue;
+
+		lengths[cpu] = 1 + bench_rand(state) % MERGE_PACKETS;
+		stamp = bench_rand(state) % 1000;
+		for (i = 0; i < lengths[cpu]; i++)
+		{
+			stamp += bench_rand(state) % 50;
+			buffers[cpu][i].stamp = stamp / granularity;
+			buffers[cpu][i].cpu = cpu;
+			buffers[cpu][i].index = i;
+		}
+		active--;
+	}
+}
+
+/*
+ * Merges the packets stamped up to limit as NPF_Read() does, and checks them against the sorted ones
+ */
+static void check_merge(ULONGLONG limit, const char* name)
+{
+	struct npf_merge_entry heap[MERGE_CPUS];
+	u_int first[MERGE_CPUS];
+	u_int count = 0, n = 0, merged = 0, cpu, i;
+	struct merge_packet* packet;
+
+	for (cpu = 0; cpu < MERGE_CPUS; cpu++)
+	{
+		first[cpu] = 0;
+		for (i = 0; i < lengths[cpu] && buffers[cpu][i].stamp <= limit; i++)
+			expected[n++] = buffers[cpu][i];
+
+		if (lengths[cpu] != 0 && buffers[cpu][0].stamp <= limit)
+			npf_merge_push(heap, &count, buffers[cpu][0].stamp, cpu);
+	}
+
+	qsort(expected, n, sizeof(expected[0]), compare_packets);
+
+	while (count > 0)
+	{
+		cpu = heap[0].cpu;
+		if (cpu >= MERGE_CPUS || first[cpu] >= lengths[cpu] || heap[0].stamp != buffers[cpu][first[cpu]].stamp)
+		{
+			printf("FAIL: %s: the heap gives CPU %u without packets\n", name, cpu);
+			failures++;
+			return;
+		}
+
+		packet = &buffers[cpu][first[cpu]++];
+		if (merged >= n || compare_packets(packet, &expected[merged]) != 0)
+		{
+			printf("FAIL: %s: packet %u of CPU %u merged at %u\n", name, packet->index, cpu, merged);
+			failures++;
+			return;
+		}
+		merged++;
+
+		if (first[cpu] < lengths[cpu] && buffers[cpu][first[cpu]].stamp <= limit)
+			npf_merge_update(heap, count, buffers[cpu][first[cpu]].stamp);
+		else
+			npf_merge_pop(heap, &count);
+	}
+
+	if (merged != n)
+	{
+		printf("FAIL: %s: %u packets merged out of %u\n", name, merged, n);
+		failures++;
+	}
+}
+
+static void test_merge(void)
+{
+	u_int32 state = 0x5eed1e55;
+	u_int round, active;
+
+	for (round = 0; round < MERGE_ROUNDS; round++)
+	{
+		// From a single CPU with traffic to all of them
+		active = 1 + (round % 8 == 7 ? MERGE_CPUS - 1 : bench_rand(&state) % 6);
+
+		fill_buffers(&state, active, 1);
+		check_merge((ULONGLONG)-1, "distinct stamps");
+		check_merge(bench_rand(&state) % 50000, "limited stamps");
+
+		fill_buffers(&state, active, 100);
+		check_merge((ULONGLONG)-1, "equal stamps");
+	}
+}
+
+static void test_empty(void)
+{
+	struct npf_merge_entry heap[2];
+	u_int count = 0;
+
+	npf_merge_push(heap, &count, 7, 3);
+	npf_merge_pop(heap, &count);
+	npf_merge_push(heap, &count, 5, 1);
+	npf_merge_push(heap, &count, 5, 0);
+
+	if (count != 2 || heap[0].cpu != 0 || heap[0].stamp != 5)
+	{
+		printf("FAIL: wrong top of the heap\n");
+		failures++;
+	}
+
+	npf_merge_update(heap, count, 6);
+	if (heap[0].cpu != 1)
+	{
+		printf("FAIL: the updated top does not go down\n");
+		failures++;
+	}
+}
+
+int main()
+{
+	test_empty();
+	test_merge();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
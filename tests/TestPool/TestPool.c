@@ -0,0 +1,400 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks the pool of blocks of the kernel buffer: the size of its blocks, that a single CPU can fill
+ * all of them and gets them back once they are read, that the blocks of an idle CPU return to the
+ * others, and, with a thread per simulated CPU storing records under its own lock as the tap does and
+ * a reader thread consuming them as NPF_Read() does, that every record either arrives whole and in
+ * order or is counted as dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "win_pool.h"
+#include "bench_random.h"
+
+#define TEST_BLOCK			4096
+#define TEST_BLOCKS			16
+
+#define STRESS_CPUS			4
+#define STRESS_BLOCK		8192
+#define STRESS_BLOCKS		32
+#define STRESS_RECORDS		200000
+
+static int failures = 0;
+
+/*
+ * A record: its header, then len bytes of data
+ */
+struct record
+{
+	u_int32 sn;
+	u_int32 len;
+};
+
+static u_char pattern(u_int cpu, u_int32 sn, u_int i)
+{
+	return (u_char)(cpu * 31 + sn * 7 + i);
+}
+
+static int store(struct npf_pool* pool, u_int cpu, u_int32 sn, u_int len)
+{
+	struct record* r = (struct record*)npf_pool_reserve(pool, cpu, sizeof(struct record) + len);
+	u_char* data;
+	u_int i;
+
+	if (r == NULL)
+		return FALSE;
+
+	r->sn = sn;
+	r->len = len;
+	data = (u_char*)(r + 1);
+	for (i = 0; i < len; i++)
+		data[i] = pattern(cpu, sn, i);
+
+	npf_pool_commit(pool, cpu, sizeof(struct record) + len);
+
+	return TRUE;
+}
+
+static struct npf_pool* create(u_int ncpu, u_int block_size, u_int nblocks, u_char** memory)
+{
+	struct npf_pool* pool = npf_pool_create(ncpu, block_size, nblocks);
+
+	// Two chunks, as the driver allocates a chunk of blocks on each node
+	*memory = (u_char*)malloc((size_t)block_size * nblocks);
+	npf_pool_add(pool, *memory, nblocks / 2);
+	npf_pool_add(pool, *memory + (size_t)block_size * (nblocks / 2), nblocks - nblocks / 2);
+
+	return pool;
+}
+
+static void test_block_size(void)
+{
+	if (npf_pool_block_size(0x1000000) != NPF_POOL_BLOCK_SIZE || npf_pool_block_size(NPF_POOL_BLOCK_SIZE * NPF_POOL_MIN_BLOCKS) != NPF_POOL_BLOCK_SIZE ||
+		npf_pool_block_size(0x20000) != 0x4000 || npf_pool_block_size(0x20004) != 0x4000 ||
+		npf_pool_block_size(NPF_POOL_MIN_BLOCK_SIZE * NPF_POOL_MIN_BLOCKS - 1) != 0 || npf_pool_block_size(0) != 0)
+	{
+		printf("FAIL: wrong size of the blocks\n");
+		failures++;
+	}
+}
+
+static void test_queue(void)
+{
+	u_char* memory;
+	struct npf_pool* pool = create(3, TEST_BLOCK, TEST_BLOCKS, &memory);
+	struct record* r;
+	u_int per_block = TEST_BLOCK / NPF_POOL_ALIGN(sizeof(struct record) + 100);
+	u_int32 sn, stored;
+
+	if (npf_pool_peek(pool, 0) != NULL || npf_pool_held(pool, 0) || npf_pool_pending(pool, 0) != 0)
+	{
+		printf("FAIL: a new pool holds records\n");
+		failures++;
+	}
+
+	if (npf_pool_reserve(pool, 0, TEST_BLOCK + 1) != NULL)
+	{
+		printf("FAIL: a record larger than a block is stored\n");
+		failures++;
+	}
+
+	// A single CPU takes all the blocks
+	for (stored = 0; store(pool, 1, stored, 100); stored++)
+		;
+
+	if (stored != per_block * TEST_BLOCKS || !npf_pool_held(pool, 1) ||
+		npf_pool_pending(pool, 1) != stored * NPF_POOL_ALIGN(sizeof(struct record) + 100))
+	{
+		printf("FAIL: %u records stored on one CPU instead of %u\n", stored, per_block * TEST_BLOCKS);
+		failures++;
+	}
+
+	if (store(pool, 2, 0, 0) || npf_pool_peek(pool, 2) != NULL)
+	{
+		printf("FAIL: a record is stored in a full pool\n");
+		failures++;
+	}
+
+	for (sn = 0; (r = (struct record*)npf_pool_peek(pool, 1)) != NULL; sn++)
+	{
+		if (r->sn != sn || r->len != 100 || ((u_char*)(r + 1))[99] != pattern(1, sn, 99))
+			break;
+		npf_pool_consume(pool, 1, sizeof(struct record) + r->len);
+	}
+
+	if (sn != stored || npf_pool_pending(pool, 1) != 0)
+	{
+		printf("FAIL: %u records read out of %u\n", sn, stored);
+		failures++;
+	}
+
+	// The last block stays with the CPU, the others are back: a few in its cache, the rest in the list
+	for (stored = 0; store(pool, 2, stored, 100); stored++)
+		;
+
+	if (stored != per_block * (TEST_BLOCKS - 1 - NPF_POOL_CACHE))
+	{
+		printf("FAIL: %u records stored on another CPU instead of %u\n", stored, per_block * (TEST_BLOCKS - 1 - NPF_POOL_CACHE));
+		failures++;
+	}
+
+	// The reader takes them back from the idle CPU
+	npf_pool_trim(pool, 1);
+	if (npf_pool_held(pool, 1) || npf_pool_peek(pool, 1) != NULL)
+	{
+		printf("FAIL: an idle CPU holds blocks after a trim\n");
+		failures++;
+	}
+
+	for (sn = 0; store(pool, 2, stored + sn, 100); sn++)
+		;
+
+	if (sn != per_block * (1 + NPF_POOL_CACHE))
+	{
+		printf("FAIL: %u records stored in the blocks of the idle CPU instead of %u\n", sn, per_block * (1 + NPF_POOL_CACHE));
+		failures++;
+	}
+
+	// The CPU keeps its queue as long as it has records to read
+	npf_pool_trim(pool, 2);
+	r = (struct record*)npf_pool_peek(pool, 2);
+	if (r == NULL || r->sn != 0)
+	{
+		printf("FAIL: a trim loses the records of a CPU\n");
+		failures++;
+	}
+
+	// Records of any size, written again after a trim
+	npf_pool_reset(pool);
+	if (npf_pool_held(pool, 2) || npf_pool_peek(pool, 2) != NULL || npf_pool_pending(pool, 2) != 0)
+	{
+		printf("FAIL: a reset pool holds records\n");
+		failures++;
+	}
+
+	for (sn = 0; sn < 1000; sn++)
+	{
+		if (!store(pool, 0, sn, (sn * 37) % (TEST_BLOCK - sizeof(struct record) + 1)))
+			break;
+
+		r = (struct record*)npf_pool_peek(pool, 0);
+		if (r == NULL || r->sn != sn)
+			break;
+		npf_pool_consume(pool, 0, sizeof(struct record) + r->len);
+
+		if (sn % 10 == 0)
+			npf_pool_trim(pool, 0);
+	}
+
+	if (sn != 1000)
+	{
+		printf("FAIL: record %u of any size is lost\n", sn);
+		failures++;
+	}
+
+	npf_pool_free(pool);
+	free(memory);
+}
+
+/*
+ * The simulated CPUs
+ */
+struct stress_cpu
+{
+	pthread_mutex_t lock;		///< The BufferLock of the CPU
+	pthread_t thread;
+	u_int cpu;
+	u_int32 state;
+	u_int dropped;
+	u_int received;
+	u_int32 next_sn;			///< Smallest sequence number of the next record read
+	int done;
+};
+
+static struct npf_pool* stress_pool;
+static struct stress_cpu stress_cpus[STRESS_CPUS];
+
+static void* stress_producer(void* arg)
+{
+	struct stress_cpu* c = (struct stress_cpu*)arg;
+	u_int32 sn;
+	u_int len;
+	int stored;
+
+	for (sn = 0; sn < STRESS_RECORDS; sn++)
+	{
+		len = bench_rand(&c->state) % 1600;
+		if (len % 97 == 0)
+			len = STRESS_BLOCK;
+
+		// CPU 0 gets most of the traffic, CPU 3 only a burst at the start
+		if (c->cpu == 3 && sn == STRESS_RECORDS / 20)
+			break;
+
+		pthread_mutex_lock(&c->lock);
+		stored = store(stress_pool, c->cpu, sn, len);
+		if (!stored)
+			c->dropped++;
+		pthread_mutex_unlock(&c->lock);
+
+		if (!stored)
+			sched_yield();
+		else if (c->cpu != 0 && sn % 4 == 0)
+			sched_yield();
+	}
+
+	__atomic_store_n(&c->done, TRUE, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static int stress_check(struct stress_cpu* c, struct record* r)
+{
+	u_char* data = (u_char*)(r + 1);
+	u_int i;
+
+	if (r->sn < c->next_sn || r->len > STRESS_BLOCK - sizeof(struct record))
+	{
+		printf("FAIL: wrong record %u of CPU %u, %u bytes\n", r->sn, c->cpu, r->len);
+		return FALSE;
+	}
+
+	for (i = 0; i < r->len; i++)
+	{
+		if (data[i] != pattern(c->cpu, r->sn, i))
+		{
+			printf("FAIL: wrong byte %u of record %u of CPU %u\n", i, r->sn, c->cpu);
+			return FALSE;
+		}
+	}
+
+	c->next_sn = r->sn + 1;
+	c->received++;
+
+	return TRUE;
+}
+
+static void test_stress(void)
+{
+	u_char* memory;
+	struct record* r;
+	u_int cpu, done, read, trims = 0, full = 0;
+	int ok = TRUE, finished = FALSE;
+
+	stress_pool = create(STRESS_CPUS, STRESS_BLOCK, STRESS_BLOCKS, &memory);
+
+	for (cpu = 0; cpu < STRESS_CPUS; cpu++)
+	{
+		memset(&stress_cpus[cpu], 0, sizeof(stress_cpus[cpu]));
+		pthread_mutex_init(&stress_cpus[cpu].lock, NULL);
+		stress_cpus[cpu].cpu = cpu;
+		stress_cpus[cpu].state = 0x7654321 + cpu;
+		pthread_create(&stress_cpus[cpu].thread, NULL, stress_producer, &stress_cpus[cpu]);
+	}
+
+	// The reader
+	while (ok)
+	{
+		for (done = 0, cpu = 0; cpu < STRESS_CPUS; cpu++)
+			done += __atomic_load_n(&stress_cpus[cpu].done, __ATOMIC_ACQUIRE);
+
+		for (read = 0, cpu = 0; cpu < STRESS_CPUS && ok; cpu++)
+		{
+			// More than the slice of the CPU if the pool were divided evenly
+			if (npf_pool_pending(stress_pool, cpu) > STRESS_BLOCK * STRESS_BLOCKS / STRESS_CPUS)
+				full++;
+
+			while (ok && (r = (struct record*)npf_pool_peek(stress_pool, cpu)) != NULL)
+			{
+				ok = stress_check(&stress_cpus[cpu], r);
+				npf_pool_consume(stress_pool, cpu, sizeof(struct record) + r->len);
+				read++;
+			}
+
+			if (ok && npf_pool_held(stress_pool, cpu))
+			{
+				pthread_mutex_lock(&stress_cpus[cpu].lock);
+				npf_pool_trim(stress_pool, cpu);
+				pthread_mutex_unlock(&stress_cpus[cpu].lock);
+				trims += !npf_pool_held(stress_pool, cpu);
+			}
+		}
+
+		// Nothing was left after the CPUs were done, in the previous round
+		if (finished && read == 0)
+			break;
+
+		finished = (done == STRESS_CPUS);
+		if (!finished)
+			sched_yield();
+	}
+
+	if (trims == 0)
+	{
+		printf("FAIL: no CPU was trimmed\n");
+		failures++;
+	}
+
+	if (full == 0)
+	{
+		printf("FAIL: no CPU took more than its slice of the pool\n");
+		failures++;
+	}
+
+	for (cpu = 0; cpu < STRESS_CPUS; cpu++)
+	{
+		pthread_join(stress_cpus[cpu].thread, NULL);
+		pthread_mutex_destroy(&stress_cpus[cpu].lock);
+
+		if (ok && stress_cpus[cpu].received + stress_cpus[cpu].dropped != (cpu == 3 ? STRESS_RECORDS / 20 : STRESS_RECORDS))
+		{
+			printf("FAIL: CPU %u: %u records received and %u dropped\n", cpu,
+				stress_cpus[cpu].received, stress_cpus[cpu].dropped);
+			failures++;
+		}
+
+		if (stress_cpus[cpu].received == 0)
+		{
+			printf("FAIL: CPU %u: no record received\n", cpu);
+			failures++;
+		}
+	}
+
+	if (npf_pool_held(stress_pool, 3))
+	{
+		printf("FAIL: the idle CPU holds blocks\n");
+		failures++;
+	}
+
+	if (!ok)
+		failures++;
+
+	npf_pool_free(stress_pool);
+	free(memory);
+}
+
+int main()
+{
+	test_block_size();
+	test_queue();
+	test_stress();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,564 @@
+/**
+ * Packet32 has no copyright assigned and is placed in the Public Domain.
+ * No warranty is given; refer to the files LICENSE-WTFPL, COPYING.Npcap and
+ * COPYING.WinPcap within this package.
+ */
+
+/*
+ * Checks the capture ring: the layout of its shared region, how the tap fills and closes the blocks
+ * and drops the packets when the application keeps them all, and, with a thread per simulated CPU
+ * storing packets under its own lock as the tap does and an application thread reading the blocks,
+ * releasing them out of order and asking for the open ones, that every packet either arrives whole
+ * and in order or is counted as dropped. Also checks that the application waits for the read
+ * timeout on an empty ring, even once the event of the driver has been set by an earlier block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "win_ring.h"
+#include "bench_random.h"
+
+#define STRESS_CPUS			4
+#define STRESS_BLOCK		8192
+#define STRESS_BLOCKS		8
+#define STRESS_PACKETS		200000
+#define STRESS_HELD			3
+#define WAIT_TIMEOUT_MS		50
+
+static int failures = 0;
+
+/*
+ * A ring with its shared region, that the driver allocates in pages
+ */
+static struct npf_ring* ring_create(u_int ncpu, u_int block_size, u_int nblocks)
+{
+	struct npf_ring* ring;
+	void* memory = malloc(npf_ring_memory_size(ncpu, block_size, nblocks));
+
+	if (memory == NULL)
+		return NULL;
+
+	ring = npf_ring_create(ncpu, block_size, nblocks, memory);
+	if (ring == NULL)
+		free(memory);
+
+	return ring;
+}
+
+static void ring_free(struct npf_ring* ring)
+{
+	void* memory = npf_ring_memory(ring);
+
+	npf_ring_free(ring);
+	free(memory);
+}
+
+static u_char pattern(u_int cpu, u_int32 sn, u_int i)
+{
+	return (u_char)(cpu * 31 + sn * 7 + i);
+}
+
+static void test_layout(void)
+{
+	struct npf_ring* ring;
+	struct npf_ring_header* header;
+	u_int size;
+
+	if (npf_ring_memory_size(0, 4096, 4) != 0 || npf_ring_memory_size(2, NPF_RING_MIN_BLOCK - 8, 4) != 0 ||
+		npf_ring_memory_size(2, 4100, 4) != 0 || npf_ring_memory_size(2, NPF_RING_MAX_BLOCK + 8, 4) != 0 ||
+		npf_ring_memory_size(2, 4096, 0) != 0 || npf_ring_memory_size(2, 4096, NPF_RING_MAX_BLOCKS + 1) != 0 ||
+		npf_ring_memory_size(4096, NPF_RING_MAX_BLOCK, NPF_RING_MAX_BLOCKS) != 0)
+	{
+		printf("FAIL: a ring with invalid parameters has a size\n");
+		failures++;
+	}
+
+	size = npf_ring_memory_size(3, 8192, 5);
+	ring = ring_create(3, 8192, 5);
+	if (ring == NULL || size % 4096 != 0)
+	{
+		printf("FAIL: cannot create a ring of %u bytes\n", size);
+		failures++;
+		return;
+	}
+
+	header = npf_ring_memory(ring);
+	if (header->magic != NPF_RING_MAGIC || header->ncpu != 3 || header->block_size != 8192 || header->nblocks != 5 ||
+		header->index_offset % 64 != 0 || header->index_offset < sizeof(struct npf_ring_header) ||
+		header->blocks_offset % 4096 != 0 || header->blocks_offset < header->index_offset + 3 * sizeof(struct npf_ring_index) ||
+		header->blocks_offset + 3 * 5 * 8192 > size || sizeof(struct npf_ring_index) != 128)
+	{
+		printf("FAIL: wrong layout of the shared region\n");
+		failures++;
+	}
+
+	if (npf_ring_next(header) != NULL)
+	{
+		printf("FAIL: a new ring has a closed block\n");
+		failures++;
+	}
+
+	ring_free(ring);
+}
+
+static void test_blocks(void)
+{
+	struct npf_ring* ring = ring_create(2, 4096, 2);
+	struct npf_ring_header* header = npf_ring_memory(ring);
+	struct npf_ring_block* block;
+	struct npf_ring_block* other;
+	struct npf_ring_packet* packet;
+	u_int first = NPF_RING_ALIGN(sizeof(struct npf_ring_block));
+	u_int length = NPF_RING_ALIGN(sizeof(struct npf_ring_packet) + 100);
+	u_int fit = (4096 - first) / length;
+	u_int i, caplen;
+
+	if (npf_ring_close(ring, 1))
+	{
+		printf("FAIL: an empty block is closed\n");
+		failures++;
+	}
+
+	// One packet more than fits in a block closes it
+	for (i = 0; i <= fit; i++)
+	{
+		caplen = 100;
+		packet = npf_ring_reserve(ring, 1, &caplen);
+		if (packet == NULL || caplen != 100)
+		{
+			printf("FAIL: cannot reserve packet %u\n", i);
+			failures++;
+			ring_free(ring);
+			return;
+		}
+		packet->stamp = i;
+		packet->header.bh_caplen = caplen;
+	}
+
+	block = npf_ring_next(header);
+	if (block == NULL || block->cpu != 1 || block->seq != 0 || block->packets != fit || block->first != first ||
+		block->length != first + fit * length || block->status != NPF_RING_BLOCK_USER || npf_ring_next(header) != NULL)
+	{
+		printf("FAIL: wrong first block\n");
+		failures++;
+		ring_free(ring);
+		return;
+	}
+
+	for (i = 0, packet = NPF_RING_FIRST_PACKET(block); packet != NULL; i++, packet = NPF_RING_NEXT_PACKET(packet))
+	{
+		if (packet->stamp != i || (u_char*)NPF_RING_PACKET_DATA(packet) + packet->header.bh_caplen > (u_char*)block + block->length)
+			break;
+	}
+
+	if (i != fit)
+	{
+		printf("FAIL: %u packets found in the first block instead of %u\n", i, fit);
+		failures++;
+	}
+
+	// The second block is full, the first one still belongs to the application
+	for (i = 0; i < fit; i++)
+	{
+		caplen = 100;
+		npf_ring_reserve(ring, 1, &caplen);
+	}
+
+	caplen = 100;
+	if (npf_ring_reserve(ring, 1, &caplen) != NULL)
+	{
+		printf("FAIL: a packet is stored in a block of the application\n");
+		failures++;
+	}
+
+	// The other CPU is not affected
+	caplen = 100000;
+	packet = npf_ring_reserve(ring, 0, &caplen);
+	if (packet == NULL || caplen != 4096 - first - sizeof(struct npf_ring_packet) || !npf_ring_close(ring, 0))
+	{
+		printf("FAIL: the largest packet is not stored, %u bytes\n", caplen);
+		failures++;
+	}
+
+	// The CPUs are taken in turn
+	other = npf_ring_next(header);
+	if (other == NULL || other->cpu != 0 || other->seq != 0 || other->packets != 1 ||
+		NPF_RING_NEXT_PACKET(NPF_RING_FIRST_PACKET(other)) != NULL)
+	{
+		printf("FAIL: the block of the other CPU is not the next one\n");
+		failures++;
+	}
+
+	other = npf_ring_next(header);
+	if (other == NULL || other->cpu != 1 || other->seq != 1)
+	{
+		printf("FAIL: the second block is not the next one\n");
+		failures++;
+	}
+
+	npf_ring_release(block);
+
+	caplen = 100;
+	packet = npf_ring_reserve(ring, 1, &caplen);
+	if (packet == NULL || !npf_ring_close(ring, 1) || npf_ring_next(header) != block || block->seq != 2 || block->packets != 1)
+	{
+		printf("FAIL: a released block is not filled again\n");
+		failures++;
+	}
+
+	ring_free(ring);
+}
+
+/*
+ * The simulated CPUs
+ */
+struct stress_cpu
+{
+	pthread_mutex_t lock;		///< The BufferLock of the CPU
+	pthread_t thread;
+	u_int cpu;
+	u_int32 state;
+	u_int dropped;
+	u_int received;
+	u_int32 next_sn;			///< Smallest stamp of the next packet read, its sequence number
+	u_int32 next_seq;			///< Sequence number of the next block read
+	int done;
+};
+
+static struct npf_ring* stress_ring;
+static struct stress_cpu stress_cpus[STRESS_CPUS];
+
+static void* stress_producer(void* arg)
+{
+	struct stress_cpu* c = (struct stress_cpu*)arg;
+	struct npf_ring_packet* packet;
+	u_int32 sn;
+	u_int i, len, caplen;
+	u_char* data;
+
+	for (sn = 0; sn < STRESS_PACKETS; sn++)
+	{
+		len = bench_rand(&c->state) % 1600;
+		if (len % 97 == 0)
+			len = STRESS_BLOCK;
+
+		pthread_mutex_lock(&c->lock);
+
+		caplen = len;
+		packet = npf_ring_reserve(stress_ring, c->cpu, &caplen);
+		if (packet != NULL)
+		{
+			packet->stamp = sn;
+			packet->header.bh_caplen = caplen;
+			packet->header.bh_datalen = len;
+			packet->header.bh_hdrlen = sizeof(struct bpf_hdr);
+			data = NPF_RING_PACKET_DATA(packet);
+			for (i = 0; i < caplen; i++)
+				data[i] = pattern(c->cpu, sn, i);
+		}
+		else
+		{
+			c->dropped++;
+		}
+
+		pthread_mutex_unlock(&c->lock);
+
+		if (packet == NULL)
+			sched_yield();
+	}
+
+	__atomic_store_n(&c->done, TRUE, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static int stress_check(struct npf_ring_block* block)
+{
+	struct stress_cpu* c;
+	struct npf_ring_packet* packet;
+	u_int n, i, max = STRESS_BLOCK - NPF_RING_ALIGN(sizeof(struct npf_ring_block)) - sizeof(struct npf_ring_packet);
+	u_char* data;
+
+	if (block->cpu >= STRESS_CPUS || block->status != NPF_RING_BLOCK_USER || block->length > STRESS_BLOCK)
+	{
+		printf("FAIL: wrong block header\n");
+		return FALSE;
+	}
+
+	c = &stress_cpus[block->cpu];
+	if (block->seq != c->next_seq++)
+	{
+		printf("FAIL: block %u of CPU %u instead of %u\n", block->seq, block->cpu, c->next_seq - 1);
+		return FALSE;
+	}
+
+	for (n = 0, packet = NPF_RING_FIRST_PACKET(block); packet != NULL; n++, packet = NPF_RING_NEXT_PACKET(packet))
+	{
+		data = NPF_RING_PACKET_DATA(packet);
+		if (data + packet->header.bh_caplen > (u_char*)block + block->length || packet->stamp < c->next_sn ||
+			packet->header.bh_caplen != (packet->header.bh_datalen < max ? packet->header.bh_datalen : max))
+		{
+			printf("FAIL: wrong packet %u of CPU %u, %u bytes\n", (u_int)packet->stamp, block->cpu, packet->header.bh_caplen);
+			return FALSE;
+		}
+
+		for (i = 0; i < packet->header.bh_caplen; i++)
+		{
+			if (data[i] != pattern(block->cpu, (u_int32)packet->stamp, i))
+			{
+				printf("FAIL: wrong byte %u of packet %u of CPU %u\n", i, (u_int)packet->stamp, block->cpu);
+				return FALSE;
+			}
+		}
+
+		c->next_sn = (u_int32)packet->stamp + 1;
+		c->received++;
+	}
+
+	if (n != block->packets)
+	{
+		printf("FAIL: %u packets in a block of %u\n", n, block->packets);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void test_stress(void)
+{
+	struct npf_ring_header* header;
+	struct npf_ring_block* held[STRESS_HELD];
+	struct npf_ring_block* block;
+	u_int nheld = 0, cpu, done, closed, flushes = 0;
+	int ok = TRUE, finished = FALSE;
+
+	stress_ring = ring_create(STRESS_CPUS, STRESS_BLOCK, STRESS_BLOCKS);
+	header = npf_ring_memory(stress_ring);
+
+	for (cpu = 0; cpu < STRESS_CPUS; cpu++)
+	{
+		memset(&stress_cpus[cpu], 0, sizeof(stress_cpus[cpu]));
+		pthread_mutex_init(&stress_cpus[cpu].lock, NULL);
+		stress_cpus[cpu].cpu = cpu;
+		stress_cpus[cpu].state = 0x1234567 + cpu;
+		pthread_create(&stress_cpus[cpu].thread, NULL, stress_producer, &stress_cpus[cpu]);
+	}
+
+	// The application
+	while (ok)
+	{
+		block = npf_ring_next(header);
+		if (block != NULL)
+		{
+			ok = stress_check(block);
+
+			// Keeps a few blocks, and gives them back in the reverse order
+			held[nheld++] = block;
+			if (nheld == STRESS_HELD)
+			{
+				while (nheld > 0)
+					npf_ring_release(held[--nheld]);
+			}
+			continue;
+		}
+
+		while (nheld > 0)
+			npf_ring_release(held[--nheld]);
+
+		for (done = 0, cpu = 0; cpu < STRESS_CPUS; cpu++)
+			done += __atomic_load_n(&stress_cpus[cpu].done, __ATOMIC_ACQUIRE);
+
+		// BIOCFLUSHRING
+		for (closed = 0, cpu = 0; cpu < STRESS_CPUS; cpu++)
+		{
+			pthread_mutex_lock(&stress_cpus[cpu].lock);
+			closed += npf_ring_close(stress_ring, cpu);
+			pthread_mutex_unlock(&stress_cpus[cpu].lock);
+		}
+		flushes += closed;
+
+		// Nothing was left after the CPUs were done, in the previous round
+		if (finished && closed == 0)
+			break;
+
+		finished = (done == STRESS_CPUS);
+		if (!finished)
+			sched_yield();
+	}
+
+	if (flushes == 0)
+	{
+		printf("FAIL: no open block was flushed\n");
+		failures++;
+	}
+
+	for (cpu = 0; cpu < STRESS_CPUS; cpu++)
+	{
+		pthread_join(stress_cpus[cpu].thread, NULL);
+		pthread_mutex_destroy(&stress_cpus[cpu].lock);
+
+		if (ok && stress_cpus[cpu].received + stress_cpus[cpu].dropped != STRESS_PACKETS)
+		{
+			printf("FAIL: CPU %u: %u packets received and %u dropped out of %u\n", cpu,
+				stress_cpus[cpu].received, stress_cpus[cpu].dropped, STRESS_PACKETS);
+			failures++;
+		}
+
+		if (stress_cpus[cpu].received == 0)
+		{
+			printf("FAIL: CPU %u: no packet received\n", cpu);
+			failures++;
+		}
+	}
+
+	if (!ok)
+		failures++;
+
+	ring_free(stress_ring);
+}
+
+/*
+ * The read event of the adapter, a manual-reset one, and the flush of the driver, for npf_ring_wait()
+ */
+struct wait_context
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int set;
+	u_int waits;
+	u_int flushes;
+	struct npf_ring* ring;
+};
+
+static void wait_reset(void* context)
+{
+	struct wait_context* w = (struct wait_context*)context;
+
+	pthread_mutex_lock(&w->mutex);
+	w->set = 0;
+	pthread_mutex_unlock(&w->mutex);
+}
+
+static void wait_event(void* context)
+{
+	struct wait_context* w = (struct wait_context*)context;
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += WAIT_TIMEOUT_MS * 1000000L;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+	deadline.tv_nsec %= 1000000000L;
+
+	pthread_mutex_lock(&w->mutex);
+	w->waits++;
+	while (!w->set && pthread_cond_timedwait(&w->cond, &w->mutex, &deadline) == 0);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+static int wait_flush(void* context)
+{
+	struct wait_context* w = (struct wait_context*)context;
+	u_int cpu;
+
+	w->flushes++;
+	for (cpu = 0; cpu < 2; cpu++)
+		npf_ring_close(w->ring, cpu);
+
+	return 1;
+}
+
+static double elapsed_ms(const struct timespec* start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static void test_wait(void)
+{
+	struct wait_context w;
+	struct npf_ring_header* header;
+	struct npf_ring_block* block;
+	struct npf_ring_packet* packet;
+	struct timespec start;
+	u_int caplen, i;
+	double ms;
+
+	memset(&w, 0, sizeof(w));
+	pthread_mutex_init(&w.mutex, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	w.ring = ring_create(2, 4096, 2);
+	header = npf_ring_memory(w.ring);
+
+	// A block closed by the driver, that sets the event
+	caplen = 100;
+	packet = npf_ring_reserve(w.ring, 0, &caplen);
+	packet->header.bh_caplen = caplen;
+	npf_ring_close(w.ring, 0);
+	w.set = 1;
+
+	block = npf_ring_wait(header, &w, wait_reset, wait_event, wait_flush);
+	if (block == NULL || w.waits != 0)
+	{
+		printf("FAIL: a closed block is not taken at once\n");
+		failures++;
+		ring_free(w.ring);
+		return;
+	}
+	npf_ring_release(block);
+
+	// The event is still set, but the ring is empty: each call waits for the whole timeout
+	for (i = 0; i < 2; i++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		block = npf_ring_wait(header, &w, wait_reset, wait_event, wait_flush);
+		ms = elapsed_ms(&start);
+
+		if (block != NULL || w.waits != i + 1 || w.flushes != i + 1 || ms < WAIT_TIMEOUT_MS * 0.9)
+		{
+			printf("FAIL: an empty ring returned after %.1f ms, %u waits, %u flushes\n", ms, w.waits, w.flushes);
+			failures++;
+			ring_free(w.ring);
+			return;
+		}
+	}
+
+	// A packet waiting in an open block is flushed once the timeout expires
+	caplen = 100;
+	packet = npf_ring_reserve(w.ring, 1, &caplen);
+	packet->header.bh_caplen = caplen;
+
+	block = npf_ring_wait(header, &w, wait_reset, wait_event, wait_flush);
+	if (block == NULL || block->cpu != 1 || block->packets != 1 || w.flushes != 3)
+	{
+		printf("FAIL: the open block is not flushed after the timeout\n");
+		failures++;
+	}
+
+	ring_free(w.ring);
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.mutex);
+}
+
+int main()
+{
+	test_layout();
+	test_blocks();
+	test_stress();
+	test_wait();
+
+	if (failures != 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}